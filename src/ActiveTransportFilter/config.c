@@ -39,6 +39,38 @@
 //
 static BOOLEAN AtfIniConfigSanityCheck(const USER_DRIVER_FILTER_TRANSPORT_DATA *data);
 
+//
+// Allocate the context of the selected IPv4 lookup engine
+//
+static ATF_ERROR AtfConfigAllocIpv4Engine(CONFIG_CTX *ctx);
+
+//
+// Copy the IPv4 (or IPv6) lookup engine of the config if it is shared with another config, before it is modified
+//
+static ATF_ERROR AtfConfigOwnIpv4Engine(CONFIG_CTX *ctx);
+static ATF_ERROR AtfConfigOwnIpv6Engine(CONFIG_CTX *ctx);
+
+//
+// Drop the reference of the config to its lookup engines, the last config sharing an engine frees it
+//
+static VOID AtfConfigReleaseEngines(CONFIG_CTX *ctx);
+
+//
+// Insert an IPv4 pool into the selected lookup engine
+//  Fails with ATF_MEMORY_BUDGET_EXCEEDED if the engine grows past the memory budget, the caller discards the config
+//
+static ATF_ERROR AtfConfigInsertIpv4Pool(CONFIG_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Insert an IPv6 pool, the IPv4-mapped prefixes go to the IPv4 lookup engine and the rest to the IPv6 engine
+//
+static ATF_ERROR AtfConfigInsertIpv6Pool(CONFIG_CTX *ctx, const IPV6_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Returns ATF_MEMORY_BUDGET_EXCEEDED if the engine and image are over the memory budget
+//
+static ATF_ERROR AtfConfigCheckIpv4Budget(const CONFIG_CTX *ctx);
+
 //
 // Create the default config
 //
@@ -67,60 +99,115 @@ ATF_ERROR AtfAllocDefaultConfig(const USER_DRIVER_FILTER_TRANSPORT_DATA *data, C
     ADD_WFP_LAYER(data->enableLayerIpv6TcpInbound, &FWPM_LAYER_INBOUND_TRANSPORT_V6);
     ADD_WFP_LAYER(data->enableLayerIpv6TcpOutbound, &FWPM_LAYER_OUTBOUND_TRANSPORT_V6);
     ADD_WFP_LAYER(data->enableLayerIcmpv4, &FWPM_CONDITION_ORIGINAL_ICMP_TYPE);
+    ADD_WFP_LAYER(data->enableLayerIpv4Dns, &FWPM_LAYER_DATAGRAM_DATA_V4);
+    ADD_WFP_LAYER(data->enableLayerIpv6Dns, &FWPM_LAYER_DATAGRAM_DATA_V6);
+    ADD_WFP_LAYER(data->enableLayerIpv4Tls, &FWPM_LAYER_STREAM_V4);
+    ADD_WFP_LAYER(data->enableLayerIpv6Tls, &FWPM_LAYER_STREAM_V6);
+
+    out->isDnsSnoopingEnabled                   = data->enableLayerIpv4Dns || data->enableLayerIpv6Dns;
+    out->isQuicEnabled                          = data->enableLayerIpv4Tls || data->enableLayerIpv6Tls;
 
     out->numOfIpv4Addresses                     = data->numOfIpv4Addresses;
     out->numOfIpv6Addresses                     = data->numOfIpv6Addresses;
 
     // Set actions
-    out->ipv4BlocklistAction                    = data->ipv4BlocklistAction;
-    out->ipv6BlocklistAction                    = data->ipv6BlocklistAction;
     out->dnsBlocklistAction                     = data->dnsBlocklistAction;
-
-    // Directions
-    out->alertInbound                           = data->alertInbound;
-    out->alertOutbound                          = data->alertOutbound;
+    out->dnsBlockResponse                       = data->dnsBlockResponse;
+    out->payloadSignatureAction                 = data->payloadSignatureAction;
+
+    // Lookup engine
+    out->ipv4LookupEngine                       = data->ipv4LookupEngine;
+    out->ipv4MemoryBudget                       = (size_t)data->ipv4MemoryBudget;
+    out->ipv4PredictedSize                      = (size_t)data->ipv4PredictedSize;
+
+    // Verdict policy, verified by AtfIniConfigSanityCheck
+    out->numOfPolicyInsns                       = data->numOfPolicyInsns;
+    for (UINT32 layer = 0; layer < POLICY_NUM_OF_LAYERS; layer++) {
+        out->policyEntry[layer] = AtfPolicySpecialize(data->policy, data->numOfPolicyInsns, layer, out->policy[layer]);
+    }
 
     //
-    // Allocate a new trie pool even if we don't have any blacklisted IPs
+    // Allocate the lookup engine even if we don't have any blacklisted IPs
     //
-    atfError = AtfIpv4TrieAllocCtx(&out->ipv4TrieCtx);
+    atfError = AtfConfigAllocIpv4Engine(out);
     if (atfError) {
+        AtfFreeConfig(out);
         return atfError;
     }
 
     if (out->numOfIpv4Addresses) {
-        const size_t sizeOfIpv4Pool = out->numOfIpv4Addresses * sizeof(struct in_addr);
-        out->ipv4AddressPool = (struct in_addr *)ATF_MALLOC(sizeOfIpv4Pool);
-        if (!out) {
-            ATF_FREE(out);
-            return ATF_NO_MEMORY_AVAILABLE;
-        }
-
-        RtlCopyMemory(out->ipv4AddressPool, data->ipv4BlackList, sizeOfIpv4Pool);
-
-        atfError = AtfIpv4TrieInsertPool(
-            out->ipv4TrieCtx, 
-            (const struct in_addr *)out->ipv4AddressPool, 
+        atfError = AtfConfigInsertIpv4Pool(
+            out, 
+            data->ipv4BlackList, 
             out->numOfIpv4Addresses
         );
         if (atfError) {
+            AtfFreeConfig(out);
             return atfError;
         }
     }
 
+    out->ipv6EngineRefCount = (size_t *)ATF_MALLOC(sizeof(size_t));
+    if (!out->ipv6EngineRefCount) {
+        AtfFreeConfig(out);
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+    *out->ipv6EngineRefCount = 1;
+
+    atfError = AtfIpv6BslAllocCtx(&out->ipv6EngineCtx);
+    if (atfError) {
+        AtfFreeConfig(out);
+        return atfError;
+    }
+
     if (out->numOfIpv6Addresses) {
-        const size_t sizeOfIpv6Pool = out->numOfIpv6Addresses * sizeof(IPV6_RAW_ADDRESS);
-        out->ipv4AddressPool = (struct in_addr *)ATF_MALLOC(sizeOfIpv6Pool);
-        if (!out) {
-            if (out->ipv4AddressPool) {
-                ATF_FREE(out->ipv4AddressPool);
-            }
-            ATF_FREE(out);
-            return ATF_NO_MEMORY_AVAILABLE;
+        atfError = AtfConfigInsertIpv6Pool(
+            out,
+            data->ipv6Blacklist,
+            out->numOfIpv6Addresses
+        );
+        if (atfError) {
+            AtfFreeConfig(out);
+            return atfError;
         }
+    }
 
-        RtlCopyMemory(out->ipv6AddressPool, data->ipv6Blacklist, sizeOfIpv6Pool);
+    AtfConfigPrintIpv4Engine(out);
+    AtfIpv6BslPrintCtx(out->ipv6EngineCtx);
+
+    *cfgCtx = out;
+
+    return ATF_ERROR_OK;
+}
+
+//
+// Copy a config, the lookup engines are shared until they are modified (no entries are reinserted)
+//
+ATF_ERROR AtfConfigClone(const CONFIG_CTX *src, CONFIG_CTX **cfgCtx)
+{
+    if (!src || !cfgCtx) {
+        return ATF_BAD_PARAMETERS;
     }
+    *cfgCtx = NULL;
+
+    CONFIG_CTX *out = ATF_MALLOC(sizeof(CONFIG_CTX));
+    if (!out) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    // Layers, actions, directions and the engine type
+    RtlCopyMemory(out, src, sizeof(CONFIG_CTX));
+
+    out->ipv4ImageCtx                           = AtfIpv4ImageReference(src->ipv4ImageCtx);
+    out->ipv4RulesCtx                           = AtfIpv4TssReference(src->ipv4RulesCtx);
+    out->domainCtx                              = AtfDomainDafsaReference(src->domainCtx);
+    out->dnsCacheCtx                            = AtfDnsCacheReference(src->dnsCacheCtx);
+    out->quicFlowCtx                            = AtfQuicFlowReference(src->quicFlowCtx);
+    out->payloadSigCtx                          = AtfPayloadSigReference(src->payloadSigCtx);
+
+    // The lookup engines are copied by AtfConfigOwnIpv4Engine()/AtfConfigOwnIpv6Engine(), if the clone modifies them
+    (*out->ipv4EngineRefCount)++;
+    (*out->ipv6EngineRefCount)++;
 
     *cfgCtx = out;
 
@@ -134,52 +221,247 @@ ATF_ERROR AtfConfigAddIpv4Blacklist(CONFIG_CTX *ctx, const VOID *blacklist, size
 {
     ATF_ERROR atfError = ATF_ERROR_OK;
 
-    const size_t numOfIps = bufLen / sizeof(struct in_addr);
+    const size_t numOfEntries = bufLen / sizeof(IPV4_PREFIX_ENTRY);
+
+    if (!ctx || !blacklist || !bufLen || bufLen % sizeof(IPV4_PREFIX_ENTRY)) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    // Append IP pool to the lookup engine, the lookup engine is allocated with the default config
+    atfError = AtfConfigInsertIpv4Pool(ctx, (const IPV4_PREFIX_ENTRY *)blacklist, numOfEntries);
+    if (atfError) {
+        return atfError;
+    }
+
+    ctx->numOfIpv4Addresses += numOfEntries;
+
+    AtfConfigPrintIpv4Engine(ctx);
+
+    return atfError;
+}
+
+//
+// Append a new IPv6 blocklist array to the config
+//
+ATF_ERROR AtfConfigAddIpv6Blacklist(CONFIG_CTX *ctx, const VOID *blacklist, size_t bufLen)
+{
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    const size_t numOfEntries = bufLen / sizeof(IPV6_PREFIX_ENTRY);
 
-    if (!ctx || !blacklist || !bufLen || bufLen % sizeof(struct in_addr)) {
+    if (!ctx || !blacklist || !bufLen || bufLen % sizeof(IPV6_PREFIX_ENTRY)) {
         return ATF_BAD_PARAMETERS;
     }
 
-    if (bufLen > BLACKLIST_IPV4_MAX_SIZE) {
-        return ATF_IOCTL_BUFFER_TOO_LARGE;
+    atfError = AtfConfigInsertIpv6Pool(ctx, (const IPV6_PREFIX_ENTRY *)blacklist, numOfEntries);
+    if (atfError) {
+        return atfError;
     }
 
-    //TODO: cleanup the pool
-    if (ctx->ipv4AddressPool) {
-        //Append
-        struct in_addr *newPool = ATF_MALLOC(bufLen + (ctx->numOfIpv4Addresses * sizeof(struct in_addr)));
-        if (!newPool) {
-            return ATF_NO_MEMORY_AVAILABLE;
+    ctx->numOfIpv6Addresses += numOfEntries;
+
+    AtfIpv6BslPrintCtx(ctx->ipv6EngineCtx);
+
+    return atfError;
+}
+
+ATF_ERROR AtfConfigApplyIpv4Delta(CONFIG_CTX *ctx, const VOID *delta, size_t deltaSize)
+{
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    if (!ctx || !delta || deltaSize < sizeof(IPV4_DELTA_HEADER)) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    const IPV4_DELTA_HEADER *header = (const IPV4_DELTA_HEADER *)delta;
+    const size_t numOfRemovals = header->numOfRemovals;
+    const size_t numOfAdditions = header->numOfAdditions;
+
+    if (header->magic != IPV4_DELTA_MAGIC ||
+        deltaSize != sizeof(IPV4_DELTA_HEADER) + (numOfRemovals + numOfAdditions) * sizeof(IPV4_PREFIX_ENTRY)) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    const IPV4_PREFIX_ENTRY *removals = (const IPV4_PREFIX_ENTRY *)(header + 1);
+    const IPV4_PREFIX_ENTRY *additions = removals + numOfRemovals;
+
+    atfError = AtfConfigOwnIpv4Engine(ctx);
+    if (atfError) {
+        return atfError;
+    }
+
+    // Removals first, the additions restore the overlapping prefixes that a removal cleared
+    if (numOfRemovals) {
+        atfError = ctx->ipv4Engine->RemovePool(ctx->ipv4EngineCtx, removals, numOfRemovals);
+        if (atfError) {
+            return atfError;
+        }
+    }
+
+    if (numOfAdditions) {
+        atfError = AtfConfigInsertIpv4Pool(ctx, additions, numOfAdditions);
+        if (atfError) {
+            return atfError;
         }
+    }
+
+    ctx->numOfIpv4Addresses += numOfAdditions;
+    ctx->numOfIpv4Addresses -= numOfRemovals < ctx->numOfIpv4Addresses ? numOfRemovals : ctx->numOfIpv4Addresses;
+
+    ATF_DEBUGA("[atftrace] IPv4 delta applied (removals: %llu, additions: %llu)",
+        (UINT64)numOfRemovals, (UINT64)numOfAdditions);
+
+    AtfConfigPrintIpv4Engine(ctx);
+
+    return atfError;
+}
+
+ATF_ERROR AtfConfigSetIpv4Image(CONFIG_CTX *ctx, const VOID *image, size_t imageSize)
+{
+    if (!ctx || !image || !imageSize) {
+        return ATF_BAD_PARAMETERS;
+    }
 
-        RtlCopyMemory(newPool, ctx->ipv4AddressPool, (ctx->numOfIpv4Addresses * sizeof(struct in_addr)));
-        RtlCopyMemory(&newPool[ctx->numOfIpv4Addresses], blacklist, bufLen);
+    if (ctx->ipv4LookupEngine != IPV4_ENGINE_TRIE) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    IPV4_IMAGE_CTX *imageCtx = NULL;
+    ATF_ERROR atfError = AtfIpv4ImageAdopt(image, imageSize, &imageCtx);
+    if (atfError) {
+        return atfError;
+    }
+
+    IPV4_IMAGE_CTX *oldImageCtx = ctx->ipv4ImageCtx;
+    ctx->ipv4ImageCtx = imageCtx;
+
+    atfError = AtfConfigCheckIpv4Budget(ctx);
+    if (atfError) {
+        ctx->ipv4ImageCtx = oldImageCtx;
+        AtfIpv4ImageFree(&imageCtx);
+        return atfError;
+    }
+
+    AtfIpv4ImageFree(&oldImageCtx);
+
+    AtfIpv4ImagePrintCtx(imageCtx);
+    AtfConfigPrintIpv4Engine(ctx);
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfConfigSetIpv4Rules(CONFIG_CTX *ctx, const VOID *rules, size_t bufLen)
+{
+    if (!ctx || !rules || !bufLen || bufLen % sizeof(IPV4_RULE_ENTRY)) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    IPV4_TSS_CTX *rulesCtx = NULL;
+    ATF_ERROR atfError = AtfIpv4TssBuild((const IPV4_RULE_ENTRY *)rules, bufLen / sizeof(IPV4_RULE_ENTRY), &rulesCtx);
+    if (atfError) {
+        return atfError;
+    }
+
+    AtfIpv4TssFree(&ctx->ipv4RulesCtx);
+    ctx->ipv4RulesCtx = rulesCtx;
+
+    AtfIpv4TssPrintCtx(rulesCtx);
+
+    return ATF_ERROR_OK;
+}
 
-        ATF_FREE(ctx->ipv4AddressPool);
-        ctx->ipv4AddressPool = newPool;
-        ctx->numOfIpv4Addresses += numOfIps;
-    } else {
-        //Assign
-        atfError = AtfIpv4TrieAllocCtx(&ctx->ipv4TrieCtx);
+ATF_ERROR AtfConfigSetDomainBlocklist(CONFIG_CTX *ctx, const VOID *image, size_t imageSize)
+{
+    if (!ctx || !image || !imageSize) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    DOMAIN_DAFSA_CTX *domainCtx = NULL;
+    ATF_ERROR atfError = AtfDomainDafsaAdopt(image, imageSize, &domainCtx);
+    if (atfError) {
+        return atfError;
+    }
+
+    DNS_CACHE_CTX *dnsCacheCtx = NULL;
+    if (ctx->isDnsSnoopingEnabled) {
+        atfError = AtfDnsCacheAllocCtx(&dnsCacheCtx);
         if (atfError) {
+            AtfDomainDafsaFree(&domainCtx);
             return atfError;
         }
+    }
 
-        ctx->ipv4AddressPool = (struct in_addr *)ATF_MALLOC(bufLen);
-        if (!ctx->ipv4AddressPool) {
-            return ATF_NO_MEMORY_AVAILABLE;
+    QUIC_FLOW_CTX *quicFlowCtx = NULL;
+    if (ctx->isQuicEnabled) {
+        atfError = AtfQuicFlowAllocCtx(&quicFlowCtx);
+        if (atfError) {
+            AtfDnsCacheFree(&dnsCacheCtx);
+            AtfDomainDafsaFree(&domainCtx);
+            return atfError;
         }
+    }
+
+    AtfDomainDafsaFree(&ctx->domainCtx);
+    ctx->domainCtx = domainCtx;
 
-        RtlCopyMemory(ctx->ipv4AddressPool, blacklist, bufLen);
+    AtfDnsCacheFree(&ctx->dnsCacheCtx);
+    ctx->dnsCacheCtx = dnsCacheCtx;
+
+    AtfQuicFlowFree(&ctx->quicFlowCtx);
+    ctx->quicFlowCtx = quicFlowCtx;
+
+    AtfDomainDafsaPrintCtx(domainCtx);
+    AtfDnsCachePrintCtx(dnsCacheCtx);
+    AtfQuicFlowPrintCtx(quicFlowCtx);
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfConfigSetPayloadSignatures(CONFIG_CTX *ctx, const VOID *image, size_t imageSize)
+{
+    if (!ctx || !image || !imageSize) {
+        return ATF_BAD_PARAMETERS;
     }
 
-    // Append IP pool to trie
-    atfError = AtfIpv4TrieInsertPool(ctx->ipv4TrieCtx, (const struct in_addr *)blacklist, numOfIps);
+    PAYLOAD_SIG_CTX *payloadSigCtx = NULL;
+    ATF_ERROR atfError = AtfPayloadSigAdopt(image, imageSize, &payloadSigCtx);
     if (atfError) {
         return atfError;
     }
 
-    return atfError;
+    AtfPayloadSigFree(&ctx->payloadSigCtx);
+    ctx->payloadSigCtx = payloadSigCtx;
+
+    AtfPayloadSigPrintCtx(payloadSigCtx);
+
+    return ATF_ERROR_OK;
+}
+
+size_t AtfConfigGetIpv4Size(const CONFIG_CTX *ctx)
+{
+    if (!ctx || !ctx->ipv4Engine) {
+        return 0;
+    }
+
+    size_t size = ctx->ipv4Engine->GetSize(ctx->ipv4EngineCtx);
+    if (ctx->ipv4ImageCtx) {
+        size += ctx->ipv4ImageCtx->totalSize;
+    }
+
+    return size;
+}
+
+VOID AtfConfigPrintIpv4Engine(const CONFIG_CTX *ctx)
+{
+    if (!ctx || !ctx->ipv4Engine) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] IPv4 Engine: %s, Predicted size: %llu, Actual size: %llu, Memory budget: %llu",
+        ctx->ipv4Engine->name, (UINT64)ctx->ipv4PredictedSize, (UINT64)AtfConfigGetIpv4Size(ctx),
+        (UINT64)ctx->ipv4MemoryBudget);
+
+    ctx->ipv4Engine->PrintCtx(ctx->ipv4EngineCtx);
 }
 
 VOID AtfFreeConfig(CONFIG_CTX *ctx)
@@ -188,19 +470,211 @@ VOID AtfFreeConfig(CONFIG_CTX *ctx)
         return;
     }
 
-    // Free the trie
-    AtfIpv4TrieFree(&ctx->ipv4TrieCtx);
-    
-    // Free IP pools
-    if (ctx->ipv4AddressPool) {
-        ATF_FREE(ctx->ipv4AddressPool);
+    // Free the lookup engines, unless another config still shares them
+    AtfConfigReleaseEngines(ctx);
+
+    AtfIpv4ImageFree(&ctx->ipv4ImageCtx);
+
+    AtfIpv4TssFree(&ctx->ipv4RulesCtx);
+
+    AtfDomainDafsaFree(&ctx->domainCtx);
+
+    AtfDnsCacheFree(&ctx->dnsCacheCtx);
+
+    AtfQuicFlowFree(&ctx->quicFlowCtx);
+
+    AtfPayloadSigFree(&ctx->payloadSigCtx);
+
+    ATF_FREE(ctx);
+}
+
+static ATF_ERROR AtfConfigAllocIpv4Engine(CONFIG_CTX *ctx)
+{
+    const IPV4_ENGINE_OPS *engine = AtfIpv4EngineGetOps(ctx->ipv4LookupEngine);
+    if (!engine) {
+        return ATF_CORRUPT_CONFIG;
+    }
+
+    ctx->ipv4EngineRefCount = (size_t *)ATF_MALLOC(sizeof(size_t));
+    if (!ctx->ipv4EngineRefCount) {
+        return ATF_NO_MEMORY_AVAILABLE;
     }
+    *ctx->ipv4EngineRefCount = 1;
 
-    if (ctx->ipv4AddressPool) {
-        ATF_FREE(ctx->ipv6AddressPool);
+    ctx->ipv4Engine = engine;
+
+    return ctx->ipv4Engine->AllocCtx(&ctx->ipv4EngineCtx);
+}
+
+static ATF_ERROR AtfConfigOwnIpv4Engine(CONFIG_CTX *ctx)
+{
+    if (*ctx->ipv4EngineRefCount == 1) {
+        return ATF_ERROR_OK;
     }
 
-    ATF_FREE(ctx);
+    size_t *refCount = (size_t *)ATF_MALLOC(sizeof(size_t));
+    if (!refCount) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    VOID *engineCtx = NULL;
+    ATF_ERROR atfError = ctx->ipv4Engine->Clone(ctx->ipv4EngineCtx, &engineCtx);
+    if (atfError) {
+        ATF_FREE(refCount);
+        return atfError;
+    }
+
+    (*ctx->ipv4EngineRefCount)--;
+
+    *refCount = 1;
+    ctx->ipv4EngineRefCount = refCount;
+    ctx->ipv4EngineCtx = engineCtx;
+
+    return ATF_ERROR_OK;
+}
+
+static ATF_ERROR AtfConfigOwnIpv6Engine(CONFIG_CTX *ctx)
+{
+    if (*ctx->ipv6EngineRefCount == 1) {
+        return ATF_ERROR_OK;
+    }
+
+    size_t *refCount = (size_t *)ATF_MALLOC(sizeof(size_t));
+    if (!refCount) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    IPV6_BSL_CTX *engineCtx = NULL;
+    ATF_ERROR atfError = AtfIpv6BslClone(ctx->ipv6EngineCtx, &engineCtx);
+    if (atfError) {
+        ATF_FREE(refCount);
+        return atfError;
+    }
+
+    (*ctx->ipv6EngineRefCount)--;
+
+    *refCount = 1;
+    ctx->ipv6EngineRefCount = refCount;
+    ctx->ipv6EngineCtx = engineCtx;
+
+    return ATF_ERROR_OK;
+}
+
+static VOID AtfConfigReleaseEngines(CONFIG_CTX *ctx)
+{
+    if (ctx->ipv4EngineRefCount) {
+        if (!--(*ctx->ipv4EngineRefCount)) {
+            ctx->ipv4Engine->Free(&ctx->ipv4EngineCtx);
+            ATF_FREE(ctx->ipv4EngineRefCount);
+        }
+
+        ctx->ipv4EngineCtx = NULL;
+        ctx->ipv4EngineRefCount = NULL;
+    }
+
+    if (ctx->ipv6EngineRefCount) {
+        if (!--(*ctx->ipv6EngineRefCount)) {
+            AtfIpv6BslFree(&ctx->ipv6EngineCtx);
+            ATF_FREE(ctx->ipv6EngineRefCount);
+        }
+
+        ctx->ipv6EngineCtx = NULL;
+        ctx->ipv6EngineRefCount = NULL;
+    }
+}
+
+static ATF_ERROR AtfConfigInsertIpv4Pool(CONFIG_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    ATF_ERROR atfError = AtfConfigOwnIpv4Engine(ctx);
+    if (atfError) {
+        return atfError;
+    }
+
+    atfError = ctx->ipv4Engine->InsertPool(ctx->ipv4EngineCtx, pool, numOfEntries);
+    if (atfError) {
+        return atfError;
+    }
+
+    return AtfConfigCheckIpv4Budget(ctx);
+}
+
+static ATF_ERROR AtfConfigInsertIpv6Pool(CONFIG_CTX *ctx, const IPV6_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    size_t numOfMapped = 0;
+    for (size_t i = 0; i < numOfEntries; i++) {
+        if (pool[i].prefixLength > IPV6_IPV4_MAPPED_PREFIX_LENGTH && IPV6_IS_IPV4_MAPPED(&pool[i].address)) {
+            numOfMapped++;
+        }
+    }
+
+    // The IPv4 engine is copied by AtfConfigInsertIpv4Pool(), only if it receives entries
+    if (numOfEntries > numOfMapped) {
+        atfError = AtfConfigOwnIpv6Engine(ctx);
+        if (atfError) {
+            return atfError;
+        }
+    }
+
+    // Only allocate scratch pools if the blocklist mixes both kinds of prefixes
+    if (!numOfMapped) {
+        return AtfIpv6BslInsertPool(ctx->ipv6EngineCtx, pool, numOfEntries);
+    }
+
+    IPV4_PREFIX_ENTRY *ipv4Pool = (IPV4_PREFIX_ENTRY *)ATF_MALLOC(numOfMapped * sizeof(IPV4_PREFIX_ENTRY));
+    if (!ipv4Pool) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    IPV6_PREFIX_ENTRY *ipv6Pool = NULL;
+    if (numOfEntries > numOfMapped) {
+        ipv6Pool = (IPV6_PREFIX_ENTRY *)ATF_MALLOC((numOfEntries - numOfMapped) * sizeof(IPV6_PREFIX_ENTRY));
+        if (!ipv6Pool) {
+            ATF_FREE(ipv4Pool);
+            return ATF_NO_MEMORY_AVAILABLE;
+        }
+    }
+
+    size_t numOfIpv4 = 0;
+    size_t numOfIpv6 = 0;
+    for (size_t i = 0; i < numOfEntries; i++) {
+        if (pool[i].prefixLength > IPV6_IPV4_MAPPED_PREFIX_LENGTH && IPV6_IS_IPV4_MAPPED(&pool[i].address)) {
+            ipv4Pool[numOfIpv4].address.S_un.S_addr = IPV6_GET_MAPPED_IPV4(&pool[i].address);
+            ipv4Pool[numOfIpv4].prefixLength = (UINT8)(pool[i].prefixLength - IPV6_IPV4_MAPPED_PREFIX_LENGTH);
+            numOfIpv4++;
+        } else {
+            ipv6Pool[numOfIpv6++] = pool[i];
+        }
+    }
+
+    atfError = AtfConfigInsertIpv4Pool(ctx, ipv4Pool, numOfIpv4);
+    if (!atfError && numOfIpv6) {
+        atfError = AtfIpv6BslInsertPool(ctx->ipv6EngineCtx, ipv6Pool, numOfIpv6);
+    }
+
+    if (ipv6Pool) {
+        ATF_FREE(ipv6Pool);
+    }
+    ATF_FREE(ipv4Pool);
+
+    return atfError;
+}
+
+static ATF_ERROR AtfConfigCheckIpv4Budget(const CONFIG_CTX *ctx)
+{
+    if (!ctx->ipv4MemoryBudget) {
+        return ATF_ERROR_OK;
+    }
+
+    const size_t size = AtfConfigGetIpv4Size(ctx);
+    if (size > ctx->ipv4MemoryBudget) {
+        ATF_DEBUGA("[atftrace] IPv4 engine %s is over the memory budget (size: %llu, budget: %llu)",
+            ctx->ipv4Engine->name, (UINT64)size, (UINT64)ctx->ipv4MemoryBudget);
+        return ATF_MEMORY_BUDGET_EXCEEDED;
+    }
+
+    return ATF_ERROR_OK;
 }
 
 static BOOLEAN AtfIniConfigSanityCheck(const USER_DRIVER_FILTER_TRANSPORT_DATA *data)
@@ -220,38 +694,73 @@ static BOOLEAN AtfIniConfigSanityCheck(const USER_DRIVER_FILTER_TRANSPORT_DATA *
         data->enableLayerIpv4TcpOutbound |
         data->enableLayerIpv6TcpInbound |
         data->enableLayerIpv6TcpOutbound |
-        data->enableLayerIcmpv4        
+        data->enableLayerIcmpv4 |
+        data->enableLayerIpv4Dns |
+        data->enableLayerIpv6Dns |
+        data->enableLayerIpv4Tls |
+        data->enableLayerIpv6Tls
         ))
     {
         ATF_DEBUG(AtfIniConfigSanityCheck, "All layers have been disabled by user, ATF will not be initialized.");
         return FALSE;
     }
 
+    if (!AtfIpv4EngineGetOps(data->ipv4LookupEngine)) {
+        ATF_DEBUG(AtfIniConfigSanityCheck, "Unknown ipv4 lookup engine. Bad config.");
+        return FALSE;
+    }
+
+    if (data->dnsBlockResponse != DNS_BLOCK_NXDOMAIN && data->dnsBlockResponse != DNS_BLOCK_NULL_ADDRESS) {
+        ATF_DEBUG(AtfIniConfigSanityCheck, "Unknown DNS block response. Bad config.");
+        return FALSE;
+    }
+
+    if (AtfPolicyVerify(data->policy, data->numOfPolicyInsns)) {
+        ATF_DEBUG(AtfIniConfigSanityCheck, "The verdict policy failed verification. Bad config.");
+        return FALSE;
+    }
+
     if (!data->numOfIpv4Addresses) {
         ATF_DEBUG(AtfIniConfigSanityCheck, "No ipv4 addresses found in user ini, continuing.");
     } else if (data->numOfIpv4Addresses > MAX_IPV4_ADDRESSES_BLACKLIST) {
         ATF_DEBUG(AtfIniConfigSanityCheck, "ini cannot exceed MAX_IPV4_ADDRESSES_BLACKLIST addresses");
+        return FALSE;
     }
 
     if (!data->numOfIpv6Addresses) {
         ATF_DEBUG(AtfIniConfigSanityCheck, "No ipv6 addresses found in user ini, continuing.");
     } else if (data->numOfIpv6Addresses > MAX_IPV6_ADDRESSES_BLACKLIST) {
         ATF_DEBUG(AtfIniConfigSanityCheck, "ini cannot exceed MAX_IPV6_ADDRESSES_BLACKLIST addresses");
+        return FALSE;
     }
 
-    // Check that all IPs in the blacklist are > 0.0.0.0
+    // Check that all IPs in the blacklist are > 0.0.0.0, and have a valid prefix length
     for (UINT16 i = 0; i < data->numOfIpv4Addresses; i++) {
-        if (data->ipv4BlackList[i].S_un.S_addr == 0x00000000) {
+        if (data->ipv4BlackList[i].address.S_un.S_addr == 0x00000000) {
             ATF_DEBUG(AtfIniConfigSanityCheck, "An ipv4 gateway address was provided. Bad config.");
             return FALSE;
         }
+
+        if (data->ipv4BlackList[i].prefixLength < IPV4_PREFIX_MIN_LENGTH || 
+            data->ipv4BlackList[i].prefixLength > IPV4_PREFIX_MAX_LENGTH) 
+        {
+            ATF_DEBUG(AtfIniConfigSanityCheck, "An ipv4 prefix length is out of range. Bad config.");
+            return FALSE;
+        }
     }
 
     for (UINT16 i = 0; i < data->numOfIpv6Addresses; i++) {
-        if (!(data->ipv6Blacklist[i].a.q.qword[0] | data->ipv6Blacklist[i].a.q.qword[1])) {
+        if (!(data->ipv6Blacklist[i].address.a.q.qword[0] | data->ipv6Blacklist[i].address.a.q.qword[1])) {
             ATF_DEBUG(AtfIniConfigSanityCheck, "An ipv6 gateway address was provided. Bad config.");
             return FALSE;
         }
+
+        if (data->ipv6Blacklist[i].prefixLength < IPV6_PREFIX_MIN_LENGTH ||
+            data->ipv6Blacklist[i].prefixLength > IPV6_PREFIX_MAX_LENGTH)
+        {
+            ATF_DEBUG(AtfIniConfigSanityCheck, "An ipv6 prefix length is out of range. Bad config.");
+            return FALSE;
+        }
     }
 
     return TRUE;
@@ -11,7 +11,15 @@
 #include "../common/errors.h"
 #include "../common/user_driver_transport.h"
 
-#include "ipv4_trie.h"
+#include "ipv4_engine.h"
+#include "ipv4_image.h"
+#include "ipv4_tss.h"
+#include "ipv6_bsl.h"
+#include "domain_dafsa.h"
+#include "dns_cache.h"
+#include "quic_flow.h"
+#include "payload_sig.h"
+#include "policy.h"
 
 //
 // Layers which will be enabled by the filter engine
@@ -41,31 +49,72 @@ typedef struct _config_ctx {
     size_t                          numOfLayers;
     ENABLED_LAYER                   enabledLayers[MAX_CALLOUT_LAYER_DATA];
 
-    // A n-length pool, aligned by 32-bits, representing all known IPv4 addresses
+    // Number of IPv4 addresses and subnets received (the entries are only kept in the lookup engine)
     size_t                          numOfIpv4Addresses;
-    struct in_addr                  *ipv4AddressPool;
 
     //
-    // Sortied trie for fast processing
+    // IPv4 lookup engine (see ipv4_engine.h), only the context of the selected engine is allocated
     //
-    IPV4_TRIE_CTX                   *ipv4TrieCtx;
+    IPV4_LOOKUP_ENGINE              ipv4LookupEngine;
+    const IPV4_ENGINE_OPS           *ipv4Engine;
+    VOID                            *ipv4EngineCtx;
 
-    // IPv6 blacklist pool
+    // Number of configs sharing ipv4EngineCtx, the engine is copied before one of them modifies it
+    size_t                          *ipv4EngineRefCount;
+
+    // Relocatable image compiled by the service (IPV4_ENGINE_TRIE), searched alongside the trie. May be NULL
+    IPV4_IMAGE_CTX                  *ipv4ImageCtx;
+
+    // Memory budget of the engine and image (0 for no limit), and the engine size predicted by the service
+    size_t                          ipv4MemoryBudget;
+    size_t                          ipv4PredictedSize;
+
+    // Number of IPv6 addresses and subnets received. IPv4-mapped prefixes are counted here, but stored in the IPv4
+    //  lookup engine
     size_t                          numOfIpv6Addresses;
-    IPV6_RAW_ADDRESS                *ipv6AddressPool;
+
+    // IPv6 lookup engine (see ipv6_bsl.h), shared as the IPv4 engine
+    IPV6_BSL_CTX                    *ipv6EngineCtx;
+    size_t                          *ipv6EngineRefCount;
+
+    // IPv4 5-tuple rules (see ipv4_tss.h), evaluated before the blocklist. NULL if there are no rules
+    IPV4_TSS_CTX                    *ipv4RulesCtx;
+
+    // Domain blocklist (see domain_dafsa.h), compiled by the service. NULL if there is no domain blocklist
+    DOMAIN_DAFSA_CTX                *domainCtx;
+
+    // Set if a DNS layer is enabled, the DNS responses are then snooped into dnsCacheCtx
+    BOOLEAN                         isDnsSnoopingEnabled;
+
+    // Addresses resolved from the domain blocklist (see dns_cache.h), allocated with the domain blocklist if DNS
+    //  snooping is enabled. Unlike the rest of the config, it is written by the callouts
+    DNS_CACHE_CTX                   *dnsCacheCtx;
+
+    // Set if a stream layer is enabled, the QUIC client Initials are then inspected as well (over the datagram layer)
+    BOOLEAN                         isQuicEnabled;
+
+    // QUIC flows decided or waiting for the rest of their ClientHello (see quic_flow.h), allocated with the domain
+    //  blocklist if QUIC is enabled. Written by the callouts, as the DNS cache
+    QUIC_FLOW_CTX                   *quicFlowCtx;
+
+    // Payload signatures (see payload_sig.h), compiled by the service and scanned on the stream layers. NULL if there
+    //  are no signatures
+    PAYLOAD_SIG_CTX                 *payloadSigCtx;
 
     //
     // Action switches
     //
-    ACTION_OPTS                     ipv4BlocklistAction;
-    ACTION_OPTS                     ipv6BlocklistAction;
     ACTION_OPTS                     dnsBlocklistAction; 
+    ACTION_OPTS                     payloadSignatureAction;
 
-    //
-    // Direction switches
-    //
-    BOOLEAN                         alertInbound;
-    BOOLEAN                         alertOutbound;
+    // Response injected for a blocked DNS query (see dns_block.h)
+    DNS_BLOCK_RESPONSE              dnsBlockResponse;
+
+    // Verified verdict policy (see policy.h), the blocklist actions and direction switches are compiled into it.
+    //  Specialized for each layer (POLICY_LAYER_*), the program of a layer starts at policyEntry
+    size_t                          numOfPolicyInsns;
+    size_t                          policyEntry[POLICY_NUM_OF_LAYERS];
+    POLICY_INSN                     policy[POLICY_NUM_OF_LAYERS][POLICY_MAX_INSNS];
 } CONFIG_CTX, *PCONFIG_CTX;
 
 //
@@ -74,10 +123,67 @@ typedef struct _config_ctx {
 ATF_ERROR AtfAllocDefaultConfig(const USER_DRIVER_FILTER_TRANSPORT_DATA *data, CONFIG_CTX **cfgCtx);
 
 //
-// Append a new blocklist array to the config
+// Create a copy of a config that can be modified without affecting src
+//  The lookup image and the rules are immutable, so they are shared rather than copied. The lookup engines are
+//  shared as well, and only copied by the first change made to them, so a clone that only replaces an image, the
+//  rules or the domain blocklist costs no engine copy. A change to an engine still copies it as a whole (a DIR-24-8
+//  engine is 64MB or more), see BLACKLIST_IPV4_MAX_SIZE
+//  The published config is never modified, changes are made to a clone which is then published (see filter.c)
+//  The reference counts are only changed by the IOCTL handlers (serialized by gIoctlLock)
+//
+ATF_ERROR AtfConfigClone(const CONFIG_CTX *src, CONFIG_CTX **cfgCtx);
+
+//
+// Append a new blocklist array (IPV4_PREFIX_ENTRY) to the config
+//  Used by both IOCTL_ATF_APPEND_IPV4_BLACKLIST and the bulk upload session, so the size is not limited here
 //
 ATF_ERROR AtfConfigAddIpv4Blacklist(CONFIG_CTX *ctx, const VOID *blacklist, size_t bufLen);
 
+//
+// Apply an IPv4 blocklist delta (IPV4_DELTA_HEADER) to the lookup engine of the config: removals, then additions
+//  The lookup image is not affected, the service replaces it as a whole
+//
+ATF_ERROR AtfConfigApplyIpv4Delta(CONFIG_CTX *ctx, const VOID *delta, size_t deltaSize);
+
+//
+// Append a new IPv6 blocklist array (IPV6_PREFIX_ENTRY) to the config
+//  IPv4-mapped prefixes longer than IPV6_IPV4_MAPPED_PREFIX_LENGTH are inserted into the IPv4 lookup engine
+//
+ATF_ERROR AtfConfigAddIpv6Blacklist(CONFIG_CTX *ctx, const VOID *blacklist, size_t bufLen);
+
+//
+// Adopt a lookup image compiled by the service, replacing the current image of the config
+//  Only supported by IPV4_ENGINE_TRIE
+//
+ATF_ERROR AtfConfigSetIpv4Image(CONFIG_CTX *ctx, const VOID *image, size_t imageSize);
+
+//
+// Replace the IPv4 rules of the config with a new rule array (IPV4_RULE_ENTRY), in priority order
+//
+ATF_ERROR AtfConfigSetIpv4Rules(CONFIG_CTX *ctx, const VOID *rules, size_t bufLen);
+
+//
+// Adopt a domain blocklist image compiled by the service, replacing the current one
+//  If DNS snooping is enabled, the config gets a new, empty DNS cache, as the cached addresses belong to the old one
+//
+ATF_ERROR AtfConfigSetDomainBlocklist(CONFIG_CTX *ctx, const VOID *image, size_t imageSize);
+
+//
+// Adopt a payload signature image compiled by the service, replacing the current one
+//  The flows being scanned start over with the new image (see filter.c)
+//
+ATF_ERROR AtfConfigSetPayloadSignatures(CONFIG_CTX *ctx, const VOID *image, size_t imageSize);
+
+//
+// Returns the physical size of the IPv4 engine and image of the config, as counted against the memory budget
+//
+size_t AtfConfigGetIpv4Size(const CONFIG_CTX *ctx);
+
+//
+// Print the selected IPv4 engine, its predicted and actual size and the memory budget, then the engine stats
+//
+VOID AtfConfigPrintIpv4Engine(const CONFIG_CTX *ctx);
+
 //
 // Free the config context structure
 //
@@ -0,0 +1,190 @@
+#include <ntddk.h>
+
+#include "dns_block.h"
+
+#define DNS_BLOCK_IP_PROTOCOL_UDP       17
+
+// Compression pointer to the question name, the owner of the answer
+#define DNS_BLOCK_QUESTION_POINTER      (0xc000 | DNS_HEADER_SIZE)
+
+//
+// Add the big endian 16-bit words of a buffer to a ones' complement sum (RFC 1071), an odd length is zero padded
+//
+static __forceinline UINT32 AtfDnsBlockChecksumAdd(UINT32 sum, const UINT8 *data, size_t length);
+
+//
+// Fold a ones' complement sum into its checksum
+//
+static __forceinline UINT16 AtfDnsBlockChecksumFold(UINT32 sum);
+
+size_t AtfDnsBlockClassifyQuery(
+    _In_ const DOMAIN_DAFSA_CTX *domainCtx,
+    _In_ const UINT8 *msg,
+    _In_ size_t msgLength,
+    _Out_ DNS_QUERY *queryOut,
+    _Out_ CHAR *nameOut,
+    _Out_ size_t *nameLengthOut
+)
+{
+    if (!domainCtx || !msg || !queryOut || !nameOut || !nameLengthOut) {
+        return 0;
+    }
+    *nameLengthOut = 0;
+
+    if (AtfDnsParseQuery(msg, msgLength, queryOut) != ATF_ERROR_OK) {
+        return 0;
+    }
+
+    const size_t nameLength = AtfDnsDecodeName(msg, msgLength, DNS_HEADER_SIZE, nameOut);
+    if (!nameLength) {
+        return 0;
+    }
+
+    // The question is echoed in the response, so its name must not point into the header: an uncompressed name
+    //  takes a length byte per label and the root label, one more byte than its dotted form
+    if (queryOut->questionLength != nameLength + 2 + DNS_QUESTION_FIXED_SIZE) {
+        return 0;
+    }
+
+    *nameLengthOut = nameLength;
+
+    return AtfDomainDafsaSearch(domainCtx, nameOut, nameLength);
+}
+
+size_t AtfDnsBlockBuildResponse(
+    _In_ const DNS_BLOCK_FLOW *flow,
+    _In_ const UINT8 *query,
+    _In_ const DNS_QUERY *parsedQuery,
+    _In_ DNS_BLOCK_RESPONSE responseType,
+    _Out_ UINT8 *packetOut,
+    _In_ size_t packetSize
+)
+{
+    if (!flow || !query || !parsedQuery || !packetOut) {
+        return 0;
+    }
+
+    // Length of the answer address, 0 for no answer
+    size_t rdLength = 0;
+    if (responseType == DNS_BLOCK_NULL_ADDRESS && parsedQuery->questionClass == DNS_CLASS_IN) {
+        if (parsedQuery->questionType == DNS_TYPE_A) {
+            rdLength = 4;
+        } else if (parsedQuery->questionType == DNS_TYPE_AAAA) {
+            rdLength = sizeof(IPV6_RAW_ADDRESS);
+        }
+    }
+
+    const size_t ipHeaderSize = flow->isIpv6 ? DNS_BLOCK_IPV6_HEADER_SIZE : DNS_BLOCK_IPV4_HEADER_SIZE;
+    const size_t answerSize = rdLength ? 2 + DNS_RR_FIXED_SIZE + rdLength : 0;
+    const size_t udpLength = DNS_UDP_HEADER_SIZE + DNS_HEADER_SIZE + parsedQuery->questionLength + answerSize;
+    const size_t packetLength = ipHeaderSize + udpLength;
+    if (packetLength > packetSize) {
+        return 0;
+    }
+
+    RtlZeroMemory(packetOut, packetLength);
+
+    UINT8 *ipHeader = packetOut;
+    UINT8 *udpHeader = &packetOut[ipHeaderSize];
+    UINT8 *msg = &udpHeader[DNS_UDP_HEADER_SIZE];
+
+    //
+    // DNS: the header and question of the query, as a response. The counts of the other sections stay 0
+    //
+    const UINT16 rcode = responseType == DNS_BLOCK_NXDOMAIN ? DNS_RCODE_NXDOMAIN : DNS_RCODE_NOERROR;
+    const UINT16 flags = DNS_FLAG_RESPONSE | DNS_FLAG_RECURSION_AVAILABLE | rcode |
+        (parsedQuery->flags & (DNS_FLAG_OPCODE_MASK | DNS_FLAG_RECURSION_DESIRED));
+
+    AtfDnsWrite16(&msg[0], parsedQuery->id);
+    AtfDnsWrite16(&msg[2], flags);
+    AtfDnsWrite16(&msg[4], 1);
+    AtfDnsWrite16(&msg[6], rdLength ? 1 : 0);
+
+    RtlCopyMemory(&msg[DNS_HEADER_SIZE], &query[DNS_HEADER_SIZE], parsedQuery->questionLength);
+
+    if (rdLength) {
+        // The unspecified address, the zeroed rdata
+        UINT8 *answer = &msg[DNS_HEADER_SIZE + parsedQuery->questionLength];
+        AtfDnsWrite16(&answer[0], DNS_BLOCK_QUESTION_POINTER);
+        AtfDnsWrite16(&answer[2], parsedQuery->questionType);
+        AtfDnsWrite16(&answer[4], DNS_CLASS_IN);
+        AtfDnsWrite32(&answer[6], DNS_BLOCK_TTL);
+        AtfDnsWrite16(&answer[10], (UINT16)rdLength);
+    }
+
+    //
+    // UDP, from the port the query was sent to
+    //
+    AtfDnsWrite16(&udpHeader[0], flow->remotePort);
+    AtfDnsWrite16(&udpHeader[2], flow->localPort);
+    AtfDnsWrite16(&udpHeader[4], (UINT16)udpLength);
+
+    //
+    // IP, from the address the query was sent to
+    //
+    const size_t addressSize = flow->isIpv6 ? sizeof(IPV6_RAW_ADDRESS) : 4;
+    UINT8 *sourceAddress;
+    UINT8 *destinationAddress;
+
+    if (flow->isIpv6) {
+        ipHeader[0] = 0x60;
+        AtfDnsWrite16(&ipHeader[4], (UINT16)udpLength);
+        ipHeader[6] = DNS_BLOCK_IP_PROTOCOL_UDP;
+        ipHeader[7] = DNS_BLOCK_HOP_LIMIT;
+
+        sourceAddress = &ipHeader[8];
+        destinationAddress = &ipHeader[24];
+    } else {
+        ipHeader[0] = 0x45;
+        AtfDnsWrite16(&ipHeader[2], (UINT16)packetLength);
+        ipHeader[8] = DNS_BLOCK_HOP_LIMIT;
+        ipHeader[9] = DNS_BLOCK_IP_PROTOCOL_UDP;
+
+        sourceAddress = &ipHeader[12];
+        destinationAddress = &ipHeader[16];
+    }
+
+    RtlCopyMemory(sourceAddress, flow->remoteAddress.a.b.byte, addressSize);
+    RtlCopyMemory(destinationAddress, flow->localAddress.a.b.byte, addressSize);
+
+    if (!flow->isIpv6) {
+        AtfDnsWrite16(&ipHeader[10], AtfDnsBlockChecksumFold(AtfDnsBlockChecksumAdd(0, ipHeader, ipHeaderSize)));
+    }
+
+    // The UDP checksum covers the pseudo header (addresses, protocol and UDP length), it is required over IPv6
+    UINT32 sum = AtfDnsBlockChecksumAdd(0, sourceAddress, addressSize);
+    sum = AtfDnsBlockChecksumAdd(sum, destinationAddress, addressSize);
+    sum += DNS_BLOCK_IP_PROTOCOL_UDP + (UINT32)udpLength;
+    sum = AtfDnsBlockChecksumAdd(sum, udpHeader, udpLength);
+
+    // A computed checksum of 0 is sent as 0xffff, 0 means no checksum
+    const UINT16 checksum = AtfDnsBlockChecksumFold(sum);
+    AtfDnsWrite16(&udpHeader[6], checksum ? checksum : 0xffff);
+
+    return packetLength;
+}
+
+static __forceinline UINT32 AtfDnsBlockChecksumAdd(UINT32 sum, const UINT8 *data, size_t length)
+{
+    // The packet is well under 64K words, the 32-bit sum cannot overflow before it is folded
+    size_t i = 0;
+    for (; i + 1 < length; i += 2) {
+        sum += AtfDnsRead16(&data[i]);
+    }
+
+    if (i < length) {
+        sum += (UINT32)data[i] << 8;
+    }
+
+    return sum;
+}
+
+static __forceinline UINT16 AtfDnsBlockChecksumFold(UINT32 sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return (UINT16)~sum;
+}
+
+//EOF
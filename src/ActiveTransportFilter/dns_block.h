@@ -0,0 +1,81 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "domain_dafsa.h"
+#include "dns_parser.h"
+
+//
+// Blocking of the DNS queries for blocklisted domains, seen outbound by the datagram callouts
+//
+//  Blocking the connects to the addresses of a blocklisted domain (dns_cache.h) still lets the name resolve, and
+//   the client then retries its SYNs against dropped addresses. When dnsBlocklistAction is ACTION_BLOCK, the query
+//   itself is dropped, and answered with a synthesized response (DNS_BLOCK_RESPONSE) so the lookup fails at once.
+//
+//  The response is built as the whole IP packet the resolver would have sent: the IP and UDP headers of the query
+//   with the addresses and ports swapped, then the header and question of the query and the answer. It is built in
+//   the buffer it is injected from (see inject.h), and carries its checksums, as a received packet is not
+//   checksum offloaded.
+//
+//  The additional section of the query (an EDNS OPT record) is not echoed, a response without OPT is valid for a
+//   query that had one (RFC 6891 7).
+//
+// TTL of the synthesized A and AAAA answers, in seconds
+#define DNS_BLOCK_TTL                   60
+
+#define DNS_BLOCK_IPV4_HEADER_SIZE      20
+#define DNS_BLOCK_IPV6_HEADER_SIZE      40
+#define DNS_BLOCK_HOP_LIMIT             64
+
+// Largest packet built: IPv6, a question of the longest name, and an AAAA answer (compressed owner name)
+#define DNS_BLOCK_MAX_PACKET_SIZE       (DNS_BLOCK_IPV6_HEADER_SIZE + DNS_UDP_HEADER_SIZE + DNS_HEADER_SIZE + \
+                                         DNS_NAME_BUFFER_SIZE + 2 + DNS_QUESTION_FIXED_SIZE + \
+                                         2 + DNS_RR_FIXED_SIZE + sizeof(IPV6_RAW_ADDRESS))
+
+//
+// Addresses and ports of a query, as the callout sees it
+//
+typedef struct _dns_block_flow {
+    BOOLEAN                         isIpv6;
+
+    // Network byte order, an IPv4 address is in the first 4 bytes
+    IPV6_RAW_ADDRESS                localAddress;
+    IPV6_RAW_ADDRESS                remoteAddress;
+
+    SERVICE_PORT                    localPort;
+    SERVICE_PORT                    remotePort;
+} DNS_BLOCK_FLOW, *PDNS_BLOCK_FLOW;
+
+//
+// Parse a query, and search its name in the domain blocklist. Callable at any IRQL <= DISPATCH_LEVEL
+//  nameOut (DNS_NAME_BUFFER_SIZE chars) receives the name, the blocklisted domain is its last (returned) chars
+//  Returns the length of the blocklisted domain, or 0 if the message is not a query, its name is compressed or
+//  malformed, or the name is not blocklisted
+//
+size_t AtfDnsBlockClassifyQuery(
+    _In_ const DOMAIN_DAFSA_CTX *domainCtx,
+    _In_ const UINT8 *msg,
+    _In_ size_t msgLength,
+    _Out_ DNS_QUERY *queryOut,
+    _Out_ CHAR *nameOut,
+    _Out_ size_t *nameLengthOut
+);
+
+//
+// Build the IP packet of the response to a query classified by AtfDnsBlockClassifyQuery, from the resolver
+//  A DNS_BLOCK_NULL_ADDRESS response only answers IN class A and AAAA queries, others get an empty answer
+//  Returns the length of the packet, or 0 if it does not fit packetSize (DNS_BLOCK_MAX_PACKET_SIZE always fits)
+//
+size_t AtfDnsBlockBuildResponse(
+    _In_ const DNS_BLOCK_FLOW *flow,
+    _In_ const UINT8 *query,
+    _In_ const DNS_QUERY *parsedQuery,
+    _In_ DNS_BLOCK_RESPONSE responseType,
+    _Out_ UINT8 *packetOut,
+    _In_ size_t packetSize
+);
+
+//EOF
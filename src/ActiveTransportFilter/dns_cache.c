@@ -0,0 +1,290 @@
+#include <ntddk.h>
+
+#include "dns_cache.h"
+
+#include "mem.h"
+#include "trace.h"
+
+//
+// Bucket of an address
+//
+static __forceinline size_t AtfDnsCacheHash(UINT64 seed, const IPV6_RAW_ADDRESS *address);
+
+//
+// Returns TRUE if a slot holds the address
+//
+static __forceinline BOOLEAN AtfDnsCacheIsSameAddress(const DNS_CACHE_SLOT *slot, const IPV6_RAW_ADDRESS *address);
+
+ATF_ERROR AtfDnsCacheAllocCtx(DNS_CACHE_CTX **ctxOut)
+{
+    if (!ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    DNS_CACHE_CTX *ctx = (DNS_CACHE_CTX *)ATF_MALLOC(sizeof(DNS_CACHE_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    // Allocations of a page or more are page aligned, so every slot is on its own cache line
+    ctx->slots = (DNS_CACHE_SLOT *)ATF_MALLOC(DNS_CACHE_NUM_OF_BUCKETS * DNS_CACHE_BUCKET_SLOTS * sizeof(DNS_CACHE_SLOT));
+    if (!ctx->slots) {
+        ATF_FREE(ctx);
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    LARGE_INTEGER counter = KeQueryPerformanceCounter(NULL);
+    ctx->seed = (UINT64)counter.QuadPart;
+    ctx->refCount = 1;
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+DNS_CACHE_CTX *AtfDnsCacheReference(DNS_CACHE_CTX *ctx)
+{
+    if (ctx) {
+        ctx->refCount++;
+    }
+
+    return ctx;
+}
+
+UINT32 AtfDnsCacheAddResponse(
+    _In_ DNS_CACHE_CTX *ctx,
+    _In_ const DOMAIN_DAFSA_CTX *domainCtx,
+    _In_ const UINT8 *msg,
+    _In_ size_t msgLength,
+    _In_ UINT32 now
+)
+{
+    if (!ctx || !domainCtx || !msg) {
+        return 0;
+    }
+
+    DNS_RESPONSE response;
+    if (AtfDnsParseResponse(msg, msgLength, &response) != ATF_ERROR_OK || !response.numOfAddresses) {
+        return 0;
+    }
+
+    CHAR name[DNS_NAME_BUFFER_SIZE];
+    size_t nameLength = AtfDnsDecodeName(msg, msgLength, response.questionOffset, name);
+    size_t domainLength = nameLength ? AtfDomainDafsaSearch(domainCtx, name, nameLength) : 0;
+
+    // A listed domain can also be reached through an alias of an unlisted name (CNAME cloaking)
+    for (UINT32 i = 0; !domainLength && i < response.numOfCnames; i++) {
+        nameLength = AtfDnsDecodeName(msg, msgLength, response.cnameOffsets[i], name);
+        if (nameLength) {
+            domainLength = AtfDomainDafsaSearch(domainCtx, name, nameLength);
+        }
+    }
+
+    if (!domainLength) {
+        return 0;
+    }
+
+    // The answers are not matched to the alias chain, every address of the response is attributed to the domain
+    const CHAR *domain = &name[nameLength - domainLength];
+    for (UINT32 i = 0; i < response.numOfAddresses; i++) {
+        const DNS_ADDRESS_RECORD *record = &response.addresses[i];
+
+        IPV6_RAW_ADDRESS address;
+        if (record->type == DNS_TYPE_A) {
+            AtfDnsCacheMapIpv4(AtfDnsRead32(&msg[record->rdataOffset]), &address);
+        } else {
+            RtlCopyMemory(&address, &msg[record->rdataOffset], sizeof(IPV6_RAW_ADDRESS));
+        }
+
+        AtfDnsCacheInsert(ctx, &address, domain, domainLength, record->ttl, now);
+    }
+
+    return response.numOfAddresses;
+}
+
+VOID AtfDnsCacheInsert(
+    _In_ DNS_CACHE_CTX *ctx,
+    _In_ const IPV6_RAW_ADDRESS *address,
+    _In_ const CHAR *domain,
+    _In_ size_t domainLength,
+    _In_ UINT32 ttl,
+    _In_ UINT32 now
+)
+{
+    if (!ctx || !address || !domain || !domainLength || domainLength > DNS_MAX_NAME_LENGTH) {
+        return;
+    }
+
+    if (ttl < DNS_CACHE_MIN_TTL) {
+        ttl = DNS_CACHE_MIN_TTL;
+    } else if (ttl > DNS_CACHE_MAX_TTL) {
+        ttl = DNS_CACHE_MAX_TTL;
+    }
+
+    //
+    // The entry of the same address is refreshed, otherwise the slot that expires first is replaced: a slot that was
+    //  never written (expiry 0), then an expired one, then the live one closest to expiring
+    //
+    DNS_CACHE_SLOT *bucket = &ctx->slots[AtfDnsCacheHash(ctx->seed, address) * DNS_CACHE_BUCKET_SLOTS];
+    DNS_CACHE_SLOT *victim = &bucket[0];
+    for (UINT32 i = 0; i < DNS_CACHE_BUCKET_SLOTS; i++) {
+        if (AtfDnsCacheIsSameAddress(&bucket[i], address)) {
+            victim = &bucket[i];
+            break;
+        }
+
+        if (bucket[i].expiry < victim->expiry) {
+            victim = &bucket[i];
+        }
+    }
+
+    const LONG sequence = victim->sequence;
+    if (sequence & 1) {
+        return;
+    }
+
+    if (InterlockedCompareExchange(&victim->sequence, (LONG)((ULONG)sequence + 1), sequence) != sequence) {
+        return;
+    }
+
+    const size_t copyLength = domainLength < DNS_CACHE_DOMAIN_SIZE ? domainLength : DNS_CACHE_DOMAIN_SIZE;
+    const CHAR *copyStart = &domain[domainLength - copyLength];
+    for (size_t i = 0; i < copyLength; i++) {
+        CHAR c = copyStart[i];
+        if (c >= 'A' && c <= 'Z') {
+            c |= 0x20;
+        }
+        victim->domain[i] = c;
+    }
+
+    victim->address = *address;
+    victim->domainLength = (UINT8)domainLength;
+    victim->expiry = now + ttl;
+
+    InterlockedExchange(&victim->sequence, (LONG)((ULONG)sequence + 2));
+}
+
+BOOLEAN AtfDnsCacheLookup(
+    _In_ const DNS_CACHE_CTX *ctx,
+    _In_ const IPV6_RAW_ADDRESS *address,
+    _In_ UINT32 now,
+    _Out_opt_ CHAR *domainOut
+)
+{
+    if (!ctx || !address) {
+        return FALSE;
+    }
+
+    const DNS_CACHE_SLOT *bucket = &ctx->slots[AtfDnsCacheHash(ctx->seed, address) * DNS_CACHE_BUCKET_SLOTS];
+    for (UINT32 i = 0; i < DNS_CACHE_BUCKET_SLOTS; i++) {
+        const DNS_CACHE_SLOT *slot = &bucket[i];
+
+        const LONG sequence = slot->sequence;
+        if (sequence & 1) {
+            continue;
+        }
+        KeMemoryBarrier();
+
+        if (!AtfDnsCacheIsSameAddress(slot, address)) {
+            continue;
+        }
+
+        const UINT32 expiry = slot->expiry;
+        const UINT8 domainLength = slot->domainLength;
+        CHAR domain[DNS_CACHE_DOMAIN_SIZE];
+        if (domainOut) {
+            RtlCopyMemory(domain, slot->domain, sizeof(domain));
+        }
+
+        // A writer took the slot while it was read, the copy may be torn
+        KeMemoryBarrier();
+        if (slot->sequence != sequence) {
+            continue;
+        }
+
+        if (expiry <= now) {
+            continue;
+        }
+
+        if (domainOut) {
+            size_t length = 0;
+            if (domainLength > DNS_CACHE_DOMAIN_SIZE) {
+                domainOut[length++] = '.';
+                domainOut[length++] = '.';
+            }
+
+            const size_t copyLength = domainLength < DNS_CACHE_DOMAIN_SIZE ? domainLength : DNS_CACHE_DOMAIN_SIZE;
+            RtlCopyMemory(&domainOut[length], domain, copyLength);
+            domainOut[length + copyLength] = '\0';
+        }
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+VOID AtfDnsCachePrintCtx(const DNS_CACHE_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    const UINT32 now = AtfDnsCacheNow();
+
+    UINT64 numOfEntries = 0;
+    for (size_t i = 0; i < DNS_CACHE_NUM_OF_BUCKETS * DNS_CACHE_BUCKET_SLOTS; i++) {
+        if (ctx->slots[i].expiry > now) {
+            numOfEntries++;
+        }
+    }
+
+    ATF_DEBUGA("[atftrace] DNS Cache Stats: Live entries: %llu, Slots: %llu, Size: %llu",
+        numOfEntries,
+        (UINT64)(DNS_CACHE_NUM_OF_BUCKETS * DNS_CACHE_BUCKET_SLOTS),
+        (UINT64)(DNS_CACHE_NUM_OF_BUCKETS * DNS_CACHE_BUCKET_SLOTS * sizeof(DNS_CACHE_SLOT)));
+}
+
+VOID AtfDnsCacheFree(DNS_CACHE_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    DNS_CACHE_CTX *c = *ctx;
+    *ctx = NULL;
+
+    if (--c->refCount) {
+        return;
+    }
+
+    if (c->slots) {
+        ATF_FREE(c->slots);
+    }
+    ATF_FREE(c);
+}
+
+static __forceinline size_t AtfDnsCacheHash(UINT64 seed, const IPV6_RAW_ADDRESS *address)
+{
+    // 64-bit mix (murmur3 finalizer) of both halves, as in ipv6_bsl.c
+    UINT64 hash = address->a.q.qword[0] ^ seed;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    hash ^= address->a.q.qword[1];
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (size_t)(hash & (DNS_CACHE_NUM_OF_BUCKETS - 1));
+}
+
+static __forceinline BOOLEAN AtfDnsCacheIsSameAddress(const DNS_CACHE_SLOT *slot, const IPV6_RAW_ADDRESS *address)
+{
+    return slot->address.a.q.qword[0] == address->a.q.qword[0] && slot->address.a.q.qword[1] == address->a.q.qword[1];
+}
+
+//EOF
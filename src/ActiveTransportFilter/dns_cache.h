@@ -0,0 +1,163 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "domain_dafsa.h"
+#include "dns_parser.h"
+
+//
+// Address to domain cache, filled by snooping the DNS responses of the datagram callouts
+//
+//  A connection to a blocklisted domain usually goes to an address that is in no IP blocklist. The datagram callouts
+//   parse every inbound DNS response (dns_parser.h), and when the question or one of its CNAME aliases is covered by
+//   the domain blocklist (domain_dafsa.h), the A and AAAA answers are cached with the listed domain. The transport
+//   callouts then look the remote address up in the cache (POLICY_SET_DNS_DOMAINS), so the connect is matched even
+//   though the name is not in the flow.
+//
+//  The cache is a fixed-size set associative table, allocated once: DNS_CACHE_NUM_OF_BUCKETS buckets of
+//   DNS_CACHE_BUCKET_SLOTS slots, each slot one cache line. IPv4 addresses are stored as IPv4-mapped IPv6 addresses,
+//   so both families share the table. When a bucket is full, the entry of the same address is replaced first, then
+//   an expired entry, then the entry that expires first.
+//
+//  Unlike the rest of the config, the cache is written by the callouts, concurrently and at DISPATCH_LEVEL, so the
+//   slots are guarded by a sequence lock rather than by the epoch:
+//
+//   - A writer claims a slot by moving its sequence from even to odd (InterlockedCompareExchange), writes the entry
+//     and moves the sequence to the next even value. A writer that finds the slot claimed drops its entry, the
+//     cache is best effort.
+//   - A reader copies the entry between two reads of the sequence, and treats the slot as empty if the sequence was
+//     odd or has changed. Readers never write, never retry and never wait.
+//
+//  Entries expire with the TTL of their record, clamped to DNS_CACHE_MIN_TTL..DNS_CACHE_MAX_TTL, in seconds of
+//   interrupt time (AtfDnsCacheNow). A new domain blocklist comes with a new, empty cache, so the entries of a
+//   domain that was removed from the blocklist do not outlive it.
+//
+//  The cache is shared between configs cloned from each other, as the domain blocklist is. The reference count is
+//   only changed by the IOCTL handlers (serialized by gIoctlLock), never by the callouts.
+//
+#define DNS_CACHE_CACHE_LINE            64
+
+#define DNS_CACHE_NUM_OF_BUCKETS        4096
+#define DNS_CACHE_BUCKET_SLOTS          4
+
+// TTL of an entry, in seconds
+#define DNS_CACHE_MIN_TTL               60
+#define DNS_CACHE_MAX_TTL               86400
+
+// Chars of the listed domain kept in a slot, a longer domain keeps its last chars
+#define DNS_CACHE_DOMAIN_SIZE           39
+
+// Buffer a domain is copied into by AtfDnsCacheLookup (a truncated domain is prefixed with "..")
+#define DNS_CACHE_DOMAIN_BUFFER_SIZE    (DNS_CACHE_DOMAIN_SIZE + 3)
+
+typedef struct DECLSPEC_ALIGN(DNS_CACHE_CACHE_LINE) _dns_cache_slot {
+    // Odd while a writer owns the slot
+    volatile LONG                   sequence;
+
+    // Seconds of interrupt time (AtfDnsCacheNow) the entry expires at, 0 if the slot was never written
+    UINT32                          expiry;
+
+    // Network byte order, IPv4 addresses are IPv4-mapped
+    IPV6_RAW_ADDRESS                address;
+
+    // Length of the listed domain, and its last DNS_CACHE_DOMAIN_SIZE chars (not NULL terminated)
+    UINT8                           domainLength;
+    CHAR                            domain[DNS_CACHE_DOMAIN_SIZE];
+} DNS_CACHE_SLOT, *PDNS_CACHE_SLOT;
+
+C_ASSERT(sizeof(DNS_CACHE_SLOT) == DNS_CACHE_CACHE_LINE);
+
+typedef struct _dns_cache_ctx {
+    // Number of configs referencing the cache
+    size_t                          refCount;
+
+    // Hash seed, so that the answers of a crafted response cannot target one bucket
+    UINT64                          seed;
+
+    // DNS_CACHE_NUM_OF_BUCKETS * DNS_CACHE_BUCKET_SLOTS slots, the slots of a bucket are consecutive
+    DNS_CACHE_SLOT                  *slots;
+} DNS_CACHE_CTX, *PDNS_CACHE_CTX;
+
+//
+// Allocate an empty cache
+//
+ATF_ERROR AtfDnsCacheAllocCtx(DNS_CACHE_CTX **ctxOut);
+
+//
+// Take another reference on the cache, for a cloned config
+//
+DNS_CACHE_CTX *AtfDnsCacheReference(DNS_CACHE_CTX *ctx);
+
+//
+// Parse a DNS response, and cache its A and AAAA answers if the question or a CNAME alias is covered by the domain
+//  blocklist. Callable at any IRQL <= DISPATCH_LEVEL
+//  Returns the number of addresses cached
+//
+UINT32 AtfDnsCacheAddResponse(
+    _In_ DNS_CACHE_CTX *ctx,
+    _In_ const DOMAIN_DAFSA_CTX *domainCtx,
+    _In_ const UINT8 *msg,
+    _In_ size_t msgLength,
+    _In_ UINT32 now
+);
+
+//
+// Cache an address with the listed domain it resolved from (not NULL terminated)
+//
+VOID AtfDnsCacheInsert(
+    _In_ DNS_CACHE_CTX *ctx,
+    _In_ const IPV6_RAW_ADDRESS *address,
+    _In_ const CHAR *domain,
+    _In_ size_t domainLength,
+    _In_ UINT32 ttl,
+    _In_ UINT32 now
+);
+
+//
+// Returns TRUE if an unexpired entry exists for the address. Callable at any IRQL <= DISPATCH_LEVEL
+//  domainOut (DNS_CACHE_DOMAIN_BUFFER_SIZE chars, may be NULL) receives the listed domain, NULL terminated
+//
+BOOLEAN AtfDnsCacheLookup(
+    _In_ const DNS_CACHE_CTX *ctx,
+    _In_ const IPV6_RAW_ADDRESS *address,
+    _In_ UINT32 now,
+    _Out_opt_ CHAR *domainOut
+);
+
+//
+// Print the number of live entries
+//
+VOID AtfDnsCachePrintCtx(const DNS_CACHE_CTX *ctx);
+
+//
+// Drop a reference to the cache, the cache is freed with the last reference
+//
+VOID AtfDnsCacheFree(DNS_CACHE_CTX **ctx);
+
+//
+// Current time of the cache, in seconds of interrupt time
+//
+static __forceinline UINT32 AtfDnsCacheNow(VOID)
+{
+    return (UINT32)(KeQueryInterruptTime() / 10000000ULL);
+}
+
+//
+// IPv4-mapped address of an IPv4 address (in the byte order of IPV4_PREFIX_ENTRY, as WFP supplies it)
+//
+static __forceinline VOID AtfDnsCacheMapIpv4(UINT32 ipv4, IPV6_RAW_ADDRESS *addressOut)
+{
+    addressOut->a.q.qword[0] = 0;
+    addressOut->a.d.dword[2] = 0;
+    addressOut->a.b.byte[10] = 0xff;
+    addressOut->a.b.byte[11] = 0xff;
+    addressOut->a.b.byte[12] = (UINT8)(ipv4 >> 24);
+    addressOut->a.b.byte[13] = (UINT8)(ipv4 >> 16);
+    addressOut->a.b.byte[14] = (UINT8)(ipv4 >> 8);
+    addressOut->a.b.byte[15] = (UINT8)ipv4;
+}
+
+//EOF
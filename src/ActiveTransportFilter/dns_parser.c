@@ -0,0 +1,221 @@
+#include <ntddk.h>
+
+#include "dns_parser.h"
+
+#include "../common/domain_dafsa_format.h"
+
+// Label length byte: the top two bits select a length, or a compression pointer (0x40 and 0x80 are reserved)
+#define DNS_LABEL_TYPE_MASK             0xc0
+#define DNS_LABEL_TYPE_POINTER          0xc0
+
+ATF_ERROR AtfDnsParseResponse(const UINT8 *msg, size_t msgLength, DNS_RESPONSE *responseOut)
+{
+    if (!msg || !responseOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    // Offsets are kept in 16 bits, a UDP payload is never larger
+    if (msgLength < DNS_HEADER_SIZE || msgLength > MAXUINT16) {
+        return ATF_BAD_DATA;
+    }
+
+    responseOut->numOfAddresses = 0;
+    responseOut->numOfCnames = 0;
+
+    responseOut->id = AtfDnsRead16(&msg[0]);
+    responseOut->flags = AtfDnsRead16(&msg[2]);
+
+    const UINT16 flags = responseOut->flags;
+    if (!(flags & DNS_FLAG_RESPONSE) || (flags & DNS_FLAG_OPCODE_MASK) != DNS_OPCODE_QUERY) {
+        return ATF_BAD_DATA;
+    }
+
+    const UINT16 qdCount = AtfDnsRead16(&msg[4]);
+    const UINT16 anCount = AtfDnsRead16(&msg[6]);
+    if (qdCount != 1) {
+        return ATF_BAD_DATA;
+    }
+
+    size_t offset = AtfDnsSkipName(msg, msgLength, DNS_HEADER_SIZE);
+    if (!offset || msgLength - offset < DNS_QUESTION_FIXED_SIZE) {
+        return ATF_BAD_DATA;
+    }
+
+    responseOut->questionOffset = DNS_HEADER_SIZE;
+    responseOut->questionType = AtfDnsRead16(&msg[offset]);
+    offset += DNS_QUESTION_FIXED_SIZE;
+
+    // The answers of a failed or truncated response are not trusted
+    if ((flags & DNS_FLAG_RCODE_MASK) != DNS_RCODE_NOERROR || (flags & DNS_FLAG_TRUNCATED)) {
+        return ATF_ERROR_OK;
+    }
+
+    const UINT32 numOfAnswers = min(anCount, DNS_MAX_ANSWERS);
+    for (UINT32 i = 0; i < numOfAnswers; i++) {
+        offset = AtfDnsSkipName(msg, msgLength, offset);
+        if (!offset || msgLength - offset < DNS_RR_FIXED_SIZE) {
+            return ATF_BAD_DATA;
+        }
+
+        const UINT16 type = AtfDnsRead16(&msg[offset]);
+        const UINT16 rrClass = AtfDnsRead16(&msg[offset + 2]);
+        const UINT32 ttl = AtfDnsRead32(&msg[offset + 4]);
+        const UINT16 rdLength = AtfDnsRead16(&msg[offset + 8]);
+        offset += DNS_RR_FIXED_SIZE;
+
+        if (msgLength - offset < rdLength) {
+            return ATF_BAD_DATA;
+        }
+
+        if (rrClass == DNS_CLASS_IN) {
+            if ((type == DNS_TYPE_A && rdLength == 4) || (type == DNS_TYPE_AAAA && rdLength == 16)) {
+                if (responseOut->numOfAddresses < DNS_MAX_ADDRESS_RECORDS) {
+                    DNS_ADDRESS_RECORD *record = &responseOut->addresses[responseOut->numOfAddresses++];
+                    record->rdataOffset = (UINT16)offset;
+                    record->type = type;
+                    record->ttl = ttl;
+                }
+            } else if (type == DNS_TYPE_CNAME && rdLength) {
+                if (responseOut->numOfCnames < DNS_MAX_CNAME_RECORDS) {
+                    responseOut->cnameOffsets[responseOut->numOfCnames++] = (UINT16)offset;
+                }
+            }
+        }
+
+        offset += rdLength;
+    }
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfDnsParseQuery(const UINT8 *msg, size_t msgLength, DNS_QUERY *queryOut)
+{
+    if (!msg || !queryOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    if (msgLength < DNS_HEADER_SIZE || msgLength > MAXUINT16) {
+        return ATF_BAD_DATA;
+    }
+
+    queryOut->id = AtfDnsRead16(&msg[0]);
+    queryOut->flags = AtfDnsRead16(&msg[2]);
+
+    const UINT16 flags = queryOut->flags;
+    if ((flags & DNS_FLAG_RESPONSE) || (flags & DNS_FLAG_OPCODE_MASK) != DNS_OPCODE_QUERY) {
+        return ATF_BAD_DATA;
+    }
+
+    const UINT16 qdCount = AtfDnsRead16(&msg[4]);
+    const UINT16 anCount = AtfDnsRead16(&msg[6]);
+    const UINT16 nsCount = AtfDnsRead16(&msg[8]);
+    if (qdCount != 1 || anCount || nsCount) {
+        return ATF_BAD_DATA;
+    }
+
+    const size_t offset = AtfDnsSkipName(msg, msgLength, DNS_HEADER_SIZE);
+    if (!offset || msgLength - offset < DNS_QUESTION_FIXED_SIZE) {
+        return ATF_BAD_DATA;
+    }
+
+    queryOut->questionLength = (UINT16)(offset + DNS_QUESTION_FIXED_SIZE - DNS_HEADER_SIZE);
+    queryOut->questionType = AtfDnsRead16(&msg[offset]);
+    queryOut->questionClass = AtfDnsRead16(&msg[offset + 2]);
+
+    return ATF_ERROR_OK;
+}
+
+size_t AtfDnsDecodeName(const UINT8 *msg, size_t msgLength, size_t offset, CHAR nameOut[DNS_NAME_BUFFER_SIZE])
+{
+    if (!msg || !nameOut) {
+        return 0;
+    }
+
+    size_t nameLength = 0;
+    UINT32 numOfPointers = 0;
+
+    // Pointers must go strictly backwards, from the position of the pointer itself
+    size_t limit = msgLength;
+
+    for (;;) {
+        if (offset >= limit) {
+            return 0;
+        }
+
+        const UINT8 length = msg[offset];
+        if ((length & DNS_LABEL_TYPE_MASK) == DNS_LABEL_TYPE_POINTER) {
+            if (offset + 1 >= limit || ++numOfPointers > DNS_MAX_POINTERS) {
+                return 0;
+            }
+
+            const size_t target = ((size_t)(length & ~DNS_LABEL_TYPE_MASK) << 8) | msg[offset + 1];
+            if (target >= offset) {
+                return 0;
+            }
+
+            limit = offset;
+            offset = target;
+            continue;
+        }
+
+        if (length & DNS_LABEL_TYPE_MASK) {
+            return 0;
+        }
+
+        if (!length) {
+            break;
+        }
+
+        // The label, and the separator before it
+        const size_t labelStart = offset + 1;
+        if (length > limit - labelStart || nameLength + (nameLength ? 1 : 0) + length > DNS_MAX_NAME_LENGTH) {
+            return 0;
+        }
+
+        if (nameLength) {
+            nameOut[nameLength++] = DOMAIN_DAFSA_LABEL_SEPARATOR;
+        }
+
+        for (size_t i = 0; i < length; i++) {
+            const UINT8 c = msg[labelStart + i];
+            if (c < DOMAIN_DAFSA_MIN_CHAR || c > DOMAIN_DAFSA_MAX_CHAR || c == DOMAIN_DAFSA_LABEL_SEPARATOR) {
+                return 0;
+            }
+
+            nameOut[nameLength++] = (CHAR)c;
+        }
+
+        offset = labelStart + length;
+    }
+
+    nameOut[nameLength] = '\0';
+
+    return nameLength;
+}
+
+size_t AtfDnsSkipName(const UINT8 *msg, size_t msgLength, size_t offset)
+{
+    if (!msg) {
+        return 0;
+    }
+
+    while (offset < msgLength) {
+        const UINT8 length = msg[offset];
+        if ((length & DNS_LABEL_TYPE_MASK) == DNS_LABEL_TYPE_POINTER) {
+            return (offset + 2 <= msgLength) ? offset + 2 : 0;
+        }
+
+        if (length & DNS_LABEL_TYPE_MASK) {
+            return 0;
+        }
+
+        offset += 1 + (size_t)length;
+        if (!length) {
+            return offset;
+        }
+    }
+
+    return 0;
+}
+
+//EOF
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+//
+// DNS wire format parser (RFC 1035) for the messages seen by the datagram callouts
+//
+//  The parser reads the message in place, as NDIS supplies it: a parsed message only holds offsets into the
+//   buffer, and a name is only decoded (into a caller buffer) when it is looked up. Every read is checked against
+//   the message length, so a truncated or malformed message is rejected rather than read past its end.
+//
+//  Compression pointers must point before the label that holds them, so a name always terminates, and a name is
+//   at most DNS_MAX_NAME_LENGTH chars whatever the pointers say.
+//
+//  Names are decoded in the dotted form the domain blocklist is searched with (domain_dafsa.h), without the
+//   trailing dot. A name with a char that cannot be in a listed domain (a '.' within a label, a space or a non
+//   ASCII char) is not decoded, it can never be blocklisted.
+//
+#define DNS_HEADER_SIZE                 12
+#define DNS_PORT                        53
+
+// Largest message over UDP without EDNS (RFC 1035 4.2.1), and the UDP header before it
+#define DNS_UDP_MAX_CLASSIC_SIZE        512
+#define DNS_UDP_HEADER_SIZE             8
+
+// Longest decoded name and label, and the buffer a name is decoded into
+#define DNS_MAX_NAME_LENGTH             253
+#define DNS_MAX_LABEL_LENGTH            63
+#define DNS_NAME_BUFFER_SIZE            (DNS_MAX_NAME_LENGTH + 2)
+
+// Compression pointers followed per name, a name of single char labels needs at most 127
+#define DNS_MAX_POINTERS                128
+
+// Answer records examined per message, and the records kept of each kind
+#define DNS_MAX_ANSWERS                 64
+#define DNS_MAX_ADDRESS_RECORDS         32
+#define DNS_MAX_CNAME_RECORDS           8
+
+// Header flags
+#define DNS_FLAG_RESPONSE               0x8000
+#define DNS_FLAG_OPCODE_MASK            0x7800
+#define DNS_FLAG_TRUNCATED              0x0200
+#define DNS_FLAG_RECURSION_DESIRED      0x0100
+#define DNS_FLAG_RECURSION_AVAILABLE    0x0080
+#define DNS_FLAG_RCODE_MASK             0x000f
+
+#define DNS_OPCODE_QUERY                0x0000
+#define DNS_RCODE_NOERROR               0
+#define DNS_RCODE_NXDOMAIN              3
+
+// Type and class after the question name, and the fixed part of a resource record after its name
+#define DNS_QUESTION_FIXED_SIZE         4
+#define DNS_RR_FIXED_SIZE               10
+
+// Record types and class
+#define DNS_TYPE_A                      1
+#define DNS_TYPE_CNAME                  5
+#define DNS_TYPE_AAAA                   28
+#define DNS_CLASS_IN                    1
+
+//
+// Address record of an answer, the address is rdataLength (4 or 16) bytes at rdataOffset
+//
+typedef struct _dns_address_record {
+    UINT16                          rdataOffset;
+    UINT16                          type;
+    UINT32                          ttl;
+} DNS_ADDRESS_RECORD, *PDNS_ADDRESS_RECORD;
+
+//
+// Parsed response, offsets are from the start of the message
+//
+typedef struct _dns_response {
+    UINT16                          id;
+    UINT16                          flags;
+
+    // Name and type of the (single) question
+    UINT16                          questionOffset;
+    UINT16                          questionType;
+
+    // A and AAAA answers, in message order. Answers past DNS_MAX_ADDRESS_RECORDS are not kept
+    UINT32                          numOfAddresses;
+    DNS_ADDRESS_RECORD              addresses[DNS_MAX_ADDRESS_RECORDS];
+
+    // Targets of the CNAME answers (the aliases the question resolves through)
+    UINT32                          numOfCnames;
+    UINT16                          cnameOffsets[DNS_MAX_CNAME_RECORDS];
+} DNS_RESPONSE, *PDNS_RESPONSE;
+
+//
+// Parsed query, the question is questionLength bytes (name, type and class) at DNS_HEADER_SIZE
+//
+typedef struct _dns_query {
+    UINT16                          id;
+    UINT16                          flags;
+
+    UINT16                          questionLength;
+    UINT16                          questionType;
+    UINT16                          questionClass;
+} DNS_QUERY, *PDNS_QUERY;
+
+//
+// Parse a standard query response (QR set, opcode QUERY, one question), collecting its IN class A, AAAA and CNAME
+//  answers. The authority and additional sections are not read
+//  Returns ATF_BAD_DATA if the message is not a response, or is malformed before the end of the answer section
+//  A response with an error rcode, or a truncated response, is parsed and returned without answers
+//
+ATF_ERROR AtfDnsParseResponse(const UINT8 *msg, size_t msgLength, DNS_RESPONSE *responseOut);
+
+//
+// Parse a standard query (QR clear, opcode QUERY, one question and no answer or authority records)
+//  The additional section (an EDNS OPT record) is not read
+//  Returns ATF_BAD_DATA if the message is not such a query, or its question is malformed
+//
+ATF_ERROR AtfDnsParseQuery(const UINT8 *msg, size_t msgLength, DNS_QUERY *queryOut);
+
+//
+// Decode the name at offset into nameOut (DNS_NAME_BUFFER_SIZE chars, NULL terminated)
+//  Returns the length of the name, or 0 if it is malformed, the root name, or has a char that is not in
+//  DOMAIN_DAFSA_MIN_CHAR to DOMAIN_DAFSA_MAX_CHAR
+//
+size_t AtfDnsDecodeName(const UINT8 *msg, size_t msgLength, size_t offset, CHAR nameOut[DNS_NAME_BUFFER_SIZE]);
+
+//
+// Skip the name at offset, without following its pointers
+//  Returns the offset that follows the name, or 0 if it runs past the end of the message or has a bad label type
+//
+size_t AtfDnsSkipName(const UINT8 *msg, size_t msgLength, size_t offset);
+
+//
+// Read a big endian field, the caller checks the bounds
+//
+static __forceinline UINT16 AtfDnsRead16(const UINT8 *p)
+{
+    return (UINT16)(((UINT16)p[0] << 8) | p[1]);
+}
+
+static __forceinline UINT32 AtfDnsRead32(const UINT8 *p)
+{
+    return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | (UINT32)p[3];
+}
+
+//
+// Write a big endian field, the caller checks the bounds
+//
+static __forceinline VOID AtfDnsWrite16(UINT8 *p, UINT16 value)
+{
+    p[0] = (UINT8)(value >> 8);
+    p[1] = (UINT8)value;
+}
+
+static __forceinline VOID AtfDnsWrite32(UINT8 *p, UINT32 value)
+{
+    p[0] = (UINT8)(value >> 24);
+    p[1] = (UINT8)(value >> 16);
+    p[2] = (UINT8)(value >> 8);
+    p[3] = (UINT8)value;
+}
+
+//EOF
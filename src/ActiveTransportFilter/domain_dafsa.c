@@ -0,0 +1,404 @@
+#include <ntddk.h>
+
+#include <limits.h>
+
+#include "domain_dafsa.h"
+
+#include "mem.h"
+#include "trace.h"
+
+C_ASSERT(sizeof(DOMAIN_DAFSA_HEADER) % DOMAIN_DAFSA_ALIGNMENT == 0);
+
+//
+// Position of a walk: the node, and the number of chars of a chain node already matched
+//
+typedef struct _domain_dafsa_walk {
+    size_t                          node;
+    UINT32                          chainIndex;
+} DOMAIN_DAFSA_WALK, *PDOMAIN_DAFSA_WALK;
+
+//
+// Check the header, the node stream bounds, and the checksum
+//
+static BOOLEAN AtfDomainDafsaValidateHeader(const DOMAIN_DAFSA_HEADER *header, size_t imageSize);
+
+//
+// Parse every node of the stream, and check that every target is the offset of a node
+//
+static BOOLEAN AtfDomainDafsaValidateNodes(const DOMAIN_DAFSA_HEADER *header, const UINT8 *nodes);
+
+//
+// Size of the node at offset, 0 if it runs past the end of the stream or is malformed
+//
+static size_t AtfDomainDafsaNodeSize(const UINT8 *nodes, size_t nodesSize, size_t offset, UINT32 offsetWidth);
+
+//
+// Read a node offset (offsetWidth bytes, little endian)
+//
+static __forceinline size_t AtfDomainDafsaReadOffset(const UINT8 *p, UINT32 offsetWidth);
+
+//
+// Follow the transition for a char, returns FALSE if there is none
+//
+static __forceinline BOOLEAN AtfDomainDafsaStep(const DOMAIN_DAFSA_CTX *ctx, DOMAIN_DAFSA_WALK *walk, UINT8 c);
+
+//
+// Returns TRUE if a listed domain ends at the position of the walk
+//
+static __forceinline BOOLEAN AtfDomainDafsaIsFinal(const DOMAIN_DAFSA_CTX *ctx, const DOMAIN_DAFSA_WALK *walk);
+
+ATF_ERROR AtfDomainDafsaAdopt(const VOID *image, size_t imageSize, DOMAIN_DAFSA_CTX **ctxOut)
+{
+    if (!image || !ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    if (imageSize < sizeof(DOMAIN_DAFSA_HEADER) || imageSize % DOMAIN_DAFSA_ALIGNMENT) {
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    // The image is copied into its final non-paged allocation first, and validated there
+    const size_t ctxSize =
+        (sizeof(DOMAIN_DAFSA_CTX) + DOMAIN_DAFSA_ALIGNMENT - 1) & ~((size_t)DOMAIN_DAFSA_ALIGNMENT - 1);
+
+    DOMAIN_DAFSA_CTX *ctx = (DOMAIN_DAFSA_CTX *)ATF_MALLOC(ctxSize + imageSize);
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    UINT8 *imageCopy = (UINT8 *)ctx + ctxSize;
+    RtlCopyMemory(imageCopy, image, imageSize);
+
+    const DOMAIN_DAFSA_HEADER *header = (const DOMAIN_DAFSA_HEADER *)imageCopy;
+    if (!AtfDomainDafsaValidateHeader(header, imageSize)) {
+        ATF_FREE(ctx);
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    const UINT8 *nodes = &imageCopy[header->nodesOffset];
+    if (!AtfDomainDafsaValidateNodes(header, nodes)) {
+        ATF_FREE(ctx);
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    ctx->refCount = 1;
+    ctx->totalSize = ctxSize + imageSize;
+    ctx->header = header;
+    ctx->nodes = nodes;
+    ctx->nodesSize = (size_t)header->nodesSize;
+    ctx->offsetWidth = header->offsetWidth;
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+DOMAIN_DAFSA_CTX *AtfDomainDafsaReference(DOMAIN_DAFSA_CTX *ctx)
+{
+    if (ctx) {
+        ctx->refCount++;
+    }
+
+    return ctx;
+}
+
+size_t AtfDomainDafsaSearch(const DOMAIN_DAFSA_CTX *ctx, const CHAR *name, size_t nameLength)
+{
+    if (!ctx || !name) {
+        return 0;
+    }
+
+    // A fully qualified name ends with the root label
+    if (nameLength && name[nameLength - 1] == DOMAIN_DAFSA_LABEL_SEPARATOR) {
+        nameLength--;
+    }
+
+    if (!nameLength || nameLength > DOMAIN_DAFSA_MAX_NAME_LENGTH) {
+        return 0;
+    }
+
+    DOMAIN_DAFSA_WALK walk = { 0, 0 };
+
+    // Labels are walked from the last one, their chars in order
+    size_t labelEnd = nameLength;
+    for (;;) {
+        size_t labelStart = labelEnd;
+        while (labelStart && name[labelStart - 1] != DOMAIN_DAFSA_LABEL_SEPARATOR) {
+            labelStart--;
+        }
+
+        if (labelStart == labelEnd) {
+            return 0;
+        }
+
+        for (size_t i = labelStart; i < labelEnd; i++) {
+            UINT8 c = (UINT8)name[i];
+            if (c >= 'A' && c <= 'Z') {
+                c |= 0x20;
+            }
+
+            if (!AtfDomainDafsaStep(ctx, &walk, c)) {
+                return 0;
+            }
+        }
+
+        // A listed domain ending on this label boundary covers the whole name
+        if (AtfDomainDafsaIsFinal(ctx, &walk)) {
+            return nameLength - labelStart;
+        }
+
+        if (!labelStart || !AtfDomainDafsaStep(ctx, &walk, DOMAIN_DAFSA_LABEL_SEPARATOR)) {
+            return 0;
+        }
+
+        labelEnd = labelStart - 1;
+    }
+}
+
+VOID AtfDomainDafsaPrintCtx(const DOMAIN_DAFSA_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] Domain DAFSA Stats: Num of domains: %llu, Num of states: %llu, Num of nodes: %llu, Image size: %llu",
+        ctx->header->numOfDomains, ctx->header->numOfStates, ctx->header->numOfNodes, ctx->header->imageSize);
+}
+
+VOID AtfDomainDafsaFree(DOMAIN_DAFSA_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    DOMAIN_DAFSA_CTX *c = *ctx;
+    *ctx = NULL;
+
+    if (--c->refCount) {
+        return;
+    }
+
+    ATF_FREE(c);
+}
+
+static BOOLEAN AtfDomainDafsaValidateHeader(const DOMAIN_DAFSA_HEADER *header, size_t imageSize)
+{
+    if (header->magic != DOMAIN_DAFSA_MAGIC || header->version != DOMAIN_DAFSA_VERSION) {
+        ATF_DEBUG(AtfDomainDafsaValidateHeader, "Bad image magic or version");
+        return FALSE;
+    }
+
+    if (header->headerSize != sizeof(DOMAIN_DAFSA_HEADER) || header->imageSize != imageSize || header->flags) {
+        ATF_DEBUG(AtfDomainDafsaValidateHeader, "Bad image size or flags");
+        return FALSE;
+    }
+
+    if (header->offsetWidth < DOMAIN_DAFSA_MIN_OFFSET_WIDTH || header->offsetWidth > DOMAIN_DAFSA_MAX_OFFSET_WIDTH) {
+        ATF_DEBUG(AtfDomainDafsaValidateHeader, "Bad image offset width");
+        return FALSE;
+    }
+
+    // At least the root node must exist, and every offset must be representable
+    if (header->nodesOffset < sizeof(DOMAIN_DAFSA_HEADER) ||
+        header->nodesOffset > imageSize ||
+        !header->nodesSize ||
+        header->nodesSize > imageSize - header->nodesOffset ||
+        header->nodesSize > (1ULL << (header->offsetWidth * 8)))
+    {
+        ATF_DEBUG(AtfDomainDafsaValidateHeader, "Image node stream out of bounds");
+        return FALSE;
+    }
+
+    const UINT8 *payload = (const UINT8 *)header + sizeof(DOMAIN_DAFSA_HEADER);
+    if (AtfIpv4ImageChecksum(payload, imageSize - sizeof(DOMAIN_DAFSA_HEADER)) != header->checksum) {
+        ATF_DEBUG(AtfDomainDafsaValidateHeader, "Image checksum mismatch");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN AtfDomainDafsaValidateNodes(const DOMAIN_DAFSA_HEADER *header, const UINT8 *nodes)
+{
+    const size_t nodesSize = (size_t)header->nodesSize;
+    const UINT32 offsetWidth = header->offsetWidth;
+
+    //
+    // Node boundaries, one bit per byte of the stream. Only used here, at PASSIVE_LEVEL, so it is paged
+    //
+    const size_t bitmapSize = (nodesSize + 7) / 8;
+    UINT8 *nodeStarts = (UINT8 *)AtfMallocPP(bitmapSize);
+    if (!nodeStarts) {
+        ATF_DEBUG(AtfMallocPP, "Failed to allocate the node bitmap");
+        return FALSE;
+    }
+    RtlZeroMemory(nodeStarts, bitmapSize);
+
+    BOOLEAN isValid = TRUE;
+
+    size_t offset = 0;
+    UINT64 numOfNodes = 0;
+    while (offset < nodesSize) {
+        const size_t nodeSize = AtfDomainDafsaNodeSize(nodes, nodesSize, offset, offsetWidth);
+        if (!nodeSize) {
+            ATF_DEBUGA("[atftrace] Domain image node at %llu is malformed", (UINT64)offset);
+            isValid = FALSE;
+            break;
+        }
+
+        // A chain without a jump continues with the next node, which must exist
+        const UINT8 flags = nodes[offset];
+        if ((flags & DOMAIN_DAFSA_NODE_CHAIN) && !(flags & DOMAIN_DAFSA_NODE_JUMP) && offset + nodeSize >= nodesSize) {
+            ATF_DEBUG(AtfDomainDafsaValidateNodes, "Image ends with an open chain");
+            isValid = FALSE;
+            break;
+        }
+
+        nodeStarts[offset / 8] |= (UINT8)(1 << (offset % 8));
+        offset += nodeSize;
+        numOfNodes++;
+    }
+
+    if (isValid && numOfNodes != header->numOfNodes) {
+        ATF_DEBUG(AtfDomainDafsaValidateNodes, "Bad number of nodes");
+        isValid = FALSE;
+    }
+
+    // Every target must be the start of a node
+    for (offset = 0; isValid && offset < nodesSize;) {
+        const UINT8 flags = nodes[offset];
+        const size_t nodeSize = AtfDomainDafsaNodeSize(nodes, nodesSize, offset, offsetWidth);
+
+        const UINT8 *targets = NULL;
+        size_t numOfTargets = 0;
+        if (flags & DOMAIN_DAFSA_NODE_CHAIN) {
+            if (flags & DOMAIN_DAFSA_NODE_JUMP) {
+                targets = &nodes[offset + 1 + (flags & DOMAIN_DAFSA_CHAIN_LENGTH_MASK)];
+                numOfTargets = 1;
+            }
+        } else {
+            numOfTargets = nodes[offset + 1];
+            targets = &nodes[offset + 2 + numOfTargets];
+        }
+
+        for (size_t i = 0; i < numOfTargets; i++) {
+            const size_t target = AtfDomainDafsaReadOffset(&targets[i * offsetWidth], offsetWidth);
+            if (target >= nodesSize || !(nodeStarts[target / 8] & (1 << (target % 8)))) {
+                ATF_DEBUGA("[atftrace] Domain image node at %llu has a bad target", (UINT64)offset);
+                isValid = FALSE;
+                break;
+            }
+        }
+
+        offset += nodeSize;
+    }
+
+    AtfFreePP(nodeStarts);
+
+    return isValid;
+}
+
+static size_t AtfDomainDafsaNodeSize(const UINT8 *nodes, size_t nodesSize, size_t offset, UINT32 offsetWidth)
+{
+    const size_t available = nodesSize - offset;
+    const UINT8 flags = nodes[offset];
+
+    const UINT8 *chars = NULL;
+    size_t numOfChars = 0;
+    size_t nodeSize = 0;
+
+    if (flags & DOMAIN_DAFSA_NODE_CHAIN) {
+        numOfChars = flags & DOMAIN_DAFSA_CHAIN_LENGTH_MASK;
+        nodeSize = 1 + numOfChars + ((flags & DOMAIN_DAFSA_NODE_JUMP) ? offsetWidth : 0);
+        if (!numOfChars || nodeSize > available) {
+            return 0;
+        }
+
+        chars = &nodes[offset + 1];
+    } else {
+        if (flags & ~DOMAIN_DAFSA_NODE_FINAL || available < 2) {
+            return 0;
+        }
+
+        numOfChars = nodes[offset + 1];
+        nodeSize = 2 + numOfChars * (1 + (size_t)offsetWidth);
+        if (nodeSize > available) {
+            return 0;
+        }
+
+        chars = &nodes[offset + 2];
+
+        // The lookup stops at the first char above the one it searches for
+        for (size_t i = 1; i < numOfChars; i++) {
+            if (chars[i] <= chars[i - 1]) {
+                return 0;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < numOfChars; i++) {
+        if (chars[i] < DOMAIN_DAFSA_MIN_CHAR || chars[i] > DOMAIN_DAFSA_MAX_CHAR) {
+            return 0;
+        }
+    }
+
+    return nodeSize;
+}
+
+static __forceinline size_t AtfDomainDafsaReadOffset(const UINT8 *p, UINT32 offsetWidth)
+{
+    size_t offset = (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16);
+    if (offsetWidth > DOMAIN_DAFSA_MIN_OFFSET_WIDTH) {
+        offset |= (size_t)p[3] << 24;
+    }
+
+    return offset;
+}
+
+static __forceinline BOOLEAN AtfDomainDafsaStep(const DOMAIN_DAFSA_CTX *ctx, DOMAIN_DAFSA_WALK *walk, UINT8 c)
+{
+    const UINT8 *node = &ctx->nodes[walk->node];
+    const UINT8 flags = node[0];
+
+    if (flags & DOMAIN_DAFSA_NODE_CHAIN) {
+        const UINT32 length = flags & DOMAIN_DAFSA_CHAIN_LENGTH_MASK;
+        if (node[1 + walk->chainIndex] != c) {
+            return FALSE;
+        }
+
+        if (++walk->chainIndex < length) {
+            return TRUE;
+        }
+
+        walk->chainIndex = 0;
+        walk->node = (flags & DOMAIN_DAFSA_NODE_JUMP) ?
+            AtfDomainDafsaReadOffset(&node[1 + length], ctx->offsetWidth) : walk->node + 1 + length;
+
+        return TRUE;
+    }
+
+    const UINT32 numOfEdges = node[1];
+    const UINT8 *chars = &node[2];
+    for (UINT32 i = 0; i < numOfEdges; i++) {
+        if (chars[i] == c) {
+            walk->node = AtfDomainDafsaReadOffset(&chars[numOfEdges + i * ctx->offsetWidth], ctx->offsetWidth);
+            return TRUE;
+        }
+
+        if (chars[i] > c) {
+            break;
+        }
+    }
+
+    return FALSE;
+}
+
+static __forceinline BOOLEAN AtfDomainDafsaIsFinal(const DOMAIN_DAFSA_CTX *ctx, const DOMAIN_DAFSA_WALK *walk)
+{
+    // Chain nodes only hold non-final states
+    const UINT8 flags = ctx->nodes[walk->node];
+    return !(flags & DOMAIN_DAFSA_NODE_CHAIN) && (flags & DOMAIN_DAFSA_NODE_FINAL);
+}
+
+//EOF
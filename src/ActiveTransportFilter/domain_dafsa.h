@@ -0,0 +1,72 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/domain_dafsa_format.h"
+
+#include "mem.h"
+
+//
+// Domain blocklist, a reversed-label DAFSA compiled by the service (see domain_dafsa_format.h)
+//
+//  As with the IPv4 image, the driver validates the image once, copies it into a single non-paged allocation and
+//   walks it in place. The validation parses every node and checks every target against the node boundaries, so a
+//   walk never reads out of the image.
+//
+//  A lookup takes a name as it appears on the wire or in a TLS/QUIC handshake, i.e. www.Example.com or
+//   www.example.com. (a trailing dot is ignored), and reads each byte of it twice: once to find the label
+//   boundaries from the end, and once to walk the automaton. Nothing is copied or allocated.
+//
+//  An image is never modified after it is adopted, so configs cloned from each other share it. The reference count
+//   is only changed by the IOCTL handlers (serialized by gIoctlLock), never by the callouts.
+//
+
+//
+// Image instance context, the image itself follows the context in the same allocation
+//
+typedef struct _domain_dafsa_ctx {
+    // Number of configs referencing the image
+    size_t                          refCount;
+
+    // Size of the whole allocation (context and image), in bytes
+    size_t                          totalSize;
+
+    const DOMAIN_DAFSA_HEADER       *header;
+
+    // Node stream, the root is at offset 0
+    const UINT8                     *nodes;
+    size_t                          nodesSize;
+    UINT32                          offsetWidth;
+} DOMAIN_DAFSA_CTX, *PDOMAIN_DAFSA_CTX;
+
+//
+// Validate an image (header, bounds, checksum, every node and every target) and copy it into a new context
+//  Returns ATF_CORRUPT_IMAGE if the image is rejected
+//
+ATF_ERROR AtfDomainDafsaAdopt(const VOID *image, size_t imageSize, DOMAIN_DAFSA_CTX **ctxOut);
+
+//
+// Take another reference on the image, for a cloned config
+//
+DOMAIN_DAFSA_CTX *AtfDomainDafsaReference(DOMAIN_DAFSA_CTX *ctx);
+
+//
+// Search the blocklist for a name (ASCII, not NULL terminated, case-insensitive)
+//  Returns the length of the listed domain covering the name, i.e. 11 for example.com when searching
+//  www.example.com, or 0 if the name is not covered
+//
+size_t AtfDomainDafsaSearch(const DOMAIN_DAFSA_CTX *ctx, const CHAR *name, size_t nameLength);
+
+//
+// Print image info
+//
+VOID AtfDomainDafsaPrintCtx(const DOMAIN_DAFSA_CTX *ctx);
+
+//
+// Drop a reference to the image, the image is freed with the last reference
+//
+VOID AtfDomainDafsaFree(DOMAIN_DAFSA_CTX **ctx);
+
+//EOF
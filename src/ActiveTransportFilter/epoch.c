@@ -0,0 +1,68 @@
+#include <ntddk.h>
+
+#include "epoch.h"
+
+#include "trace.h"
+
+//
+// Flip the current epoch, then wait for the readers of the previous epoch to exit
+//
+static VOID AtfEpochFlipAndDrain(ATF_EPOCH *epoch);
+
+VOID AtfEpochInit(ATF_EPOCH *epoch)
+{
+    if (!epoch) {
+        return;
+    }
+
+    RtlZeroMemory(epoch, sizeof(ATF_EPOCH));
+}
+
+VOID AtfEpochEnter(ATF_EPOCH *epoch, ATF_EPOCH_GUARD *guard)
+{
+    guard->slot = KeGetCurrentProcessorIndex() % ATF_EPOCH_MAX_SLOTS;
+    guard->epoch = epoch->currentEpoch & 1;
+
+    // Full barrier, the published pointer cannot be loaded before the reader is counted
+    InterlockedIncrement(&epoch->slots[guard->slot].readers[guard->epoch]);
+}
+
+VOID AtfEpochExit(ATF_EPOCH *epoch, const ATF_EPOCH_GUARD *guard)
+{
+    InterlockedDecrement(&epoch->slots[guard->slot].readers[guard->epoch]);
+}
+
+VOID AtfEpochSynchronize(ATF_EPOCH *epoch)
+{
+    //
+    // A reader may have loaded the epoch just before a flip and been counted in the other epoch, so one drain
+    //  is not enough. After two flips both counters have been drained once
+    //
+    AtfEpochFlipAndDrain(epoch);
+    AtfEpochFlipAndDrain(epoch);
+}
+
+static VOID AtfEpochFlipAndDrain(ATF_EPOCH *epoch)
+{
+    const LONG oldEpoch = epoch->currentEpoch & 1;
+
+    InterlockedExchange(&epoch->currentEpoch, oldEpoch ^ 1);
+
+    LARGE_INTEGER interval;
+    interval.QuadPart = ATF_EPOCH_DRAIN_INTERVAL;
+
+    for (;;) {
+        LONG readers = 0;
+        for (ULONG i = 0; i < ATF_EPOCH_MAX_SLOTS; i++) {
+            readers += InterlockedCompareExchange(&epoch->slots[i].readers[oldEpoch], 0, 0);
+        }
+
+        if (!readers) {
+            break;
+        }
+
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+}
+
+//EOF
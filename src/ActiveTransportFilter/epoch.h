@@ -0,0 +1,68 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+
+//
+// Epoch-based reclamation (RCU-style) for objects that are read from the WFP callouts
+//
+//  Readers never block and never take a lock. A reader enters the epoch, loads the published pointer, uses it,
+//   and exits. A writer builds the replacement object off to the side, publishes it with a single atomic pointer
+//   swap, and then calls AtfEpochSynchronize() to wait until every reader that could still hold the old pointer
+//   has exited. Only then is the old object freed.
+//
+//  Readers are counted in two epochs (the current epoch flips between 0 and 1). AtfEpochSynchronize() flips the
+//   epoch and waits for the old epoch to drain, twice, so that both counters are drained once. New readers always
+//   enter the epoch that is not being waited on, so the writer cannot be starved by a steady stream of packets.
+//
+//  The counters are split into per-processor slots, each on its own cache line, so that callouts running on
+//   different processors do not contend on the same counter. A reader records its slot and epoch in an
+//   ATF_EPOCH_GUARD and exits on that slot, even if it was moved to another processor in between.
+//
+#define ATF_EPOCH_MAX_SLOTS             64
+#define ATF_EPOCH_CACHE_LINE            64
+
+// Interval between drain checks in AtfEpochSynchronize(), in 100ns units (negative is relative)
+#define ATF_EPOCH_DRAIN_INTERVAL        (-10000LL)
+
+typedef struct DECLSPEC_ALIGN(ATF_EPOCH_CACHE_LINE) _atf_epoch_slot {
+    volatile LONG                   readers[2];
+} ATF_EPOCH_SLOT, *PATF_EPOCH_SLOT;
+
+typedef struct _atf_epoch {
+    volatile LONG                   currentEpoch;
+    ATF_EPOCH_SLOT                  slots[ATF_EPOCH_MAX_SLOTS];
+} ATF_EPOCH, *PATF_EPOCH;
+
+//
+// Reader state between AtfEpochEnter() and AtfEpochExit()
+//
+typedef struct _atf_epoch_guard {
+    ULONG                           slot;
+    LONG                            epoch;
+} ATF_EPOCH_GUARD, *PATF_EPOCH_GUARD;
+
+//
+// Initialize the epoch counters
+//
+VOID AtfEpochInit(ATF_EPOCH *epoch);
+
+//
+// Enter a read-side critical section, callable at any IRQL <= DISPATCH_LEVEL
+//  Pointers published under this epoch may be loaded after this call, and stay valid until AtfEpochExit()
+//
+VOID AtfEpochEnter(ATF_EPOCH *epoch, ATF_EPOCH_GUARD *guard);
+
+//
+// Exit a read-side critical section
+//
+VOID AtfEpochExit(ATF_EPOCH *epoch, const ATF_EPOCH_GUARD *guard);
+
+//
+// Wait for every reader that entered before this call to exit, PASSIVE_LEVEL only
+//  The caller must have already unpublished the old pointer. Writers must be serialized by the caller
+//
+VOID AtfEpochSynchronize(ATF_EPOCH *epoch);
+
+//EOF
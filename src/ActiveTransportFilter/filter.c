@@ -77,7 +77,7 @@
 // 
 //   filter.c intercepts WFP layers as specified in the config, the primary NDIS/WFP hook being AtfFilterCallbackTcpIpv4().
 // 
-//   The filter callback is non-synchronized. Once a packet is received, filter.c will parse the packet and access the ruleset. 
+//   The filter callback takes no locks (see [Config Updates While Running]). Once a packet is received, filter.c will parse the packet and access the ruleset. 
 //   From there, a rule will be applied on the packet: PASS, BLOCK, or ALERT. The ini can set the default state on how to 
 //   handle traffic.
 // 
@@ -216,45 +216,130 @@
 // 
 // [Trie Space Complexity for Trie]
 // 
-//   The trie requires a great deal of memory to store IPs, but this number will gradually decrease as more and more IPs are being added
-//   to the trie, some of which share the same octets/nodes.
-// 
-//   Let's do some math:
+//   The first variant of the trie stored each node as a full array of 256 pointers. Let's do some math:
 // 
 //   1) On a 64-bit system, we have 8 bytes per pointer. 
-//   2) Each node requires 255 pointers, meaning 255 * sizeof(VOID *);
-//   3) Total space per each node: 2040bytes!
+//   2) Each node requires 256 pointers, meaning 256 * sizeof(VOID *);
+//   3) Total space per each node: 2048bytes!
 // 
 //   For one IP address, we need four nodes:
-//   4) 2040 * 4 = 8160bytes per IP!
+//   4) 2048 * 4 = 8192bytes per IP!
 // 
 //   Lastly, let's say that 100000 blacklisted addresses exist in the trie, at *worst*. This means that none of the addresses share any 
 //    common prefix and so a new node is needed for each IP.
 // 
-//   This will obviously not be the case in a real world distribution, but let's just assume that:
+//   5) 8192b * 100000 = 819,200,000
+//   6) 819,200,000bytes = ~816MB of non-paged memory, which is far too much for the large online feeds.
+// 
+//   The trie is now bitmap-compressed (see ipv4_trie.h, the idea comes from "Poptrie"). The walk is the same, one octet per level
+//   and at most 4 steps, but instead of an array of pointers, each node has a 256-bit bitmap of which octets have children. The children
+//   of a node are stored next to each other in one array, and the index of a child is the number of set bits in the bitmap below the 
+//   octet (a popcount). The last octet is a "leaf", which is a bit in a second bitmap plus one byte in a packed leaf vector.
 // 
-//   5) 8160b * 100000 = 816,000,000
-//   6) 816,000,000bytes = 816.0MB. 
+//   7) Each node is 80 bytes (two 256-bit bitmaps, a children pointer and a leaf vector pointer)
+//   8) At worst, 3 nodes + 1 leaf byte per IP, so 100000 unrelated IPs need ~24MB, and in practice much less since 
+//      addresses share their first octets.
 // 
-//   So to store 100K IPs with unreasonable distribution, we require about 816.0MB of space! This space is in non-paged memory as well,
-//   which is another draw back to the trie method. 
+//   The lookup cost per level is a bit test and a popcount over at most 4 words, which is negligable compared to the cache miss
+//   of loading the node, and the nodes are now small enough that the upper levels of the trie stay in cache.
 // 
-//   That said, we can limit the amount of non-paged memory used by the trie by limiting the IPs used. Keep in mind that the trie will
-//   also non-duplicate IPs, so if an online blacklist repeats the same IP a few times, the IP will not be re-added to the trie!
+//   The nodes are not allocated one by one from the pool. They are carved out of 1MB arena chunks (mem.h), so a large blacklist
+//   costs a few hundred pool allocations rather than millions, and freeing a config releases the chunks without walking the trie.
 // 
-//   All that in mind, physical memory vs computation time, I think it's better to sactifice memory for speed, especially when dealing
-//   with NDIS and the windows TCP/IP stack -- it's important to return from the callout as fast as possible.
+//   Keep in mind that the trie will also non-duplicate IPs, so if an online blacklist repeats the same IP a few times, the IP will 
+//   not be re-added to the trie!
 // 
-//   Another note: Since filter.c requires access-only (and will shut down WFP if a change is to be made in the trie), there is no need
-//   for atomic or synchronization primitives, further decreasing processing overhead. This is to be noted since WFP can call the callout
-//   in filter.c from various threads and contexts. The trie, so long as it's not modified, is thread-safe.
+//   Subnets (CIDR entries, e.g. 1.10.16.0/20) are stored as leaves on the level of their last partial octet, one leaf for each
+//   octet the subnet covers on that level. A /20 is 16 leaves on the third level, and a /8 is a single leaf on the root, rather 
+//   than 16M addresses. Each leaf stores the longest prefix covering it, and the search keeps walking while children exist, so
+//   the result is the longest-prefix-match (the callout logs the matched prefix length).
+// 
+//   Another note: filter.c never modifies a config that the callouts can see, so the trie is access-only and thread-safe. This is to be
+//   noted since WFP can call the callout in filter.c from various threads and contexts.
 // 
 //   Dev note: I tried to do modify the trie in real-time, with WFP running, by implementing spinlocks and mutexes to protect the trie state, 
 //   but this inevitably led to BSODs, specifically in the WaitForSingleObject() routine on the KMUTEX. More details on that on the README.md file.
 // 
-// Note: Adding or altering the trie requires WFP to be shutdown and callbacks unregistered from WFP.
-//  The trie can be appended to by invoking IOCTL_ATF_APPEND_IPV4_BLACKLIST while WFP is shutdown. The new IP pool will simply
-//  be added to the existing trie.
+// [IPv6]
+//   The TCP v6 layers go through AtfFilterCallbackTcpIpv6(). A trie walk over 128-bit addresses would take up to 16 steps, so
+//   IPv6 prefixes are kept in one hash table per distinct prefix length instead, and a lookup binary searches the lengths
+//   (ipv6_bsl.h). Feeds mostly use /128, /64 and /48, so that is 2 or 3 hash probes of a single cache line each.
+// 
+//   IPv4-mapped addresses (::ffff:a.b.c.d, dual-stack sockets) are IPv4 peers. They are searched in the IPv4 lookup engine
+//   and image, with the IPv4 blocklist action, and mapped blocklist entries longer than /96 are stored there as well.
+// 
+// [5-Tuple Rules]
+//   Besides the blocklists, the ini can define rules on the local and remote subnet, port range, protocol and direction of an
+//   IPv4 flow ("block 10.0.0.0/8 to tcp/445"). The service sorts them by priority and sends them in a bulk upload, and the
+//   driver compiles them with tuple space search (ipv4_tss.h): one hash table per combination of prefix lengths, with port
+//   ranges split into port prefixes. A flow probes each table of its direction and protocol once, so the work per packet is
+//   bounded by the number of tables rather than the number of rules. The first matching rule decides the flow, before the
+//   blocklist is searched. IPv4-mapped IPv6 flows are not matched against the rules.
+// 
+// [Verdict Policy]
+//   The order of the checks and the action of each match are not hard-coded. The service compiles the ini switches (rules first,
+//   the direction switches, then each blocklist with its action) into a small bytecode program (policy_format.h) that is sent
+//   with the default config. The driver verifies it when the config is created: jumps only go forward, so it terminates in at
+//   most POLICY_MAX_INSNS steps. It is then specialized for each layer, so that the tests a layer decides on its own (and the
+//   jumps they leave behind) are not dispatched per flow. Each callout inlines the interpreter (policy.h), and the lookups it
+//   needs are done on demand by filter.c.
+//   A different policy only needs a different program, not a new driver.
+// 
+// [DNS Snooping]
+//   Domains cannot be matched on a TCP flow, the flow only has addresses. When a DNS layer is enabled, the datagram callouts
+//   (AtfFilterCallbackDatagram()) parse the inbound DNS responses, and if the question or one of its CNAME aliases is in the
+//   domain blocklist, the answered addresses go into a small fixed-size cache (dns_cache.h) with the TTL of their record. The
+//   policy searches the remote address of a flow in that cache (POLICY_SET_DNS_DOMAINS) with the DNS blocklist action, so the
+//   connect that follows the lookup is matched, and logged with the domain.
+//   The cache is the only part of a config written by the callouts, its slots are guarded by sequence locks, so the
+//   transport callouts still never wait.
+//   The outbound queries are searched in the domain blocklist as well. With a dnsBlocklistAction of BLOCK, the query for a
+//   blocklisted name is absorbed, and answered with a synthesized NXDOMAIN or null address response (dns_block.h) injected
+//   in the receive path (inject.h), so the lookup fails at once instead of the connects timing out.
+// 
+// [TLS Server Name]
+//   Many blocklisted domains are served from CDN addresses shared with domains that are not, so the addresses resolved for them
+//   over-block, and a client with its own resolver (DNS over HTTPS) is not snooped at all. When a stream layer is enabled, the
+//   stream callouts (AtfFilterCallbackStream()) read the first data sent on each outbound TCP flow. If it is a TLS ClientHello,
+//   its server name (tls_parser.h) is searched in the domain blocklist, and the flow is alerted on (with the name in
+//   ATF_FLT_DATA.fqDnsName) or dropped with the DNS blocklist action.
+//   Each flow is parsed once: as soon as it is decided, the callout hands it back to WFP (FWPS_STREAM_ACTION_ALLOW_CONNECTION) and
+//   is not called for it again. A ClientHello larger than the first segment is only waited for (FWPS_STREAM_ACTION_NEED_MORE_DATA)
+//   when the name was not in the data already sent. The data is copied to a per-processor buffer, so nothing is allocated per flow.
+// 
+// [QUIC Server Name]
+//   HTTP/3 runs over QUIC (UDP/443), where the ClientHello is sent in the CRYPTO frames of the client Initial packets, under keys
+//   derived from the connection ID in clear (quic_parser.h). The QUIC callouts (AtfFilterCallbackQuic()) are registered on the
+//   datagram layers with the stream layers, so a blocklisted name is not reached over HTTP/3 when it is blocked over TLS.
+//   A datagram flow is not handed back to WFP once decided, so the callout sees every datagram sent to port 443. Most are passed
+//   over on their first byte (1-RTT short headers), the Initials of a decided flow with one lookup, and only the Initials of an
+//   undecided flow are unprotected and parsed. The verdict of each flow, and the CRYPTO stream of a ClientHello that spans
+//   Initials, are kept in fixed-size tables (quic_flow.h) allocated with the domain blocklist. The datagrams of a blocked flow
+//   are dropped with a send error, so the client falls back to TCP, where the TLS callouts see the same name.
+// 
+// [Payload Signatures]
+//   The service compiles a signature file (literals) into a prefilter and an Aho-Corasick automaton (payload_sig_format.h),
+//   and the stream callouts scan the payload of every TCP flow, sent and received, with the payload signature action. A flow
+//   is given a small context when it is first classified (FwpsFlowAssociateContext0), that holds the scan state of each
+//   direction, so a signature split over segments is found. The data is read in place from the MDLs of the stream, it is
+//   never copied, and the prefilter passes over most of it without touching the automaton (payload_sig.h).
+//   A flow is kept by the callout while it is scanned (FWPS_STREAM_ACTION_NONE), and handed back to WFP on its first match:
+//   it is dropped, or alerted on once. The contexts are freed by WFP when their flow ends (AtfFilterFreeStreamFlow()). Before
+//   the callouts are unregistered, new contexts are refused and the existing ones removed (AtfFilterRemoveStreamFlows()), and
+//   WFP is waited for until it has freed them all (AtfFilterWaitStreamFlows()). A flow that started with another image
+//   starts over with the new one.
+// 
+// [Config Updates While Running]
+//   A config is never altered in place. To change the ruleset (new ini, appended blacklist, bulk upload), ioctl.c builds a complete new 
+//   CONFIG_CTX off to the side, and filter.c publishes it with a single atomic pointer swap (AtfFilterStoreDefaultConfig()).
+//   The callout takes no locks: it enters an epoch (epoch.h, a pair of per-processor reader counters), loads the config pointer, 
+//   and exits the epoch when it is done with the config. After the swap, the writer waits for every callout that could still hold 
+//   the old pointer to exit, and only then frees the old config. 
+// 
+//   So WFP keeps filtering with the old ruleset until the swap, and with the new one right after it, there is no unfiltered window.
+//   The price is that both configs exist in memory while the new one is built.
+// 
+//   Note: the enabled WFP layers are only read when WFP is started, so a change of layers still requires a WFP restart.
 // 
 // IOCTL: filter.c is configured using the following process:
 // 
@@ -295,13 +380,20 @@
 //      c. The data returned from curl is parsed and stored into a chunk of memory consisting of an array of DWORDS, for each IP
 //      d. Serialize the buffer
 //     
-//  3. Usermode calls IOCTL_ATF_APPEND_IPV4_BLACKLIST, which sends the blacklisted IPs to the driver
-//      a. ioctl.c intercepts the request and passes it to config.c
+//  3. Usermode opens a bulk upload session, which sends all of the blacklisted IPs to the driver at once
+//      (IOCTL_ATF_BULK_UPLOAD_BEGIN, one or more IOCTL_ATF_BULK_UPLOAD_DATA direct I/O transfers, IOCTL_ATF_BULK_UPLOAD_COMMIT). 
+//      Small lists can still be sent with IOCTL_ATF_APPEND_IPV4_BLACKLIST, BLACKLIST_IPV4_MAX_SIZE bytes at a time
+//      a. ioctl.c stages the transfers, and on commit passes the whole buffer to config.c
 //      b. config.c at this point begins reading the IP address buffer as sent by ioctl.c
 //      c. If a "patricia trie" needs to be created, this is the time. Otherwise, if IPs are supplied in the default config,
 //          a trie will already exist
 //      d. ipv4_trie.c is called to populate the current trie context (which is stored in the config context)
 //      e. config.c sends the finished config to filter.c
+//     With the trie engine, the service instead compiles the list into a relocatable lookup image (ipv4_image_builder.cpp,
+//      BULK_PAYLOAD_IPV4_IMAGE). ipv4_image.c validates the image and adopts it in a single allocation, it is searched
+//      alongside the trie built from the ini
+//     The image may carry a binary fuse prefilter (ini: ipv4_prefilter), so that most misses skip the node walk. A
+//      prefilter-only image may return false positives, so its matches are alerted on but never blocked
 // 
 // [WFP and Filter Engine Startup]
 //  4. The Usermode service starts the driver service (IOCTL_ATF_WFP_SERVICE_START)
@@ -319,7 +411,8 @@
 //  5. The usermode service receives an ATF_ERROR_OK if everything above succeeded. 
 // 
 // [Appending or Modifying the Ruleset/config]
-// Further: To add IPs to the blacklist or modify the config context, the WFP subsystem needs to be halted, here is the process
+// Further: Blacklists and configs can be sent while WFP is running (see [Config Updates While Running] above). WFP only needs to be
+//  halted to change the enabled layers, or to flush the config, here is the process
 //  1. The service calls IOCTL_ATF_WFP_SERVICE_STOP to stop the WFP service
 //      a. ioctl.c callback is invoked, which instructs wfp.c to unregister ATF from the WFP subsystem
 //      b. wfp.c calls on DestroyWfp(), which destroys the callout layers, filters, etc, and detaches from WFP
@@ -381,6 +474,7 @@
 #include <ntstrsafe.h>
 #include <ip2string.h>
 #include <inaddr.h>
+#include <in6addr.h>
 
 #include <initguid.h>
 #include <guiddef.h>
@@ -391,35 +485,325 @@
 #include "trace.h"
 
 #include "config.h"
+#include "epoch.h"
+#include "mem.h"
+#include "dns_block.h"
+#include "inject.h"
+#include "tls_parser.h"
+#include "quic_flow.h"
+
+//
+// Current (published) config context structure
+//  The callouts load this pointer inside gConfigEpoch, and never see a config that is being modified. Writers
+//  (IOCTL handlers, serialized by gIoctlLock) build a new config and publish it with AtfFilterStoreDefaultConfig()
+//
+static CONFIG_CTX * volatile gConfigCtx = NULL;
 
 //
-// Current config context structure (may be modified by config.cpp)
+// Tracks the callouts that may hold a reference to a config, so a replaced config is freed only after they exit
 //
-static CONFIG_CTX* gConfigCtx = NULL;
+static ATF_EPOCH gConfigEpoch;
 
 //
 // For debugging, print the target ip from DWORd to string
 //
 static VOID AtfFilterPrintIP(enum _flow_direction dir, const ATF_FLT_DATA *data);
 
+//
+// Returns the DNS message of a datagram, read in place or copied into storage (DNS_UDP_HEADER_SIZE +
+//  DNS_UDP_MAX_CLASSIC_SIZE bytes), or NULL if it cannot be read
+//
+static const UINT8 *AtfFilterGetDnsMessage(
+    _In_ NET_BUFFER_LIST *netBufferList,
+    _Out_ UINT8 *storage,
+    _Out_ size_t *msgLengthOut
+);
+
+//
+// Report an outbound DNS query for a blocklisted domain, and with ACTION_BLOCK drop it and inject its response
+//
+static VOID AtfFilterBlockDnsQuery(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _In_ const UINT8 *msg,
+    _In_ size_t msgLength,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ BOOLEAN isIpv6
+);
+
+//
+// Per-processor buffers the first record of a stream, or a QUIC Initial that is not contiguous, is copied into
+//  (TLS_MAX_HELLO_SIZE bytes each), only used at DISPATCH_LEVEL. NULL when no stream layer is enabled
+//
+static UINT8 *gStreamBuffers = NULL;
+static ULONG gNumOfStreamBuffers = 0;
+
+//
+// Parse the first data sent on a stream, copied into the buffer of the processor
+//
+static TLS_HELLO_RESULT AtfFilterReadClientHello(
+    _In_ const FWPS_STREAM_DATA0 *streamData,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *requiredLengthOut
+);
+
+//
+// Per-flow state of the stream callouts, associated with the flows while payload signatures are scanned
+//
+typedef struct _atf_stream_direction {
+    // Image the stream was scanned with, the stream is reset when the config has another one
+    UINT32                          imageId;
+
+    PAYLOAD_SIG_STREAM              scan;
+} ATF_STREAM_DIRECTION;
+
+typedef struct _atf_stream_flow {
+    // Entry of gStreamFlows, unlinked (empty) once the context is being removed
+    LIST_ENTRY                      entry;
+
+    // To remove the context from its flow (AtfFilterRemoveStreamFlows())
+    UINT64                          flowHandle;
+    UINT16                          layerId;
+    UINT32                          calloutId;
+
+    // The server name of the flow is decided, a signature was found (the flow is not scanned anymore)
+    BOOLEAN                         isServerNameDecided;
+    BOOLEAN                         isSignatureFound;
+
+    // Sent data, then received data. The data of a direction is classified in order, one segment at a time
+    ATF_STREAM_DIRECTION            directions[2];
+} ATF_STREAM_FLOW;
+
+//
+// Flows with a context, protected by gStreamFlowLock. Initialized by AtfFilterInitStream()
+//
+static LIST_ENTRY gStreamFlows;
+static KSPIN_LOCK gStreamFlowLock;
+
+// Contexts not freed yet, including those being associated, protected by gStreamFlowLock
+static size_t gNumOfStreamFlows = 0;
+
+// Set by AtfFilterRemoveStreamFlows(), no context is associated anymore. gStreamFlowsFreed is signaled once the last
+//  context is freed
+static BOOLEAN gIsStreamFlowsClosed = FALSE;
+static KEVENT gStreamFlowsFreed;
+
+//
+// Allocate the context of a flow and associate it, returns NULL if the flow cannot have one
+//
+static ATF_STREAM_FLOW *AtfFilterAssociateStreamFlow(
+    _In_ const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _In_ UINT16 layerId,
+    _In_ UINT32 calloutId
+);
+
+//
+// Scan the data of a stream for the payload signatures of the config. Returns TRUE if the flow is to be dropped
+//
+static BOOLEAN AtfFilterScanStream(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _Inout_ ATF_STREAM_FLOW *flow,
+    _In_ const FWPS_STREAM_DATA0 *streamData,
+    _In_ BOOLEAN isSend,
+    _In_ BOOLEAN isIpv6
+);
+
+//
+// Scan the data of a stream in place, MDL by MDL. Returns the first signature found, or PAYLOAD_SIG_NO_MATCH
+//
+static UINT32 AtfFilterScanStreamData(
+    _In_ const PAYLOAD_SIG_CTX *payloadSigCtx,
+    _Inout_ PAYLOAD_SIG_STREAM *stream,
+    _In_ const FWPS_STREAM_DATA0 *streamData
+);
+
+//
+// Unprotect and parse a QUIC Initial sent to a server, read in place or copied into the buffer of the processor.
+//  Returns the verdict of its flow (QUIC_FLOW_*)
+//
+static UINT8 AtfFilterInspectQuic(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ NET_BUFFER *netBuffer,
+    _In_ const QUIC_FLOW_KEY *key,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *domainLengthOut
+);
+
+//
+// Indexes of the flow fields of a layer (FWPS_FIELD_*), for the layers the server names are read at
+//
+typedef struct _atf_filter_flow_fields {
+    UINT32                          localAddress;
+    UINT32                          remoteAddress;
+    UINT32                          localPort;
+    UINT32                          remotePort;
+
+    UINT8                           protocol;
+    const CHAR                      *protocolName;
+} ATF_FILTER_FLOW_FIELDS;
+
+// Stream layers (TLS), IPv4 then IPv6
+static const ATF_FILTER_FLOW_FIELDS gStreamFields[2] = {
+    {
+        FWPS_FIELD_STREAM_V4_IP_LOCAL_ADDRESS, FWPS_FIELD_STREAM_V4_IP_REMOTE_ADDRESS,
+        FWPS_FIELD_STREAM_V4_IP_LOCAL_PORT, FWPS_FIELD_STREAM_V4_IP_REMOTE_PORT,
+        RULE_PROTOCOL_TCP, "TLS"
+    },
+    {
+        FWPS_FIELD_STREAM_V6_IP_LOCAL_ADDRESS, FWPS_FIELD_STREAM_V6_IP_REMOTE_ADDRESS,
+        FWPS_FIELD_STREAM_V6_IP_LOCAL_PORT, FWPS_FIELD_STREAM_V6_IP_REMOTE_PORT,
+        RULE_PROTOCOL_TCP, "TLS"
+    }
+};
+
+// Datagram layers (QUIC), IPv4 then IPv6
+static const ATF_FILTER_FLOW_FIELDS gDatagramFields[2] = {
+    {
+        FWPS_FIELD_DATAGRAM_DATA_V4_IP_LOCAL_ADDRESS, FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_ADDRESS,
+        FWPS_FIELD_DATAGRAM_DATA_V4_IP_LOCAL_PORT, FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_PORT,
+        RULE_PROTOCOL_UDP, "QUIC"
+    },
+    {
+        FWPS_FIELD_DATAGRAM_DATA_V6_IP_LOCAL_ADDRESS, FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_ADDRESS,
+        FWPS_FIELD_DATAGRAM_DATA_V6_IP_LOCAL_PORT, FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_PORT,
+        RULE_PROTOCOL_UDP, "QUIC"
+    }
+};
+
+//
+// Report a flow to a blocklisted server name. Returns TRUE if the flow is to be dropped
+//
+static BOOLEAN AtfFilterReportServerName(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const ATF_FILTER_FLOW_FIELDS *fields,
+    _In_ const CHAR *name,
+    _In_ size_t nameLength,
+    _In_ size_t domainLength,
+    _In_ BOOLEAN isIpv6
+);
+
+//
+// Report a flow whose payload matches a signature. Returns TRUE if the flow is to be dropped
+//
+static BOOLEAN AtfFilterReportSignature(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const ATF_FILTER_FLOW_FIELDS *fields,
+    _In_ const CHAR *name,
+    _In_ BOOLEAN isSend,
+    _In_ BOOLEAN isIpv6
+);
+
+C_ASSERT(sizeof(((ATF_FLT_DATA *)0)->fqDnsName) >= TLS_NAME_BUFFER_SIZE);
+
+//
+// Apply the ruleset of a config to a parsed IPv4 flow
+//
+static ATF_ERROR AtfFilterProcessIpv4(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const ATF_FLT_DATA *data,
+    _In_ enum _flow_direction dir
+);
+
+//
+// Apply the ruleset of a config to a parsed IPv6 flow
+//
+static ATF_ERROR AtfFilterProcessIpv6(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const ATF_FLT_DATA_V6 *data,
+    _In_ enum _flow_direction dir
+);
+
+//
+// Lookups of the policy program of a flow (POLICY_ENV), one of data and dataV6 is set
+//  domainName (DNS_CACHE_DOMAIN_BUFFER_SIZE chars) receives the domain of a POLICY_SET_DNS_DOMAINS match
+//
+typedef struct _atf_filter_lookup_ctx {
+    const CONFIG_CTX                *configCtx;
+    const ATF_FLT_DATA              *data;
+    const ATF_FLT_DATA_V6           *dataV6;
+    UINT8                           direction;
+    CHAR                            *domainName;
+} ATF_FILTER_LOOKUP_CTX, *PATF_FILTER_LOOKUP_CTX;
+
+//
+// POLICY_SEARCH_SET_FN of IPv4 flows, the IPv6 blocklist never matches
+//
+static POLICY_SEARCH_SET_FN AtfFilterSearchSetIpv4;
+
+//
+// POLICY_CLASSIFY_FN of IPv4 flows, searches the 5-tuple rules of the config
+//
+static POLICY_CLASSIFY_FN AtfFilterClassifyIpv4;
+
+//
+// POLICY_SEARCH_SET_FN of IPv6 flows, IPv4-mapped addresses are searched in the IPv4 blocklist
+//
+static POLICY_SEARCH_SET_FN AtfFilterSearchSetIpv6;
+
+//
+// Map the verdict of a policy program to a filter signal (ATF_FILTER_SIGNAL_*)
+//
+static ATF_ERROR AtfFilterGetSignal(_In_ const POLICY_VERDICT *verdict);
+
+#if defined(ATF_MAIN_EVENT_OUTPUT)
+//
+// Log a BLOCK or ALERT verdict, with the rule or blocklist entry that caused it
+//
+static VOID AtfFilterLogVerdict(
+    _In_ const POLICY_VERDICT *verdict,
+    _In_ ATF_ERROR signal,
+    _In_ enum _flow_direction dir,
+    _In_ BOOLEAN isIpv6,
+    _In_ const CHAR *localIpStr,
+    _In_ SERVICE_PORT localPort,
+    _In_ const CHAR *remoteIpStr,
+    _In_ SERVICE_PORT remotePort,
+    _In_ const CHAR *domainName
+);
+#endif //ATF_MAIN_EVENT_OUTPUT
+
+//
+// Search the local and remote address of a flow (ips[0] and ips[1]) in the configured IPv4 lookup engine
+//  Outputs the prefix length of the longest matching blocklist entry, or 0 if there is no match
+//  isApproximate is set if a match only comes from a prefilter-only image, and may be a false positive
+//
+static VOID AtfFilterSearchIpv4(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const struct in_addr ips[2],
+    _Out_ UINT8 *localPrefixLength,
+    _Out_ UINT8 *remotePrefixLength,
+    _Out_ BOOLEAN *isApproximate
+);
+
 //
 // Initialize the filter engine
 //
 VOID AtfFilterInit(VOID)
 {
     gConfigCtx = NULL;
+
+    AtfEpochInit(&gConfigEpoch);
 }
 
 //
-// If an existing config exists, then replace it
+// Publish a config. If an existing config exists, then replace it
+//  The new config is visible to the callouts as soon as the pointer is swapped, the old config is freed once
+//  every callout that could still be using it has returned. WFP does not need to be stopped
 //
 VOID AtfFilterStoreDefaultConfig(const CONFIG_CTX *configCtx)
 {
-    if (gConfigCtx != NULL) {
-        AtfFilterFlushConfig();
-    }
+    CONFIG_CTX *oldConfigCtx = (CONFIG_CTX *)InterlockedExchangePointer((PVOID volatile *)&gConfigCtx, (PVOID)configCtx);
 
-    gConfigCtx = (CONFIG_CTX *)configCtx;
+    if (oldConfigCtx) {
+        AtfEpochSynchronize(&gConfigEpoch);
+        AtfFreeConfig(oldConfigCtx);
+    }
 
     ATF_DEBUG(AtfFilterStoreDefaultConfig, "Successfully loaded filter config");
 }
@@ -427,16 +811,18 @@ VOID AtfFilterStoreDefaultConfig(const CONFIG_CTX *configCtx)
 //
 // Return the current config
 //
-CONFIG_CTX *AtfFilterGetCurrentConfig(VOID)
+const CONFIG_CTX *AtfFilterGetCurrentConfig(VOID)
 {
     return gConfigCtx;
 }
 
 VOID AtfFilterFlushConfig(VOID)
 {
-    if (gConfigCtx) {
-        AtfFreeConfig(gConfigCtx);
-        gConfigCtx = NULL;
+    CONFIG_CTX *oldConfigCtx = (CONFIG_CTX *)InterlockedExchangePointer((PVOID volatile *)&gConfigCtx, NULL);
+
+    if (oldConfigCtx) {
+        AtfEpochSynchronize(&gConfigEpoch);
+        AtfFreeConfig(oldConfigCtx);
     }
 }
     
@@ -499,6 +885,8 @@ static ATF_ERROR AtfFilterParsePacket(
     dataOut->localPort = (SERVICE_PORT)fixedValues->incomingValue[FWPS_FIELD_OUTBOUND_TRANSPORT_V4_IP_LOCAL_PORT].value.uint16;
     dataOut->remotePort = (SERVICE_PORT)fixedValues->incomingValue[FWPS_FIELD_OUTBOUND_TRANSPORT_V4_IP_REMOTE_PORT].value.uint16;
 
+    dataOut->protocol = fixedValues->incomingValue[FWPS_FIELD_OUTBOUND_TRANSPORT_V4_IP_PROTOCOL].value.uint8;
+
     // Parse IP strings
     IN_ADDR localIp;
     localIp.S_un.S_addr = reverse_byte_order_uint32_t(dataOut->localIp.S_un.S_addr);
@@ -520,10 +908,6 @@ ATF_ERROR AtfFilterCallbackTcpIpv4(
     _In_ enum _flow_direction dir
 )
 {
-    DbgBreakPoint();
-
-    UNREFERENCED_PARAMETER(dir);
-
     VALIDATE_PARAMETER(fixedValues);
     VALIDATE_PARAMETER(classifyOut);
 
@@ -534,84 +918,1414 @@ ATF_ERROR AtfFilterCallbackTcpIpv4(
         return ATF_ERROR_OK;
     }
 
-    // Default action is PASS
+    //
+    // No locks on this path. The config is pinned by the epoch until AtfEpochExit(), even if it is 
+    //  replaced in the meantime
+    //
+    ATF_EPOCH_GUARD epochGuard;
+    AtfEpochEnter(&gConfigEpoch, &epochGuard);
+
+    ATF_ERROR atfError = ATF_FILTER_SIGNAL_PASS;
+
+    const CONFIG_CTX *configCtx = gConfigCtx;
+    if (configCtx) {
+        atfError = AtfFilterProcessIpv4(configCtx, &data, dir);
+    }
+
+    AtfEpochExit(&gConfigEpoch, &epochGuard);
+
+    return atfError;
+}
+
+//
+// The inbound and outbound v6 layers share the field indexes, as the v4 layers do
+//
+static ATF_ERROR AtfFilterParsePacketV6(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _Out_ ATF_FLT_DATA_V6 *dataOut
+)
+{
+    VALIDATE_PARAMETER(dataOut);
+    VALIDATE_PARAMETER(fixedValues);
+
+    RtlZeroMemory(dataOut, sizeof(ATF_FLT_DATA_V6));
+
+    const FWP_BYTE_ARRAY16 *localIp = fixedValues->incomingValue[FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_LOCAL_ADDRESS].value.byteArray16;
+    const FWP_BYTE_ARRAY16 *remoteIp = fixedValues->incomingValue[FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_REMOTE_ADDRESS].value.byteArray16;
+    if (!localIp || !remoteIp) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    RtlCopyMemory(&dataOut->localIp, localIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+    RtlCopyMemory(&dataOut->remoteIp, remoteIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+
+    dataOut->localPort = (SERVICE_PORT)fixedValues->incomingValue[FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_LOCAL_PORT].value.uint16;
+    dataOut->remotePort = (SERVICE_PORT)fixedValues->incomingValue[FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_REMOTE_PORT].value.uint16;
+
+    dataOut->protocol = fixedValues->incomingValue[FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_PROTOCOL].value.uint8;
+
+    // Parse IP strings, the addresses are already in network byte order
+    RtlIpv6AddressToStringA((const struct in6_addr *)&dataOut->localIp, dataOut->localIpStr);
+    RtlIpv6AddressToStringA((const struct in6_addr *)&dataOut->remoteIp, dataOut->remoteIpStr);
+
+    return ATF_ERROR_OK;
+}
+
+//
+// Filter callback for IPv6 (TCP)
+//
+ATF_ERROR AtfFilterCallbackTcpIpv6(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ enum _flow_direction dir
+)
+{
+    VALIDATE_PARAMETER(fixedValues);
+    VALIDATE_PARAMETER(classifyOut);
+
+    ATF_FLT_DATA_V6 data;
+    if (AtfFilterParsePacketV6(fixedValues, &data) != ATF_ERROR_OK) {
+        return ATF_ERROR_OK;
+    }
+
+    ATF_EPOCH_GUARD epochGuard;
+    AtfEpochEnter(&gConfigEpoch, &epochGuard);
+
     ATF_ERROR atfError = ATF_FILTER_SIGNAL_PASS;
 
-    // Do not do any action on inbound (if disabled)
-    if (dir == _flow_direction_inbound && !gConfigCtx->alertInbound) {
-        return atfError;
+    const CONFIG_CTX *configCtx = gConfigCtx;
+    if (configCtx) {
+        atfError = AtfFilterProcessIpv6(configCtx, &data, dir);
+    }
+
+    AtfEpochExit(&gConfigEpoch, &epochGuard);
+
+    return atfError;
+}
+
+//
+// Filter callback for the datagram layers, the v4 and v6 field indexes differ
+//
+ATF_ERROR AtfFilterCallbackDatagram(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _In_opt_ VOID *layerData,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ BOOLEAN isIpv6
+)
+{
+    VALIDATE_PARAMETER(fixedValues);
+    VALIDATE_PARAMETER(metaValues);
+    VALIDATE_PARAMETER(classifyOut);
+
+    if (!layerData) {
+        return ATF_ERROR_OK;
     }
 
-    // Do not do any action on outbound (if disabled)
-    if (dir == _flow_direction_outbound && !gConfigCtx->alertOutbound) {
-        return atfError;
+    const UINT32 direction = fixedValues->incomingValue[isIpv6 ? 
+        FWPS_FIELD_DATAGRAM_DATA_V6_DIRECTION : FWPS_FIELD_DATAGRAM_DATA_V4_DIRECTION].value.uint32;
+    const UINT8 protocol = fixedValues->incomingValue[isIpv6 ? 
+        FWPS_FIELD_DATAGRAM_DATA_V6_IP_PROTOCOL : FWPS_FIELD_DATAGRAM_DATA_V4_IP_PROTOCOL].value.uint8;
+    const UINT16 remotePort = fixedValues->incomingValue[isIpv6 ?
+        FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_PORT : FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_PORT].value.uint16;
+
+    // Only the queries to the resolvers and their responses are parsed
+    if (protocol != RULE_PROTOCOL_UDP || remotePort != DNS_PORT) {
+        return ATF_ERROR_OK;
     }
 
-    // Default state is PASS
-    BOOLEAN srcInTrie = FALSE;
-    BOOLEAN destInTrie = FALSE;
+    // The responses injected for the blocked queries come back through the callout
+    NET_BUFFER_LIST *netBufferList = (NET_BUFFER_LIST *)layerData;
+    if (AtfInjectIsSelfInjected(netBufferList)) {
+        return ATF_ERROR_OK;
+    }
 
-    // Search tries (trees?)
-    CHAR *badIp = NULL;
-    if (AtfIpv4TrieSearch(gConfigCtx->ipv4TrieCtx, data.localIp)) {
-        srcInTrie = TRUE;
-        badIp = data.localIpStr;
+    UINT8 storage[DNS_UDP_HEADER_SIZE + DNS_UDP_MAX_CLASSIC_SIZE];
+    size_t msgLength = 0;
+    const UINT8 *msg = AtfFilterGetDnsMessage(netBufferList, storage, &msgLength);
+    if (!msg) {
+        return ATF_ERROR_OK;
     }
-    if (AtfIpv4TrieSearch(gConfigCtx->ipv4TrieCtx, data.remoteIp)) {
-        destInTrie = TRUE;
-        badIp = data.remoteIpStr;
+
+    ATF_EPOCH_GUARD epochGuard;
+    AtfEpochEnter(&gConfigEpoch, &epochGuard);
+
+    const CONFIG_CTX *configCtx = gConfigCtx;
+    if (configCtx && configCtx->domainCtx) {
+        if (direction == FWP_DIRECTION_INBOUND) {
+            if (configCtx->dnsCacheCtx) {
+                AtfDnsCacheAddResponse(configCtx->dnsCacheCtx, configCtx->domainCtx, msg, msgLength, AtfDnsCacheNow());
+            }
+        } else if (configCtx->dnsBlocklistAction != ACTION_PASS) {
+            AtfFilterBlockDnsQuery(configCtx, fixedValues, metaValues, msg, msgLength, classifyOut, isIpv6);
+        }
     }
 
-    if (gConfigCtx->ipv4BlocklistAction == ACTION_BLOCK && (srcInTrie | destInTrie)) {
-        atfError = ATF_FILTER_SIGNAL_BLOCK;
-    } else if (gConfigCtx->ipv4BlocklistAction == ACTION_ALERT && (srcInTrie | destInTrie)) {
-        atfError = ATF_FILTER_SIGNAL_ALERT;
+    AtfEpochExit(&gConfigEpoch, &epochGuard);
+
+    return ATF_ERROR_OK;
+}
+
+static const UINT8 *AtfFilterGetDnsMessage(
+    _In_ NET_BUFFER_LIST *netBufferList,
+    _Out_ UINT8 *storage,
+    _Out_ size_t *msgLengthOut
+)
+{
+    NET_BUFFER *netBuffer = NET_BUFFER_LIST_FIRST_NB(netBufferList);
+    if (!netBuffer) {
+        return NULL;
     }
 
-    static const CHAR *actionNames[] = 
-    {
-        "PASS",
-        "BLOCK",
-        "ALERT"
-    };
+    const ULONG dataLength = NET_BUFFER_DATA_LENGTH(netBuffer);
+    if (dataLength < DNS_UDP_HEADER_SIZE + DNS_HEADER_SIZE) {
+        return NULL;
+    }
+
+    //
+    // The datagram is read in place when it is contiguous, which it almost always is. Otherwise only a classic
+    //  (non EDNS) message is copied, to keep the stack of the callout small
+    //
+    const UINT8 *datagram = (const UINT8 *)NdisGetDataBuffer(netBuffer, dataLength, NULL, 1, 0);
+    if (!datagram && dataLength <= DNS_UDP_HEADER_SIZE + DNS_UDP_MAX_CLASSIC_SIZE) {
+        datagram = (const UINT8 *)NdisGetDataBuffer(netBuffer, dataLength, storage, 1, 0);
+    }
+
+    if (!datagram) {
+        return NULL;
+    }
+
+    // The data of a datagram starts at its UDP header, the length in the header covers the whole datagram
+    if (AtfDnsRead16(&datagram[4]) != dataLength) {
+        return NULL;
+    }
+
+    *msgLengthOut = dataLength - DNS_UDP_HEADER_SIZE;
+
+    return &datagram[DNS_UDP_HEADER_SIZE];
+}
+
+static VOID AtfFilterBlockDnsQuery(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _In_ const UINT8 *msg,
+    _In_ size_t msgLength,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ BOOLEAN isIpv6
+)
+{
+    DNS_QUERY query;
+    CHAR name[DNS_NAME_BUFFER_SIZE];
+    size_t nameLength = 0;
+
+    const size_t domainLength = AtfDnsBlockClassifyQuery(configCtx->domainCtx, msg, msgLength, &query, name, &nameLength);
+    if (!domainLength) {
+        return;
+    }
+
+    const BOOLEAN isBlocked = configCtx->dnsBlocklistAction == ACTION_BLOCK && 
+        (classifyOut->rights & FWPS_RIGHT_ACTION_WRITE);
 
     // Report/log
 #if defined(ATF_MAIN_EVENT_OUTPUT)
-    if (atfError != ATF_FILTER_SIGNAL_PASS) {
-        ATF_DEBUGA("SIGNAL %s (%s): IP: %s (local:%s:%d -> remote:%s:%d)", 
-            atfError == ATF_FILTER_SIGNAL_BLOCK ? actionNames[ACTION_BLOCK] : actionNames[ACTION_ALERT],
-            dir == _flow_direction_inbound ? "INBOUND" : "OUTBOUND",
-            badIp,
-            data.localIpStr, data.localPort,
-            data.remoteIpStr, data.remotePort
-        );
-    }
+    ATF_DEBUGA("SIGNAL %s (OUTBOUND): DNS query: %s (matched %s)", 
+        isBlocked ? "BLOCK" : "ALERT", 
+        name, 
+        &name[nameLength - domainLength]);
 #endif //ATF_MAIN_EVENT_OUTPUT
 
-    // Do ops
-    switch(atfError)
-    {
-    case ATF_FILTER_SIGNAL_PASS:
-        {
-            return atfError;
-        } 
-        break;
-    case ATF_FILTER_SIGNAL_BLOCK:
-        {
+    // A filter of higher weight may already have decided the query, it is then only reported
+    if (!isBlocked) {
+        return;
+    }
 
-        }
-        break;
-    case ATF_FILTER_SIGNAL_ALERT:
-        {
+    //
+    // The query is absorbed, so the application gets no send error, only the response
+    //
+    classifyOut->actionType = FWP_ACTION_BLOCK;
+    classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+    classifyOut->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
 
-        } 
-        break;
-    default:
-        {
-            ATF_ERROR(AtfFilterCallbackTcpIpv4Inbound, atfError);
+    DNS_BLOCK_FLOW flow;
+    RtlZeroMemory(&flow, sizeof(flow));
+    flow.isIpv6 = isIpv6;
+
+    IF_INDEX interfaceIndex;
+    IF_INDEX subInterfaceIndex;
+
+    if (isIpv6) {
+        const FWP_BYTE_ARRAY16 *localIp = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V6_IP_LOCAL_ADDRESS].value.byteArray16;
+        const FWP_BYTE_ARRAY16 *remoteIp = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_ADDRESS].value.byteArray16;
+        if (!localIp || !remoteIp) {
+            return;
         }
-        break;
+
+        RtlCopyMemory(&flow.localAddress, localIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+        RtlCopyMemory(&flow.remoteAddress, remoteIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+
+        flow.localPort = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V6_IP_LOCAL_PORT].value.uint16;
+        flow.remotePort = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_PORT].value.uint16;
+
+        interfaceIndex = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V6_INTERFACE_INDEX].value.uint32;
+        subInterfaceIndex = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V6_SUB_INTERFACE_INDEX].value.uint32;
+    } else {
+        // Host byte order, as the TCP layers
+        AtfDnsWrite32(flow.localAddress.a.b.byte, 
+            fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V4_IP_LOCAL_ADDRESS].value.uint32);
+        AtfDnsWrite32(flow.remoteAddress.a.b.byte, 
+            fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_ADDRESS].value.uint32);
+
+        flow.localPort = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V4_IP_LOCAL_PORT].value.uint16;
+        flow.remotePort = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_PORT].value.uint16;
+
+        interfaceIndex = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V4_INTERFACE_INDEX].value.uint32;
+        subInterfaceIndex = fixedValues->incomingValue[FWPS_FIELD_DATAGRAM_DATA_V4_SUB_INTERFACE_INDEX].value.uint32;
     }
 
-    return ATF_ERROR_OK;
+    const COMPARTMENT_ID compartmentId = FWPS_IS_METADATA_FIELD_PRESENT(metaValues, FWPS_METADATA_FIELD_COMPARTMENT_ID) ?
+        (COMPARTMENT_ID)metaValues->compartmentId : UNSPECIFIED_COMPARTMENT_ID;
+
+    //
+    // The response is built in the buffer it is injected from, the injection owns the buffer
+    //
+    UINT8 *packet = (UINT8 *)ATF_MALLOC(DNS_BLOCK_MAX_PACKET_SIZE);
+    if (!packet) {
+        return;
+    }
+
+    const size_t packetLength = 
+        AtfDnsBlockBuildResponse(&flow, msg, &query, configCtx->dnsBlockResponse, packet, DNS_BLOCK_MAX_PACKET_SIZE);
+    if (!packetLength) {
+        ATF_FREE(packet);
+        return;
+    }
+
+    const NTSTATUS ntStatus = 
+        AtfInjectTransportReceive(packet, packetLength, isIpv6, compartmentId, interfaceIndex, subInterfaceIndex);
+    if (!NT_SUCCESS(ntStatus)) {
+        ATF_ERROR(AtfInjectTransportReceive, ntStatus);
+    }
+}
+
+NTSTATUS AtfFilterInitStream(VOID)
+{
+    // The flow list outlives a WFP restart, it is emptied before the callouts are unregistered
+    if (!gStreamFlows.Flink) {
+        KeInitializeSpinLock(&gStreamFlowLock);
+        InitializeListHead(&gStreamFlows);
+        KeInitializeEvent(&gStreamFlowsFreed, NotificationEvent, FALSE);
+    }
+
+    AtfFilterReopenStreamFlows();
+
+    if (gStreamBuffers) {
+        return STATUS_SUCCESS;
+    }
+
+    // Processors that can be added later are counted, the buffer is indexed by processor number
+    const ULONG numOfProcessors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    UINT8 *buffers = (UINT8 *)ATF_MALLOC((size_t)numOfProcessors * TLS_MAX_HELLO_SIZE);
+    if (!buffers) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    gNumOfStreamBuffers = numOfProcessors;
+    gStreamBuffers = buffers;
+
+    return STATUS_SUCCESS;
+}
+
+VOID AtfFilterDestroyStream(VOID)
+{
+    if (!gStreamBuffers) {
+        return;
+    }
+
+    ATF_FREE(gStreamBuffers);
+    gStreamBuffers = NULL;
+    gNumOfStreamBuffers = 0;
+}
+
+VOID AtfFilterFreeStreamFlow(UINT64 flowContext)
+{
+    ATF_STREAM_FLOW *flow = (ATF_STREAM_FLOW *)(ULONG_PTR)flowContext;
+    if (!flow) {
+        return;
+    }
+
+    KLOCK_QUEUE_HANDLE lockHandle;
+    KeAcquireInStackQueuedSpinLock(&gStreamFlowLock, &lockHandle);
+
+    // Already unlinked if the context is being removed by AtfFilterRemoveStreamFlows()
+    if (!IsListEmpty(&flow->entry)) {
+        RemoveEntryList(&flow->entry);
+    }
+
+    gNumOfStreamFlows--;
+    if (gIsStreamFlowsClosed && !gNumOfStreamFlows) {
+        KeSetEvent(&gStreamFlowsFreed, IO_NO_INCREMENT, FALSE);
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    ATF_FREE(flow);
+}
+
+VOID AtfFilterRemoveStreamFlows(VOID)
+{
+    if (!gStreamFlows.Flink) {
+        return;
+    }
+
+    //
+    // The stream filters are still live, so the callouts are refused new contexts before the list is emptied
+    //
+    KLOCK_QUEUE_HANDLE lockHandle;
+    KeAcquireInStackQueuedSpinLock(&gStreamFlowLock, &lockHandle);
+
+    gIsStreamFlowsClosed = TRUE;
+    if (!gNumOfStreamFlows) {
+        KeSetEvent(&gStreamFlowsFreed, IO_NO_INCREMENT, FALSE);
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    for (;;) {
+        KeAcquireInStackQueuedSpinLock(&gStreamFlowLock, &lockHandle);
+
+        if (IsListEmpty(&gStreamFlows)) {
+            KeReleaseInStackQueuedSpinLock(&lockHandle);
+            break;
+        }
+
+        ATF_STREAM_FLOW *flow = CONTAINING_RECORD(RemoveHeadList(&gStreamFlows), ATF_STREAM_FLOW, entry);
+        InitializeListHead(&flow->entry);
+
+        const UINT64 flowHandle = flow->flowHandle;
+        const UINT16 layerId = flow->layerId;
+        const UINT32 calloutId = flow->calloutId;
+
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+        //
+        // WFP calls the flow delete function, which frees the context. If the flow is already ending, it is called
+        //  anyway
+        //
+        FwpsFlowRemoveContext0(flowHandle, layerId, calloutId);
+    }
+}
+
+VOID AtfFilterReopenStreamFlows(VOID)
+{
+    if (!gStreamFlows.Flink) {
+        return;
+    }
+
+    KLOCK_QUEUE_HANDLE lockHandle;
+    KeAcquireInStackQueuedSpinLock(&gStreamFlowLock, &lockHandle);
+    gIsStreamFlowsClosed = FALSE;
+    KeClearEvent(&gStreamFlowsFreed);
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
+VOID AtfFilterWaitStreamFlows(VOID)
+{
+    if (!gStreamFlows.Flink) {
+        return;
+    }
+
+    KeWaitForSingleObject(&gStreamFlowsFreed, Executive, KernelMode, FALSE, NULL);
+}
+
+ATF_ERROR AtfFilterCallbackStream(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ VOID *layerData,
+    _In_ UINT32 calloutId,
+    _In_ UINT64 flowContext,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ BOOLEAN isIpv6
+)
+{
+    VALIDATE_PARAMETER(fixedValues);
+    VALIDATE_PARAMETER(metaValues);
+    VALIDATE_PARAMETER(classifyOut);
+
+    FWPS_STREAM_CALLOUT_IO_PACKET0 *streamPacket = (FWPS_STREAM_CALLOUT_IO_PACKET0 *)layerData;
+    if (!streamPacket || !streamPacket->streamData) {
+        return ATF_ERROR_OK;
+    }
+
+    // A filter of higher weight has already decided the data
+    if (!(classifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return ATF_ERROR_OK;
+    }
+
+    const FWPS_STREAM_DATA0 *streamData = streamPacket->streamData;
+    const BOOLEAN isSend = (streamData->flags & FWPS_STREAM_FLAG_SEND) != 0;
+
+    // Only the flows this host connects are clients, the data sent on an accepted flow is never a ClientHello
+    const UINT32 direction = fixedValues->incomingValue[isIpv6 ?
+        FWPS_FIELD_STREAM_V6_DIRECTION : FWPS_FIELD_STREAM_V4_DIRECTION].value.uint32;
+
+    ATF_STREAM_FLOW *flow = (ATF_STREAM_FLOW *)(ULONG_PTR)flowContext;
+
+    ATF_EPOCH_GUARD epochGuard;
+    AtfEpochEnter(&gConfigEpoch, &epochGuard);
+
+    FWPS_STREAM_ACTION_TYPE streamAction = FWPS_STREAM_ACTION_ALLOW_CONNECTION;
+    UINT32 countBytesRequired = 0;
+
+    // Set while the callout still has to see the flow, its data is then let through (FWPS_STREAM_ACTION_NONE)
+    BOOLEAN isFlowKept = FALSE;
+
+    const CONFIG_CTX *configCtx = gConfigCtx;
+    if (configCtx) {
+        const BOOLEAN isScanned = configCtx->payloadSigCtx && configCtx->payloadSignatureAction != ACTION_PASS;
+        if (isScanned && !flow) {
+            flow = AtfFilterAssociateStreamFlow(metaValues, fixedValues->layerId, calloutId);
+        }
+
+        if (configCtx->domainCtx && configCtx->dnsBlocklistAction != ACTION_PASS && 
+            direction == FWP_DIRECTION_OUTBOUND && !(flow && flow->isServerNameDecided)) 
+        {
+            if (!isSend) {
+                // Data received before any is sent (a server that speaks first) is let through, the server name is
+                //  read from the first data sent
+                isFlowKept = TRUE;
+            } else {
+                CHAR name[TLS_NAME_BUFFER_SIZE];
+                size_t nameLength = 0;
+                size_t requiredLength = 0;
+
+                const TLS_HELLO_RESULT result = AtfFilterReadClientHello(streamData, name, &nameLength, &requiredLength);
+                if (result == TLS_HELLO_NAME) {
+                    const size_t domainLength = AtfDomainDafsaSearch(configCtx->domainCtx, name, nameLength);
+                    if (domainLength && 
+                        AtfFilterReportServerName(configCtx, fixedValues, &gStreamFields[isIpv6], name, nameLength, domainLength, isIpv6)) 
+                    {
+                        streamAction = FWPS_STREAM_ACTION_DROP_CONNECTION;
+                    }
+                } else if (result == TLS_HELLO_INCOMPLETE && !(streamData->flags & FWPS_STREAM_FLAG_SEND_DISCONNECT)) {
+                    // The rest of the record is sent with the next segments, no more will come after a FIN
+                    streamAction = FWPS_STREAM_ACTION_NEED_MORE_DATA;
+                    countBytesRequired = (UINT32)requiredLength;
+                }
+
+                if (flow && streamAction == FWPS_STREAM_ACTION_ALLOW_CONNECTION) {
+                    flow->isServerNameDecided = TRUE;
+                }
+            }
+        }
+
+        //
+        // Data that is waited for comes back with the rest of the record, it is scanned then, and only once
+        //
+        if (isScanned && flow && !flow->isSignatureFound && streamAction == FWPS_STREAM_ACTION_ALLOW_CONNECTION) {
+            if (AtfFilterScanStream(configCtx, fixedValues, flow, streamData, isSend, isIpv6)) {
+                streamAction = FWPS_STREAM_ACTION_DROP_CONNECTION;
+            } else if (!flow->isSignatureFound) {
+                isFlowKept = TRUE;
+            }
+        }
+    }
+
+    AtfEpochExit(&gConfigEpoch, &epochGuard);
+
+    if (streamAction == FWPS_STREAM_ACTION_ALLOW_CONNECTION && isFlowKept) {
+        streamPacket->streamAction = FWPS_STREAM_ACTION_NONE;
+        classifyOut->actionType = FWP_ACTION_CONTINUE;
+        return ATF_ERROR_OK;
+    }
+
+    //
+    // Every stream action but NONE is taken with no classify action
+    //
+    streamPacket->streamAction = streamAction;
+    streamPacket->countBytesRequired = countBytesRequired;
+    classifyOut->actionType = FWP_ACTION_NONE;
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfFilterCallbackQuic(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_opt_ VOID *layerData,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ BOOLEAN isIpv6
+)
+{
+    VALIDATE_PARAMETER(fixedValues);
+    VALIDATE_PARAMETER(classifyOut);
+
+    if (!layerData) {
+        return ATF_ERROR_OK;
+    }
+
+    // A filter of higher weight has already decided the datagram
+    if (!(classifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return ATF_ERROR_OK;
+    }
+
+    const ATF_FILTER_FLOW_FIELDS *fields = &gDatagramFields[isIpv6];
+
+    const UINT32 direction = fixedValues->incomingValue[isIpv6 ? 
+        FWPS_FIELD_DATAGRAM_DATA_V6_DIRECTION : FWPS_FIELD_DATAGRAM_DATA_V4_DIRECTION].value.uint32;
+    const UINT8 protocol = fixedValues->incomingValue[isIpv6 ? 
+        FWPS_FIELD_DATAGRAM_DATA_V6_IP_PROTOCOL : FWPS_FIELD_DATAGRAM_DATA_V4_IP_PROTOCOL].value.uint8;
+    const UINT16 remotePort = fixedValues->incomingValue[fields->remotePort].value.uint16;
+
+    // Only the client Initials carry a ClientHello
+    if (direction != FWP_DIRECTION_OUTBOUND || protocol != RULE_PROTOCOL_UDP || remotePort != QUIC_PORT) {
+        return ATF_ERROR_OK;
+    }
+
+    NET_BUFFER *netBuffer = NET_BUFFER_LIST_FIRST_NB((NET_BUFFER_LIST *)layerData);
+    if (!netBuffer) {
+        return ATF_ERROR_OK;
+    }
+
+    //
+    // The packets of the established connections (short headers) and the datagrams too small to be an Initial are
+    //  passed over on the first bytes of the datagram, before anything else is read
+    //
+    const ULONG dataLength = NET_BUFFER_DATA_LENGTH(netBuffer);
+    if (dataLength < DNS_UDP_HEADER_SIZE + QUIC_MIN_INITIAL_SIZE || dataLength > TLS_MAX_HELLO_SIZE) {
+        return ATF_ERROR_OK;
+    }
+
+    UINT8 storage[DNS_UDP_HEADER_SIZE + QUIC_INITIAL_PEEK_SIZE];
+    const UINT8 *header = (const UINT8 *)NdisGetDataBuffer(netBuffer, sizeof(storage), storage, 1, 0);
+    if (!header || !AtfQuicIsInitial(&header[DNS_UDP_HEADER_SIZE], dataLength - DNS_UDP_HEADER_SIZE)) {
+        return ATF_ERROR_OK;
+    }
+
+    QUIC_FLOW_KEY key;
+    RtlZeroMemory(&key, sizeof(key));
+
+    if (isIpv6) {
+        const FWP_BYTE_ARRAY16 *localIp = fixedValues->incomingValue[fields->localAddress].value.byteArray16;
+        const FWP_BYTE_ARRAY16 *remoteIp = fixedValues->incomingValue[fields->remoteAddress].value.byteArray16;
+        if (!localIp || !remoteIp) {
+            return ATF_ERROR_OK;
+        }
+
+        RtlCopyMemory(&key.localAddress, localIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+        RtlCopyMemory(&key.remoteAddress, remoteIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+    } else {
+        AtfDnsCacheMapIpv4(fixedValues->incomingValue[fields->localAddress].value.uint32, &key.localAddress);
+        AtfDnsCacheMapIpv4(fixedValues->incomingValue[fields->remoteAddress].value.uint32, &key.remoteAddress);
+    }
+
+    key.localPort = fixedValues->incomingValue[fields->localPort].value.uint16;
+    key.remotePort = remotePort;
+
+    ATF_EPOCH_GUARD epochGuard;
+    AtfEpochEnter(&gConfigEpoch, &epochGuard);
+
+    BOOLEAN isBlocked = FALSE;
+
+    const CONFIG_CTX *configCtx = gConfigCtx;
+    if (configCtx && configCtx->domainCtx && configCtx->quicFlowCtx && configCtx->dnsBlocklistAction != ACTION_PASS) {
+        CHAR name[TLS_NAME_BUFFER_SIZE];
+        size_t nameLength = 0;
+        size_t domainLength = 0;
+
+        const UINT8 verdict = AtfFilterInspectQuic(configCtx, netBuffer, &key, name, &nameLength, &domainLength);
+
+        // The flow is reported once, by the datagram that decided it
+        if (domainLength) {
+            AtfFilterReportServerName(configCtx, fixedValues, fields, name, nameLength, domainLength, isIpv6);
+        }
+
+        isBlocked = verdict == QUIC_FLOW_BLOCK;
+    }
+
+    AtfEpochExit(&gConfigEpoch, &epochGuard);
+
+    //
+    // The datagram is dropped, not absorbed: the send error makes the client give up on QUIC at once and connect over
+    //  TCP, where the TLS callouts decide the same name
+    //
+    if (isBlocked) {
+        classifyOut->actionType = FWP_ACTION_BLOCK;
+        classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+    }
+
+    return ATF_ERROR_OK;
+}
+
+static UINT8 AtfFilterInspectQuic(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ NET_BUFFER *netBuffer,
+    _In_ const QUIC_FLOW_KEY *key,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *domainLengthOut
+)
+{
+    *nameLengthOut = 0;
+    *domainLengthOut = 0;
+
+    const ULONG dataLength = NET_BUFFER_DATA_LENGTH(netBuffer);
+    const BOOLEAN isBlocking = configCtx->dnsBlocklistAction == ACTION_BLOCK;
+
+    UINT8 verdict = QUIC_FLOW_UNDECIDED;
+
+    //
+    // The datagram is read in place when it is contiguous, which it almost always is. Otherwise it is copied into the
+    //  buffer of the processor, which is only used at DISPATCH_LEVEL
+    //
+    const UINT8 *datagram = (const UINT8 *)NdisGetDataBuffer(netBuffer, dataLength, NULL, 1, 0);
+    if (datagram) {
+        // The length in the UDP header covers the whole datagram
+        if (AtfDnsRead16(&datagram[4]) == dataLength) {
+            verdict = AtfQuicFlowInspect(configCtx->quicFlowCtx, configCtx->domainCtx, key, 
+                &datagram[DNS_UDP_HEADER_SIZE], dataLength - DNS_UDP_HEADER_SIZE, isBlocking, AtfDnsCacheNow(), 
+                nameOut, nameLengthOut, domainLengthOut);
+        }
+
+        return verdict;
+    }
+
+    if (!gStreamBuffers) {
+        return verdict;
+    }
+
+    const KIRQL oldIrql = KeRaiseIrqlToDpcLevel();
+
+    const ULONG processorIndex = KeGetCurrentProcessorIndex();
+    if (processorIndex < gNumOfStreamBuffers) {
+        UINT8 *buffer = &gStreamBuffers[(size_t)processorIndex * TLS_MAX_HELLO_SIZE];
+
+        datagram = (const UINT8 *)NdisGetDataBuffer(netBuffer, dataLength, buffer, 1, 0);
+        if (datagram && AtfDnsRead16(&datagram[4]) == dataLength) {
+            verdict = AtfQuicFlowInspect(configCtx->quicFlowCtx, configCtx->domainCtx, key, 
+                &datagram[DNS_UDP_HEADER_SIZE], dataLength - DNS_UDP_HEADER_SIZE, isBlocking, AtfDnsCacheNow(), 
+                nameOut, nameLengthOut, domainLengthOut);
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+
+    return verdict;
+}
+
+static ATF_STREAM_FLOW *AtfFilterAssociateStreamFlow(
+    _In_ const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _In_ UINT16 layerId,
+    _In_ UINT32 calloutId
+)
+{
+    if (!gStreamFlows.Flink || !FWPS_IS_METADATA_FIELD_PRESENT(metaValues, FWPS_METADATA_FIELD_FLOW_HANDLE)) {
+        return NULL;
+    }
+
+    ATF_STREAM_FLOW *flow = (ATF_STREAM_FLOW *)ATF_MALLOC(sizeof(ATF_STREAM_FLOW));
+    if (!flow) {
+        return NULL;
+    }
+
+    const UINT64 flowHandle = metaValues->flowHandle;
+
+    flow->flowHandle = flowHandle;
+    flow->layerId = layerId;
+    flow->calloutId = calloutId;
+    InitializeListHead(&flow->entry);
+
+    //
+    // The context is counted before it is associated, so AtfFilterWaitStreamFlows() also waits for the contexts
+    //  being associated while the callouts are unregistered
+    //
+    KLOCK_QUEUE_HANDLE lockHandle;
+    KeAcquireInStackQueuedSpinLock(&gStreamFlowLock, &lockHandle);
+
+    const BOOLEAN isClosed = gIsStreamFlowsClosed;
+    if (!isClosed) {
+        gNumOfStreamFlows++;
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    if (isClosed) {
+        ATF_FREE(flow);
+        return NULL;
+    }
+
+    const NTSTATUS ntStatus = FwpsFlowAssociateContext0(flowHandle, layerId, calloutId, (UINT64)(ULONG_PTR)flow);
+    if (!NT_SUCCESS(ntStatus)) {
+        KeAcquireInStackQueuedSpinLock(&gStreamFlowLock, &lockHandle);
+        gNumOfStreamFlows--;
+        if (gIsStreamFlowsClosed && !gNumOfStreamFlows) {
+            KeSetEvent(&gStreamFlowsFreed, IO_NO_INCREMENT, FALSE);
+        }
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+        ATF_FREE(flow);
+        return NULL;
+    }
+
+    //
+    // The list was emptied in the meantime, the context is removed here. WFP frees it with the flow delete function
+    //
+    KeAcquireInStackQueuedSpinLock(&gStreamFlowLock, &lockHandle);
+
+    const BOOLEAN isLate = gIsStreamFlowsClosed;
+    if (!isLate) {
+        InsertTailList(&gStreamFlows, &flow->entry);
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    if (isLate) {
+        FwpsFlowRemoveContext0(flowHandle, layerId, calloutId);
+        return NULL;
+    }
+
+    return flow;
+}
+
+static BOOLEAN AtfFilterScanStream(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _Inout_ ATF_STREAM_FLOW *flow,
+    _In_ const FWPS_STREAM_DATA0 *streamData,
+    _In_ BOOLEAN isSend,
+    _In_ BOOLEAN isIpv6
+)
+{
+    const PAYLOAD_SIG_CTX *payloadSigCtx = configCtx->payloadSigCtx;
+
+    // The automaton state of a stream only means something with the image it was scanned with
+    ATF_STREAM_DIRECTION *streamDirection = &flow->directions[isSend ? 0 : 1];
+    if (streamDirection->imageId != payloadSigCtx->imageId) {
+        AtfPayloadSigResetStream(&streamDirection->scan);
+        streamDirection->imageId = payloadSigCtx->imageId;
+    }
+
+    const UINT32 signatureId = AtfFilterScanStreamData(payloadSigCtx, &streamDirection->scan, streamData);
+    if (signatureId == PAYLOAD_SIG_NO_MATCH) {
+        return FALSE;
+    }
+
+    // A flow is reported once, on its first signature
+    flow->isSignatureFound = TRUE;
+
+    return AtfFilterReportSignature(
+        configCtx, fixedValues, &gStreamFields[isIpv6], AtfPayloadSigGetName(payloadSigCtx, signatureId), isSend, isIpv6);
+}
+
+static UINT32 AtfFilterScanStreamData(
+    _In_ const PAYLOAD_SIG_CTX *payloadSigCtx,
+    _Inout_ PAYLOAD_SIG_STREAM *stream,
+    _In_ const FWPS_STREAM_DATA0 *streamData
+)
+{
+    const FWPS_STREAM_DATA_OFFSET0 *dataOffset = &streamData->dataOffset;
+    size_t remaining = streamData->dataLength;
+
+    NET_BUFFER_LIST *netBufferList = dataOffset->netBufferList;
+    NET_BUFFER *netBuffer = dataOffset->netBuffer;
+    MDL *mdl = dataOffset->mdl;
+    size_t mdlOffset = dataOffset->mdlOffset;
+
+    while (remaining && netBufferList) {
+        for (; remaining && netBuffer; netBuffer = NET_BUFFER_NEXT_NB(netBuffer), mdl = NULL) {
+            MDL *currentMdl = NET_BUFFER_CURRENT_MDL(netBuffer);
+            size_t currentOffset = NET_BUFFER_CURRENT_MDL_OFFSET(netBuffer);
+
+            // The data starts in the middle of the first net buffer, and at the start of the following ones
+            if (!mdl) {
+                mdl = currentMdl;
+                mdlOffset = currentOffset;
+            }
+
+            // Bytes of the net buffer before the data
+            size_t skipped = 0;
+            for (; currentMdl && currentMdl != mdl; currentMdl = currentMdl->Next, currentOffset = 0) {
+                skipped += MmGetMdlByteCount(currentMdl) - currentOffset;
+            }
+            if (!currentMdl) {
+                return PAYLOAD_SIG_NO_MATCH;
+            }
+            skipped += mdlOffset - currentOffset;
+
+            const size_t netBufferLength = NET_BUFFER_DATA_LENGTH(netBuffer);
+            size_t length = netBufferLength > skipped ? min(netBufferLength - skipped, remaining) : 0;
+            remaining -= length;
+
+            for (; length && mdl; mdl = mdl->Next, mdlOffset = 0) {
+                const size_t mdlLength = MmGetMdlByteCount(mdl);
+                if (mdlOffset >= mdlLength) {
+                    continue;
+                }
+
+                const size_t scanLength = min(mdlLength - mdlOffset, length);
+                length -= scanLength;
+
+                const UINT8 *data = (const UINT8 *)MmGetSystemAddressForMdlSafe(mdl, LowPagePriority | MdlMappingNoExecute);
+                if (!data) {
+                    // A literal cannot be matched across bytes that were not read
+                    AtfPayloadSigResetStream(stream);
+                    continue;
+                }
+
+                const UINT32 signatureId = AtfPayloadSigScan(payloadSigCtx, stream, &data[mdlOffset], scanLength);
+                if (signatureId != PAYLOAD_SIG_NO_MATCH) {
+                    return signatureId;
+                }
+            }
+        }
+
+        netBufferList = NET_BUFFER_LIST_NEXT_NBL(netBufferList);
+        if (netBufferList) {
+            netBuffer = NET_BUFFER_LIST_FIRST_NB(netBufferList);
+        }
+    }
+
+    return PAYLOAD_SIG_NO_MATCH;
+}
+
+static TLS_HELLO_RESULT AtfFilterReadClientHello(
+    _In_ const FWPS_STREAM_DATA0 *streamData,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *requiredLengthOut
+)
+{
+    *nameLengthOut = 0;
+    *requiredLengthOut = 0;
+
+    //
+    // The record header alone tells a ClientHello from any other protocol, it is the only copy made for those
+    //
+    UINT8 header[TLS_RECORD_HEADER_SIZE];
+    SIZE_T bytesCopied = 0;
+
+    FwpsCopyStreamDataToBuffer0(streamData, header, min(streamData->dataLength, sizeof(header)), &bytesCopied);
+
+    TLS_HELLO_RESULT result = AtfTlsParseClientHello(header, bytesCopied, nameOut, nameLengthOut, requiredLengthOut);
+    if (result != TLS_HELLO_INCOMPLETE || bytesCopied < TLS_RECORD_HEADER_SIZE) {
+        return result;
+    }
+
+    // Without the buffers (they could not be allocated), the ClientHellos are only told apart from other data
+    if (!gStreamBuffers) {
+        return TLS_HELLO_NO_NAME;
+    }
+
+    // The record, or as much of it as was sent
+    const size_t copyLength = min(streamData->dataLength, *requiredLengthOut);
+
+    //
+    // The buffer of the processor is only used at DISPATCH_LEVEL, so no other callout can take it in the meantime
+    //
+    const KIRQL oldIrql = KeRaiseIrqlToDpcLevel();
+
+    const ULONG processorIndex = KeGetCurrentProcessorIndex();
+    if (processorIndex < gNumOfStreamBuffers) {
+        UINT8 *buffer = &gStreamBuffers[(size_t)processorIndex * TLS_MAX_HELLO_SIZE];
+
+        FwpsCopyStreamDataToBuffer0(streamData, buffer, copyLength, &bytesCopied);
+        result = AtfTlsParseClientHello(buffer, bytesCopied, nameOut, nameLengthOut, requiredLengthOut);
+    } else {
+        result = TLS_HELLO_NO_NAME;
+    }
+
+    KeLowerIrql(oldIrql);
+
+    return result;
+}
+
+static BOOLEAN AtfFilterReportServerName(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const ATF_FILTER_FLOW_FIELDS *fields,
+    _In_ const CHAR *name,
+    _In_ size_t nameLength,
+    _In_ size_t domainLength,
+    _In_ BOOLEAN isIpv6
+)
+{
+    const BOOLEAN isBlocked = configCtx->dnsBlocklistAction == ACTION_BLOCK;
+
+#if defined(ATF_MAIN_EVENT_OUTPUT)
+    const CHAR *signalName = isBlocked ? "BLOCK" : "ALERT";
+
+    if (isIpv6) {
+        ATF_FLT_DATA_V6 data;
+        RtlZeroMemory(&data, sizeof(data));
+
+        const FWP_BYTE_ARRAY16 *localIp = fixedValues->incomingValue[fields->localAddress].value.byteArray16;
+        const FWP_BYTE_ARRAY16 *remoteIp = fixedValues->incomingValue[fields->remoteAddress].value.byteArray16;
+        if (localIp && remoteIp) {
+            RtlCopyMemory(&data.localIp, localIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+            RtlCopyMemory(&data.remoteIp, remoteIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+        }
+
+        data.localPort = fixedValues->incomingValue[fields->localPort].value.uint16;
+        data.remotePort = fixedValues->incomingValue[fields->remotePort].value.uint16;
+
+        RtlIpv6AddressToStringA((const struct in6_addr *)&data.localIp, data.localIpStr);
+        RtlIpv6AddressToStringA((const struct in6_addr *)&data.remoteIp, data.remoteIpStr);
+
+        ATF_DEBUGA("SIGNAL %s (OUTBOUND): %s: %s (matched %s) (local:[%s]:%d -> remote:[%s]:%d)",
+            signalName, fields->protocolName, name, &name[nameLength - domainLength], data.localIpStr, data.localPort, data.remoteIpStr, data.remotePort);
+    } else {
+        ATF_FLT_DATA data;
+        RtlZeroMemory(&data, sizeof(data));
+
+        data.localIp.S_un.S_addr = fixedValues->incomingValue[fields->localAddress].value.uint32;
+        data.remoteIp.S_un.S_addr = fixedValues->incomingValue[fields->remoteAddress].value.uint32;
+
+        data.localPort = fixedValues->incomingValue[fields->localPort].value.uint16;
+        data.remotePort = fixedValues->incomingValue[fields->remotePort].value.uint16;
+        data.protocol = fields->protocol;
+
+        // The name sent by the client, and the blocklisted domain it is under
+        RtlCopyMemory(data.fqDnsName, name, nameLength + 1);
+        RtlCopyMemory(data.domainName, &name[nameLength - domainLength], domainLength + 1);
+
+        IN_ADDR localIp;
+        localIp.S_un.S_addr = reverse_byte_order_uint32_t(data.localIp.S_un.S_addr);
+        RtlIpv4AddressToStringA(&localIp, data.localIpStr);
+
+        IN_ADDR remoteIp;
+        remoteIp.S_un.S_addr = reverse_byte_order_uint32_t(data.remoteIp.S_un.S_addr);
+        RtlIpv4AddressToStringA(&remoteIp, data.remoteIpStr);
+
+        ATF_DEBUGA("SIGNAL %s (OUTBOUND): %s: %s (matched %s) (local:%s:%d -> remote:%s:%d)",
+            signalName, fields->protocolName, data.fqDnsName, data.domainName, data.localIpStr, data.localPort, data.remoteIpStr, data.remotePort);
+    }
+#else
+    UNREFERENCED_PARAMETER(fixedValues);
+    UNREFERENCED_PARAMETER(fields);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(nameLength);
+    UNREFERENCED_PARAMETER(domainLength);
+    UNREFERENCED_PARAMETER(isIpv6);
+#endif //ATF_MAIN_EVENT_OUTPUT
+
+    return isBlocked;
+}
+
+static BOOLEAN AtfFilterReportSignature(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const ATF_FILTER_FLOW_FIELDS *fields,
+    _In_ const CHAR *name,
+    _In_ BOOLEAN isSend,
+    _In_ BOOLEAN isIpv6
+)
+{
+    const BOOLEAN isBlocked = configCtx->payloadSignatureAction == ACTION_BLOCK;
+
+#if defined(ATF_MAIN_EVENT_OUTPUT)
+    const CHAR *signalName = isBlocked ? "BLOCK" : "ALERT";
+    const CHAR *directionName = isSend ? "SEND" : "RECEIVE";
+
+    if (!name) {
+        name = "unknown";
+    }
+
+    if (isIpv6) {
+        ATF_FLT_DATA_V6 data;
+        RtlZeroMemory(&data, sizeof(data));
+
+        const FWP_BYTE_ARRAY16 *localIp = fixedValues->incomingValue[fields->localAddress].value.byteArray16;
+        const FWP_BYTE_ARRAY16 *remoteIp = fixedValues->incomingValue[fields->remoteAddress].value.byteArray16;
+        if (localIp && remoteIp) {
+            RtlCopyMemory(&data.localIp, localIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+            RtlCopyMemory(&data.remoteIp, remoteIp->byteArray16, sizeof(IPV6_RAW_ADDRESS));
+        }
+
+        data.localPort = fixedValues->incomingValue[fields->localPort].value.uint16;
+        data.remotePort = fixedValues->incomingValue[fields->remotePort].value.uint16;
+
+        RtlIpv6AddressToStringA((const struct in6_addr *)&data.localIp, data.localIpStr);
+        RtlIpv6AddressToStringA((const struct in6_addr *)&data.remoteIp, data.remoteIpStr);
+
+        ATF_DEBUGA("SIGNAL %s (%s): PAYLOAD: %s (local:[%s]:%d -> remote:[%s]:%d)",
+            signalName, directionName, name, data.localIpStr, data.localPort, data.remoteIpStr, data.remotePort);
+    } else {
+        ATF_FLT_DATA data;
+        RtlZeroMemory(&data, sizeof(data));
+
+        data.localIp.S_un.S_addr = fixedValues->incomingValue[fields->localAddress].value.uint32;
+        data.remoteIp.S_un.S_addr = fixedValues->incomingValue[fields->remoteAddress].value.uint32;
+
+        data.localPort = fixedValues->incomingValue[fields->localPort].value.uint16;
+        data.remotePort = fixedValues->incomingValue[fields->remotePort].value.uint16;
+
+        IN_ADDR localIp;
+        localIp.S_un.S_addr = reverse_byte_order_uint32_t(data.localIp.S_un.S_addr);
+        RtlIpv4AddressToStringA(&localIp, data.localIpStr);
+
+        IN_ADDR remoteIp;
+        remoteIp.S_un.S_addr = reverse_byte_order_uint32_t(data.remoteIp.S_un.S_addr);
+        RtlIpv4AddressToStringA(&remoteIp, data.remoteIpStr);
+
+        ATF_DEBUGA("SIGNAL %s (%s): PAYLOAD: %s (local:%s:%d -> remote:%s:%d)",
+            signalName, directionName, name, data.localIpStr, data.localPort, data.remoteIpStr, data.remotePort);
+    }
+#else
+    UNREFERENCED_PARAMETER(fixedValues);
+    UNREFERENCED_PARAMETER(fields);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(isSend);
+    UNREFERENCED_PARAMETER(isIpv6);
+#endif //ATF_MAIN_EVENT_OUTPUT
+
+    return isBlocked;
+}
+
+static ATF_ERROR AtfFilterProcessIpv4(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const ATF_FLT_DATA *data,
+    _In_ enum _flow_direction dir
+)
+{
+    const UINT8 direction = dir == _flow_direction_inbound ? RULE_DIRECTION_INBOUND : RULE_DIRECTION_OUTBOUND;
+
+    CHAR domainName[DNS_CACHE_DOMAIN_BUFFER_SIZE];
+    domainName[0] = '\0';
+    const ATF_FILTER_LOOKUP_CTX lookupCtx = { configCtx, data, NULL, direction, domainName };
+
+    const POLICY_ENV env = {
+        POLICY_LAYER_TRANSPORT_V4,
+        direction,
+        data->protocol,
+        data->localPort,
+        data->remotePort,
+        AtfFilterSearchSetIpv4,
+        AtfFilterClassifyIpv4,
+        &lookupCtx
+    };
+
+    POLICY_VERDICT verdict;
+    const POLICY_INSN *policy = &configCtx->policy[POLICY_LAYER_TRANSPORT_V4][configCtx->policyEntry[POLICY_LAYER_TRANSPORT_V4]];
+    AtfPolicyRun(policy, &env, &verdict);
+
+    const ATF_ERROR atfError = AtfFilterGetSignal(&verdict);
+
+    // Report/log
+#if defined(ATF_MAIN_EVENT_OUTPUT)
+    if (atfError != ATF_FILTER_SIGNAL_PASS) {
+        AtfFilterLogVerdict(&verdict, atfError, dir, FALSE, data->localIpStr, data->localPort, data->remoteIpStr, data->remotePort,
+            domainName);
+    }
+#endif //ATF_MAIN_EVENT_OUTPUT
+
+    // Do ops
+    switch(atfError)
+    {
+    case ATF_FILTER_SIGNAL_PASS:
+        {
+            return atfError;
+        } 
+        break;
+    case ATF_FILTER_SIGNAL_BLOCK:
+        {
+
+        }
+        break;
+    case ATF_FILTER_SIGNAL_ALERT:
+        {
+
+        } 
+        break;
+    default:
+        {
+            ATF_ERROR(AtfFilterCallbackTcpIpv4Inbound, atfError);
+        }
+        break;
+    }
+
+    return ATF_ERROR_OK;
+}
+
+static ATF_ERROR AtfFilterProcessIpv6(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const ATF_FLT_DATA_V6 *data,
+    _In_ enum _flow_direction dir
+)
+{
+    const UINT8 direction = dir == _flow_direction_inbound ? RULE_DIRECTION_INBOUND : RULE_DIRECTION_OUTBOUND;
+
+    CHAR domainName[DNS_CACHE_DOMAIN_BUFFER_SIZE];
+    domainName[0] = '\0';
+    const ATF_FILTER_LOOKUP_CTX lookupCtx = { configCtx, NULL, data, direction, domainName };
+
+    // The 5-tuple rules are IPv4 only
+    const POLICY_ENV env = {
+        POLICY_LAYER_TRANSPORT_V6,
+        direction,
+        data->protocol,
+        data->localPort,
+        data->remotePort,
+        AtfFilterSearchSetIpv6,
+        NULL,
+        &lookupCtx
+    };
+
+    POLICY_VERDICT verdict;
+    const POLICY_INSN *policy = &configCtx->policy[POLICY_LAYER_TRANSPORT_V6][configCtx->policyEntry[POLICY_LAYER_TRANSPORT_V6]];
+    AtfPolicyRun(policy, &env, &verdict);
+
+    const ATF_ERROR atfError = AtfFilterGetSignal(&verdict);
+
+    // Report/log
+#if defined(ATF_MAIN_EVENT_OUTPUT)
+    if (atfError != ATF_FILTER_SIGNAL_PASS) {
+        AtfFilterLogVerdict(&verdict, atfError, dir, TRUE, data->localIpStr, data->localPort, data->remoteIpStr, data->remotePort,
+            domainName);
+    }
+#endif //ATF_MAIN_EVENT_OUTPUT
+
+    // Do ops
+    switch(atfError)
+    {
+    case ATF_FILTER_SIGNAL_PASS:
+        {
+            return atfError;
+        } 
+        break;
+    case ATF_FILTER_SIGNAL_BLOCK:
+        {
+
+        }
+        break;
+    case ATF_FILTER_SIGNAL_ALERT:
+        {
+
+        } 
+        break;
+    default:
+        {
+            ATF_ERROR(AtfFilterCallbackTcpIpv6Inbound, atfError);
+        }
+        break;
+    }
+
+    return ATF_ERROR_OK;
+}
+
+static VOID AtfFilterSearchSetIpv4(
+    _In_ const VOID *lookupCtx,
+    _In_ UINT32 set,
+    _Out_ UINT8 prefixLengths[2],
+    _Out_ BOOLEAN *isApproximate
+)
+{
+    const ATF_FILTER_LOOKUP_CTX *ctx = (const ATF_FILTER_LOOKUP_CTX *)lookupCtx;
+
+    prefixLengths[0] = 0;
+    prefixLengths[1] = 0;
+    *isApproximate = FALSE;
+
+    switch (set)
+    {
+    case POLICY_SET_IPV4_BLOCKLIST:
+        {
+            const struct in_addr ips[2] = { ctx->data->localIp, ctx->data->remoteIp };
+            AtfFilterSearchIpv4(ctx->configCtx, ips, &prefixLengths[0], &prefixLengths[1], isApproximate);
+        }
+        break;
+    case POLICY_SET_DNS_DOMAINS:
+        {
+            // Only the remote address can come from a DNS response. The cache keeps IPv4 addresses mapped
+            IPV6_RAW_ADDRESS remoteIp;
+            AtfDnsCacheMapIpv4(ctx->data->remoteIp.S_un.S_addr, &remoteIp);
+
+            if (AtfDnsCacheLookup(ctx->configCtx->dnsCacheCtx, &remoteIp, AtfDnsCacheNow(), ctx->domainName)) {
+                prefixLengths[1] = IPV4_PREFIX_MAX_LENGTH;
+            }
+        }
+        break;
+    default:
+        {
+            // IPv4 flows are not in the IPv6 blocklist
+        }
+        break;
+    }
+}
+
+static BOOLEAN AtfFilterClassifyIpv4(
+    _In_ const VOID *lookupCtx,
+    _Out_ IPV4_TSS_RULE *ruleOut
+)
+{
+    const ATF_FILTER_LOOKUP_CTX *ctx = (const ATF_FILTER_LOOKUP_CTX *)lookupCtx;
+    const ATF_FLT_DATA *data = ctx->data;
+
+    const IPV4_TSS_FLOW flow = {
+        data->localIp.S_un.S_addr,
+        data->remoteIp.S_un.S_addr,
+        data->localPort,
+        data->remotePort,
+        data->protocol,
+        ctx->direction
+    };
+
+    return AtfIpv4TssClassify(ctx->configCtx->ipv4RulesCtx, &flow, ruleOut);
+}
+
+static VOID AtfFilterSearchSetIpv6(
+    _In_ const VOID *lookupCtx,
+    _In_ UINT32 set,
+    _Out_ UINT8 prefixLengths[2],
+    _Out_ BOOLEAN *isApproximate
+)
+{
+    const ATF_FILTER_LOOKUP_CTX *ctx = (const ATF_FILTER_LOOKUP_CTX *)lookupCtx;
+    const ATF_FLT_DATA_V6 *data = ctx->dataV6;
+
+    prefixLengths[0] = 0;
+    prefixLengths[1] = 0;
+    *isApproximate = FALSE;
+
+    if (set == POLICY_SET_IPV6_BLOCKLIST) {
+        // The IPv6 engine also holds the mapped prefixes of /96 and shorter
+        const IPV6_RAW_ADDRESS ips[2] = { data->localIp, data->remoteIp };
+        AtfIpv6BslSearchBatch(ctx->configCtx->ipv6EngineCtx, ips, prefixLengths, 2);
+        return;
+    }
+
+    if (set == POLICY_SET_DNS_DOMAINS) {
+        // The cache keeps IPv4 addresses mapped, so a mapped remote address is searched as it is
+        if (AtfDnsCacheLookup(ctx->configCtx->dnsCacheCtx, &data->remoteIp, AtfDnsCacheNow(), ctx->domainName)) {
+            prefixLengths[1] = IPV6_PREFIX_MAX_LENGTH;
+        }
+        return;
+    }
+
+    // IPv4-mapped addresses are IPv4 peers (dual-stack sockets), they are searched in the IPv4 blocklist
+    const BOOLEAN isLocalMapped = IPV6_IS_IPV4_MAPPED(&data->localIp);
+    const BOOLEAN isRemoteMapped = IPV6_IS_IPV4_MAPPED(&data->remoteIp);
+    if (!isLocalMapped && !isRemoteMapped) {
+        return;
+    }
+
+    struct in_addr ips[2];
+    ips[0].S_un.S_addr = isLocalMapped ? IPV6_GET_MAPPED_IPV4(&data->localIp) : 0;
+    ips[1].S_un.S_addr = isRemoteMapped ? IPV6_GET_MAPPED_IPV4(&data->remoteIp) : 0;
+
+    UINT8 localPrefixLength = 0;
+    UINT8 remotePrefixLength = 0;
+    AtfFilterSearchIpv4(ctx->configCtx, ips, &localPrefixLength, &remotePrefixLength, isApproximate);
+
+    // Reported as IPv6 prefix lengths
+    if (isLocalMapped && localPrefixLength) {
+        prefixLengths[0] = localPrefixLength + IPV6_IPV4_MAPPED_PREFIX_LENGTH;
+    }
+    if (isRemoteMapped && remotePrefixLength) {
+        prefixLengths[1] = remotePrefixLength + IPV6_IPV4_MAPPED_PREFIX_LENGTH;
+    }
+    if (!prefixLengths[0] && !prefixLengths[1]) {
+        *isApproximate = FALSE;
+    }
+}
+
+static ATF_ERROR AtfFilterGetSignal(_In_ const POLICY_VERDICT *verdict)
+{
+    switch (verdict->action)
+    {
+    case ACTION_BLOCK:
+        {
+            // A prefilter-only match may be a false positive, so it is never blocked on, whatever the policy
+            if (!verdict->isRule && verdict->set != POLICY_SET_NONE && verdict->isApproximate) {
+                return ATF_FILTER_SIGNAL_ALERT;
+            }
+            return ATF_FILTER_SIGNAL_BLOCK;
+        }
+        break;
+    case ACTION_ALERT:
+        {
+            return ATF_FILTER_SIGNAL_ALERT;
+        }
+        break;
+    default:
+        {
+        }
+        break;
+    }
+
+    return ATF_FILTER_SIGNAL_PASS;
+}
+
+#if defined(ATF_MAIN_EVENT_OUTPUT)
+static VOID AtfFilterLogVerdict(
+    _In_ const POLICY_VERDICT *verdict,
+    _In_ ATF_ERROR signal,
+    _In_ enum _flow_direction dir,
+    _In_ BOOLEAN isIpv6,
+    _In_ const CHAR *localIpStr,
+    _In_ SERVICE_PORT localPort,
+    _In_ const CHAR *remoteIpStr,
+    _In_ SERVICE_PORT remotePort,
+    _In_ const CHAR *domainName
+)
+{
+    const CHAR *signalName = signal == ATF_FILTER_SIGNAL_BLOCK ? "BLOCK" : "ALERT";
+    const CHAR *dirName = dir == _flow_direction_inbound ? "INBOUND" : "OUTBOUND";
+
+    // IPv6 addresses are bracketed, as in a URI
+    CHAR flowStr[128];
+    RtlStringCbPrintfA(flowStr, sizeof(flowStr), isIpv6 ? "local:[%s]:%d -> remote:[%s]:%d" : "local:%s:%d -> remote:%s:%d",
+        localIpStr, localPort, remoteIpStr, remotePort);
+
+    if (verdict->isRule) {
+        ATF_DEBUGA("SIGNAL %s (%s): rule #%u (%s)", signalName, dirName, verdict->ruleId, flowStr);
+    } else if (verdict->set == POLICY_SET_DNS_DOMAINS) {
+        ATF_DEBUGA("SIGNAL %s (%s): DNS: %s resolved to %s (%s)", signalName, dirName, domainName, remoteIpStr, flowStr);
+    } else if (verdict->set != POLICY_SET_NONE) {
+        ATF_DEBUGA("SIGNAL %s (%s): IP: %s (matched /%d%s) (%s)", 
+            signalName,
+            dirName,
+            verdict->isRemote ? remoteIpStr : localIpStr,
+            verdict->prefixLength,
+            verdict->isApproximate ? ", prefilter" : "",
+            flowStr
+        );
+    } else {
+        ATF_DEBUGA("SIGNAL %s (%s): policy (%s)", signalName, dirName, flowStr);
+    }
+}
+#endif //ATF_MAIN_EVENT_OUTPUT
+
+static VOID AtfFilterSearchIpv4(
+    _In_ const CONFIG_CTX *configCtx,
+    _In_ const struct in_addr ips[2],
+    _Out_ UINT8 *localPrefixLength,
+    _Out_ UINT8 *remotePrefixLength,
+    _Out_ BOOLEAN *isApproximate
+)
+{
+    *isApproximate = FALSE;
+
+    // Both addresses go through one batch search, so the engine can overlap their memory accesses
+    UINT8 results[2];
+
+    configCtx->ipv4Engine->SearchBatch(configCtx->ipv4EngineCtx, ips, results, 2);
+
+    *localPrefixLength = results[0];
+    *remotePrefixLength = results[1];
+
+    // The compiled image holds the online blocklists, the trie holds the ini entries and appended lists
+    if (configCtx->ipv4ImageCtx) {
+        AtfIpv4ImageSearchBatch(configCtx->ipv4ImageCtx, ips, results, 2);
+
+        const BOOLEAN isImageApproximate = AtfIpv4ImageIsApproximate(configCtx->ipv4ImageCtx);
+
+        if (results[0] > *localPrefixLength) {
+            *localPrefixLength = results[0];
+            *isApproximate |= isImageApproximate;
+        }
+        if (results[1] > *remotePrefixLength) {
+            *remotePrefixLength = results[1];
+            *isApproximate |= isImageApproximate;
+        }
+    }
 }
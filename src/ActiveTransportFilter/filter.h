@@ -42,6 +42,10 @@ typedef struct _atf_filter_conn_data {
     SERVICE_PORT                localPort;
     SERVICE_PORT                remotePort;
 
+    // IP protocol number (RULE_PROTOCOL_TCP, RULE_PROTOCOL_UDP, ...)
+    UINT8                       protocol;
+
+    // Server name of the flow (TLS ClientHello), and the blocklisted domain it is under
     CHAR                        fqDnsName[0xff]; //RFC1035
     CHAR                        domainName[0xff];
 
@@ -49,6 +53,22 @@ typedef struct _atf_filter_conn_data {
     CHAR                        localIpStr[16];
     CHAR                        remoteIpStr[16];
 } ATF_FLT_DATA, *PATF_FLT_DATA;
+
+typedef struct _atf_filter_conn_data_v6 {
+    // Network byte order, as supplied by WFP
+    IPV6_RAW_ADDRESS            localIp;
+    IPV6_RAW_ADDRESS            remoteIp;
+
+    SERVICE_PORT                localPort;
+    SERVICE_PORT                remotePort;
+
+    // IP protocol number
+    UINT8                       protocol;
+
+    // IP strings
+    CHAR                        localIpStr[46];
+    CHAR                        remoteIpStr[46];
+} ATF_FLT_DATA_V6, *PATF_FLT_DATA_V6;
 #pragma pack(pop)
 
 //
@@ -68,7 +88,8 @@ VOID AtfFilterFlushConfig(VOID);
 BOOLEAN AtfFilterIsInitialized(VOID);
 
 //
-// Store the current default ini configuration into the filter engine
+// Store (publish) the current default ini configuration into the filter engine
+//  The previous config is freed once no callout can be using it, so this may wait. PASSIVE_LEVEL only
 //
 VOID AtfFilterStoreDefaultConfig(const CONFIG_CTX *confgCtx);
 
@@ -81,6 +102,88 @@ ATF_ERROR AtfFilterCallbackTcpIpv4(
     _In_ enum _flow_direction dir
 );
 
+//
+// Filter callback for IPv6 (TCP)
+//  IPv4-mapped addresses are searched in the IPv4 blocklist
+//
+ATF_ERROR AtfFilterCallbackTcpIpv6(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ enum _flow_direction dir
+);
+
+//
+// Filter callback for the datagram layers (UDP), snoops the inbound DNS responses into the DNS cache of the config,
+//  and blocks the outbound DNS queries for blocklisted domains (dnsBlocklistAction) with a synthesized response
+//
+ATF_ERROR AtfFilterCallbackDatagram(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _In_opt_ VOID *layerData,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ BOOLEAN isIpv6
+);
+
+//
+// Allocate the per-processor buffers of the stream and QUIC callouts. PASSIVE_LEVEL only, before the callouts are
+//  registered
+//
+NTSTATUS AtfFilterInitStream(VOID);
+
+//
+// Free the buffers of the stream and QUIC callouts, once they are unregistered
+//
+VOID AtfFilterDestroyStream(VOID);
+
+//
+// Filter callback for the stream layers (TCP data), matches the server name of the TLS ClientHello sent first on an
+//  outbound flow against the domain blocklist (dnsBlocklistAction), and scans the payload of every flow for the
+//  payload signatures (payloadSignatureAction). Each flow is handed back to WFP once decided
+//  The flow context is the one associated by a previous call (0 for none), for the callout calloutId
+//
+ATF_ERROR AtfFilterCallbackStream(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ VOID *layerData,
+    _In_ UINT32 calloutId,
+    _In_ UINT64 flowContext,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ BOOLEAN isIpv6
+);
+
+//
+// Free the context of a stream flow, called by WFP when the flow ends or its context is removed
+//
+VOID AtfFilterFreeStreamFlow(UINT64 flowContext);
+
+//
+// Refuse new stream flow contexts, and remove the existing ones, so that the stream callouts can be unregistered.
+//  PASSIVE_LEVEL only
+//
+VOID AtfFilterRemoveStreamFlows(VOID);
+
+//
+// Wait until WFP has freed every stream flow context, after AtfFilterRemoveStreamFlows(). PASSIVE_LEVEL only
+//
+VOID AtfFilterWaitStreamFlows(VOID);
+
+//
+// Associate stream flow contexts again, after AtfFilterRemoveStreamFlows() when the callouts stay registered
+//
+VOID AtfFilterReopenStreamFlows(VOID);
+
+//
+// Filter callback for the QUIC datagrams (UDP/443), matches the server name of the ClientHello in the client Initial
+//  packets of an outbound flow against the domain blocklist (dnsBlocklistAction). The datagrams of a blocked flow are
+//  dropped
+//
+ATF_ERROR AtfFilterCallbackQuic(
+    _In_ const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_opt_ VOID *layerData,
+    _Inout_ FWPS_CLASSIFY_OUT0 *classifyOut,
+    _In_ BOOLEAN isIpv6
+);
+
 //
 // Returns a TRUE is a WFP filter layer guid is to be enabled 
 //  This data is supplied by the ini file and stored in filter.c's CONFIG_CTX object
@@ -88,7 +191,8 @@ ATF_ERROR AtfFilterCallbackTcpIpv4(
 BOOLEAN AtfFilterIsLayerEnabled(const GUID *guid);
 
 //
-// Returns the current config. Used to append an IPv4 blacklist to the existing config
+// Returns the current config. Used to build a new config from the existing one (see AtfConfigClone)
+//  The published config is read-only, it must not be modified
 //
-CONFIG_CTX *AtfFilterGetCurrentConfig(VOID);
+const CONFIG_CTX *AtfFilterGetCurrentConfig(VOID);
 
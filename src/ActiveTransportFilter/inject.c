@@ -0,0 +1,181 @@
+#include "inject.h"
+
+#include "mem.h"
+#include "trace.h"
+
+#define INJECT_POOL_TAG                 'jnIA'
+
+//
+// Injection handle and NET_BUFFER_LIST pool, NULL if not initialized
+//
+static HANDLE gInjectionHandle = NULL;
+static NDIS_GENERIC_OBJECT *gNdisGenericObj = NULL;
+static NDIS_HANDLE gNetBufferListPool = NULL;
+
+//
+// Completion routine of an injected packet, frees the NET_BUFFER_LIST, its MDL and the packet
+//
+static VOID NTAPI AtfInjectComplete(
+    _In_ VOID *context,
+    _Inout_ NET_BUFFER_LIST *netBufferList,
+    _In_ BOOLEAN dispatchLevel
+);
+
+NTSTATUS AtfInjectInit(
+    _In_ DRIVER_OBJECT *driverObject
+)
+{
+    ATF_ASSERT(driverObject);
+
+    if (gInjectionHandle) {
+        return STATUS_ALREADY_INITIALIZED;
+    }
+
+    gNdisGenericObj = NdisAllocateGenericObject(driverObject, INJECT_POOL_TAG, 0);
+    if (!gNdisGenericObj) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    NET_BUFFER_LIST_POOL_PARAMETERS poolParameters = { 0 };
+    poolParameters.Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
+    poolParameters.Header.Revision = NET_BUFFER_LIST_POOL_PARAMETERS_REVISION_1;
+    poolParameters.Header.Size = NDIS_SIZEOF_NET_BUFFER_LIST_POOL_PARAMETERS_REVISION_1;
+    poolParameters.fAllocateNetBuffer = TRUE;
+    poolParameters.PoolTag = INJECT_POOL_TAG;
+
+    gNetBufferListPool = NdisAllocateNetBufferListPool(gNdisGenericObj, &poolParameters);
+    if (!gNetBufferListPool) {
+        NdisFreeGenericObject(gNdisGenericObj);
+        gNdisGenericObj = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    HANDLE injectionHandle = NULL;
+    NTSTATUS ntStatus = FwpsInjectionHandleCreate0(AF_UNSPEC, FWPS_INJECTION_TYPE_TRANSPORT, &injectionHandle);
+    if (!NT_SUCCESS(ntStatus)) {
+        ATF_ERROR(FwpsInjectionHandleCreate0, ntStatus);
+        NdisFreeNetBufferListPool(gNetBufferListPool);
+        NdisFreeGenericObject(gNdisGenericObj);
+        gNetBufferListPool = NULL;
+        gNdisGenericObj = NULL;
+        return ntStatus;
+    }
+
+    gInjectionHandle = injectionHandle;
+
+    return STATUS_SUCCESS;
+}
+
+VOID AtfInjectDestroy(VOID)
+{
+    if (!gInjectionHandle) {
+        return;
+    }
+
+    // Waits for the pending injections, so their completion routines no longer use the pool
+    FwpsInjectionHandleDestroy0(gInjectionHandle);
+    gInjectionHandle = NULL;
+
+    NdisFreeNetBufferListPool(gNetBufferListPool);
+    NdisFreeGenericObject(gNdisGenericObj);
+    gNetBufferListPool = NULL;
+    gNdisGenericObj = NULL;
+}
+
+BOOLEAN AtfInjectIsSelfInjected(
+    _In_ const NET_BUFFER_LIST *netBufferList
+)
+{
+    if (!gInjectionHandle || !netBufferList) {
+        return FALSE;
+    }
+
+    const FWPS_PACKET_INJECTION_STATE injectionState = 
+        FwpsQueryPacketInjectionState0(gInjectionHandle, netBufferList, NULL);
+
+    return injectionState == FWPS_PACKET_INJECTED_BY_SELF || injectionState == FWPS_PACKET_PREVIOUSLY_INJECTED_BY_SELF;
+}
+
+NTSTATUS AtfInjectTransportReceive(
+    _In_ UINT8 *packet,
+    _In_ size_t packetLength,
+    _In_ BOOLEAN isIpv6,
+    _In_ COMPARTMENT_ID compartmentId,
+    _In_ IF_INDEX interfaceIndex,
+    _In_ IF_INDEX subInterfaceIndex
+)
+{
+    if (!packet) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!gInjectionHandle || !packetLength || packetLength > MAXULONG) {
+        ATF_FREE(packet);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    MDL *mdl = IoAllocateMdl(packet, (ULONG)packetLength, FALSE, FALSE, NULL);
+    if (!mdl) {
+        ATF_FREE(packet);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // ATF_MALLOC is non-paged (mem.h)
+    MmBuildMdlForNonPagedPool(mdl);
+
+    NET_BUFFER_LIST *netBufferList = NULL;
+    NTSTATUS ntStatus = FwpsAllocateNetBufferAndNetBufferList0(
+        gNetBufferListPool,
+        0,
+        0,
+        mdl,
+        0,
+        packetLength,
+        &netBufferList
+    );
+    if (!NT_SUCCESS(ntStatus)) {
+        IoFreeMdl(mdl);
+        ATF_FREE(packet);
+        return ntStatus;
+    }
+
+    ntStatus = FwpsInjectTransportReceiveAsync0(
+        gInjectionHandle,
+        NULL,
+        NULL,
+        0,
+        isIpv6 ? AF_INET6 : AF_INET,
+        compartmentId,
+        interfaceIndex,
+        subInterfaceIndex,
+        netBufferList,
+        AtfInjectComplete,
+        packet
+    );
+    if (!NT_SUCCESS(ntStatus)) {
+        // The completion routine is only called for an accepted injection
+        FwpsFreeNetBufferList0(netBufferList);
+        IoFreeMdl(mdl);
+        ATF_FREE(packet);
+        return ntStatus;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID NTAPI AtfInjectComplete(
+    _In_ VOID *context,
+    _Inout_ NET_BUFFER_LIST *netBufferList,
+    _In_ BOOLEAN dispatchLevel
+)
+{
+    UNREFERENCED_PARAMETER(dispatchLevel);
+
+    MDL *mdl = NET_BUFFER_FIRST_MDL(NET_BUFFER_LIST_FIRST_NB(netBufferList));
+
+    FwpsFreeNetBufferList0(netBufferList);
+    IoFreeMdl(mdl);
+    ATF_FREE(context);
+}
+
+//EOF
@@ -0,0 +1,59 @@
+#if _MSC_VER > 1000
+#pragma once
+#endif //_MSC_VER > 1000
+
+#if !defined(NDIS60)
+#define NDIS60 1
+#endif //NDIS60
+
+#if !defined(NDIS_SUPPORT_NDIS6)
+#define NDIS_SUPPORT_NDIS6 1
+#endif //NDIS_SUPPORT_NDIS6
+
+#include <ntddk.h>
+#include <fwpsk.h>
+
+//
+// Packet injection, for the packets the callouts synthesize (see dns_block.h)
+//
+//  A transport injection handle and a NET_BUFFER_LIST pool are created with WFP (InitializeWfp()), and destroyed
+//   with it. A packet is injected from the buffer it was built in: the buffer is wrapped in an MDL and a
+//   NET_BUFFER_LIST, and all three are freed by the completion routine, so the callout does not wait for the
+//   injection.
+//
+//  The callouts are called again for the packets they inject, AtfInjectIsSelfInjected() lets them skip those.
+//
+
+//
+// Create the injection handle and NET_BUFFER_LIST pool. PASSIVE_LEVEL only
+//
+NTSTATUS AtfInjectInit(
+    _In_ DRIVER_OBJECT *driverObject
+);
+
+//
+// Destroy the injection handle and pool, once the pending injections have completed. PASSIVE_LEVEL only
+//
+VOID AtfInjectDestroy(VOID);
+
+//
+// Returns TRUE if the packet was injected by AtfInjectTransportReceive()
+//
+BOOLEAN AtfInjectIsSelfInjected(
+    _In_ const NET_BUFFER_LIST *netBufferList
+);
+
+//
+// Inject a whole IP packet in the receive path, as if received on the interface. Callable at IRQL <= DISPATCH_LEVEL
+//  The packet must be allocated with ATF_MALLOC, it is owned (and freed) by the injection whether it succeeds or not
+//
+NTSTATUS AtfInjectTransportReceive(
+    _In_ UINT8 *packet,
+    _In_ size_t packetLength,
+    _In_ BOOLEAN isIpv6,
+    _In_ COMPARTMENT_ID compartmentId,
+    _In_ IF_INDEX interfaceIndex,
+    _In_ IF_INDEX subInterfaceIndex
+);
+
+// EOF
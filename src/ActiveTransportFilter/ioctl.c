@@ -9,6 +9,10 @@
 #include "../common/errors.h"
 #include "../common/ioctl_codes.h"
 #include "../common/user_driver_transport.h"
+#include "../common/ipv4_image_format.h"
+#include "../common/domain_dafsa_format.h"
+#include "../common/payload_sig_format.h"
+#include "mem.h"
 
 //
 // DeviceIoControl handler
@@ -62,11 +66,113 @@ static NTSTATUS AtfHandlerAppendIpv4Blacklist(
     _In_ size_t bufLen
 );
 
+//
+// Handler to apply an IPv4 blocklist delta
+//
+static NTSTATUS AtfHandleApplyIpv4Delta(
+    _In_ WDFREQUEST request,
+    _In_ size_t bufLen
+);
+
+//
+// Handlers for the bulk upload session
+//  IOCTL_ATF_BULK_UPLOAD_BEGIN, IOCTL_ATF_BULK_UPLOAD_DATA, IOCTL_ATF_BULK_UPLOAD_COMMIT
+//
+static NTSTATUS AtfHandleBulkUploadBegin(
+    _In_ WDFREQUEST request, 
+    _In_ size_t bufLen
+);
+
+static NTSTATUS AtfHandleBulkUploadData(
+    _In_ WDFREQUEST request, 
+    _In_ size_t bufLen,
+    _In_ size_t dataLen
+);
+
+static NTSTATUS AtfHandleBulkUploadCommit(VOID);
+
+//
+// Free the staging buffer and close the bulk upload session, if one is open
+//
+static VOID AtfBulkUploadDiscard(VOID);
+
+//
+// Build a copy of the current config with an IPv4 blocklist appended, and publish it to filter.c
+//  The published config is never modified, so this is safe while WFP is running
+//
+static NTSTATUS AtfPublishIpv4Blacklist(
+    _In_ const VOID *blacklist,
+    _In_ size_t bufLen
+);
+
+//
+// Build a copy of the current config with a new IPv4 lookup image, and publish it to filter.c
+//
+static NTSTATUS AtfPublishIpv4Image(
+    _In_ const VOID *image,
+    _In_ size_t imageSize
+);
+
+//
+// Build a copy of the current config with an IPv4 blocklist delta applied, and publish it to filter.c
+//
+static NTSTATUS AtfPublishIpv4Delta(
+    _In_ const VOID *delta,
+    _In_ size_t deltaSize
+);
+
+//
+// Build a copy of the current config with an IPv6 blocklist appended, and publish it to filter.c
+//
+static NTSTATUS AtfPublishIpv6Blacklist(
+    _In_ const VOID *blacklist,
+    _In_ size_t bufLen
+);
+
+//
+// Build a copy of the current config with its IPv4 rules replaced, and publish it to filter.c
+//
+static NTSTATUS AtfPublishIpv4Rules(
+    _In_ const VOID *rules,
+    _In_ size_t bufLen
+);
+
+//
+// Build a copy of the current config with a new domain blocklist image, and publish it to filter.c
+//
+static NTSTATUS AtfPublishDomainImage(
+    _In_ const VOID *image,
+    _In_ size_t imageSize
+);
+
+//
+// Build a copy of the current config with a new payload signature image, and publish it to filter.c
+//
+static NTSTATUS AtfPublishSignatureImage(
+    _In_ const VOID *image,
+    _In_ size_t imageSize
+);
+
 //
 // Lock that handles synchronization between IOCTL calls
 //
 KMUTEX gIoctlLock;
 
+//
+// Bulk upload session state, protected by gIoctlLock
+//  The staging buffer is only accessed from IOCTL handlers (PASSIVE_LEVEL), so it is allocated from paged pool
+//
+typedef struct _bulk_upload_session {
+    // BULK_PAYLOAD_NONE if no session is open
+    BULK_PAYLOAD_TYPE               payloadType;
+
+    size_t                          totalSize;
+    size_t                          receivedSize;
+    UINT8                           *buffer;
+} BULK_UPLOAD_SESSION, *PBULK_UPLOAD_SESSION;
+
+static BULK_UPLOAD_SESSION gBulkSession;
+
 NTSTATUS AtfInitializeIoctlHandlers(
     WDFDEVICE wdfDevice
 )
@@ -96,6 +202,11 @@ NTSTATUS AtfInitializeIoctlHandlers(
     return STATUS_SUCCESS;
 }
 
+VOID AtfIoctlCleanup(VOID)
+{
+    AtfBulkUploadDiscard();
+}
+
 VOID AtfIoDeviceControl(
     _In_ WDFQUEUE queue,
     _In_ WDFREQUEST request,
@@ -104,8 +215,6 @@ VOID AtfIoDeviceControl(
     _In_ ULONG ioControlCode
 )
 {
-    UNREFERENCED_PARAMETER(outputBufferLength);
-
     //
     // Dev note: using a KMUTEX since it does not change IRQL from PASSIVE_LEVEL
     //  Initially, I used a spinlock but this caused FwpmEngineOpen() to fail since spinlocks
@@ -176,6 +285,36 @@ VOID AtfIoDeviceControl(
             );
         }
         break;
+    case IOCTL_ATF_APPLY_IPV4_DELTA:
+        {
+            ntStatus = AtfHandleApplyIpv4Delta(
+                request,
+                inputBufferLength
+            );
+        }
+        break;
+    case IOCTL_ATF_BULK_UPLOAD_BEGIN:
+        {
+            ntStatus = AtfHandleBulkUploadBegin(
+                request,
+                inputBufferLength
+            );
+        }
+        break;
+    case IOCTL_ATF_BULK_UPLOAD_DATA:
+        {
+            ntStatus = AtfHandleBulkUploadData(
+                request,
+                inputBufferLength,
+                outputBufferLength
+            );
+        }
+        break;
+    case IOCTL_ATF_BULK_UPLOAD_COMMIT:
+        {
+            ntStatus = AtfHandleBulkUploadCommit();
+        }
+        break;
     default:
         ntStatus = STATUS_INVALID_DEVICE_REQUEST;
         break;
@@ -273,6 +412,7 @@ static NTSTATUS AtfHandleFlushConfig(
         return STATUS_DEVICE_NOT_READY;
     }
 
+    AtfBulkUploadDiscard();
     AtfFilterFlushConfig();
     
     ATF_DEBUG(AtfFilterFlushConfig, "Successfully flushed filter config");
@@ -280,11 +420,11 @@ static NTSTATUS AtfHandleFlushConfig(
 }
 
 //
-// Important note: the WFP subsystem cannot be running while appending blacklist IPs.
-//  The service must be stopped IOCTL_ATF_WFP_SERVICE_STOP, then appended (IOCTL_ATF_APPEND_IPV4_BLACKLIST), 
-//  then restarted by calling IOCTL_ATF_WFP_SERVICE_START
+// The config and blacklists can be sent while WFP is running. A new CONFIG_CTX is built and then published to filter.c
+//  with an atomic swap, so the callouts switch from the old ruleset to the new one without an unfiltered window.
+//  A change of enabled layers only takes effect after WFP is restarted
 // 
-// Note: The filter.c engine will automatically flush its config if a new config is received
+// Note: The filter.c engine will automatically free the old config once no callout is using it
 //
 static NTSTATUS AtfHandleSendWfpConfig(
     _In_ WDFREQUEST request, 
@@ -293,12 +433,6 @@ static NTSTATUS AtfHandleSendWfpConfig(
 {
     NTSTATUS ntStatus = STATUS_SUCCESS;
 
-    if (IsWfpRunning()) {
-        // WFP cannot be running when sending the config
-        ATF_ERROR(IsWfpRunning, STATUS_DEVICE_BUSY);
-        return STATUS_DEVICE_BUSY;
-    }
-
     if (bufLen == 0) {
         return STATUS_NO_DATA_DETECTED;
     }
@@ -334,7 +468,9 @@ static NTSTATUS AtfHandleSendWfpConfig(
     //  inputs. The filter does not need a filter state of its own.
     //
     // If a default config already exists, we can override it, so the filter engine
-    //  will destroy the configCtx and load the new one as supplied by the user
+    //  will swap in the new configCtx as supplied by the user, and destroy the old one.
+    //  A bulk upload that was opened against the old config is discarded
+    AtfBulkUploadDiscard();
     AtfFilterStoreDefaultConfig(configCtx);
 
     ATF_DEBUG(AtfHandleSendWfpConfig, "Sucessfully processed config ini!");
@@ -348,12 +484,6 @@ static NTSTATUS AtfHandlerAppendIpv4Blacklist(
 {
     NTSTATUS ntStatus = STATUS_SUCCESS;
 
-    if (IsWfpRunning()) {
-        // WFP cannot be running when sending the blacklist
-        ATF_ERROR(IsWfpRunning, STATUS_DEVICE_BUSY);
-        return STATUS_DEVICE_BUSY;
-    }
-
     //
     // There must exist at least a default config (IOCTL_ATF_SEND_WFP_CONFIG) before blacklist IPs can be appended
     //
@@ -370,15 +500,41 @@ static NTSTATUS AtfHandlerAppendIpv4Blacklist(
         return STATUS_BUFFER_TOO_SMALL;
     }
 
-    //
-    // config.c will reallocate this memory and store a pointer into the current filter.c's CONFIG_CTX object
-    //
-    CONFIG_CTX *configCtx = AtfFilterGetCurrentConfig();
-    if (!configCtx) {
-        ATF_ERROR(AtfFilterGetCurrentConfig, STATUS_DEVICE_NOT_READY);
+    VOID *rawBuf = NULL;
+
+    ntStatus = WdfRequestRetrieveInputBuffer(
+        request,
+        bufLen,
+        (PVOID *)&rawBuf,
+        NULL
+    );
+    if (!NT_SUCCESS(ntStatus)) {
+        return ntStatus;
+    }
+
+    return AtfPublishIpv4Blacklist(rawBuf, bufLen);
+}
+
+static NTSTATUS AtfHandleApplyIpv4Delta(
+    _In_ WDFREQUEST request,
+    _In_ size_t bufLen
+)
+{
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+
+    if (!AtfFilterIsInitialized()) {
+        ATF_ERROR(AtfFilterIsInitialized, STATUS_DEVICE_NOT_READY);
         return STATUS_DEVICE_NOT_READY;
     }
 
+    if (bufLen < sizeof(IPV4_DELTA_HEADER)) {
+        return STATUS_NO_DATA_DETECTED;
+    }
+
+    if (bufLen > IPV4_DELTA_MAX_SIZE) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
     VOID *rawBuf = NULL;
 
     ntStatus = WdfRequestRetrieveInputBuffer(
@@ -391,13 +547,482 @@ static NTSTATUS AtfHandlerAppendIpv4Blacklist(
         return ntStatus;
     }
 
-    ATF_ERROR atfError = AtfConfigAddIpv4Blacklist(configCtx, rawBuf, bufLen);
+    return AtfPublishIpv4Delta(rawBuf, bufLen);
+}
+
+static NTSTATUS AtfHandleBulkUploadBegin(
+    _In_ WDFREQUEST request, 
+    _In_ size_t bufLen
+)
+{
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+
+    //
+    // The payload is applied to the current config on commit, so a default config must exist
+    //
+    if (!AtfFilterIsInitialized()) {
+        ATF_ERROR(AtfFilterIsInitialized, STATUS_DEVICE_NOT_READY);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (bufLen != sizeof(BULK_UPLOAD_BEGIN)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    BULK_UPLOAD_BEGIN *begin = NULL;
+
+    ntStatus = WdfRequestRetrieveInputBuffer(
+        request,
+        sizeof(BULK_UPLOAD_BEGIN),
+        (PVOID *)&begin,
+        NULL
+    );
+    if (!NT_SUCCESS(ntStatus)) {
+        return ntStatus;
+    }
+
+    if (begin->magic != BULK_UPLOAD_MAGIC) {
+        return STATUS_BAD_DATA;
+    }
+
+    if (begin->totalSize == 0 || begin->totalSize > BULK_UPLOAD_MAX_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    switch (begin->payloadType)
+    {
+    case BULK_PAYLOAD_IPV4_BLOCKLIST:
+        {
+            if (begin->totalSize % sizeof(IPV4_PREFIX_ENTRY)) {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+    case BULK_PAYLOAD_IPV6_BLOCKLIST:
+        {
+            if (begin->totalSize % sizeof(IPV6_PREFIX_ENTRY)) {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+    case BULK_PAYLOAD_IPV4_IMAGE:
+        {
+            // The image itself is validated on commit
+            if (begin->totalSize < sizeof(IPV4_IMAGE_HEADER) || begin->totalSize % IPV4_IMAGE_ALIGNMENT) {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+    case BULK_PAYLOAD_IPV4_DELTA:
+        {
+            // The entry counts are checked against the size on commit
+            if (begin->totalSize < sizeof(IPV4_DELTA_HEADER) ||
+                (begin->totalSize - sizeof(IPV4_DELTA_HEADER)) % sizeof(IPV4_PREFIX_ENTRY)) {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+    case BULK_PAYLOAD_IPV4_RULES:
+        {
+            // The rules themselves are validated on commit
+            if (begin->totalSize % sizeof(IPV4_RULE_ENTRY) ||
+                begin->totalSize / sizeof(IPV4_RULE_ENTRY) > IPV4_RULES_MAX_ENTRIES) {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+    case BULK_PAYLOAD_DOMAIN_IMAGE:
+        {
+            // The image itself is validated on commit
+            if (begin->totalSize < sizeof(DOMAIN_DAFSA_HEADER) || begin->totalSize % DOMAIN_DAFSA_ALIGNMENT) {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+    case BULK_PAYLOAD_SIGNATURE_IMAGE:
+        {
+            // The image itself is validated on commit
+            if (begin->totalSize < sizeof(PAYLOAD_SIG_HEADER) || begin->totalSize % PAYLOAD_SIG_ALIGNMENT) {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+    default:
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        break;
+    }
+
+    // A previous session that was never committed is discarded
+    AtfBulkUploadDiscard();
+
+    gBulkSession.buffer = (UINT8 *)AtfMallocPP((SIZE_T)begin->totalSize);
+    if (!gBulkSession.buffer) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    gBulkSession.payloadType = begin->payloadType;
+    gBulkSession.totalSize = (size_t)begin->totalSize;
+    gBulkSession.receivedSize = 0;
+
+    ATF_DEBUGA("[atftrace] Bulk upload session opened (type: %d, size: %llu)", 
+        gBulkSession.payloadType, (UINT64)gBulkSession.totalSize);
+
+    return ntStatus;
+}
+
+static NTSTATUS AtfHandleBulkUploadData(
+    _In_ WDFREQUEST request, 
+    _In_ size_t bufLen,
+    _In_ size_t dataLen
+)
+{
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+
+    if (gBulkSession.payloadType == BULK_PAYLOAD_NONE) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (bufLen != sizeof(BULK_UPLOAD_DATA)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (dataLen == 0 || dataLen > BULK_UPLOAD_MAX_TRANSFER_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    BULK_UPLOAD_DATA *header = NULL;
+
+    ntStatus = WdfRequestRetrieveInputBuffer(
+        request,
+        sizeof(BULK_UPLOAD_DATA),
+        (PVOID *)&header,
+        NULL
+    );
+    if (!NT_SUCCESS(ntStatus)) {
+        return ntStatus;
+    }
+
+    // Transfers must be sequential, and cannot exceed the size declared in IOCTL_ATF_BULK_UPLOAD_BEGIN
+    if (header->offset != gBulkSession.receivedSize || dataLen > gBulkSession.totalSize - gBulkSession.receivedSize) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // METHOD_IN_DIRECT: the payload is the output buffer, locked and mapped by the I/O manager rather than copied
+    //
+    VOID *data = NULL;
+
+    ntStatus = WdfRequestRetrieveOutputBuffer(
+        request,
+        dataLen,
+        (PVOID *)&data,
+        NULL
+    );
+    if (!NT_SUCCESS(ntStatus)) {
+        return ntStatus;
+    }
+
+    RtlCopyMemory(&gBulkSession.buffer[gBulkSession.receivedSize], data, dataLen);
+    gBulkSession.receivedSize += dataLen;
+
+    return ntStatus;
+}
+
+static NTSTATUS AtfHandleBulkUploadCommit(VOID)
+{
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+
+    if (gBulkSession.payloadType == BULK_PAYLOAD_NONE) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    // The session is kept open, so the service can resend the missing data
+    if (gBulkSession.receivedSize != gBulkSession.totalSize) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    switch (gBulkSession.payloadType)
+    {
+    case BULK_PAYLOAD_IPV4_BLOCKLIST:
+        {
+            ntStatus = AtfPublishIpv4Blacklist(gBulkSession.buffer, gBulkSession.totalSize);
+        }
+        break;
+    case BULK_PAYLOAD_IPV4_IMAGE:
+        {
+            ntStatus = AtfPublishIpv4Image(gBulkSession.buffer, gBulkSession.totalSize);
+        }
+        break;
+    case BULK_PAYLOAD_IPV4_DELTA:
+        {
+            ntStatus = AtfPublishIpv4Delta(gBulkSession.buffer, gBulkSession.totalSize);
+        }
+        break;
+    case BULK_PAYLOAD_IPV6_BLOCKLIST:
+        {
+            ntStatus = AtfPublishIpv6Blacklist(gBulkSession.buffer, gBulkSession.totalSize);
+        }
+        break;
+    case BULK_PAYLOAD_IPV4_RULES:
+        {
+            ntStatus = AtfPublishIpv4Rules(gBulkSession.buffer, gBulkSession.totalSize);
+        }
+        break;
+    case BULK_PAYLOAD_DOMAIN_IMAGE:
+        {
+            ntStatus = AtfPublishDomainImage(gBulkSession.buffer, gBulkSession.totalSize);
+        }
+        break;
+    case BULK_PAYLOAD_SIGNATURE_IMAGE:
+        {
+            ntStatus = AtfPublishSignatureImage(gBulkSession.buffer, gBulkSession.totalSize);
+        }
+        break;
+    default:
+        {
+            ntStatus = STATUS_INVALID_PARAMETER;
+        }
+        break;
+    }
+
+    AtfBulkUploadDiscard();
+
+    return ntStatus;
+}
+
+static VOID AtfBulkUploadDiscard(VOID)
+{
+    if (gBulkSession.buffer) {
+        AtfFreePP(gBulkSession.buffer);
+    }
+
+    RtlZeroMemory(&gBulkSession, sizeof(BULK_UPLOAD_SESSION));
+}
+
+static NTSTATUS AtfPublishIpv4Blacklist(
+    _In_ const VOID *blacklist,
+    _In_ size_t bufLen
+)
+{
+    const CONFIG_CTX *configCtx = AtfFilterGetCurrentConfig();
+    if (!configCtx) {
+        ATF_ERROR(AtfFilterGetCurrentConfig, STATUS_DEVICE_NOT_READY);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    //
+    // The new config is built off to the side, the callouts keep using the current config until it is published
+    //
+    CONFIG_CTX *newConfigCtx = NULL;
+    ATF_ERROR atfError = AtfConfigClone(configCtx, &newConfigCtx);
+    if (atfError) {
+        ATF_ERROR(AtfConfigClone, atfError);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    atfError = AtfConfigAddIpv4Blacklist(newConfigCtx, blacklist, bufLen);
     if (atfError) {
         ATF_ERROR(AtfConfigAddIpv4Blacklist, atfError);
+        AtfFreeConfig(newConfigCtx);
         return STATUS_DEVICE_NOT_READY;
     }
 
-    return ntStatus;
+    AtfFilterStoreDefaultConfig(newConfigCtx);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS AtfPublishIpv4Image(
+    _In_ const VOID *image,
+    _In_ size_t imageSize
+)
+{
+    const CONFIG_CTX *configCtx = AtfFilterGetCurrentConfig();
+    if (!configCtx) {
+        ATF_ERROR(AtfFilterGetCurrentConfig, STATUS_DEVICE_NOT_READY);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    // The image is only supported by the trie engine, the service sends a raw blocklist for other engines
+    if (configCtx->ipv4LookupEngine != IPV4_ENGINE_TRIE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    CONFIG_CTX *newConfigCtx = NULL;
+    ATF_ERROR atfError = AtfConfigClone(configCtx, &newConfigCtx);
+    if (atfError) {
+        ATF_ERROR(AtfConfigClone, atfError);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    atfError = AtfConfigSetIpv4Image(newConfigCtx, image, imageSize);
+    if (atfError) {
+        ATF_ERROR(AtfConfigSetIpv4Image, atfError);
+        AtfFreeConfig(newConfigCtx);
+        return atfError == ATF_CORRUPT_IMAGE ? STATUS_BAD_DATA : STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AtfFilterStoreDefaultConfig(newConfigCtx);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS AtfPublishIpv4Delta(
+    _In_ const VOID *delta,
+    _In_ size_t deltaSize
+)
+{
+    const CONFIG_CTX *configCtx = AtfFilterGetCurrentConfig();
+    if (!configCtx) {
+        ATF_ERROR(AtfFilterGetCurrentConfig, STATUS_DEVICE_NOT_READY);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    //
+    // The clone copies the engine as a whole, but only the entries of the delta are inserted or removed,
+    //  instead of flushing the config and inserting the full blocklist again
+    //
+    CONFIG_CTX *newConfigCtx = NULL;
+    ATF_ERROR atfError = AtfConfigClone(configCtx, &newConfigCtx);
+    if (atfError) {
+        ATF_ERROR(AtfConfigClone, atfError);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    atfError = AtfConfigApplyIpv4Delta(newConfigCtx, delta, deltaSize);
+    if (atfError) {
+        ATF_ERROR(AtfConfigApplyIpv4Delta, atfError);
+        AtfFreeConfig(newConfigCtx);
+        return atfError == ATF_BAD_PARAMETERS ? STATUS_BAD_DATA : STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AtfFilterStoreDefaultConfig(newConfigCtx);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS AtfPublishIpv6Blacklist(
+    _In_ const VOID *blacklist,
+    _In_ size_t bufLen
+)
+{
+    const CONFIG_CTX *configCtx = AtfFilterGetCurrentConfig();
+    if (!configCtx) {
+        ATF_ERROR(AtfFilterGetCurrentConfig, STATUS_DEVICE_NOT_READY);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    CONFIG_CTX *newConfigCtx = NULL;
+    ATF_ERROR atfError = AtfConfigClone(configCtx, &newConfigCtx);
+    if (atfError) {
+        ATF_ERROR(AtfConfigClone, atfError);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // IPv4-mapped entries go into the IPv4 lookup engine of the new config
+    atfError = AtfConfigAddIpv6Blacklist(newConfigCtx, blacklist, bufLen);
+    if (atfError) {
+        ATF_ERROR(AtfConfigAddIpv6Blacklist, atfError);
+        AtfFreeConfig(newConfigCtx);
+        return atfError == ATF_BAD_PARAMETERS ? STATUS_BAD_DATA : STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AtfFilterStoreDefaultConfig(newConfigCtx);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS AtfPublishIpv4Rules(
+    _In_ const VOID *rules,
+    _In_ size_t bufLen
+)
+{
+    const CONFIG_CTX *configCtx = AtfFilterGetCurrentConfig();
+    if (!configCtx) {
+        ATF_ERROR(AtfFilterGetCurrentConfig, STATUS_DEVICE_NOT_READY);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    CONFIG_CTX *newConfigCtx = NULL;
+    ATF_ERROR atfError = AtfConfigClone(configCtx, &newConfigCtx);
+    if (atfError) {
+        ATF_ERROR(AtfConfigClone, atfError);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // The clone shares the rules of the current config, they are released when it is replaced
+    atfError = AtfConfigSetIpv4Rules(newConfigCtx, rules, bufLen);
+    if (atfError) {
+        ATF_ERROR(AtfConfigSetIpv4Rules, atfError);
+        AtfFreeConfig(newConfigCtx);
+        return atfError == ATF_BAD_PARAMETERS ? STATUS_BAD_DATA : STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AtfFilterStoreDefaultConfig(newConfigCtx);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS AtfPublishDomainImage(
+    _In_ const VOID *image,
+    _In_ size_t imageSize
+)
+{
+    const CONFIG_CTX *configCtx = AtfFilterGetCurrentConfig();
+    if (!configCtx) {
+        ATF_ERROR(AtfFilterGetCurrentConfig, STATUS_DEVICE_NOT_READY);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    CONFIG_CTX *newConfigCtx = NULL;
+    ATF_ERROR atfError = AtfConfigClone(configCtx, &newConfigCtx);
+    if (atfError) {
+        ATF_ERROR(AtfConfigClone, atfError);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    atfError = AtfConfigSetDomainBlocklist(newConfigCtx, image, imageSize);
+    if (atfError) {
+        ATF_ERROR(AtfConfigSetDomainBlocklist, atfError);
+        AtfFreeConfig(newConfigCtx);
+        return atfError == ATF_CORRUPT_IMAGE ? STATUS_BAD_DATA : STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AtfFilterStoreDefaultConfig(newConfigCtx);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS AtfPublishSignatureImage(
+    _In_ const VOID *image,
+    _In_ size_t imageSize
+)
+{
+    const CONFIG_CTX *configCtx = AtfFilterGetCurrentConfig();
+    if (!configCtx) {
+        ATF_ERROR(AtfFilterGetCurrentConfig, STATUS_DEVICE_NOT_READY);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    CONFIG_CTX *newConfigCtx = NULL;
+    ATF_ERROR atfError = AtfConfigClone(configCtx, &newConfigCtx);
+    if (atfError) {
+        ATF_ERROR(AtfConfigClone, atfError);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    atfError = AtfConfigSetPayloadSignatures(newConfigCtx, image, imageSize);
+    if (atfError) {
+        ATF_ERROR(AtfConfigSetPayloadSignatures, atfError);
+        AtfFreeConfig(newConfigCtx);
+        return atfError == ATF_CORRUPT_IMAGE ? STATUS_BAD_DATA : STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AtfFilterStoreDefaultConfig(newConfigCtx);
+
+    return STATUS_SUCCESS;
 }
 
 //EOF
\ No newline at end of file
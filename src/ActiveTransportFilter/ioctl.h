@@ -10,3 +10,8 @@
 NTSTATUS AtfInitializeIoctlHandlers(
     WDFDEVICE wdfDevice
 );
+
+//
+// Release resources held by the IOCTL handlers (i.e. an open bulk upload session), called on driver unload
+//
+VOID AtfIoctlCleanup(VOID);
\ No newline at end of file
@@ -0,0 +1,582 @@
+#include <ntddk.h>
+
+#include <inaddr.h>
+#include <limits.h>
+
+#include "ipv4_cuckoo.h"
+
+#include "mem.h"
+#include "trace.h"
+
+//
+// SSE2 is part of the x64 baseline, and XMM registers may be used at any IRQL in x64 kernel code.
+//  Other targets compare the slots one at a time
+//
+#if defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define IPV4_CUCKOO_SSE2
+#endif //_M_X64
+
+C_ASSERT(sizeof(IPV4_CUCKOO_BUCKET) == 32);
+C_ASSERT(IPV4_CUCKOO_BUCKET_SLOTS == 8);
+
+//
+// Allocate a zeroed bucket array of numOfBuckets buckets, aligned to IPV4_CUCKOO_ALIGNMENT
+//
+static ATF_ERROR AtfIpv4CuckooAllocBuckets(IPV4_CUCKOO_CTX *ctx, size_t numOfBuckets);
+
+//
+// Number of buckets needed to hold numOfAddresses at IPV4_CUCKOO_LOAD_PERCENT occupancy
+//
+static size_t AtfIpv4CuckooBucketsFor(size_t numOfAddresses);
+
+//
+// The two candidate buckets of a key
+//
+static __forceinline VOID AtfIpv4CuckooGetBuckets(
+    const IPV4_CUCKOO_CTX *ctx,
+    UINT32 key,
+    size_t *firstOut,
+    size_t *secondOut
+);
+
+//
+// Returns TRUE if the key is in the bucket
+//
+static __forceinline BOOLEAN AtfIpv4CuckooBucketContains(const IPV4_CUCKOO_BUCKET *bucket, UINT32 key);
+
+//
+// Returns TRUE if the key is in the table (0.0.0.0 excluded)
+//
+static BOOLEAN AtfIpv4CuckooContains(const IPV4_CUCKOO_CTX *ctx, UINT32 key);
+
+//
+// Place a key, evicting other keys to their other bucket as needed
+//  Returns IPV4_CUCKOO_EMPTY_SLOT on success, otherwise the key left without a slot (not necessarily the input key)
+//
+static UINT32 AtfIpv4CuckooPlace(IPV4_CUCKOO_CTX *ctx, UINT32 key);
+
+//
+// Rebuild the table with a new seed, and at least numOfBuckets buckets. homelessKey (if not IPV4_CUCKOO_EMPTY_SLOT)
+//  is placed along with the current keys. The table grows by a quarter on every failed attempt
+//
+static ATF_ERROR AtfIpv4CuckooRebuild(IPV4_CUCKOO_CTX *ctx, size_t numOfBuckets, UINT32 homelessKey);
+
+//
+// Insert a single /32 address
+//
+static ATF_ERROR AtfIpv4CuckooInsert(IPV4_CUCKOO_CTX *ctx, UINT32 key);
+
+//
+// Remove a single /32 address
+//
+static VOID AtfIpv4CuckooRemove(IPV4_CUCKOO_CTX *ctx, UINT32 key);
+
+//
+// Update totalTableSize and totalNumOfPrefixes
+//
+static VOID AtfIpv4CuckooUpdateStats(IPV4_CUCKOO_CTX *ctx);
+
+ATF_ERROR AtfIpv4CuckooAllocCtx(IPV4_CUCKOO_CTX **ctxOut)
+{
+    if (!ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    IPV4_CUCKOO_CTX *ctx = (IPV4_CUCKOO_CTX *)ATF_MALLOC(sizeof(IPV4_CUCKOO_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    // The seed only needs to differ between tables, so that a crafted feed cannot force rebuilds
+    LARGE_INTEGER counter = KeQueryPerformanceCounter(NULL);
+    ctx->seed = (UINT64)counter.QuadPart;
+    ctx->kickState = (UINT32)counter.QuadPart;
+
+    ATF_ERROR atfError = AtfIpv4CuckooAllocBuckets(ctx, IPV4_CUCKOO_MIN_BUCKETS);
+    if (atfError) {
+        ATF_FREE(ctx);
+        return atfError;
+    }
+
+    AtfIpv4CuckooUpdateStats(ctx);
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfIpv4CuckooInsertPool(IPV4_CUCKOO_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    if (!ctx || !pool || !numOfEntries) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    size_t numOfHostEntries = 0;
+    for (size_t i = 0; i < numOfEntries; i++) {
+        const UINT8 prefixLength = pool[i].prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            return ATF_BAD_PARAMETERS;
+        }
+
+        if (prefixLength == IPV4_PREFIX_MAX_LENGTH) {
+            numOfHostEntries++;
+        }
+    }
+
+    // Size the table once for the whole pool, rather than growing it while inserting
+    const size_t requiredBuckets = AtfIpv4CuckooBucketsFor(ctx->numOfAddresses + numOfHostEntries);
+    if (requiredBuckets > ctx->numOfBuckets) {
+        atfError = AtfIpv4CuckooRebuild(ctx, requiredBuckets, IPV4_CUCKOO_EMPTY_SLOT);
+        if (atfError) {
+            return atfError;
+        }
+    }
+
+    for (size_t i = 0; i < numOfEntries; i++) {
+        if (pool[i].prefixLength == IPV4_PREFIX_MAX_LENGTH) {
+            atfError = AtfIpv4CuckooInsert(ctx, pool[i].address.S_un.S_addr);
+        } else {
+            if (!ctx->trieCtx) {
+                atfError = AtfIpv4TrieAllocCtx(&ctx->trieCtx);
+                if (atfError) {
+                    break;
+                }
+            }
+
+            atfError = AtfIpv4TrieInsertPool(ctx->trieCtx, &pool[i], 1);
+        }
+
+        if (atfError) {
+            break;
+        }
+    }
+
+    AtfIpv4CuckooUpdateStats(ctx);
+
+    return atfError;
+}
+
+ATF_ERROR AtfIpv4CuckooRemovePool(IPV4_CUCKOO_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    if (!ctx || !pool || !numOfEntries) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    for (size_t i = 0; i < numOfEntries; i++) {
+        const UINT8 prefixLength = pool[i].prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            atfError = ATF_BAD_PARAMETERS;
+            break;
+        }
+
+        if (prefixLength == IPV4_PREFIX_MAX_LENGTH) {
+            AtfIpv4CuckooRemove(ctx, pool[i].address.S_un.S_addr);
+        } else if (ctx->trieCtx) {
+            atfError = AtfIpv4TrieRemovePool(ctx->trieCtx, &pool[i], 1);
+            if (atfError) {
+                break;
+            }
+        }
+    }
+
+    // An empty trie is only its root, which is dropped so that lookups stop at the hash set again
+    if (ctx->trieCtx && ctx->trieCtx->totalNumOfNodes == 1 && !AtfIpv4TrieBitmapCount(ctx->trieCtx->root.leafBitmap)) {
+        AtfIpv4TrieFree(&ctx->trieCtx);
+    }
+
+    AtfIpv4CuckooUpdateStats(ctx);
+
+    return atfError;
+}
+
+UINT8 AtfIpv4CuckooSearch(const IPV4_CUCKOO_CTX *ctx, struct in_addr ip)
+{
+    if (!ctx) {
+        return 0;
+    }
+
+    const UINT32 key = ip.S_un.S_addr;
+
+    if (key == IPV4_CUCKOO_EMPTY_SLOT ? ctx->hasZeroAddress : AtfIpv4CuckooContains(ctx, key)) {
+        return IPV4_PREFIX_MAX_LENGTH;
+    }
+
+    return AtfIpv4TrieSearch(ctx->trieCtx, ip);
+}
+
+VOID AtfIpv4CuckooSearchBatch(
+    const IPV4_CUCKOO_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+)
+{
+    if (!ips || !resultsOut) {
+        return;
+    }
+
+    if (!ctx) {
+        RtlZeroMemory(resultsOut, numOfIps * sizeof(UINT8));
+        return;
+    }
+
+    size_t firstBuckets[IPV4_TRIE_BATCH_WINDOW];
+    size_t secondBuckets[IPV4_TRIE_BATCH_WINDOW];
+
+    for (size_t base = 0; base < numOfIps; base += IPV4_TRIE_BATCH_WINDOW) {
+        const size_t windowSize =
+            (numOfIps - base) < IPV4_TRIE_BATCH_WINDOW ? (numOfIps - base) : IPV4_TRIE_BATCH_WINDOW;
+
+        for (size_t i = 0; i < windowSize; i++) {
+            AtfIpv4CuckooGetBuckets(ctx, ips[base + i].S_un.S_addr, &firstBuckets[i], &secondBuckets[i]);
+
+            PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &ctx->buckets[firstBuckets[i]]);
+            PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &ctx->buckets[secondBuckets[i]]);
+        }
+
+        for (size_t i = 0; i < windowSize; i++) {
+            const UINT32 key = ips[base + i].S_un.S_addr;
+
+            BOOLEAN isFound = FALSE;
+            if (key == IPV4_CUCKOO_EMPTY_SLOT) {
+                isFound = ctx->hasZeroAddress;
+            } else {
+                isFound = AtfIpv4CuckooBucketContains(&ctx->buckets[firstBuckets[i]], key) ||
+                    AtfIpv4CuckooBucketContains(&ctx->buckets[secondBuckets[i]], key);
+            }
+
+            resultsOut[base + i] = isFound ? IPV4_PREFIX_MAX_LENGTH : 0;
+        }
+
+        // Shorter prefixes, only for the misses
+        if (ctx->trieCtx) {
+            for (size_t i = 0; i < windowSize; i++) {
+                if (!resultsOut[base + i]) {
+                    resultsOut[base + i] = AtfIpv4TrieSearch(ctx->trieCtx, ips[base + i]);
+                }
+            }
+        }
+    }
+}
+
+ATF_ERROR AtfIpv4CuckooClone(const IPV4_CUCKOO_CTX *src, IPV4_CUCKOO_CTX **ctxOut)
+{
+    if (!src || !ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    IPV4_CUCKOO_CTX *ctx = (IPV4_CUCKOO_CTX *)ATF_MALLOC(sizeof(IPV4_CUCKOO_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    RtlCopyMemory(ctx, src, sizeof(IPV4_CUCKOO_CTX));
+    ctx->buckets = NULL;
+    ctx->bucketAllocation = NULL;
+    ctx->trieCtx = NULL;
+
+    ATF_ERROR atfError = AtfIpv4CuckooAllocBuckets(ctx, src->numOfBuckets);
+    if (atfError) {
+        AtfIpv4CuckooFree(&ctx);
+        return atfError;
+    }
+
+    RtlCopyMemory(ctx->buckets, src->buckets, src->numOfBuckets * sizeof(IPV4_CUCKOO_BUCKET));
+
+    if (src->trieCtx) {
+        atfError = AtfIpv4TrieClone(src->trieCtx, &ctx->trieCtx);
+        if (atfError) {
+            AtfIpv4CuckooFree(&ctx);
+            return atfError;
+        }
+    }
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+VOID AtfIpv4CuckooPrintCtx(const IPV4_CUCKOO_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] IPv4 Cuckoo Stats: Num of addresses: %llu, Num of buckets: %llu, Load: %llu%%, Rebuilds: %llu, Total table size: %llu, Num of prefixes: %llu",
+        (UINT64)ctx->numOfAddresses, (UINT64)ctx->numOfBuckets,
+        (UINT64)(ctx->numOfAddresses * 100 / (ctx->numOfBuckets * IPV4_CUCKOO_BUCKET_SLOTS)),
+        (UINT64)ctx->numOfRebuilds, (UINT64)ctx->totalTableSize, (UINT64)ctx->totalNumOfPrefixes);
+
+    AtfIpv4TriePrintCtx(ctx->trieCtx);
+}
+
+VOID AtfIpv4CuckooFree(IPV4_CUCKOO_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    IPV4_CUCKOO_CTX *c = *ctx;
+
+    if (c->bucketAllocation) {
+        ATF_FREE(c->bucketAllocation);
+    }
+
+    AtfIpv4TrieFree(&c->trieCtx);
+
+    RtlZeroMemory(c, sizeof(IPV4_CUCKOO_CTX));
+    ATF_FREE(c);
+    *ctx = NULL;
+}
+
+static ATF_ERROR AtfIpv4CuckooAllocBuckets(IPV4_CUCKOO_CTX *ctx, size_t numOfBuckets)
+{
+    if (numOfBuckets > _UI32_MAX) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    VOID *allocation = ATF_MALLOC(numOfBuckets * sizeof(IPV4_CUCKOO_BUCKET) + IPV4_CUCKOO_ALIGNMENT);
+    if (!allocation) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    ctx->bucketAllocation = allocation;
+    ctx->buckets = (IPV4_CUCKOO_BUCKET *)(((ULONG_PTR)allocation + IPV4_CUCKOO_ALIGNMENT - 1) & ~((ULONG_PTR)IPV4_CUCKOO_ALIGNMENT - 1));
+    ctx->numOfBuckets = numOfBuckets;
+
+    return ATF_ERROR_OK;
+}
+
+static size_t AtfIpv4CuckooBucketsFor(size_t numOfAddresses)
+{
+    const size_t slotsPerBucket = IPV4_CUCKOO_BUCKET_SLOTS * IPV4_CUCKOO_LOAD_PERCENT;
+    const size_t numOfBuckets = (numOfAddresses * 100 + slotsPerBucket - 1) / slotsPerBucket;
+
+    return numOfBuckets < IPV4_CUCKOO_MIN_BUCKETS ? IPV4_CUCKOO_MIN_BUCKETS : numOfBuckets;
+}
+
+static __forceinline VOID AtfIpv4CuckooGetBuckets(
+    const IPV4_CUCKOO_CTX *ctx,
+    UINT32 key,
+    size_t *firstOut,
+    size_t *secondOut
+)
+{
+    // 64-bit mix (murmur3 finalizer), each half picks a bucket by multiply-shift rather than modulo
+    UINT64 hash = key ^ ctx->seed;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    const size_t first = (size_t)(((hash & _UI32_MAX) * ctx->numOfBuckets) >> 32);
+    size_t second = (size_t)(((hash >> 32) * ctx->numOfBuckets) >> 32);
+
+    if (second == first) {
+        second = (first + 1 == ctx->numOfBuckets) ? 0 : first + 1;
+    }
+
+    *firstOut = first;
+    *secondOut = second;
+}
+
+static __forceinline BOOLEAN AtfIpv4CuckooBucketContains(const IPV4_CUCKOO_BUCKET *bucket, UINT32 key)
+{
+#if defined(IPV4_CUCKOO_SSE2)
+    const __m128i needle = _mm_set1_epi32((int)key);
+    const __m128i low = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)&bucket->keys[0]), needle);
+    const __m128i high = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)&bucket->keys[4]), needle);
+
+    return _mm_movemask_epi8(_mm_or_si128(low, high)) != 0;
+#else
+    for (UINT32 i = 0; i < IPV4_CUCKOO_BUCKET_SLOTS; i++) {
+        if (bucket->keys[i] == key) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+#endif //IPV4_CUCKOO_SSE2
+}
+
+static BOOLEAN AtfIpv4CuckooContains(const IPV4_CUCKOO_CTX *ctx, UINT32 key)
+{
+    size_t first, second;
+    AtfIpv4CuckooGetBuckets(ctx, key, &first, &second);
+
+    return AtfIpv4CuckooBucketContains(&ctx->buckets[first], key) ||
+        AtfIpv4CuckooBucketContains(&ctx->buckets[second], key);
+}
+
+static UINT32 AtfIpv4CuckooPlace(IPV4_CUCKOO_CTX *ctx, UINT32 key)
+{
+    UINT32 currKey = key;
+
+    for (UINT32 kick = 0; kick < IPV4_CUCKOO_MAX_KICKS; kick++) {
+        size_t first, second;
+        AtfIpv4CuckooGetBuckets(ctx, currKey, &first, &second);
+
+        const size_t candidates[2] = { first, second };
+        for (UINT32 c = 0; c < ARRAYSIZE(candidates); c++) {
+            IPV4_CUCKOO_BUCKET *bucket = &ctx->buckets[candidates[c]];
+
+            for (UINT32 slot = 0; slot < IPV4_CUCKOO_BUCKET_SLOTS; slot++) {
+                if (bucket->keys[slot] == IPV4_CUCKOO_EMPTY_SLOT) {
+                    bucket->keys[slot] = currKey;
+                    return IPV4_CUCKOO_EMPTY_SLOT;
+                }
+            }
+        }
+
+        // Both buckets are full, evict a pseudo-random slot of either, and move the evicted key instead
+        ctx->kickState = ctx->kickState * 1103515245 + 12345;
+
+        IPV4_CUCKOO_BUCKET *victimBucket = &ctx->buckets[candidates[(ctx->kickState >> 16) & 1]];
+        UINT32 *victimSlot = &victimBucket->keys[(ctx->kickState >> 20) % IPV4_CUCKOO_BUCKET_SLOTS];
+
+        const UINT32 victimKey = *victimSlot;
+        *victimSlot = currKey;
+        currKey = victimKey;
+    }
+
+    return currKey;
+}
+
+static ATF_ERROR AtfIpv4CuckooRebuild(IPV4_CUCKOO_CTX *ctx, size_t numOfBuckets, UINT32 homelessKey)
+{
+    const IPV4_CUCKOO_BUCKET *oldBuckets = ctx->buckets;
+    const size_t oldNumOfBuckets = ctx->numOfBuckets;
+
+    //
+    // The new table is built aside, the current table stays intact until the new one holds every key
+    //
+    for (;;) {
+        IPV4_CUCKOO_CTX next;
+        RtlCopyMemory(&next, ctx, sizeof(IPV4_CUCKOO_CTX));
+
+        next.seed = ctx->seed * 0x9e3779b97f4a7c15ULL + 1;
+        ctx->seed = next.seed;
+
+        ATF_ERROR atfError = AtfIpv4CuckooAllocBuckets(&next, numOfBuckets);
+        if (atfError) {
+            return atfError;
+        }
+
+        BOOLEAN isPlaced = homelessKey == IPV4_CUCKOO_EMPTY_SLOT ||
+            AtfIpv4CuckooPlace(&next, homelessKey) == IPV4_CUCKOO_EMPTY_SLOT;
+
+        for (size_t b = 0; b < oldNumOfBuckets && isPlaced; b++) {
+            for (UINT32 slot = 0; slot < IPV4_CUCKOO_BUCKET_SLOTS && isPlaced; slot++) {
+                const UINT32 key = oldBuckets[b].keys[slot];
+                if (key != IPV4_CUCKOO_EMPTY_SLOT) {
+                    isPlaced = AtfIpv4CuckooPlace(&next, key) == IPV4_CUCKOO_EMPTY_SLOT;
+                }
+            }
+        }
+
+        if (!isPlaced) {
+            ATF_FREE(next.bucketAllocation);
+            numOfBuckets += numOfBuckets / 4;
+            continue;
+        }
+
+        ATF_FREE(ctx->bucketAllocation);
+
+        ctx->bucketAllocation = next.bucketAllocation;
+        ctx->buckets = next.buckets;
+        ctx->numOfBuckets = next.numOfBuckets;
+        ctx->kickState = next.kickState;
+        ctx->numOfRebuilds++;
+
+        return ATF_ERROR_OK;
+    }
+}
+
+static ATF_ERROR AtfIpv4CuckooInsert(IPV4_CUCKOO_CTX *ctx, UINT32 key)
+{
+    if (key == IPV4_CUCKOO_EMPTY_SLOT) {
+        if (!ctx->hasZeroAddress) {
+            ctx->hasZeroAddress = TRUE;
+            ctx->numOfAddresses++;
+        }
+
+        return ATF_ERROR_OK;
+    }
+
+    if (AtfIpv4CuckooContains(ctx, key)) {
+        return ATF_ERROR_OK;
+    }
+
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    const size_t numOfSlots = ctx->numOfBuckets * IPV4_CUCKOO_BUCKET_SLOTS;
+    if ((ctx->numOfAddresses + 1) * 100 > numOfSlots * IPV4_CUCKOO_MAX_LOAD_PERCENT) {
+        atfError = AtfIpv4CuckooRebuild(ctx, AtfIpv4CuckooBucketsFor(ctx->numOfAddresses + 1), IPV4_CUCKOO_EMPTY_SLOT);
+        if (atfError) {
+            return atfError;
+        }
+    }
+
+    // On failure some key (not necessarily this one) is left over, and the table is rebuilt to place it
+    const UINT32 homelessKey = AtfIpv4CuckooPlace(ctx, key);
+    if (homelessKey != IPV4_CUCKOO_EMPTY_SLOT) {
+        atfError = AtfIpv4CuckooRebuild(ctx, ctx->numOfBuckets, homelessKey);
+        if (atfError) {
+            return atfError;
+        }
+    }
+
+    ctx->numOfAddresses++;
+
+    return ATF_ERROR_OK;
+}
+
+static VOID AtfIpv4CuckooRemove(IPV4_CUCKOO_CTX *ctx, UINT32 key)
+{
+    if (key == IPV4_CUCKOO_EMPTY_SLOT) {
+        if (ctx->hasZeroAddress) {
+            ctx->hasZeroAddress = FALSE;
+            ctx->numOfAddresses--;
+        }
+
+        return;
+    }
+
+    size_t first, second;
+    AtfIpv4CuckooGetBuckets(ctx, key, &first, &second);
+
+    // A key is stored at most once, in either of its buckets
+    const size_t candidates[2] = { first, second };
+    for (UINT32 c = 0; c < ARRAYSIZE(candidates); c++) {
+        IPV4_CUCKOO_BUCKET *bucket = &ctx->buckets[candidates[c]];
+
+        for (UINT32 slot = 0; slot < IPV4_CUCKOO_BUCKET_SLOTS; slot++) {
+            if (bucket->keys[slot] == key) {
+                bucket->keys[slot] = IPV4_CUCKOO_EMPTY_SLOT;
+                ctx->numOfAddresses--;
+                return;
+            }
+        }
+    }
+}
+
+static VOID AtfIpv4CuckooUpdateStats(IPV4_CUCKOO_CTX *ctx)
+{
+    ctx->totalTableSize = ctx->numOfBuckets * sizeof(IPV4_CUCKOO_BUCKET);
+    ctx->totalNumOfPrefixes = ctx->numOfAddresses;
+
+    if (ctx->trieCtx) {
+        ctx->totalTableSize += ctx->trieCtx->totalTrieSize;
+        ctx->totalNumOfPrefixes += ctx->trieCtx->totalNumOfPrefixes;
+    }
+}
+
+//EOF
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include <inaddr.h>
+#include <limits.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "ipv4_trie.h"
+#include "mem.h"
+
+//
+// Bucketized cuckoo hash set for exact-match (/32) IPv4 blocklists
+//
+//  Most online feeds are lists of individual addresses, for which a trie spends most of its memory and
+//   memory accesses on structure. Instead, every address hashes to two candidate buckets, and a bucket
+//   holds IPV4_CUCKOO_BUCKET_SLOTS addresses in 32 bytes (two buckets per cache line):
+//
+//   - A lookup reads at most two buckets, and compares all of the slots of a bucket at once (SSE2 on x64)
+//   - An insert takes a free slot in either bucket, otherwise it evicts an address to its other bucket,
+//      repeating up to IPV4_CUCKOO_MAX_KICKS times. If that fails, the table is rebuilt larger
+//   - The table is sized for IPV4_CUCKOO_LOAD_PERCENT occupancy, about 4.5 bytes per address
+//
+//  The keys are whole addresses rather than fingerprints: a 32-bit key is as cheap to compare as a
+//   fingerprint, and a match needs no second memory access to confirm it. 0.0.0.0 marks a free slot, so
+//   0.0.0.0/32 itself is kept as a flag.
+//
+//  Prefixes shorter than /32 cannot be hashed, they are kept in a companion trie (see ipv4_trie.h) which is only
+//   allocated if the blocklist has any. A lookup that misses the hash set then also searches the trie.
+//
+#define IPV4_CUCKOO_BUCKET_SLOTS        8
+#define IPV4_CUCKOO_MIN_BUCKETS         64
+#define IPV4_CUCKOO_MAX_KICKS           512
+
+// Occupancy the table is sized for, and the occupancy at which it is rebuilt larger
+#define IPV4_CUCKOO_LOAD_PERCENT        90
+#define IPV4_CUCKOO_MAX_LOAD_PERCENT    95
+
+// Bucket array alignment, a bucket never spans two cache lines
+#define IPV4_CUCKOO_ALIGNMENT           64
+
+// Free slot marker
+#define IPV4_CUCKOO_EMPTY_SLOT          0
+
+//
+// Hash bucket
+//
+typedef struct DECLSPEC_ALIGN(32) _ipv4_cuckoo_bucket {
+    UINT32                          keys[IPV4_CUCKOO_BUCKET_SLOTS];
+} IPV4_CUCKOO_BUCKET, *PIPV4_CUCKOO_BUCKET;
+
+//
+// Cuckoo hash set instance context
+//
+typedef struct _ipv4_cuckoo_ctx {
+    // Total physical size of the bucket array and companion trie, in bytes
+    size_t                          totalTableSize;
+
+    // Total number of stored prefixes (duplicates are not counted)
+    size_t                          totalNumOfPrefixes;
+
+    // Number of stored /32 addresses (including 0.0.0.0)
+    size_t                          numOfAddresses;
+
+    // Number of times the table was rebuilt (grown or reseeded)
+    size_t                          numOfRebuilds;
+
+    // Hash seed, changed on every rebuild
+    UINT64                          seed;
+
+    // State of the eviction slot picker
+    UINT32                          kickState;
+
+    // 0.0.0.0/32 is in the blocklist
+    BOOLEAN                         hasZeroAddress;
+
+    // Bucket array, aligned to IPV4_CUCKOO_ALIGNMENT within the allocation
+    size_t                          numOfBuckets;
+    IPV4_CUCKOO_BUCKET              *buckets;
+    VOID                            *bucketAllocation;
+
+    // Prefixes shorter than /32, NULL if there are none
+    IPV4_TRIE_CTX                   *trieCtx;
+} IPV4_CUCKOO_CTX, *PIPV4_CUCKOO_CTX;
+
+//
+// Initialize the context, with an empty table of IPV4_CUCKOO_MIN_BUCKETS buckets
+//
+ATF_ERROR AtfIpv4CuckooAllocCtx(IPV4_CUCKOO_CTX **ctxOut);
+
+//
+// Insert a pool of ipv4 prefixes, the table is resized once up front for the /32 entries of the pool
+//
+ATF_ERROR AtfIpv4CuckooInsertPool(IPV4_CUCKOO_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Remove a pool of ipv4 prefixes. Freed slots are reused by later inserts, the table is not shrunk.
+//  The companion trie is freed once it no longer holds any prefix
+//
+ATF_ERROR AtfIpv4CuckooRemovePool(IPV4_CUCKOO_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Search for a single input IP
+//  Returns the prefix length of the longest matching entry, or 0 if the IP is not covered
+//
+UINT8 AtfIpv4CuckooSearch(const IPV4_CUCKOO_CTX *ctx, struct in_addr ip);
+
+//
+// Search for numOfIps addresses, resultsOut receives the same values as AtfIpv4CuckooSearch.
+//  Both buckets of every key in a window are prefetched before any of them is compared
+//
+VOID AtfIpv4CuckooSearchBatch(
+    const IPV4_CUCKOO_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+);
+
+//
+// Create a copy of the table (and companion trie)
+//
+ATF_ERROR AtfIpv4CuckooClone(const IPV4_CUCKOO_CTX *src, IPV4_CUCKOO_CTX **ctxOut);
+
+//
+// Print context info
+//
+VOID AtfIpv4CuckooPrintCtx(const IPV4_CUCKOO_CTX *ctx);
+
+//
+// Free the table and context
+//
+VOID AtfIpv4CuckooFree(IPV4_CUCKOO_CTX **ctx);
+
+//EOF
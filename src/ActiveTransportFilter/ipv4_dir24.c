@@ -0,0 +1,445 @@
+#include <ntddk.h>
+
+#include <inaddr.h>
+#include <limits.h>
+
+#include "ipv4_dir24.h"
+
+#include "mem.h"
+#include "trace.h"
+
+#define IPV4_DIR24_TBL24_INDEX(addr)    ((addr) >> (32 - IPV4_DIR24_TBL24_BITS))
+#define IPV4_DIR24_TBL8_INDEX(addr)     ((addr) & _UI8_MAX)
+#define IPV4_DIR24_MAX_BLOCKS           (IPV4_DIR24_EXTENDED - 1)
+
+//
+// Grow the tbl8 block pool (doubling), blocks are referenced by index so a copy is safe
+//
+static ATF_ERROR AtfIpv4Dir24GrowTbl8(IPV4_DIR24_CTX *ctx)
+{
+    const size_t newCapacity = ctx->tbl8Capacity ? ctx->tbl8Capacity * 2 : IPV4_DIR24_TBL8_INITIAL_BLOCKS;
+    if (newCapacity > IPV4_DIR24_MAX_BLOCKS) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    IPV4_DIR24_TBL8_ENTRY *newTbl8 = (IPV4_DIR24_TBL8_ENTRY *)ATF_MALLOC(newCapacity * IPV4_DIR24_TBL8_BLOCK_SIZE);
+    if (!newTbl8) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    if (ctx->tbl8) {
+        RtlCopyMemory(newTbl8, ctx->tbl8, ctx->numOfTbl8Blocks * IPV4_DIR24_TBL8_BLOCK_SIZE);
+        ATF_FREE(ctx->tbl8);
+    }
+
+    ctx->totalTableSize += (newCapacity - ctx->tbl8Capacity) * IPV4_DIR24_TBL8_BLOCK_SIZE;
+    ctx->tbl8 = newTbl8;
+    ctx->tbl8Capacity = newCapacity;
+
+    return ATF_ERROR_OK;
+}
+
+//
+// Returns the tbl8 block for a tbl24 index, converting the tbl24 entry to an extended entry if necessary.
+//  A new block inherits the prefix length that covered the whole /24
+//
+static IPV4_DIR24_TBL8_ENTRY *AtfIpv4Dir24GetOrAddBlock(IPV4_DIR24_CTX *ctx, UINT32 tbl24Index)
+{
+    const IPV4_DIR24_ENTRY entry = ctx->tbl24[tbl24Index];
+
+    if (entry & IPV4_DIR24_EXTENDED) {
+        return &ctx->tbl8[(size_t)(entry & ~IPV4_DIR24_EXTENDED) * IPV4_DIR24_TBL8_ENTRIES];
+    }
+
+    size_t blockIndex = 0;
+
+    if (ctx->numOfFreeTbl8Blocks) {
+        blockIndex = ctx->tbl8FreeList;
+        RtlCopyMemory(&ctx->tbl8FreeList, &ctx->tbl8[blockIndex * IPV4_DIR24_TBL8_ENTRIES], sizeof(size_t));
+        ctx->numOfFreeTbl8Blocks--;
+    } else {
+        if (ctx->numOfTbl8Blocks == ctx->tbl8Capacity) {
+            if (AtfIpv4Dir24GrowTbl8(ctx)) {
+                return NULL;
+            }
+        }
+
+        blockIndex = ctx->numOfTbl8Blocks++;
+    }
+
+    IPV4_DIR24_TBL8_ENTRY *block = &ctx->tbl8[blockIndex * IPV4_DIR24_TBL8_ENTRIES];
+
+    RtlFillMemory(block, IPV4_DIR24_TBL8_BLOCK_SIZE, (UCHAR)entry);
+
+    ctx->tbl24[tbl24Index] = IPV4_DIR24_EXTENDED | (IPV4_DIR24_ENTRY)blockIndex;
+
+    return block;
+}
+
+//
+// Set the entries of a tbl8 block range to prefixLength, where they are not covered by a longer prefix.
+//  Returns TRUE if any entry was changed
+//
+static BOOLEAN AtfIpv4Dir24FillBlock(
+    IPV4_DIR24_TBL8_ENTRY *block,
+    UINT32 firstEntry,
+    UINT32 numOfEntries,
+    UINT8 prefixLength
+)
+{
+    BOOLEAN isUpdated = FALSE;
+
+    for (UINT32 i = firstEntry; i < firstEntry + numOfEntries; i++) {
+        if (block[i] < prefixLength) {
+            block[i] = prefixLength;
+            isUpdated = TRUE;
+        }
+    }
+
+    return isUpdated;
+}
+
+//
+// Clear the entries of a tbl8 block range that hold exactly prefixLength.
+//  Returns TRUE if any entry was changed
+//
+static BOOLEAN AtfIpv4Dir24ClearBlock(
+    IPV4_DIR24_TBL8_ENTRY *block,
+    UINT32 firstEntry,
+    UINT32 numOfEntries,
+    UINT8 prefixLength
+)
+{
+    BOOLEAN isUpdated = FALSE;
+
+    for (UINT32 i = firstEntry; i < firstEntry + numOfEntries; i++) {
+        if (block[i] == prefixLength) {
+            block[i] = 0;
+            isUpdated = TRUE;
+        }
+    }
+
+    return isUpdated;
+}
+
+//
+// Fold the tbl8 block of an extended tbl24 entry back into the entry, if every address of the /24 has the same
+//  prefix length of 24 bits or less. The block is put on the free list
+//
+static VOID AtfIpv4Dir24CompactBlock(IPV4_DIR24_CTX *ctx, UINT32 tbl24Index)
+{
+    const IPV4_DIR24_ENTRY entry = ctx->tbl24[tbl24Index];
+    if (!(entry & IPV4_DIR24_EXTENDED)) {
+        return;
+    }
+
+    const size_t blockIndex = entry & ~IPV4_DIR24_EXTENDED;
+    IPV4_DIR24_TBL8_ENTRY *block = &ctx->tbl8[blockIndex * IPV4_DIR24_TBL8_ENTRIES];
+
+    const IPV4_DIR24_TBL8_ENTRY value = block[0];
+    if (value > IPV4_DIR24_TBL24_BITS) {
+        return;
+    }
+
+    for (UINT32 i = 1; i < IPV4_DIR24_TBL8_ENTRIES; i++) {
+        if (block[i] != value) {
+            return;
+        }
+    }
+
+    ctx->tbl24[tbl24Index] = value;
+
+    RtlCopyMemory(block, &ctx->tbl8FreeList, sizeof(size_t));
+    ctx->tbl8FreeList = blockIndex;
+    ctx->numOfFreeTbl8Blocks++;
+}
+
+ATF_ERROR AtfIpv4Dir24AllocCtx(IPV4_DIR24_CTX **ctxOut)
+{
+    if (!ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    IPV4_DIR24_CTX *ctx = (IPV4_DIR24_CTX *)ATF_MALLOC(sizeof(IPV4_DIR24_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    ctx->tbl24 = (IPV4_DIR24_ENTRY *)ATF_MALLOC(IPV4_DIR24_TBL24_SIZE);
+    if (!ctx->tbl24) {
+        ATF_FREE(ctx);
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    ctx->totalTableSize = IPV4_DIR24_TBL24_SIZE;
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfIpv4Dir24InsertPool(IPV4_DIR24_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    if (!ctx || !pool || !numOfEntries) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    for (size_t currEntry = 0; currEntry < numOfEntries; currEntry++) {
+        const UINT8 prefixLength = pool[currEntry].prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            return ATF_BAD_PARAMETERS;
+        }
+
+        const UINT32 ip = pool[currEntry].address.S_un.S_addr & IPV4_PREFIX_MASK(prefixLength);
+
+        BOOLEAN isNewPrefix = FALSE;
+
+        if (prefixLength <= IPV4_DIR24_TBL24_BITS) {
+            // Fill the covered tbl24 range, and every tbl8 block the range overlaps
+            const UINT32 firstIndex = IPV4_DIR24_TBL24_INDEX(ip);
+            const UINT32 numOfIndexes = 1UL << (IPV4_DIR24_TBL24_BITS - prefixLength);
+
+            for (UINT32 index = firstIndex; index < firstIndex + numOfIndexes; index++) {
+                const IPV4_DIR24_ENTRY entry = ctx->tbl24[index];
+
+                if (!(entry & IPV4_DIR24_EXTENDED)) {
+                    if (entry < prefixLength) {
+                        ctx->tbl24[index] = prefixLength;
+                        isNewPrefix = TRUE;
+                    }
+                    continue;
+                }
+
+                isNewPrefix |= AtfIpv4Dir24FillBlock(
+                    &ctx->tbl8[(size_t)(entry & ~IPV4_DIR24_EXTENDED) * IPV4_DIR24_TBL8_ENTRIES],
+                    0,
+                    IPV4_DIR24_TBL8_ENTRIES,
+                    prefixLength
+                );
+            }
+        } else {
+            // Fill the covered range of a single tbl8 block
+            IPV4_DIR24_TBL8_ENTRY *block = AtfIpv4Dir24GetOrAddBlock(ctx, IPV4_DIR24_TBL24_INDEX(ip));
+            if (!block) {
+                return ATF_NO_MEMORY_AVAILABLE;
+            }
+
+            isNewPrefix = AtfIpv4Dir24FillBlock(
+                block,
+                IPV4_DIR24_TBL8_INDEX(ip),
+                1UL << (IPV4_PREFIX_MAX_LENGTH - prefixLength),
+                prefixLength
+            );
+        }
+
+        if (isNewPrefix) {
+            ctx->totalNumOfPrefixes++;
+        }
+    }
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfIpv4Dir24RemovePool(IPV4_DIR24_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    if (!ctx || !pool || !numOfEntries) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    for (size_t currEntry = 0; currEntry < numOfEntries; currEntry++) {
+        const UINT8 prefixLength = pool[currEntry].prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            return ATF_BAD_PARAMETERS;
+        }
+
+        const UINT32 ip = pool[currEntry].address.S_un.S_addr & IPV4_PREFIX_MASK(prefixLength);
+
+        // Entries that hold a longer prefix were not set by this one, and stay
+        BOOLEAN isRemoved = FALSE;
+
+        if (prefixLength <= IPV4_DIR24_TBL24_BITS) {
+            const UINT32 firstIndex = IPV4_DIR24_TBL24_INDEX(ip);
+            const UINT32 numOfIndexes = 1UL << (IPV4_DIR24_TBL24_BITS - prefixLength);
+
+            for (UINT32 index = firstIndex; index < firstIndex + numOfIndexes; index++) {
+                const IPV4_DIR24_ENTRY entry = ctx->tbl24[index];
+
+                if (!(entry & IPV4_DIR24_EXTENDED)) {
+                    if (entry == prefixLength) {
+                        ctx->tbl24[index] = 0;
+                        isRemoved = TRUE;
+                    }
+                    continue;
+                }
+
+                if (AtfIpv4Dir24ClearBlock(
+                    &ctx->tbl8[(size_t)(entry & ~IPV4_DIR24_EXTENDED) * IPV4_DIR24_TBL8_ENTRIES],
+                    0,
+                    IPV4_DIR24_TBL8_ENTRIES,
+                    prefixLength)) {
+                    isRemoved = TRUE;
+                    AtfIpv4Dir24CompactBlock(ctx, index);
+                }
+            }
+        } else {
+            // A /24 without a block holds no prefix longer than 24 bits
+            const UINT32 index = IPV4_DIR24_TBL24_INDEX(ip);
+            const IPV4_DIR24_ENTRY entry = ctx->tbl24[index];
+
+            if (entry & IPV4_DIR24_EXTENDED) {
+                isRemoved = AtfIpv4Dir24ClearBlock(
+                    &ctx->tbl8[(size_t)(entry & ~IPV4_DIR24_EXTENDED) * IPV4_DIR24_TBL8_ENTRIES],
+                    IPV4_DIR24_TBL8_INDEX(ip),
+                    1UL << (IPV4_PREFIX_MAX_LENGTH - prefixLength),
+                    prefixLength
+                );
+
+                if (isRemoved) {
+                    AtfIpv4Dir24CompactBlock(ctx, index);
+                }
+            }
+        }
+
+        if (isRemoved && ctx->totalNumOfPrefixes) {
+            ctx->totalNumOfPrefixes--;
+        }
+    }
+
+    return ATF_ERROR_OK;
+}
+
+UINT8 AtfIpv4Dir24Search(const IPV4_DIR24_CTX *ctx, struct in_addr ip)
+{
+    if (!ctx || !ctx->totalNumOfPrefixes) {
+        return 0;
+    }
+
+    const UINT32 addr = ip.S_un.S_addr;
+    const IPV4_DIR24_ENTRY entry = ctx->tbl24[IPV4_DIR24_TBL24_INDEX(addr)];
+
+    if (!(entry & IPV4_DIR24_EXTENDED)) {
+        return (UINT8)entry;
+    }
+
+    return ctx->tbl8[((size_t)(entry & ~IPV4_DIR24_EXTENDED) * IPV4_DIR24_TBL8_ENTRIES) + IPV4_DIR24_TBL8_INDEX(addr)];
+}
+
+VOID AtfIpv4Dir24SearchBatch(
+    const IPV4_DIR24_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+)
+{
+    if (!ips || !resultsOut) {
+        return;
+    }
+
+    if (!ctx || !ctx->totalNumOfPrefixes) {
+        RtlZeroMemory(resultsOut, numOfIps * sizeof(UINT8));
+        return;
+    }
+
+    //
+    // Results are staged in a small window so the tbl24 loads for the window are independent
+    //  of each other, and the CPU can have them in flight at the same time
+    //
+    #define IPV4_DIR24_BATCH_WINDOW 16
+
+    IPV4_DIR24_ENTRY entries[IPV4_DIR24_BATCH_WINDOW];
+
+    for (size_t base = 0; base < numOfIps; base += IPV4_DIR24_BATCH_WINDOW) {
+        const size_t windowSize =
+            (numOfIps - base) < IPV4_DIR24_BATCH_WINDOW ? (numOfIps - base) : IPV4_DIR24_BATCH_WINDOW;
+
+        // First access: tbl24
+        for (size_t i = 0; i < windowSize; i++) {
+            entries[i] = ctx->tbl24[IPV4_DIR24_TBL24_INDEX(ips[base + i].S_un.S_addr)];
+        }
+
+        // Second access: tbl8, only for extended entries
+        for (size_t i = 0; i < windowSize; i++) {
+            const IPV4_DIR24_ENTRY entry = entries[i];
+
+            if (!(entry & IPV4_DIR24_EXTENDED)) {
+                resultsOut[base + i] = (UINT8)entry;
+                continue;
+            }
+
+            resultsOut[base + i] = ctx->tbl8[((size_t)(entry & ~IPV4_DIR24_EXTENDED) * IPV4_DIR24_TBL8_ENTRIES) +
+                IPV4_DIR24_TBL8_INDEX(ips[base + i].S_un.S_addr)];
+        }
+    }
+
+    #undef IPV4_DIR24_BATCH_WINDOW
+}
+
+ATF_ERROR AtfIpv4Dir24Clone(const IPV4_DIR24_CTX *src, IPV4_DIR24_CTX **ctxOut)
+{
+    if (!src || !ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    IPV4_DIR24_CTX *ctx = NULL;
+    ATF_ERROR atfError = AtfIpv4Dir24AllocCtx(&ctx);
+    if (atfError) {
+        return atfError;
+    }
+
+    RtlCopyMemory(ctx->tbl24, src->tbl24, IPV4_DIR24_TBL24_SIZE);
+
+    // Only the used blocks are copied, the pool keeps the capacity of the source so appends do not regrow it
+    if (src->tbl8Capacity) {
+        ctx->tbl8 = (IPV4_DIR24_TBL8_ENTRY *)ATF_MALLOC(src->tbl8Capacity * IPV4_DIR24_TBL8_BLOCK_SIZE);
+        if (!ctx->tbl8) {
+            AtfIpv4Dir24Free(&ctx);
+            return ATF_NO_MEMORY_AVAILABLE;
+        }
+
+        RtlCopyMemory(ctx->tbl8, src->tbl8, src->numOfTbl8Blocks * IPV4_DIR24_TBL8_BLOCK_SIZE);
+    }
+
+    ctx->numOfTbl8Blocks = src->numOfTbl8Blocks;
+    ctx->tbl8Capacity = src->tbl8Capacity;
+    ctx->numOfFreeTbl8Blocks = src->numOfFreeTbl8Blocks;
+    ctx->tbl8FreeList = src->tbl8FreeList;
+    ctx->totalTableSize = src->totalTableSize;
+    ctx->totalNumOfPrefixes = src->totalNumOfPrefixes;
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+VOID AtfIpv4Dir24Free(IPV4_DIR24_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    IPV4_DIR24_CTX *c = *ctx;
+
+    if (c->tbl24) {
+        ATF_FREE(c->tbl24);
+    }
+
+    if (c->tbl8) {
+        ATF_FREE(c->tbl8);
+    }
+
+    RtlZeroMemory(c, sizeof(IPV4_DIR24_CTX));
+    ATF_FREE(c);
+    *ctx = NULL;
+}
+
+VOID AtfIpv4Dir24PrintCtx(const IPV4_DIR24_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] IPv4 DIR-24-8 Stats: Num of tbl8 blocks: %llu (free: %llu), Total table size: %llu, Num of prefixes: %llu",
+        (UINT64)ctx->numOfTbl8Blocks, (UINT64)ctx->numOfFreeTbl8Blocks, (UINT64)ctx->totalTableSize,
+        (UINT64)ctx->totalNumOfPrefixes);
+}
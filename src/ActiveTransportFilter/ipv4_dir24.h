@@ -0,0 +1,118 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include <inaddr.h>
+#include <limits.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "mem.h"
+
+//
+// DIR-24-8 flat lookup table for IPv4 addresses
+//
+//  The first 24 bits of the address index directly into tbl24 (16M entries). An entry is either:
+//   0                                  -> no blocklist entry covers this /24
+//   prefix length (1-24)               -> the whole /24 is covered
+//   IPV4_DIR24_EXTENDED | block index  -> the /24 has longer entries, the last octet indexes into a tbl8 block
+//
+//  A tbl8 block holds 256 entries, one per address in the /24, each storing the prefix length that covers
+//   that address (0 if none).
+//
+//  Prefixes are expanded into every entry they cover, and an entry keeps the longest covering prefix, so the
+//   entry value is already the longest-prefix-match. A prefix of 24 bits or less fills a range of tbl24 (and the
+//   tbl8 blocks it overlaps), a longer prefix fills a range of a single tbl8 block.
+//
+//  Removing a prefix clears the entries that still hold its length. A tbl8 block whose entries all end up
+//   equal (and fit in tbl24) is folded back into its tbl24 entry, and the block is kept for reuse.
+//
+//  Most lookups are therefore one memory access, and the rest are two. The price is a fixed 64MB of
+//   non-paged memory for tbl24, plus 256 bytes per /24 that holds individual addresses.
+//
+#define IPV4_DIR24_TBL24_BITS           24
+#define IPV4_DIR24_TBL24_ENTRIES        (1UL << IPV4_DIR24_TBL24_BITS)
+#define IPV4_DIR24_TBL8_ENTRIES         (_UI8_MAX + 1)
+#define IPV4_DIR24_EXTENDED             0x80000000UL
+#define IPV4_DIR24_TBL24_SIZE           (IPV4_DIR24_TBL24_ENTRIES * sizeof(IPV4_DIR24_ENTRY))
+#define IPV4_DIR24_TBL8_BLOCK_SIZE      (IPV4_DIR24_TBL8_ENTRIES * sizeof(IPV4_DIR24_TBL8_ENTRY))
+
+// Initial number of tbl8 blocks, the block pool doubles when full
+#define IPV4_DIR24_TBL8_INITIAL_BLOCKS  1024
+
+typedef UINT32 IPV4_DIR24_ENTRY;
+typedef UINT8 IPV4_DIR24_TBL8_ENTRY;
+
+//
+// DIR-24-8 instance context
+//
+typedef struct _ipv4_dir24_ctx {
+    // Total physical size of the tables, in bytes
+    size_t                          totalTableSize;
+
+    // Total number of stored prefixes (duplicates, and prefixes hidden by longer ones, are not counted)
+    size_t                          totalNumOfPrefixes;
+
+    // First level table, IPV4_DIR24_TBL24_ENTRIES entries
+    IPV4_DIR24_ENTRY                *tbl24;
+
+    // tbl8 block pool, blocks are referenced by index so the pool can be reallocated
+    size_t                          numOfTbl8Blocks;
+    size_t                          tbl8Capacity;
+    IPV4_DIR24_TBL8_ENTRY           *tbl8;
+
+    // Blocks released by removals, reused before the pool grows. A free block holds the index of the next one
+    size_t                          numOfFreeTbl8Blocks;
+    size_t                          tbl8FreeList;
+} IPV4_DIR24_CTX, *PIPV4_DIR24_CTX;
+
+//
+// Initialize the context, allocates tbl24
+//
+ATF_ERROR AtfIpv4Dir24AllocCtx(IPV4_DIR24_CTX **ctxOut);
+
+//
+// Insert a pool of ipv4 prefixes into the tables
+//
+ATF_ERROR AtfIpv4Dir24InsertPool(IPV4_DIR24_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Remove a pool of ipv4 prefixes from the tables
+//
+ATF_ERROR AtfIpv4Dir24RemovePool(IPV4_DIR24_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Search the tables for a single input IP
+//  Returns the prefix length of the longest matching entry, or 0 if the IP is not covered
+//
+UINT8 AtfIpv4Dir24Search(const IPV4_DIR24_CTX *ctx, struct in_addr ip);
+
+//
+// Search the tables for numOfIps addresses, resultsOut receives the same values as AtfIpv4Dir24Search.
+//  All tbl24 loads are issued before any tbl8 load, so the cache misses of the keys overlap rather than
+//  being serialized
+//
+VOID AtfIpv4Dir24SearchBatch(
+    const IPV4_DIR24_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+);
+
+//
+// Create a copy of the tables
+//
+ATF_ERROR AtfIpv4Dir24Clone(const IPV4_DIR24_CTX *src, IPV4_DIR24_CTX **ctxOut);
+
+//
+// Print context info
+//
+VOID AtfIpv4Dir24PrintCtx(const IPV4_DIR24_CTX *ctx);
+
+//
+// Free the tables and context
+//
+VOID AtfIpv4Dir24Free(IPV4_DIR24_CTX **ctx);
+
+//EOF
\ No newline at end of file
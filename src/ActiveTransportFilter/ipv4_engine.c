@@ -0,0 +1,88 @@
+#include <ntddk.h>
+
+#include <inaddr.h>
+
+#include "ipv4_engine.h"
+
+#include "ipv4_trie.h"
+#include "ipv4_dir24.h"
+#include "ipv4_cuckoo.h"
+#include "ipv4_roaring.h"
+
+//
+// Forwarders from the opaque interface to the typed functions of an engine module, and the size of its context
+//
+#define IPV4_ENGINE_FORWARDERS(module, ctxType, sizeField) \
+    static ATF_ERROR AtfIpv4Engine##module##AllocCtx(VOID **ctxOut) \
+    { \
+        return AtfIpv4##module##AllocCtx((ctxType **)ctxOut); \
+    } \
+    static ATF_ERROR AtfIpv4Engine##module##InsertPool(VOID *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries) \
+    { \
+        return AtfIpv4##module##InsertPool((ctxType *)ctx, pool, numOfEntries); \
+    } \
+    static ATF_ERROR AtfIpv4Engine##module##RemovePool(VOID *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries) \
+    { \
+        return AtfIpv4##module##RemovePool((ctxType *)ctx, pool, numOfEntries); \
+    } \
+    static VOID AtfIpv4Engine##module##SearchBatch(const VOID *ctx, const struct in_addr *ips, UINT8 *resultsOut, size_t numOfIps) \
+    { \
+        AtfIpv4##module##SearchBatch((const ctxType *)ctx, ips, resultsOut, numOfIps); \
+    } \
+    static ATF_ERROR AtfIpv4Engine##module##Clone(const VOID *src, VOID **ctxOut) \
+    { \
+        return AtfIpv4##module##Clone((const ctxType *)src, (ctxType **)ctxOut); \
+    } \
+    static size_t AtfIpv4Engine##module##GetSize(const VOID *ctx) \
+    { \
+        return ctx ? ((const ctxType *)ctx)->sizeField : 0; \
+    } \
+    static VOID AtfIpv4Engine##module##PrintCtx(const VOID *ctx) \
+    { \
+        AtfIpv4##module##PrintCtx((const ctxType *)ctx); \
+    } \
+    static VOID AtfIpv4Engine##module##Free(VOID **ctx) \
+    { \
+        AtfIpv4##module##Free((ctxType **)ctx); \
+    }
+
+#define IPV4_ENGINE_OPS_ENTRY(engine, name, module) \
+    { \
+        engine, \
+        name, \
+        AtfIpv4Engine##module##AllocCtx, \
+        AtfIpv4Engine##module##InsertPool, \
+        AtfIpv4Engine##module##RemovePool, \
+        AtfIpv4Engine##module##SearchBatch, \
+        AtfIpv4Engine##module##Clone, \
+        AtfIpv4Engine##module##GetSize, \
+        AtfIpv4Engine##module##PrintCtx, \
+        AtfIpv4Engine##module##Free \
+    }
+
+IPV4_ENGINE_FORWARDERS(Trie, IPV4_TRIE_CTX, totalTrieSize)
+IPV4_ENGINE_FORWARDERS(Dir24, IPV4_DIR24_CTX, totalTableSize)
+IPV4_ENGINE_FORWARDERS(Cuckoo, IPV4_CUCKOO_CTX, totalTableSize)
+IPV4_ENGINE_FORWARDERS(Roaring, IPV4_ROARING_CTX, totalSetSize)
+
+//
+// Registered engines, indexed by IPV4_LOOKUP_ENGINE
+//
+static const IPV4_ENGINE_OPS gIpv4Engines[] = {
+    IPV4_ENGINE_OPS_ENTRY(IPV4_ENGINE_TRIE, "TRIE", Trie),
+    IPV4_ENGINE_OPS_ENTRY(IPV4_ENGINE_DIR24, "DIR24", Dir24),
+    IPV4_ENGINE_OPS_ENTRY(IPV4_ENGINE_CUCKOO, "CUCKOO", Cuckoo),
+    IPV4_ENGINE_OPS_ENTRY(IPV4_ENGINE_ROARING, "ROARING", Roaring)
+};
+
+const IPV4_ENGINE_OPS *AtfIpv4EngineGetOps(IPV4_LOOKUP_ENGINE engine)
+{
+    // The table must be kept in IPV4_LOOKUP_ENGINE order
+    if ((UINT32)engine >= ARRAYSIZE(gIpv4Engines) || gIpv4Engines[engine].engine != engine) {
+        return NULL;
+    }
+
+    return &gIpv4Engines[engine];
+}
+
+//EOF
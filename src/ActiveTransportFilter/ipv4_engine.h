@@ -0,0 +1,56 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include <inaddr.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+//
+// IPv4 lookup engine interface
+//
+//  config.c and filter.c only reach the selected engine through its IPV4_ENGINE_OPS, so an engine is added by
+//   implementing the usual module functions (AllocCtx, InsertPool, RemovePool, SearchBatch, Clone, PrintCtx, Free)
+//   and registering them in ipv4_engine.c, together with the size of its context.
+//
+//  The engine contexts are opaque here (VOID *), each entry of the table forwards to the typed functions of
+//   its module.
+//
+typedef ATF_ERROR IPV4_ENGINE_ALLOC_CTX(VOID **ctxOut);
+typedef ATF_ERROR IPV4_ENGINE_INSERT_POOL(VOID *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+typedef ATF_ERROR IPV4_ENGINE_REMOVE_POOL(VOID *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+typedef VOID IPV4_ENGINE_SEARCH_BATCH(const VOID *ctx, const struct in_addr *ips, UINT8 *resultsOut, size_t numOfIps);
+typedef ATF_ERROR IPV4_ENGINE_CLONE(const VOID *src, VOID **ctxOut);
+typedef size_t IPV4_ENGINE_GET_SIZE(const VOID *ctx);
+typedef VOID IPV4_ENGINE_PRINT_CTX(const VOID *ctx);
+typedef VOID IPV4_ENGINE_FREE(VOID **ctx);
+
+typedef struct _ipv4_engine_ops {
+    IPV4_LOOKUP_ENGINE              engine;
+
+    // Name used in the ini (ipv4_lookup_engine) and in the traces
+    const CHAR                      *name;
+
+    IPV4_ENGINE_ALLOC_CTX           *AllocCtx;
+    IPV4_ENGINE_INSERT_POOL         *InsertPool;
+
+    // Removing a prefix clears the addresses it covers. Prefixes that overlap it and stay in the blocklist must
+    //  be inserted again afterwards, the engines do not keep track of hidden prefixes (see AtfConfigApplyIpv4Delta)
+    IPV4_ENGINE_REMOVE_POOL         *RemovePool;
+    IPV4_ENGINE_SEARCH_BATCH        *SearchBatch;
+    IPV4_ENGINE_CLONE               *Clone;
+
+    // Physical size of the context in bytes, as counted against the memory budget
+    IPV4_ENGINE_GET_SIZE            *GetSize;
+
+    IPV4_ENGINE_PRINT_CTX           *PrintCtx;
+    IPV4_ENGINE_FREE                *Free;
+} IPV4_ENGINE_OPS, *PIPV4_ENGINE_OPS;
+
+//
+// Returns the interface of an engine, or NULL if the engine is unknown
+//
+const IPV4_ENGINE_OPS *AtfIpv4EngineGetOps(IPV4_LOOKUP_ENGINE engine);
+
+//EOF
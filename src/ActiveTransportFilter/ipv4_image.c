@@ -0,0 +1,393 @@
+#include <ntddk.h>
+
+#include <inaddr.h>
+#include <limits.h>
+
+#include "ipv4_image.h"
+
+#include "mem.h"
+#include "trace.h"
+
+C_ASSERT(IPV4_IMAGE_BITMAP_WORDS == IPV4_TRIE_BITMAP_WORDS);
+C_ASSERT(sizeof(IPV4_IMAGE_HEADER) % IPV4_IMAGE_ALIGNMENT == 0);
+C_ASSERT(sizeof(IPV4_IMAGE_NODE) % IPV4_IMAGE_ALIGNMENT == 0);
+
+//
+// Check the header, the section bounds, and the checksum
+//
+static BOOLEAN AtfIpv4ImageValidateHeader(const IPV4_IMAGE_HEADER *header, size_t imageSize);
+
+//
+// Check that every child and leaf link of every node is in bounds, and that every leaf is a valid prefix length
+//
+static BOOLEAN AtfIpv4ImageValidateNodes(
+    const IPV4_IMAGE_HEADER *header,
+    const IPV4_IMAGE_NODE *nodes,
+    const IPV4_TRIE_LEAF *leaves
+);
+
+//
+// Check the prefilter parameters, so that every fingerprint slot is within the filter array
+//
+static BOOLEAN AtfIpv4ImageValidateFilter(const IPV4_IMAGE_HEADER *header, size_t imageSize);
+
+//
+// Probe the prefilter on every level in use
+//  Returns the prefix length of the deepest level hit ((level + 1) * 8), or 0 if the IP is definitely not covered
+//
+static UINT8 AtfIpv4ImageFilterProbe(const IPV4_IMAGE_CTX *ctx, struct in_addr ip);
+
+ATF_ERROR AtfIpv4ImageAdopt(const VOID *image, size_t imageSize, IPV4_IMAGE_CTX **ctxOut)
+{
+    if (!image || !ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    if (imageSize < sizeof(IPV4_IMAGE_HEADER) || imageSize % IPV4_IMAGE_ALIGNMENT) {
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    //
+    // The image is copied into its final non-paged allocation first, and validated there.
+    //  The context is padded to IPV4_IMAGE_ALIGNMENT so the image keeps its alignment
+    //
+    const size_t ctxSize = (sizeof(IPV4_IMAGE_CTX) + IPV4_IMAGE_ALIGNMENT - 1) & ~((size_t)IPV4_IMAGE_ALIGNMENT - 1);
+
+    IPV4_IMAGE_CTX *ctx = (IPV4_IMAGE_CTX *)ATF_MALLOC(ctxSize + imageSize);
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    UINT8 *imageCopy = (UINT8 *)ctx + ctxSize;
+    RtlCopyMemory(imageCopy, image, imageSize);
+
+    const IPV4_IMAGE_HEADER *header = (const IPV4_IMAGE_HEADER *)imageCopy;
+    if (!AtfIpv4ImageValidateHeader(header, imageSize)) {
+        ATF_FREE(ctx);
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    const IPV4_IMAGE_NODE *nodes = (const IPV4_IMAGE_NODE *)&imageCopy[header->nodesOffset];
+    const IPV4_TRIE_LEAF *leaves = (const IPV4_TRIE_LEAF *)&imageCopy[header->leavesOffset];
+
+    if (!AtfIpv4ImageValidateNodes(header, nodes, leaves)) {
+        ATF_FREE(ctx);
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    ctx->refCount = 1;
+    ctx->totalSize = ctxSize + imageSize;
+    ctx->header = header;
+    ctx->nodes = nodes;
+    ctx->leaves = leaves;
+
+    if (header->flags & IPV4_IMAGE_FLAG_PREFILTER) {
+        ctx->filter = (const IPV4_IMAGE_FINGERPRINT *)&imageCopy[header->filterOffset];
+    }
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+IPV4_IMAGE_CTX *AtfIpv4ImageReference(IPV4_IMAGE_CTX *ctx)
+{
+    if (ctx) {
+        ctx->refCount++;
+    }
+
+    return ctx;
+}
+
+UINT8 AtfIpv4ImageSearch(const IPV4_IMAGE_CTX *ctx, struct in_addr ip)
+{
+    if (!ctx) {
+        return 0;
+    }
+
+    if (ctx->filter) {
+        const UINT8 filterMatch = AtfIpv4ImageFilterProbe(ctx, ip);
+        if (!filterMatch || (ctx->header->flags & IPV4_IMAGE_FLAG_PREFILTER_ONLY)) {
+            return filterMatch;
+        }
+    }
+
+    const IPV4_IMAGE_NODE *currNode = &ctx->nodes[0];
+    IPV4_TRIE_LEAF longestMatch = 0;
+
+    for (UINT8 level = 0; level < IPV4_TRIE_MAX_DEPTH; level++) {
+        const IPV4_OCTET octet = IPV4_TRIE_OCTET(ip.S_un.S_addr, level);
+
+        // Leaves on a deeper level always belong to longer prefixes
+        if (AtfIpv4TrieBitTest(currNode->leafBitmap, octet)) {
+            longestMatch = ctx->leaves[currNode->leavesIndex + AtfIpv4TrieRank(currNode->leafBitmap, octet)];
+        }
+
+        if (!AtfIpv4TrieBitTest(currNode->childBitmap, octet)) {
+            break;
+        }
+
+        currNode = &ctx->nodes[currNode->childrenIndex + AtfIpv4TrieRank(currNode->childBitmap, octet)];
+    }
+
+    return longestMatch;
+}
+
+VOID AtfIpv4ImageSearchBatch(
+    const IPV4_IMAGE_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+)
+{
+    if (!ips || !resultsOut) {
+        return;
+    }
+
+    if (!ctx) {
+        RtlZeroMemory(resultsOut, numOfIps * sizeof(UINT8));
+        return;
+    }
+
+    const IPV4_IMAGE_NODE *currNodes[IPV4_TRIE_BATCH_WINDOW];
+
+    for (size_t base = 0; base < numOfIps; base += IPV4_TRIE_BATCH_WINDOW) {
+        const size_t windowSize =
+            (numOfIps - base) < IPV4_TRIE_BATCH_WINDOW ? (numOfIps - base) : IPV4_TRIE_BATCH_WINDOW;
+
+        size_t numOfActive = windowSize;
+        for (size_t i = 0; i < windowSize; i++) {
+            currNodes[i] = &ctx->nodes[0];
+            resultsOut[base + i] = 0;
+
+            // Filter misses (and every key of a prefilter-only image) never enter the walk
+            if (ctx->filter) {
+                const UINT8 filterMatch = AtfIpv4ImageFilterProbe(ctx, ips[base + i]);
+                if (!filterMatch || (ctx->header->flags & IPV4_IMAGE_FLAG_PREFILTER_ONLY)) {
+                    resultsOut[base + i] = filterMatch;
+                    currNodes[i] = NULL;
+                    numOfActive--;
+                }
+            }
+        }
+
+        for (UINT8 level = 0; level < IPV4_TRIE_MAX_DEPTH && numOfActive; level++) {
+            for (size_t i = 0; i < windowSize; i++) {
+                const IPV4_IMAGE_NODE *currNode = currNodes[i];
+                if (!currNode) {
+                    continue;
+                }
+
+                const IPV4_OCTET octet = IPV4_TRIE_OCTET(ips[base + i].S_un.S_addr, level);
+
+                if (AtfIpv4TrieBitTest(currNode->leafBitmap, octet)) {
+                    resultsOut[base + i] = ctx->leaves[currNode->leavesIndex + AtfIpv4TrieRank(currNode->leafBitmap, octet)];
+                }
+
+                if (!AtfIpv4TrieBitTest(currNode->childBitmap, octet)) {
+                    currNodes[i] = NULL;
+                    numOfActive--;
+                    continue;
+                }
+
+                currNodes[i] = &ctx->nodes[currNode->childrenIndex + AtfIpv4TrieRank(currNode->childBitmap, octet)];
+                AtfIpv4TriePrefetchNode(currNodes[i], sizeof(IPV4_IMAGE_NODE));
+            }
+        }
+    }
+}
+
+BOOLEAN AtfIpv4ImageIsApproximate(const IPV4_IMAGE_CTX *ctx)
+{
+    if (!ctx) {
+        return FALSE;
+    }
+
+    return (ctx->header->flags & IPV4_IMAGE_FLAG_PREFILTER_ONLY) != 0;
+}
+
+VOID AtfIpv4ImagePrintCtx(const IPV4_IMAGE_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] IPv4 Image Stats: Num of nodes: %llu, Num of leaves: %llu, Image size: %llu, Num of prefixes: %llu",
+        ctx->header->numOfNodes, ctx->header->numOfLeaves, ctx->header->imageSize, ctx->header->numOfPrefixes);
+
+    if (ctx->filter) {
+        ATF_DEBUGA("[atftrace] IPv4 Image Prefilter: Fingerprints: %u, Segment length: %u, Level mask: 0x%x, Prefilter only: %d",
+            ctx->header->filterArrayLength, ctx->header->filterSegmentLength, ctx->header->filterLevelMask,
+            AtfIpv4ImageIsApproximate(ctx));
+    }
+}
+
+VOID AtfIpv4ImageFree(IPV4_IMAGE_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    IPV4_IMAGE_CTX *c = *ctx;
+    *ctx = NULL;
+
+    if (--c->refCount) {
+        return;
+    }
+
+    ATF_FREE(c);
+}
+
+static BOOLEAN AtfIpv4ImageValidateHeader(const IPV4_IMAGE_HEADER *header, size_t imageSize)
+{
+    if (header->magic != IPV4_IMAGE_MAGIC || header->version != IPV4_IMAGE_VERSION) {
+        ATF_DEBUG(AtfIpv4ImageValidateHeader, "Bad image magic or version");
+        return FALSE;
+    }
+
+    if (header->headerSize != sizeof(IPV4_IMAGE_HEADER) || header->imageSize != imageSize) {
+        ATF_DEBUG(AtfIpv4ImageValidateHeader, "Bad image size");
+        return FALSE;
+    }
+
+    if (header->flags & ~(IPV4_IMAGE_FLAG_PREFILTER | IPV4_IMAGE_FLAG_PREFILTER_ONLY) ||
+        ((header->flags & IPV4_IMAGE_FLAG_PREFILTER_ONLY) && !(header->flags & IPV4_IMAGE_FLAG_PREFILTER)))
+    {
+        ATF_DEBUG(AtfIpv4ImageValidateHeader, "Bad image flags");
+        return FALSE;
+    }
+
+    // At least the root node must exist, unless the image is only a prefilter
+    const BOOLEAN isPrefilterOnly = (header->flags & IPV4_IMAGE_FLAG_PREFILTER_ONLY) != 0;
+    if ((isPrefilterOnly && (header->numOfNodes || header->numOfLeaves)) ||
+        (!isPrefilterOnly && !header->numOfNodes) ||
+        header->numOfNodes > _UI32_MAX || header->numOfLeaves > _UI32_MAX)
+    {
+        ATF_DEBUG(AtfIpv4ImageValidateHeader, "Bad number of nodes or leaves");
+        return FALSE;
+    }
+
+    // Sections must be aligned, and within the image (written so that none of the checks can overflow)
+    if (header->nodesOffset % IPV4_IMAGE_ALIGNMENT ||
+        header->nodesOffset < sizeof(IPV4_IMAGE_HEADER) ||
+        header->nodesOffset > imageSize ||
+        header->numOfNodes > (imageSize - header->nodesOffset) / sizeof(IPV4_IMAGE_NODE) ||
+        header->leavesOffset < sizeof(IPV4_IMAGE_HEADER) ||
+        header->leavesOffset > imageSize ||
+        header->numOfLeaves > (imageSize - header->leavesOffset) / sizeof(IPV4_TRIE_LEAF))
+    {
+        ATF_DEBUG(AtfIpv4ImageValidateHeader, "Image section out of bounds");
+        return FALSE;
+    }
+
+    if ((header->flags & IPV4_IMAGE_FLAG_PREFILTER) && !AtfIpv4ImageValidateFilter(header, imageSize)) {
+        return FALSE;
+    }
+
+    const UINT8 *payload = (const UINT8 *)header + sizeof(IPV4_IMAGE_HEADER);
+    if (AtfIpv4ImageChecksum(payload, imageSize - sizeof(IPV4_IMAGE_HEADER)) != header->checksum) {
+        ATF_DEBUG(AtfIpv4ImageValidateHeader, "Image checksum mismatch");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN AtfIpv4ImageValidateNodes(
+    const IPV4_IMAGE_HEADER *header,
+    const IPV4_IMAGE_NODE *nodes,
+    const IPV4_TRIE_LEAF *leaves
+)
+{
+    for (UINT64 i = 0; i < header->numOfNodes; i++) {
+        const UINT64 numOfChildren = AtfIpv4TrieBitmapCount(nodes[i].childBitmap);
+        const UINT64 numOfLeaves = AtfIpv4TrieBitmapCount(nodes[i].leafBitmap);
+
+        //
+        // Children are stored breadth-first, so they always come after their parent. The search is bounded to
+        //  IPV4_TRIE_MAX_DEPTH levels regardless, this only guarantees the links are in bounds
+        //
+        if (numOfChildren &&
+            (nodes[i].childrenIndex <= i || nodes[i].childrenIndex + numOfChildren > header->numOfNodes))
+        {
+            ATF_DEBUG(AtfIpv4ImageValidateNodes, "Image node has a bad child link");
+            return FALSE;
+        }
+
+        if (numOfLeaves && nodes[i].leavesIndex + numOfLeaves > header->numOfLeaves) {
+            ATF_DEBUG(AtfIpv4ImageValidateNodes, "Image node has a bad leaf link");
+            return FALSE;
+        }
+    }
+
+    for (UINT64 i = 0; i < header->numOfLeaves; i++) {
+        if (leaves[i] < IPV4_PREFIX_MIN_LENGTH || leaves[i] > IPV4_PREFIX_MAX_LENGTH) {
+            ATF_DEBUG(AtfIpv4ImageValidateNodes, "Image leaf has a bad prefix length");
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN AtfIpv4ImageValidateFilter(const IPV4_IMAGE_HEADER *header, size_t imageSize)
+{
+    const UINT32 segmentLength = header->filterSegmentLength;
+
+    //
+    // The first slot is below filterSegmentCountLength, and the other two are in the two segments after it.
+    //  Segments are a power of two in size, so the xor in AtfIpv4ImageFilterSlots() stays within the segment
+    //
+    if (!segmentLength || segmentLength > IPV4_IMAGE_FILTER_MAX_SEGMENT_LENGTH ||
+        (segmentLength & (segmentLength - 1)) ||
+        !header->filterSegmentCountLength ||
+        header->filterSegmentCountLength % segmentLength ||
+        header->filterArrayLength < (UINT64)header->filterSegmentCountLength + 2 * (UINT64)segmentLength)
+    {
+        ATF_DEBUG(AtfIpv4ImageValidateFilter, "Bad prefilter parameters");
+        return FALSE;
+    }
+
+    if (!header->filterLevelMask || header->filterLevelMask >> IPV4_TRIE_MAX_DEPTH) {
+        ATF_DEBUG(AtfIpv4ImageValidateFilter, "Bad prefilter level mask");
+        return FALSE;
+    }
+
+    if (header->filterOffset % IPV4_IMAGE_ALIGNMENT ||
+        header->filterOffset < sizeof(IPV4_IMAGE_HEADER) ||
+        header->filterOffset > imageSize ||
+        header->filterArrayLength > (imageSize - header->filterOffset) / sizeof(IPV4_IMAGE_FINGERPRINT))
+    {
+        ATF_DEBUG(AtfIpv4ImageValidateFilter, "Prefilter out of bounds");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static UINT8 AtfIpv4ImageFilterProbe(const IPV4_IMAGE_CTX *ctx, struct in_addr ip)
+{
+    const IPV4_IMAGE_HEADER *header = ctx->header;
+    UINT8 deepestMatch = 0;
+
+    for (UINT32 level = 0; level < IPV4_TRIE_MAX_DEPTH; level++) {
+        if (!(header->filterLevelMask & (1UL << level))) {
+            continue;
+        }
+
+        const UINT64 hash = AtfIpv4ImageFilterHash(AtfIpv4ImageFilterKey(ip.S_un.S_addr, level), header->filterSeed);
+
+        UINT32 slots[3];
+        AtfIpv4ImageFilterSlots(header, hash, slots);
+
+        const IPV4_IMAGE_FINGERPRINT fingerprint = ctx->filter[slots[0]] ^ ctx->filter[slots[1]] ^ ctx->filter[slots[2]];
+        if (fingerprint == AtfIpv4ImageFilterFingerprint(hash)) {
+            deepestMatch = (UINT8)((level + 1) * IPV4_TRIE_STRIDE);
+        }
+    }
+
+    return deepestMatch;
+}
+
+//EOF
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include <inaddr.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/ipv4_image_format.h"
+
+#include "ipv4_trie.h"
+#include "mem.h"
+
+//
+// Relocatable IPv4 lookup image, compiled by the service (see ipv4_image_format.h)
+//
+//  The driver validates the image once, copies it into a single non-paged allocation and searches it in place.
+//   There is no per-node allocation and no raw address pool is kept. The search is the same walk as
+//   AtfIpv4TrieSearch(), with links resolved as indexes into the node and leaf arrays.
+//
+//  An image is never modified after it is adopted, so configs cloned from each other share it. The reference
+//   count is only changed by the IOCTL handlers (serialized by gIoctlLock), never by the callouts.
+//
+
+//
+// Image instance context, the image itself follows the context in the same allocation
+//
+typedef struct _ipv4_image_ctx {
+    // Number of configs referencing the image
+    size_t                          refCount;
+
+    // Size of the whole allocation (context and image), in bytes
+    size_t                          totalSize;
+
+    const IPV4_IMAGE_HEADER         *header;
+    const IPV4_IMAGE_NODE           *nodes;
+    const IPV4_TRIE_LEAF            *leaves;
+
+    // Prefilter fingerprints, NULL if the image has no prefilter
+    const IPV4_IMAGE_FINGERPRINT    *filter;
+} IPV4_IMAGE_CTX, *PIPV4_IMAGE_CTX;
+
+//
+// Validate an image (header, bounds, checksum and every node link) and copy it into a new context
+//  Returns ATF_CORRUPT_IMAGE if the image is rejected
+//
+ATF_ERROR AtfIpv4ImageAdopt(const VOID *image, size_t imageSize, IPV4_IMAGE_CTX **ctxOut);
+
+//
+// Take another reference on the image, for a cloned config
+//
+IPV4_IMAGE_CTX *AtfIpv4ImageReference(IPV4_IMAGE_CTX *ctx);
+
+//
+// Search the image for a single input IP
+//  Returns the prefix length of the longest matching entry, or 0 if the IP is not covered
+//  If the image has a prefilter, it is checked first and a filter miss returns 0 without walking the nodes.
+//  For a prefilter-only image, the result is the length of the deepest level hit in the filter (see
+//  AtfIpv4ImageIsApproximate)
+//
+UINT8 AtfIpv4ImageSearch(const IPV4_IMAGE_CTX *ctx, struct in_addr ip);
+
+//
+// Search the image for numOfIps addresses in lockstep, see AtfIpv4TrieSearchBatch()
+//
+VOID AtfIpv4ImageSearchBatch(
+    const IPV4_IMAGE_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+);
+
+//
+// Returns TRUE if the search results are approximate (prefilter-only image), these must never be blocked on
+//
+BOOLEAN AtfIpv4ImageIsApproximate(const IPV4_IMAGE_CTX *ctx);
+
+//
+// Print image info
+//
+VOID AtfIpv4ImagePrintCtx(const IPV4_IMAGE_CTX *ctx);
+
+//
+// Drop a reference to the image, the image is freed with the last reference
+//
+VOID AtfIpv4ImageFree(IPV4_IMAGE_CTX **ctx);
+
+//EOF
@@ -0,0 +1,834 @@
+#include <ntddk.h>
+
+#include <inaddr.h>
+#include <limits.h>
+
+#include "ipv4_roaring.h"
+
+#include "mem.h"
+#include "trace.h"
+
+// Chunk bitmap while a container is rebuilt, one bit per low 16-bit value
+#define IPV4_ROARING_SCRATCH_WORDS      (IPV4_ROARING_CHUNK_SIZE / (sizeof(UINT64) * CHAR_BIT))
+
+// Number of pool words of a run
+#define IPV4_ROARING_RUN_WORDS          2
+
+#define IPV4_ROARING_CHUNK(address)     ((address) >> (32 - IPV4_ROARING_CHUNK_BITS))
+#define IPV4_ROARING_LOW(address)       ((UINT16)((address) & (IPV4_ROARING_CHUNK_SIZE - 1)))
+
+//
+// Buffers used while applying a pool of prefixes
+//
+typedef struct _ipv4_roaring_scratch {
+    // Chunks wholly covered by a /16 or shorter prefix, one bit per chunk
+    UINT64                          *coveredChunks;
+
+    // Entries longer than /16, grouped by chunk
+    UINT32                          *chunkEnd;
+    UINT32                          *entryOrder;
+
+    // Chunk bitmap of the container being rebuilt
+    UINT64                          *bitmap;
+
+    // Directory and pool being built
+    IPV4_ROARING_CONTAINER          *directory;
+    IPV4_ROARING_POOL               pool;
+} IPV4_ROARING_SCRATCH, *PIPV4_ROARING_SCRATCH;
+
+C_ASSERT(sizeof(IPV4_ROARING_CONTAINER) == 8);
+C_ASSERT(IPV4_ROARING_BITMAP_WORDS * sizeof(UINT16) == IPV4_ROARING_SCRATCH_WORDS * sizeof(UINT64));
+
+//
+// Add or remove a pool of prefixes. Every chunk the pool touches is decoded into a bitmap, updated, and encoded
+//  again as the smallest container type. Containers of the other chunks are copied as is
+//
+static ATF_ERROR AtfIpv4RoaringApplyPool(
+    IPV4_ROARING_CTX *ctx,
+    const IPV4_PREFIX_ENTRY *pool,
+    size_t numOfEntries,
+    BOOLEAN isRemove
+);
+
+//
+// Allocate and free the scratch buffers of AtfIpv4RoaringApplyPool
+//
+static ATF_ERROR AtfIpv4RoaringAllocScratch(IPV4_ROARING_SCRATCH *scratch, size_t numOfEntries);
+static VOID AtfIpv4RoaringFreeScratch(IPV4_ROARING_SCRATCH *scratch);
+
+//
+// Rebuild the directory and pool with the pool of prefixes applied. The set is only updated once every container
+//  is encoded, on failure it is left as it was
+//
+static ATF_ERROR AtfIpv4RoaringRebuild(
+    IPV4_ROARING_CTX *ctx,
+    const IPV4_PREFIX_ENTRY *pool,
+    size_t numOfEntries,
+    BOOLEAN isRemove,
+    IPV4_ROARING_SCRATCH *scratch
+);
+
+//
+// Make room for numOfWords more words in the pool
+//
+static ATF_ERROR AtfIpv4RoaringPoolReserve(IPV4_ROARING_POOL *pool, size_t numOfWords);
+
+//
+// Number of pool words used by a container
+//
+static size_t AtfIpv4RoaringContainerWords(const IPV4_ROARING_CONTAINER *container);
+
+//
+// Number of values in a container
+//
+static UINT32 AtfIpv4RoaringContainerCardinality(const UINT16 *words, const IPV4_ROARING_CONTAINER *container);
+
+//
+// Returns TRUE if the low 16 bits of an address are in the container
+//
+static __forceinline BOOLEAN AtfIpv4RoaringContainerContains(
+    const UINT16 *words,
+    const IPV4_ROARING_CONTAINER *container,
+    UINT16 low
+);
+
+//
+// Address within the container which a lookup of low reads first
+//
+static __forceinline const VOID *AtfIpv4RoaringContainerProbe(
+    const UINT16 *words,
+    const IPV4_ROARING_CONTAINER *container,
+    UINT16 low
+);
+
+//
+// Decode a container into a zeroed chunk bitmap
+//
+static VOID AtfIpv4RoaringDecode(const UINT16 *words, const IPV4_ROARING_CONTAINER *container, UINT64 *bitmap);
+
+//
+// Encode a chunk bitmap as the smallest container type, appended to the pool
+//
+static ATF_ERROR AtfIpv4RoaringEncode(
+    const UINT64 *bitmap,
+    IPV4_ROARING_POOL *pool,
+    IPV4_ROARING_CONTAINER *containerOut,
+    UINT32 *cardinalityOut
+);
+
+//
+// Set or clear [start, start + length) in a chunk bitmap
+//
+static VOID AtfIpv4RoaringUpdateRange(UINT64 *bitmap, UINT32 start, UINT32 length, BOOLEAN isRemove);
+
+//
+// Index of the lowest set bit, v must be non-zero
+//
+static __forceinline UINT32 AtfIpv4RoaringLowestBit(UINT64 v);
+
+//
+// Update totalSetSize and numOfContainers
+//
+static VOID AtfIpv4RoaringUpdateStats(IPV4_ROARING_CTX *ctx);
+
+ATF_ERROR AtfIpv4RoaringAllocCtx(IPV4_ROARING_CTX **ctxOut)
+{
+    if (!ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    IPV4_ROARING_CTX *ctx = (IPV4_ROARING_CTX *)ATF_MALLOC(sizeof(IPV4_ROARING_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    AtfIpv4RoaringUpdateStats(ctx);
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfIpv4RoaringInsertPool(IPV4_ROARING_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    ATF_ERROR atfError = AtfIpv4RoaringApplyPool(ctx, pool, numOfEntries, FALSE);
+    if (atfError) {
+        return atfError;
+    }
+
+    ctx->totalNumOfPrefixes += numOfEntries;
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfIpv4RoaringRemovePool(IPV4_ROARING_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    return AtfIpv4RoaringApplyPool(ctx, pool, numOfEntries, TRUE);
+}
+
+UINT8 AtfIpv4RoaringSearch(const IPV4_ROARING_CTX *ctx, struct in_addr ip)
+{
+    if (!ctx) {
+        return 0;
+    }
+
+    const UINT32 address = ip.S_un.S_addr;
+    const IPV4_ROARING_CONTAINER *container = &ctx->directory[IPV4_ROARING_CHUNK(address)];
+
+    return AtfIpv4RoaringContainerContains(ctx->pool.words, container, IPV4_ROARING_LOW(address)) ?
+        IPV4_PREFIX_MAX_LENGTH : 0;
+}
+
+VOID AtfIpv4RoaringSearchBatch(
+    const IPV4_ROARING_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+)
+{
+    if (!ips || !resultsOut) {
+        return;
+    }
+
+    if (!ctx) {
+        RtlZeroMemory(resultsOut, numOfIps * sizeof(UINT8));
+        return;
+    }
+
+    for (size_t base = 0; base < numOfIps; base += IPV4_TRIE_BATCH_WINDOW) {
+        const size_t windowSize =
+            (numOfIps - base) < IPV4_TRIE_BATCH_WINDOW ? (numOfIps - base) : IPV4_TRIE_BATCH_WINDOW;
+
+        // Directory entries first, then the first container word each lookup reads, then the lookups
+        for (size_t i = 0; i < windowSize; i++) {
+            PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &ctx->directory[IPV4_ROARING_CHUNK(ips[base + i].S_un.S_addr)]);
+        }
+
+        for (size_t i = 0; i < windowSize; i++) {
+            const UINT32 address = ips[base + i].S_un.S_addr;
+            const IPV4_ROARING_CONTAINER *container = &ctx->directory[IPV4_ROARING_CHUNK(address)];
+
+            if (container->type != IPV4_ROARING_EMPTY) {
+                PreFetchCacheLine(PF_TEMPORAL_LEVEL_1,
+                    AtfIpv4RoaringContainerProbe(ctx->pool.words, container, IPV4_ROARING_LOW(address)));
+            }
+        }
+
+        for (size_t i = 0; i < windowSize; i++) {
+            const UINT32 address = ips[base + i].S_un.S_addr;
+            const IPV4_ROARING_CONTAINER *container = &ctx->directory[IPV4_ROARING_CHUNK(address)];
+
+            resultsOut[base + i] =
+                AtfIpv4RoaringContainerContains(ctx->pool.words, container, IPV4_ROARING_LOW(address)) ?
+                IPV4_PREFIX_MAX_LENGTH : 0;
+        }
+    }
+}
+
+ATF_ERROR AtfIpv4RoaringClone(const IPV4_ROARING_CTX *src, IPV4_ROARING_CTX **ctxOut)
+{
+    if (!src || !ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    IPV4_ROARING_CTX *ctx = (IPV4_ROARING_CTX *)ATF_MALLOC(sizeof(IPV4_ROARING_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    RtlCopyMemory(ctx, src, sizeof(IPV4_ROARING_CTX));
+    RtlZeroMemory(&ctx->pool, sizeof(IPV4_ROARING_POOL));
+
+    if (src->pool.size) {
+        ATF_ERROR atfError = AtfIpv4RoaringPoolReserve(&ctx->pool, src->pool.size);
+        if (atfError) {
+            AtfIpv4RoaringFree(&ctx);
+            return atfError;
+        }
+
+        RtlCopyMemory(ctx->pool.words, src->pool.words, src->pool.size * sizeof(UINT16));
+        ctx->pool.size = src->pool.size;
+    }
+
+    AtfIpv4RoaringUpdateStats(ctx);
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+VOID AtfIpv4RoaringPrintCtx(const IPV4_ROARING_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] IPv4 Roaring Stats: Num of addresses: %llu, Containers (array/bitmap/run): %llu/%llu/%llu, Pool size: %llu, Total set size: %llu, Num of prefixes: %llu",
+        ctx->cardinality,
+        (UINT64)ctx->numOfContainers[IPV4_ROARING_ARRAY], (UINT64)ctx->numOfContainers[IPV4_ROARING_BITMAP],
+        (UINT64)ctx->numOfContainers[IPV4_ROARING_RUN],
+        (UINT64)(ctx->pool.size * sizeof(UINT16)), (UINT64)ctx->totalSetSize, (UINT64)ctx->totalNumOfPrefixes);
+}
+
+VOID AtfIpv4RoaringFree(IPV4_ROARING_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    IPV4_ROARING_CTX *c = *ctx;
+
+    if (c->pool.words) {
+        ATF_FREE(c->pool.words);
+    }
+
+    RtlZeroMemory(c, sizeof(IPV4_ROARING_CTX));
+    ATF_FREE(c);
+    *ctx = NULL;
+}
+
+static ATF_ERROR AtfIpv4RoaringApplyPool(
+    IPV4_ROARING_CTX *ctx,
+    const IPV4_PREFIX_ENTRY *pool,
+    size_t numOfEntries,
+    BOOLEAN isRemove
+)
+{
+    if (!ctx || !pool || !numOfEntries || numOfEntries > _UI32_MAX) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    for (size_t i = 0; i < numOfEntries; i++) {
+        if (pool[i].prefixLength < IPV4_PREFIX_MIN_LENGTH || pool[i].prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            return ATF_BAD_PARAMETERS;
+        }
+    }
+
+    IPV4_ROARING_SCRATCH scratch;
+    RtlZeroMemory(&scratch, sizeof(IPV4_ROARING_SCRATCH));
+
+    ATF_ERROR atfError = AtfIpv4RoaringAllocScratch(&scratch, numOfEntries);
+    if (!atfError) {
+        atfError = AtfIpv4RoaringRebuild(ctx, pool, numOfEntries, isRemove, &scratch);
+    }
+
+    AtfIpv4RoaringFreeScratch(&scratch);
+
+    return atfError;
+}
+
+static ATF_ERROR AtfIpv4RoaringAllocScratch(IPV4_ROARING_SCRATCH *scratch, size_t numOfEntries)
+{
+    scratch->coveredChunks = (UINT64 *)ATF_MALLOC(IPV4_ROARING_NUM_OF_CHUNKS / CHAR_BIT);
+    scratch->chunkEnd = (UINT32 *)ATF_MALLOC((IPV4_ROARING_NUM_OF_CHUNKS + 1) * sizeof(UINT32));
+    scratch->entryOrder = (UINT32 *)ATF_MALLOC(numOfEntries * sizeof(UINT32));
+    scratch->bitmap = (UINT64 *)ATF_MALLOC(IPV4_ROARING_SCRATCH_WORDS * sizeof(UINT64));
+    scratch->directory = (IPV4_ROARING_CONTAINER *)ATF_MALLOC(IPV4_ROARING_NUM_OF_CHUNKS * sizeof(IPV4_ROARING_CONTAINER));
+
+    if (!scratch->coveredChunks || !scratch->chunkEnd || !scratch->entryOrder || !scratch->bitmap || !scratch->directory) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    return ATF_ERROR_OK;
+}
+
+static VOID AtfIpv4RoaringFreeScratch(IPV4_ROARING_SCRATCH *scratch)
+{
+    if (scratch->coveredChunks) {
+        ATF_FREE(scratch->coveredChunks);
+    }
+
+    if (scratch->chunkEnd) {
+        ATF_FREE(scratch->chunkEnd);
+    }
+
+    if (scratch->entryOrder) {
+        ATF_FREE(scratch->entryOrder);
+    }
+
+    if (scratch->bitmap) {
+        ATF_FREE(scratch->bitmap);
+    }
+
+    if (scratch->directory) {
+        ATF_FREE(scratch->directory);
+    }
+
+    if (scratch->pool.words) {
+        ATF_FREE(scratch->pool.words);
+    }
+
+    RtlZeroMemory(scratch, sizeof(IPV4_ROARING_SCRATCH));
+}
+
+static ATF_ERROR AtfIpv4RoaringRebuild(
+    IPV4_ROARING_CTX *ctx,
+    const IPV4_PREFIX_ENTRY *pool,
+    size_t numOfEntries,
+    BOOLEAN isRemove,
+    IPV4_ROARING_SCRATCH *scratch
+)
+{
+    UINT64 *coveredChunks = scratch->coveredChunks;
+    UINT32 *chunkEnd = scratch->chunkEnd;
+    UINT32 *entryOrder = scratch->entryOrder;
+    UINT64 *bitmap = scratch->bitmap;
+    IPV4_ROARING_POOL *nextPool = &scratch->pool;
+
+    //
+    // Prefixes of /16 and shorter mark the chunks they cover. Longer prefixes are grouped by chunk (counting sort),
+    //  the entries of chunk c are entryOrder[chunkEnd[c - 1]] to entryOrder[chunkEnd[c] - 1]
+    //
+    for (size_t i = 0; i < numOfEntries; i++) {
+        const UINT8 prefixLength = pool[i].prefixLength;
+        const UINT32 address = pool[i].address.S_un.S_addr & IPV4_PREFIX_MASK(prefixLength);
+
+        if (prefixLength > IPV4_ROARING_CHUNK_BITS) {
+            chunkEnd[IPV4_ROARING_CHUNK(address) + 1]++;
+            continue;
+        }
+
+        const UINT32 firstChunk = IPV4_ROARING_CHUNK(address);
+        const UINT32 numOfChunks = 1UL << (IPV4_ROARING_CHUNK_BITS - prefixLength);
+        for (UINT32 chunk = firstChunk; chunk < firstChunk + numOfChunks; chunk++) {
+            coveredChunks[chunk / 64] |= 1ULL << (chunk % 64);
+        }
+    }
+
+    for (UINT32 chunk = 0; chunk < IPV4_ROARING_NUM_OF_CHUNKS; chunk++) {
+        chunkEnd[chunk + 1] += chunkEnd[chunk];
+    }
+
+    for (size_t i = 0; i < numOfEntries; i++) {
+        if (pool[i].prefixLength > IPV4_ROARING_CHUNK_BITS) {
+            const UINT32 chunk = IPV4_ROARING_CHUNK(pool[i].address.S_un.S_addr);
+            entryOrder[chunkEnd[chunk]++] = (UINT32)i;
+        }
+    }
+
+    // Most chunks are usually copied, start from the size of the current pool
+    ATF_ERROR atfError = AtfIpv4RoaringPoolReserve(nextPool, ctx->pool.size + IPV4_ROARING_INITIAL_POOL_WORDS);
+    if (atfError) {
+        return atfError;
+    }
+
+    UINT64 cardinality = ctx->cardinality;
+
+    for (UINT32 chunk = 0; chunk < IPV4_ROARING_NUM_OF_CHUNKS; chunk++) {
+        const IPV4_ROARING_CONTAINER *container = &ctx->directory[chunk];
+        IPV4_ROARING_CONTAINER *nextContainer = &scratch->directory[chunk];
+
+        const UINT32 firstEntry = chunk ? chunkEnd[chunk - 1] : 0;
+        const UINT32 lastEntry = chunkEnd[chunk];
+        const BOOLEAN isCovered = (coveredChunks[chunk / 64] >> (chunk % 64)) & 1;
+
+        if (!isCovered && firstEntry == lastEntry) {
+            const size_t numOfWords = AtfIpv4RoaringContainerWords(container);
+
+            atfError = AtfIpv4RoaringPoolReserve(nextPool, numOfWords);
+            if (atfError) {
+                return atfError;
+            }
+
+            *nextContainer = *container;
+            nextContainer->offset = (UINT32)nextPool->size;
+
+            if (numOfWords) {
+                RtlCopyMemory(&nextPool->words[nextPool->size], &ctx->pool.words[container->offset],
+                    numOfWords * sizeof(UINT16));
+                nextPool->size += numOfWords;
+            }
+
+            continue;
+        }
+
+        cardinality -= AtfIpv4RoaringContainerCardinality(ctx->pool.words, container);
+
+        RtlZeroMemory(bitmap, IPV4_ROARING_SCRATCH_WORDS * sizeof(UINT64));
+
+        if (isCovered) {
+            // Whole chunk added or removed, the entries within it make no difference
+            if (!isRemove) {
+                AtfIpv4RoaringUpdateRange(bitmap, 0, IPV4_ROARING_CHUNK_SIZE, FALSE);
+            }
+        } else {
+            AtfIpv4RoaringDecode(ctx->pool.words, container, bitmap);
+
+            for (UINT32 e = firstEntry; e < lastEntry; e++) {
+                const IPV4_PREFIX_ENTRY *entry = &pool[entryOrder[e]];
+                const UINT32 address = entry->address.S_un.S_addr & IPV4_PREFIX_MASK(entry->prefixLength);
+
+                AtfIpv4RoaringUpdateRange(bitmap, IPV4_ROARING_LOW(address),
+                    1UL << (IPV4_PREFIX_MAX_LENGTH - entry->prefixLength), isRemove);
+            }
+        }
+
+        UINT32 nextCardinality = 0;
+        atfError = AtfIpv4RoaringEncode(bitmap, nextPool, nextContainer, &nextCardinality);
+        if (atfError) {
+            return atfError;
+        }
+
+        cardinality += nextCardinality;
+    }
+
+    // Trim the pool to its final size
+    IPV4_ROARING_POOL trimmedPool = { 0 };
+    if (nextPool->size) {
+        atfError = AtfIpv4RoaringPoolReserve(&trimmedPool, nextPool->size);
+        if (atfError) {
+            return atfError;
+        }
+
+        RtlCopyMemory(trimmedPool.words, nextPool->words, nextPool->size * sizeof(UINT16));
+        trimmedPool.size = nextPool->size;
+    }
+
+    // The current pool is freed along with the scratch
+    ATF_FREE(nextPool->words);
+    scratch->pool = ctx->pool;
+    ctx->pool = trimmedPool;
+
+    RtlCopyMemory(ctx->directory, scratch->directory, sizeof(ctx->directory));
+    ctx->cardinality = cardinality;
+
+    AtfIpv4RoaringUpdateStats(ctx);
+
+    return ATF_ERROR_OK;
+}
+
+static ATF_ERROR AtfIpv4RoaringPoolReserve(IPV4_ROARING_POOL *pool, size_t numOfWords)
+{
+    const size_t requiredWords = pool->size + numOfWords;
+    if (requiredWords <= pool->capacity) {
+        return ATF_ERROR_OK;
+    }
+
+    // Container offsets are 32-bit
+    if (requiredWords > _UI32_MAX) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    size_t capacity = pool->capacity * 2;
+    if (capacity < requiredWords) {
+        capacity = requiredWords;
+    }
+
+    UINT16 *words = (UINT16 *)ATF_MALLOC(capacity * sizeof(UINT16));
+    if (!words) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    if (pool->words) {
+        RtlCopyMemory(words, pool->words, pool->size * sizeof(UINT16));
+        ATF_FREE(pool->words);
+    }
+
+    pool->words = words;
+    pool->capacity = capacity;
+
+    return ATF_ERROR_OK;
+}
+
+static size_t AtfIpv4RoaringContainerWords(const IPV4_ROARING_CONTAINER *container)
+{
+    switch (container->type) {
+    case IPV4_ROARING_ARRAY:
+        return (size_t)container->count + 1;
+    case IPV4_ROARING_BITMAP:
+        return IPV4_ROARING_BITMAP_WORDS;
+    case IPV4_ROARING_RUN:
+        return ((size_t)container->count + 1) * IPV4_ROARING_RUN_WORDS;
+    default:
+        return 0;
+    }
+}
+
+static UINT32 AtfIpv4RoaringContainerCardinality(const UINT16 *words, const IPV4_ROARING_CONTAINER *container)
+{
+    UINT32 cardinality = 0;
+
+    switch (container->type) {
+    case IPV4_ROARING_ARRAY:
+    {
+        cardinality = (UINT32)container->count + 1;
+    }
+    break;
+    case IPV4_ROARING_BITMAP:
+    {
+        const UINT64 *bitmap = (const UINT64 *)&words[container->offset];
+        for (UINT32 i = 0; i < IPV4_ROARING_SCRATCH_WORDS; i++) {
+            UINT64 word;
+            RtlCopyMemory(&word, &bitmap[i], sizeof(UINT64));
+            cardinality += AtfIpv4TriePopcount(word);
+        }
+    }
+    break;
+    case IPV4_ROARING_RUN:
+    {
+        const UINT16 *runs = &words[container->offset];
+        for (UINT32 i = 0; i <= container->count; i++) {
+            cardinality += (UINT32)runs[i * IPV4_ROARING_RUN_WORDS + 1] + 1;
+        }
+    }
+    break;
+    default:
+        break;
+    }
+
+    return cardinality;
+}
+
+static __forceinline BOOLEAN AtfIpv4RoaringContainerContains(
+    const UINT16 *words,
+    const IPV4_ROARING_CONTAINER *container,
+    UINT16 low
+)
+{
+    switch (container->type) {
+    case IPV4_ROARING_ARRAY:
+    {
+        const UINT16 *values = &words[container->offset];
+
+        // Lower bound over count + 1 sorted values
+        UINT32 first = 0, length = (UINT32)container->count + 1;
+        while (length > 1) {
+            const UINT32 half = length / 2;
+            if (values[first + half] <= low) {
+                first += half;
+            }
+            length -= half;
+        }
+
+        return values[first] == low;
+    }
+    case IPV4_ROARING_BITMAP:
+    {
+        return (words[container->offset + (low >> 4)] >> (low & 15)) & 1;
+    }
+    case IPV4_ROARING_RUN:
+    {
+        const UINT16 *runs = &words[container->offset];
+
+        // Last run starting at or below low
+        UINT32 first = 0, length = (UINT32)container->count + 1;
+        while (length > 1) {
+            const UINT32 half = length / 2;
+            if (runs[(first + half) * IPV4_ROARING_RUN_WORDS] <= low) {
+                first += half;
+            }
+            length -= half;
+        }
+
+        const UINT16 start = runs[first * IPV4_ROARING_RUN_WORDS];
+        return low >= start && (UINT32)(low - start) <= runs[first * IPV4_ROARING_RUN_WORDS + 1];
+    }
+    default:
+        return FALSE;
+    }
+}
+
+static __forceinline const VOID *AtfIpv4RoaringContainerProbe(
+    const UINT16 *words,
+    const IPV4_ROARING_CONTAINER *container,
+    UINT16 low
+)
+{
+    switch (container->type) {
+    case IPV4_ROARING_ARRAY:
+        return &words[container->offset + ((UINT32)container->count + 1) / 2];
+    case IPV4_ROARING_BITMAP:
+        return &words[container->offset + (low >> 4)];
+    case IPV4_ROARING_RUN:
+        return &words[container->offset + (((UINT32)container->count + 1) / 2) * IPV4_ROARING_RUN_WORDS];
+    default:
+        return container;
+    }
+}
+
+static VOID AtfIpv4RoaringDecode(const UINT16 *words, const IPV4_ROARING_CONTAINER *container, UINT64 *bitmap)
+{
+    switch (container->type) {
+    case IPV4_ROARING_ARRAY:
+    {
+        const UINT16 *values = &words[container->offset];
+        for (UINT32 i = 0; i <= container->count; i++) {
+            bitmap[values[i] / 64] |= 1ULL << (values[i] % 64);
+        }
+    }
+    break;
+    case IPV4_ROARING_BITMAP:
+    {
+        RtlCopyMemory(bitmap, &words[container->offset], IPV4_ROARING_BITMAP_WORDS * sizeof(UINT16));
+    }
+    break;
+    case IPV4_ROARING_RUN:
+    {
+        const UINT16 *runs = &words[container->offset];
+        for (UINT32 i = 0; i <= container->count; i++) {
+            AtfIpv4RoaringUpdateRange(bitmap, runs[i * IPV4_ROARING_RUN_WORDS],
+                (UINT32)runs[i * IPV4_ROARING_RUN_WORDS + 1] + 1, FALSE);
+        }
+    }
+    break;
+    default:
+        break;
+    }
+}
+
+static ATF_ERROR AtfIpv4RoaringEncode(
+    const UINT64 *bitmap,
+    IPV4_ROARING_POOL *pool,
+    IPV4_ROARING_CONTAINER *containerOut,
+    UINT32 *cardinalityOut
+)
+{
+    RtlZeroMemory(containerOut, sizeof(IPV4_ROARING_CONTAINER));
+    *cardinalityOut = 0;
+
+    //
+    // A run starts on a set bit whose lower neighbour is clear, the carry is the top bit of the previous word
+    //
+    UINT32 cardinality = 0, numOfRuns = 0;
+    UINT64 carry = 0;
+    for (UINT32 i = 0; i < IPV4_ROARING_SCRATCH_WORDS; i++) {
+        const UINT64 word = bitmap[i];
+
+        cardinality += AtfIpv4TriePopcount(word);
+        numOfRuns += AtfIpv4TriePopcount(word & ~((word << 1) | carry));
+        carry = word >> 63;
+    }
+
+    if (!cardinality) {
+        return ATF_ERROR_OK;
+    }
+
+    // Smallest representation, ties go to the cheaper lookup (bitmap, then array)
+    const size_t runWords = (size_t)numOfRuns * IPV4_ROARING_RUN_WORDS;
+
+    IPV4_ROARING_TYPE type = IPV4_ROARING_BITMAP;
+    size_t numOfWords = IPV4_ROARING_BITMAP_WORDS;
+
+    if (cardinality <= IPV4_ROARING_ARRAY_MAX_CARDINALITY && cardinality < numOfWords) {
+        type = IPV4_ROARING_ARRAY;
+        numOfWords = cardinality;
+    }
+
+    if (runWords < numOfWords) {
+        type = IPV4_ROARING_RUN;
+        numOfWords = runWords;
+    }
+
+    ATF_ERROR atfError = AtfIpv4RoaringPoolReserve(pool, numOfWords);
+    if (atfError) {
+        return atfError;
+    }
+
+    UINT16 *words = &pool->words[pool->size];
+
+    switch (type) {
+    case IPV4_ROARING_ARRAY:
+    {
+        UINT32 numOfValues = 0;
+        for (UINT32 i = 0; i < IPV4_ROARING_SCRATCH_WORDS; i++) {
+            for (UINT64 word = bitmap[i]; word; word &= word - 1) {
+                words[numOfValues++] = (UINT16)(i * 64 + AtfIpv4RoaringLowestBit(word));
+            }
+        }
+
+        containerOut->count = (UINT16)(cardinality - 1);
+    }
+    break;
+    case IPV4_ROARING_BITMAP:
+    {
+        RtlCopyMemory(words, bitmap, IPV4_ROARING_BITMAP_WORDS * sizeof(UINT16));
+    }
+    break;
+    case IPV4_ROARING_RUN:
+    {
+        //
+        // Starts and ends come in the same order, so the n-th end closes the n-th run
+        //
+        UINT32 numOfStarts = 0, numOfEnds = 0;
+        carry = 0;
+        for (UINT32 i = 0; i < IPV4_ROARING_SCRATCH_WORDS; i++) {
+            const UINT64 word = bitmap[i];
+            const UINT64 nextCarry = (i + 1 < IPV4_ROARING_SCRATCH_WORDS) ? (bitmap[i + 1] & 1) : 0;
+
+            for (UINT64 starts = word & ~((word << 1) | carry); starts; starts &= starts - 1) {
+                words[numOfStarts++ * IPV4_ROARING_RUN_WORDS] = (UINT16)(i * 64 + AtfIpv4RoaringLowestBit(starts));
+            }
+
+            for (UINT64 ends = word & ~((word >> 1) | (nextCarry << 63)); ends; ends &= ends - 1) {
+                UINT16 *run = &words[numOfEnds++ * IPV4_ROARING_RUN_WORDS];
+                run[1] = (UINT16)(i * 64 + AtfIpv4RoaringLowestBit(ends) - run[0]);
+            }
+
+            carry = word >> 63;
+        }
+
+        containerOut->count = (UINT16)(numOfRuns - 1);
+    }
+    break;
+    default:
+        break;
+    }
+
+    containerOut->type = (UINT8)type;
+    containerOut->offset = (UINT32)pool->size;
+    pool->size += numOfWords;
+
+    *cardinalityOut = cardinality;
+
+    return ATF_ERROR_OK;
+}
+
+static VOID AtfIpv4RoaringUpdateRange(UINT64 *bitmap, UINT32 start, UINT32 length, BOOLEAN isRemove)
+{
+    const UINT32 end = start + length;
+
+    for (UINT32 v = start; v < end;) {
+        const UINT32 bit = v % 64;
+        const UINT32 numOfBits = (end - v) < (64 - bit) ? (end - v) : (64 - bit);
+        const UINT64 mask = (numOfBits == 64 ? ~0ULL : ((1ULL << numOfBits) - 1)) << bit;
+
+        if (isRemove) {
+            bitmap[v / 64] &= ~mask;
+        } else {
+            bitmap[v / 64] |= mask;
+        }
+
+        v += numOfBits;
+    }
+}
+
+static __forceinline UINT32 AtfIpv4RoaringLowestBit(UINT64 v)
+{
+    unsigned long index = 0;
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(_M_ARM64)
+    _BitScanForward64(&index, v);
+#else
+    if (!_BitScanForward(&index, (unsigned long)v)) {
+        _BitScanForward(&index, (unsigned long)(v >> 32));
+        index += 32;
+    }
+#endif //_M_X64
+
+    return (UINT32)index;
+}
+
+static VOID AtfIpv4RoaringUpdateStats(IPV4_ROARING_CTX *ctx)
+{
+    RtlZeroMemory(ctx->numOfContainers, sizeof(ctx->numOfContainers));
+
+    for (UINT32 chunk = 0; chunk < IPV4_ROARING_NUM_OF_CHUNKS; chunk++) {
+        ctx->numOfContainers[ctx->directory[chunk].type]++;
+    }
+
+    ctx->totalSetSize = sizeof(IPV4_ROARING_CTX) + ctx->pool.capacity * sizeof(UINT16);
+}
+
+//EOF
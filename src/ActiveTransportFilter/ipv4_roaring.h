@@ -0,0 +1,149 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include <inaddr.h>
+#include <limits.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "ipv4_trie.h"
+#include "mem.h"
+
+//
+// Roaring-style hybrid container set for IPv4 addresses
+//
+//  The address space is split by the top 16 bits into 65536 chunks. The directory is indexed directly by the
+//   chunk, and each non-empty chunk holds one container of low 16-bit values, whichever is smallest:
+//
+//   ARRAY:  sorted UINT16 values, 2 bytes per address, up to IPV4_ROARING_ARRAY_MAX_CARDINALITY addresses
+//   BITMAP: 65536 bits (8KB), for dense chunks
+//   RUN:    sorted (start, length - 1) UINT16 pairs, 4 bytes per run, for subnets and address ranges
+//
+//  Clustered feeds get bitmaps and runs where they are dense, and arrays where they are sparse, so neither side
+//   pays for the other. A lookup is one directory load and one search within the container (a bit test, or a
+//   binary search over at most 8KB), with no pointer chasing.
+//
+//  All containers live in a single pool of UINT16 words, referenced by offset. Inserting and removing a pool of
+//   prefixes (union and difference) rebuilds only the chunks the pool touches, the other containers are copied
+//   to the new pool as is. A prefix of /16 or shorter replaces every chunk it covers with a single run.
+//
+//  This is a set: a lookup answers whether the address is in any blocklist entry, and reports it as a /32 match.
+//   The length of the covering prefix is not kept.
+//
+#define IPV4_ROARING_CHUNK_BITS                 16
+#define IPV4_ROARING_NUM_OF_CHUNKS              (1UL << IPV4_ROARING_CHUNK_BITS)
+#define IPV4_ROARING_CHUNK_SIZE                 (1UL << (32 - IPV4_ROARING_CHUNK_BITS))
+#define IPV4_ROARING_ARRAY_MAX_CARDINALITY      4096
+#define IPV4_ROARING_BITMAP_WORDS               (IPV4_ROARING_CHUNK_SIZE / (sizeof(UINT16) * CHAR_BIT))
+
+// Initial size of the container pool while it is being rebuilt, in UINT16 words. The pool doubles when full, and is
+//  trimmed once the rebuild completes
+#define IPV4_ROARING_INITIAL_POOL_WORDS         (64 * 1024)
+
+typedef enum {
+    IPV4_ROARING_EMPTY,
+    IPV4_ROARING_ARRAY,
+    IPV4_ROARING_BITMAP,
+    IPV4_ROARING_RUN,
+    IPV4_ROARING_NUM_OF_TYPES
+} IPV4_ROARING_TYPE;
+
+//
+// Directory entry of a chunk
+//
+typedef struct _ipv4_roaring_container {
+    // Offset of the container in the pool, in UINT16 words
+    UINT32                          offset;
+
+    // Number of values (ARRAY) or runs (RUN), minus one. Unused for BITMAP
+    UINT16                          count;
+
+    // IPV4_ROARING_TYPE
+    UINT8                           type;
+    UINT8                           reserved;
+} IPV4_ROARING_CONTAINER, *PIPV4_ROARING_CONTAINER;
+
+//
+// Container pool
+//
+typedef struct _ipv4_roaring_pool {
+    UINT16                          *words;
+
+    // Used and allocated size, in UINT16 words
+    size_t                          size;
+    size_t                          capacity;
+} IPV4_ROARING_POOL, *PIPV4_ROARING_POOL;
+
+//
+// Roaring set instance context
+//
+typedef struct _ipv4_roaring_ctx {
+    // Total physical size of the directory and pool, in bytes
+    size_t                          totalSetSize;
+
+    // Total number of inserted prefixes (duplicates are counted)
+    size_t                          totalNumOfPrefixes;
+
+    // Number of addresses in the set
+    UINT64                          cardinality;
+
+    // Number of containers of each type
+    size_t                          numOfContainers[IPV4_ROARING_NUM_OF_TYPES];
+
+    // Containers of all the chunks
+    IPV4_ROARING_POOL               pool;
+
+    // Directory, indexed by the top 16 bits of the address
+    IPV4_ROARING_CONTAINER          directory[IPV4_ROARING_NUM_OF_CHUNKS];
+} IPV4_ROARING_CTX, *PIPV4_ROARING_CTX;
+
+//
+// Initialize an empty set
+//
+ATF_ERROR AtfIpv4RoaringAllocCtx(IPV4_ROARING_CTX **ctxOut);
+
+//
+// Add a pool of ipv4 prefixes to the set (union)
+//
+ATF_ERROR AtfIpv4RoaringInsertPool(IPV4_ROARING_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Remove a pool of ipv4 prefixes from the set (difference)
+//
+ATF_ERROR AtfIpv4RoaringRemovePool(IPV4_ROARING_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Search the set for a single input IP
+//  Returns IPV4_PREFIX_MAX_LENGTH if the IP is in the set, or 0
+//
+UINT8 AtfIpv4RoaringSearch(const IPV4_ROARING_CTX *ctx, struct in_addr ip);
+
+//
+// Search the set for numOfIps addresses, resultsOut receives the same values as AtfIpv4RoaringSearch.
+//  The directory entries of all the keys are prefetched first
+//
+VOID AtfIpv4RoaringSearchBatch(
+    const IPV4_ROARING_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+);
+
+//
+// Create a copy of the set
+//
+ATF_ERROR AtfIpv4RoaringClone(const IPV4_ROARING_CTX *src, IPV4_ROARING_CTX **ctxOut);
+
+//
+// Print context info
+//
+VOID AtfIpv4RoaringPrintCtx(const IPV4_ROARING_CTX *ctx);
+
+//
+// Free the set and context
+//
+VOID AtfIpv4RoaringFree(IPV4_ROARING_CTX **ctx);
+
+//EOF
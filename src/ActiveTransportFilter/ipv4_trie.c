@@ -8,142 +8,547 @@
 #include "mem.h"
 #include "trace.h"
 
-ATF_ERROR AtfIpv4TrieAllocCtx(IPV4_TRIE_CTX **ctxOut)
+//
+// Copy the children arrays and leaf vectors below a node into the arena of ctx, node is a copy of the source node
+//
+static ATF_ERROR AtfIpv4TrieCloneNode(IPV4_TRIE_CTX *ctx, IPV4_TRIE_NODE *node);
+
+//
+// Make room for a new element at rank in a packed array of count elements
+//  The array grows in place while it fits its arena size class, otherwise it is moved to a larger block.
+//  The new element is zeroed
+//
+static VOID *AtfIpv4TrieInsertAt(
+    IPV4_TRIE_CTX *ctx,
+    VOID *array,
+    UINT32 count,
+    UINT32 rank,
+    size_t elementSize
+)
 {
-    IPV4_TRIE_CTX *ctx = (IPV4_TRIE_CTX *)ATF_MALLOC(sizeof(IPV4_TRIE_CTX));
-    if (!ctx) {
+    UINT8 *oldArray = (UINT8 *)array;
+
+    if (oldArray && AtfArenaBlockSize(count * elementSize) >= (count + 1) * elementSize) {
+        RtlMoveMemory(&oldArray[(rank + 1) * elementSize], &oldArray[rank * elementSize], (count - rank) * elementSize);
+        RtlZeroMemory(&oldArray[rank * elementSize], elementSize);
+        return oldArray;
+    }
+
+    // AtfArenaAlloc returns zeroed memory, so the element at rank is already empty
+    UINT8 *newArray = (UINT8 *)AtfArenaAlloc(&ctx->arena, (count + 1) * elementSize);
+    if (!newArray) {
+        return NULL;
+    }
+
+    if (oldArray) {
+        RtlCopyMemory(newArray, oldArray, rank * elementSize);
+        RtlCopyMemory(&newArray[(rank + 1) * elementSize], &oldArray[rank * elementSize], (count - rank) * elementSize);
+        AtfArenaFree(&ctx->arena, oldArray, count * elementSize);
+    }
+
+    return newArray;
+}
+
+//
+// Remove the element at rank from a packed array of count elements
+//  The array moves to a smaller block when it drops to a smaller arena size class, so the space of removed
+//  elements is reused by later inserts. Returns NULL once the array is empty
+//
+static VOID *AtfIpv4TrieRemoveAt(
+    IPV4_TRIE_CTX *ctx,
+    VOID *array,
+    UINT32 count,
+    UINT32 rank,
+    size_t elementSize
+)
+{
+    UINT8 *oldArray = (UINT8 *)array;
+
+    if (count == 1) {
+        AtfArenaFree(&ctx->arena, oldArray, elementSize);
+        return NULL;
+    }
+
+    if (AtfArenaBlockSize((count - 1) * elementSize) < AtfArenaBlockSize(count * elementSize)) {
+        UINT8 *newArray = (UINT8 *)AtfArenaAlloc(&ctx->arena, (count - 1) * elementSize);
+
+        // Without a new block the array shrinks in place. The block is then larger than its size class
+        //  implies, which only costs the difference when it is freed
+        if (newArray) {
+            RtlCopyMemory(newArray, oldArray, rank * elementSize);
+            RtlCopyMemory(&newArray[rank * elementSize], &oldArray[(rank + 1) * elementSize], (count - rank - 1) * elementSize);
+            AtfArenaFree(&ctx->arena, oldArray, count * elementSize);
+            return newArray;
+        }
+    }
+
+    RtlMoveMemory(&oldArray[rank * elementSize], &oldArray[(rank + 1) * elementSize], (count - rank - 1) * elementSize);
+    RtlZeroMemory(&oldArray[(count - 1) * elementSize], elementSize);
+
+    return oldArray;
+}
+
+//
+// Returns the child node for an octet, creating it if necessary
+//  The new node is inserted into the children array at its rank
+//
+static IPV4_TRIE_NODE *AtfIpv4TrieGetOrAddChild(IPV4_TRIE_CTX *ctx, IPV4_TRIE_NODE *node, IPV4_OCTET octet)
+{
+    const UINT32 rank = AtfIpv4TrieRank(node->childBitmap, octet);
+
+    if (AtfIpv4TrieBitTest(node->childBitmap, octet)) {
+        return &node->children[rank];
+    }
+
+    const UINT32 numOfChildren = AtfIpv4TrieBitmapCount(node->childBitmap);
+
+    IPV4_TRIE_NODE *newChildren = (IPV4_TRIE_NODE *)AtfIpv4TrieInsertAt(
+        ctx, 
+        node->children, 
+        numOfChildren, 
+        rank, 
+        IPV4_TRIE_NODE_SIZE
+    );
+    if (!newChildren) {
+        return NULL;
+    }
+
+    node->children = newChildren;
+    node->childBitmap[octet >> 6] |= 1ULL << (octet & 63);
+
+    ctx->totalTrieSize += IPV4_TRIE_NODE_SIZE;
+    ctx->totalNumOfNodes++;
+
+    return &node->children[rank];
+}
+
+//
+// Set a leaf for an octet, unless it is already covered by a prefix of the same or a longer length.
+//  Sets *isUpdated to TRUE if the leaf was created or replaced
+//
+static ATF_ERROR AtfIpv4TrieSetLeaf(
+    IPV4_TRIE_CTX *ctx,
+    IPV4_TRIE_NODE *node,
+    IPV4_OCTET octet,
+    IPV4_TRIE_LEAF value,
+    BOOLEAN *isUpdated
+)
+{
+    const UINT32 rank = AtfIpv4TrieRank(node->leafBitmap, octet);
+
+    *isUpdated = FALSE;
+
+    if (AtfIpv4TrieBitTest(node->leafBitmap, octet)) {
+        if (node->leaves[rank] < value) {
+            node->leaves[rank] = value;
+            *isUpdated = TRUE;
+        }
+        return ATF_ERROR_OK;
+    }
+
+    const UINT32 numOfLeaves = AtfIpv4TrieBitmapCount(node->leafBitmap);
+
+    IPV4_TRIE_LEAF *newLeaves = (IPV4_TRIE_LEAF *)AtfIpv4TrieInsertAt(
+        ctx, 
+        node->leaves, 
+        numOfLeaves, 
+        rank, 
+        sizeof(IPV4_TRIE_LEAF)
+    );
+    if (!newLeaves) {
         return ATF_NO_MEMORY_AVAILABLE;
     }
 
-    ctx->root = ATF_MALLOC(IPV4_TRIE_NODE_SIZE);
+    newLeaves[rank] = value;
+
+    node->leaves = newLeaves;
+    node->leafBitmap[octet >> 6] |= 1ULL << (octet & 63);
+
+    ctx->totalTrieSize += sizeof(IPV4_TRIE_LEAF);
+    *isUpdated = TRUE;
+
+    return ATF_ERROR_OK;
+}
+
+//
+// Clear a leaf for an octet if it holds exactly value, i.e. it was set by the prefix being removed.
+//  Returns TRUE if the leaf was removed
+//
+static BOOLEAN AtfIpv4TrieClearLeaf(
+    IPV4_TRIE_CTX *ctx,
+    IPV4_TRIE_NODE *node,
+    IPV4_OCTET octet,
+    IPV4_TRIE_LEAF value
+)
+{
+    if (!AtfIpv4TrieBitTest(node->leafBitmap, octet)) {
+        return FALSE;
+    }
+
+    const UINT32 rank = AtfIpv4TrieRank(node->leafBitmap, octet);
+    if (node->leaves[rank] != value) {
+        return FALSE;
+    }
+
+    node->leaves = (IPV4_TRIE_LEAF *)AtfIpv4TrieRemoveAt(
+        ctx,
+        node->leaves,
+        AtfIpv4TrieBitmapCount(node->leafBitmap),
+        rank,
+        sizeof(IPV4_TRIE_LEAF)
+    );
+    node->leafBitmap[octet >> 6] &= ~(1ULL << (octet & 63));
+
+    ctx->totalTrieSize -= sizeof(IPV4_TRIE_LEAF);
+
+    return TRUE;
+}
+
+//
+// Remove the (empty) child node of an octet from the children array
+//
+static VOID AtfIpv4TrieRemoveChild(IPV4_TRIE_CTX *ctx, IPV4_TRIE_NODE *node, IPV4_OCTET octet)
+{
+    node->children = (IPV4_TRIE_NODE *)AtfIpv4TrieRemoveAt(
+        ctx,
+        node->children,
+        AtfIpv4TrieBitmapCount(node->childBitmap),
+        AtfIpv4TrieRank(node->childBitmap, octet),
+        IPV4_TRIE_NODE_SIZE
+    );
+    node->childBitmap[octet >> 6] &= ~(1ULL << (octet & 63));
+
+    ctx->totalTrieSize -= IPV4_TRIE_NODE_SIZE;
+    ctx->totalNumOfNodes--;
+}
+
+ATF_ERROR AtfIpv4TrieAllocCtx(IPV4_TRIE_CTX **ctxOut)
+{
+    if (!ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    // The root node is embedded in the context, and is zeroed by ATF_MALLOC
+    IPV4_TRIE_CTX *ctx = (IPV4_TRIE_CTX *)ATF_MALLOC(sizeof(IPV4_TRIE_CTX));
     if (!ctx) {
-        ATF_FREE(ctx);
         return ATF_NO_MEMORY_AVAILABLE;
     }
 
+    ctx->totalTrieSize = IPV4_TRIE_NODE_SIZE;
+    ctx->totalNumOfNodes = 1;
+
+    AtfArenaInit(&ctx->arena);
+
     *ctxOut = ctx;
 
     return ATF_ERROR_OK;
 }
 
 //
-// Insert a IPv4 pool into the trie
+// Insert a pool of IPv4 prefixes into the trie
 //
-ATF_ERROR AtfIpv4TrieInsertPool(IPV4_TRIE_CTX *ctx, const struct in_addr *pool, size_t numOfIps)
+ATF_ERROR AtfIpv4TrieInsertPool(IPV4_TRIE_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
 {
-    if (!ctx || !pool || !numOfIps) {
+    if (!ctx || !pool || !numOfEntries) {
         return ATF_BAD_PARAMETERS;
-    }    
+    }
 
     // Iterate through the input pool
-    for (size_t currIp = 0; currIp < numOfIps; currIp++) {
-        struct in_addr ip;
-        ip.S_un.S_addr = pool[currIp].S_un.S_addr;
+    for (size_t currEntry = 0; currEntry < numOfEntries; currEntry++) {
+        const UINT8 prefixLength = pool[currEntry].prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            return ATF_BAD_PARAMETERS;
+        }
+
+        const UINT32 ip = pool[currEntry].address.S_un.S_addr & IPV4_PREFIX_MASK(prefixLength);
 
-        VOID **currTrieNode = ctx->root;
+        // The level that holds the leaves for this prefix, and the number of octets it covers on that level
+        const UINT8 leafLevel = (prefixLength - 1) / IPV4_TRIE_STRIDE;
+        const UINT32 numOfLeaves = 1UL << (((leafLevel + 1) * IPV4_TRIE_STRIDE) - prefixLength);
 
-        // Iterate through each octet and insert trie at the corresponding index (octet)        
-        for (UINT8 octetCount = 0; octetCount < sizeof(struct in_addr); octetCount++) {
-            const IPV4_OCTET currOctet = (ip.S_un.S_addr >> (octetCount * 8)) & 0xff;
+        IPV4_TRIE_NODE *currTrieNode = &ctx->root;
+
+        // Walk (or create) the child nodes down to the leaf level
+        for (UINT8 level = 0; level < leafLevel; level++) {
+            currTrieNode = AtfIpv4TrieGetOrAddChild(ctx, currTrieNode, IPV4_TRIE_OCTET(ip, level));
+            if (!currTrieNode) {
+                return ATF_NO_MEMORY_AVAILABLE;
+            }
+        }
 
-            // If we've reached the last octet, add a -1 (ipEndMarker)
-            if (octetCount == 3) {
-                currTrieNode[currOctet] = ipEndMarker;
+        // Expand the prefix into a leaf for each octet it covers
+        BOOLEAN isNewPrefix = FALSE;
+        const UINT32 firstOctet = IPV4_TRIE_OCTET(ip, leafLevel);
+        for (UINT32 octet = firstOctet; octet < firstOctet + numOfLeaves; octet++) {
+            BOOLEAN isUpdated = FALSE;
+            ATF_ERROR atfError = AtfIpv4TrieSetLeaf(
+                ctx,
+                currTrieNode,
+                (IPV4_OCTET)octet,
+                (IPV4_TRIE_LEAF)prefixLength,
+                &isUpdated
+            );
+            if (atfError) {
+                return atfError;
+            }
+
+            isNewPrefix |= isUpdated;
+        }
+
+        if (isNewPrefix) {
+            ctx->totalNumOfPrefixes++;
+        }
+    }
+
+    return ATF_ERROR_OK;
+}
+
+//
+// Remove a pool of IPv4 prefixes from the trie
+//
+ATF_ERROR AtfIpv4TrieRemovePool(IPV4_TRIE_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    if (!ctx || !pool || !numOfEntries) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    for (size_t currEntry = 0; currEntry < numOfEntries; currEntry++) {
+        const UINT8 prefixLength = pool[currEntry].prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            return ATF_BAD_PARAMETERS;
+        }
+
+        const UINT32 ip = pool[currEntry].address.S_un.S_addr & IPV4_PREFIX_MASK(prefixLength);
+
+        const UINT8 leafLevel = (prefixLength - 1) / IPV4_TRIE_STRIDE;
+        const UINT32 numOfLeaves = 1UL << (((leafLevel + 1) * IPV4_TRIE_STRIDE) - prefixLength);
+
+        // Nodes along the path, so that the ones left empty can be unlinked bottom-up
+        IPV4_TRIE_NODE *path[IPV4_TRIE_MAX_DEPTH];
+        path[0] = &ctx->root;
+
+        BOOLEAN isOnPath = TRUE;
+        for (UINT8 level = 0; level < leafLevel; level++) {
+            const IPV4_OCTET octet = IPV4_TRIE_OCTET(ip, level);
+            if (!AtfIpv4TrieBitTest(path[level]->childBitmap, octet)) {
+                isOnPath = FALSE;
                 break;
             }
 
-            // Add the new trie, if necessary
-            if (currTrieNode[currOctet] == 0) {
-                currTrieNode[currOctet] = (IPV4_OCTET *)ATF_MALLOC(IPV4_TRIE_NODE_SIZE);
-                if (currTrieNode[currOctet] == NULL) {
-                    return ATF_NO_MEMORY_AVAILABLE;
-                }
+            path[level + 1] = &path[level]->children[AtfIpv4TrieRank(path[level]->childBitmap, octet)];
+        }
+
+        // Not in the trie
+        if (!isOnPath) {
+            continue;
+        }
+
+        // Leaves that hold a longer prefix were not set by this one, and stay
+        BOOLEAN isRemoved = FALSE;
+        const UINT32 firstOctet = IPV4_TRIE_OCTET(ip, leafLevel);
+        for (UINT32 octet = firstOctet; octet < firstOctet + numOfLeaves; octet++) {
+            isRemoved |= AtfIpv4TrieClearLeaf(ctx, path[leafLevel], (IPV4_OCTET)octet, (IPV4_TRIE_LEAF)prefixLength);
+        }
+
+        if (!isRemoved) {
+            continue;
+        }
 
-                ctx->totalTrieSize += IPV4_TRIE_NODE_SIZE;
+        if (ctx->totalNumOfPrefixes) {
+            ctx->totalNumOfPrefixes--;
+        }
+
+        // Reclaim the nodes the removal left without leaves or children, the root always stays
+        for (UINT8 level = leafLevel; level > 0; level--) {
+            const IPV4_TRIE_NODE *node = path[level];
+            if (AtfIpv4TrieBitmapCount(node->childBitmap) || AtfIpv4TrieBitmapCount(node->leafBitmap)) {
+                break;
             }
 
-            // Iterate into the next trie
-            currTrieNode = currTrieNode[currOctet];
+            AtfIpv4TrieRemoveChild(ctx, path[level - 1], IPV4_TRIE_OCTET(ip, level - 1));
         }
     }
 
-    ctx->totalNumOfIps += numOfIps;
-
     return ATF_ERROR_OK;
 }
 
-BOOLEAN AtfIpv4TrieSearch(IPV4_TRIE_CTX *ctx, struct in_addr ip)
+ATF_ERROR AtfIpv4TrieClone(const IPV4_TRIE_CTX *src, IPV4_TRIE_CTX **ctxOut)
 {
-    if (!ctx || !ctx->totalNumOfIps) {
-        return FALSE;
+    if (!src || !ctxOut) {
+        return ATF_BAD_PARAMETERS;
     }
+    *ctxOut = NULL;
 
-    VOID **currTrieNode = ctx->root;
+    IPV4_TRIE_CTX *ctx = NULL;
+    ATF_ERROR atfError = AtfIpv4TrieAllocCtx(&ctx);
+    if (atfError) {
+        return atfError;
+    }
+
+    ctx->totalTrieSize = src->totalTrieSize;
+    ctx->totalNumOfNodes = src->totalNumOfNodes;
+    ctx->totalNumOfPrefixes = src->totalNumOfPrefixes;
+    ctx->root = src->root;
+
+    atfError = AtfIpv4TrieCloneNode(ctx, &ctx->root);
+    if (atfError) {
+        AtfIpv4TrieFree(&ctx);
+        return atfError;
+    }
 
-    for (UINT8 octetCount = 0; octetCount < sizeof(struct in_addr); octetCount++) {
-        const IPV4_OCTET octet = (ip.S_un.S_addr >> (octetCount * 8)) & 0xff;
+    *ctxOut = ctx;
 
-        if (currTrieNode[octet] == NULL) {
-            return FALSE;
+    return ATF_ERROR_OK;
+}
+
+static ATF_ERROR AtfIpv4TrieCloneNode(IPV4_TRIE_CTX *ctx, IPV4_TRIE_NODE *node)
+{
+    const UINT32 numOfChildren = AtfIpv4TrieBitmapCount(node->childBitmap);
+    const UINT32 numOfLeaves = AtfIpv4TrieBitmapCount(node->leafBitmap);
+
+    // node still points to the source arrays. If the clone fails part way, it is freed by releasing its arena,
+    //  which never follows these pointers
+    const IPV4_TRIE_NODE *srcChildren = node->children;
+    const IPV4_TRIE_LEAF *srcLeaves = node->leaves;
+
+    node->children = NULL;
+    node->leaves = NULL;
+
+    if (numOfLeaves) {
+        node->leaves = (IPV4_TRIE_LEAF *)AtfArenaAlloc(&ctx->arena, numOfLeaves * sizeof(IPV4_TRIE_LEAF));
+        if (!node->leaves) {
+            return ATF_NO_MEMORY_AVAILABLE;
         }
 
-        // Just to be "safe", as the ipEndMarker pointer is invalid
-        if (currTrieNode[octet] != ipEndMarker) {
-            currTrieNode = currTrieNode[octet];
-        }            
+        RtlCopyMemory(node->leaves, srcLeaves, numOfLeaves * sizeof(IPV4_TRIE_LEAF));
     }
 
-    // All nodes
-    return TRUE;
-}
+    if (numOfChildren) {
+        node->children = (IPV4_TRIE_NODE *)AtfArenaAlloc(&ctx->arena, numOfChildren * IPV4_TRIE_NODE_SIZE);
+        if (!node->children) {
+            return ATF_NO_MEMORY_AVAILABLE;
+        }
 
-// Free prototype
-static VOID AtfIpv4TrieFreeRecursive(VOID **root);
+        RtlCopyMemory(node->children, srcChildren, numOfChildren * IPV4_TRIE_NODE_SIZE);
 
-VOID AtfIpv4TrieFree(IPV4_TRIE_CTX **ctx)
+        // Depth is bounded by IPV4_TRIE_MAX_DEPTH
+        for (UINT32 i = 0; i < numOfChildren; i++) {
+            ATF_ERROR atfError = AtfIpv4TrieCloneNode(ctx, &node->children[i]);
+            if (atfError) {
+                return atfError;
+            }
+        }
+    }
+
+    return ATF_ERROR_OK;
+}
+
+UINT8 AtfIpv4TrieSearch(const IPV4_TRIE_CTX *ctx, struct in_addr ip)
 {
-    if (*ctx) {
-        return;
+    if (!ctx || !ctx->totalNumOfPrefixes) {
+        return 0;
     }
 
-    IPV4_TRIE_CTX *c = *ctx;
+    const IPV4_TRIE_NODE *currTrieNode = &ctx->root;
+    IPV4_TRIE_LEAF longestMatch = 0;
+
+    for (UINT8 level = 0; level < IPV4_TRIE_MAX_DEPTH; level++) {
+        const IPV4_OCTET octet = IPV4_TRIE_OCTET(ip.S_un.S_addr, level);
+
+        // Leaves on a deeper level always belong to longer prefixes
+        if (AtfIpv4TrieBitTest(currTrieNode->leafBitmap, octet)) {
+            longestMatch = currTrieNode->leaves[AtfIpv4TrieRank(currTrieNode->leafBitmap, octet)];
+        }
+
+        if (!AtfIpv4TrieBitTest(currTrieNode->childBitmap, octet)) {
+            break;
+        }
 
-    if (c->root) {
-        AtfIpv4TrieFreeRecursive(c->root);
-        ATF_FREE(c->root);
+        currTrieNode = &currTrieNode->children[AtfIpv4TrieRank(currTrieNode->childBitmap, octet)];
     }
-    
-    RtlZeroMemory(c, sizeof(IPV4_TRIE_CTX));
-    ATF_FREE(c);
-    *ctx = NULL;
+
+    return longestMatch;
 }
 
-static VOID AtfIpv4TrieFreeRecursive(VOID **root)
+VOID AtfIpv4TrieSearchBatch(
+    const IPV4_TRIE_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+)
 {
-    if (!root) {
+    if (!ips || !resultsOut) {
+        return;
+    }
+
+    if (!ctx || !ctx->totalNumOfPrefixes) {
+        RtlZeroMemory(resultsOut, numOfIps * sizeof(UINT8));
         return;
     }
 
-    for (UINT8 i = 0; i < _UI8_MAX; i++) {
-        if (root[i] == ipEndMarker) {
-            // We've reached the last octet node, so return early
-            return;
-        } else if (root[i] != NULL) {
-            AtfIpv4TrieFreeRecursive(root[i]);
-            ATF_FREE(root[i]);
-            root[i] = NULL;
+    const IPV4_TRIE_NODE *currNodes[IPV4_TRIE_BATCH_WINDOW];
+
+    for (size_t base = 0; base < numOfIps; base += IPV4_TRIE_BATCH_WINDOW) {
+        const size_t windowSize =
+            (numOfIps - base) < IPV4_TRIE_BATCH_WINDOW ? (numOfIps - base) : IPV4_TRIE_BATCH_WINDOW;
+
+        for (size_t i = 0; i < windowSize; i++) {
+            currNodes[i] = &ctx->root;
+            resultsOut[base + i] = 0;
+        }
+
+        // Same walk as AtfIpv4TrieSearch, a key that runs out of children drops out of the window
+        size_t numOfActive = windowSize;
+        for (UINT8 level = 0; level < IPV4_TRIE_MAX_DEPTH && numOfActive; level++) {
+            for (size_t i = 0; i < windowSize; i++) {
+                const IPV4_TRIE_NODE *currTrieNode = currNodes[i];
+                if (!currTrieNode) {
+                    continue;
+                }
+
+                const IPV4_OCTET octet = IPV4_TRIE_OCTET(ips[base + i].S_un.S_addr, level);
+
+                if (AtfIpv4TrieBitTest(currTrieNode->leafBitmap, octet)) {
+                    resultsOut[base + i] = currTrieNode->leaves[AtfIpv4TrieRank(currTrieNode->leafBitmap, octet)];
+                }
+
+                if (!AtfIpv4TrieBitTest(currTrieNode->childBitmap, octet)) {
+                    currNodes[i] = NULL;
+                    numOfActive--;
+                    continue;
+                }
+
+                currNodes[i] = &currTrieNode->children[AtfIpv4TrieRank(currTrieNode->childBitmap, octet)];
+                AtfIpv4TriePrefetchNode(currNodes[i], sizeof(IPV4_TRIE_NODE));
+            }
         }
     }
 }
 
+VOID AtfIpv4TrieFree(IPV4_TRIE_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    IPV4_TRIE_CTX *c = *ctx;
+
+    // Every node below the root lives in the arena, so the trie does not need to be walked
+    AtfArenaRelease(&c->arena);
+
+    RtlZeroMemory(c, sizeof(IPV4_TRIE_CTX));
+    ATF_FREE(c);
+    *ctx = NULL;
+}
+
 VOID AtfIpv4TriePrintCtx(const IPV4_TRIE_CTX *ctx)
 {
     if (!ctx) {
         return;
     }
 
-    const size_t numOfNodes = ctx->totalTrieSize / IPV4_TRIE_NODE_SIZE;
-
-    ATF_DEBUGA("[atftrace] IPv4 Trie Stats: Num of nodes: %d, Total Trie size: %d, Num of IPs: %d",
-        numOfNodes, ctx->totalTrieSize, ctx->totalNumOfIps);
-}
\ No newline at end of file
+    ATF_DEBUGA("[atftrace] IPv4 Trie Stats: Num of nodes: %llu, Total Trie size: %llu, Num of prefixes: %llu",
+        (UINT64)ctx->totalNumOfNodes, (UINT64)ctx->totalTrieSize, (UINT64)ctx->totalNumOfPrefixes);
+    ATF_DEBUGA("[atftrace] IPv4 Trie Arena: Num of chunks: %llu, Reserved: %llu, Allocated: %llu",
+        (UINT64)ctx->arena.numOfChunks, (UINT64)ctx->arena.reservedSize, (UINT64)ctx->arena.allocatedSize);
+}
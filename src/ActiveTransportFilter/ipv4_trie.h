@@ -6,25 +6,123 @@
 #include <limits.h>
 
 #include "../common/errors.h"
+#include "../common/user_driver_transport.h"
 
 #include "mem.h"
 
-#define IPV4_TRIE_NODE_SIZE ((_UI8_MAX + 1) * sizeof(VOID *))
+//
+// Bitmap-compressed multibit trie (Poptrie-style) for IPv4 addresses
+//
+//  Each ipv4 octet is still one level of the trie (stride of 8 bits), so a lookup is bounded to 4 steps.
+//   However, a node no longer holds an array of 256 pointers. Instead, each node holds two 256-bit bitmaps:
+//
+//   childBitmap: bit n is set if a child node exists for octet n. All children of a node are stored
+//                 contiguously, and the index of a child is the number of set bits below n (popcount)
+//   leafBitmap:  bit n is set if octet n terminates a blocklist entry. The packed leaf vector stores one
+//                 IPV4_TRIE_LEAF per set bit, indexed the same way as the children
+//
+//  A node is 80 bytes, rather than 2048 bytes, and an empty slot costs a single bit.
+//
+//  The children arrays and leaf vectors are allocated from an arena owned by the context (see mem.h), sized to
+//   their power-of-two size class, so most inserts grow an array in place. Freeing the trie releases the arena
+//   chunks, rather than walking the nodes.
+//
+//  Prefixes (CIDR entries) are stored using controlled prefix expansion. A prefix of length p is stored at
+//   level (p - 1) / 8, as leaves for every octet it covers at that level (a /20 sets 16 leaves, a /8 sets
+//   a single leaf on the root). A leaf keeps the longest prefix that covers it, and a lookup walks down
+//   until it runs out of children, returning the last leaf seen (longest-prefix-match).
+//
+#define IPV4_TRIE_STRIDE                8
+#define IPV4_TRIE_FANOUT                (_UI8_MAX + 1)
+#define IPV4_TRIE_BITMAP_WORDS          (IPV4_TRIE_FANOUT / (sizeof(UINT64) * CHAR_BIT))
+#define IPV4_TRIE_MAX_DEPTH             sizeof(struct in_addr)
+#define IPV4_TRIE_NODE_SIZE             sizeof(IPV4_TRIE_NODE)
 
 //
-// Sorted "patricia trie" for IPv4 addresses
-// 
-//  First variant: each ipv4 octet will be represented by an array of pointers, the complexity time 
-//   will be O(m) for each octet. 
-// 
+// Returns the octet for a given trie level, the first octet of the address is the root level
+//  Addresses are stored in the same byte order WFP supplies them (see shared::ParseStringToIpv4)
 //
+#define IPV4_TRIE_OCTET(addr, level) \
+    ((IPV4_OCTET)(((addr) >> ((IPV4_TRIE_MAX_DEPTH - 1 - (level)) * IPV4_TRIE_STRIDE)) & _UI8_MAX))
 
 typedef UINT8 IPV4_OCTET;
 
 //
-// The last octet pointer array is marked with this value, indicating that the IP is indeed in the trie
+// Value stored in the packed leaf vector: the prefix length of the longest entry covering the leaf
 //
-static VOID *ipEndMarker = (VOID *)-1;
+typedef UINT8 IPV4_TRIE_LEAF;
+
+//
+// Bitmap helpers, shared with the relocatable image (ipv4_image.c)
+//
+//
+// Population count, does not depend on the POPCNT instruction being available
+//
+static __forceinline UINT32 AtfIpv4TriePopcount(UINT64 v)
+{
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (UINT32)((v * 0x0101010101010101ULL) >> 56);
+}
+
+static __forceinline BOOLEAN AtfIpv4TrieBitTest(const UINT64 *bitmap, IPV4_OCTET octet)
+{
+    return (bitmap[octet >> 6] >> (octet & 63)) & 1;
+}
+
+//
+// Number of set bits below the octet, i.e. the index into the children or leaf array
+//
+static __forceinline UINT32 AtfIpv4TrieRank(const UINT64 *bitmap, IPV4_OCTET octet)
+{
+    const UINT32 word = octet >> 6;
+
+    UINT32 rank = AtfIpv4TriePopcount(bitmap[word] & ((1ULL << (octet & 63)) - 1));
+    for (UINT32 i = 0; i < word; i++) {
+        rank += AtfIpv4TriePopcount(bitmap[i]);
+    }
+
+    return rank;
+}
+
+static __forceinline UINT32 AtfIpv4TrieBitmapCount(const UINT64 *bitmap)
+{
+    UINT32 count = 0;
+    for (UINT32 i = 0; i < IPV4_TRIE_BITMAP_WORDS; i++) {
+        count += AtfIpv4TriePopcount(bitmap[i]);
+    }
+
+    return count;
+}
+
+//
+// Prefetch a node (bitmaps and links span two cache lines)
+//
+static __forceinline VOID AtfIpv4TriePrefetchNode(const VOID *node, size_t nodeSize)
+{
+    PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, node);
+    PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, (const UINT8 *)node + nodeSize - 1);
+}
+
+//
+// Maximum number of keys walked in lockstep by the batch searches
+//
+#define IPV4_TRIE_BATCH_WINDOW          16
+
+//
+// Trie node
+//
+typedef struct _ipv4_trie_node {
+    UINT64                          childBitmap[IPV4_TRIE_BITMAP_WORDS];
+    UINT64                          leafBitmap[IPV4_TRIE_BITMAP_WORDS];
+
+    // Contiguous array of child nodes, popcount(childBitmap) in size
+    struct _ipv4_trie_node          *children;
+
+    // Packed leaf vector, popcount(leafBitmap) in size
+    IPV4_TRIE_LEAF                  *leaves;
+} IPV4_TRIE_NODE, *PIPV4_TRIE_NODE;
 
 //
 // Trie instance context
@@ -33,12 +131,17 @@ typedef struct _ipv4_trie_ctx {
     // Total physical size of the trie, in bytes
     size_t          totalTrieSize;
 
+    // Total number of nodes, including the root
+    size_t          totalNumOfNodes;
+
+    // Total number of stored prefixes (duplicates, and prefixes hidden by longer ones, are not counted)
+    size_t          totalNumOfPrefixes;
 
-    // Total number of stored IP addresses
-    size_t          totalNumOfIps;
+    // Backing memory of all children arrays and leaf vectors
+    ATF_ARENA       arena;
 
     // root
-    VOID            *root;
+    IPV4_TRIE_NODE  root;
 } IPV4_TRIE_CTX, *PIPV4_TRIE_CTX;
 
 //
@@ -47,15 +150,40 @@ typedef struct _ipv4_trie_ctx {
 ATF_ERROR AtfIpv4TrieAllocCtx(IPV4_TRIE_CTX **ctxOut);
 
 //
-// Insert ipv4 pool into trie
-//  root is the first array uint8_t, which points to the second array
+// Insert a pool of ipv4 prefixes into the trie
 //
-ATF_ERROR AtfIpv4TrieInsertPool(IPV4_TRIE_CTX *ctx, const struct in_addr *pool, size_t numOfIps);
+ATF_ERROR AtfIpv4TrieInsertPool(IPV4_TRIE_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
 
 //
-// Search the tree for a single input IP
+// Remove a pool of ipv4 prefixes from the trie
+//  The leaves a prefix set are cleared, unless they were taken over by a longer prefix. Children arrays and leaf
+//  vectors shrink back to their size class, and nodes left empty are unlinked and returned to the arena
 //
-BOOLEAN AtfIpv4TrieSearch(IPV4_TRIE_CTX *ctx, struct in_addr ip);
+ATF_ERROR AtfIpv4TrieRemovePool(IPV4_TRIE_CTX *ctx, const IPV4_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Search the trie for a single input IP
+//  Returns the prefix length of the longest matching entry, or 0 if the IP is not covered
+//
+UINT8 AtfIpv4TrieSearch(const IPV4_TRIE_CTX *ctx, struct in_addr ip);
+
+//
+// Search the trie for numOfIps addresses, resultsOut receives the same values as AtfIpv4TrieSearch.
+//  Up to IPV4_TRIE_BATCH_WINDOW keys are walked in lockstep, one level at a time. The next node of every key
+//  is prefetched before any of them is read, so the cache misses of the keys overlap rather than being a
+//  chain of dependent loads per key
+//
+VOID AtfIpv4TrieSearchBatch(
+    const IPV4_TRIE_CTX *ctx,
+    const struct in_addr *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+);
+
+//
+// Create a deep copy of the trie, in a new arena sized to fit
+//
+ATF_ERROR AtfIpv4TrieClone(const IPV4_TRIE_CTX *src, IPV4_TRIE_CTX **ctxOut);
 
 //
 // Print trie context info
@@ -64,7 +192,7 @@ VOID AtfIpv4TriePrintCtx(const IPV4_TRIE_CTX *ctx);
 
 //
 // Free the entire trie and context
-// 
+//
 VOID AtfIpv4TrieFree(IPV4_TRIE_CTX **ctx);
 
 //EOF
\ No newline at end of file
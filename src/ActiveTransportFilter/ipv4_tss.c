@@ -0,0 +1,630 @@
+#include <ntddk.h>
+
+#include "ipv4_tss.h"
+
+#include "mem.h"
+#include "trace.h"
+
+C_ASSERT(sizeof(IPV4_TSS_SLOT) == 16);
+
+// Slot array alignment, a slot never spans two cache lines
+#define IPV4_TSS_ALIGNMENT              64
+
+// Size of the (prefix lengths -> tuple) index of a partition while building, twice IPV4_TSS_MAX_TUPLES
+#define IPV4_TSS_INDEX_SHIFT            9
+#define IPV4_TSS_INDEX_SIZE             (1 << IPV4_TSS_INDEX_SHIFT)
+
+//
+// Aligned block of ports, port & mask == the prefix
+//
+typedef struct _ipv4_tss_port_prefix {
+    SERVICE_PORT                    port;
+    UINT8                           prefixLength;
+} IPV4_TSS_PORT_PREFIX, *PIPV4_TSS_PORT_PREFIX;
+
+//
+// Scratch state of a build
+//
+typedef struct _ipv4_tss_build {
+    IPV4_TSS_TUPLE                  tuples[IPV4_TSS_NUM_OF_PARTITIONS][IPV4_TSS_MAX_TUPLES];
+    UINT32                          numOfTuples[IPV4_TSS_NUM_OF_PARTITIONS];
+
+    // Tuple index + 1 by prefix lengths, 0 for an empty slot
+    UINT16                          index[IPV4_TSS_NUM_OF_PARTITIONS][IPV4_TSS_INDEX_SIZE];
+
+    // Port prefixes of the rule being expanded
+    IPV4_TSS_PORT_PREFIX            localPorts[IPV4_TSS_MAX_PORT_PREFIXES];
+    IPV4_TSS_PORT_PREFIX            remotePorts[IPV4_TSS_MAX_PORT_PREFIXES];
+    UINT32                          numOfLocalPorts;
+    UINT32                          numOfRemotePorts;
+} IPV4_TSS_BUILD, *PIPV4_TSS_BUILD;
+
+//
+// Returns TRUE if the fields of a rule are in range
+//
+static BOOLEAN AtfIpv4TssIsValidRule(const IPV4_RULE_ENTRY *rule);
+
+//
+// Split an inclusive port range into the fewest port prefixes, returns the number of prefixes
+//
+static UINT32 AtfIpv4TssSplitPortRange(SERVICE_PORT low, SERVICE_PORT high, IPV4_TSS_PORT_PREFIX *prefixesOut);
+
+//
+// Returns a bitmap of the partitions a rule is stored in
+//
+static UINT32 AtfIpv4TssGetPartitions(const IPV4_RULE_ENTRY *rule);
+
+//
+// Returns the tuple of a combination of prefix lengths in a partition of the build, adding it if it does not exist
+//  Returns NULL if the partition already has IPV4_TSS_MAX_TUPLES tuples
+//
+static IPV4_TSS_TUPLE *AtfIpv4TssFindOrAddTuple(
+    IPV4_TSS_BUILD *build,
+    UINT32 partition,
+    UINT8 localPrefixLength,
+    UINT8 remotePrefixLength,
+    UINT8 localPortPrefixLength,
+    UINT8 remotePortPrefixLength
+);
+
+//
+// First slot of a combination of prefix lengths in the tuple index of a partition
+//
+static __forceinline UINT32 AtfIpv4TssIndexHash(
+    UINT8 localPrefixLength,
+    UINT8 remotePrefixLength,
+    UINT8 localPortPrefixLength,
+    UINT8 remotePortPrefixLength
+);
+
+//
+// Sort the tuples of each partition of the build by minRank, lay out their tables and rebuild the tuple index
+//  Returns the total number of slots
+//
+static size_t AtfIpv4TssLayoutTuples(IPV4_TSS_BUILD *build);
+
+//
+// Store the keys of a rule in the tables of every tuple it expands to
+//
+static VOID AtfIpv4TssInsertRule(IPV4_TSS_CTX *ctx, IPV4_TSS_BUILD *build, const IPV4_RULE_ENTRY *rule, UINT32 rank);
+
+//
+// Index of the first slot probed for a (masked) key, within the table of its tuple
+//
+static __forceinline size_t AtfIpv4TssHash(UINT64 seed, const IPV4_TSS_TUPLE *tuple, const IPV4_TSS_KEY *key);
+
+//
+// Mask a flow or rule key with the mask of a tuple
+//
+static __forceinline VOID AtfIpv4TssMaskKey(const IPV4_TSS_KEY *key, const IPV4_TSS_KEY *mask, IPV4_TSS_KEY *keyOut);
+
+static __forceinline BOOLEAN AtfIpv4TssIsEqualKey(const IPV4_TSS_KEY *a, const IPV4_TSS_KEY *b);
+
+ATF_ERROR AtfIpv4TssBuild(const IPV4_RULE_ENTRY *rules, size_t numOfRules, IPV4_TSS_CTX **ctxOut)
+{
+    if (!rules || !ctxOut || !numOfRules || numOfRules > IPV4_RULES_MAX_ENTRIES) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    for (size_t i = 0; i < numOfRules; i++) {
+        if (!AtfIpv4TssIsValidRule(&rules[i])) {
+            return ATF_BAD_PARAMETERS;
+        }
+    }
+
+    IPV4_TSS_BUILD *build = (IPV4_TSS_BUILD *)ATF_MALLOC(sizeof(IPV4_TSS_BUILD));
+    if (!build) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    //
+    // First pass, find the tuples of every rule and count their keys. Rules are visited by rank, so the first
+    //  rule to reach a tuple has its lowest rank
+    //
+    size_t numOfKeys = 0;
+    for (size_t i = 0; i < numOfRules; i++) {
+        const IPV4_RULE_ENTRY *rule = &rules[i];
+        const UINT32 partitions = AtfIpv4TssGetPartitions(rule);
+
+        build->numOfLocalPorts = AtfIpv4TssSplitPortRange(rule->localPortLow, rule->localPortHigh, build->localPorts);
+        build->numOfRemotePorts = AtfIpv4TssSplitPortRange(rule->remotePortLow, rule->remotePortHigh, build->remotePorts);
+
+        for (UINT32 p = 0; p < IPV4_TSS_NUM_OF_PARTITIONS; p++) {
+            if (!(partitions & (1 << p))) {
+                continue;
+            }
+
+            for (UINT32 l = 0; l < build->numOfLocalPorts; l++) {
+                for (UINT32 r = 0; r < build->numOfRemotePorts; r++) {
+                    IPV4_TSS_TUPLE *tuple = AtfIpv4TssFindOrAddTuple(
+                        build,
+                        p,
+                        rule->localPrefixLength,
+                        rule->remotePrefixLength,
+                        build->localPorts[l].prefixLength,
+                        build->remotePorts[r].prefixLength
+                    );
+                    if (!tuple) {
+                        ATF_DEBUGA("[atftrace] IPv4 rule %u needs more than %u tuples", rule->ruleId, IPV4_TSS_MAX_TUPLES);
+                        ATF_FREE(build);
+                        return ATF_BAD_PARAMETERS;
+                    }
+
+                    if (tuple->minRank == IPV4_TSS_EMPTY_RANK) {
+                        tuple->minRank = (UINT32)i;
+                    }
+
+                    tuple->numOfKeys++;
+                    numOfKeys++;
+                }
+            }
+        }
+
+        if (numOfKeys > IPV4_TSS_MAX_KEYS) {
+            ATF_DEBUGA("[atftrace] IPv4 rules expand to more than %u keys", IPV4_TSS_MAX_KEYS);
+            ATF_FREE(build);
+            return ATF_BAD_PARAMETERS;
+        }
+    }
+
+    const size_t numOfSlots = AtfIpv4TssLayoutTuples(build);
+
+    size_t numOfTuples = 0;
+    for (UINT32 p = 0; p < IPV4_TSS_NUM_OF_PARTITIONS; p++) {
+        numOfTuples += build->numOfTuples[p];
+    }
+
+    //
+    // The context, tuples and rules, then the slot array aligned to IPV4_TSS_ALIGNMENT, in a single allocation.
+    //  Sizes are bounded by IPV4_TSS_MAX_KEYS and IPV4_RULES_MAX_ENTRIES, so they cannot overflow
+    //
+    const size_t headerSize = sizeof(IPV4_TSS_CTX) + numOfTuples * sizeof(IPV4_TSS_TUPLE) + numOfRules * sizeof(IPV4_TSS_RULE);
+    const size_t totalSize = headerSize + IPV4_TSS_ALIGNMENT + numOfSlots * sizeof(IPV4_TSS_SLOT);
+
+    UINT8 *allocation = (UINT8 *)ATF_MALLOC(totalSize);
+    if (!allocation) {
+        ATF_FREE(build);
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    IPV4_TSS_CTX *ctx = (IPV4_TSS_CTX *)allocation;
+    IPV4_TSS_TUPLE *tuples = (IPV4_TSS_TUPLE *)(allocation + sizeof(IPV4_TSS_CTX));
+    IPV4_TSS_RULE *ctxRules = (IPV4_TSS_RULE *)&tuples[numOfTuples];
+
+    ctx->refCount = 1;
+    ctx->totalSize = totalSize;
+    ctx->numOfRules = numOfRules;
+    ctx->rules = ctxRules;
+    ctx->numOfSlots = numOfSlots;
+    ctx->slots = (IPV4_TSS_SLOT *)(((ULONG_PTR)allocation + headerSize + IPV4_TSS_ALIGNMENT - 1) & ~((ULONG_PTR)IPV4_TSS_ALIGNMENT - 1));
+
+    // The seed only needs to differ between builds, so that a crafted rule set cannot target one probe sequence
+    LARGE_INTEGER counter = KeQueryPerformanceCounter(NULL);
+    ctx->seed = (UINT64)counter.QuadPart;
+
+    for (UINT32 p = 0; p < IPV4_TSS_NUM_OF_PARTITIONS; p++) {
+        ctx->partitions[p].numOfTuples = build->numOfTuples[p];
+        ctx->partitions[p].tuples = tuples;
+
+        RtlCopyMemory(tuples, build->tuples[p], build->numOfTuples[p] * sizeof(IPV4_TSS_TUPLE));
+        tuples += build->numOfTuples[p];
+    }
+
+    for (size_t i = 0; i < numOfRules; i++) {
+        ctxRules[i].ruleId = rules[i].ruleId;
+        ctxRules[i].action = rules[i].action;
+    }
+
+    // Every rank is IPV4_TSS_EMPTY_RANK
+    RtlFillMemory(ctx->slots, numOfSlots * sizeof(IPV4_TSS_SLOT), 0xff);
+
+    // Second pass, store the keys by rank, so a key stored by several rules keeps the lowest rank
+    for (size_t i = 0; i < numOfRules; i++) {
+        AtfIpv4TssInsertRule(ctx, build, &rules[i], (UINT32)i);
+    }
+
+    for (UINT32 p = 0; p < IPV4_TSS_NUM_OF_PARTITIONS; p++) {
+        IPV4_TSS_PARTITION *partition = &ctx->partitions[p];
+
+        for (UINT32 t = 0; t < partition->numOfTuples; t++) {
+            partition->maxSteps += partition->tuples[t].maxProbes;
+            ctx->numOfKeys += partition->tuples[t].numOfKeys;
+        }
+    }
+
+    ATF_FREE(build);
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+IPV4_TSS_CTX *AtfIpv4TssReference(IPV4_TSS_CTX *ctx)
+{
+    if (ctx) {
+        ctx->refCount++;
+    }
+
+    return ctx;
+}
+
+BOOLEAN AtfIpv4TssClassify(const IPV4_TSS_CTX *ctx, const IPV4_TSS_FLOW *flow, IPV4_TSS_RULE *ruleOut)
+{
+    if (!ctx) {
+        return FALSE;
+    }
+
+    if (flow->protocol != RULE_PROTOCOL_TCP && flow->protocol != RULE_PROTOCOL_UDP) {
+        return FALSE;
+    }
+
+    const UINT32 partitionIndex =
+        (flow->direction == RULE_DIRECTION_OUTBOUND ? 2 : 0) + (flow->protocol == RULE_PROTOCOL_UDP ? 1 : 0);
+    const IPV4_TSS_PARTITION *partition = &ctx->partitions[partitionIndex];
+
+    const IPV4_TSS_KEY flowKey = { flow->localAddress, flow->remoteAddress, flow->localPort, flow->remotePort };
+
+    UINT32 bestRank = IPV4_TSS_EMPTY_RANK;
+
+    for (UINT32 t = 0; t < partition->numOfTuples; t++) {
+        const IPV4_TSS_TUPLE *tuple = &partition->tuples[t];
+
+        // The remaining tuples only hold rules of a higher rank than the match
+        if (tuple->minRank >= bestRank) {
+            break;
+        }
+
+        IPV4_TSS_KEY key;
+        AtfIpv4TssMaskKey(&flowKey, &tuple->mask, &key);
+
+        const IPV4_TSS_SLOT *slots = &ctx->slots[tuple->firstSlot];
+        size_t index = AtfIpv4TssHash(ctx->seed, tuple, &key);
+
+        for (UINT32 probe = 0; probe < tuple->maxProbes; probe++) {
+            const IPV4_TSS_SLOT *slot = &slots[index];
+            if (slot->rank == IPV4_TSS_EMPTY_RANK) {
+                break;
+            }
+
+            if (AtfIpv4TssIsEqualKey(&slot->key, &key)) {
+                if (slot->rank < bestRank) {
+                    bestRank = slot->rank;
+                }
+                break;
+            }
+
+            index = (index + 1 == tuple->numOfSlots) ? 0 : index + 1;
+        }
+    }
+
+    if (bestRank == IPV4_TSS_EMPTY_RANK) {
+        return FALSE;
+    }
+
+    *ruleOut = ctx->rules[bestRank];
+
+    return TRUE;
+}
+
+VOID AtfIpv4TssPrintCtx(const IPV4_TSS_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] IPv4 TSS Stats: Num of rules: %llu, Num of keys: %llu, Num of slots: %llu, Total size: %llu",
+        (UINT64)ctx->numOfRules, (UINT64)ctx->numOfKeys, (UINT64)ctx->numOfSlots, (UINT64)ctx->totalSize);
+
+    static const CHAR *partitionNames[IPV4_TSS_NUM_OF_PARTITIONS] =
+    {
+        "inbound TCP",
+        "inbound UDP",
+        "outbound TCP",
+        "outbound UDP"
+    };
+
+    for (UINT32 p = 0; p < IPV4_TSS_NUM_OF_PARTITIONS; p++) {
+        ATF_DEBUGA("[atftrace] IPv4 TSS %s: Num of tuples: %u, Max steps: %u",
+            partitionNames[p], ctx->partitions[p].numOfTuples, ctx->partitions[p].maxSteps);
+    }
+}
+
+VOID AtfIpv4TssFree(IPV4_TSS_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    IPV4_TSS_CTX *c = *ctx;
+    *ctx = NULL;
+
+    if (--c->refCount) {
+        return;
+    }
+
+    ATF_FREE(c);
+}
+
+static BOOLEAN AtfIpv4TssIsValidRule(const IPV4_RULE_ENTRY *rule)
+{
+    if (rule->localPrefixLength > IPV4_PREFIX_MAX_LENGTH || rule->remotePrefixLength > IPV4_PREFIX_MAX_LENGTH) {
+        return FALSE;
+    }
+
+    if (rule->localPortLow > rule->localPortHigh || rule->remotePortLow > rule->remotePortHigh) {
+        return FALSE;
+    }
+
+    if (rule->protocol != RULE_PROTOCOL_ANY && rule->protocol != RULE_PROTOCOL_TCP && rule->protocol != RULE_PROTOCOL_UDP) {
+        return FALSE;
+    }
+
+    if (rule->direction > RULE_DIRECTION_OUTBOUND || rule->action > ACTION_ALERT) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static UINT32 AtfIpv4TssSplitPortRange(SERVICE_PORT low, SERVICE_PORT high, IPV4_TSS_PORT_PREFIX *prefixesOut)
+{
+    UINT32 numOfPrefixes = 0;
+
+    // 32 bits, so that the end of the last block (65536) does not wrap
+    UINT32 port = low;
+    while (port <= high) {
+        // Largest aligned block starting at port that does not go past high
+        UINT8 prefixLength = 16;
+        while (prefixLength > 0) {
+            const UINT32 blockSize = 1UL << (16 - prefixLength + 1);
+            if ((port & (blockSize - 1)) || port + blockSize - 1 > high) {
+                break;
+            }
+            prefixLength--;
+        }
+
+        prefixesOut[numOfPrefixes].port = (SERVICE_PORT)port;
+        prefixesOut[numOfPrefixes].prefixLength = prefixLength;
+        numOfPrefixes++;
+
+        port += 1UL << (16 - prefixLength);
+    }
+
+    return numOfPrefixes;
+}
+
+static UINT32 AtfIpv4TssGetPartitions(const IPV4_RULE_ENTRY *rule)
+{
+    // Bit 0 and 1 are inbound TCP and UDP, bit 2 and 3 outbound
+    UINT32 protocols = 0x3;
+    if (rule->protocol == RULE_PROTOCOL_TCP) {
+        protocols = 0x1;
+    } else if (rule->protocol == RULE_PROTOCOL_UDP) {
+        protocols = 0x2;
+    }
+
+    UINT32 partitions = 0;
+    if (rule->direction != RULE_DIRECTION_OUTBOUND) {
+        partitions |= protocols;
+    }
+    if (rule->direction != RULE_DIRECTION_INBOUND) {
+        partitions |= protocols << 2;
+    }
+
+    return partitions;
+}
+
+static IPV4_TSS_TUPLE *AtfIpv4TssFindOrAddTuple(
+    IPV4_TSS_BUILD *build,
+    UINT32 partition,
+    UINT8 localPrefixLength,
+    UINT8 remotePrefixLength,
+    UINT8 localPortPrefixLength,
+    UINT8 remotePortPrefixLength
+)
+{
+    UINT16 *index = build->index[partition];
+    UINT32 i = AtfIpv4TssIndexHash(localPrefixLength, remotePrefixLength, localPortPrefixLength, remotePortPrefixLength);
+
+    // The index is twice the maximum number of tuples, so there is always an empty slot
+    while (index[i]) {
+        IPV4_TSS_TUPLE *tuple = &build->tuples[partition][index[i] - 1];
+        if (tuple->localPrefixLength == localPrefixLength && tuple->remotePrefixLength == remotePrefixLength &&
+            tuple->localPortPrefixLength == localPortPrefixLength && tuple->remotePortPrefixLength == remotePortPrefixLength)
+        {
+            return tuple;
+        }
+
+        i = (i + 1) & (IPV4_TSS_INDEX_SIZE - 1);
+    }
+
+    if (build->numOfTuples[partition] == IPV4_TSS_MAX_TUPLES) {
+        return NULL;
+    }
+
+    IPV4_TSS_TUPLE *tuple = &build->tuples[partition][build->numOfTuples[partition]++];
+    index[i] = (UINT16)build->numOfTuples[partition];
+
+    tuple->localPrefixLength = localPrefixLength;
+    tuple->remotePrefixLength = remotePrefixLength;
+    tuple->localPortPrefixLength = localPortPrefixLength;
+    tuple->remotePortPrefixLength = remotePortPrefixLength;
+    tuple->minRank = IPV4_TSS_EMPTY_RANK;
+
+    tuple->mask.localAddress = IPV4_PREFIX_MASK(localPrefixLength);
+    tuple->mask.remoteAddress = IPV4_PREFIX_MASK(remotePrefixLength);
+    tuple->mask.localPort = localPortPrefixLength ? (SERVICE_PORT)(0xffff << (16 - localPortPrefixLength)) : 0;
+    tuple->mask.remotePort = remotePortPrefixLength ? (SERVICE_PORT)(0xffff << (16 - remotePortPrefixLength)) : 0;
+
+    return tuple;
+}
+
+static size_t AtfIpv4TssLayoutTuples(IPV4_TSS_BUILD *build)
+{
+    size_t numOfSlots = 0;
+
+    for (UINT32 p = 0; p < IPV4_TSS_NUM_OF_PARTITIONS; p++) {
+        IPV4_TSS_TUPLE *tuples = build->tuples[p];
+        const UINT32 numOfTuples = build->numOfTuples[p];
+
+        // Insertion sort, there are at most IPV4_TSS_MAX_TUPLES
+        for (UINT32 i = 1; i < numOfTuples; i++) {
+            const IPV4_TSS_TUPLE tuple = tuples[i];
+
+            UINT32 j = i;
+            while (j > 0 && tuples[j - 1].minRank > tuple.minRank) {
+                tuples[j] = tuples[j - 1];
+                j--;
+            }
+
+            tuples[j] = tuple;
+        }
+
+        RtlZeroMemory(build->index[p], sizeof(build->index[p]));
+
+        for (UINT32 i = 0; i < numOfTuples; i++) {
+            IPV4_TSS_TUPLE *tuple = &tuples[i];
+
+            // The count includes duplicates, so the table may end up below IPV4_TSS_LOAD_PERCENT
+            tuple->firstSlot = numOfSlots;
+            tuple->numOfSlots = ((size_t)tuple->numOfKeys * 100) / IPV4_TSS_LOAD_PERCENT + 1;
+            if (tuple->numOfSlots < IPV4_TSS_MIN_SLOTS) {
+                tuple->numOfSlots = IPV4_TSS_MIN_SLOTS;
+            }
+
+            numOfSlots += tuple->numOfSlots;
+
+            // Counted again as the keys are stored
+            tuple->numOfKeys = 0;
+
+            UINT32 index = AtfIpv4TssIndexHash(
+                tuple->localPrefixLength,
+                tuple->remotePrefixLength,
+                tuple->localPortPrefixLength,
+                tuple->remotePortPrefixLength
+            );
+            while (build->index[p][index]) {
+                index = (index + 1) & (IPV4_TSS_INDEX_SIZE - 1);
+            }
+
+            build->index[p][index] = (UINT16)(i + 1);
+        }
+    }
+
+    return numOfSlots;
+}
+
+static __forceinline UINT32 AtfIpv4TssIndexHash(
+    UINT8 localPrefixLength,
+    UINT8 remotePrefixLength,
+    UINT8 localPortPrefixLength,
+    UINT8 remotePortPrefixLength
+)
+{
+    const UINT32 lengths =
+        ((UINT32)localPrefixLength << 24) | ((UINT32)remotePrefixLength << 16) |
+        ((UINT32)localPortPrefixLength << 8) | remotePortPrefixLength;
+
+    // Fibonacci hashing, the top bits of the 32-bit product
+    return (UINT32)(lengths * 0x9e3779b1U) >> (32 - IPV4_TSS_INDEX_SHIFT);
+}
+
+static VOID AtfIpv4TssInsertRule(IPV4_TSS_CTX *ctx, IPV4_TSS_BUILD *build, const IPV4_RULE_ENTRY *rule, UINT32 rank)
+{
+    const UINT32 partitions = AtfIpv4TssGetPartitions(rule);
+
+    build->numOfLocalPorts = AtfIpv4TssSplitPortRange(rule->localPortLow, rule->localPortHigh, build->localPorts);
+    build->numOfRemotePorts = AtfIpv4TssSplitPortRange(rule->remotePortLow, rule->remotePortHigh, build->remotePorts);
+
+    for (UINT32 p = 0; p < IPV4_TSS_NUM_OF_PARTITIONS; p++) {
+        if (!(partitions & (1 << p))) {
+            continue;
+        }
+
+        for (UINT32 l = 0; l < build->numOfLocalPorts; l++) {
+            for (UINT32 r = 0; r < build->numOfRemotePorts; r++) {
+                // Every tuple was added by the first pass, the build tuples are only used to find its index
+                const IPV4_TSS_TUPLE *buildTuple = AtfIpv4TssFindOrAddTuple(
+                    build,
+                    p,
+                    rule->localPrefixLength,
+                    rule->remotePrefixLength,
+                    build->localPorts[l].prefixLength,
+                    build->remotePorts[r].prefixLength
+                );
+
+                IPV4_TSS_TUPLE *tuple = &ctx->partitions[p].tuples[buildTuple - build->tuples[p]];
+
+                const IPV4_TSS_KEY ruleKey = {
+                    rule->localAddress.S_un.S_addr,
+                    rule->remoteAddress.S_un.S_addr,
+                    build->localPorts[l].port,
+                    build->remotePorts[r].port
+                };
+
+                IPV4_TSS_KEY key;
+                AtfIpv4TssMaskKey(&ruleKey, &tuple->mask, &key);
+
+                IPV4_TSS_SLOT *slots = &ctx->slots[tuple->firstSlot];
+                size_t index = AtfIpv4TssHash(ctx->seed, tuple, &key);
+
+                // The table is at most half full, so there is always an empty slot
+                for (UINT32 probe = 1;; probe++) {
+                    IPV4_TSS_SLOT *slot = &slots[index];
+
+                    if (slot->rank == IPV4_TSS_EMPTY_RANK) {
+                        slot->key = key;
+                        slot->rank = rank;
+                        tuple->numOfKeys++;
+
+                        if (probe > tuple->maxProbes) {
+                            tuple->maxProbes = probe;
+                        }
+                        break;
+                    }
+
+                    // Stored by a rule of a lower rank, which wins
+                    if (AtfIpv4TssIsEqualKey(&slot->key, &key)) {
+                        break;
+                    }
+
+                    index = (index + 1 == tuple->numOfSlots) ? 0 : index + 1;
+                }
+            }
+        }
+    }
+}
+
+static __forceinline size_t AtfIpv4TssHash(UINT64 seed, const IPV4_TSS_TUPLE *tuple, const IPV4_TSS_KEY *key)
+{
+    // 64-bit mix (murmur3 finalizer) of the addresses then the ports, the high half picks the slot by multiply-shift
+    UINT64 hash = (((UINT64)key->localAddress << 32) | key->remoteAddress) ^ seed;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    hash ^= ((UINT64)key->localPort << 16) | key->remotePort;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (size_t)(((hash >> 32) * tuple->numOfSlots) >> 32);
+}
+
+static __forceinline VOID AtfIpv4TssMaskKey(const IPV4_TSS_KEY *key, const IPV4_TSS_KEY *mask, IPV4_TSS_KEY *keyOut)
+{
+    keyOut->localAddress = key->localAddress & mask->localAddress;
+    keyOut->remoteAddress = key->remoteAddress & mask->remoteAddress;
+    keyOut->localPort = key->localPort & mask->localPort;
+    keyOut->remotePort = key->remotePort & mask->remotePort;
+}
+
+static __forceinline BOOLEAN AtfIpv4TssIsEqualKey(const IPV4_TSS_KEY *a, const IPV4_TSS_KEY *b)
+{
+    return a->localAddress == b->localAddress && a->remoteAddress == b->remoteAddress &&
+        a->localPort == b->localPort && a->remotePort == b->remotePort;
+}
+
+//EOF
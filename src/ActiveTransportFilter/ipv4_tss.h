@@ -0,0 +1,185 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include <inaddr.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "mem.h"
+
+//
+// Tuple space search (Srinivasan et al.) for the IPv4 5-tuple rules (IPV4_RULE_ENTRY)
+//
+//  A rule matches a local and remote prefix, a local and remote port range, a protocol and a direction. Rules with
+//   the same prefix lengths match the same bits of a flow, so they are kept in one exact-match hash table, a
+//   "tuple", keyed by the masked fields. A flow is classified by masking it with each tuple and probing its table.
+//
+//  - Port ranges are split into the fewest aligned power-of-two blocks covering them (at most 30 for 16 bits), i.e.
+//     port prefixes, so that a range is matched by a masked key too. 6660-6669 is 6660/14, 6664/14 and 6668/15,
+//     and a rule is stored once for each pair of its local and remote port prefixes
+//  - The protocol and direction of a flow are known before the search, so the tuples are partitioned by them
+//     instead of being masked, and only the tuples of the flow's partition are searched. A rule for any direction
+//     or protocol is stored in every partition it applies to
+//  - The rank of a rule is its position in the rule list, the lowest rank wins. A key stored by several rules
+//     keeps the lowest rank, and each tuple records the lowest rank it holds. The tuples of a partition are searched
+//     in order of that rank, and the search stops at the first tuple that cannot beat the best match so far
+//
+//  A flow that matches no rule (the common case) probes every tuple of its partition. The number of tuples is
+//   capped at IPV4_TSS_MAX_TUPLES, and the build records the longest probe sequence of each table, so the number
+//   of slots read per flow is bounded by the sum of those (maxSteps), whatever the number of rules. Rule sets mostly
+//   use a few prefix lengths, /32, /24 or any address and a single port or any port, so that is a few tuples.
+//
+//  The tables are built from the whole rule list and never modified afterwards. Configs cloned from each other
+//   share them, the reference count is only changed by the IOCTL handlers (serialized by gIoctlLock).
+//
+#define IPV4_TSS_MAX_TUPLES             256
+#define IPV4_TSS_MIN_SLOTS              8
+#define IPV4_TSS_LOAD_PERCENT           50
+
+// Maximum number of prefixes a port range is split into
+#define IPV4_TSS_MAX_PORT_PREFIXES      30
+
+// Maximum number of keys stored over all tuples and partitions, before duplicates are dropped
+#define IPV4_TSS_MAX_KEYS               (1024 * 1024)
+
+// Partitions, by direction (inbound, outbound) and protocol (TCP, UDP)
+#define IPV4_TSS_NUM_OF_PARTITIONS      4
+
+// Rank of an empty slot
+#define IPV4_TSS_EMPTY_RANK             0xffffffff
+
+//
+// Masked fields of a flow, host byte order
+//
+typedef struct _ipv4_tss_key {
+    UINT32                          localAddress;
+    UINT32                          remoteAddress;
+    SERVICE_PORT                    localPort;
+    SERVICE_PORT                    remotePort;
+} IPV4_TSS_KEY, *PIPV4_TSS_KEY;
+
+//
+// Hash table slot, 4 per cache line
+//
+typedef struct _ipv4_tss_slot {
+    IPV4_TSS_KEY                    key;
+
+    // Lowest rank of the rules storing the key, IPV4_TSS_EMPTY_RANK for an empty slot
+    UINT32                          rank;
+} IPV4_TSS_SLOT, *PIPV4_TSS_SLOT;
+
+//
+// A combination of prefix lengths and its hash table, a range of the slot array
+//
+typedef struct _ipv4_tss_tuple {
+    IPV4_TSS_KEY                    mask;
+
+    UINT8                           localPrefixLength;
+    UINT8                           remotePrefixLength;
+    UINT8                           localPortPrefixLength;
+    UINT8                           remotePortPrefixLength;
+
+    // Lowest rank stored in the table
+    UINT32                          minRank;
+
+    // Longest probe sequence of a stored key, a search reads at most this many slots
+    UINT32                          maxProbes;
+
+    // Keys stored
+    UINT32                          numOfKeys;
+
+    size_t                          firstSlot;
+    size_t                          numOfSlots;
+} IPV4_TSS_TUPLE, *PIPV4_TSS_TUPLE;
+
+//
+// Tuples of a direction and protocol, in ascending minRank
+//
+typedef struct _ipv4_tss_partition {
+    UINT32                          numOfTuples;
+
+    // Sum of the maxProbes of the tuples, the slots read by a search that matches no rule
+    UINT32                          maxSteps;
+
+    IPV4_TSS_TUPLE                  *tuples;
+} IPV4_TSS_PARTITION, *PIPV4_TSS_PARTITION;
+
+//
+// Action and id of a rule, by rank
+//
+typedef struct _ipv4_tss_rule {
+    UINT32                          ruleId;
+    UINT8                           action;
+} IPV4_TSS_RULE, *PIPV4_TSS_RULE;
+
+//
+// Flow to classify, host byte order
+//
+typedef struct _ipv4_tss_flow {
+    UINT32                          localAddress;
+    UINT32                          remoteAddress;
+    SERVICE_PORT                    localPort;
+    SERVICE_PORT                    remotePort;
+
+    // RULE_PROTOCOL_TCP or RULE_PROTOCOL_UDP, other protocols never match
+    UINT8                           protocol;
+
+    // RULE_DIRECTION_INBOUND or RULE_DIRECTION_OUTBOUND
+    UINT8                           direction;
+} IPV4_TSS_FLOW, *PIPV4_TSS_FLOW;
+
+//
+// Tuple space search instance context, the tuples, rules and slots follow the context in the same allocation
+//
+typedef struct _ipv4_tss_ctx {
+    // Number of configs referencing the context
+    size_t                          refCount;
+
+    // Size of the whole allocation, in bytes
+    size_t                          totalSize;
+
+    // Hash seed
+    UINT64                          seed;
+
+    size_t                          numOfRules;
+    const IPV4_TSS_RULE             *rules;
+
+    // Keys stored over all partitions, after the port ranges are expanded and duplicates dropped
+    size_t                          numOfKeys;
+
+    IPV4_TSS_PARTITION              partitions[IPV4_TSS_NUM_OF_PARTITIONS];
+
+    size_t                          numOfSlots;
+    IPV4_TSS_SLOT                   *slots;
+} IPV4_TSS_CTX, *PIPV4_TSS_CTX;
+
+//
+// Build the tables from a rule list in priority order
+//  Returns ATF_BAD_PARAMETERS if a rule is invalid, or the rules need more than IPV4_TSS_MAX_TUPLES tuples in a
+//  partition or IPV4_TSS_MAX_KEYS keys
+//
+ATF_ERROR AtfIpv4TssBuild(const IPV4_RULE_ENTRY *rules, size_t numOfRules, IPV4_TSS_CTX **ctxOut);
+
+//
+// Take another reference on the tables, for a cloned config
+//
+IPV4_TSS_CTX *AtfIpv4TssReference(IPV4_TSS_CTX *ctx);
+
+//
+// Classify a flow. Returns TRUE and the action and id of the first matching rule, or FALSE if no rule matches
+//
+BOOLEAN AtfIpv4TssClassify(const IPV4_TSS_CTX *ctx, const IPV4_TSS_FLOW *flow, IPV4_TSS_RULE *ruleOut);
+
+//
+// Print context info
+//
+VOID AtfIpv4TssPrintCtx(const IPV4_TSS_CTX *ctx);
+
+//
+// Release a reference, the tables are freed with the last one
+//
+VOID AtfIpv4TssFree(IPV4_TSS_CTX **ctx);
+
+//EOF
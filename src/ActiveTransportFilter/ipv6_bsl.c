@@ -0,0 +1,666 @@
+#include <ntddk.h>
+
+#include <limits.h>
+
+#include "ipv6_bsl.h"
+
+#include "mem.h"
+#include "trace.h"
+
+C_ASSERT(sizeof(IPV6_BSL_SLOT) == 32);
+
+//
+// Scratch state of a rebuild
+//
+typedef struct _ipv6_bsl_rebuild {
+    IPV6_BSL_LEVEL                  workLevels[IPV6_PREFIX_MAX_LENGTH];
+    IPV6_BSL_LEVEL                  levels[IPV6_PREFIX_MAX_LENGTH];
+
+    // Entries of each level, first the worst case, then the entries placed
+    size_t                          numOfEntries[IPV6_PREFIX_MAX_LENGTH];
+} IPV6_BSL_REBUILD, *PIPV6_BSL_REBUILD;
+
+//
+// Convert an address (network byte order) to a key
+//
+static __forceinline VOID AtfIpv6BslMakeKey(const IPV6_RAW_ADDRESS *ip, IPV6_BSL_KEY *keyOut);
+
+//
+// Mask a key to a prefix length
+//
+static __forceinline VOID AtfIpv6BslMaskKey(const IPV6_BSL_KEY *key, UINT8 prefixLength, IPV6_BSL_KEY *keyOut);
+
+//
+// Index of the first slot probed for a key, within the table of its level
+//
+static __forceinline size_t AtfIpv6BslHash(UINT64 seed, const IPV6_BSL_LEVEL *level, const IPV6_BSL_KEY *key);
+
+//
+// Linear probe a level from a slot index, returns NULL if the (masked) key is not in the table
+//
+static __forceinline const IPV6_BSL_SLOT *AtfIpv6BslProbe(
+    const IPV6_BSL_SLOT *slots,
+    const IPV6_BSL_LEVEL *level,
+    const IPV6_BSL_KEY *key,
+    size_t index
+);
+
+//
+// Returns the slot of a (masked) key in a level, taking a free slot if the key is not in the table
+//
+static IPV6_BSL_SLOT *AtfIpv6BslFindOrAdd(
+    IPV6_BSL_SLOT *slots,
+    UINT64 seed,
+    const IPV6_BSL_LEVEL *level,
+    const IPV6_BSL_KEY *key
+);
+
+//
+// Lay out the tables of the levels, each sized for numOfEntries at IPV6_BSL_LOAD_PERCENT occupancy, and allocate
+//  a zeroed slot array for all of them
+//
+static ATF_ERROR AtfIpv6BslAllocSlots(
+    IPV6_BSL_LEVEL *levels,
+    UINT32 numOfLevels,
+    const size_t *numOfEntries,
+    IPV6_BSL_SLOT **slotsOut,
+    VOID **allocationOut,
+    size_t *numOfSlotsOut
+);
+
+//
+// Rebuild the levels and slot array from the prefix list, and drop the duplicate prefixes from the list
+//  The tables are first built in working tables sized for the worst case, then copied to tables sized for the
+//  entries placed. The current tables are left intact if either cannot be allocated
+//
+static ATF_ERROR AtfIpv6BslRebuild(IPV6_BSL_CTX *ctx, size_t numOfPrefixes);
+
+//
+// Update totalTableSize
+//
+static VOID AtfIpv6BslUpdateStats(IPV6_BSL_CTX *ctx);
+
+ATF_ERROR AtfIpv6BslAllocCtx(IPV6_BSL_CTX **ctxOut)
+{
+    if (!ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    IPV6_BSL_CTX *ctx = (IPV6_BSL_CTX *)ATF_MALLOC(sizeof(IPV6_BSL_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    // The seed only needs to differ between tables, so that a crafted feed cannot target one probe sequence
+    LARGE_INTEGER counter = KeQueryPerformanceCounter(NULL);
+    ctx->seed = (UINT64)counter.QuadPart;
+
+    AtfIpv6BslUpdateStats(ctx);
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfIpv6BslInsertPool(IPV6_BSL_CTX *ctx, const IPV6_PREFIX_ENTRY *pool, size_t numOfEntries)
+{
+    if (!ctx || !pool || !numOfEntries) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    for (size_t i = 0; i < numOfEntries; i++) {
+        if (pool[i].prefixLength < IPV6_PREFIX_MIN_LENGTH || pool[i].prefixLength > IPV6_PREFIX_MAX_LENGTH) {
+            return ATF_BAD_PARAMETERS;
+        }
+    }
+
+    const size_t numOfPrefixes = ctx->totalNumOfPrefixes + numOfEntries;
+    if (numOfPrefixes < numOfEntries || numOfPrefixes > (MAXSIZE_T / sizeof(IPV6_BSL_PREFIX)) / 2) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    // Grow the prefix list geometrically, feeds are usually appended in several pools
+    if (numOfPrefixes > ctx->maxNumOfPrefixes) {
+        size_t maxNumOfPrefixes = ctx->maxNumOfPrefixes * 2;
+        if (maxNumOfPrefixes < numOfPrefixes) {
+            maxNumOfPrefixes = numOfPrefixes;
+        }
+
+        IPV6_BSL_PREFIX *prefixes = (IPV6_BSL_PREFIX *)ATF_MALLOC(maxNumOfPrefixes * sizeof(IPV6_BSL_PREFIX));
+        if (!prefixes) {
+            return ATF_NO_MEMORY_AVAILABLE;
+        }
+
+        if (ctx->prefixes) {
+            RtlCopyMemory(prefixes, ctx->prefixes, ctx->totalNumOfPrefixes * sizeof(IPV6_BSL_PREFIX));
+            ATF_FREE(ctx->prefixes);
+        }
+
+        ctx->prefixes = prefixes;
+        ctx->maxNumOfPrefixes = maxNumOfPrefixes;
+    }
+
+    for (size_t i = 0; i < numOfEntries; i++) {
+        IPV6_BSL_PREFIX *prefix = &ctx->prefixes[ctx->totalNumOfPrefixes + i];
+
+        IPV6_BSL_KEY key;
+        AtfIpv6BslMakeKey(&pool[i].address, &key);
+        AtfIpv6BslMaskKey(&key, pool[i].prefixLength, &prefix->key);
+        prefix->prefixLength = pool[i].prefixLength;
+    }
+
+    ATF_ERROR atfError = AtfIpv6BslRebuild(ctx, numOfPrefixes);
+
+    AtfIpv6BslUpdateStats(ctx);
+
+    return atfError;
+}
+
+UINT8 AtfIpv6BslSearch(const IPV6_BSL_CTX *ctx, const IPV6_RAW_ADDRESS *ip)
+{
+    if (!ctx || !ip || !ctx->numOfLevels) {
+        return 0;
+    }
+
+    IPV6_BSL_KEY key;
+    AtfIpv6BslMakeKey(ip, &key);
+
+    UINT8 bestLength = 0;
+
+    INT32 low = 0;
+    INT32 high = (INT32)ctx->numOfLevels - 1;
+    while (low <= high) {
+        const INT32 mid = (low + high) / 2;
+        const IPV6_BSL_LEVEL *level = &ctx->levels[mid];
+
+        IPV6_BSL_KEY probe;
+        AtfIpv6BslMaskKey(&key, level->prefixLength, &probe);
+
+        const IPV6_BSL_SLOT *slot = AtfIpv6BslProbe(ctx->slots, level, &probe, AtfIpv6BslHash(ctx->seed, level, &probe));
+        if (slot) {
+            bestLength = slot->bestLength;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return bestLength;
+}
+
+VOID AtfIpv6BslSearchBatch(
+    const IPV6_BSL_CTX *ctx,
+    const IPV6_RAW_ADDRESS *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+)
+{
+    if (!ips || !resultsOut) {
+        return;
+    }
+
+    if (!ctx || !ctx->numOfLevels) {
+        RtlZeroMemory(resultsOut, numOfIps * sizeof(UINT8));
+        return;
+    }
+
+    IPV6_BSL_KEY keys[IPV6_BSL_BATCH_WINDOW];
+    IPV6_BSL_KEY probes[IPV6_BSL_BATCH_WINDOW];
+    size_t indexes[IPV6_BSL_BATCH_WINDOW];
+    INT32 lows[IPV6_BSL_BATCH_WINDOW];
+    INT32 highs[IPV6_BSL_BATCH_WINDOW];
+
+    for (size_t base = 0; base < numOfIps; base += IPV6_BSL_BATCH_WINDOW) {
+        const size_t windowSize =
+            (numOfIps - base) < IPV6_BSL_BATCH_WINDOW ? (numOfIps - base) : IPV6_BSL_BATCH_WINDOW;
+
+        for (size_t i = 0; i < windowSize; i++) {
+            AtfIpv6BslMakeKey(&ips[base + i], &keys[i]);
+            lows[i] = 0;
+            highs[i] = (INT32)ctx->numOfLevels - 1;
+            resultsOut[base + i] = 0;
+        }
+
+        //
+        // Every round takes one probe of each key that is still searching, all keys of a window take
+        //  the same number of rounds, give or take one
+        //
+        BOOLEAN isSearching = TRUE;
+        while (isSearching) {
+            isSearching = FALSE;
+
+            for (size_t i = 0; i < windowSize; i++) {
+                if (lows[i] > highs[i]) {
+                    continue;
+                }
+
+                const IPV6_BSL_LEVEL *level = &ctx->levels[(lows[i] + highs[i]) / 2];
+
+                AtfIpv6BslMaskKey(&keys[i], level->prefixLength, &probes[i]);
+                indexes[i] = AtfIpv6BslHash(ctx->seed, level, &probes[i]);
+
+                PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &ctx->slots[level->firstSlot + indexes[i]]);
+
+                isSearching = TRUE;
+            }
+
+            for (size_t i = 0; i < windowSize; i++) {
+                if (lows[i] > highs[i]) {
+                    continue;
+                }
+
+                const INT32 mid = (lows[i] + highs[i]) / 2;
+
+                const IPV6_BSL_SLOT *slot = AtfIpv6BslProbe(ctx->slots, &ctx->levels[mid], &probes[i], indexes[i]);
+                if (slot) {
+                    resultsOut[base + i] = slot->bestLength;
+                    lows[i] = mid + 1;
+                } else {
+                    highs[i] = mid - 1;
+                }
+            }
+        }
+    }
+}
+
+ATF_ERROR AtfIpv6BslClone(const IPV6_BSL_CTX *src, IPV6_BSL_CTX **ctxOut)
+{
+    if (!src || !ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    IPV6_BSL_CTX *ctx = (IPV6_BSL_CTX *)ATF_MALLOC(sizeof(IPV6_BSL_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    RtlCopyMemory(ctx, src, sizeof(IPV6_BSL_CTX));
+    ctx->prefixes = NULL;
+    ctx->slots = NULL;
+    ctx->slotAllocation = NULL;
+
+    if (src->maxNumOfPrefixes) {
+        ctx->prefixes = (IPV6_BSL_PREFIX *)ATF_MALLOC(src->maxNumOfPrefixes * sizeof(IPV6_BSL_PREFIX));
+        if (!ctx->prefixes) {
+            AtfIpv6BslFree(&ctx);
+            return ATF_NO_MEMORY_AVAILABLE;
+        }
+
+        RtlCopyMemory(ctx->prefixes, src->prefixes, src->totalNumOfPrefixes * sizeof(IPV6_BSL_PREFIX));
+    }
+
+    if (src->numOfSlots) {
+        ctx->slotAllocation = ATF_MALLOC(src->numOfSlots * sizeof(IPV6_BSL_SLOT) + IPV6_BSL_ALIGNMENT);
+        if (!ctx->slotAllocation) {
+            AtfIpv6BslFree(&ctx);
+            return ATF_NO_MEMORY_AVAILABLE;
+        }
+
+        ctx->slots = (IPV6_BSL_SLOT *)(((ULONG_PTR)ctx->slotAllocation + IPV6_BSL_ALIGNMENT - 1) & ~((ULONG_PTR)IPV6_BSL_ALIGNMENT - 1));
+        RtlCopyMemory(ctx->slots, src->slots, src->numOfSlots * sizeof(IPV6_BSL_SLOT));
+    }
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+VOID AtfIpv6BslPrintCtx(const IPV6_BSL_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] IPv6 BSL Stats: Num of prefixes: %llu, Num of levels: %u, Num of markers: %llu, Num of slots: %llu, Rebuilds: %llu, Total table size: %llu",
+        (UINT64)ctx->totalNumOfPrefixes, ctx->numOfLevels, (UINT64)ctx->numOfMarkers, (UINT64)ctx->numOfSlots,
+        (UINT64)ctx->numOfRebuilds, (UINT64)ctx->totalTableSize);
+}
+
+VOID AtfIpv6BslFree(IPV6_BSL_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    IPV6_BSL_CTX *c = *ctx;
+
+    if (c->slotAllocation) {
+        ATF_FREE(c->slotAllocation);
+    }
+
+    if (c->prefixes) {
+        ATF_FREE(c->prefixes);
+    }
+
+    RtlZeroMemory(c, sizeof(IPV6_BSL_CTX));
+    ATF_FREE(c);
+    *ctx = NULL;
+}
+
+static __forceinline VOID AtfIpv6BslMakeKey(const IPV6_RAW_ADDRESS *ip, IPV6_BSL_KEY *keyOut)
+{
+    keyOut->high = RtlUlonglongByteSwap(ip->a.q.qword[0]);
+    keyOut->low = RtlUlonglongByteSwap(ip->a.q.qword[1]);
+}
+
+static __forceinline VOID AtfIpv6BslMaskKey(const IPV6_BSL_KEY *key, UINT8 prefixLength, IPV6_BSL_KEY *keyOut)
+{
+    if (prefixLength <= 64) {
+        keyOut->high = prefixLength ? key->high & (_UI64_MAX << (64 - prefixLength)) : 0;
+        keyOut->low = 0;
+    } else {
+        keyOut->high = key->high;
+        keyOut->low = key->low & (_UI64_MAX << (IPV6_PREFIX_MAX_LENGTH - prefixLength));
+    }
+}
+
+static __forceinline size_t AtfIpv6BslHash(UINT64 seed, const IPV6_BSL_LEVEL *level, const IPV6_BSL_KEY *key)
+{
+    // 64-bit mix (murmur3 finalizer) of both halves, the high half of the hash picks the slot by multiply-shift
+    UINT64 hash = key->high ^ seed;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    hash ^= key->low;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (size_t)(((hash >> 32) * level->numOfSlots) >> 32);
+}
+
+static __forceinline const IPV6_BSL_SLOT *AtfIpv6BslProbe(
+    const IPV6_BSL_SLOT *slots,
+    const IPV6_BSL_LEVEL *level,
+    const IPV6_BSL_KEY *key,
+    size_t index
+)
+{
+    // Tables always have free slots, so a free slot ends the probe
+    for (;;) {
+        const IPV6_BSL_SLOT *slot = &slots[level->firstSlot + index];
+
+        if (!(slot->flags & IPV6_BSL_SLOT_USED)) {
+            return NULL;
+        }
+
+        if (slot->key.high == key->high && slot->key.low == key->low) {
+            return slot;
+        }
+
+        index = (index + 1 == level->numOfSlots) ? 0 : index + 1;
+    }
+}
+
+static IPV6_BSL_SLOT *AtfIpv6BslFindOrAdd(
+    IPV6_BSL_SLOT *slots,
+    UINT64 seed,
+    const IPV6_BSL_LEVEL *level,
+    const IPV6_BSL_KEY *key
+)
+{
+    size_t index = AtfIpv6BslHash(seed, level, key);
+
+    for (;;) {
+        IPV6_BSL_SLOT *slot = &slots[level->firstSlot + index];
+
+        if (!(slot->flags & IPV6_BSL_SLOT_USED)) {
+            slot->key = *key;
+            slot->flags = IPV6_BSL_SLOT_USED;
+            return slot;
+        }
+
+        if (slot->key.high == key->high && slot->key.low == key->low) {
+            return slot;
+        }
+
+        index = (index + 1 == level->numOfSlots) ? 0 : index + 1;
+    }
+}
+
+static ATF_ERROR AtfIpv6BslAllocSlots(
+    IPV6_BSL_LEVEL *levels,
+    UINT32 numOfLevels,
+    const size_t *numOfEntries,
+    IPV6_BSL_SLOT **slotsOut,
+    VOID **allocationOut,
+    size_t *numOfSlotsOut
+)
+{
+    size_t numOfSlots = 0;
+
+    for (UINT32 l = 0; l < numOfLevels; l++) {
+        size_t levelSlots = numOfEntries[l] * 100 / IPV6_BSL_LOAD_PERCENT + 1;
+        if (levelSlots < IPV6_BSL_MIN_SLOTS) {
+            levelSlots = IPV6_BSL_MIN_SLOTS;
+        }
+
+        if (levelSlots > _UI32_MAX) {
+            return ATF_NO_MEMORY_AVAILABLE;
+        }
+
+        levels[l].firstSlot = numOfSlots;
+        levels[l].numOfSlots = levelSlots;
+        numOfSlots += levelSlots;
+    }
+
+    if (numOfSlots > (MAXSIZE_T - IPV6_BSL_ALIGNMENT) / sizeof(IPV6_BSL_SLOT)) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    VOID *allocation = ATF_MALLOC(numOfSlots * sizeof(IPV6_BSL_SLOT) + IPV6_BSL_ALIGNMENT);
+    if (!allocation) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    *slotsOut = (IPV6_BSL_SLOT *)(((ULONG_PTR)allocation + IPV6_BSL_ALIGNMENT - 1) & ~((ULONG_PTR)IPV6_BSL_ALIGNMENT - 1));
+    *allocationOut = allocation;
+    *numOfSlotsOut = numOfSlots;
+
+    return ATF_ERROR_OK;
+}
+
+static ATF_ERROR AtfIpv6BslRebuild(IPV6_BSL_CTX *ctx, size_t numOfPrefixes)
+{
+    //
+    // The distinct lengths are the levels, the binary search runs over their indexes
+    //
+    UINT8 levelOfLength[IPV6_PREFIX_MAX_LENGTH + 1] = { 0 };
+    for (size_t i = 0; i < numOfPrefixes; i++) {
+        levelOfLength[ctx->prefixes[i].prefixLength] = 1;
+    }
+
+    // Levels of the working and final tables, and the entry counts, too large for the stack
+    IPV6_BSL_REBUILD *rebuild = (IPV6_BSL_REBUILD *)ATF_MALLOC(sizeof(IPV6_BSL_REBUILD));
+    if (!rebuild) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    UINT32 numOfLevels = 0;
+    for (UINT32 length = IPV6_PREFIX_MIN_LENGTH; length <= IPV6_PREFIX_MAX_LENGTH; length++) {
+        if (levelOfLength[length]) {
+            levelOfLength[length] = (UINT8)numOfLevels;
+            rebuild->workLevels[numOfLevels].prefixLength = (UINT8)length;
+            rebuild->levels[numOfLevels].prefixLength = (UINT8)length;
+            numOfLevels++;
+        }
+    }
+
+    //
+    // The working tables are sized for every prefix and marker, counting a marker once for each prefix that needs it
+    //
+    for (size_t i = 0; i < numOfPrefixes; i++) {
+        const INT32 target = levelOfLength[ctx->prefixes[i].prefixLength];
+
+        INT32 low = 0;
+        INT32 high = (INT32)numOfLevels - 1;
+        while (low <= high) {
+            const INT32 mid = (low + high) / 2;
+
+            rebuild->numOfEntries[mid]++;
+            if (mid == target) {
+                break;
+            }
+
+            if (mid < target) {
+                low = mid + 1;
+            } else {
+                high = mid - 1;
+            }
+        }
+    }
+
+    IPV6_BSL_SLOT *workSlots = NULL;
+    VOID *workAllocation = NULL;
+    size_t numOfWorkSlots = 0;
+
+    ATF_ERROR atfError = AtfIpv6BslAllocSlots(
+        rebuild->workLevels, numOfLevels, rebuild->numOfEntries, &workSlots, &workAllocation, &numOfWorkSlots);
+    if (atfError) {
+        ATF_FREE(rebuild);
+        return atfError;
+    }
+
+    //
+    // Place the prefixes and their markers, a prefix already placed is a duplicate and is dropped from the list
+    //
+    size_t numOfUniquePrefixes = 0;
+
+    for (size_t i = 0; i < numOfPrefixes; i++) {
+        const IPV6_BSL_PREFIX prefix = ctx->prefixes[i];
+        const INT32 target = levelOfLength[prefix.prefixLength];
+
+        IPV6_BSL_SLOT *slot = AtfIpv6BslFindOrAdd(workSlots, ctx->seed, &rebuild->workLevels[target], &prefix.key);
+        if (slot->flags & IPV6_BSL_SLOT_PREFIX) {
+            continue;
+        }
+
+        slot->flags |= IPV6_BSL_SLOT_PREFIX;
+        ctx->prefixes[numOfUniquePrefixes++] = prefix;
+
+        INT32 low = 0;
+        INT32 high = (INT32)numOfLevels - 1;
+        while (low <= high) {
+            const INT32 mid = (low + high) / 2;
+            if (mid == target) {
+                break;
+            }
+
+            // The search for this prefix moves to the longer half here, so it needs a marker on this level
+            if (mid < target) {
+                IPV6_BSL_KEY marker;
+                AtfIpv6BslMaskKey(&prefix.key, rebuild->workLevels[mid].prefixLength, &marker);
+                AtfIpv6BslFindOrAdd(workSlots, ctx->seed, &rebuild->workLevels[mid], &marker);
+
+                low = mid + 1;
+            } else {
+                high = mid - 1;
+            }
+        }
+    }
+
+    //
+    // bestLength, level by level in ascending length. The longest prefix covering a marker is found on the closest
+    //  shorter level holding its key, whose bestLength is already known
+    //
+    size_t numOfUsedSlots = 0;
+
+    for (UINT32 l = 0; l < numOfLevels; l++) {
+        const IPV6_BSL_LEVEL *level = &rebuild->workLevels[l];
+
+        rebuild->numOfEntries[l] = 0;
+
+        for (size_t s = 0; s < level->numOfSlots; s++) {
+            IPV6_BSL_SLOT *slot = &workSlots[level->firstSlot + s];
+            if (!(slot->flags & IPV6_BSL_SLOT_USED)) {
+                continue;
+            }
+
+            rebuild->numOfEntries[l]++;
+
+            if (slot->flags & IPV6_BSL_SLOT_PREFIX) {
+                slot->bestLength = level->prefixLength;
+                continue;
+            }
+
+            for (INT32 shorter = (INT32)l - 1; shorter >= 0; shorter--) {
+                const IPV6_BSL_LEVEL *shorterLevel = &rebuild->workLevels[shorter];
+
+                IPV6_BSL_KEY key;
+                AtfIpv6BslMaskKey(&slot->key, shorterLevel->prefixLength, &key);
+
+                const IPV6_BSL_SLOT *covering =
+                    AtfIpv6BslProbe(workSlots, shorterLevel, &key, AtfIpv6BslHash(ctx->seed, shorterLevel, &key));
+                if (covering) {
+                    slot->bestLength = covering->bestLength;
+                    break;
+                }
+            }
+        }
+
+        numOfUsedSlots += rebuild->numOfEntries[l];
+    }
+
+    //
+    // Markers are shared by the prefixes under them, so the working tables are mostly empty. The final tables are
+    //  sized for the entries actually placed
+    //
+    IPV6_BSL_SLOT *slots = NULL;
+    VOID *slotAllocation = NULL;
+    size_t numOfSlots = 0;
+
+    atfError = AtfIpv6BslAllocSlots(
+        rebuild->levels, numOfLevels, rebuild->numOfEntries, &slots, &slotAllocation, &numOfSlots);
+    if (atfError) {
+        ATF_FREE(workAllocation);
+        ATF_FREE(rebuild);
+        return atfError;
+    }
+
+    for (UINT32 l = 0; l < numOfLevels; l++) {
+        const IPV6_BSL_LEVEL *workLevel = &rebuild->workLevels[l];
+
+        for (size_t s = 0; s < workLevel->numOfSlots; s++) {
+            const IPV6_BSL_SLOT *workSlot = &workSlots[workLevel->firstSlot + s];
+            if (workSlot->flags & IPV6_BSL_SLOT_USED) {
+                *AtfIpv6BslFindOrAdd(slots, ctx->seed, &rebuild->levels[l], &workSlot->key) = *workSlot;
+            }
+        }
+    }
+
+    ATF_FREE(workAllocation);
+
+    if (ctx->slotAllocation) {
+        ATF_FREE(ctx->slotAllocation);
+    }
+
+    RtlZeroMemory(ctx->levels, sizeof(ctx->levels));
+    RtlCopyMemory(ctx->levels, rebuild->levels, numOfLevels * sizeof(IPV6_BSL_LEVEL));
+    ctx->numOfLevels = numOfLevels;
+    ctx->numOfSlots = numOfSlots;
+    ctx->slots = slots;
+    ctx->slotAllocation = slotAllocation;
+
+    ctx->totalNumOfPrefixes = numOfUniquePrefixes;
+    ctx->numOfMarkers = numOfUsedSlots - numOfUniquePrefixes;
+    ctx->numOfRebuilds++;
+
+    ATF_FREE(rebuild);
+
+    return ATF_ERROR_OK;
+}
+
+static VOID AtfIpv6BslUpdateStats(IPV6_BSL_CTX *ctx)
+{
+    ctx->totalTableSize = sizeof(IPV6_BSL_CTX) + ctx->maxNumOfPrefixes * sizeof(IPV6_BSL_PREFIX);
+
+    if (ctx->slotAllocation) {
+        ctx->totalTableSize += ctx->numOfSlots * sizeof(IPV6_BSL_SLOT) + IPV6_BSL_ALIGNMENT;
+    }
+}
+
+//EOF
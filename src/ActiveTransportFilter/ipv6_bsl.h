@@ -0,0 +1,162 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include <limits.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "mem.h"
+
+//
+// Binary search on prefix lengths (Waldvogel et al.) for IPv6 blocklists
+//
+//  A trie over 128-bit addresses is up to 16 levels deep even with an 8-bit stride, so a lookup would chase up
+//   to 16 nodes. Instead, the prefixes of every distinct length are kept in a hash table of their own, and a
+//   lookup binary searches over the lengths, i.e. ceil(log2(n + 1)) probes for n distinct lengths:
+//
+//   - A probe masks the address to the length of the level and looks it up in that table. A hit means a longer
+//      match may exist, so the search moves to the longer half, a miss moves it to the shorter half
+//   - For a prefix to be found this way, a "marker" is stored on every level where the search for it moves to the
+//      longer half. A marker may send the search the wrong way, so every slot (marker or prefix) carries the
+//      longest blocklist prefix covering it (bestLength), and the result is the bestLength of the last hit
+//
+//  Blocklists use few lengths (/128, /64 and /48 cover most feeds), so a lookup is 2 to 4 probes, and at most 8
+//   for all 128 lengths. A slot is 32 bytes and every table is sized for the entries it holds at
+//   IPV6_BSL_LOAD_PERCENT occupancy, so a probe is a single cache line in the common case.
+//
+//  The markers and bestLength of a level depend on every other level, so the tables are rebuilt from the list of
+//   prefixes on each InsertPool, rather than updated in place. Pools are large and infrequent (the ini, and whole
+//   online feeds), so the tables stay immutable between them, like the rest of a published config.
+//
+//  Keys are the address in host byte order, split in two 64-bit halves and masked to the length of the level.
+//
+#define IPV6_BSL_MIN_SLOTS              8
+#define IPV6_BSL_LOAD_PERCENT           50
+
+// Slot array alignment, a slot never spans two cache lines
+#define IPV6_BSL_ALIGNMENT              64
+
+// Maximum number of keys searched in lockstep by the batch search
+#define IPV6_BSL_BATCH_WINDOW           16
+
+// Slot flags
+#define IPV6_BSL_SLOT_USED              0x01
+#define IPV6_BSL_SLOT_PREFIX            0x02
+
+//
+// 128-bit key, high holds the first 64 bits of the address
+//
+typedef struct _ipv6_bsl_key {
+    UINT64                          high;
+    UINT64                          low;
+} IPV6_BSL_KEY, *PIPV6_BSL_KEY;
+
+//
+// Hash table slot, a prefix or a marker of the level
+//
+typedef struct DECLSPEC_ALIGN(32) _ipv6_bsl_slot {
+    IPV6_BSL_KEY                    key;
+
+    // Longest blocklist prefix covering the key with at most the length of the level, 0 for none
+    UINT8                           bestLength;
+    UINT8                           flags;
+} IPV6_BSL_SLOT, *PIPV6_BSL_SLOT;
+
+//
+// A distinct prefix length and its hash table, a range of the slot array
+//
+typedef struct _ipv6_bsl_level {
+    UINT8                           prefixLength;
+
+    size_t                          firstSlot;
+    size_t                          numOfSlots;
+} IPV6_BSL_LEVEL, *PIPV6_BSL_LEVEL;
+
+//
+// Stored prefix, the key is already masked
+//
+typedef struct _ipv6_bsl_prefix {
+    IPV6_BSL_KEY                    key;
+    UINT8                           prefixLength;
+} IPV6_BSL_PREFIX, *PIPV6_BSL_PREFIX;
+
+//
+// Binary search on prefix lengths instance context
+//
+typedef struct _ipv6_bsl_ctx {
+    // Total physical size of the context, slot array and prefix list, in bytes
+    size_t                          totalTableSize;
+
+    // Total number of stored prefixes (duplicates are not counted)
+    size_t                          totalNumOfPrefixes;
+
+    // Number of markers that are not also a prefix
+    size_t                          numOfMarkers;
+
+    // Number of times the tables were rebuilt
+    size_t                          numOfRebuilds;
+
+    // Hash seed
+    UINT64                          seed;
+
+    // Prefixes the tables are built from, in insertion order
+    size_t                          maxNumOfPrefixes;
+    IPV6_BSL_PREFIX                 *prefixes;
+
+    // Levels, in ascending prefix length
+    UINT32                          numOfLevels;
+    IPV6_BSL_LEVEL                  levels[IPV6_PREFIX_MAX_LENGTH];
+
+    // Slot array of all levels, aligned to IPV6_BSL_ALIGNMENT within the allocation
+    size_t                          numOfSlots;
+    IPV6_BSL_SLOT                   *slots;
+    VOID                            *slotAllocation;
+} IPV6_BSL_CTX, *PIPV6_BSL_CTX;
+
+//
+// Initialize the context, with no levels
+//
+ATF_ERROR AtfIpv6BslAllocCtx(IPV6_BSL_CTX **ctxOut);
+
+//
+// Insert a pool of ipv6 prefixes, then rebuild the tables
+//  IPv4-mapped prefixes are stored like any other, the caller decides whether they belong to the IPv4 blocklist
+//
+ATF_ERROR AtfIpv6BslInsertPool(IPV6_BSL_CTX *ctx, const IPV6_PREFIX_ENTRY *pool, size_t numOfEntries);
+
+//
+// Search for a single input IP (network byte order, as supplied by WFP)
+//  Returns the prefix length of the longest matching entry, or 0 if the IP is not covered
+//
+UINT8 AtfIpv6BslSearch(const IPV6_BSL_CTX *ctx, const IPV6_RAW_ADDRESS *ip);
+
+//
+// Search for numOfIps addresses, resultsOut receives the same values as AtfIpv6BslSearch.
+//  Up to IPV6_BSL_BATCH_WINDOW keys are searched in lockstep, one probe each per round, and the slots of a round
+//  are prefetched before any of them is compared
+//
+VOID AtfIpv6BslSearchBatch(
+    const IPV6_BSL_CTX *ctx,
+    const IPV6_RAW_ADDRESS *ips,
+    UINT8 *resultsOut,
+    size_t numOfIps
+);
+
+//
+// Create a copy of the tables and prefix list
+//
+ATF_ERROR AtfIpv6BslClone(const IPV6_BSL_CTX *src, IPV6_BSL_CTX **ctxOut);
+
+//
+// Print context info
+//
+VOID AtfIpv6BslPrintCtx(const IPV6_BSL_CTX *ctx);
+
+//
+// Free the tables and context
+//
+VOID AtfIpv6BslFree(IPV6_BSL_CTX **ctx);
+
+//EOF
@@ -5,6 +5,16 @@
 #include "../common/errors.h"
 #include "trace.h"
 
+//
+// Returns the size class index of an arena block, or ATF_ARENA_NUM_OF_CLASSES if the block needs a dedicated chunk
+//
+static UINT32 AtfArenaClassIndex(size_t size);
+
+//
+// Carve a block from the current chunk, allocating a new chunk if it does not fit
+//
+static VOID *AtfArenaCarve(ATF_ARENA *arena, size_t blockSize);
+
 //
 // Non-paged pool allocator
 //
@@ -69,4 +79,142 @@ VOID AtfFreePP(VOID *p)
     ExFreePoolWithTag(p, MEM_PAGE_NAME_PP);
 }
 
+//
+// Arena allocator
+//
+VOID AtfArenaInit(ATF_ARENA *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+    RtlZeroMemory(arena, sizeof(ATF_ARENA));
+}
+
+VOID *AtfArenaAlloc(ATF_ARENA *arena, size_t size)
+{
+    if (!arena || size == 0) {
+        return NULL;
+    }
+
+    const UINT32 classIndex = AtfArenaClassIndex(size);
+    const size_t blockSize = AtfArenaBlockSize(size);
+
+    VOID *ptr = NULL;
+
+    if (classIndex < ATF_ARENA_NUM_OF_CLASSES && arena->freeLists[classIndex]) {
+        // Reuse a freed block, it still holds the free list link and old data
+        ptr = arena->freeLists[classIndex];
+        arena->freeLists[classIndex] = *(VOID **)ptr;
+
+        RtlZeroMemory(ptr, blockSize);
+    } else {
+        // Chunks are zeroed by ATF_MALLOC, and bump memory is never reused
+        ptr = AtfArenaCarve(arena, blockSize);
+        if (!ptr) {
+            return NULL;
+        }
+    }
+
+    arena->allocatedSize += blockSize;
+
+    return ptr;
+}
+
+VOID AtfArenaFree(ATF_ARENA *arena, VOID *p, size_t size)
+{
+    if (!arena || !p || size == 0) {
+        return;
+    }
+
+    const UINT32 classIndex = AtfArenaClassIndex(size);
+
+    arena->allocatedSize -= AtfArenaBlockSize(size);
+
+    // Blocks in dedicated chunks are reclaimed by AtfArenaRelease()
+    if (classIndex >= ATF_ARENA_NUM_OF_CLASSES) {
+        return;
+    }
+
+    *(VOID **)p = arena->freeLists[classIndex];
+    arena->freeLists[classIndex] = p;
+}
+
+size_t AtfArenaBlockSize(size_t size)
+{
+    const UINT32 classIndex = AtfArenaClassIndex(size);
+    if (classIndex >= ATF_ARENA_NUM_OF_CLASSES) {
+        // Dedicated chunk, keep the alignment of the blocks
+        return (size + ATF_ARENA_MIN_BLOCK_SIZE - 1) & ~(ATF_ARENA_MIN_BLOCK_SIZE - 1);
+    }
+
+    return (size_t)ATF_ARENA_MIN_BLOCK_SIZE << classIndex;
+}
+
+VOID AtfArenaRelease(ATF_ARENA *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+    ATF_ARENA_CHUNK *chunk = arena->chunks;
+    while (chunk) {
+        ATF_ARENA_CHUNK *next = chunk->next;
+        ATF_FREE(chunk);
+        chunk = next;
+    }
+
+    RtlZeroMemory(arena, sizeof(ATF_ARENA));
+}
+
+static UINT32 AtfArenaClassIndex(size_t size)
+{
+    UINT32 classIndex = 0;
+
+    while (classIndex < ATF_ARENA_NUM_OF_CLASSES && ((size_t)ATF_ARENA_MIN_BLOCK_SIZE << classIndex) < size) {
+        classIndex++;
+    }
+
+    return classIndex;
+}
+
+static VOID *AtfArenaCarve(ATF_ARENA *arena, size_t blockSize)
+{
+    ATF_ARENA_CHUNK *chunk = arena->chunks;
+
+    if (blockSize > ATF_ARENA_MAX_BLOCK_SIZE || !chunk || chunk->size - chunk->used < blockSize) {
+        //
+        // The remainder of the current chunk is abandoned. It is at most ATF_ARENA_MAX_BLOCK_SIZE, which is small
+        //  compared to ATF_ARENA_CHUNK_SIZE
+        //
+        const size_t chunkSize = blockSize > ATF_ARENA_MAX_BLOCK_SIZE ? blockSize : ATF_ARENA_CHUNK_SIZE;
+
+        ATF_ARENA_CHUNK *newChunk = (ATF_ARENA_CHUNK *)ATF_MALLOC(sizeof(ATF_ARENA_CHUNK) + chunkSize);
+        if (!newChunk) {
+            return NULL;
+        }
+
+        newChunk->size = chunkSize;
+
+        arena->numOfChunks++;
+        arena->reservedSize += sizeof(ATF_ARENA_CHUNK) + chunkSize;
+
+        if (blockSize > ATF_ARENA_MAX_BLOCK_SIZE && chunk) {
+            // A dedicated chunk is full, link it behind the current chunk so that one stays in use
+            newChunk->next = chunk->next;
+            chunk->next = newChunk;
+        } else {
+            newChunk->next = chunk;
+            arena->chunks = newChunk;
+        }
+
+        chunk = newChunk;
+    }
+
+    VOID *ptr = (UINT8 *)(chunk + 1) + chunk->used;
+    chunk->used += blockSize;
+
+    return ptr;
+}
+
 //EOF
\ No newline at end of file
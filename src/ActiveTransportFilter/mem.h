@@ -56,3 +56,76 @@ VOID *AtfMallocPP(SIZE_T size);
 VOID AtfFreePP(VOID *p);
 
 
+//
+// Arena (slab) allocator
+//
+//  Structures built from many small allocations (i.e. the trie nodes) are carved out of large chunks with a bump
+//   pointer, rather than allocating each one from the pool. Freed blocks are kept on a free list per size class
+//   (powers of two, from ATF_ARENA_MIN_BLOCK_SIZE to ATF_ARENA_MAX_BLOCK_SIZE) and reused by later allocations.
+//   The whole arena is released at once by freeing its chunks, so teardown does not walk the structure.
+//
+//  Blocks larger than ATF_ARENA_MAX_BLOCK_SIZE get a dedicated chunk, and are only reclaimed by AtfArenaRelease().
+//
+//  An arena is not synchronized, its owner must serialize allocations (IOCTL handlers are serialized by gIoctlLock).
+//   Chunks are allocated with ATF_MALLOC, so arena memory is non-paged and can be read from the callouts.
+//
+#define ATF_ARENA_CHUNK_SIZE            (1024 * 1024)
+#define ATF_ARENA_MIN_BLOCK_SHIFT       4
+#define ATF_ARENA_MAX_BLOCK_SHIFT       16
+#define ATF_ARENA_MIN_BLOCK_SIZE        (1ULL << ATF_ARENA_MIN_BLOCK_SHIFT)
+#define ATF_ARENA_MAX_BLOCK_SIZE        (1ULL << ATF_ARENA_MAX_BLOCK_SHIFT)
+#define ATF_ARENA_NUM_OF_CLASSES        (ATF_ARENA_MAX_BLOCK_SHIFT - ATF_ARENA_MIN_BLOCK_SHIFT + 1)
+
+//
+// Chunk header, the chunk's blocks follow the header
+//  The header is a multiple of ATF_ARENA_MIN_BLOCK_SIZE, so every block is 16-byte aligned
+//
+typedef struct DECLSPEC_ALIGN(16) _atf_arena_chunk {
+    struct _atf_arena_chunk         *next;
+
+    // Size of the block area, and the bump offset into it
+    size_t                          size;
+    size_t                          used;
+} ATF_ARENA_CHUNK, *PATF_ARENA_CHUNK;
+
+typedef struct _atf_arena {
+    ATF_ARENA_CHUNK                 *chunks;
+
+    // Singly-linked free list for each size class, the link is stored in the freed block
+    VOID                            *freeLists[ATF_ARENA_NUM_OF_CLASSES];
+
+    // Number of chunks and their total size (including headers), in bytes
+    size_t                          numOfChunks;
+    size_t                          reservedSize;
+
+    // Size of the blocks currently allocated, rounded up to their size class, in bytes
+    size_t                          allocatedSize;
+} ATF_ARENA, *PATF_ARENA;
+
+//
+// Initialize an empty arena, no memory is reserved until the first allocation
+//
+VOID AtfArenaInit(ATF_ARENA *arena);
+
+//
+// Allocate a zeroed block of at least size bytes
+//
+VOID *AtfArenaAlloc(ATF_ARENA *arena, size_t size);
+
+//
+// Return a block to the arena, size must be the size it was allocated with
+//
+VOID AtfArenaFree(ATF_ARENA *arena, VOID *p, size_t size);
+
+//
+// Returns the usable size of a block allocated with size bytes (the size class)
+//  A block can grow in place up to this size
+//
+size_t AtfArenaBlockSize(size_t size);
+
+//
+// Free every chunk of the arena, invalidating all blocks, and reset it to empty
+//
+VOID AtfArenaRelease(ATF_ARENA *arena);
+
+//EOF
@@ -204,6 +204,11 @@ VOID AtfUnloadDriver(
         DestroyWfp(gDeviceObj);
     }
 
+    //
+    // Discard any open bulk upload session
+    //
+    AtfIoctlCleanup();
+
     //
     // Destroy the filter config
     //
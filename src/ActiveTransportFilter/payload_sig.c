@@ -0,0 +1,447 @@
+#include <ntddk.h>
+
+#include "payload_sig.h"
+
+#include "mem.h"
+#include "trace.h"
+
+C_ASSERT(sizeof(PAYLOAD_SIG_HEADER) % PAYLOAD_SIG_ALIGNMENT == 0);
+C_ASSERT(sizeof(PAYLOAD_SIG_STATE) == 16);
+
+// Bytes checked at once by the prefilter
+#define PAYLOAD_SIG_STRIDE                  4
+
+// Lanes of the prefilter state, one per byte of a UINT64: a stride is checked in the lanes from
+//  prefilterLength - 2 up
+C_ASSERT(PAYLOAD_SIG_MAX_PREFILTER_LENGTH - 2 + PAYLOAD_SIG_STRIDE <= sizeof(UINT64));
+
+//
+// Id of the last adopted image
+//
+static volatile LONG gPayloadSigImageId = 0;
+
+//
+// Check the header, the section bounds, and the checksum
+//
+static BOOLEAN AtfPayloadSigValidateHeader(const PAYLOAD_SIG_HEADER *header, size_t imageSize);
+
+//
+// Check that a section of count elements of elementSize bytes is aligned and fits the image
+//
+static BOOLEAN AtfPayloadSigValidateSection(
+    const PAYLOAD_SIG_HEADER *header,
+    UINT64 offset,
+    UINT64 count,
+    UINT64 elementSize
+);
+
+//
+// Check every state, sparse edge, dense row and name
+//
+static BOOLEAN AtfPayloadSigValidateAutomaton(const PAYLOAD_SIG_CTX *ctx);
+
+//
+// Follow the transition of the automaton for a char, through the failure states
+//
+static __forceinline UINT32 AtfPayloadSigStep(const PAYLOAD_SIG_CTX *ctx, UINT32 state, UINT8 c);
+
+ATF_ERROR AtfPayloadSigAdopt(const VOID *image, size_t imageSize, PAYLOAD_SIG_CTX **ctxOut)
+{
+    if (!image || !ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    if (imageSize < sizeof(PAYLOAD_SIG_HEADER) || imageSize % PAYLOAD_SIG_ALIGNMENT) {
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    // The image is copied into its final non-paged allocation first, and validated there
+    const size_t ctxSize =
+        (sizeof(PAYLOAD_SIG_CTX) + PAYLOAD_SIG_ALIGNMENT - 1) & ~((size_t)PAYLOAD_SIG_ALIGNMENT - 1);
+
+    PAYLOAD_SIG_CTX *ctx = (PAYLOAD_SIG_CTX *)ATF_MALLOC(ctxSize + imageSize);
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    UINT8 *imageCopy = (UINT8 *)ctx + ctxSize;
+    RtlCopyMemory(imageCopy, image, imageSize);
+
+    const PAYLOAD_SIG_HEADER *header = (const PAYLOAD_SIG_HEADER *)imageCopy;
+    if (!AtfPayloadSigValidateHeader(header, imageSize)) {
+        ATF_FREE(ctx);
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    ctx->header = header;
+    ctx->states = (const PAYLOAD_SIG_STATE *)&imageCopy[header->statesOffset];
+    ctx->edgeTargets = (const UINT32 *)&imageCopy[header->edgeTargetsOffset];
+    ctx->edgeChars = &imageCopy[header->edgeCharsOffset];
+    ctx->dense = (const UINT32 *)&imageCopy[header->denseOffset];
+    ctx->reach = (const UINT64 *)&imageCopy[header->reachOffset];
+    ctx->names = (const CHAR *)&imageCopy[header->namesOffset];
+    ctx->prefilterLength = header->prefilterLength;
+    ctx->domainBits = header->domainBits;
+
+    if (!AtfPayloadSigValidateAutomaton(ctx)) {
+        ATF_FREE(ctx);
+        return ATF_CORRUPT_IMAGE;
+    }
+
+    ctx->refCount = 1;
+    ctx->totalSize = ctxSize + imageSize;
+    ctx->imageId = (UINT32)InterlockedIncrement(&gPayloadSigImageId);
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+PAYLOAD_SIG_CTX *AtfPayloadSigReference(PAYLOAD_SIG_CTX *ctx)
+{
+    if (ctx) {
+        ctx->refCount++;
+    }
+
+    return ctx;
+}
+
+VOID AtfPayloadSigResetStream(PAYLOAD_SIG_STREAM *stream)
+{
+    // No lane of the prefilter holds a bigram yet
+    stream->shiftOr = ~0ULL;
+    stream->history = 0;
+    stream->length = 0;
+    stream->state = 0;
+}
+
+UINT32 AtfPayloadSigScan(
+    _In_ const PAYLOAD_SIG_CTX *ctx,
+    _Inout_ PAYLOAD_SIG_STREAM *stream,
+    _In_ const UINT8 *data,
+    _In_ size_t dataLength
+)
+{
+    if (!ctx || !stream || !data) {
+        return PAYLOAD_SIG_NO_MATCH;
+    }
+
+    const PAYLOAD_SIG_STATE *states = ctx->states;
+    const UINT64 *reach = ctx->reach;
+
+    const UINT32 prefilterLength = ctx->prefilterLength;
+    // Mask of the bigram hash (AtfPayloadSigBigramHash), which the loops below compute inline
+    const UINT32 hashMask = (1UL << ctx->domainBits) - 1;
+
+    // Bytes before the last one of a candidate
+    const size_t window = prefilterLength - 1;
+
+    // The lane a literal of any bucket completes its prefix in, and the lanes of the bytes of a stride
+    const UINT64 laneMask = 0xffULL << ((prefilterLength - 2) * 8);
+    const UINT64 strideMask = 0xffffffffULL << ((prefilterLength - 2) * 8);
+
+    UINT64 shiftOr = stream->shiftOr;
+    UINT32 prev = (UINT8)stream->history;
+    UINT32 state = stream->state;
+
+    size_t i = 0;
+    while (i < dataLength) {
+        if (!state) {
+            //
+            // Prefilter, PAYLOAD_SIG_STRIDE bytes at a time while none of them completes the prefix of a bucket.
+            //  The reach entries have no bit above lane prefilterLength - 2, so after a stride, lane
+            //  prefilterLength - 2 + k holds the check of the byte k bytes before the last one
+            //
+            while (i + PAYLOAD_SIG_STRIDE <= dataLength) {
+                const UINT32 c0 = data[i];
+                const UINT32 c1 = data[i + 1];
+                const UINT32 c2 = data[i + 2];
+                const UINT32 c3 = data[i + 3];
+
+                const UINT64 next = (shiftOr << 32) |
+                    (reach[(prev | (c0 << 8)) & hashMask] << 24) |
+                    (reach[(c0 | (c1 << 8)) & hashMask] << 16) |
+                    (reach[(c1 | (c2 << 8)) & hashMask] << 8) |
+                    reach[(c2 | (c3 << 8)) & hashMask];
+
+                if ((next & strideMask) != strideMask) {
+                    break;
+                }
+
+                shiftOr = next;
+                prev = c3;
+                i += PAYLOAD_SIG_STRIDE;
+            }
+
+            // One byte at a time up to the candidate, which is in the next stride
+            for (; i < dataLength; i++) {
+                const UINT32 c = data[i];
+                shiftOr = (shiftOr << 8) | reach[(prev | (c << 8)) & hashMask];
+                prev = c;
+
+                if ((shiftOr & laneMask) != laneMask) {
+                    break;
+                }
+            }
+
+            if (i == dataLength) {
+                break;
+            }
+
+            //
+            // Confirm the candidate: replay its prefix through the automaton. A prefix that would start before the
+            //  stream is a candidate of the initial state, not of the payload
+            //
+            if (stream->length + i >= window) {
+                for (size_t k = 0; k <= window; k++) {
+                    UINT8 c;
+                    if (i + k >= window) {
+                        c = data[i + k - window];
+                    } else {
+                        // The prefix started in an earlier segment
+                        c = (UINT8)(stream->history >> (8 * (window - i - k - 1)));
+                    }
+
+                    state = AtfPayloadSigStep(ctx, state, c);
+                }
+            }
+        } else {
+            //
+            // Automaton, the prefilter state is kept up to date for when the scan falls back to it
+            //
+            const UINT32 c = data[i];
+            shiftOr = (shiftOr << 8) | reach[(prev | (c << 8)) & hashMask];
+            prev = c;
+
+            state = AtfPayloadSigStep(ctx, state, (UINT8)c);
+        }
+
+        i++;
+
+        if (state) {
+            const UINT32 match = states[state].match;
+            if (match != PAYLOAD_SIG_NO_MATCH) {
+                return match;
+            }
+
+            // Every partial match left is shorter than a prefix, and raises its own candidate
+            if (states[state].depth < prefilterLength) {
+                state = 0;
+            }
+        }
+    }
+
+    // Keep the last bytes, for the candidates that start in this segment and end in the next one
+    UINT64 history = stream->history;
+    for (i = (dataLength > sizeof(UINT64)) ? dataLength - sizeof(UINT64) : 0; i < dataLength; i++) {
+        history = (history << 8) | data[i];
+    }
+
+    stream->shiftOr = shiftOr;
+    stream->history = history;
+    stream->length += dataLength;
+    stream->state = state;
+
+    return PAYLOAD_SIG_NO_MATCH;
+}
+
+const CHAR *AtfPayloadSigGetName(const PAYLOAD_SIG_CTX *ctx, UINT32 signatureId)
+{
+    if (!ctx || signatureId >= ctx->header->numOfSignatures) {
+        return NULL;
+    }
+
+    return &ctx->names[(size_t)signatureId * PAYLOAD_SIG_NAME_SIZE];
+}
+
+VOID AtfPayloadSigPrintCtx(const PAYLOAD_SIG_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    ATF_DEBUGA("[atftrace] Payload Signature Stats: Num of signatures: %lu, Num of states: %lu, Num of dense states: %lu, Prefilter length: %lu, Image size: %llu",
+        ctx->header->numOfSignatures, ctx->header->numOfStates, ctx->header->numOfDenseStates,
+        ctx->prefilterLength, ctx->header->imageSize);
+}
+
+VOID AtfPayloadSigFree(PAYLOAD_SIG_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    PAYLOAD_SIG_CTX *c = *ctx;
+    *ctx = NULL;
+
+    if (--c->refCount) {
+        return;
+    }
+
+    ATF_FREE(c);
+}
+
+static BOOLEAN AtfPayloadSigValidateHeader(const PAYLOAD_SIG_HEADER *header, size_t imageSize)
+{
+    if (header->magic != PAYLOAD_SIG_MAGIC || header->version != PAYLOAD_SIG_VERSION) {
+        ATF_DEBUG(AtfPayloadSigValidateHeader, "Bad image magic or version");
+        return FALSE;
+    }
+
+    if (header->headerSize != sizeof(PAYLOAD_SIG_HEADER) || header->imageSize != imageSize || header->flags) {
+        ATF_DEBUG(AtfPayloadSigValidateHeader, "Bad image size or flags");
+        return FALSE;
+    }
+
+    if (!header->numOfSignatures || header->numOfSignatures > PAYLOAD_SIG_MAX_SIGNATURES ||
+        !header->numOfStates || header->numOfStates > PAYLOAD_SIG_MAX_STATES ||
+        header->numOfEdges > header->numOfStates ||
+        !header->numOfDenseStates || header->numOfDenseStates > header->numOfStates)
+    {
+        ATF_DEBUG(AtfPayloadSigValidateHeader, "Bad image counts");
+        return FALSE;
+    }
+
+    if (header->prefilterLength < PAYLOAD_SIG_MIN_PREFILTER_LENGTH ||
+        header->prefilterLength > PAYLOAD_SIG_MAX_PREFILTER_LENGTH ||
+        header->domainBits < PAYLOAD_SIG_MIN_DOMAIN_BITS ||
+        header->domainBits > PAYLOAD_SIG_MAX_DOMAIN_BITS)
+    {
+        ATF_DEBUG(AtfPayloadSigValidateHeader, "Bad image prefilter parameters");
+        return FALSE;
+    }
+
+    if (!AtfPayloadSigValidateSection(header, header->statesOffset, header->numOfStates, sizeof(PAYLOAD_SIG_STATE)) ||
+        !AtfPayloadSigValidateSection(header, header->edgeTargetsOffset, header->numOfEdges, sizeof(UINT32)) ||
+        !AtfPayloadSigValidateSection(header, header->edgeCharsOffset, header->numOfEdges, sizeof(UINT8)) ||
+        !AtfPayloadSigValidateSection(header, header->denseOffset,
+            (UINT64)header->numOfDenseStates * PAYLOAD_SIG_ALPHABET_SIZE, sizeof(UINT32)) ||
+        !AtfPayloadSigValidateSection(header, header->reachOffset, 1ULL << header->domainBits, sizeof(UINT64)) ||
+        !AtfPayloadSigValidateSection(header, header->namesOffset, header->numOfSignatures, PAYLOAD_SIG_NAME_SIZE))
+    {
+        ATF_DEBUG(AtfPayloadSigValidateHeader, "Image section out of bounds");
+        return FALSE;
+    }
+
+    const UINT8 *payload = (const UINT8 *)header + sizeof(PAYLOAD_SIG_HEADER);
+    if (AtfIpv4ImageChecksum(payload, imageSize - sizeof(PAYLOAD_SIG_HEADER)) != header->checksum) {
+        ATF_DEBUG(AtfPayloadSigValidateHeader, "Image checksum mismatch");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN AtfPayloadSigValidateSection(
+    const PAYLOAD_SIG_HEADER *header,
+    UINT64 offset,
+    UINT64 count,
+    UINT64 elementSize
+)
+{
+    // Counts are bounded by the header checks, the section size cannot overflow
+    return offset >= sizeof(PAYLOAD_SIG_HEADER) &&
+        !(offset % PAYLOAD_SIG_ALIGNMENT) &&
+        offset <= header->imageSize &&
+        count * elementSize <= header->imageSize - offset;
+}
+
+static BOOLEAN AtfPayloadSigValidateAutomaton(const PAYLOAD_SIG_CTX *ctx)
+{
+    const PAYLOAD_SIG_HEADER *header = ctx->header;
+
+    // The failure chains end at the root, which must have a transition for every char
+    if (!(ctx->states[0].flags & PAYLOAD_SIG_STATE_DENSE) || ctx->states[0].fail || ctx->states[0].depth) {
+        ATF_DEBUG(AtfPayloadSigValidateAutomaton, "Image root is not a dense state");
+        return FALSE;
+    }
+
+    for (UINT32 s = 0; s < header->numOfStates; s++) {
+        const PAYLOAD_SIG_STATE *state = &ctx->states[s];
+
+        if ((s && state->fail >= s) ||
+            (state->match != PAYLOAD_SIG_NO_MATCH && state->match >= header->numOfSignatures) ||
+            (state->flags & ~PAYLOAD_SIG_STATE_DENSE))
+        {
+            ATF_DEBUGA("[atftrace] Payload signature state %lu is malformed", s);
+            return FALSE;
+        }
+
+        if (state->flags & PAYLOAD_SIG_STATE_DENSE) {
+            if (state->edges >= header->numOfDenseStates) {
+                ATF_DEBUGA("[atftrace] Payload signature state %lu has a bad dense row", s);
+                return FALSE;
+            }
+
+            continue;
+        }
+
+        if ((UINT64)state->edges + state->numOfEdges > header->numOfEdges) {
+            ATF_DEBUGA("[atftrace] Payload signature state %lu has edges out of bounds", s);
+            return FALSE;
+        }
+
+        // The step stops at the first char above the one it searches for
+        const UINT8 *chars = &ctx->edgeChars[state->edges];
+        const UINT32 *targets = &ctx->edgeTargets[state->edges];
+        for (UINT32 i = 0; i < state->numOfEdges; i++) {
+            if ((i && chars[i] <= chars[i - 1]) || targets[i] >= header->numOfStates) {
+                ATF_DEBUGA("[atftrace] Payload signature state %lu has a bad edge", s);
+                return FALSE;
+            }
+        }
+    }
+
+    const UINT64 numOfTargets = (UINT64)header->numOfDenseStates * PAYLOAD_SIG_ALPHABET_SIZE;
+    for (UINT64 i = 0; i < numOfTargets; i++) {
+        if (ctx->dense[i] >= header->numOfStates) {
+            ATF_DEBUG(AtfPayloadSigValidateAutomaton, "Image dense row has a bad target");
+            return FALSE;
+        }
+    }
+
+    // The stride check of the prefilter relies on the lanes above the prefix being clear
+    const UINT64 reachMask = ~((1ULL << ((ctx->prefilterLength - 1) * 8)) - 1);
+    for (UINT32 i = 0; i < (1UL << ctx->domainBits); i++) {
+        if (ctx->reach[i] & reachMask) {
+            ATF_DEBUG(AtfPayloadSigValidateAutomaton, "Image reach entry has bits above the prefix");
+            return FALSE;
+        }
+    }
+
+    for (UINT32 i = 0; i < header->numOfSignatures; i++) {
+        if (ctx->names[(size_t)i * PAYLOAD_SIG_NAME_SIZE + PAYLOAD_SIG_NAME_SIZE - 1]) {
+            ATF_DEBUG(AtfPayloadSigValidateAutomaton, "Image signature name is not terminated");
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static __forceinline UINT32 AtfPayloadSigStep(const PAYLOAD_SIG_CTX *ctx, UINT32 state, UINT8 c)
+{
+    // Failure states are lower than their state, the loop ends at the latest on the root, which is dense
+    for (;;) {
+        const PAYLOAD_SIG_STATE *s = &ctx->states[state];
+        if (s->flags & PAYLOAD_SIG_STATE_DENSE) {
+            return ctx->dense[(size_t)s->edges * PAYLOAD_SIG_ALPHABET_SIZE + c];
+        }
+
+        const UINT8 *chars = &ctx->edgeChars[s->edges];
+        for (UINT32 i = 0; i < s->numOfEdges; i++) {
+            if (chars[i] == c) {
+                return ctx->edgeTargets[s->edges + i];
+            }
+
+            if (chars[i] > c) {
+                break;
+            }
+        }
+
+        state = s->fail;
+    }
+}
+
+//EOF
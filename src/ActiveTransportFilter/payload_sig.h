@@ -0,0 +1,118 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/payload_sig_format.h"
+
+#include "mem.h"
+
+//
+// Payload signatures, literals compiled by the service into a prefilter and an Aho-Corasick automaton (see
+//  payload_sig_format.h)
+//
+//  As with the other images, the driver validates the image once, copies it into a single non-paged allocation and
+//   scans with it in place. The validation checks every state, edge and dense row, and that every failure state is
+//   lower than its state, so a scan never reads out of the image and every failure chain ends at the root.
+//
+//  A stream is scanned segment by segment, in place: the state carried from one segment to the next
+//   (PAYLOAD_SIG_STREAM) is the prefilter state, the automaton state and the last bytes of the stream, so a literal
+//   split over segments is found without copying or buffering any payload.
+//
+//  The scan runs the prefilter until it reports a candidate, then replays the prefilterLength bytes of the candidate
+//   through the automaton from the root, and stays in the automaton while its state is at least prefilterLength
+//   deep. Below that depth the partial matches are all shorter than the prefix of any literal, each of them raises
+//   its own candidate once its prefix is complete, so the scan falls back to the prefilter without missing a match.
+//
+//  An image is never modified after it is adopted, so configs cloned from each other share it. The reference count
+//   is only changed by the IOCTL handlers (serialized by gIoctlLock), never by the callouts.
+//
+
+//
+// Scan state of one direction of a stream
+//
+typedef struct _payload_sig_stream {
+    // Prefilter state, one lane per byte
+    UINT64                          shiftOr;
+
+    // Last bytes of the stream, the last one in the low byte
+    UINT64                          history;
+
+    // Bytes scanned since the stream was reset
+    UINT64                          length;
+
+    // Automaton state, 0 (the root) while the prefilter runs
+    UINT32                          state;
+} PAYLOAD_SIG_STREAM, *PPAYLOAD_SIG_STREAM;
+
+//
+// Image instance context, the image itself follows the context in the same allocation
+//
+typedef struct _payload_sig_ctx {
+    // Number of configs referencing the image
+    size_t                          refCount;
+
+    // Size of the whole allocation (context and image), in bytes
+    size_t                          totalSize;
+
+    // Unique per adopted image, streams scanned with another image are reset (AtfPayloadSigResetStream)
+    UINT32                          imageId;
+
+    const PAYLOAD_SIG_HEADER        *header;
+
+    const PAYLOAD_SIG_STATE         *states;
+    const UINT32                    *edgeTargets;
+    const UINT8                     *edgeChars;
+    const UINT32                    *dense;
+    const UINT64                    *reach;
+    const CHAR                      *names;
+
+    UINT32                          prefilterLength;
+    UINT32                          domainBits;
+} PAYLOAD_SIG_CTX, *PPAYLOAD_SIG_CTX;
+
+//
+// Validate an image (header, bounds, checksum, every state, edge and dense row) and copy it into a new context
+//  Returns ATF_CORRUPT_IMAGE if the image is rejected
+//
+ATF_ERROR AtfPayloadSigAdopt(const VOID *image, size_t imageSize, PAYLOAD_SIG_CTX **ctxOut);
+
+//
+// Take another reference on the image, for a cloned config
+//
+PAYLOAD_SIG_CTX *AtfPayloadSigReference(PAYLOAD_SIG_CTX *ctx);
+
+//
+// Start a stream, or start over after a gap in it
+//
+VOID AtfPayloadSigResetStream(PAYLOAD_SIG_STREAM *stream);
+
+//
+// Scan the next segment of a stream, callable at any IRQL <= DISPATCH_LEVEL
+//  Returns the id of the first signature found, or PAYLOAD_SIG_NO_MATCH. The stream must be reset before it is
+//  scanned again after a match
+//
+UINT32 AtfPayloadSigScan(
+    _In_ const PAYLOAD_SIG_CTX *ctx,
+    _Inout_ PAYLOAD_SIG_STREAM *stream,
+    _In_ const UINT8 *data,
+    _In_ size_t dataLength
+);
+
+//
+// Returns the name of a signature (NULL terminated), or NULL if the id is out of range
+//
+const CHAR *AtfPayloadSigGetName(const PAYLOAD_SIG_CTX *ctx, UINT32 signatureId);
+
+//
+// Print image info
+//
+VOID AtfPayloadSigPrintCtx(const PAYLOAD_SIG_CTX *ctx);
+
+//
+// Drop a reference to the image, the image is freed with the last reference
+//
+VOID AtfPayloadSigFree(PAYLOAD_SIG_CTX **ctx);
+
+//EOF
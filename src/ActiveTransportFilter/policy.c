@@ -0,0 +1,272 @@
+#include <ntddk.h>
+
+#include "policy.h"
+
+#include "trace.h"
+
+C_ASSERT(sizeof(POLICY_INSN) == 8);
+C_ASSERT(POLICY_OP_RET < POLICY_OP_JA && POLICY_OP_RET_RULE < POLICY_OP_JA);
+
+//
+// What the verifier knows on every path to an instruction
+//
+#define POLICY_STATE_REACHED            0x01
+#define POLICY_STATE_RULE_MATCHED       0x02
+#define POLICY_STATE_SET_MATCHED        0x04
+
+//
+// Returns TRUE if the operands of an instruction are in range
+//
+static BOOLEAN AtfPolicyIsValidInsn(const POLICY_INSN *insn);
+
+//
+// Merge the state of a branch into its target, only the facts known on both paths are kept
+//  Returns FALSE if the target is past the end of the program
+//
+static BOOLEAN AtfPolicyMergeState(UINT8 *states, size_t numOfInsns, size_t target, UINT8 state);
+
+//
+// Offset of a branch of instruction pc, past the jump it lands on if there is one and the offset fits
+//
+static UINT8 AtfPolicyThreadJump(const POLICY_INSN *insns, size_t numOfInsns, size_t pc, UINT8 offset);
+
+ATF_ERROR AtfPolicyVerify(const POLICY_INSN *insns, size_t numOfInsns)
+{
+    if (!insns || !numOfInsns || numOfInsns > POLICY_MAX_INSNS) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    UINT8 states[POLICY_MAX_INSNS];
+    RtlZeroMemory(states, sizeof(states));
+    states[0] = POLICY_STATE_REACHED;
+
+    // Jumps only go forward, so every branch into an instruction is merged before it is visited
+    for (size_t pc = 0; pc < numOfInsns; pc++) {
+        const POLICY_INSN *insn = &insns[pc];
+
+        if (!AtfPolicyIsValidInsn(insn)) {
+            ATF_DEBUGA("[atftrace] Policy instruction %llu is invalid (opcode %d)", (UINT64)pc, insn->opcode);
+            return ATF_BAD_PARAMETERS;
+        }
+
+        //
+        // AtfPolicySpecialize() threads the jumps of every instruction, reached or not, so none may jump past the end
+        //
+        if (insn->opcode != POLICY_OP_RET && insn->opcode != POLICY_OP_RET_RULE &&
+            (pc + 1 + insn->jt >= numOfInsns || (insn->opcode != POLICY_OP_JA && pc + 1 + insn->jf >= numOfInsns))) 
+        {
+            ATF_DEBUGA("[atftrace] Policy instruction %llu jumps past the end", (UINT64)pc);
+            return ATF_BAD_PARAMETERS;
+        }
+
+        const UINT8 state = states[pc];
+        if (!state) {
+            continue;
+        }
+
+        UINT8 trueState = state;
+        BOOLEAN isValid = TRUE;
+
+        switch (insn->opcode)
+        {
+        case POLICY_OP_RET:
+            {
+                continue;
+            }
+            break;
+        case POLICY_OP_RET_RULE:
+            {
+                if (!(state & POLICY_STATE_RULE_MATCHED)) {
+                    ATF_DEBUGA("[atftrace] Policy instruction %llu returns a rule that may not have matched", (UINT64)pc);
+                    return ATF_BAD_PARAMETERS;
+                }
+                continue;
+            }
+            break;
+        case POLICY_OP_JA:
+            {
+                isValid = AtfPolicyMergeState(states, numOfInsns, pc + 1 + insn->jt, state);
+                if (!isValid) {
+                    ATF_DEBUGA("[atftrace] Policy instruction %llu jumps past the end", (UINT64)pc);
+                    return ATF_BAD_PARAMETERS;
+                }
+                continue;
+            }
+            break;
+        case POLICY_OP_JAPPROXIMATE:
+            {
+                if (!(state & POLICY_STATE_SET_MATCHED)) {
+                    ATF_DEBUGA("[atftrace] Policy instruction %llu tests a set match that may not exist", (UINT64)pc);
+                    return ATF_BAD_PARAMETERS;
+                }
+            }
+            break;
+        case POLICY_OP_JSET:
+            {
+                trueState |= POLICY_STATE_SET_MATCHED;
+            }
+            break;
+        case POLICY_OP_JRULE:
+            {
+                trueState |= POLICY_STATE_RULE_MATCHED;
+            }
+            break;
+        default:
+            {
+            }
+            break;
+        }
+
+        isValid = AtfPolicyMergeState(states, numOfInsns, pc + 1 + insn->jt, trueState) &&
+            AtfPolicyMergeState(states, numOfInsns, pc + 1 + insn->jf, state);
+        if (!isValid) {
+            ATF_DEBUGA("[atftrace] Policy instruction %llu jumps past the end", (UINT64)pc);
+            return ATF_BAD_PARAMETERS;
+        }
+    }
+
+    return ATF_ERROR_OK;
+}
+
+size_t AtfPolicySpecialize(const POLICY_INSN *insns, size_t numOfInsns, UINT32 layer, POLICY_INSN *insnsOut)
+{
+    RtlCopyMemory(insnsOut, insns, numOfInsns * sizeof(POLICY_INSN));
+
+    // Tests with the same result on every flow of the layer become jumps
+    for (size_t pc = 0; pc < numOfInsns; pc++) {
+        POLICY_INSN *insn = &insnsOut[pc];
+
+        BOOLEAN isResolved = TRUE;
+        BOOLEAN isTrue = FALSE;
+
+        switch (insn->opcode)
+        {
+        case POLICY_OP_JLAYER:
+            {
+                isTrue = layer == insn->k;
+            }
+            break;
+        case POLICY_OP_JRULE:
+            {
+                // The rules only match IPv4 flows
+                isResolved = layer == POLICY_LAYER_TRANSPORT_V6;
+            }
+            break;
+        case POLICY_OP_JSET:
+            {
+                isResolved = layer == POLICY_LAYER_TRANSPORT_V4 && insn->arg == POLICY_SET_IPV6_BLOCKLIST;
+            }
+            break;
+        default:
+            {
+                isResolved = FALSE;
+            }
+            break;
+        }
+
+        if (isResolved) {
+            insn->opcode = POLICY_OP_JA;
+            insn->arg = 0;
+            insn->jt = isTrue ? insn->jt : insn->jf;
+            insn->jf = 0;
+            insn->k = 0;
+        }
+    }
+
+    // Jumps only go forward, so the targets are already threaded when an instruction is visited
+    for (size_t pc = numOfInsns; pc-- > 0;) {
+        POLICY_INSN *insn = &insnsOut[pc];
+        if (insn->opcode == POLICY_OP_RET || insn->opcode == POLICY_OP_RET_RULE) {
+            continue;
+        }
+
+        insn->jt = AtfPolicyThreadJump(insnsOut, numOfInsns, pc, insn->jt);
+        if (insn->opcode != POLICY_OP_JA) {
+            insn->jf = AtfPolicyThreadJump(insnsOut, numOfInsns, pc, insn->jf);
+        }
+    }
+
+    // The first instruction can be a jump too
+    return insnsOut[0].opcode == POLICY_OP_JA ? 1 + (size_t)insnsOut[0].jt : 0;
+}
+
+static UINT8 AtfPolicyThreadJump(const POLICY_INSN *insns, size_t numOfInsns, size_t pc, UINT8 offset)
+{
+    if (pc + 1 + offset >= numOfInsns) {
+        return offset;
+    }
+
+    const POLICY_INSN *target = &insns[pc + 1 + offset];
+    if (target->opcode != POLICY_OP_JA) {
+        return offset;
+    }
+
+    const size_t threadedOffset = (size_t)offset + 1 + target->jt;
+
+    return threadedOffset <= 0xff && pc + 1 + threadedOffset < numOfInsns ? (UINT8)threadedOffset : offset;
+}
+
+static BOOLEAN AtfPolicyIsValidInsn(const POLICY_INSN *insn)
+{
+    switch (insn->opcode)
+    {
+    case POLICY_OP_RET:
+        {
+            return insn->k <= ACTION_ALERT;
+        }
+        break;
+    case POLICY_OP_JLAYER:
+        {
+            return insn->k <= POLICY_LAYER_TRANSPORT_V6;
+        }
+        break;
+    case POLICY_OP_JDIRECTION:
+        {
+            return insn->k == RULE_DIRECTION_INBOUND || insn->k == RULE_DIRECTION_OUTBOUND;
+        }
+        break;
+    case POLICY_OP_JPROTOCOL:
+        {
+            return insn->k <= 0xff;
+        }
+        break;
+    case POLICY_OP_JLOCAL_PORT:
+    case POLICY_OP_JREMOTE_PORT:
+        {
+            return (insn->k & 0xffff) <= (insn->k >> 16);
+        }
+        break;
+    case POLICY_OP_JSET:
+        {
+            return insn->arg < POLICY_NUM_OF_SETS && insn->k && !(insn->k & ~POLICY_ADDRESS_ANY);
+        }
+        break;
+    case POLICY_OP_RET_RULE:
+    case POLICY_OP_JA:
+    case POLICY_OP_JAPPROXIMATE:
+    case POLICY_OP_JRULE:
+        {
+            return TRUE;
+        }
+        break;
+    default:
+        {
+        }
+        break;
+    }
+
+    return FALSE;
+}
+
+static BOOLEAN AtfPolicyMergeState(UINT8 *states, size_t numOfInsns, size_t target, UINT8 state)
+{
+    if (target >= numOfInsns) {
+        return FALSE;
+    }
+
+    states[target] = states[target] ? (states[target] & state) : state;
+
+    return TRUE;
+}
+
+//EOF
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/policy_format.h"
+
+#include "ipv4_tss.h"
+
+//
+// Verdict policy interpreter (see policy_format.h)
+//
+//  The program is verified once, when the config is created, so the interpreter does no bounds or operand checks.
+//   Lookups are supplied by the caller (filter.c) and run when an instruction needs them, at most once per set.
+//
+//  POLICY_OP_RET and POLICY_OP_RET_RULE must stay the lowest opcodes, the interpreter loops while the opcode is above them.
+//
+
+// No POLICY_OP_JSET matched
+#define POLICY_SET_NONE                 0xff
+
+//
+// Search the local and remote address of the flow in a set (POLICY_SET_*). A prefix length of 0 is a miss
+//
+typedef VOID POLICY_SEARCH_SET_FN(
+    _In_ const VOID *lookupCtx,
+    _In_ UINT32 set,
+    _Out_ UINT8 prefixLengths[2],
+    _Out_ BOOLEAN *isApproximate
+);
+
+//
+// Classify the flow against the 5-tuple rules, returns FALSE if no rule matches
+//
+typedef BOOLEAN POLICY_CLASSIFY_FN(
+    _In_ const VOID *lookupCtx,
+    _Out_ IPV4_TSS_RULE *ruleOut
+);
+
+//
+// Flow a program runs on
+//
+typedef struct _policy_env {
+    UINT8                           layer;
+    UINT8                           direction;
+    UINT8                           protocol;
+    SERVICE_PORT                    localPort;
+    SERVICE_PORT                    remotePort;
+
+    // ClassifyRules may be NULL, no rule matches then
+    POLICY_SEARCH_SET_FN            *SearchSet;
+    POLICY_CLASSIFY_FN              *ClassifyRules;
+    const VOID                      *lookupCtx;
+} POLICY_ENV, *PPOLICY_ENV;
+
+//
+// Result of a program, and what it matched for the event log
+//
+typedef struct _policy_verdict {
+    ACTION_OPTS                     action;
+
+    // Last POLICY_OP_JSET match, set is POLICY_SET_NONE if there was none
+    UINT8                           set;
+    UINT8                           prefixLength;
+    BOOLEAN                         isRemote;
+    BOOLEAN                         isApproximate;
+
+    // The action is the one of a 5-tuple rule (POLICY_OP_RET_RULE)
+    BOOLEAN                         isRule;
+    UINT32                          ruleId;
+} POLICY_VERDICT, *PPOLICY_VERDICT;
+
+//
+// Check that a program terminates and only reads results it has computed
+//  Returns ATF_BAD_PARAMETERS if the program is rejected
+//
+ATF_ERROR AtfPolicyVerify(const POLICY_INSN *insns, size_t numOfInsns);
+
+//
+// Specialize a verified program for a layer (POLICY_LAYER_*), insnsOut holds numOfInsns instructions
+//  Tests that have the same result on every flow of the layer (POLICY_OP_JLAYER, POLICY_OP_JRULE on IPv6 and the IPv6
+//  blocklist on IPv4) are resolved into jumps, and branches to a jump are threaded to its target, so neither is
+//  dispatched per flow. Branches that would need an offset over 255 are left as they are.
+//  Returns the index the specialized program starts at
+//
+size_t AtfPolicySpecialize(const POLICY_INSN *insns, size_t numOfInsns, UINT32 layer, POLICY_INSN *insnsOut);
+
+//
+// Run a verified program on a flow
+//  Inlined into each callout, so that each layer has its own dispatch branch and the lookups are direct calls.
+//  Tests loop until a return is reached, the next instruction is computed without a branch on the test result
+//
+static __forceinline VOID AtfPolicyRun(const POLICY_INSN *insns, const POLICY_ENV *env, POLICY_VERDICT *verdictOut)
+{
+    // Lookup results, by set
+    UINT8 prefixLengths[POLICY_NUM_OF_SETS][2];
+    BOOLEAN isApproximate[POLICY_NUM_OF_SETS];
+    UINT32 searchedSets = 0;
+
+    // Only read after POLICY_OP_JRULE matched (checked by the verifier)
+    IPV4_TSS_RULE rule;
+
+    verdictOut->action = ACTION_PASS;
+    verdictOut->set = POLICY_SET_NONE;
+    verdictOut->prefixLength = 0;
+    verdictOut->isRemote = FALSE;
+    verdictOut->isApproximate = FALSE;
+    verdictOut->isRule = FALSE;
+    verdictOut->ruleId = 0;
+
+    // The verifier guarantees that every path ends in a return
+    const POLICY_INSN *insn = insns;
+    while (insn->opcode > POLICY_OP_RET_RULE) {
+        BOOLEAN isTrue = FALSE;
+
+        switch (insn->opcode)
+        {
+        case POLICY_OP_JA:
+            {
+                isTrue = TRUE;
+            }
+            break;
+        case POLICY_OP_JLAYER:
+            {
+                isTrue = env->layer == insn->k;
+            }
+            break;
+        case POLICY_OP_JDIRECTION:
+            {
+                isTrue = env->direction == insn->k;
+            }
+            break;
+        case POLICY_OP_JPROTOCOL:
+            {
+                isTrue = env->protocol == insn->k;
+            }
+            break;
+        case POLICY_OP_JLOCAL_PORT:
+            {
+                isTrue = env->localPort >= (insn->k & 0xffff) && env->localPort <= (insn->k >> 16);
+            }
+            break;
+        case POLICY_OP_JREMOTE_PORT:
+            {
+                isTrue = env->remotePort >= (insn->k & 0xffff) && env->remotePort <= (insn->k >> 16);
+            }
+            break;
+        case POLICY_OP_JSET:
+            {
+                const UINT32 set = insn->arg;
+                if (!(searchedSets & (1UL << set))) {
+                    env->SearchSet(env->lookupCtx, set, prefixLengths[set], &isApproximate[set]);
+                    searchedSets |= 1UL << set;
+                }
+
+                const UINT8 localPrefixLength = (insn->k & POLICY_ADDRESS_LOCAL) ? prefixLengths[set][0] : 0;
+                const UINT8 remotePrefixLength = (insn->k & POLICY_ADDRESS_REMOTE) ? prefixLengths[set][1] : 0;
+
+                isTrue = localPrefixLength || remotePrefixLength;
+                if (isTrue) {
+                    verdictOut->set = (UINT8)set;
+                    verdictOut->isRemote = remotePrefixLength != 0;
+                    verdictOut->prefixLength = remotePrefixLength ? remotePrefixLength : localPrefixLength;
+                    verdictOut->isApproximate = isApproximate[set];
+                }
+            }
+            break;
+        case POLICY_OP_JAPPROXIMATE:
+            {
+                isTrue = verdictOut->isApproximate;
+            }
+            break;
+        case POLICY_OP_JRULE:
+            {
+                isTrue = env->ClassifyRules && env->ClassifyRules(env->lookupCtx, &rule);
+            }
+            break;
+        default:
+            {
+                // Rejected by the verifier
+            }
+            break;
+        }
+
+        const UINT32 trueMask = 0 - (UINT32)isTrue;
+        insn += 1 + ((insn->jt & trueMask) | (insn->jf & ~trueMask));
+    }
+
+    if (insn->opcode == POLICY_OP_RET_RULE) {
+        verdictOut->action = (ACTION_OPTS)rule.action;
+        verdictOut->isRule = TRUE;
+        verdictOut->ruleId = rule.ruleId;
+        return;
+    }
+
+    verdictOut->action = (ACTION_OPTS)insn->k;
+}
+
+//EOF
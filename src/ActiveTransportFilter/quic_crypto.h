@@ -0,0 +1,86 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+
+//
+// The primitives of the QUIC v1 Initial packet protection (RFC 9001 5): HKDF-SHA256 (RFC 5869) to derive the keys,
+//  and the AES-128 block function for both the header protection mask and the AES-128-GCM payload keystream
+//
+//  The Initial keys are derived from the Destination Connection ID the client chose, which is in clear in the packet,
+//   so they protect nothing from an observer and are no secret of the host. This is why the primitives can be plain,
+//   table driven C, with no provider handle to open and no IRQL constraint: they are callable at DISPATCH_LEVEL,
+//   never allocate, and only ever process the public keys of the Initial packets.
+//
+//  Only the encryption direction of AES is needed, GCM decrypts with the keystream of its counter mode (see
+//   quic_parser.h). The GCM tag is not checked, the payload is only parsed.
+//
+#define QUIC_SHA256_SIZE                32
+#define QUIC_SHA256_BLOCK_SIZE          64
+
+#define QUIC_AES_BLOCK_SIZE             16
+#define QUIC_AES128_KEY_SIZE            16
+#define QUIC_AES128_ROUNDS              10
+
+//
+// Expanded AES-128 encryption key
+//
+typedef struct _quic_aes128_ctx {
+    UINT32                          roundKeys[4 * (QUIC_AES128_ROUNDS + 1)];
+} QUIC_AES128_CTX, *PQUIC_AES128_CTX;
+
+//
+// Expand an AES-128 key
+//
+VOID AtfQuicAes128Init(_Out_ QUIC_AES128_CTX *ctx, _In_ const UINT8 key[QUIC_AES128_KEY_SIZE]);
+
+//
+// Encrypt one block, in and out may be the same buffer
+//
+VOID AtfQuicAes128Encrypt(
+    _In_ const QUIC_AES128_CTX *ctx,
+    _In_ const UINT8 in[QUIC_AES_BLOCK_SIZE],
+    _Out_ UINT8 out[QUIC_AES_BLOCK_SIZE]
+);
+
+//
+// SHA-256 of a message
+//
+VOID AtfQuicSha256(_In_ const UINT8 *data, _In_ size_t dataLength, _Out_ UINT8 digestOut[QUIC_SHA256_SIZE]);
+
+//
+// HMAC-SHA256 of a message, keys longer than a block are hashed first
+//
+VOID AtfQuicHmacSha256(
+    _In_ const UINT8 *key,
+    _In_ size_t keyLength,
+    _In_ const UINT8 *data,
+    _In_ size_t dataLength,
+    _Out_ UINT8 macOut[QUIC_SHA256_SIZE]
+);
+
+//
+// HKDF-Extract (RFC 5869 2.2)
+//
+VOID AtfQuicHkdfExtract(
+    _In_ const UINT8 *salt,
+    _In_ size_t saltLength,
+    _In_ const UINT8 *ikm,
+    _In_ size_t ikmLength,
+    _Out_ UINT8 prkOut[QUIC_SHA256_SIZE]
+);
+
+//
+// HKDF-Expand-Label of TLS 1.3 (RFC 8446 7.1) with an empty context, as QUIC uses it
+//  label is without the "tls13 " prefix. Returns ATF_BAD_PARAMETERS if outLength is larger than QUIC_SHA256_SIZE
+//  (a single HKDF-Expand block, every QUIC Initial secret fits) or the label is too long
+//
+ATF_ERROR AtfQuicHkdfExpandLabel(
+    _In_ const UINT8 secret[QUIC_SHA256_SIZE],
+    _In_ const CHAR *label,
+    _Out_ UINT8 *out,
+    _In_ size_t outLength
+);
+
+//EOF
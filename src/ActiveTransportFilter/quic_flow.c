@@ -0,0 +1,341 @@
+#include <ntddk.h>
+
+#include "quic_flow.h"
+
+#include "dns_cache.h"
+#include "mem.h"
+#include "trace.h"
+
+//
+// Hash of a flow, its bucket is the low bits
+//
+static __forceinline UINT64 AtfQuicFlowHash(UINT64 seed, const QUIC_FLOW_KEY *key);
+
+//
+// Returns TRUE if both keys are the same flow
+//
+static __forceinline BOOLEAN AtfQuicFlowIsSameKey(const QUIC_FLOW_KEY *a, const QUIC_FLOW_KEY *b);
+
+//
+// Take the pending slot of a flow, reset if it held another flow or had expired. Returns NULL if another callout
+//  owns it
+//
+static QUIC_FLOW_PENDING *AtfQuicFlowAcquirePending(QUIC_FLOW_CTX *ctx, const QUIC_FLOW_KEY *key, UINT64 hash, UINT32 now);
+
+//
+// Give a pending slot back, freeing it if its flow is decided
+//
+static VOID AtfQuicFlowReleasePending(QUIC_FLOW_PENDING *pending, BOOLEAN isDecided);
+
+ATF_ERROR AtfQuicFlowAllocCtx(QUIC_FLOW_CTX **ctxOut)
+{
+    if (!ctxOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+    *ctxOut = NULL;
+
+    QUIC_FLOW_CTX *ctx = (QUIC_FLOW_CTX *)ATF_MALLOC(sizeof(QUIC_FLOW_CTX));
+    if (!ctx) {
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    // Allocations of a page or more are page aligned, so every slot is on its own cache line
+    ctx->slots = (QUIC_FLOW_SLOT *)ATF_MALLOC(QUIC_FLOW_NUM_OF_BUCKETS * QUIC_FLOW_BUCKET_SLOTS * sizeof(QUIC_FLOW_SLOT));
+    ctx->pending = (QUIC_FLOW_PENDING *)ATF_MALLOC(QUIC_FLOW_NUM_OF_PENDING * sizeof(QUIC_FLOW_PENDING));
+    if (!ctx->slots || !ctx->pending) {
+        if (ctx->slots) {
+            ATF_FREE(ctx->slots);
+        }
+        if (ctx->pending) {
+            ATF_FREE(ctx->pending);
+        }
+        ATF_FREE(ctx);
+        return ATF_NO_MEMORY_AVAILABLE;
+    }
+
+    LARGE_INTEGER counter = KeQueryPerformanceCounter(NULL);
+    ctx->seed = (UINT64)counter.QuadPart;
+    ctx->refCount = 1;
+
+    *ctxOut = ctx;
+
+    return ATF_ERROR_OK;
+}
+
+QUIC_FLOW_CTX *AtfQuicFlowReference(QUIC_FLOW_CTX *ctx)
+{
+    if (ctx) {
+        ctx->refCount++;
+    }
+
+    return ctx;
+}
+
+UINT8 AtfQuicFlowInspect(
+    _In_ QUIC_FLOW_CTX *ctx,
+    _In_ const DOMAIN_DAFSA_CTX *domainCtx,
+    _In_ const QUIC_FLOW_KEY *key,
+    _In_ const UINT8 *datagram,
+    _In_ size_t datagramLength,
+    _In_ BOOLEAN isBlocking,
+    _In_ UINT32 now,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *domainLengthOut
+)
+{
+    *nameLengthOut = 0;
+    *domainLengthOut = 0;
+
+    if (!ctx || !domainCtx || !key || !datagram || !nameOut) {
+        return QUIC_FLOW_UNDECIDED;
+    }
+
+    if (!AtfQuicIsInitial(datagram, datagramLength)) {
+        return QUIC_FLOW_UNDECIDED;
+    }
+
+    UINT8 verdict = AtfQuicFlowLookup(ctx, key, now);
+    if (verdict != QUIC_FLOW_UNDECIDED) {
+        return verdict;
+    }
+
+    QUIC_INITIAL_HEADER header;
+    if (AtfQuicParseInitialHeader(datagram, datagramLength, &header) != ATF_ERROR_OK) {
+        return QUIC_FLOW_UNDECIDED;
+    }
+
+    QUIC_FLOW_PENDING *pending = AtfQuicFlowAcquirePending(ctx, key, AtfQuicFlowHash(ctx->seed, key), now);
+    if (!pending) {
+        return QUIC_FLOW_UNDECIDED;
+    }
+
+    // The keys of every client Initial come from the Destination Connection ID of the first one
+    if (!pending->numOfPackets &&
+        AtfQuicDeriveInitialKeys(&datagram[header.dcidOffset], header.dcidLength, &pending->keys) != ATF_ERROR_OK)
+    {
+        AtfQuicFlowReleasePending(pending, TRUE);
+        return QUIC_FLOW_UNDECIDED;
+    }
+    pending->numOfPackets++;
+
+    const TLS_HELLO_RESULT result =
+        AtfQuicReadClientHello(datagram, &header, &pending->keys, &pending->stream, nameOut, nameLengthOut);
+    if (result == TLS_HELLO_INCOMPLETE && pending->numOfPackets < QUIC_FLOW_MAX_PACKETS) {
+        AtfQuicFlowReleasePending(pending, FALSE);
+        return QUIC_FLOW_UNDECIDED;
+    }
+
+    AtfQuicFlowReleasePending(pending, TRUE);
+
+    verdict = QUIC_FLOW_PASS;
+    if (result == TLS_HELLO_NAME) {
+        *domainLengthOut = AtfDomainDafsaSearch(domainCtx, nameOut, *nameLengthOut);
+        if (*domainLengthOut && isBlocking) {
+            verdict = QUIC_FLOW_BLOCK;
+        }
+    }
+
+    AtfQuicFlowDecide(ctx, key, verdict, now);
+
+    return verdict;
+}
+
+UINT8 AtfQuicFlowLookup(_In_ const QUIC_FLOW_CTX *ctx, _In_ const QUIC_FLOW_KEY *key, _In_ UINT32 now)
+{
+    if (!ctx || !key) {
+        return QUIC_FLOW_UNDECIDED;
+    }
+
+    const size_t bucketIndex = (size_t)(AtfQuicFlowHash(ctx->seed, key) & (QUIC_FLOW_NUM_OF_BUCKETS - 1));
+    const QUIC_FLOW_SLOT *bucket = &ctx->slots[bucketIndex * QUIC_FLOW_BUCKET_SLOTS];
+    for (UINT32 i = 0; i < QUIC_FLOW_BUCKET_SLOTS; i++) {
+        const QUIC_FLOW_SLOT *slot = &bucket[i];
+
+        const LONG sequence = slot->sequence;
+        if (sequence & 1) {
+            continue;
+        }
+        KeMemoryBarrier();
+
+        if (!AtfQuicFlowIsSameKey(&slot->key, key)) {
+            continue;
+        }
+
+        const UINT32 expiry = slot->expiry;
+        const UINT8 verdict = slot->verdict;
+
+        // A writer took the slot while it was read, the copy may be torn
+        KeMemoryBarrier();
+        if (slot->sequence != sequence) {
+            continue;
+        }
+
+        if (expiry <= now) {
+            continue;
+        }
+
+        return verdict;
+    }
+
+    return QUIC_FLOW_UNDECIDED;
+}
+
+VOID AtfQuicFlowDecide(_In_ QUIC_FLOW_CTX *ctx, _In_ const QUIC_FLOW_KEY *key, _In_ UINT8 verdict, _In_ UINT32 now)
+{
+    if (!ctx || !key || verdict == QUIC_FLOW_UNDECIDED) {
+        return;
+    }
+
+    //
+    // The entry of the same flow is refreshed, otherwise the slot that expires first is replaced, as in the DNS cache
+    //
+    const size_t bucketIndex = (size_t)(AtfQuicFlowHash(ctx->seed, key) & (QUIC_FLOW_NUM_OF_BUCKETS - 1));
+    QUIC_FLOW_SLOT *bucket = &ctx->slots[bucketIndex * QUIC_FLOW_BUCKET_SLOTS];
+    QUIC_FLOW_SLOT *victim = &bucket[0];
+    for (UINT32 i = 0; i < QUIC_FLOW_BUCKET_SLOTS; i++) {
+        if (AtfQuicFlowIsSameKey(&bucket[i].key, key)) {
+            victim = &bucket[i];
+            break;
+        }
+
+        if (bucket[i].expiry < victim->expiry) {
+            victim = &bucket[i];
+        }
+    }
+
+    const LONG sequence = victim->sequence;
+    if (sequence & 1) {
+        return;
+    }
+
+    if (InterlockedCompareExchange(&victim->sequence, (LONG)((ULONG)sequence + 1), sequence) != sequence) {
+        return;
+    }
+
+    victim->key = *key;
+    victim->verdict = verdict;
+    victim->expiry = now + QUIC_FLOW_DECIDED_TTL;
+
+    InterlockedExchange(&victim->sequence, (LONG)((ULONG)sequence + 2));
+}
+
+VOID AtfQuicFlowPrintCtx(const QUIC_FLOW_CTX *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    const UINT32 now = AtfDnsCacheNow();
+
+    UINT64 numOfDecided = 0;
+    for (size_t i = 0; i < QUIC_FLOW_NUM_OF_BUCKETS * QUIC_FLOW_BUCKET_SLOTS; i++) {
+        if (ctx->slots[i].expiry > now) {
+            numOfDecided++;
+        }
+    }
+
+    UINT64 numOfPending = 0;
+    for (size_t i = 0; i < QUIC_FLOW_NUM_OF_PENDING; i++) {
+        if (ctx->pending[i].expiry > now) {
+            numOfPending++;
+        }
+    }
+
+    ATF_DEBUGA("[atftrace] QUIC Flow Stats: Decided: %llu, Pending: %llu, Size: %llu",
+        numOfDecided,
+        numOfPending,
+        (UINT64)(QUIC_FLOW_NUM_OF_BUCKETS * QUIC_FLOW_BUCKET_SLOTS * sizeof(QUIC_FLOW_SLOT) +
+            QUIC_FLOW_NUM_OF_PENDING * sizeof(QUIC_FLOW_PENDING)));
+}
+
+VOID AtfQuicFlowFree(QUIC_FLOW_CTX **ctx)
+{
+    if (!ctx || !*ctx) {
+        return;
+    }
+
+    QUIC_FLOW_CTX *c = *ctx;
+    *ctx = NULL;
+
+    if (--c->refCount) {
+        return;
+    }
+
+    if (c->slots) {
+        ATF_FREE(c->slots);
+    }
+    if (c->pending) {
+        ATF_FREE(c->pending);
+    }
+    ATF_FREE(c);
+}
+
+static QUIC_FLOW_PENDING *AtfQuicFlowAcquirePending(QUIC_FLOW_CTX *ctx, const QUIC_FLOW_KEY *key, UINT64 hash, UINT32 now)
+{
+    // The high bits, the bucket of the decided table is the low ones
+    QUIC_FLOW_PENDING *pending = &ctx->pending[(size_t)(hash >> 32) % QUIC_FLOW_NUM_OF_PENDING];
+
+    if (pending->isOwned || InterlockedCompareExchange(&pending->isOwned, 1, 0) != 0) {
+        return NULL;
+    }
+
+    // A live slot of another flow is left to it, the new flow is let through
+    const BOOLEAN isSameFlow = AtfQuicFlowIsSameKey(&pending->key, key);
+    if (pending->expiry > now && !isSameFlow) {
+        InterlockedExchange(&pending->isOwned, 0);
+        return NULL;
+    }
+
+    if (pending->expiry <= now || !isSameFlow) {
+        pending->key = *key;
+        pending->numOfPackets = 0;
+        pending->expiry = now + QUIC_FLOW_PENDING_TTL;
+        AtfQuicResetCryptoStream(&pending->stream);
+    }
+
+    return pending;
+}
+
+static VOID AtfQuicFlowReleasePending(QUIC_FLOW_PENDING *pending, BOOLEAN isDecided)
+{
+    if (isDecided) {
+        pending->expiry = 0;
+    }
+
+    InterlockedExchange(&pending->isOwned, 0);
+}
+
+static __forceinline UINT64 AtfQuicFlowHash(UINT64 seed, const QUIC_FLOW_KEY *key)
+{
+    // 64-bit mix (murmur3 finalizer) of the words of the key, as in dns_cache.c
+    UINT64 hash = seed ^ ((UINT64)key->localPort << 16) ^ key->remotePort;
+    const UINT64 words[4] = {
+        key->localAddress.a.q.qword[0],
+        key->localAddress.a.q.qword[1],
+        key->remoteAddress.a.q.qword[0],
+        key->remoteAddress.a.q.qword[1]
+    };
+
+    for (UINT32 i = 0; i < ARRAYSIZE(words); i++) {
+        hash ^= words[i];
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+    }
+
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static __forceinline BOOLEAN AtfQuicFlowIsSameKey(const QUIC_FLOW_KEY *a, const QUIC_FLOW_KEY *b)
+{
+    return a->localPort == b->localPort && a->remotePort == b->remotePort &&
+        a->remoteAddress.a.q.qword[0] == b->remoteAddress.a.q.qword[0] &&
+        a->remoteAddress.a.q.qword[1] == b->remoteAddress.a.q.qword[1] &&
+        a->localAddress.a.q.qword[0] == b->localAddress.a.q.qword[0] &&
+        a->localAddress.a.q.qword[1] == b->localAddress.a.q.qword[1];
+}
+
+//EOF
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "domain_dafsa.h"
+#include "quic_parser.h"
+
+//
+// Per-flow state of the QUIC callouts: the flows already decided, and the CRYPTO streams of the flows whose
+//  ClientHello is not complete yet
+//
+//  A datagram flow has no stream layer to hand it back to WFP once it is decided, every datagram of a QUIC
+//   connection reaches the callout. Most are short header (1-RTT) packets, passed over on their first byte
+//   (AtfQuicIsInitial). The client Initials that follow the ClientHello (acknowledgements, retransmissions) are
+//   looked up in the decided table, one bucket of one cache line per slot, and only the Initials of a flow that is
+//   still undecided are unprotected and parsed (quic_parser.h).
+//
+//  - The decided table is a fixed-size set associative table: QUIC_FLOW_NUM_OF_BUCKETS buckets of
+//    QUIC_FLOW_BUCKET_SLOTS slots, keyed by the addresses and ports of the flow (IPv4 addresses are IPv4-mapped).
+//    Its slots are guarded by a sequence lock, as the slots of the DNS cache (dns_cache.h): writers claim a slot with
+//    InterlockedCompareExchange and drop their entry if it is taken, readers never write, never retry and never wait.
+//    A decision is kept QUIC_FLOW_DECIDED_TTL seconds, longer than the handshake of a connection lasts.
+//
+//  - A flow that is not decided by its first Initial (the ClientHello spans packets) takes a pending slot, with the
+//    Initial keys of its first Destination Connection ID and its CRYPTO stream (QUIC_CRYPTO_STREAM). The pending slot
+//    of a flow is chosen by its hash out of QUIC_FLOW_NUM_OF_PENDING, and is owned by one callout at a time (an
+//    interlocked flag that is only tried, never waited on). A pending slot older than QUIC_FLOW_PENDING_TTL is taken
+//    over by the next flow that hashes to it. A flow that cannot take its slot, or that is still undecided after
+//    QUIC_FLOW_MAX_PACKETS Initials, is let through.
+//
+//  Decisions depend on the domain blocklist, so a new domain blocklist comes with new, empty flow state, as it comes
+//   with a new DNS cache. The state is shared between configs cloned from each other, the reference count is only
+//   changed by the IOCTL handlers (serialized by gIoctlLock).
+//
+#define QUIC_FLOW_CACHE_LINE            64
+
+#define QUIC_FLOW_NUM_OF_BUCKETS        1024
+#define QUIC_FLOW_BUCKET_SLOTS          4
+
+#define QUIC_FLOW_NUM_OF_PENDING        64
+
+// In seconds
+#define QUIC_FLOW_DECIDED_TTL           60
+#define QUIC_FLOW_PENDING_TTL           3
+
+// Initial packets parsed per flow before it is let through undecided
+#define QUIC_FLOW_MAX_PACKETS           8
+
+// Verdict of a flow
+#define QUIC_FLOW_UNDECIDED             0
+#define QUIC_FLOW_PASS                  1
+#define QUIC_FLOW_BLOCK                 2
+
+//
+// Addresses and ports of a flow. The addresses are in network byte order, IPv4 addresses are IPv4-mapped, the ports
+//  are as classified by WFP
+//
+typedef struct _quic_flow_key {
+    IPV6_RAW_ADDRESS                localAddress;
+    IPV6_RAW_ADDRESS                remoteAddress;
+    UINT16                          localPort;
+    UINT16                          remotePort;
+} QUIC_FLOW_KEY, *PQUIC_FLOW_KEY;
+
+typedef struct DECLSPEC_ALIGN(QUIC_FLOW_CACHE_LINE) _quic_flow_slot {
+    // Odd while a writer owns the slot
+    volatile LONG                   sequence;
+
+    // Seconds of interrupt time (AtfDnsCacheNow) the entry expires at, 0 if the slot was never written
+    UINT32                          expiry;
+
+    QUIC_FLOW_KEY                   key;
+    UINT8                           verdict;
+} QUIC_FLOW_SLOT, *PQUIC_FLOW_SLOT;
+
+C_ASSERT(sizeof(QUIC_FLOW_SLOT) == QUIC_FLOW_CACHE_LINE);
+
+typedef struct _quic_flow_pending {
+    // Set while a callout owns the slot
+    volatile LONG                   isOwned;
+
+    // Seconds of interrupt time the flow is given up at, 0 if the slot is free
+    UINT32                          expiry;
+
+    QUIC_FLOW_KEY                   key;
+
+    // Initial packets of the flow parsed so far
+    UINT32                          numOfPackets;
+
+    QUIC_INITIAL_KEYS               keys;
+    QUIC_CRYPTO_STREAM              stream;
+} QUIC_FLOW_PENDING, *PQUIC_FLOW_PENDING;
+
+typedef struct _quic_flow_ctx {
+    // Number of configs referencing the state
+    size_t                          refCount;
+
+    // Hash seed, so that the flows of a crafted port sequence cannot target one bucket
+    UINT64                          seed;
+
+    // QUIC_FLOW_NUM_OF_BUCKETS * QUIC_FLOW_BUCKET_SLOTS slots, the slots of a bucket are consecutive
+    QUIC_FLOW_SLOT                  *slots;
+
+    // QUIC_FLOW_NUM_OF_PENDING slots
+    QUIC_FLOW_PENDING               *pending;
+} QUIC_FLOW_CTX, *PQUIC_FLOW_CTX;
+
+//
+// Allocate empty flow state
+//
+ATF_ERROR AtfQuicFlowAllocCtx(QUIC_FLOW_CTX **ctxOut);
+
+//
+// Take another reference on the state, for a cloned config
+//
+QUIC_FLOW_CTX *AtfQuicFlowReference(QUIC_FLOW_CTX *ctx);
+
+//
+// Inspect a datagram sent to a QUIC server (its UDP payload), callable at any IRQL <= DISPATCH_LEVEL
+//  Returns the verdict of the flow, QUIC_FLOW_UNDECIDED if the datagram holds no client Initial or the ClientHello
+//  is not complete yet. When the flow is decided by this datagram, and its server name is covered by the domain
+//  blocklist, nameOut receives the name and domainLengthOut the length of the listed domain (0 otherwise), so that
+//  the caller reports the flow once. isBlocking selects the verdict of such a flow
+//
+UINT8 AtfQuicFlowInspect(
+    _In_ QUIC_FLOW_CTX *ctx,
+    _In_ const DOMAIN_DAFSA_CTX *domainCtx,
+    _In_ const QUIC_FLOW_KEY *key,
+    _In_ const UINT8 *datagram,
+    _In_ size_t datagramLength,
+    _In_ BOOLEAN isBlocking,
+    _In_ UINT32 now,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *domainLengthOut
+);
+
+//
+// Returns the verdict of a decided flow, or QUIC_FLOW_UNDECIDED
+//
+UINT8 AtfQuicFlowLookup(_In_ const QUIC_FLOW_CTX *ctx, _In_ const QUIC_FLOW_KEY *key, _In_ UINT32 now);
+
+//
+// Record the verdict of a flow
+//
+VOID AtfQuicFlowDecide(_In_ QUIC_FLOW_CTX *ctx, _In_ const QUIC_FLOW_KEY *key, _In_ UINT8 verdict, _In_ UINT32 now);
+
+//
+// Print the number of decided and pending flows
+//
+VOID AtfQuicFlowPrintCtx(const QUIC_FLOW_CTX *ctx);
+
+//
+// Drop a reference to the state, it is freed with the last reference
+//
+VOID AtfQuicFlowFree(QUIC_FLOW_CTX **ctx);
+
+//EOF
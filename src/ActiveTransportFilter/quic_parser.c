@@ -0,0 +1,427 @@
+#include <ntddk.h>
+
+#include "quic_parser.h"
+
+//
+// Initial salt of QUIC v1 (RFC 9001 5.2)
+//
+static const UINT8 gQuicV1InitialSalt[] = {
+    0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+    0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a
+};
+
+//
+// Decryption state of a packet payload: the ciphertext, and the last keystream block computed, as the frame headers
+//  are read a byte at a time
+//
+typedef struct _quic_payload {
+    const QUIC_AES128_CTX           *packetKey;
+    const UINT8                     *ciphertext;
+    size_t                          length;
+
+    // Nonce (IV xor packet number), then the 32-bit block counter
+    UINT8                           counterBlock[QUIC_AES_BLOCK_SIZE];
+
+    UINT8                           keystream[QUIC_AES_BLOCK_SIZE];
+    size_t                          keystreamIndex;
+} QUIC_PAYLOAD, *PQUIC_PAYLOAD;
+
+// GCM with a 96-bit nonce starts the counter at 1 for the tag, the payload starts at 2
+#define QUIC_GCM_FIRST_COUNTER          2
+
+//
+// Read a variable-length integer (RFC 9000 16) of the header, returns the number of bytes read or 0 if it runs past
+//  the end
+//
+static size_t AtfQuicReadVarint(const UINT8 *p, size_t available, UINT64 *valueOut);
+
+//
+// Decrypt payload bytes, the caller checks the bounds
+//
+static __forceinline UINT8 AtfQuicDecryptByte(QUIC_PAYLOAD *payload, size_t offset);
+static VOID AtfQuicDecrypt(QUIC_PAYLOAD *payload, size_t offset, size_t length, UINT8 *out);
+
+//
+// Read a variable-length integer of the payload at *offset, and move past it. Returns FALSE if it runs past the end
+//
+static BOOLEAN AtfQuicReadPayloadVarint(QUIC_PAYLOAD *payload, size_t *offset, UINT64 *valueOut);
+
+//
+// Skip the body of an ACK frame. Returns FALSE if it is malformed
+//
+static BOOLEAN AtfQuicSkipAck(QUIC_PAYLOAD *payload, size_t *offset, BOOLEAN hasEcnCounts);
+
+//
+// Add [start, end) to the ranges of the stream. Returns TRUE if the range starting at 0 grew
+//
+static BOOLEAN AtfQuicAddCryptoRange(QUIC_CRYPTO_STREAM *stream, UINT32 start, UINT32 end);
+
+ATF_ERROR AtfQuicParseInitialHeader(
+    _In_ const UINT8 *datagram,
+    _In_ size_t datagramLength,
+    _Out_ QUIC_INITIAL_HEADER *headerOut
+)
+{
+    if (!datagram || !headerOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    // Offsets are kept in 16 bits, a UDP payload is never larger
+    if (datagramLength > MAXUINT16 || !AtfQuicIsInitial(datagram, datagramLength)) {
+        return ATF_BAD_DATA;
+    }
+
+    // First byte and version
+    size_t offset = 5;
+
+    const UINT8 dcidLength = datagram[offset++];
+    if (dcidLength > QUIC_MAX_CID_LENGTH) {
+        return ATF_BAD_DATA;
+    }
+
+    headerOut->dcidOffset = (UINT16)offset;
+    headerOut->dcidLength = dcidLength;
+    offset += dcidLength;
+
+    // The lengths are read before the minimum size of a client Initial runs out
+    const UINT8 scidLength = datagram[offset++];
+    if (scidLength > QUIC_MAX_CID_LENGTH) {
+        return ATF_BAD_DATA;
+    }
+    offset += scidLength;
+
+    UINT64 tokenLength = 0;
+    size_t fieldLength = AtfQuicReadVarint(&datagram[offset], datagramLength - offset, &tokenLength);
+    if (!fieldLength || tokenLength > datagramLength - offset - fieldLength) {
+        return ATF_BAD_DATA;
+    }
+    offset += fieldLength + (size_t)tokenLength;
+
+    UINT64 packetLength = 0;
+    fieldLength = AtfQuicReadVarint(&datagram[offset], datagramLength - offset, &packetLength);
+    if (!fieldLength || packetLength > datagramLength - offset - fieldLength) {
+        return ATF_BAD_DATA;
+    }
+    offset += fieldLength;
+
+    // The sample is taken as if the packet number were 4 bytes, and is always within the packet
+    if (packetLength < QUIC_HP_SAMPLE_OFFSET + QUIC_HP_SAMPLE_SIZE) {
+        return ATF_BAD_DATA;
+    }
+
+    headerOut->pnOffset = (UINT16)offset;
+    headerOut->packetEnd = (UINT16)(offset + (size_t)packetLength);
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR AtfQuicDeriveInitialKeys(
+    _In_ const UINT8 *dcid,
+    _In_ size_t dcidLength,
+    _Out_ QUIC_INITIAL_KEYS *keysOut
+)
+{
+    if ((!dcid && dcidLength) || dcidLength > QUIC_MAX_CID_LENGTH || !keysOut) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    UINT8 initialSecret[QUIC_SHA256_SIZE];
+    AtfQuicHkdfExtract(gQuicV1InitialSalt, sizeof(gQuicV1InitialSalt), dcid, dcidLength, initialSecret);
+
+    UINT8 clientSecret[QUIC_SHA256_SIZE];
+    ATF_ERROR atfError = AtfQuicHkdfExpandLabel(initialSecret, "client in", clientSecret, sizeof(clientSecret));
+    if (atfError) {
+        return atfError;
+    }
+
+    UINT8 key[QUIC_AES128_KEY_SIZE];
+    UINT8 headerKey[QUIC_AES128_KEY_SIZE];
+
+    atfError = AtfQuicHkdfExpandLabel(clientSecret, "quic key", key, sizeof(key));
+    if (!atfError) {
+        atfError = AtfQuicHkdfExpandLabel(clientSecret, "quic iv", keysOut->iv, sizeof(keysOut->iv));
+    }
+    if (!atfError) {
+        atfError = AtfQuicHkdfExpandLabel(clientSecret, "quic hp", headerKey, sizeof(headerKey));
+    }
+    if (atfError) {
+        return atfError;
+    }
+
+    AtfQuicAes128Init(&keysOut->packetKey, key);
+    AtfQuicAes128Init(&keysOut->headerKey, headerKey);
+
+    return ATF_ERROR_OK;
+}
+
+TLS_HELLO_RESULT AtfQuicReadClientHello(
+    _In_ const UINT8 *datagram,
+    _In_ const QUIC_INITIAL_HEADER *header,
+    _In_ const QUIC_INITIAL_KEYS *keys,
+    _Inout_ QUIC_CRYPTO_STREAM *stream,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut
+)
+{
+    *nameLengthOut = 0;
+
+    if (!datagram || !header || !keys || !stream || !nameOut) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    //
+    // Header protection: the mask uncovers the packet number length in the first byte, then the packet number
+    //
+    UINT8 mask[QUIC_AES_BLOCK_SIZE];
+    AtfQuicAes128Encrypt(&keys->headerKey, &datagram[header->pnOffset + QUIC_HP_SAMPLE_OFFSET], mask);
+
+    const UINT8 firstByte = datagram[0] ^ (mask[0] & QUIC_LONG_HEADER_PROTECTED_BITS);
+    const size_t pnLength = (size_t)(firstByte & QUIC_PN_LENGTH_MASK) + 1;
+
+    UINT32 packetNumber = 0;
+    for (size_t i = 0; i < pnLength; i++) {
+        packetNumber = (packetNumber << 8) | (UINT8)(datagram[header->pnOffset + i] ^ mask[1 + i]);
+    }
+
+    const size_t payloadOffset = header->pnOffset + pnLength;
+    if (header->packetEnd - payloadOffset <= QUIC_TAG_SIZE) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    //
+    // The nonce is the IV with the packet number xored into its last bytes. The packet number is at most 32 bits
+    //  here, its full 62-bit value only differs once the truncated one wraps, which an Initial never does
+    //
+    QUIC_PAYLOAD payload;
+    payload.packetKey = &keys->packetKey;
+    payload.ciphertext = &datagram[payloadOffset];
+    payload.length = header->packetEnd - payloadOffset - QUIC_TAG_SIZE;
+    payload.keystreamIndex = MAXSIZE_T;
+
+    RtlCopyMemory(payload.counterBlock, keys->iv, QUIC_IV_SIZE);
+    payload.counterBlock[QUIC_IV_SIZE - 4] ^= (UINT8)(packetNumber >> 24);
+    payload.counterBlock[QUIC_IV_SIZE - 3] ^= (UINT8)(packetNumber >> 16);
+    payload.counterBlock[QUIC_IV_SIZE - 2] ^= (UINT8)(packetNumber >> 8);
+    payload.counterBlock[QUIC_IV_SIZE - 1] ^= (UINT8)packetNumber;
+
+    //
+    // Frames, up to the answer
+    //
+    size_t offset = 0;
+    while (offset < payload.length) {
+        const UINT8 frameType = AtfQuicDecryptByte(&payload, offset++);
+
+        switch (frameType) {
+        case QUIC_FRAME_PADDING:
+        case QUIC_FRAME_PING:
+            break;
+
+        case QUIC_FRAME_ACK:
+        case QUIC_FRAME_ACK_ECN:
+            if (!AtfQuicSkipAck(&payload, &offset, frameType == QUIC_FRAME_ACK_ECN)) {
+                return TLS_HELLO_NOT_HELLO;
+            }
+            break;
+
+        case QUIC_FRAME_CRYPTO:
+            {
+                UINT64 cryptoOffset = 0;
+                UINT64 cryptoLength = 0;
+                if (!AtfQuicReadPayloadVarint(&payload, &offset, &cryptoOffset) ||
+                    !AtfQuicReadPayloadVarint(&payload, &offset, &cryptoLength) ||
+                    cryptoLength > payload.length - offset)
+                {
+                    return TLS_HELLO_NOT_HELLO;
+                }
+
+                const size_t dataOffset = offset;
+                offset += (size_t)cryptoLength;
+
+                // Only the part of the frame within the kept stream is decrypted
+                if (!cryptoLength || cryptoOffset >= QUIC_CRYPTO_STREAM_SIZE) {
+                    break;
+                }
+
+                const UINT32 start = (UINT32)cryptoOffset;
+                const UINT32 end = (UINT32)min(cryptoOffset + cryptoLength, QUIC_CRYPTO_STREAM_SIZE);
+
+                AtfQuicDecrypt(&payload, dataOffset, end - start, &stream->data[start]);
+                if (!AtfQuicAddCryptoRange(stream, start, end)) {
+                    break;
+                }
+
+                size_t requiredLength = 0;
+                const TLS_HELLO_RESULT result = AtfTlsParseHandshake(
+                    stream->data, stream->ranges[0].end, nameOut, nameLengthOut, &requiredLength);
+                if (result != TLS_HELLO_INCOMPLETE) {
+                    return result;
+                }
+
+                if (requiredLength > QUIC_CRYPTO_STREAM_SIZE) {
+                    return TLS_HELLO_NO_NAME;
+                }
+            }
+            break;
+
+        default:
+            // CONNECTION_CLOSE, or a frame that is not allowed in an Initial packet
+            return TLS_HELLO_NOT_HELLO;
+        }
+    }
+
+    return TLS_HELLO_INCOMPLETE;
+}
+
+static size_t AtfQuicReadVarint(const UINT8 *p, size_t available, UINT64 *valueOut)
+{
+    if (!available) {
+        return 0;
+    }
+
+    // The two top bits of the first byte are the log2 of the length
+    const size_t length = (size_t)1 << (p[0] >> 6);
+    if (length > available) {
+        return 0;
+    }
+
+    UINT64 value = p[0] & 0x3f;
+    for (size_t i = 1; i < length; i++) {
+        value = (value << 8) | p[i];
+    }
+
+    *valueOut = value;
+
+    return length;
+}
+
+static __forceinline UINT8 AtfQuicDecryptByte(QUIC_PAYLOAD *payload, size_t offset)
+{
+    const size_t blockIndex = offset / QUIC_AES_BLOCK_SIZE;
+    if (blockIndex != payload->keystreamIndex) {
+        const UINT32 counter = (UINT32)blockIndex + QUIC_GCM_FIRST_COUNTER;
+        payload->counterBlock[12] = (UINT8)(counter >> 24);
+        payload->counterBlock[13] = (UINT8)(counter >> 16);
+        payload->counterBlock[14] = (UINT8)(counter >> 8);
+        payload->counterBlock[15] = (UINT8)counter;
+
+        AtfQuicAes128Encrypt(payload->packetKey, payload->counterBlock, payload->keystream);
+        payload->keystreamIndex = blockIndex;
+    }
+
+    return payload->ciphertext[offset] ^ payload->keystream[offset % QUIC_AES_BLOCK_SIZE];
+}
+
+static VOID AtfQuicDecrypt(QUIC_PAYLOAD *payload, size_t offset, size_t length, UINT8 *out)
+{
+    while (length) {
+        // Computes the keystream block of the offset if it is not the last one
+        out[0] = AtfQuicDecryptByte(payload, offset);
+
+        const size_t blockOffset = offset % QUIC_AES_BLOCK_SIZE;
+        size_t count = QUIC_AES_BLOCK_SIZE - blockOffset;
+        if (count > length) {
+            count = length;
+        }
+
+        for (size_t i = 1; i < count; i++) {
+            out[i] = payload->ciphertext[offset + i] ^ payload->keystream[blockOffset + i];
+        }
+
+        out += count;
+        offset += count;
+        length -= count;
+    }
+}
+
+static BOOLEAN AtfQuicReadPayloadVarint(QUIC_PAYLOAD *payload, size_t *offset, UINT64 *valueOut)
+{
+    if (*offset >= payload->length) {
+        return FALSE;
+    }
+
+    const UINT8 first = AtfQuicDecryptByte(payload, *offset);
+    const size_t length = (size_t)1 << (first >> 6);
+    if (length > payload->length - *offset) {
+        return FALSE;
+    }
+
+    UINT64 value = first & 0x3f;
+    for (size_t i = 1; i < length; i++) {
+        value = (value << 8) | AtfQuicDecryptByte(payload, *offset + i);
+    }
+
+    *offset += length;
+    *valueOut = value;
+
+    return TRUE;
+}
+
+static BOOLEAN AtfQuicSkipAck(QUIC_PAYLOAD *payload, size_t *offset, BOOLEAN hasEcnCounts)
+{
+    UINT64 value = 0;
+    UINT64 numOfRanges = 0;
+
+    // Largest Acknowledged, ACK Delay, ACK Range Count and First ACK Range
+    if (!AtfQuicReadPayloadVarint(payload, offset, &value) ||
+        !AtfQuicReadPayloadVarint(payload, offset, &value) ||
+        !AtfQuicReadPayloadVarint(payload, offset, &numOfRanges) ||
+        !AtfQuicReadPayloadVarint(payload, offset, &value))
+    {
+        return FALSE;
+    }
+
+    if (numOfRanges > QUIC_MAX_ACK_RANGES) {
+        return FALSE;
+    }
+
+    // Gap and ACK Range Length of each range, then the three ECN counts
+    const UINT64 numOfFields = numOfRanges * 2 + (hasEcnCounts ? 3 : 0);
+    for (UINT64 i = 0; i < numOfFields; i++) {
+        if (!AtfQuicReadPayloadVarint(payload, offset, &value)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN AtfQuicAddCryptoRange(QUIC_CRYPTO_STREAM *stream, UINT32 start, UINT32 end)
+{
+    QUIC_CRYPTO_RANGE *ranges = stream->ranges;
+    const UINT32 numOfRanges = stream->numOfRanges;
+    const UINT32 oldPrefix = (numOfRanges && !ranges[0].start) ? ranges[0].end : 0;
+
+    // The ranges before the new one, not touching it
+    UINT32 first = 0;
+    while (first < numOfRanges && ranges[first].end < start) {
+        first++;
+    }
+
+    // The ranges it overlaps or touches are merged into it
+    UINT32 last = first;
+    while (last < numOfRanges && ranges[last].start <= end) {
+        start = min(start, ranges[last].start);
+        end = max(end, ranges[last].end);
+        last++;
+    }
+
+    if (first == last) {
+        // A retransmission out of order may be dropped, the range is then received again or the flow times out
+        if (numOfRanges == QUIC_MAX_CRYPTO_RANGES) {
+            return FALSE;
+        }
+
+        RtlMoveMemory(&ranges[first + 1], &ranges[first], (numOfRanges - first) * sizeof(QUIC_CRYPTO_RANGE));
+        stream->numOfRanges++;
+    } else if (last - first > 1) {
+        RtlMoveMemory(&ranges[first + 1], &ranges[last], (numOfRanges - last) * sizeof(QUIC_CRYPTO_RANGE));
+        stream->numOfRanges -= last - first - 1;
+    }
+
+    ranges[first].start = start;
+    ranges[first].end = end;
+
+    return !ranges[0].start && ranges[0].end > oldPrefix;
+}
+
+//EOF
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include "quic_crypto.h"
+#include "tls_parser.h"
+
+//
+// QUIC v1 client Initial packet parser (RFC 9000 17.2.2, RFC 9001 5) for the datagrams seen by the QUIC callouts
+//
+//  A QUIC connection starts with the ClientHello of TLS 1.3, in the CRYPTO frames of the client Initial packets. The
+//   Initial packets are protected with keys derived from their Destination Connection ID (quic_crypto.h), so the
+//   server name is readable by anyone on the path, once the packet is unprotected:
+//
+//   - The header protection mask is one AES block of the hp key over a sample of the ciphertext. It uncovers the
+//     length of the packet number, and the packet number.
+//   - The payload is AES-128-GCM with the packet number in the nonce. GCM encrypts with AES in counter mode, so any
+//     byte of the payload is decrypted with the keystream block it falls in, without the rest of the payload.
+//
+//  Only what the ClientHello needs is decrypted: the frame headers, and the data of the CRYPTO frames, which goes
+//   straight into the CRYPTO stream of the flow (QUIC_CRYPTO_STREAM) at its offset. After each frame that extends
+//   the stream from offset 0, the ClientHello is parsed again (AtfTlsParseHandshake), and the packet is left as soon
+//   as the answer is known, usually before the PADDING that fills the rest of the datagram. The GCM tag is not
+//   checked: the keys are public, so a valid tag proves nothing about the sender, and the host only parses its own
+//   datagrams.
+//
+//  A ClientHello with a post-quantum key share does not fit in one Initial packet, and clients split and reorder
+//   the CRYPTO frames on purpose. The stream therefore keeps the ranges it holds, and is carried from one packet of
+//   the flow to the next by the caller (quic_flow.h). Data past QUIC_CRYPTO_STREAM_SIZE is not kept, a ClientHello
+//   that does not fit is reported as having no name.
+//
+#define QUIC_PORT                       443
+#define QUIC_VERSION_1                  0x00000001
+
+// A datagram holding a client Initial is at least this size (RFC 9000 14.1)
+#define QUIC_MIN_INITIAL_SIZE           1200
+
+#define QUIC_MAX_CID_LENGTH             20
+
+// First byte of a long header: header form and fixed bit set, the packet type in bits 4-5
+#define QUIC_LONG_HEADER_FORM           0x80
+#define QUIC_FIXED_BIT                  0x40
+#define QUIC_LONG_PACKET_TYPE_MASK      0x30
+#define QUIC_PACKET_TYPE_INITIAL        0x00
+#define QUIC_INITIAL_TYPE_MASK          (QUIC_LONG_HEADER_FORM | QUIC_FIXED_BIT | QUIC_LONG_PACKET_TYPE_MASK)
+#define QUIC_INITIAL_TYPE_BITS          (QUIC_LONG_HEADER_FORM | QUIC_FIXED_BIT | QUIC_PACKET_TYPE_INITIAL)
+
+// Bits of the first byte under header protection, and the packet number length they hold (minus 1)
+#define QUIC_LONG_HEADER_PROTECTED_BITS 0x0f
+#define QUIC_PN_LENGTH_MASK             0x03
+#define QUIC_MAX_PN_LENGTH              4
+
+// The header protection sample starts 4 bytes after the start of the packet number
+#define QUIC_HP_SAMPLE_OFFSET           4
+#define QUIC_HP_SAMPLE_SIZE             16
+
+#define QUIC_IV_SIZE                    12
+#define QUIC_TAG_SIZE                   16
+
+// Frames allowed in an Initial packet (RFC 9000 12.4)
+#define QUIC_FRAME_PADDING              0x00
+#define QUIC_FRAME_PING                 0x01
+#define QUIC_FRAME_ACK                  0x02
+#define QUIC_FRAME_ACK_ECN              0x03
+#define QUIC_FRAME_CRYPTO               0x06
+#define QUIC_FRAME_CONNECTION_CLOSE     0x1c
+
+// ACK ranges read per ACK frame, a client Initial acknowledges at most a few server Initials
+#define QUIC_MAX_ACK_RANGES             64
+
+// CRYPTO stream kept per flow from offset 0, and the disjoint ranges of it that were received
+#define QUIC_CRYPTO_STREAM_SIZE         4096
+#define QUIC_MAX_CRYPTO_RANGES          16
+
+//
+// Keys of the client Initial packets of a connection
+//
+typedef struct _quic_initial_keys {
+    QUIC_AES128_CTX                 packetKey;
+    QUIC_AES128_CTX                 headerKey;
+    UINT8                           iv[QUIC_IV_SIZE];
+} QUIC_INITIAL_KEYS, *PQUIC_INITIAL_KEYS;
+
+//
+// Parsed long header of an Initial packet, offsets are from the start of the datagram
+//
+typedef struct _quic_initial_header {
+    // Destination Connection ID, the keys are derived from the one of the first Initial of the flow
+    UINT16                          dcidOffset;
+    UINT8                           dcidLength;
+
+    // Start of the (protected) packet number, and end of the packet. Other packets may follow it in the datagram
+    UINT16                          pnOffset;
+    UINT16                          packetEnd;
+} QUIC_INITIAL_HEADER, *PQUIC_INITIAL_HEADER;
+
+//
+// Part [start, end) of the CRYPTO stream
+//
+typedef struct _quic_crypto_range {
+    UINT32                          start;
+    UINT32                          end;
+} QUIC_CRYPTO_RANGE, *PQUIC_CRYPTO_RANGE;
+
+//
+// CRYPTO stream of a flow, put back in order from the frames of its Initial packets
+//
+typedef struct _quic_crypto_stream {
+    // Sorted, disjoint and not adjacent. The ClientHello is parsed from the first range, when it starts at 0
+    UINT32                          numOfRanges;
+    QUIC_CRYPTO_RANGE               ranges[QUIC_MAX_CRYPTO_RANGES];
+
+    UINT8                           data[QUIC_CRYPTO_STREAM_SIZE];
+} QUIC_CRYPTO_STREAM, *PQUIC_CRYPTO_STREAM;
+
+//
+// Parse the long header of the first packet of a datagram sent to a QUIC server
+//  Returns ATF_BAD_DATA if the datagram is too small for a client Initial, or the packet is not a QUIC v1 Initial
+//
+ATF_ERROR AtfQuicParseInitialHeader(
+    _In_ const UINT8 *datagram,
+    _In_ size_t datagramLength,
+    _Out_ QUIC_INITIAL_HEADER *headerOut
+);
+
+//
+// Derive the client Initial keys from the Destination Connection ID of the first Initial packet of a connection
+//
+ATF_ERROR AtfQuicDeriveInitialKeys(
+    _In_ const UINT8 *dcid,
+    _In_ size_t dcidLength,
+    _Out_ QUIC_INITIAL_KEYS *keysOut
+);
+
+//
+// Decrypt the CRYPTO frames of an Initial packet into the stream of its flow, and parse the ClientHello. Callable at
+//  any IRQL, does not allocate
+//  Returns TLS_HELLO_INCOMPLETE when the name is not in the stream yet (it is in a later packet of the flow), and
+//  TLS_HELLO_NOT_HELLO if the packet cannot be unprotected or its frames are malformed (the keys are not those of
+//  the flow) or it closes the connection
+//
+TLS_HELLO_RESULT AtfQuicReadClientHello(
+    _In_ const UINT8 *datagram,
+    _In_ const QUIC_INITIAL_HEADER *header,
+    _In_ const QUIC_INITIAL_KEYS *keys,
+    _Inout_ QUIC_CRYPTO_STREAM *stream,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut
+);
+
+// Bytes of a packet read by AtfQuicIsInitial: the first byte and the version
+#define QUIC_INITIAL_PEEK_SIZE          5
+
+//
+// Returns TRUE if a packet may be a client Initial: a QUIC v1 long header of type Initial. Only reads
+//  QUIC_INITIAL_PEEK_SIZE bytes, so the short header packets of the established connections are passed over at once
+//
+static __forceinline BOOLEAN AtfQuicIsInitial(const UINT8 *packet, size_t packetLength)
+{
+    return packetLength >= QUIC_MIN_INITIAL_SIZE &&
+        (packet[0] & QUIC_INITIAL_TYPE_MASK) == QUIC_INITIAL_TYPE_BITS &&
+        packet[1] == 0 && packet[2] == 0 && packet[3] == 0 && packet[4] == QUIC_VERSION_1;
+}
+
+//
+// Empty a CRYPTO stream, for a new flow
+//
+static __forceinline VOID AtfQuicResetCryptoStream(QUIC_CRYPTO_STREAM *stream)
+{
+    stream->numOfRanges = 0;
+}
+
+//EOF
@@ -0,0 +1,342 @@
+#include <ntddk.h>
+
+#include "tls_parser.h"
+
+#include "../common/domain_dafsa_format.h"
+
+// Fixed part of a ClientHello before the session id: legacy_version and random
+#define TLS_HELLO_FIXED_SIZE            (2 + 32)
+#define TLS_MAX_SESSION_ID_LENGTH       32
+
+//
+// Result of a bounds check: the bytes are there, past the end of the data, or past the end of their structure
+//
+typedef enum {
+    TLS_READ_OK,
+    TLS_READ_INCOMPLETE,
+    TLS_READ_MALFORMED
+} TLS_READ_RESULT;
+
+//
+// Check that length bytes at offset are within the structure (ending at limit) and within the data
+//  limit is never past the end of the ClientHello, so bytes missing from the data are only still to come
+//
+static __forceinline TLS_READ_RESULT AtfTlsCheckRead(size_t offset, size_t length, size_t limit, size_t available);
+
+//
+// Read a big endian field, the caller checks the bounds
+//
+static __forceinline UINT16 AtfTlsRead16(const UINT8 *p);
+static __forceinline UINT32 AtfTlsRead24(const UINT8 *p);
+
+//
+// Copy and check a host_name, returns its length or 0 if it is not a usable name
+//
+static size_t AtfTlsCopyHostName(const UINT8 *name, size_t nameLength, CHAR nameOut[TLS_NAME_BUFFER_SIZE]);
+
+//
+// Parse the body of a ClientHello, from offset to helloEnd, of which available bytes are in the data
+//
+static TLS_HELLO_RESULT AtfTlsParseHelloBody(
+    const UINT8 *data,
+    size_t offset,
+    size_t helloEnd,
+    size_t available,
+    CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    size_t *nameLengthOut
+);
+
+//
+// Map a failed read to the result of the parse
+//
+#define TLS_READ_FAILED(readResult) \
+    ((readResult) == TLS_READ_INCOMPLETE ? TLS_HELLO_INCOMPLETE : TLS_HELLO_NOT_HELLO)
+
+TLS_HELLO_RESULT AtfTlsParseClientHello(
+    _In_ const UINT8 *data,
+    _In_ size_t dataLength,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *requiredLengthOut
+)
+{
+    *nameLengthOut = 0;
+    *requiredLengthOut = TLS_RECORD_HEADER_SIZE;
+
+    if (!data || !nameOut) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    //
+    // Record header: a handshake record of TLS 1.0 to 1.3 (the record version of a ClientHello is 3.1, sometimes 3.0)
+    //
+    if (!dataLength) {
+        return TLS_HELLO_INCOMPLETE;
+    }
+
+    if (data[0] != TLS_CONTENT_TYPE_HANDSHAKE || (dataLength > 1 && data[1] != 3) || (dataLength > 2 && data[2] > 4)) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    if (dataLength < TLS_RECORD_HEADER_SIZE) {
+        return TLS_HELLO_INCOMPLETE;
+    }
+
+    const size_t recordLength = AtfTlsRead16(&data[3]);
+    if (recordLength < TLS_HANDSHAKE_HEADER_SIZE || recordLength > TLS_MAX_RECORD_LENGTH) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    const size_t recordEnd = TLS_RECORD_HEADER_SIZE + recordLength;
+    const size_t available = dataLength < recordEnd ? dataLength : recordEnd;
+    *requiredLengthOut = recordEnd;
+
+    //
+    // Handshake header, the whole ClientHello must be in the first record
+    //
+    size_t offset = TLS_RECORD_HEADER_SIZE;
+    TLS_READ_RESULT readResult = AtfTlsCheckRead(offset, TLS_HANDSHAKE_HEADER_SIZE, recordEnd, available);
+    if (readResult != TLS_READ_OK) {
+        return TLS_READ_FAILED(readResult);
+    }
+
+    if (data[offset] != TLS_HANDSHAKE_CLIENT_HELLO) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    const size_t helloLength = AtfTlsRead24(&data[offset + 1]);
+    offset += TLS_HANDSHAKE_HEADER_SIZE;
+
+    if (helloLength > recordEnd - offset) {
+        return TLS_HELLO_NO_NAME;
+    }
+
+    return AtfTlsParseHelloBody(data, offset, offset + helloLength, available, nameOut, nameLengthOut);
+}
+
+TLS_HELLO_RESULT AtfTlsParseHandshake(
+    _In_ const UINT8 *data,
+    _In_ size_t dataLength,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *requiredLengthOut
+)
+{
+    *nameLengthOut = 0;
+    *requiredLengthOut = TLS_HANDSHAKE_HEADER_SIZE;
+
+    if (!data || !nameOut) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    if (!dataLength) {
+        return TLS_HELLO_INCOMPLETE;
+    }
+
+    if (data[0] != TLS_HANDSHAKE_CLIENT_HELLO) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    if (dataLength < TLS_HANDSHAKE_HEADER_SIZE) {
+        return TLS_HELLO_INCOMPLETE;
+    }
+
+    // Not bound by a record, but no ClientHello is larger than one
+    const size_t helloLength = AtfTlsRead24(&data[1]);
+    if (helloLength > TLS_MAX_RECORD_LENGTH) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+
+    const size_t helloEnd = TLS_HANDSHAKE_HEADER_SIZE + helloLength;
+    *requiredLengthOut = helloEnd;
+
+    const size_t available = dataLength < helloEnd ? dataLength : helloEnd;
+
+    return AtfTlsParseHelloBody(data, TLS_HANDSHAKE_HEADER_SIZE, helloEnd, available, nameOut, nameLengthOut);
+}
+
+static TLS_HELLO_RESULT AtfTlsParseHelloBody(
+    const UINT8 *data,
+    size_t offset,
+    size_t helloEnd,
+    size_t available,
+    CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    size_t *nameLengthOut
+)
+{
+    //
+    // legacy_version, random, legacy_session_id, cipher_suites and legacy_compression_methods
+    //
+    TLS_READ_RESULT readResult = AtfTlsCheckRead(offset, TLS_HELLO_FIXED_SIZE + 1, helloEnd, available);
+    if (readResult != TLS_READ_OK) {
+        return TLS_READ_FAILED(readResult);
+    }
+
+    if (data[offset] != 3) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+    offset += TLS_HELLO_FIXED_SIZE;
+
+    const size_t sessionIdLength = data[offset];
+    if (sessionIdLength > TLS_MAX_SESSION_ID_LENGTH) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+    offset += 1 + sessionIdLength;
+
+    readResult = AtfTlsCheckRead(offset, 2, helloEnd, available);
+    if (readResult != TLS_READ_OK) {
+        return TLS_READ_FAILED(readResult);
+    }
+
+    const size_t cipherSuitesLength = AtfTlsRead16(&data[offset]);
+    if (!cipherSuitesLength || (cipherSuitesLength & 1)) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+    offset += 2 + cipherSuitesLength;
+
+    readResult = AtfTlsCheckRead(offset, 1, helloEnd, available);
+    if (readResult != TLS_READ_OK) {
+        return TLS_READ_FAILED(readResult);
+    }
+
+    const size_t compressionMethodsLength = data[offset];
+    if (!compressionMethodsLength) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+    offset += 1 + compressionMethodsLength;
+
+    // A ClientHello without extensions (SSL 3.0 style) has no name
+    if (offset == helloEnd) {
+        return TLS_HELLO_NO_NAME;
+    }
+
+    readResult = AtfTlsCheckRead(offset, 2, helloEnd, available);
+    if (readResult != TLS_READ_OK) {
+        return TLS_READ_FAILED(readResult);
+    }
+
+    const size_t extensionsEnd = offset + 2 + AtfTlsRead16(&data[offset]);
+    if (extensionsEnd > helloEnd) {
+        return TLS_HELLO_NOT_HELLO;
+    }
+    offset += 2;
+
+    //
+    // Extensions, up to server_name. The body of the others is skipped without being read, so it does not need to
+    //  be in the data
+    //
+    while (offset < extensionsEnd) {
+        readResult = AtfTlsCheckRead(offset, 4, extensionsEnd, available);
+        if (readResult != TLS_READ_OK) {
+            return TLS_READ_FAILED(readResult);
+        }
+
+        const UINT16 extensionType = AtfTlsRead16(&data[offset]);
+        const size_t extensionLength = AtfTlsRead16(&data[offset + 2]);
+        offset += 4;
+
+        if (extensionLength > extensionsEnd - offset) {
+            return TLS_HELLO_NOT_HELLO;
+        }
+
+        if (extensionType != TLS_EXTENSION_SERVER_NAME) {
+            offset += extensionLength;
+            continue;
+        }
+
+        const size_t extensionEnd = offset + extensionLength;
+
+        readResult = AtfTlsCheckRead(offset, 2, extensionEnd, available);
+        if (readResult != TLS_READ_OK) {
+            return TLS_READ_FAILED(readResult);
+        }
+
+        const size_t listEnd = offset + 2 + AtfTlsRead16(&data[offset]);
+        if (listEnd > extensionEnd) {
+            return TLS_HELLO_NOT_HELLO;
+        }
+        offset += 2;
+
+        // The list holds at most one name of each type, only host_name is defined
+        while (offset < listEnd) {
+            readResult = AtfTlsCheckRead(offset, 3, listEnd, available);
+            if (readResult != TLS_READ_OK) {
+                return TLS_READ_FAILED(readResult);
+            }
+
+            const UINT8 nameType = data[offset];
+            const size_t nameLength = AtfTlsRead16(&data[offset + 1]);
+            offset += 3;
+
+            readResult = AtfTlsCheckRead(offset, nameLength, listEnd, available);
+            if (readResult != TLS_READ_OK) {
+                return TLS_READ_FAILED(readResult);
+            }
+
+            if (nameType == TLS_SERVER_NAME_HOST_NAME) {
+                *nameLengthOut = AtfTlsCopyHostName(&data[offset], nameLength, nameOut);
+                return *nameLengthOut ? TLS_HELLO_NAME : TLS_HELLO_NO_NAME;
+            }
+
+            offset += nameLength;
+        }
+
+        return TLS_HELLO_NO_NAME;
+    }
+
+    return TLS_HELLO_NO_NAME;
+}
+
+static __forceinline TLS_READ_RESULT AtfTlsCheckRead(size_t offset, size_t length, size_t limit, size_t available)
+{
+    if (offset > limit || length > limit - offset) {
+        return TLS_READ_MALFORMED;
+    }
+
+    if (offset + length > available) {
+        return TLS_READ_INCOMPLETE;
+    }
+
+    return TLS_READ_OK;
+}
+
+static __forceinline UINT16 AtfTlsRead16(const UINT8 *p)
+{
+    return (UINT16)(((UINT16)p[0] << 8) | p[1]);
+}
+
+static __forceinline UINT32 AtfTlsRead24(const UINT8 *p)
+{
+    return ((UINT32)p[0] << 16) | ((UINT32)p[1] << 8) | (UINT32)p[2];
+}
+
+static size_t AtfTlsCopyHostName(const UINT8 *name, size_t nameLength, CHAR nameOut[TLS_NAME_BUFFER_SIZE])
+{
+    if (!nameLength || nameLength > TLS_MAX_NAME_LENGTH) {
+        return 0;
+    }
+
+    // No empty label: not first, not last, and never two separators in a row
+    if (name[0] == DOMAIN_DAFSA_LABEL_SEPARATOR || name[nameLength - 1] == DOMAIN_DAFSA_LABEL_SEPARATOR) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < nameLength; i++) {
+        const UINT8 c = name[i];
+        if (c < DOMAIN_DAFSA_MIN_CHAR || c > DOMAIN_DAFSA_MAX_CHAR) {
+            return 0;
+        }
+
+        if (c == DOMAIN_DAFSA_LABEL_SEPARATOR && name[i - 1] == DOMAIN_DAFSA_LABEL_SEPARATOR) {
+            return 0;
+        }
+
+        nameOut[i] = (CHAR)c;
+    }
+
+    nameOut[nameLength] = '\0';
+
+    return nameLength;
+}
+
+//EOF
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+//
+// TLS ClientHello parser (RFC 8446 4.1.2, RFC 6066 3) for the first data sent on a TCP flow, seen by the stream
+//  callouts
+//
+//  Only the server name (SNI) is extracted. The parser reads the data in place and exits as soon as the answer is
+//   known: the first byte tells a TLS handshake record from anything else, and the extensions are walked only
+//   until the server_name extension. The name is usually in the first segment, the rest of a large ClientHello (a
+//   post-quantum key share) is only waited for when the name has not been found before the end of the data.
+//
+//  A ClientHello fragmented over more than one record is not reassembled, it is reported as having no name.
+//
+//  QUIC carries the handshake messages without records (RFC 9001 4), in the CRYPTO frames of its Initial packets.
+//   AtfTlsParseHandshake parses such a ClientHello, once the frames are put back in order (quic_parser.h).
+//
+//  The name is returned in the form the domain blocklist is searched with (domain_dafsa.h). A name with a char
+//   that cannot be in a listed domain, an empty label or a trailing dot is rejected, it can never be blocklisted.
+//
+#define TLS_RECORD_HEADER_SIZE          5
+#define TLS_HANDSHAKE_HEADER_SIZE       4
+
+// Largest record payload (RFC 8446 5.1), so the most data a ClientHello can need
+#define TLS_MAX_RECORD_LENGTH           16384
+#define TLS_MAX_HELLO_SIZE              (TLS_RECORD_HEADER_SIZE + TLS_MAX_RECORD_LENGTH)
+
+#define TLS_CONTENT_TYPE_HANDSHAKE      22
+#define TLS_HANDSHAKE_CLIENT_HELLO      1
+#define TLS_EXTENSION_SERVER_NAME       0
+#define TLS_SERVER_NAME_HOST_NAME       0
+
+// Longest host name (a DNS name), and the buffer it is copied into
+#define TLS_MAX_NAME_LENGTH             253
+#define TLS_NAME_BUFFER_SIZE            (TLS_MAX_NAME_LENGTH + 2)
+
+typedef enum {
+    TLS_HELLO_NOT_HELLO,    // The data is not a ClientHello (or is malformed), the flow has no name
+    TLS_HELLO_INCOMPLETE,   // The name is not in the data, the record is requiredLengthOut bytes
+    TLS_HELLO_NO_NAME,      // A ClientHello without a usable host name
+    TLS_HELLO_NAME          // nameOut holds the host name
+} TLS_HELLO_RESULT;
+
+//
+// Parse the first data sent on a flow. Callable at any IRQL, does not allocate
+//  nameOut (TLS_NAME_BUFFER_SIZE chars) receives the host name, NULL terminated, and nameLengthOut its length
+//  requiredLengthOut receives the length of the whole first record when the result is TLS_HELLO_INCOMPLETE, at most
+//  TLS_MAX_HELLO_SIZE
+//
+TLS_HELLO_RESULT AtfTlsParseClientHello(
+    _In_ const UINT8 *data,
+    _In_ size_t dataLength,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *requiredLengthOut
+);
+
+//
+// Parse the start of a handshake message stream, with no record header (the CRYPTO stream of QUIC)
+//  As AtfTlsParseClientHello, requiredLengthOut receives the length of the whole ClientHello, with its handshake
+//  header, when the result is TLS_HELLO_INCOMPLETE
+//
+TLS_HELLO_RESULT AtfTlsParseHandshake(
+    _In_ const UINT8 *data,
+    _In_ size_t dataLength,
+    _Out_ CHAR nameOut[TLS_NAME_BUFFER_SIZE],
+    _Out_ size_t *nameLengthOut,
+    _Out_ size_t *requiredLengthOut
+);
+
+//EOF
@@ -17,6 +17,9 @@
 #include "wfp.h"
 #include "trace.h"
 #include "filter.h"
+#include "dns_parser.h"
+#include "quic_parser.h"
+#include "inject.h"
 
 #include "../common/common.h"
 #include "../common/default_config.h"
@@ -48,9 +51,22 @@ void NTAPI AtfClassifyFuncTcpV4Outbound(
 );
 
 //
-// Main callout function (TCP v6)
+// Main callout functions (TCP ipv6 inbound)
 //
-void NTAPI AtfClassifyFuncTcpV6(
+void NTAPI AtfClassifyFuncTcpV6Inbound(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+);
+
+//
+// Main callout functions (TCP ipv6 outbound)
+//
+void NTAPI AtfClassifyFuncTcpV6Outbound(
     _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
     _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
     _Inout_opt_ void *layerData,
@@ -73,6 +89,84 @@ void NTAPI AtfClassifyFuncIcmp(
     _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
 );
 
+//
+// Main callout function (UDP ipv4, DNS queries and responses)
+//
+void NTAPI AtfClassifyFuncDnsV4(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+);
+
+//
+// Main callout function (UDP ipv6, DNS queries and responses)
+//
+void NTAPI AtfClassifyFuncDnsV6(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+);
+
+//
+// Main callout function (TCP ipv4 stream, TLS server name)
+//
+void NTAPI AtfClassifyFuncTlsV4(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+);
+
+//
+// Main callout function (TCP ipv6 stream, TLS server name)
+//
+void NTAPI AtfClassifyFuncTlsV6(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+);
+
+//
+// Main callout function (UDP ipv4 datagrams, QUIC server name)
+//
+void NTAPI AtfClassifyFuncQuicV4(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+);
+
+//
+// Main callout function (UDP ipv6 datagrams, QUIC server name)
+//
+void NTAPI AtfClassifyFuncQuicV6(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+);
+
 //
 // Default notify function for adding or deleting layers
 //
@@ -106,6 +200,12 @@ typedef struct _callout_desc_layer {
     const wchar_t                   *filterDesc;
 
     FWPS_CALLOUT_CLASSIFY_FN3       callback;
+
+    // The filter only matches this remote port, 0 for every packet of the layer
+    UINT16                          remotePort;
+
+    // Layer switch (enabledLayers) the callout is registered with, NULL for the switch of its own layer
+    const GUID                      *switchGuid;
 } CALLOUT_DESC, *PCALLOUT_DESC;
 
 //
@@ -115,6 +215,13 @@ static NTSTATUS AtfAddCalloutLayer(
     const CALLOUT_DESC *calloutDesc
 );
 
+//
+// Return TRUE if a callout enabled with the layer switch (enabledLayers) is still registered
+//
+static BOOLEAN AtfIsSwitchRegistered(
+    const GUID *switchGuid
+);
+
 //
 // The callout descriptor layers. For each to be enabled, the user-mode ini must have each set to true.
 //  wfp.c will then query filter.c for the aformentioned config, and will initialize the layers that way
@@ -135,7 +242,7 @@ const CALLOUT_DESC descList[] = {
         AtfClassifyFuncTcpV4Inbound
     },
 
-    // TCP Outbound v6
+    // TCP Inbound v6
     {
         &FWPM_LAYER_INBOUND_TRANSPORT_V6,
 
@@ -145,7 +252,7 @@ const CALLOUT_DESC descList[] = {
         L"ATF Filter TCP V6 Inbound",
         L"ATF Filter Transport ipv6 Inbound",
 
-        AtfClassifyFuncTcpV6
+        AtfClassifyFuncTcpV6Inbound
     },
 
     // TCP Outbound v4
@@ -171,7 +278,7 @@ const CALLOUT_DESC descList[] = {
         L"ATF Filter TCP V6 Outbound",
         L"ATF Filter Transport ipv6 Outbound",
 
-        AtfClassifyFuncTcpV6
+        AtfClassifyFuncTcpV6Outbound
     },
 
     // ICMP Original Type
@@ -185,6 +292,90 @@ const CALLOUT_DESC descList[] = {
         L"ATF Filter ICMP Original Type",
 
         AtfClassifyFuncIcmp
+    },
+
+    // UDP v4, DNS queries and responses
+    {
+        &FWPM_LAYER_DATAGRAM_DATA_V4,
+
+        L"ATF Callout DNS V4",
+        L"ATF Callout Datagram ipv4 DNS",
+
+        L"ATF Filter DNS V4",
+        L"ATF Filter Datagram ipv4 DNS",
+
+        AtfClassifyFuncDnsV4,
+        DNS_PORT
+    },
+
+    // UDP v6, DNS queries and responses
+    {
+        &FWPM_LAYER_DATAGRAM_DATA_V6,
+
+        L"ATF Callout DNS V6",
+        L"ATF Callout Datagram ipv6 DNS",
+
+        L"ATF Filter DNS V6",
+        L"ATF Filter Datagram ipv6 DNS",
+
+        AtfClassifyFuncDnsV6,
+        DNS_PORT
+    },
+
+    // TCP v4 streams, the server name of the TLS ClientHello
+    {
+        &FWPM_LAYER_STREAM_V4,
+
+        L"ATF Callout TLS V4",
+        L"ATF Callout Stream ipv4 TLS",
+
+        L"ATF Filter TLS V4",
+        L"ATF Filter Stream ipv4 TLS",
+
+        AtfClassifyFuncTlsV4
+    },
+
+    // TCP v6 streams, the server name of the TLS ClientHello
+    {
+        &FWPM_LAYER_STREAM_V6,
+
+        L"ATF Callout TLS V6",
+        L"ATF Callout Stream ipv6 TLS",
+
+        L"ATF Filter TLS V6",
+        L"ATF Filter Stream ipv6 TLS",
+
+        AtfClassifyFuncTlsV6
+    },
+
+    // UDP v4, the server name of the QUIC client Initials. Enabled with the TLS layer
+    {
+        &FWPM_LAYER_DATAGRAM_DATA_V4,
+
+        L"ATF Callout QUIC V4",
+        L"ATF Callout Datagram ipv4 QUIC",
+
+        L"ATF Filter QUIC V4",
+        L"ATF Filter Datagram ipv4 QUIC",
+
+        AtfClassifyFuncQuicV4,
+        QUIC_PORT,
+        &FWPM_LAYER_STREAM_V4
+    },
+
+    // UDP v6, the server name of the QUIC client Initials. Enabled with the TLS layer
+    {
+        &FWPM_LAYER_DATAGRAM_DATA_V6,
+
+        L"ATF Callout QUIC V6",
+        L"ATF Callout Datagram ipv6 QUIC",
+
+        L"ATF Filter QUIC V6",
+        L"ATF Filter Datagram ipv6 QUIC",
+
+        AtfClassifyFuncQuicV6,
+        QUIC_PORT,
+        &FWPM_LAYER_STREAM_V6
     }
 };
 
@@ -294,9 +485,35 @@ NTSTATUS InitializeWfp(
         return ntStatus;
     }
 
+    //
+    // The DNS layers answer the queries they block with injected responses. Without injection the queries are
+    //  still blocked, the lookups then time out
+    //
+    if (AtfFilterIsLayerEnabled(&FWPM_LAYER_DATAGRAM_DATA_V4) || AtfFilterIsLayerEnabled(&FWPM_LAYER_DATAGRAM_DATA_V6)) {
+        ntStatus = AtfInjectInit(deviceObj->DriverObject);
+        if (!NT_SUCCESS(ntStatus)) {
+            ATF_ERROR(AtfInjectInit, ntStatus);
+            ntStatus = STATUS_SUCCESS;
+        }
+    }
+
+    //
+    // The stream layers copy the ClientHellos into per-processor buffers, and the QUIC callouts (enabled with them) the
+    //  Initials that are not contiguous. Without them, the ClientHellos are still recognized, but their names are not
+    //  read
+    //
+    if (AtfFilterIsLayerEnabled(&FWPM_LAYER_STREAM_V4) || AtfFilterIsLayerEnabled(&FWPM_LAYER_STREAM_V6)) {
+        ntStatus = AtfFilterInitStream();
+        if (!NT_SUCCESS(ntStatus)) {
+            ATF_ERROR(AtfFilterInitStream, ntStatus);
+            ntStatus = STATUS_SUCCESS;
+        }
+    }
+
     atfDevice = deviceObj;
     for (UINT8 currLayer = 0; currLayer < ARRAYSIZE(descList); currLayer++) {
-        if (!AtfFilterIsLayerEnabled(descList[currLayer].guid)) {
+        const GUID *switchGuid = descList[currLayer].switchGuid ? descList[currLayer].switchGuid : descList[currLayer].guid;
+        if (!AtfFilterIsLayerEnabled(switchGuid)) {
             ATF_DEBUGA("WFP Filter Layer Disabled: %ws", descList[currLayer].calloutName);
             continue;
         }
@@ -380,6 +597,18 @@ static NTSTATUS AtfAddCalloutLayer(
     fwpmFilter.action.type = FWP_ACTION_CALLOUT_UNKNOWN;
     fwpmFilter.action.calloutKey = fwpmCallout.calloutKey;
 
+    // The datagram layers see every UDP packet, the callout is only invoked for its port
+    FWPM_FILTER_CONDITION fwpmCondition = { 0 };
+    if (calloutDesc->remotePort) {
+        fwpmCondition.fieldKey = FWPM_CONDITION_IP_REMOTE_PORT;
+        fwpmCondition.matchType = FWP_MATCH_EQUAL;
+        fwpmCondition.conditionValue.type = FWP_UINT16;
+        fwpmCondition.conditionValue.uint16 = calloutDesc->remotePort;
+
+        fwpmFilter.filterCondition = &fwpmCondition;
+        fwpmFilter.numFilterConditions = 1;
+    }
+
     UINT64 fwpmFilterId = 0;
     ntStatus = FwpmFilterAdd(
         kmfeHandle,
@@ -417,6 +646,20 @@ static NTSTATUS AtfAddCalloutLayer(
     return ntStatus;
 }
 
+static BOOLEAN AtfIsSwitchRegistered(
+    const GUID *switchGuid
+)
+{
+    for (const CALLOUT_LAYER_DESCRIPTOR *layerDesc = calloutData; layerDesc->magic == CALLOUT_LAYER_DATA_MAGIC; layerDesc++) {
+        const GUID *layerSwitch = layerDesc->desc->switchGuid ? layerDesc->desc->switchGuid : layerDesc->desc->guid;
+        if (layerDesc->isLayerActive && IsEqualGUID(layerSwitch, switchGuid)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 NTSTATUS DestroyWfp(
     _In_ DEVICE_OBJECT *deviceObject
 )
@@ -437,15 +680,28 @@ NTSTATUS DestroyWfp(
     }
 
     //
-    // Iterate through calloutData and destroy each layer
+    // Delete the filters and callout objects of every layer in one transaction, nothing is classified once it is
+    //  committed. Layers deleted by a previous (failed) call have no IDs left
     //
+    ntStatus = FwpmTransactionBegin(kmfeHandle, 0);
+    if (!NT_SUCCESS(ntStatus)) {
+        ATF_ERROR(FwpmTransactionBegin, ntStatus);
+        return ntStatus;
+    }
+
     CALLOUT_LAYER_DESCRIPTOR *layerDesc = calloutData;
-    while (layerDesc->magic != CALLOUT_LAYER_DATA_MAGIC) {
+    for (; layerDesc->magic == CALLOUT_LAYER_DATA_MAGIC; layerDesc++) {
+        if (!layerDesc->fwpmFilterId) {
+            continue;
+        }
+
         ntStatus = FwpmFilterDeleteById(
             kmfeHandle,
             layerDesc->fwpmFilterId
         );
         if (!NT_SUCCESS(ntStatus)) {
+            ATF_ERROR(FwpmFilterDeleteById, ntStatus);
+            FwpmTransactionAbort(kmfeHandle);
             return ntStatus;
         }
 
@@ -454,24 +710,75 @@ NTSTATUS DestroyWfp(
             layerDesc->fwpmCalloutId
         );
         if (!NT_SUCCESS(ntStatus)) {
+            ATF_ERROR(FwpmCalloutDeleteById, ntStatus);
+            FwpmTransactionAbort(kmfeHandle);
             return ntStatus;
         }
+    }
+
+    ntStatus = FwpmTransactionCommit(kmfeHandle);
+    if (!NT_SUCCESS(ntStatus)) {
+        ATF_ERROR(FwpmTransactionCommit, ntStatus);
+        FwpmTransactionAbort(kmfeHandle);
+        return ntStatus;
+    }
+
+    for (layerDesc = calloutData; layerDesc->magic == CALLOUT_LAYER_DATA_MAGIC; layerDesc++) {
+        layerDesc->fwpmFilterId = 0;
+        layerDesc->fwpmCalloutId = 0;
+    }
+
+    //
+    // A callout cannot be unregistered while flows still have its contexts. Classifies that were already running are
+    //  refused new contexts, then the existing ones are removed
+    //
+    AtfFilterRemoveStreamFlows();
+
+    //
+    // Unregister each callout. A callout that stays registered can still have flow contexts, the list is reopened
+    //  for it
+    //
+    NTSTATUS unregisterStatus = STATUS_SUCCESS;
+    for (layerDesc = calloutData; layerDesc->magic == CALLOUT_LAYER_DATA_MAGIC; layerDesc++) {
+        if (!layerDesc->isLayerActive) {
+            continue;
+        }
 
         ntStatus = FwpsCalloutUnregisterById(
             layerDesc->fwpsCalloutId
         );
+        if (ntStatus == STATUS_DEVICE_BUSY) {
+            // Contexts that were being removed are freed by WFP (flowDeleteFn) once their classify is done
+            AtfFilterWaitStreamFlows();
+
+            ntStatus = FwpsCalloutUnregisterById(
+                layerDesc->fwpsCalloutId
+            );
+        }
         if (!NT_SUCCESS(ntStatus)) {
-            return ntStatus;
+            ATF_ERROR(FwpsCalloutUnregisterById, ntStatus);
+            unregisterStatus = ntStatus;
+            continue;
         }
 
+        layerDesc->isLayerActive = FALSE;
+
         ATF_DEBUG(FwpsCalloutUnregisterById, "Successfully deleted callout layer");
+    }
 
-        layerDesc++;
+    // The injection handles are freed once no DNS callout can inject anymore
+    if (!AtfIsSwitchRegistered(&FWPM_LAYER_DATAGRAM_DATA_V4) && !AtfIsSwitchRegistered(&FWPM_LAYER_DATAGRAM_DATA_V6)) {
+        AtfInjectDestroy();
     }
 
-    ntStatus = FwpmTransactionCommit(kmfeHandle);
-    if (!NT_SUCCESS(ntStatus)) {
-        return ntStatus;
+    // The per-processor buffers are used by the TLS and QUIC callouts, both enabled with the stream layers
+    if (!AtfIsSwitchRegistered(&FWPM_LAYER_STREAM_V4) && !AtfIsSwitchRegistered(&FWPM_LAYER_STREAM_V6)) {
+        AtfFilterDestroyStream();
+    }
+
+    if (!NT_SUCCESS(unregisterStatus)) {
+        AtfFilterReopenStreamFlows();
+        return unregisterStatus;
     }
 
     FwpmProviderDeleteByKey(kmfeHandle, &ATF_FWPM_PROVIDER_KEY);
@@ -497,7 +804,7 @@ BOOLEAN IsWfpRunning(VOID)
 }
 
 //
-// Calls directly into the filter engine (AtfFilterCallbackTcpIpv4Inbound/AtfFilterCallbackTcpIpv4Inbound)
+// Calls directly into the filter engine (AtfFilterCallbackTcpIpv4/AtfFilterCallbackTcpIpv6)
 //
 void NTAPI AtfClassifyFuncTcpV4Inbound(
     _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
@@ -547,7 +854,7 @@ void NTAPI AtfClassifyFuncTcpV4Outbound(
     );  
 }
 
-void NTAPI AtfClassifyFuncTcpV6(
+void NTAPI AtfClassifyFuncTcpV6Inbound(
     _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
     _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
     _Inout_opt_ void *layerData,
@@ -557,18 +864,40 @@ void NTAPI AtfClassifyFuncTcpV6(
     _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
 )
 {
-    ATF_DEBUG(AtfClassifyFuncTcpV6, "Entered WFP callout: TCP ipv6");
+    UNREFERENCED_PARAMETER(metaValues);
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
 
-    UNREFERENCED_PARAMETER(fixedValues);
+    AtfFilterCallbackTcpIpv6(
+        fixedValues,
+        classifyOut,
+        _flow_direction_inbound
+    );
+}
+
+void NTAPI AtfClassifyFuncTcpV6Outbound(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+)
+{
     UNREFERENCED_PARAMETER(metaValues);
     UNREFERENCED_PARAMETER(layerData);
     UNREFERENCED_PARAMETER(classifyContext);
     UNREFERENCED_PARAMETER(filter);
-    UNREFERENCED_PARAMETER(fixedValues);
     UNREFERENCED_PARAMETER(flowContext);
-    UNREFERENCED_PARAMETER(classifyOut);
 
-    return;
+    AtfFilterCallbackTcpIpv6(
+        fixedValues,
+        classifyOut,
+        _flow_direction_outbound
+    );
 }
 
 void NTAPI AtfClassifyFuncIcmp(
@@ -595,6 +924,153 @@ void NTAPI AtfClassifyFuncIcmp(
     return;
 }
 
+//
+// Calls directly into the filter engine (AtfFilterCallbackDatagram)
+//
+void NTAPI AtfClassifyFuncDnsV4(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+)
+{
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    AtfFilterCallbackDatagram(
+        fixedValues,
+        metaValues,
+        layerData,
+        classifyOut,
+        FALSE
+    );
+}
+
+void NTAPI AtfClassifyFuncDnsV6(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+)
+{
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    AtfFilterCallbackDatagram(
+        fixedValues,
+        metaValues,
+        layerData,
+        classifyOut,
+        TRUE
+    );
+}
+
+//
+// Calls directly into the filter engine (AtfFilterCallbackStream)
+//
+void NTAPI AtfClassifyFuncTlsV4(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+)
+{
+    UNREFERENCED_PARAMETER(classifyContext);
+
+    AtfFilterCallbackStream(
+        fixedValues,
+        metaValues,
+        layerData,
+        filter->action.calloutId,
+        flowContext,
+        classifyOut,
+        FALSE
+    );
+}
+
+void NTAPI AtfClassifyFuncTlsV6(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+)
+{
+    UNREFERENCED_PARAMETER(classifyContext);
+
+    AtfFilterCallbackStream(
+        fixedValues,
+        metaValues,
+        layerData,
+        filter->action.calloutId,
+        flowContext,
+        classifyOut,
+        TRUE
+    );
+}
+
+//
+// Calls directly into the filter engine (AtfFilterCallbackQuic)
+//
+void NTAPI AtfClassifyFuncQuicV4(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+)
+{
+    UNREFERENCED_PARAMETER(metaValues);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    AtfFilterCallbackQuic(
+        fixedValues,
+        layerData,
+        classifyOut,
+        FALSE
+    );
+}
+
+void NTAPI AtfClassifyFuncQuicV6(
+    _In_        const FWPS_INCOMING_VALUES0 *fixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0 *metaValues,
+    _Inout_opt_ void *layerData,
+    _In_opt_    const void *classifyContext,
+    _In_        const FWPS_FILTER3 *filter,
+    _In_        UINT64 flowContext,
+    _Inout_     FWPS_CLASSIFY_OUT0 *classifyOut
+)
+{
+    UNREFERENCED_PARAMETER(metaValues);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    AtfFilterCallbackQuic(
+        fixedValues,
+        layerData,
+        classifyOut,
+        TRUE
+    );
+}
+
 NTSTATUS NTAPI AtfNotifyFunctionHandler(
     _In_    FWPS_CALLOUT_NOTIFY_TYPE notifyType,
     _In_    const GUID* filterKey,
@@ -634,9 +1110,11 @@ void NTAPI AtfFlowDeleteFunctionHandler(
 {
     UNREFERENCED_PARAMETER(layerId);
     UNREFERENCED_PARAMETER(calloutId);
-    UNREFERENCED_PARAMETER(flowContext);
 
     //ATF_DEBUGAF("Received layerId: 0x%08x", layerId);
 
+    // Only the stream callouts associate contexts with their flows
+    AtfFilterFreeStreamFlow(flowContext);
+
     return;
 }
\ No newline at end of file
@@ -0,0 +1,429 @@
+#include <Windows.h>
+
+#include "domain_dafsa_builder.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/domain_dafsa_format.h"
+#include "../common/user_logging.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+// Sort rank of the label separator, below every char of a name
+#define DOMAIN_DAFSA_SEPARATOR_RANK         0x01
+
+// Largest stream that can be addressed with offsets of the minimum width
+#define DOMAIN_DAFSA_MIN_WIDTH_STREAM_SIZE  (1ULL << (DOMAIN_DAFSA_MIN_OFFSET_WIDTH * 8))
+
+ATF_ERROR DomainDafsaBuilder::CompileImage(const std::vector<std::string> &domains, std::vector<std::byte> &imageOut)
+{
+    imageOut.clear();
+    numOfDomains = 0;
+
+    std::vector<std::string> names;
+    names.reserve(domains.size());
+
+    for (const std::string &domain : domains) {
+        std::string name;
+        if (!ParseDomainName(domain, name)) {
+            continue;
+        }
+
+        names.push_back(reverseLabels(name));
+    }
+
+    //
+    // 1. Sort the reversed names, a listed domain covers its subdomains so they are dropped
+    //
+    sortAndDropCovered(names);
+    if (names.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    numOfDomains = names.size();
+
+    //
+    // 2. Build the minimal automaton
+    //
+    std::vector<DAFSA_STATE> states;
+    const size_t numOfStates = buildAutomaton(names, states);
+
+    names.clear();
+    names.shrink_to_fit();
+
+    //
+    // 3. Serialize the states, with wider offsets if the stream does not fit the minimum width
+    //
+    std::vector<uint8_t> nodes;
+    size_t numOfNodes = 0;
+    uint32_t offsetWidth = DOMAIN_DAFSA_MIN_OFFSET_WIDTH;
+
+    layoutNodes(states, offsetWidth, nodes, numOfNodes);
+    if (nodes.size() > DOMAIN_DAFSA_MIN_WIDTH_STREAM_SIZE) {
+        offsetWidth = DOMAIN_DAFSA_MAX_OFFSET_WIDTH;
+        layoutNodes(states, offsetWidth, nodes, numOfNodes);
+    }
+
+    const size_t nodesOffset = sizeof(DOMAIN_DAFSA_HEADER);
+    const size_t imageSize = alignSize(nodesOffset + nodes.size());
+
+    if (imageSize > BULK_UPLOAD_MAX_SIZE) {
+        return ATF_BULK_PAYLOAD_TOO_LARGE;
+    }
+
+    imageOut.resize(imageSize);
+    std::memcpy(imageOut.data() + nodesOffset, nodes.data(), nodes.size());
+
+    DOMAIN_DAFSA_HEADER *header = reinterpret_cast<DOMAIN_DAFSA_HEADER *>(imageOut.data());
+
+    header->magic = DOMAIN_DAFSA_MAGIC;
+    header->version = DOMAIN_DAFSA_VERSION;
+    header->headerSize = sizeof(DOMAIN_DAFSA_HEADER);
+    header->flags = 0;
+    header->imageSize = imageSize;
+    header->numOfDomains = numOfDomains;
+    header->numOfStates = numOfStates;
+    header->numOfNodes = numOfNodes;
+    header->nodesOffset = nodesOffset;
+    header->nodesSize = nodes.size();
+    header->offsetWidth = offsetWidth;
+
+    header->checksum = AtfIpv4ImageChecksum(imageOut.data() + sizeof(DOMAIN_DAFSA_HEADER), imageSize - sizeof(DOMAIN_DAFSA_HEADER));
+
+    LOG_DEBUG("Compiled domain image: %d domains, %d states, %d nodes, %d bytes",
+        numOfDomains, numOfStates, numOfNodes, imageSize);
+
+    return ATF_ERROR_OK;
+}
+
+size_t DomainDafsaBuilder::GetNumOfDomains(void) const
+{
+    return numOfDomains;
+}
+
+bool DomainDafsaBuilder::ParseDomainName(const std::string &in, std::string &out)
+{
+    std::string name = in;
+    std::transform(name.begin(), name.end(), name.begin(), [](char c) {
+        return (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : c;
+    });
+
+    if (!name.empty() && name.back() == DOMAIN_DAFSA_LABEL_SEPARATOR) {
+        name.pop_back();
+    }
+
+    if (name.compare(0, 2, "*.") == 0) {
+        name.erase(0, 2);
+    } else if (!name.empty() && name.front() == DOMAIN_DAFSA_LABEL_SEPARATOR) {
+        name.erase(0, 1);
+    }
+
+    if (name.empty() || name.size() > DOMAIN_DAFSA_MAX_NAME_LENGTH) {
+        return false;
+    }
+
+    size_t numOfLabels = 1;
+    size_t labelLength = 0;
+    bool isNumeric = true;
+    for (const char c : name) {
+        if (c == DOMAIN_DAFSA_LABEL_SEPARATOR) {
+            if (!labelLength) {
+                return false;
+            }
+
+            numOfLabels++;
+            labelLength = 0;
+            continue;
+        }
+
+        const bool isDigit = c >= '0' && c <= '9';
+        if (!isDigit && !(c >= 'a' && c <= 'z') && c != '-' && c != '_') {
+            return false;
+        }
+
+        isNumeric &= isDigit;
+
+        if (++labelLength > DOMAIN_DAFSA_MAX_LABEL_LENGTH) {
+            return false;
+        }
+    }
+
+    // Hosts files list localhost and 0.0.0.0 as well
+    if (!labelLength || numOfLabels < 2 || isNumeric) {
+        return false;
+    }
+
+    out = name;
+
+    return true;
+}
+
+std::string DomainDafsaBuilder::reverseLabels(const std::string &name)
+{
+    std::string reversed;
+    reversed.reserve(name.size());
+
+    size_t labelEnd = name.size();
+    while (labelEnd != std::string::npos) {
+        const size_t separator = labelEnd ? name.rfind(DOMAIN_DAFSA_LABEL_SEPARATOR, labelEnd - 1) : std::string::npos;
+        const size_t labelStart = separator == std::string::npos ? 0 : separator + 1;
+
+        if (!reversed.empty()) {
+            reversed.push_back(DOMAIN_DAFSA_LABEL_SEPARATOR);
+        }
+        reversed.append(name, labelStart, labelEnd - labelStart);
+
+        labelEnd = separator;
+    }
+
+    return reversed;
+}
+
+void DomainDafsaBuilder::sortAndDropCovered(std::vector<std::string> &names)
+{
+    //
+    // With the separator ranked first, the subdomains of com.example (com.example.*) sort right after it and
+    //  before com.example-cdn, so a name is covered if it extends the last name kept with a separator
+    //
+    for (std::string &name : names) {
+        std::replace(name.begin(), name.end(), (char)DOMAIN_DAFSA_LABEL_SEPARATOR, (char)DOMAIN_DAFSA_SEPARATOR_RANK);
+    }
+
+    std::sort(names.begin(), names.end());
+
+    size_t numOfKept = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (numOfKept) {
+            const std::string &kept = names[numOfKept - 1];
+            if (names[i].size() >= kept.size() &&
+                names[i].compare(0, kept.size(), kept) == 0 &&
+                (names[i].size() == kept.size() || names[i][kept.size()] == DOMAIN_DAFSA_SEPARATOR_RANK))
+            {
+                continue;
+            }
+        }
+
+        if (numOfKept != i) {
+            names[numOfKept] = std::move(names[i]);
+        }
+        numOfKept++;
+    }
+
+    names.resize(numOfKept);
+
+    for (std::string &name : names) {
+        std::replace(name.begin(), name.end(), (char)DOMAIN_DAFSA_SEPARATOR_RANK, (char)DOMAIN_DAFSA_LABEL_SEPARATOR);
+    }
+}
+
+size_t DomainDafsaBuilder::buildAutomaton(const std::vector<std::string> &names, std::vector<DAFSA_STATE> &statesOut)
+{
+    statesOut.clear();
+    statesOut.push_back({ false, {} });
+
+    // Registered states by signature (finality, then each transition and its target)
+    std::unordered_map<std::string, uint32_t> registry;
+    registry.reserve(names.size() * 2);
+
+    // States merged into a registered one, reused for the next names
+    std::vector<uint32_t> freeStates;
+
+    // States along the previous name, path[0] is the root
+    std::vector<uint32_t> path(1, 0);
+
+    std::string signature;
+
+    //
+    // Replace or register the states of the previous name below depth, deepest first so that the targets of a
+    //  state are final when its signature is taken
+    //
+    auto minimize = [&](size_t depth) {
+        while (path.size() > depth + 1) {
+            const uint32_t state = path.back();
+            path.pop_back();
+
+            const DAFSA_STATE &s = statesOut[state];
+            signature.assign(1, s.isFinal ? '\x01' : '\x00');
+            for (const std::pair<uint8_t, uint32_t> &edge : s.edges) {
+                signature.push_back((char)edge.first);
+                signature.append(reinterpret_cast<const char *>(&edge.second), sizeof(edge.second));
+            }
+
+            std::unordered_map<std::string, uint32_t>::const_iterator registered = registry.find(signature);
+            if (registered == registry.end()) {
+                registry.emplace(signature, state);
+                continue;
+            }
+
+            statesOut[path.back()].edges.back().second = registered->second;
+
+            statesOut[state].edges.clear();
+            statesOut[state].isFinal = false;
+            freeStates.push_back(state);
+        }
+    };
+
+    const std::string *previous = nullptr;
+    for (const std::string &name : names) {
+        size_t prefixLength = 0;
+        if (previous) {
+            const size_t maxLength = std::min(previous->size(), name.size());
+            while (prefixLength < maxLength && (*previous)[prefixLength] == name[prefixLength]) {
+                prefixLength++;
+            }
+        }
+
+        minimize(prefixLength);
+
+        for (size_t i = prefixLength; i < name.size(); i++) {
+            uint32_t state = 0;
+            if (freeStates.empty()) {
+                state = (uint32_t)statesOut.size();
+                statesOut.push_back({ false, {} });
+            } else {
+                state = freeStates.back();
+                freeStates.pop_back();
+            }
+
+            statesOut[path.back()].edges.push_back({ (uint8_t)name[i], state });
+            path.push_back(state);
+        }
+
+        statesOut[path.back()].isFinal = true;
+        previous = &name;
+    }
+
+    minimize(0);
+
+    return registry.size() + 1;
+}
+
+void DomainDafsaBuilder::layoutNodes(
+    const std::vector<DAFSA_STATE> &states,
+    uint32_t offsetWidth,
+    std::vector<uint8_t> &nodesOut,
+    size_t &numOfNodesOut
+)
+{
+    static const uint32_t notPlaced = UINT32_MAX;
+
+    nodesOut.clear();
+    numOfNodesOut = 0;
+
+    std::vector<uint32_t> inDegree(states.size());
+
+    std::vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+        const uint32_t state = stack.back();
+        stack.pop_back();
+
+        for (const std::pair<uint8_t, uint32_t> &edge : states[state].edges) {
+            if (!inDegree[edge.second]++) {
+                stack.push_back(edge.second);
+            }
+        }
+    }
+
+    // Node offset of each state, and the target fields to fill in once every state is placed
+    std::vector<uint32_t> nodeOffset(states.size(), notPlaced);
+    std::vector<std::pair<size_t, uint32_t>> fixups;
+
+    auto isChainState = [&](uint32_t state) {
+        return !states[state].isFinal && states[state].edges.size() == 1;
+    };
+
+    auto appendTarget = [&](uint32_t target) {
+        fixups.push_back({ nodesOut.size(), target });
+        nodesOut.insert(nodesOut.end(), offsetWidth, 0);
+    };
+
+    // Placed states are still on the stack when they are reached twice
+    stack.assign(1, 0);
+    while (!stack.empty()) {
+        uint32_t state = stack.back();
+        stack.pop_back();
+
+        // Nodes written inline, one after the other, as long as a chain leads to a state not written yet
+        while (state != notPlaced && nodeOffset[state] == notPlaced) {
+            nodeOffset[state] = (uint32_t)nodesOut.size();
+            numOfNodesOut++;
+
+            const DAFSA_STATE &s = states[state];
+            if (isChainState(state)) {
+                const size_t headerOffset = nodesOut.size();
+                nodesOut.push_back(0);
+
+                // States only reached from the chain are merged into it, they are never the target of a node
+                uint32_t length = 0;
+                uint32_t next = state;
+                for (;;) {
+                    const std::pair<uint8_t, uint32_t> &edge = states[next].edges.front();
+                    nodesOut.push_back(edge.first);
+                    length++;
+                    next = edge.second;
+
+                    if (length == DOMAIN_DAFSA_CHAIN_LENGTH_MASK || !isChainState(next) ||
+                        inDegree[next] != 1 || nodeOffset[next] != notPlaced)
+                    {
+                        break;
+                    }
+
+                    nodeOffset[next] = nodeOffset[state];
+                }
+
+                uint8_t flags = (uint8_t)(DOMAIN_DAFSA_NODE_CHAIN | length);
+                if (nodeOffset[next] == notPlaced) {
+                    state = next;
+                } else {
+                    flags |= DOMAIN_DAFSA_NODE_JUMP;
+                    appendTarget(next);
+                    state = notPlaced;
+                }
+
+                nodesOut[headerOffset] = flags;
+                continue;
+            }
+
+            // The driver scans the chars of a branch in ascending order
+            std::vector<std::pair<uint8_t, uint32_t>> edges = s.edges;
+            std::sort(edges.begin(), edges.end());
+
+            nodesOut.push_back(s.isFinal ? DOMAIN_DAFSA_NODE_FINAL : 0);
+            nodesOut.push_back((uint8_t)edges.size());
+            for (const std::pair<uint8_t, uint32_t> &edge : edges) {
+                nodesOut.push_back(edge.first);
+            }
+            for (const std::pair<uint8_t, uint32_t> &edge : edges) {
+                appendTarget(edge.second);
+            }
+
+            // The first char is written next
+            for (std::vector<std::pair<uint8_t, uint32_t>>::const_reverse_iterator i = edges.rbegin(); i != edges.rend(); i++) {
+                if (nodeOffset[i->second] == notPlaced) {
+                    stack.push_back(i->second);
+                }
+            }
+
+            state = notPlaced;
+        }
+    }
+
+    for (const std::pair<size_t, uint32_t> &fixup : fixups) {
+        const uint32_t offset = nodeOffset[fixup.second];
+        for (uint32_t i = 0; i < offsetWidth; i++) {
+            nodesOut[fixup.first + i] = (uint8_t)(offset >> (i * 8));
+        }
+    }
+}
+
+size_t DomainDafsaBuilder::alignSize(size_t size)
+{
+    return (size + DOMAIN_DAFSA_ALIGNMENT - 1) & ~((size_t)DOMAIN_DAFSA_ALIGNMENT - 1);
+}
+
+//EOF
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/domain_dafsa_format.h"
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Compiles domain blocklists into a reversed-label DAFSA image (see domain_dafsa_format.h), which the driver
+//  adopts as is
+//
+//  1. The names are reversed by label (www.example.com becomes com.example.www) and sorted with the label
+//     separator ranked below every other char. A name then directly follows every name it is a subdomain of, so
+//     duplicates and the names covered by another listed domain are dropped in the same pass
+//  2. The sorted names are inserted into a minimal automaton with the incremental algorithm for sorted input
+//     (Daciuk et al.): the states of the previous name below the common prefix can no longer change, so they are
+//     replaced by an equivalent registered state, or registered, before the next name is added
+//  3. The states are serialized depth first. Runs of single-edge, non-final states only reached from their
+//     predecessor are collapsed into chain nodes, which are followed by the node they lead to whenever it has not
+//     been written yet, so most transitions cost one byte and no offset
+//
+class DomainDafsaBuilder {
+private:
+    typedef struct _dafsa_state {
+        bool                                    isFinal;
+
+        // Transitions in insertion order (the sort order of the names), with the target state
+        std::vector<std::pair<uint8_t, uint32_t>> edges;
+    } DAFSA_STATE;
+
+    // Number of distinct domains in the last compiled image
+    size_t                                      numOfDomains;
+
+public:
+    DomainDafsaBuilder(void) :
+        numOfDomains(0)
+    {
+
+    }
+
+    ~DomainDafsaBuilder(void)
+    {
+
+    }
+
+    //
+    // Compile the domains into an image, imageOut receives the whole image (header included)
+    //  Names that ParseDomainName() rejects are skipped. Returns ATF_NO_DATA_AVAILABLE if no name is left
+    //
+    ATF_ERROR CompileImage(const std::vector<std::string> &domains, std::vector<std::byte> &imageOut);
+
+    //
+    // Returns the number of distinct domains in the last compiled image
+    //
+    size_t GetNumOfDomains(void) const;
+
+    //
+    // Normalize a blocklist entry into a lowercase domain name, returns false if it is not one
+    //  A trailing dot and a leading wildcard label (*.example.com or .example.com) are removed, since every
+    //  listed domain covers its subdomains. Names need at least two labels, and IPv4 addresses are rejected
+    //
+    static bool ParseDomainName(const std::string &in, std::string &out);
+
+private:
+    //
+    // Reverse the labels of a domain name, www.example.com becomes com.example.www
+    //
+    static std::string reverseLabels(const std::string &name);
+
+    //
+    // Sort the reversed names, and drop the duplicates and the names covered by another one
+    //
+    static void sortAndDropCovered(std::vector<std::string> &names);
+
+    //
+    // Build the minimal automaton of the sorted names, the root is state 0
+    //  Returns the number of states reachable from the root
+    //
+    static size_t buildAutomaton(const std::vector<std::string> &names, std::vector<DAFSA_STATE> &statesOut);
+
+    //
+    // Serialize the states into the node stream, with offsetWidth byte targets
+    //
+    static void layoutNodes(
+        const std::vector<DAFSA_STATE> &states,
+        uint32_t offsetWidth,
+        std::vector<uint8_t> &nodesOut,
+        size_t &numOfNodesOut
+    );
+
+    //
+    // Round up to DOMAIN_DAFSA_ALIGNMENT
+    //
+    static size_t alignSize(size_t size);
+};
+
+//EOF
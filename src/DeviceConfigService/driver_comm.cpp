@@ -81,6 +81,40 @@ ATF_ERROR IoctlComm::SendRawBufferIoctl(IOCTL_CODE ioctl, const std::vector<std:
     return SendRawBufferIoctl(ioctl, rawBuffer.data(), rawBuffer.size());
 }
 
+ATF_ERROR IoctlComm::SendDirectBufferIoctl(
+    IOCTL_CODE ioctl, 
+    const void *inPtr, 
+    size_t inSize, 
+    const void *dataPtr, 
+    size_t dataSize) const
+{
+    if (driverHandle == INVALID_HANDLE_VALUE) {
+        return ATF_FAILED_HANDLE_NOT_OPENED;
+    }
+
+    if (!inSize || !dataSize) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    DWORD bytesReturned = 0;
+
+    if (!DeviceIoControl(
+        driverHandle,
+        ioctl,
+        const_cast<void *>(inPtr),
+        (DWORD)inSize,
+        const_cast<void *>(dataPtr),
+        (DWORD)dataSize,
+        &bytesReturned,
+        NULL
+    )) 
+    {
+        return ATF_DEVICEIOCONTROL;
+    }
+
+    return ATF_ERROR_OK;
+}
+
 ATF_ERROR IoctlComm::SendIoctlNoData(IOCTL_CODE ioctl) const
 {
     if (driverHandle == INVALID_HANDLE_VALUE) {
@@ -60,6 +60,18 @@ public:
     ATF_ERROR SendRawBufferIoctl(IOCTL_CODE ioctl, const std::vector<std::byte> &rawBuffer) const;
     ATF_ERROR SendRawBufferIoctl(IOCTL_CODE ioctl, const void *ptr, size_t size) const;
 
+    //
+    // Send a small input buffer along with a large data buffer, for METHOD_IN_DIRECT IOCTLs
+    //  The data buffer is passed as the output buffer, which the I/O manager locks and maps for the driver
+    //  instead of copying it
+    //
+    ATF_ERROR SendDirectBufferIoctl(
+        IOCTL_CODE ioctl, 
+        const void *inPtr, 
+        size_t inSize, 
+        const void *dataPtr, 
+        size_t dataSize) const;
+
     //
     // Send a raw IOCTL, without any input or output buffer
     //
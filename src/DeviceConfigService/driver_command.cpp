@@ -4,12 +4,18 @@
 #include "../common/user_logging.h"
 #include "../common/errors.h"
 #include "driver_command.h"
+#include "ipv4_image_builder.h"
+#include "ipv4_bulk_builder.h"
+#include "ipv4_delta_builder.h"
+#include "domain_dafsa_builder.h"
+#include "payload_sig_builder.h"
 
 #include <vector>
 #include <string>
 #include <cstring>
 #include <cstdint>
 #include <memory>
+#include <chrono>
 
 #include <inaddr.h>
 
@@ -79,7 +85,7 @@ ATF_ERROR DriverCommand::CmdStopWfp(void)
     return atfError;
 }
 
-ATF_ERROR DriverCommand::CmdFlushConfig(void) const
+ATF_ERROR DriverCommand::CmdFlushConfig(void)
 {
     ATF_ERROR atfError = ATF_ERROR_OK;
 
@@ -91,10 +97,17 @@ ATF_ERROR DriverCommand::CmdFlushConfig(void) const
         return ATF_WFP_ALREADY_RUNNING;
     }
 
-    return ioctlComm->SendIoctlNoData(IOCTL_ATF_FLUSH_CONFIG);
+    atfError = ioctlComm->SendIoctlNoData(IOCTL_ATF_FLUSH_CONFIG);
+    if (atfError) {
+        return atfError;
+    }
+
+    sentIpv4Blacklist.clear();
+
+    return atfError;
 }
 
-ATF_ERROR DriverCommand::CmdSendIniConfiguration(void) const
+ATF_ERROR DriverCommand::CmdSendIniConfiguration(void)
 {
     ATF_ERROR atfError = ATF_ERROR_OK;
 
@@ -116,10 +129,18 @@ ATF_ERROR DriverCommand::CmdSendIniConfiguration(void) const
         return ATF_NO_INI_CONFIG;
     }
 
-    return ioctlComm->SendRawBufferIoctl(IOCTL_ATF_SEND_WFP_CONFIG, configSerialized);
+    // A new default config starts with an empty lookup engine
+    atfError = ioctlComm->SendRawBufferIoctl(IOCTL_ATF_SEND_WFP_CONFIG, configSerialized);
+    if (atfError) {
+        return atfError;
+    }
+
+    sentIpv4Blacklist.clear();
+
+    return atfError;
 }
 
-ATF_ERROR DriverCommand::CmdAppendIpv4Blacklist(void) const
+ATF_ERROR DriverCommand::CmdAppendIpv4Blacklist(void)
 {
     if (!isDeviceReady()) {
         return ATF_DEVICE_NOT_CONNECTED;
@@ -130,31 +151,224 @@ ATF_ERROR DriverCommand::CmdAppendIpv4Blacklist(void) const
         return ATF_WFP_ALREADY_RUNNING;
     }
 
-    const std::vector<struct in_addr> &list = filterConfig->GetIpv4BlacklistOnline();
-
-    if (!list.size()) {
+    if (!filterConfig->GetIpv4BlacklistOnline().size()) {
         return ATF_NO_DATA_AVAILABLE;
     }
 
-    // Serialize the IP list into a raw buffer
-    const size_t totalSize = list.size() * sizeof(struct in_addr);
-    std::vector<std::byte> rawBuf(totalSize);
-    CopyMemory(rawBuf.data(), list.data(), list.size() * sizeof(struct in_addr));
+    //
+    // The trie engine takes a compiled image, which the driver adopts without building anything.
+    //  The other engines are built by the driver from the raw list, sorted and without duplicates
+    //
+    if (filterConfig->GetIpv4LookupEngine() == IPV4_ENGINE_TRIE) {
+        return sendIpv4Image();
+    }
 
+    return sendIpv4Blacklist();
+}
 
-    // Split the blacklist buffer into chunks and send it, as it cannot exceed IOCTL size BLACKLIST_IPV4_MAX_SIZE
-    while (rawBuf.size()) {
-        const std::vector<std::byte> chunk(rawBuf.begin(), 
-            rawBuf.begin() + (rawBuf.size() > BLACKLIST_IPV4_MAX_SIZE ? BLACKLIST_IPV4_MAX_SIZE : rawBuf.size()));
+ATF_ERROR DriverCommand::CmdUpdateIpv4Blacklist(void)
+{
+    ATF_ERROR atfError = ATF_ERROR_OK;
 
-        ATF_ERROR atfError = ioctlComm->SendRawBufferIoctl(IOCTL_ATF_APPEND_IPV4_BLACKLIST, chunk);
-        if (atfError) {
-            return atfError;
+    if (!isDeviceReady()) {
+        return ATF_DEVICE_NOT_CONNECTED;
+    }
+
+    // The image is immutable in the driver, so it is replaced as a whole
+    if (filterConfig->GetIpv4LookupEngine() == IPV4_ENGINE_TRIE) {
+        if (!filterConfig->GetIpv4BlacklistOnline().size()) {
+            return ATF_NO_DATA_AVAILABLE;
         }
 
-        rawBuf.erase(rawBuf.begin(), rawBuf.begin() + chunk.size());
+        return sendIpv4Image();
+    }
+
+    // Nothing to diff against yet
+    if (sentIpv4Blacklist.empty()) {
+        return sendIpv4Blacklist();
+    }
+
+    size_t numOfDuplicates = 0;
+    std::vector<IPV4_PREFIX_ENTRY> currentList = 
+        Ipv4BulkBuilder::SortUnique(filterConfig->GetIpv4BlacklistOnline(), numOfDuplicates);
+
+    // The ini blocklist is in the same lookup engine, a removal must not clear its entries either
+    std::vector<IPV4_PREFIX_ENTRY> retainedList = currentList;
+    const std::vector<IPV4_PREFIX_ENTRY> &iniList = filterConfig->GetIpv4BlacklistIni();
+    retainedList.insert(retainedList.end(), iniList.begin(), iniList.end());
+    retainedList = Ipv4BulkBuilder::SortUnique(retainedList, numOfDuplicates);
+
+    std::vector<IPV4_PREFIX_ENTRY> removals;
+    std::vector<IPV4_PREFIX_ENTRY> additions;
+    Ipv4DeltaBuilder::Diff(sentIpv4Blacklist, currentList, retainedList, removals, additions);
+
+    if (removals.empty() && additions.empty()) {
+        LOG_DEBUG("IPv4 blacklist unchanged (%d entries)", currentList.size());
+        return ATF_ERROR_OK;
+    }
+
+    const std::vector<std::byte> delta = Ipv4DeltaBuilder::Serialize(removals, additions);
+
+    if (delta.size() <= IPV4_DELTA_MAX_SIZE) {
+        atfError = ioctlComm->SendRawBufferIoctl(IOCTL_ATF_APPLY_IPV4_DELTA, delta);
+    } else {
+        atfError = sendBulkPayload(BULK_PAYLOAD_IPV4_DELTA, delta.data(), delta.size());
+    }
+
+    if (atfError) {
+        return atfError;
+    }
+
+    LOG_INFO("Sent IPv4 blacklist delta (%d removals, %d additions) for %d entries",
+        removals.size(), additions.size(), currentList.size());
+
+    sentIpv4Blacklist.swap(currentList);
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR DriverCommand::CmdAppendIpv6Blacklist(void)
+{
+    if (!isDeviceReady()) {
+        return ATF_DEVICE_NOT_CONNECTED;
+    }
+
+    // WFP engine cannot be running while sending commands to filter.c
+    if (isWfpReady()) {
+        return ATF_WFP_ALREADY_RUNNING;
+    }
+
+    // Sorted and without duplicate or covered prefixes (see Ipv6Aggregator)
+    const std::vector<IPV6_PREFIX_ENTRY> &distinctList = filterConfig->GetIpv6BlacklistOnline();
+    if (distinctList.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    ATF_ERROR atfError = sendBulkPayload(
+        BULK_PAYLOAD_IPV6_BLOCKLIST,
+        distinctList.data(),
+        distinctList.size() * sizeof(IPV6_PREFIX_ENTRY)
+    );
+    if (atfError) {
+        return atfError;
     }
 
+    LOG_INFO("Sent %d IPv6 prefixes from the online blacklists", distinctList.size());
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR DriverCommand::CmdSendIpv4Rules(void)
+{
+    if (!isDeviceReady()) {
+        return ATF_DEVICE_NOT_CONNECTED;
+    }
+
+    // WFP engine cannot be running while sending commands to filter.c
+    if (isWfpReady()) {
+        return ATF_WFP_ALREADY_RUNNING;
+    }
+
+    const std::vector<IPV4_RULE_ENTRY> &rules = filterConfig->GetIpv4Rules();
+    if (rules.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    ATF_ERROR atfError = sendBulkPayload(BULK_PAYLOAD_IPV4_RULES, rules.data(), rules.size() * sizeof(IPV4_RULE_ENTRY));
+    if (atfError) {
+        return atfError;
+    }
+
+    LOG_INFO("Sent %d IPv4 rules", rules.size());
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR DriverCommand::CmdSendDomainBlacklist(void)
+{
+    if (!isDeviceReady()) {
+        return ATF_DEVICE_NOT_CONNECTED;
+    }
+
+    // WFP engine cannot be running while sending commands to filter.c
+    if (isWfpReady()) {
+        return ATF_WFP_ALREADY_RUNNING;
+    }
+
+    std::vector<std::string> domains = filterConfig->GetDomainBlacklistIni();
+    const std::vector<std::string> &domainsOnline = filterConfig->GetDomainBlacklistOnline();
+    domains.insert(domains.end(), domainsOnline.begin(), domainsOnline.end());
+    if (domains.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    DomainDafsaBuilder builder;
+    std::vector<std::byte> image;
+
+    const auto compileStart = std::chrono::steady_clock::now();
+
+    ATF_ERROR atfError = builder.CompileImage(domains, image);
+    if (atfError) {
+        return atfError;
+    }
+
+    const auto compileTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - compileStart);
+    LOG_DEBUG("Compiled %d domain entries in %lld ms", domains.size(), (long long)compileTime.count());
+
+    atfError = sendBulkPayload(BULK_PAYLOAD_DOMAIN_IMAGE, image.data(), image.size());
+    if (atfError) {
+        return atfError;
+    }
+
+    LOG_INFO("Sent %d blacklist domains (%d bytes)", builder.GetNumOfDomains(), image.size());
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR DriverCommand::CmdSendPayloadSignatures(void)
+{
+    if (!isDeviceReady()) {
+        return ATF_DEVICE_NOT_CONNECTED;
+    }
+
+    // WFP engine cannot be running while sending commands to filter.c
+    if (isWfpReady()) {
+        return ATF_WFP_ALREADY_RUNNING;
+    }
+
+    const std::string &signatureFile = filterConfig->GetPayloadSignatureFile();
+    if (signatureFile.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    std::vector<PayloadSigBuilder::PAYLOAD_SIGNATURE> signatures;
+    ATF_ERROR atfError = PayloadSigBuilder::ParseSignatureFile(signatureFile, signatures);
+    if (atfError) {
+        return atfError;
+    }
+
+    PayloadSigBuilder builder;
+    std::vector<std::byte> image;
+
+    const auto compileStart = std::chrono::steady_clock::now();
+
+    atfError = builder.CompileImage(signatures, image);
+    if (atfError) {
+        return atfError;
+    }
+
+    const auto compileTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - compileStart);
+    LOG_DEBUG("Compiled %d payload signatures in %lld ms", signatures.size(), (long long)compileTime.count());
+
+    atfError = sendBulkPayload(BULK_PAYLOAD_SIGNATURE_IMAGE, image.data(), image.size());
+    if (atfError) {
+        return atfError;
+    }
+
+    LOG_INFO("Sent %d payload signatures (%d bytes)", builder.GetNumOfSignatures(), image.size());
+
     return ATF_ERROR_OK;
 }
 
@@ -191,4 +405,107 @@ bool DriverCommand::isWfpReady(void) const
     return wfpRunning;
 }
 
+ATF_ERROR DriverCommand::sendBulkPayload(BULK_PAYLOAD_TYPE payloadType, const void *payload, size_t payloadSize) const
+{
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    if (!payload || !payloadSize) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    if (payloadSize > BULK_UPLOAD_MAX_SIZE) {
+        return ATF_BULK_PAYLOAD_TOO_LARGE;
+    }
+
+    BULK_UPLOAD_BEGIN begin = { 0 };
+    begin.magic = BULK_UPLOAD_MAGIC;
+    begin.payloadType = payloadType;
+    begin.totalSize = payloadSize;
+
+    atfError = ioctlComm->SendRawBufferIoctl(IOCTL_ATF_BULK_UPLOAD_BEGIN, &begin, sizeof(begin));
+    if (atfError) {
+        return atfError;
+    }
+
+    // A 1M entry blocklist is 8MB, so it fits in a single transfer
+    const uint8_t *rawPayload = static_cast<const uint8_t *>(payload);
+    for (size_t offset = 0; offset < payloadSize; offset += BULK_UPLOAD_MAX_TRANSFER_SIZE) {
+        const size_t transferSize = 
+            (payloadSize - offset) > BULK_UPLOAD_MAX_TRANSFER_SIZE ? BULK_UPLOAD_MAX_TRANSFER_SIZE : (payloadSize - offset);
+
+        BULK_UPLOAD_DATA header = { 0 };
+        header.offset = offset;
+
+        atfError = ioctlComm->SendDirectBufferIoctl(
+            IOCTL_ATF_BULK_UPLOAD_DATA, 
+            &header, 
+            sizeof(header), 
+            rawPayload + offset, 
+            transferSize
+        );
+        if (atfError) {
+            return atfError;
+        }
+    }
+
+    LOG_DEBUG("Bulk upload sent %d bytes, committing", payloadSize);
+
+    return ioctlComm->SendIoctlNoData(IOCTL_ATF_BULK_UPLOAD_COMMIT);
+}
+
+ATF_ERROR DriverCommand::sendIpv4Image(void) const
+{
+    const std::vector<IPV4_PREFIX_ENTRY> &list = filterConfig->GetIpv4BlacklistOnline();
+
+    Ipv4ImageBuilder builder;
+    std::vector<std::byte> image;
+
+    const auto compileStart = std::chrono::steady_clock::now();
+
+    ATF_ERROR atfError = builder.CompileImage(list, filterConfig->GetIpv4PrefilterMode(), image);
+    if (atfError == ATF_BULK_PAYLOAD_TOO_LARGE) {
+        // The driver refuses the upload anyway, about 10M distinct addresses fill the limit without a prefilter
+        LOG_ERROR("IPv4 image of %llu entries is %llu bytes, over the bulk upload limit of %llu bytes. Use "
+            "ipv4_prefilter = PREFILTER_ONLY or smaller feeds", (unsigned long long)list.size(),
+            (unsigned long long)builder.GetImageSize(), (unsigned long long)BULK_UPLOAD_MAX_SIZE);
+        return atfError;
+    }
+    if (atfError) {
+        return atfError;
+    }
+
+    const auto compileTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - compileStart);
+    LOG_DEBUG("Compiled %d IPv4 entries in %lld ms", list.size(), (long long)compileTime.count());
+
+    return sendBulkPayload(BULK_PAYLOAD_IPV4_IMAGE, image.data(), image.size());
+}
+
+ATF_ERROR DriverCommand::sendIpv4Blacklist(void)
+{
+    // Feeds overlap, and the driver would count every duplicate as another prefix. Sorted, the entries are also
+    //  inserted in address order
+    size_t numOfDuplicates = 0;
+    std::vector<IPV4_PREFIX_ENTRY> distinctList = 
+        Ipv4BulkBuilder::SortUnique(filterConfig->GetIpv4BlacklistOnline(), numOfDuplicates);
+    if (distinctList.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    LOG_DEBUG("Dropped %d duplicate IPv4 entries", numOfDuplicates);
+
+    ATF_ERROR atfError = sendBulkPayload(
+        BULK_PAYLOAD_IPV4_BLOCKLIST,
+        distinctList.data(),
+        distinctList.size() * sizeof(IPV4_PREFIX_ENTRY)
+    );
+    if (atfError) {
+        return atfError;
+    }
+
+    sentIpv4Blacklist.swap(distinctList);
+
+    return ATF_ERROR_OK;
+}
+
 //EOF
\ No newline at end of file
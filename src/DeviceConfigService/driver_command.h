@@ -12,6 +12,7 @@
 #include <memory>
 #include <string>
 #include <map>
+#include <vector>
 
 #if defined(_DEBUG)
 #undef OVERRIDE_CONN_REQ
@@ -30,7 +31,12 @@ public:
         { IOCTL_ATF_WFP_SERVICE_START, "START_WFP" },
         { IOCTL_ATF_WFP_SERVICE_STOP, "STOP_WFP" },
         { IOCTL_ATF_FLUSH_CONFIG, "FLUSH_CONFIG" },
-        { IOCTL_ATF_SEND_WFP_CONFIG, "SET_INI_CONFIG" }
+        { IOCTL_ATF_SEND_WFP_CONFIG, "SET_INI_CONFIG" },
+        { IOCTL_ATF_APPEND_IPV4_BLACKLIST, "APPEND_IPV4_BLACKLIST" },
+        { IOCTL_ATF_BULK_UPLOAD_BEGIN, "BULK_UPLOAD_BEGIN" },
+        { IOCTL_ATF_BULK_UPLOAD_DATA, "BULK_UPLOAD_DATA" },
+        { IOCTL_ATF_BULK_UPLOAD_COMMIT, "BULK_UPLOAD_COMMIT" },
+        { IOCTL_ATF_APPLY_IPV4_DELTA, "APPLY_IPV4_DELTA" }
     };
 
 private:
@@ -40,6 +46,10 @@ private:
 
     bool                                    wfpRunning;
 
+    // Online IPv4 blacklist as last sent to the lookup engine, sorted and without duplicates. Refreshes send the
+    //  difference to this list. Empty if the list was never sent, or went into a compiled image (IPV4_ENGINE_TRIE)
+    std::vector<IPV4_PREFIX_ENTRY>          sentIpv4Blacklist;
+
     // Cleanup
     std::shared_ptr<FilterConfig>           filterConfig;
 
@@ -78,19 +88,50 @@ public:
     // Command fto flush the configuation
     //  IOCTL_ATF_FLUSH_CONFIG
     //
-    ATF_ERROR CmdFlushConfig(void) const;
+    ATF_ERROR CmdFlushConfig(void);
 
     //
     // Default configuration load from the ini file (see ini_reader.h -- FilterConfig class)
     //  IOCTL_ATF_SEND_WFP_CONFIG
     //
-    ATF_ERROR CmdSendIniConfiguration(void) const;
+    ATF_ERROR CmdSendIniConfiguration(void);
+
+    //
+    // Command to append the online IPv4 blacklists to the driver, in a single bulk upload session
+    //  IOCTL_ATF_BULK_UPLOAD_BEGIN/DATA/COMMIT
+    //
+    ATF_ERROR CmdAppendIpv4Blacklist(void);
+
+    //
+    // Command to bring the driver up to date with refreshed online IPv4 blacklists (see FilterConfig), WFP may be running
+    //  Only the removed and added prefixes are sent (IOCTL_ATF_APPLY_IPV4_DELTA, or a bulk upload session for large
+    //  deltas). The trie engine gets a new compiled image instead
+    //
+    ATF_ERROR CmdUpdateIpv4Blacklist(void);
+
+    //
+    // Command to append the online IPv6 blacklists to the driver, in a single bulk upload session
+    //  IOCTL_ATF_BULK_UPLOAD_BEGIN/DATA/COMMIT (BULK_PAYLOAD_IPV6_BLOCKLIST)
+    //
+    ATF_ERROR CmdAppendIpv6Blacklist(void);
+
+    //
+    // Command to send the 5-tuple rules of the ini to the driver, replacing its rules
+    //  IOCTL_ATF_BULK_UPLOAD_BEGIN/DATA/COMMIT (BULK_PAYLOAD_IPV4_RULES)
+    //
+    ATF_ERROR CmdSendIpv4Rules(void);
 
     //
-    // Command to append an IPv4 blacklist to the driver
-    //  IOCTL_ATF_APPEND_IPV4_BLACKLIST
+    // Command to compile the domain blacklists (ini and online) and send them to the driver, replacing its domains
+    //  IOCTL_ATF_BULK_UPLOAD_BEGIN/DATA/COMMIT (BULK_PAYLOAD_DOMAIN_IMAGE)
     //
-    ATF_ERROR CmdAppendIpv4Blacklist(void) const;
+    ATF_ERROR CmdSendDomainBlacklist(void);
+
+    //
+    // Command to compile the payload signature file of the ini and send it to the driver, replacing its signatures
+    //  IOCTL_ATF_BULK_UPLOAD_BEGIN/DATA/COMMIT (BULK_PAYLOAD_SIGNATURE_IMAGE)
+    //
+    ATF_ERROR CmdSendPayloadSignatures(void);
 
     //
     // Get the logical device driver path
@@ -111,4 +152,19 @@ private:
     //  Config update commands require the engine to be in an OFF state
     //
     bool isWfpReady(void) const;
+
+    //
+    // Send a payload through a bulk upload session (begin, data transfers, commit)
+    //
+    ATF_ERROR sendBulkPayload(BULK_PAYLOAD_TYPE payloadType, const void *payload, size_t payloadSize) const;
+
+    //
+    // Compile the online IPv4 blacklist into a lookup image, and send it through a bulk upload session
+    //
+    ATF_ERROR sendIpv4Image(void) const;
+
+    //
+    // Send the online IPv4 blacklist, sorted and without duplicates, through a bulk upload session
+    //
+    ATF_ERROR sendIpv4Blacklist(void);
 };
@@ -6,6 +6,7 @@
 #include <curl/curl.h>
 
 #include "ini_reader.h"
+#include "policy_compiler.h"
 
 #include "../common/errors.h"
 #include "../common/user_driver_transport.h"
@@ -15,9 +16,11 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <cstring>
 #include <cstdint>
 #include <sstream>
+#include <array>
 
 //
 // Global init for CURL
@@ -44,20 +47,35 @@ ATF_ERROR IpBlacklistItem::DownloadAndParseBlacklist(void)
 
     LOG_DEBUG("downloadBlocklist() downloaded blocklist: %s size: %d bytes", blacklistName.c_str(), rawDownloadBuffer.size());
 
-    atfError = parseBufIntoList(rawDownloadBuffer, blacklist);
+    if (isDomainFeed) {
+        atfError = parseBufIntoDomains(rawDownloadBuffer, blacklistDomains);
+        if (atfError) {
+            LOG_ERROR("parseBufIntoDomains() failed for blocklist: %s, error: 0x%08x", blacklistName.c_str(), atfError);
+            return atfError;
+        }
+
+        LOG_DEBUG("parseBufIntoDomains() parsed blocklist: %s numOfDomains: %d", 
+            blacklistName.c_str(), blacklistDomains.size());
+
+        return atfError;
+    }
+
+    atfError = parseBufIntoList(rawDownloadBuffer, blacklist, blacklistIpv6);
     if (atfError) {
         LOG_ERROR("parseBufIntoList() failed for blocklist: %s, error: 0x%08x", blacklistName.c_str(), atfError);
         return atfError;
     }
 
-    LOG_DEBUG("parseBufIntoList() parsed blocklist: %s numOfIps: %d", blacklistName.c_str(), blacklist.size());
+    LOG_DEBUG("parseBufIntoList() parsed blocklist: %s numOfIps: %d numOfIpv6s: %d", 
+        blacklistName.c_str(), blacklist.size(), blacklistIpv6.size());
 
     return atfError;
 }
 
 ATF_ERROR IpBlacklistItem::parseBufIntoList(
     const std::vector<char> &buf, 
-    std::vector<struct in_addr> &ipOut
+    std::vector<IPV4_PREFIX_ENTRY> &ipOut,
+    std::vector<IPV6_PREFIX_ENTRY> &ipv6Out
 )
 {
     ATF_ERROR atfError = ATF_ERROR_OK;
@@ -68,22 +86,80 @@ ATF_ERROR IpBlacklistItem::parseBufIntoList(
     }
 
     for (std::vector<std::string>::const_iterator i = ipList.begin(); i != ipList.end(); i++) {
+        // Feeds such as Spamhaus DROP append a comment to each subnet
+        const std::string token = shared::IsolateFirstToken(*i);
+
+        IPV4_PREFIX_ENTRY entry = { 0 };
         uint32_t ip;
-        if (shared::ParseStringToIpv4(*i, ip)) {
-            struct in_addr ipAddr;
-            ipAddr.S_un.S_addr = ip;
-            blacklist.push_back(ipAddr);
+        if (shared::ParseStringToIpv4Prefix(token, ip, entry.prefixLength)) {
+            entry.address.S_un.S_addr = ip;
+            ipOut.push_back(entry);
+            continue;
+        }
+
+        // Only tokens with a ':' can be IPv6, which skips the parser for comments and blank lines
+        if (token.find(':') == std::string::npos) {
+            continue;
+        }
+
+        IPV6_PREFIX_ENTRY entryIpv6 = { 0 };
+        std::array<uint8_t, 16> ipv6;
+        if (shared::ParseStringToIpv6Prefix(token, ipv6, entryIpv6.prefixLength)) {
+            std::memcpy(entryIpv6.address.a.b.byte, ipv6.data(), ipv6.size());
+            ipv6Out.push_back(entryIpv6);
         }
     }
     
     return atfError;
 }
 
-const std::vector<struct in_addr> IpBlacklistItem::GetIps(void) const
+ATF_ERROR IpBlacklistItem::parseBufIntoDomains(
+    const std::vector<char> &buf,
+    std::vector<std::string> &domainsOut
+)
+{
+    const std::vector<std::string> lineList = shared::SplitStringByLine(buf);
+    if (!lineList.size()) {
+        return ATF_CURL_BAD_DATA;
+    }
+
+    for (std::vector<std::string>::const_iterator i = lineList.begin(); i != lineList.end(); i++) {
+        std::string token = shared::IsolateFirstToken(*i);
+        if (token.empty()) {
+            continue;
+        }
+
+        // Hosts files map the name to a sinkhole address, 0.0.0.0 example.com
+        uint32_t ip;
+        if (shared::ParseStringToIpv4(token, ip) || token.find(':') != std::string::npos) {
+            const size_t tokenEnd = i->find(token) + token.size();
+            token = shared::IsolateFirstToken(i->substr(tokenEnd));
+        }
+
+        std::string domain;
+        if (DomainDafsaBuilder::ParseDomainName(token, domain)) {
+            domainsOut.push_back(domain);
+        }
+    }
+
+    return ATF_ERROR_OK;
+}
+
+const std::vector<IPV4_PREFIX_ENTRY> IpBlacklistItem::GetIps(void) const
 {
     return blacklist;
 }
 
+const std::vector<IPV6_PREFIX_ENTRY> &IpBlacklistItem::GetIpv6s(void) const
+{
+    return blacklistIpv6;
+}
+
+const std::vector<std::string> &IpBlacklistItem::GetDomains(void) const
+{
+    return blacklistDomains;
+}
+
 const std::string IpBlacklistItem::GetName(void) const
 {
     return blacklistName;
@@ -161,15 +237,37 @@ ATF_ERROR FilterConfig::ParseIniFile(void)
 
     // Parse all layer switches
     enableLayerIpv4TcpInbound = iniReader.GetBoolean("wfp_layer", "enable_layer_inbound_tcp_v4", false);
-    enableLayerIpv4TcpOutbound = iniReader.GetBoolean("wfp_layer", "enable_layer_inbound_tcp_v6", false);
-    enableLayerIpv6TcpInbound = iniReader.GetBoolean("wfp_layer", "enable_layer_outbound_tcp_v4", false);
+    enableLayerIpv4TcpOutbound = iniReader.GetBoolean("wfp_layer", "enable_layer_outbound_tcp_v4", false);
+    enableLayerIpv6TcpInbound = iniReader.GetBoolean("wfp_layer", "enable_layer_inbound_tcp_v6", false);
     enableLayerIpv6TcpOutbound = iniReader.GetBoolean("wfp_layer", "enable_layer_outbound_tcp_v6", false);
     enableLayerIcmpv4 = iniReader.GetBoolean("wfp_layer", "enableLayerIcmpv4", false);
+    enableLayerIpv4Dns = iniReader.GetBoolean("wfp_layer", "enable_layer_dns_v4", false);
+    enableLayerIpv6Dns = iniReader.GetBoolean("wfp_layer", "enable_layer_dns_v6", false);
+    enableLayerIpv4Tls = iniReader.GetBoolean("wfp_layer", "enable_layer_tls_v4", false);
+    enableLayerIpv6Tls = iniReader.GetBoolean("wfp_layer", "enable_layer_tls_v6", false);
 
     // Parse action switches
     parseActionType("ipv4_blocklist_action", ipv4BlocklistAction);
     parseActionType("ipv6_blocklist_action", ipv6BlocklistAction);
     parseActionType("dns_blocklist_action", dnsBlocklistAction);
+    parseDnsBlockResponse("dns_block_response", dnsBlockResponse);
+    parseActionType("payload_signature_action", payloadSignatureAction);
+
+    // Parse lookup engine
+    parseLookupEngine("ipv4_lookup_engine", ipv4LookupEngine);
+    parseMemoryBudget("ipv4_memory_budget_mb", ipv4MemoryBudget);
+    parsePrefilterMode("ipv4_prefilter", ipv4PrefilterMode);
+    aggregateIpv4Feeds = iniReader.GetBoolean("lookup_engine", "ipv4_aggregate_feeds", true);
+    aggregateIpv6Feeds = iniReader.GetBoolean("lookup_engine", "ipv6_aggregate_feeds", true);
+
+    const long aggregateThreshold = 
+        iniReader.GetInteger("lookup_engine", "ipv6_aggregate_threshold", IPV6_AGGREGATE_DEFAULT_THRESHOLD);
+    ipv6AggregateThreshold = aggregateThreshold > 0 ? (size_t)aggregateThreshold : 0;
+
+    // Capped at a week, so the interval in milliseconds fits a DWORD
+    const long maxRefreshInterval = 7 * 24 * 60;
+    const long refreshInterval = iniReader.GetInteger("ipv4_blacklist_urls_simple", "refresh_interval_minutes", 0);
+    ipv4RefreshInterval = refreshInterval > 0 ? (uint32_t)std::min(refreshInterval, maxRefreshInterval) : 0;
 
     // Parse direction switches
     alertInbound = iniReader.GetBoolean("alert_config", "alert_inbound", false);
@@ -178,6 +276,7 @@ ATF_ERROR FilterConfig::ParseIniFile(void)
     // Parse hardcoded blacklist strings
     const std::string ipv4Blacklist = iniReader.Get("blacklist_ipv4", "ipv4_list", unknownVal);
     const std::string ipv6Blacklist = iniReader.Get("blacklist_ipv6", "ipv6_list", unknownVal);
+    const std::string domainBlacklist = iniReader.Get("blacklist_domains", "domain_list", unknownVal);
 
     if (ipv4Blacklist != unknownVal) {
         const std::vector<std::string> out = shared::SplitStringByDelimiter(ipv4Blacklist, standardDelimiter);
@@ -189,25 +288,84 @@ ATF_ERROR FilterConfig::ParseIniFile(void)
         for (std::vector<std::string>::const_iterator i = out.begin(); i != out.end(); i++) {
             uint32_t out = 0;
 
-            if (!shared::ParseStringToIpv4(*i, out)) {
+            IPV4_PREFIX_ENTRY entry = { 0 };
+            if (!shared::ParseStringToIpv4Prefix(*i, out, entry.prefixLength)) {
+                continue;
+            }
+
+            entry.address.S_un.S_addr = out;
+
+            blocklistIpv4.push_back(entry);
+        }
+    }
+
+    if (ipv6Blacklist != unknownVal) {
+        const std::vector<std::string> out = shared::SplitStringByDelimiter(ipv6Blacklist, standardDelimiter);
+
+        if (out.size() > MAX_IPV6_ADDRESSES_BLACKLIST) {
+            return ATF_DEFAULT_CONFIG_TOO_LARGE;
+        }
+
+        for (std::vector<std::string>::const_iterator i = out.begin(); i != out.end(); i++) {
+            std::array<uint8_t, 16> ip;
+
+            IPV6_PREFIX_ENTRY entry = { 0 };
+            if (!shared::ParseStringToIpv6Prefix(*i, ip, entry.prefixLength)) {
+                LOG_WARNING("Skipping invalid IPv6 blacklist entry %s", i->c_str());
                 continue;
             }
 
-            struct in_addr ipAddr;
-            ipAddr.S_un.S_addr = out;
+            std::memcpy(entry.address.a.b.byte, ip.data(), ip.size());
 
-            blocklistIpv4.push_back(ipAddr);
+            blocklistIpv6.push_back(entry);
         }
     }
 
+    if (domainBlacklist != unknownVal) {
+        const std::vector<std::string> out = shared::SplitStringByDelimiter(domainBlacklist, standardDelimiter);
+
+        for (std::vector<std::string>::const_iterator i = out.begin(); i != out.end(); i++) {
+            std::string domain;
+            if (!DomainDafsaBuilder::ParseDomainName(*i, domain)) {
+                LOG_WARNING("Skipping invalid domain blacklist entry %s", i->c_str());
+                continue;
+            }
+
+            blocklistDomains.push_back(domain);
+        }
+    }
+
+    // The signatures themselves are parsed when they are compiled for the driver
+    const std::string signatureFile = iniReader.Get("payload_signatures", "signature_file", unknownVal);
+    if (signatureFile != unknownVal) {
+        payloadSignatureFile = signatureFile;
+    }
+
+    ATF_ERROR atfError = parseIpv4Rules();
+    if (atfError) {
+        return atfError;
+    }
+
     //
     // Parse the online IP blacklists
     //
-    ATF_ERROR atfError = parseOnlineIpBlacklists();
+    atfError = parseOnlineIpBlacklists();
     if (atfError) {
         LOG_ERROR("Failed to parse online IP blacklist: 0x%08x", atfError);
     }
 
+    atfError = parseOnlineIpv6Blacklists();
+    if (atfError) {
+        LOG_ERROR("Failed to parse online IPv6 blacklist: 0x%08x", atfError);
+    }
+
+    atfError = parseOnlineDomainBlacklists();
+    if (atfError) {
+        LOG_ERROR("Failed to parse online domain blacklist: 0x%08x", atfError);
+    }
+
+    selectLookupEngine();
+
     genIoctlStruct();
 
     lastIniSum = shared::Crc32SumFile(iniFilePath);
@@ -245,16 +403,208 @@ void FilterConfig::parseActionType(std::string typeStr, ACTION_OPTS &opt)
     opt = actionVals.at(actionString);
 }
 
+void FilterConfig::parseDnsBlockResponse(std::string typeStr, DNS_BLOCK_RESPONSE &response)
+{
+    static const std::string nxdomainResponse = "NXDOMAIN";
+
+    static const std::map<std::string, DNS_BLOCK_RESPONSE> responseVals = {
+        {
+            nxdomainResponse, DNS_BLOCK_NXDOMAIN
+        },
+
+        {
+            "NULL_IP", DNS_BLOCK_NULL_ADDRESS
+        }
+    };
+
+    const std::string responseString = iniReader.GetString("alert_config", typeStr, nxdomainResponse);
+    if (responseVals.find(responseString) == responseVals.end()) {
+        LOG_WARNING("Unknown DNS block response %s, using %s", responseString.c_str(), nxdomainResponse.c_str());
+        response = DNS_BLOCK_NXDOMAIN;
+        return;
+    }
+
+    response = responseVals.at(responseString);
+}
+
+void FilterConfig::parseLookupEngine(std::string typeStr, IPV4_LOOKUP_ENGINE &engine)
+{
+    static const std::string trieEngine = "TRIE";
+    static const std::string dir24Engine = "DIR24";
+    static const std::string cuckooEngine = "CUCKOO";
+    static const std::string roaringEngine = "ROARING";
+    static const std::string autoEngine = "AUTO";
+
+    static const std::map<std::string, IPV4_LOOKUP_ENGINE> engineVals = {
+        {
+            trieEngine, IPV4_ENGINE_TRIE
+        },
+
+        {
+            dir24Engine, IPV4_ENGINE_DIR24
+        },
+
+        {
+            cuckooEngine, IPV4_ENGINE_CUCKOO
+        },
+
+        {
+            roaringEngine, IPV4_ENGINE_ROARING
+        }
+    };
+
+    const std::string engineString = iniReader.GetString("lookup_engine", typeStr, trieEngine);
+    isAutoLookupEngine = (engineString == autoEngine);
+    if (isAutoLookupEngine) {
+        // Selected in selectLookupEngine, once the blocklists are known
+        engine = IPV4_ENGINE_TRIE;
+        return;
+    }
+
+    if (engineVals.find(engineString) == engineVals.end()) {
+        LOG_WARNING("Unknown lookup engine %s, using %s", engineString.c_str(), trieEngine.c_str());
+        engine = IPV4_ENGINE_TRIE;
+        return;
+    }
+
+    engine = engineVals.at(engineString);
+}
+
+void FilterConfig::parseMemoryBudget(std::string typeStr, uint64_t &budget)
+{
+    const long budgetMb = iniReader.GetInteger("lookup_engine", typeStr, IPV4_DEFAULT_MEMORY_BUDGET_MB);
+    if (budgetMb < 0) {
+        LOG_WARNING("Invalid memory budget %ld MB, the lookup engine will not be limited", budgetMb);
+        budget = 0;
+        return;
+    }
+
+    budget = (uint64_t)budgetMb * 1024 * 1024;
+}
+
+void FilterConfig::selectLookupEngine(void)
+{
+    std::vector<IPV4_PREFIX_ENTRY> prefixes = blocklistIpv4;
+    prefixes.insert(prefixes.end(), blocklistIpv4Online.begin(), blocklistIpv4Online.end());
+
+    if (isAutoLookupEngine) {
+        ipv4LookupEngine = Ipv4EngineSelector::SelectEngine(prefixes, ipv4MemoryBudget, ipv4PredictedSize);
+    } else {
+        ipv4PredictedSize = Ipv4EngineSelector::EstimateEngine(ipv4LookupEngine, prefixes);
+        if (ipv4MemoryBudget && ipv4PredictedSize > ipv4MemoryBudget) {
+            LOG_WARNING("IPv4 engine %s is estimated over the memory budget (%llu > %llu bytes)",
+                Ipv4EngineSelector::GetEngineName(ipv4LookupEngine), ipv4PredictedSize, ipv4MemoryBudget);
+        }
+    }
+
+    LOG_INFO("IPv4 engine: %s%s, estimated size: %llu bytes, memory budget: %llu bytes",
+        Ipv4EngineSelector::GetEngineName(ipv4LookupEngine), isAutoLookupEngine ? " (AUTO)" : "",
+        ipv4PredictedSize, ipv4MemoryBudget);
+}
+
+void FilterConfig::parsePrefilterMode(std::string typeStr, IPV4_PREFILTER_MODE &mode)
+{
+    static const std::string noPrefilter = "NONE";
+
+    static const std::map<std::string, IPV4_PREFILTER_MODE> prefilterVals = {
+        {
+            noPrefilter, IPV4_PREFILTER_NONE
+        },
+
+        {
+            "PREFILTER", IPV4_PREFILTER_ENABLED
+        },
+
+        {
+            "PREFILTER_ONLY", IPV4_PREFILTER_ONLY
+        }
+    };
+
+    const std::string prefilterString = iniReader.GetString("lookup_engine", typeStr, noPrefilter);
+    if (prefilterVals.find(prefilterString) == prefilterVals.end()) {
+        LOG_WARNING("Unknown prefilter mode %s, using %s", prefilterString.c_str(), noPrefilter.c_str());
+        mode = IPV4_PREFILTER_NONE;
+        return;
+    }
+
+    mode = prefilterVals.at(prefilterString);
+}
+
 const USER_DRIVER_FILTER_TRANSPORT_DATA &FilterConfig::GetRawFilterData(void) const
 {
     return rawTransportData;
 }
 
-const std::vector<struct in_addr> &FilterConfig::GetIpv4BlacklistOnline(void) const
+const std::vector<IPV4_PREFIX_ENTRY> &FilterConfig::GetIpv4BlacklistOnline(void) const
 {
     return blocklistIpv4Online;
 }
 
+const std::vector<IPV6_PREFIX_ENTRY> &FilterConfig::GetIpv6BlacklistOnline(void) const
+{
+    return blocklistIpv6Online;
+}
+
+const std::vector<std::string> &FilterConfig::GetDomainBlacklistIni(void) const
+{
+    return blocklistDomains;
+}
+
+const std::vector<std::string> &FilterConfig::GetDomainBlacklistOnline(void) const
+{
+    return blocklistDomainsOnline;
+}
+
+const std::string &FilterConfig::GetPayloadSignatureFile(void) const
+{
+    return payloadSignatureFile;
+}
+
+const std::vector<IPV4_RULE_ENTRY> &FilterConfig::GetIpv4Rules(void) const
+{
+    return ipv4Rules;
+}
+
+const std::vector<IPV4_PREFIX_ENTRY> &FilterConfig::GetIpv4BlacklistIni(void) const
+{
+    return blocklistIpv4;
+}
+
+ATF_ERROR FilterConfig::RefreshOnlineIpBlacklists(void)
+{
+    std::vector<IPV4_PREFIX_ENTRY> previousList;
+    previousList.swap(blocklistIpv4Online);
+
+    onlineIpBlacklists.clear();
+
+    ATF_ERROR atfError = parseOnlineIpBlacklists();
+    if (atfError) {
+        // A failed download would otherwise remove every online IP from the driver
+        blocklistIpv4Online.swap(previousList);
+        return atfError;
+    }
+
+    LOG_INFO("Refreshed online IPv4 blacklists (%d entries, previously %d)", 
+        blocklistIpv4Online.size(), previousList.size());
+
+    return ATF_ERROR_OK;
+}
+
+uint32_t FilterConfig::GetIpv4RefreshInterval(void) const
+{
+    return ipv4RefreshInterval;
+}
+
+IPV4_LOOKUP_ENGINE FilterConfig::GetIpv4LookupEngine(void) const
+{
+    return ipv4LookupEngine;
+}
+
+IPV4_PREFILTER_MODE FilterConfig::GetIpv4PrefilterMode(void) const
+{
+    return ipv4PrefilterMode;
+}
+
 ATF_ERROR FilterConfig::getIniValuesBySection(
     const std::string &sectionName, 
     std::vector<std::string> &keyList) const
@@ -269,7 +619,6 @@ ATF_ERROR FilterConfig::getIniValuesBySection(
 ATF_ERROR FilterConfig::parseOnlineIpBlacklists(void)
 {
     static const std::string unknownVal = "UNKNOWN";
-    static const char standardDelimiter = ',';
 
     ATF_ERROR atfError = ATF_ERROR_OK;
 
@@ -279,24 +628,13 @@ ATF_ERROR FilterConfig::parseOnlineIpBlacklists(void)
         return ATF_ERROR_OK;
     }
 
-    const std::vector<std::string> splitUris = shared::SplitStringByDelimiter(ipUriUnparsed, standardDelimiter);
-    if (!splitUris.size()) {
-        return ATF_ERROR_OK;    
-    }
-
-    std::map<std::string, std::string> nameUriMap;
-    for (std::vector<std::string>::const_iterator i = splitUris.begin(); i != splitUris.end(); i++) {
-        nameUriMap[shared::IsolateDomainFromUri(*i)] = *i;
-    }
-
-    // Initialize the blacklist objects
-    for (std::map<std::string, std::string>::const_iterator i = nameUriMap.begin(); i != nameUriMap.end(); i++) {
-        if (i->first != "") {
-            onlineIpBlacklists.push_back({i->first, i->second});
-        }
+    parseBlacklistUris(ipUriUnparsed, false, onlineIpBlacklists);
+    if (!onlineIpBlacklists.size()) {
+        return ATF_ERROR_OK;
     }
 
     // Download and parse each IP blocklist
+    Ipv4Aggregator aggregator;
     bool anyBlacklistAvail = false;
     for (std::vector<IpBlacklistItem>::iterator currBlacklist = onlineIpBlacklists.begin(); 
         currBlacklist != onlineIpBlacklists.end(); currBlacklist++)
@@ -306,13 +644,67 @@ ATF_ERROR FilterConfig::parseOnlineIpBlacklists(void)
             anyBlacklistAvail = true;
         }
 
-        const std::vector<struct in_addr> &ipList = currBlacklist->GetIps();
+        const std::vector<IPV4_PREFIX_ENTRY> &ipList = currBlacklist->GetIps();
         if (ipList.size()) {
             LOG_DEBUG("Downloaded blacklist IPs (ipv4) from %s (numOfIps: %d)", currBlacklist->GetName().c_str(), ipList.size());
-            blocklistIpv4Online.insert(blocklistIpv4Online.end(), ipList.begin(), ipList.end());
+
+            if (aggregateIpv4Feeds) {
+                aggregator.AddFeed(currBlacklist->GetName(), ipList);
+            } else {
+                blocklistIpv4Online.insert(blocklistIpv4Online.end(), ipList.begin(), ipList.end());
+            }
+        }
+    }
+
+    if (aggregateIpv4Feeds) {
+        blocklistIpv4Online = aggregator.Aggregate();
+    }
+
+    if (anyBlacklistAvail) {
+        return ATF_ERROR_OK;
+    }
+
+    return ATF_NO_BLACKLISTS_AVAIL;
+}
+
+ATF_ERROR FilterConfig::parseOnlineIpv6Blacklists(void)
+{
+    static const std::string unknownVal = "UNKNOWN";
+
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    const std::string ipUriUnparsed = iniReader.GetString("ipv6_blacklist_urls_simple", "online_ip_blocklists", unknownVal);
+    if (ipUriUnparsed == unknownVal) {
+        // Can be optionally removed
+        return ATF_ERROR_OK;
+    }
+
+    parseBlacklistUris(ipUriUnparsed, false, onlineIpv6Blacklists);
+    if (!onlineIpv6Blacklists.size()) {
+        return ATF_ERROR_OK;
+    }
+
+    // Download and parse each IP blocklist, the IPv4 entries of a mixed feed are left to ipv4_blacklist_urls_simple
+    Ipv6Aggregator aggregator(aggregateIpv6Feeds ? ipv6AggregateThreshold : 0);
+    bool anyBlacklistAvail = false;
+    for (std::vector<IpBlacklistItem>::iterator currBlacklist = onlineIpv6Blacklists.begin(); 
+        currBlacklist != onlineIpv6Blacklists.end(); currBlacklist++)
+    {
+        atfError = currBlacklist->DownloadAndParseBlacklist();
+        if (!atfError) {
+            anyBlacklistAvail = true;
+        }
+
+        const std::vector<IPV6_PREFIX_ENTRY> &ipList = currBlacklist->GetIpv6s();
+        if (ipList.size()) {
+            LOG_DEBUG("Downloaded blacklist IPs (ipv6) from %s (numOfIps: %d)", currBlacklist->GetName().c_str(), ipList.size());
+            aggregator.AddFeed(currBlacklist->GetName(), ipList);
         }
     }
 
+    // Without collapsing, the aggregator still drops the duplicate and covered prefixes across feeds
+    blocklistIpv6Online = aggregator.Aggregate();
+
     if (anyBlacklistAvail) {
         return ATF_ERROR_OK;
     }
@@ -320,6 +712,219 @@ ATF_ERROR FilterConfig::parseOnlineIpBlacklists(void)
     return ATF_NO_BLACKLISTS_AVAIL;
 }
 
+ATF_ERROR FilterConfig::parseOnlineDomainBlacklists(void)
+{
+    static const std::string unknownVal = "UNKNOWN";
+
+    ATF_ERROR atfError = ATF_ERROR_OK;
+
+    const std::string uriUnparsed = iniReader.GetString("domain_blacklist_urls_simple", "online_domain_blocklists", unknownVal);
+    if (uriUnparsed == unknownVal) {
+        // Can be optionally removed
+        return ATF_ERROR_OK;
+    }
+
+    parseBlacklistUris(uriUnparsed, true, onlineDomainBlacklists);
+    if (!onlineDomainBlacklists.size()) {
+        return ATF_ERROR_OK;
+    }
+
+    // Download and parse each domain blocklist, duplicates across feeds are dropped by the image builder
+    bool anyBlacklistAvail = false;
+    for (std::vector<IpBlacklistItem>::iterator currBlacklist = onlineDomainBlacklists.begin(); 
+        currBlacklist != onlineDomainBlacklists.end(); currBlacklist++)
+    {
+        atfError = currBlacklist->DownloadAndParseBlacklist();
+        if (!atfError) {
+            anyBlacklistAvail = true;
+        }
+
+        const std::vector<std::string> &domainList = currBlacklist->GetDomains();
+        if (domainList.size()) {
+            LOG_DEBUG("Downloaded blacklist domains from %s (numOfDomains: %d)", currBlacklist->GetName().c_str(), domainList.size());
+            blocklistDomainsOnline.insert(blocklistDomainsOnline.end(), domainList.begin(), domainList.end());
+        }
+    }
+
+    if (anyBlacklistAvail) {
+        return ATF_ERROR_OK;
+    }
+
+    return ATF_NO_BLACKLISTS_AVAIL;
+}
+
+ATF_ERROR FilterConfig::parseIpv4Rules(void)
+{
+    static const long defaultPriority = 100;
+
+    struct NamedRule {
+        long                priority;
+        std::string         name;
+        IPV4_RULE_ENTRY     rule;
+    };
+
+    // Sections() is sorted by name, which breaks priority ties
+    std::vector<NamedRule> namedRules;
+    for (const std::string &sectionName : iniReader.Sections()) {
+        if (sectionName.rfind(sectionPrefixIpv4Rule, 0) != 0) {
+            continue;
+        }
+
+        NamedRule namedRule = { 0 };
+        namedRule.name = sectionName.substr(sectionPrefixIpv4Rule.size());
+        namedRule.priority = iniReader.GetInteger(sectionName, "priority", defaultPriority);
+
+        if (!parseIpv4Rule(sectionName, namedRule.rule)) {
+            LOG_WARNING("Skipping invalid rule %s", namedRule.name.c_str());
+            continue;
+        }
+
+        namedRules.push_back(namedRule);
+    }
+
+    if (namedRules.size() > IPV4_RULES_MAX_ENTRIES) {
+        return ATF_DEFAULT_CONFIG_TOO_LARGE;
+    }
+
+    std::stable_sort(namedRules.begin(), namedRules.end(), [](const NamedRule &a, const NamedRule &b) {
+        return a.priority < b.priority;
+    });
+
+    ipv4Rules.clear();
+    for (const NamedRule &namedRule : namedRules) {
+        IPV4_RULE_ENTRY rule = namedRule.rule;
+        rule.ruleId = (UINT32)ipv4Rules.size();
+
+        // The driver only reports the id of a matching rule
+        LOG_DEBUG("IPv4 rule #%d: %s (priority %d)", ipv4Rules.size(), namedRule.name.c_str(), namedRule.priority);
+
+        ipv4Rules.push_back(rule);
+    }
+
+    return ATF_ERROR_OK;
+}
+
+bool FilterConfig::parseIpv4Rule(const std::string &sectionName, IPV4_RULE_ENTRY &ruleOut) const
+{
+    static const std::string anyVal = "any";
+
+    static const std::map<std::string, ACTION_OPTS> actionVals = {
+        { "PASS", ACTION_PASS },
+        { "BLOCK", ACTION_BLOCK },
+        { "ALERT", ACTION_ALERT }
+    };
+
+    static const std::map<std::string, RULE_DIRECTION> directionVals = {
+        { anyVal, RULE_DIRECTION_ANY },
+        { "inbound", RULE_DIRECTION_INBOUND },
+        { "outbound", RULE_DIRECTION_OUTBOUND }
+    };
+
+    static const std::map<std::string, UINT8> protocolVals = {
+        { anyVal, RULE_PROTOCOL_ANY },
+        { "tcp", RULE_PROTOCOL_TCP },
+        { "udp", RULE_PROTOCOL_UDP }
+    };
+
+    ruleOut = { 0 };
+
+    const std::string actionString = iniReader.GetString(sectionName, "action", "");
+    const std::string directionString = iniReader.GetString(sectionName, "direction", anyVal);
+    const std::string protocolString = iniReader.GetString(sectionName, "protocol", anyVal);
+    if (actionVals.find(actionString) == actionVals.end() ||
+        directionVals.find(directionString) == directionVals.end() ||
+        protocolVals.find(protocolString) == protocolVals.end())
+    {
+        return false;
+    }
+
+    ruleOut.action = (UINT8)actionVals.at(actionString);
+    ruleOut.direction = (UINT8)directionVals.at(directionString);
+    ruleOut.protocol = protocolVals.at(protocolString);
+
+    // A prefix length of 0 matches any address
+    const std::string localString = iniReader.GetString(sectionName, "local", anyVal);
+    if (localString != anyVal) {
+        uint32_t address = 0;
+        if (!shared::ParseStringToIpv4Prefix(localString, address, ruleOut.localPrefixLength)) {
+            return false;
+        }
+        ruleOut.localAddress.S_un.S_addr = address;
+    }
+
+    const std::string remoteString = iniReader.GetString(sectionName, "remote", anyVal);
+    if (remoteString != anyVal) {
+        uint32_t address = 0;
+        if (!shared::ParseStringToIpv4Prefix(remoteString, address, ruleOut.remotePrefixLength)) {
+            return false;
+        }
+        ruleOut.remoteAddress.S_un.S_addr = address;
+    }
+
+    if (!parsePortRange(iniReader.GetString(sectionName, "local_ports", anyVal), ruleOut.localPortLow, ruleOut.localPortHigh) ||
+        !parsePortRange(iniReader.GetString(sectionName, "remote_ports", anyVal), ruleOut.remotePortLow, ruleOut.remotePortHigh))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool FilterConfig::parsePortRange(const std::string &portStr, SERVICE_PORT &lowOut, SERVICE_PORT &highOut)
+{
+    static const uint32_t maxPort = 0xffff;
+
+    if (portStr == "any") {
+        lowOut = 0;
+        highOut = (SERVICE_PORT)maxPort;
+        return true;
+    }
+
+    // A trailing '-' is not split into an empty token
+    const std::vector<std::string> bounds = shared::SplitStringByDelimiter(portStr, '-');
+    if (bounds.empty() || bounds.size() > 2 || portStr.back() == '-') {
+        return false;
+    }
+
+    uint32_t low = 0;
+    uint32_t high = 0;
+    if (!shared::ConvertStringToInt(bounds.front(), low) || !shared::ConvertStringToInt(bounds.back(), high)) {
+        return false;
+    }
+
+    if (low > high || high > maxPort) {
+        return false;
+    }
+
+    lowOut = (SERVICE_PORT)low;
+    highOut = (SERVICE_PORT)high;
+
+    return true;
+}
+
+void FilterConfig::parseBlacklistUris(
+    const std::string &uriList,
+    bool isDomainFeed,
+    std::vector<IpBlacklistItem> &blacklistsOut
+)
+{
+    static const char standardDelimiter = ',';
+
+    const std::vector<std::string> splitUris = shared::SplitStringByDelimiter(uriList, standardDelimiter);
+
+    std::map<std::string, std::string> nameUriMap;
+    for (std::vector<std::string>::const_iterator i = splitUris.begin(); i != splitUris.end(); i++) {
+        nameUriMap[shared::IsolateDomainFromUri(*i)] = *i;
+    }
+
+    // Initialize the blacklist objects
+    for (std::map<std::string, std::string>::const_iterator i = nameUriMap.begin(); i != nameUriMap.end(); i++) {
+        if (i->first != "") {
+            blacklistsOut.push_back({i->first, i->second, isDomainFeed});
+        }
+    }
+}
+
 void FilterConfig::genIoctlStruct(void)
 {
     ZeroMemory(&rawTransportData, sizeof(USER_DRIVER_FILTER_TRANSPORT_DATA));
@@ -332,18 +937,46 @@ void FilterConfig::genIoctlStruct(void)
     rawTransportData.enableLayerIpv6TcpInbound = enableLayerIpv6TcpInbound;
     rawTransportData.enableLayerIpv6TcpOutbound = enableLayerIpv6TcpOutbound;
     rawTransportData.enableLayerIcmpv4 = enableLayerIcmpv4;
+    rawTransportData.enableLayerIpv4Dns = enableLayerIpv4Dns;
+    rawTransportData.enableLayerIpv6Dns = enableLayerIpv6Dns;
+    rawTransportData.enableLayerIpv4Tls = enableLayerIpv4Tls;
+    rawTransportData.enableLayerIpv6Tls = enableLayerIpv6Tls;
 
     rawTransportData.dnsBlocklistAction = dnsBlocklistAction;
+    rawTransportData.dnsBlockResponse = dnsBlockResponse;
+    rawTransportData.payloadSignatureAction = payloadSignatureAction;
     rawTransportData.ipv4BlocklistAction = ipv4BlocklistAction;
     rawTransportData.ipv6BlocklistAction = ipv6BlocklistAction;
 
+    rawTransportData.ipv4LookupEngine = ipv4LookupEngine;
+    rawTransportData.ipv4MemoryBudget = ipv4MemoryBudget;
+    rawTransportData.ipv4PredictedSize = ipv4PredictedSize;
+
     rawTransportData.alertInbound = alertInbound;
     rawTransportData.alertOutbound = alertOutbound;
 
+    // The switches above are only informational, the driver runs the policy compiled from them
+    const POLICY_OPTIONS policyOptions = {
+        alertInbound, alertOutbound, ipv4BlocklistAction, ipv6BlocklistAction, dnsBlocklistAction
+    };
+    std::vector<POLICY_INSN> policy;
+    if (PolicyCompiler::CompileFilterPolicy(policyOptions, policy) == ATF_ERROR_OK) {
+        LOG_DEBUG("Verdict policy of %d instructions", policy.size());
+        rawTransportData.numOfPolicyInsns = (UINT16)policy.size();
+        std::copy(policy.begin(), policy.end(), rawTransportData.policy);
+    } else {
+        LOG_ERROR("Failed to compile the verdict policy, the driver will reject the config");
+    }
+
     rawTransportData.numOfIpv4Addresses = (UINT16)blocklistIpv4.size();
-    for (std::vector<struct in_addr>::const_iterator i = blocklistIpv4.begin(); i != blocklistIpv4.end(); i++) {
+    for (std::vector<IPV4_PREFIX_ENTRY>::const_iterator i = blocklistIpv4.begin(); i != blocklistIpv4.end(); i++) {
         rawTransportData.ipv4BlackList[i - blocklistIpv4.begin()] = *i;
     }
+
+    rawTransportData.numOfIpv6Addresses = (UINT16)blocklistIpv6.size();
+    for (std::vector<IPV6_PREFIX_ENTRY>::const_iterator i = blocklistIpv6.begin(); i != blocklistIpv6.end(); i++) {
+        rawTransportData.ipv6Blacklist[i - blocklistIpv6.begin()] = *i;
+    }
 }
 
 std::vector<std::byte> FilterConfig::SerializeConfigBuffer(void) const
@@ -10,6 +10,12 @@
 #include "../common/shared.h"
 #include "../common/user_driver_transport.h"
 
+#include "ipv4_image_builder.h"
+#include "ipv4_engine_selector.h"
+#include "ipv4_aggregator.h"
+#include "ipv6_aggregator.h"
+#include "domain_dafsa_builder.h"
+
 #include <string>
 #include <vector>
 #include <cstring>
@@ -18,23 +24,34 @@
 
 //
 // Struct representing an IP blacklist from online
-//  Supplied by ipv4_blacklist_urls_simple in the INI file
+//  Supplied by ipv4_blacklist_urls_simple or ipv6_blacklist_urls_simple in the INI file, or a domain blacklist
+//  supplied by domain_blacklist_urls_simple
 //
 class IpBlacklistItem {
 private:
     const std::string                           blacklistName;
     const std::string                           uri;
 
-    // Parsed IPv4 addresses
-    std::vector<struct in_addr>                 blacklist;
+    // Parse the download as a list of domain names (or a hosts file) rather than IPs
+    const bool                                  isDomainFeed;
+
+    // Parsed IPv4 addresses and subnets
+    std::vector<IPV4_PREFIX_ENTRY>              blacklist;
+
+    // Parsed IPv6 addresses and subnets
+    std::vector<IPV6_PREFIX_ENTRY>              blacklistIpv6;
+
+    // Parsed domain names, normalized by DomainDafsaBuilder::ParseDomainName()
+    std::vector<std::string>                    blacklistDomains;
 
     // Raw output vector from CURL
     std::vector<char>                           rawDownloadBuffer;
 
 public:
-    IpBlacklistItem(const std::string &blacklistName, const std::string &uri) :
+    IpBlacklistItem(const std::string &blacklistName, const std::string &uri, bool isDomainFeed = false) :
         uri(uri),
-        blacklistName(blacklistName)
+        blacklistName(blacklistName),
+        isDomainFeed(isDomainFeed)
     {
     
     }
@@ -63,18 +80,39 @@ private:
 
 
     //
-    // Parse CURL output buffer into std::vector<struct in_addr>
+    // Parse CURL output buffer into std::vector<IPV4_PREFIX_ENTRY> and std::vector<IPV6_PREFIX_ENTRY>
+    //  Each line may contain an address, or a subnet in CIDR notation (a.b.c.d/nn or x:x::x/nnn)
     //
     ATF_ERROR parseBufIntoList(
         const std::vector<char> &buf, 
-        std::vector<struct in_addr> &ipOut
+        std::vector<IPV4_PREFIX_ENTRY> &ipOut,
+        std::vector<IPV6_PREFIX_ENTRY> &ipv6Out
+    );
+
+    //
+    // Parse CURL output buffer into domain names, one per line
+    //  Hosts file lines (0.0.0.0 example.com) are accepted as well, the name follows the address
+    //
+    ATF_ERROR parseBufIntoDomains(
+        const std::vector<char> &buf,
+        std::vector<std::string> &domainsOut
     );
 
 public:
     //
     // Return the ip list
     //
-    const std::vector<struct in_addr> GetIps(void) const;
+    const std::vector<IPV4_PREFIX_ENTRY> GetIps(void) const;
+
+    //
+    // Return the IPv6 list
+    //
+    const std::vector<IPV6_PREFIX_ENTRY> &GetIpv6s(void) const;
+
+    //
+    // Return the domain list
+    //
+    const std::vector<std::string> &GetDomains(void) const;
 
     //
     // Return blocklist domain
@@ -94,6 +132,10 @@ private:
     bool                                        enableLayerIpv6TcpInbound;
     bool                                        enableLayerIpv6TcpOutbound;
     bool                                        enableLayerIcmpv4;
+    bool                                        enableLayerIpv4Dns;
+    bool                                        enableLayerIpv6Dns;
+    bool                                        enableLayerIpv4Tls;
+    bool                                        enableLayerIpv6Tls;
 
     //
     // Direction switches
@@ -102,11 +144,32 @@ private:
     bool                                        alertOutbound;
 
     // Blacklist from the default ini config ONLY
-    std::vector<struct in_addr>                 blocklistIpv4;
-    std::vector<IPV6_RAW_ADDRESS>               blocklistIpv6;
+    std::vector<IPV4_PREFIX_ENTRY>              blocklistIpv4;
+    std::vector<IPV6_PREFIX_ENTRY>              blocklistIpv6;
+
+    // 5-tuple rules from the rule.<name> sections, in priority order. The rule id is the index
+    std::vector<IPV4_RULE_ENTRY>                ipv4Rules;
 
     // Blacklist from the additional, dynamic/online IP blocklists
-    std::vector<struct in_addr>                 blocklistIpv4Online;
+    std::vector<IPV4_PREFIX_ENTRY>              blocklistIpv4Online;
+    std::vector<IPV6_PREFIX_ENTRY>              blocklistIpv6Online;
+
+    // Domain blacklist from the ini (blacklist_domains), and from the online domain blocklists
+    std::vector<std::string>                    blocklistDomains;
+    std::vector<std::string>                    blocklistDomainsOnline;
+
+    // Path of the payload signature file (payload_signatures), empty if there is none
+    std::string                                 payloadSignatureFile;
+
+    // Merge the online blocklists into the minimal prefix set before upload (see ipv4_aggregator.h)
+    bool                                        aggregateIpv4Feeds;
+
+    // Collapse clustered IPv6 entries into /64 and /48 prefixes before upload (see ipv6_aggregator.h)
+    bool                                        aggregateIpv6Feeds;
+    size_t                                      ipv6AggregateThreshold;
+
+    // Minutes between refreshes of the online blocklists (0 to download them once)
+    uint32_t                                    ipv4RefreshInterval;
 
     //
     // Action configs
@@ -114,6 +177,21 @@ private:
     ACTION_OPTS                                 ipv4BlocklistAction;
     ACTION_OPTS                                 ipv6BlocklistAction;
     ACTION_OPTS                                 dnsBlocklistAction;
+    DNS_BLOCK_RESPONSE                          dnsBlockResponse;
+    ACTION_OPTS                                 payloadSignatureAction;
+
+    //
+    // Lookup engine configs
+    //
+    IPV4_LOOKUP_ENGINE                          ipv4LookupEngine;
+    IPV4_PREFILTER_MODE                         ipv4PrefilterMode;
+
+    // ipv4_lookup_engine = AUTO, the engine is selected from the blocklist under ipv4MemoryBudget
+    bool                                        isAutoLookupEngine;
+
+    // Non-paged memory budget of the IPv4 engine in bytes (0 for no limit), and the estimated size of the engine
+    uint64_t                                    ipv4MemoryBudget;
+    uint64_t                                    ipv4PredictedSize;
 
     //
     // Transport buffer for IOCTL
@@ -134,6 +212,8 @@ private:
     // Online IP blacklist
     //
     std::vector<IpBlacklistItem>                onlineIpBlacklists;
+    std::vector<IpBlacklistItem>                onlineIpv6Blacklists;
+    std::vector<IpBlacklistItem>                onlineDomainBlacklists;
 
 public:
     FilterConfig(std::string &iniFilePath) :
@@ -142,6 +222,23 @@ public:
         enableLayerIpv6TcpInbound(false),
         enableLayerIpv6TcpOutbound(false),
         enableLayerIcmpv4(false),
+        enableLayerIpv4Dns(false),
+        enableLayerIpv6Dns(false),
+        enableLayerIpv4Tls(false),
+        enableLayerIpv6Tls(false),
+
+        aggregateIpv4Feeds(true),
+        aggregateIpv6Feeds(true),
+        ipv6AggregateThreshold(IPV6_AGGREGATE_DEFAULT_THRESHOLD),
+        ipv4RefreshInterval(0),
+
+        dnsBlockResponse(DNS_BLOCK_NXDOMAIN),
+
+        ipv4LookupEngine(IPV4_ENGINE_TRIE),
+        ipv4PrefilterMode(IPV4_PREFILTER_NONE),
+        isAutoLookupEngine(false),
+        ipv4MemoryBudget(0),
+        ipv4PredictedSize(0),
 
         iniFilePath(iniFilePath),
         rawTransportData({ 0 }),
@@ -173,7 +270,54 @@ public:
     //
     // Returns the vector containing IPs retrieved from online blacklists
     //
-    const std::vector<struct in_addr> &GetIpv4BlacklistOnline(void) const;
+    const std::vector<IPV4_PREFIX_ENTRY> &GetIpv4BlacklistOnline(void) const;
+
+    //
+    // Returns the vector containing the IPv6 prefixes retrieved from online blacklists
+    //
+    const std::vector<IPV6_PREFIX_ENTRY> &GetIpv6BlacklistOnline(void) const;
+
+    //
+    // Returns the 5-tuple rules of the ini, in priority order
+    //
+    const std::vector<IPV4_RULE_ENTRY> &GetIpv4Rules(void) const;
+
+    //
+    // Returns the domains of the ini blocklist (blacklist_domains) and of the online domain blocklists
+    //
+    const std::vector<std::string> &GetDomainBlacklistIni(void) const;
+    const std::vector<std::string> &GetDomainBlacklistOnline(void) const;
+
+    //
+    // Returns the path of the payload signature file (see payload_sig_builder.h), empty if there is none
+    //
+    const std::string &GetPayloadSignatureFile(void) const;
+
+    //
+    // Returns the vector containing the IPs of the ini blocklist (blacklist_ipv4)
+    //
+    const std::vector<IPV4_PREFIX_ENTRY> &GetIpv4BlacklistIni(void) const;
+
+    //
+    // Download and parse the online blacklists again, replacing the previous IPs
+    //  The previous IPs are kept if no blacklist could be downloaded
+    //
+    ATF_ERROR RefreshOnlineIpBlacklists(void);
+
+    //
+    // Returns the minutes between refreshes of the online blacklists, 0 if they are not refreshed
+    //
+    uint32_t GetIpv4RefreshInterval(void) const;
+
+    //
+    // Returns the IPv4 lookup engine selected in the ini
+    //
+    IPV4_LOOKUP_ENGINE GetIpv4LookupEngine(void) const;
+
+    //
+    // Returns the prefilter built into the compiled IPv4 image (trie engine only)
+    //
+    IPV4_PREFILTER_MODE GetIpv4PrefilterMode(void) const;
 
     //
     // Returns whether or not the USER_DRIVER_FILTER_TRANSPORT_DATA structure is initialized
@@ -194,6 +338,42 @@ private:
     //
     ATF_ERROR parseOnlineIpBlacklists(void);
 
+    //
+    // Parse the ipv6_blacklist_urls_simple object and download all IPv6 prefixes
+    //
+    ATF_ERROR parseOnlineIpv6Blacklists(void);
+
+    //
+    // Parse the domain_blacklist_urls_simple object and download all domains
+    //
+    ATF_ERROR parseOnlineDomainBlacklists(void);
+
+    //
+    // Parse the rule.<name> sections into ipv4Rules, sorted by priority then name
+    //  Invalid rules are skipped with a warning
+    //
+    static inline const std::string sectionPrefixIpv4Rule = "rule.";
+    ATF_ERROR parseIpv4Rules(void);
+
+    //
+    // Parse a single rule section, returns false if a value is invalid
+    //
+    bool parseIpv4Rule(const std::string &sectionName, IPV4_RULE_ENTRY &ruleOut) const;
+
+    //
+    // Parse "any", a port (N) or an inclusive port range (N-M)
+    //
+    static bool parsePortRange(const std::string &portStr, SERVICE_PORT &lowOut, SERVICE_PORT &highOut);
+
+    //
+    // Split a comma separated list of URIs into blacklist objects, one per domain
+    //
+    static void parseBlacklistUris(
+        const std::string &uriList,
+        bool isDomainFeed,
+        std::vector<IpBlacklistItem> &blacklistsOut
+    );
+
     //
     // Returns a vector for all keys in a given section
     //
@@ -211,4 +391,25 @@ private:
     // Parser for the action type
     //
     void parseActionType(std::string typeStr, ACTION_OPTS &opt);
+
+    //
+    // Parser for the response to a blocked DNS query
+    //
+    void parseDnsBlockResponse(std::string typeStr, DNS_BLOCK_RESPONSE &response);
+
+    //
+    // Parser for the lookup engine type
+    //
+    void parseLookupEngine(std::string typeStr, IPV4_LOOKUP_ENGINE &engine);
+
+    //
+    // Parser for the memory budget of the lookup engine, in megabytes
+    //
+    void parseMemoryBudget(std::string typeStr, uint64_t &budget);
+
+    //
+    // Select the IPv4 lookup engine (AUTO) or estimate the size of the configured one, once all blocklists are parsed
+    //
+    void selectLookupEngine(void);
+    void parsePrefilterMode(std::string typeStr, IPV4_PREFILTER_MODE &mode);
 };
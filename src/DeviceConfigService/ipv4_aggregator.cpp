@@ -0,0 +1,165 @@
+#include <Windows.h>
+
+#include "ipv4_aggregator.h"
+#include "ipv4_bulk_builder.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/user_logging.h"
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <tuple>
+#include <functional>
+#include <cstdint>
+
+// Range sort key: the first address above the prefix length
+#define IPV4_AGGREGATE_KEY_BITS             (32 + 8)
+
+void Ipv4Aggregator::AddFeed(const std::string &name, const std::vector<IPV4_PREFIX_ENTRY> &entries)
+{
+    IPV4_AGGREGATE_FEED feed;
+    feed.name = name;
+    feed.numOfEntries = entries.size();
+    feed.numOfPrefixes = 0;
+
+    buildRanges(entries, feed.ranges);
+
+    for (const IPV4_RANGE &range : feed.ranges) {
+        feed.numOfPrefixes += rangeToPrefixes(range, NULL);
+    }
+
+    feeds.push_back(std::move(feed));
+}
+
+std::vector<IPV4_PREFIX_ENTRY> Ipv4Aggregator::Aggregate(void) const
+{
+    std::vector<IPV4_PREFIX_ENTRY> prefixes;
+    size_t totalNumOfEntries = 0;
+
+    //
+    // K-way merge on the range start, (start, feed, index of the range in the feed)
+    //
+    typedef std::tuple<uint64_t, size_t, size_t> MERGE_CURSOR;
+    std::priority_queue<MERGE_CURSOR, std::vector<MERGE_CURSOR>, std::greater<MERGE_CURSOR>> cursors;
+
+    for (size_t i = 0; i < feeds.size(); i++) {
+        totalNumOfEntries += feeds[i].numOfEntries;
+
+        if (!feeds[i].ranges.empty()) {
+            cursors.emplace(feeds[i].ranges[0].start, i, 0);
+        }
+    }
+
+    bool isRangeOpen = false;
+    IPV4_RANGE mergedRange = { 0 };
+
+    while (!cursors.empty()) {
+        const auto [start, feedIndex, rangeIndex] = cursors.top();
+        cursors.pop();
+
+        const IPV4_RANGE &range = feeds[feedIndex].ranges[rangeIndex];
+        if (rangeIndex + 1 < feeds[feedIndex].ranges.size()) {
+            cursors.emplace(feeds[feedIndex].ranges[rangeIndex + 1].start, feedIndex, rangeIndex + 1);
+        }
+
+        // Overlapping or adjacent ranges are one
+        if (isRangeOpen && range.start <= mergedRange.end) {
+            mergedRange.end = std::max(mergedRange.end, range.end);
+            continue;
+        }
+
+        if (isRangeOpen) {
+            rangeToPrefixes(mergedRange, &prefixes);
+        }
+
+        mergedRange = range;
+        isRangeOpen = true;
+    }
+
+    if (isRangeOpen) {
+        rangeToPrefixes(mergedRange, &prefixes);
+    }
+
+    for (const IPV4_AGGREGATE_FEED &feed : feeds) {
+        LOG_INFO("Aggregated IPv4 feed %s: %d entries -> %d prefixes (ratio: %.2f)",
+            feed.name.c_str(), feed.numOfEntries, feed.numOfPrefixes,
+            compressionRatio(feed.numOfEntries, feed.numOfPrefixes));
+    }
+
+    LOG_INFO("Aggregated %d IPv4 feeds: %d entries -> %d prefixes (ratio: %.2f)",
+        feeds.size(), totalNumOfEntries, prefixes.size(), compressionRatio(totalNumOfEntries, prefixes.size()));
+
+    return prefixes;
+}
+
+void Ipv4Aggregator::buildRanges(const std::vector<IPV4_PREFIX_ENTRY> &entries, std::vector<IPV4_RANGE> &rangesOut)
+{
+    rangesOut.clear();
+
+    std::vector<uint64_t> keys;
+    keys.reserve(entries.size());
+
+    for (const IPV4_PREFIX_ENTRY &entry : entries) {
+        const uint32_t prefixLength = entry.prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            continue;
+        }
+
+        const uint32_t address = entry.address.S_un.S_addr & IPV4_PREFIX_MASK(prefixLength);
+        keys.push_back(((uint64_t)address << 8) | prefixLength);
+    }
+
+    Ipv4BulkBuilder::RadixSort(keys, IPV4_AGGREGATE_KEY_BITS);
+
+    for (const uint64_t key : keys) {
+        const uint64_t start = key >> 8;
+        const uint64_t end = start + (1ULL << (IPV4_PREFIX_MAX_LENGTH - (key & 0xff)));
+
+        if (!rangesOut.empty() && start <= rangesOut.back().end) {
+            rangesOut.back().end = std::max(rangesOut.back().end, end);
+            continue;
+        }
+
+        rangesOut.push_back({ start, end });
+    }
+}
+
+size_t Ipv4Aggregator::rangeToPrefixes(const IPV4_RANGE &range, std::vector<IPV4_PREFIX_ENTRY> *prefixesOut)
+{
+    size_t numOfPrefixes = 0;
+
+    for (uint64_t start = range.start; start < range.end;) {
+        // Largest block aligned on start that ends within the range, a prefix is at least a /1
+        uint32_t blockBits = IPV4_PREFIX_MAX_LENGTH - IPV4_PREFIX_MIN_LENGTH;
+        while ((start & ((1ULL << blockBits) - 1)) || start + (1ULL << blockBits) > range.end) {
+            blockBits--;
+        }
+
+        if (prefixesOut) {
+            IPV4_PREFIX_ENTRY entry = { 0 };
+            entry.address.S_un.S_addr = (uint32_t)start;
+            entry.prefixLength = (uint8_t)(IPV4_PREFIX_MAX_LENGTH - blockBits);
+
+            prefixesOut->push_back(entry);
+        }
+
+        numOfPrefixes++;
+        start += 1ULL << blockBits;
+    }
+
+    return numOfPrefixes;
+}
+
+double Ipv4Aggregator::compressionRatio(size_t numOfEntries, size_t numOfPrefixes)
+{
+    if (!numOfPrefixes) {
+        return 1.0;
+    }
+
+    return (double)numOfEntries / (double)numOfPrefixes;
+}
+
+//EOF
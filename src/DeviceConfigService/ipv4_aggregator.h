@@ -0,0 +1,90 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <inaddr.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Address range [start, end), end can be one past the last address (2^32)
+//
+typedef struct _ipv4_range {
+    uint64_t                                    start;
+    uint64_t                                    end;
+} IPV4_RANGE;
+
+//
+// A feed added to the aggregator, as the disjoint ranges it covers
+//
+typedef struct _ipv4_aggregate_feed {
+    std::string                                 name;
+
+    // Entries as downloaded, and prefixes in the minimal CIDR set of the feed alone
+    size_t                                      numOfEntries;
+    size_t                                      numOfPrefixes;
+
+    // Sorted, neither overlapping nor adjacent
+    std::vector<IPV4_RANGE>                     ranges;
+} IPV4_AGGREGATE_FEED;
+
+//
+// Merges the online blocklists into the minimal set of CIDR prefixes covering the same addresses
+//  (see ini, [lookup_engine] ipv4_aggregate_feeds)
+//
+//  Each feed is radix sorted (see ipv4_bulk_builder.h) and collapsed into disjoint ranges as it is added:
+//   duplicates, covered subnets and adjacent entries all end up in the same range. The feeds are then k-way
+//   merged by range start, and every range of the union is split back into the largest aligned prefixes.
+//
+//  The driver matches exactly the same addresses, but a match reports the length of the aggregated prefix
+//   rather than the one in the feed.
+//
+class Ipv4Aggregator {
+private:
+    std::vector<IPV4_AGGREGATE_FEED>            feeds;
+
+public:
+    Ipv4Aggregator(void)
+    {
+
+    }
+
+    ~Ipv4Aggregator(void)
+    {
+
+    }
+
+    //
+    // Add the entries of a feed, invalid prefix lengths are skipped
+    //
+    void AddFeed(const std::string &name, const std::vector<IPV4_PREFIX_ENTRY> &entries);
+
+    //
+    // Merge every feed added so far into the minimal prefix set, and log the compression ratio of each feed
+    //
+    std::vector<IPV4_PREFIX_ENTRY> Aggregate(void) const;
+
+private:
+    //
+    // Sort the entries and collapse them into disjoint, non-adjacent ranges
+    //
+    static void buildRanges(const std::vector<IPV4_PREFIX_ENTRY> &entries, std::vector<IPV4_RANGE> &rangesOut);
+
+    //
+    // Split a range into the largest aligned prefixes, prefixesOut can be NULL to only count them
+    //
+    static size_t rangeToPrefixes(const IPV4_RANGE &range, std::vector<IPV4_PREFIX_ENTRY> *prefixesOut);
+
+    //
+    // Entries per prefix, 1.0 for an empty feed
+    //
+    static double compressionRatio(size_t numOfEntries, size_t numOfPrefixes);
+};
+
+//EOF
@@ -0,0 +1,188 @@
+#include <Windows.h>
+
+#include "ipv4_bulk_builder.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/user_logging.h"
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <cstdint>
+
+// Prefix sort key: the address above the prefix length
+#define IPV4_BULK_PREFIX_KEY_BITS               (32 + 8)
+
+void Ipv4BulkBuilder::RadixSort(std::vector<uint64_t> &keys, uint32_t keyBits)
+{
+    const size_t numOfKeys = keys.size();
+    if (numOfKeys < 2) {
+        return;
+    }
+
+    const uint32_t numOfThreads = GetNumOfThreads(numOfKeys);
+    const size_t sliceSize = (numOfKeys + numOfThreads - 1) / numOfThreads;
+
+    std::vector<uint64_t> buffer(numOfKeys);
+    std::vector<size_t> histograms((size_t)numOfThreads * IPV4_BULK_RADIX_BUCKETS);
+
+    uint64_t *src = keys.data();
+    uint64_t *dst = buffer.data();
+
+    for (uint32_t shift = 0; shift < keyBits; shift += IPV4_BULK_RADIX_BITS) {
+        std::fill(histograms.begin(), histograms.end(), 0);
+
+        RunWorkers(numOfThreads, [&](uint32_t worker) {
+            size_t *histogram = &histograms[(size_t)worker * IPV4_BULK_RADIX_BUCKETS];
+            const size_t begin = std::min(numOfKeys, worker * sliceSize);
+            const size_t end = std::min(numOfKeys, begin + sliceSize);
+
+            for (size_t i = begin; i < end; i++) {
+                histogram[(src[i] >> shift) & (IPV4_BULK_RADIX_BUCKETS - 1)]++;
+            }
+        });
+
+        //
+        // Turn the histograms into the first output index of each (digit, worker). A digit shared by every key
+        //  would leave the order as is, so the pass is skipped
+        //
+        bool isSharedDigit = false;
+        size_t offset = 0;
+
+        for (uint32_t digit = 0; digit < IPV4_BULK_RADIX_BUCKETS; digit++) {
+            const size_t digitStart = offset;
+
+            for (uint32_t worker = 0; worker < numOfThreads; worker++) {
+                size_t &bucket = histograms[(size_t)worker * IPV4_BULK_RADIX_BUCKETS + digit];
+                const size_t count = bucket;
+
+                bucket = offset;
+                offset += count;
+            }
+
+            if (offset - digitStart == numOfKeys) {
+                isSharedDigit = true;
+                break;
+            }
+        }
+
+        if (isSharedDigit) {
+            continue;
+        }
+
+        RunWorkers(numOfThreads, [&](uint32_t worker) {
+            size_t *outIndex = &histograms[(size_t)worker * IPV4_BULK_RADIX_BUCKETS];
+            const size_t begin = std::min(numOfKeys, worker * sliceSize);
+            const size_t end = std::min(numOfKeys, begin + sliceSize);
+
+            for (size_t i = begin; i < end; i++) {
+                dst[outIndex[(src[i] >> shift) & (IPV4_BULK_RADIX_BUCKETS - 1)]++] = src[i];
+            }
+        });
+
+        // The output of this pass is the input of the next one
+        std::swap(src, dst);
+    }
+
+    if (src != keys.data()) {
+        keys.swap(buffer);
+    }
+}
+
+std::vector<IPV4_PREFIX_ENTRY> Ipv4BulkBuilder::SortUnique(
+    const std::vector<IPV4_PREFIX_ENTRY> &prefixes,
+    size_t &numOfDuplicatesOut
+)
+{
+    std::vector<uint64_t> keys;
+    keys.reserve(prefixes.size());
+
+    for (const IPV4_PREFIX_ENTRY &entry : prefixes) {
+        const uint32_t prefixLength = entry.prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            continue;
+        }
+
+        const uint32_t address = entry.address.S_un.S_addr & IPV4_PREFIX_MASK(prefixLength);
+        keys.push_back(((uint64_t)address << 8) | prefixLength);
+    }
+
+    RadixSort(keys, IPV4_BULK_PREFIX_KEY_BITS);
+
+    // Duplicates are adjacent once sorted
+    std::vector<IPV4_PREFIX_ENTRY> distinctPrefixes;
+    distinctPrefixes.reserve(keys.size());
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (i && keys[i] == keys[i - 1]) {
+            continue;
+        }
+
+        IPV4_PREFIX_ENTRY entry = { 0 };
+        entry.address.S_un.S_addr = (uint32_t)(keys[i] >> 8);
+        entry.prefixLength = (uint8_t)(keys[i] & 0xff);
+
+        distinctPrefixes.push_back(entry);
+    }
+
+    numOfDuplicatesOut = prefixes.size() - distinctPrefixes.size();
+
+    return distinctPrefixes;
+}
+
+uint32_t Ipv4BulkBuilder::GetNumOfThreads(size_t numOfItems)
+{
+    const size_t hardwareThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    const size_t neededThreads = std::max<size_t>(1, numOfItems / IPV4_BULK_MIN_KEYS_PER_THREAD);
+
+    return (uint32_t)std::min<size_t>({ hardwareThreads, neededThreads, IPV4_BULK_MAX_THREADS });
+}
+
+void Ipv4BulkBuilder::RunWorkers(uint32_t numOfThreads, const std::function<void(uint32_t)> &worker)
+{
+    std::vector<std::thread> threads;
+    threads.reserve(numOfThreads);
+
+    for (uint32_t i = 1; i < numOfThreads; i++) {
+        threads.emplace_back(worker, i);
+    }
+
+    worker(0);
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+void Ipv4BulkBuilder::PartitionByFirstOctet(
+    const std::vector<size_t> &octetWeights,
+    uint32_t numOfParts,
+    std::vector<uint32_t> &partsOut
+)
+{
+    static const uint32_t numOfOctets = UINT8_MAX + 1;
+
+    numOfParts = std::max<uint32_t>(1, numOfParts);
+    partsOut.assign(numOfParts + 1, numOfOctets);
+    partsOut[0] = 0;
+
+    size_t totalWeight = 0;
+    for (uint32_t octet = 0; octet < numOfOctets; octet++) {
+        totalWeight += octetWeights[octet];
+    }
+
+    // Part p ends on the first octet where the running weight reaches p / numOfParts of the total
+    size_t weight = 0;
+    uint32_t part = 1;
+    for (uint32_t octet = 0; octet < numOfOctets && part < numOfParts; octet++) {
+        weight += octetWeights[octet];
+
+        while (part < numOfParts && weight * numOfParts >= totalWeight * part) {
+            partsOut[part++] = octet + 1;
+        }
+    }
+}
+
+//EOF
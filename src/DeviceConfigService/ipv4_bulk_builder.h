@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <inaddr.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include <vector>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Radix digit of the bulk sort, 2048 buckets keep the per-thread histograms in L1
+//
+#define IPV4_BULK_RADIX_BITS                    11
+#define IPV4_BULK_RADIX_BUCKETS                 (1UL << IPV4_BULK_RADIX_BITS)
+
+//
+// Below this many keys per worker, the work is not worth another thread
+//
+#define IPV4_BULK_MIN_KEYS_PER_THREAD           (64 * 1024)
+#define IPV4_BULK_MAX_THREADS                   16
+
+//
+// Bulk sorting and partitioning of large blocklists, shared by the image builder and the raw blocklist upload
+//
+//  Feeds are merged in whatever order they were downloaded and often overlap, so everything is first turned into
+//   fixed-width integer keys and sorted with a parallel LSD radix sort:
+//   1. Each worker builds a histogram of the current digit over its own slice of the keys
+//   2. The histograms are turned into per-worker output offsets (digit-major, worker-minor), which keeps every
+//      pass stable
+//   3. Each worker scatters its slice to its offsets
+//  Passes over a digit that every key shares are skipped. Duplicates end up adjacent and are dropped by the sweep
+//   that consumes the sorted keys.
+//
+class Ipv4BulkBuilder {
+public:
+    //
+    // Sort the keys in place, only the low keyBits bits of each key are significant
+    //
+    static void RadixSort(std::vector<uint64_t> &keys, uint32_t keyBits);
+
+    //
+    // Sort the prefixes by (address, prefix length) and drop the duplicates. The host bits of every prefix are
+    //  cleared, entries with an invalid prefix length are dropped
+    //
+    static std::vector<IPV4_PREFIX_ENTRY> SortUnique(
+        const std::vector<IPV4_PREFIX_ENTRY> &prefixes,
+        size_t &numOfDuplicatesOut
+    );
+
+    //
+    // Number of workers for a job of numOfItems items
+    //
+    static uint32_t GetNumOfThreads(size_t numOfItems);
+
+    //
+    // Run worker(index) on numOfThreads threads and wait for all of them, the calling thread runs index 0
+    //
+    static void RunWorkers(uint32_t numOfThreads, const std::function<void(uint32_t)> &worker);
+
+    //
+    // Split the 256 first octets into numOfParts contiguous ranges of about the same weight.
+    //  octetWeights holds the weight of each first octet, partsOut receives numOfParts + 1 octet boundaries
+    //
+    static void PartitionByFirstOctet(
+        const std::vector<size_t> &octetWeights,
+        uint32_t numOfParts,
+        std::vector<uint32_t> &partsOut
+    );
+};
+
+//EOF
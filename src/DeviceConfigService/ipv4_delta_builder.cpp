@@ -0,0 +1,142 @@
+#include <Windows.h>
+
+#include "ipv4_delta_builder.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/user_logging.h"
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+
+void Ipv4DeltaBuilder::Diff(
+    const std::vector<IPV4_PREFIX_ENTRY> &previous,
+    const std::vector<IPV4_PREFIX_ENTRY> &current,
+    const std::vector<IPV4_PREFIX_ENTRY> &retained,
+    std::vector<IPV4_PREFIX_ENTRY> &removalsOut,
+    std::vector<IPV4_PREFIX_ENTRY> &additionsOut
+)
+{
+    removalsOut.clear();
+    additionsOut.clear();
+
+    std::vector<uint64_t> addedKeys;
+
+    // Merge on the sort key, an entry found on a single side was removed or added
+    size_t p = 0, c = 0;
+    while (p < previous.size() || c < current.size()) {
+        if (c == current.size() || (p < previous.size() && prefixKey(previous[p]) < prefixKey(current[c]))) {
+            removalsOut.push_back(previous[p++]);
+        } else if (p == previous.size() || prefixKey(current[c]) < prefixKey(previous[p])) {
+            addedKeys.push_back(prefixKey(current[c++]));
+        } else {
+            p++;
+            c++;
+        }
+    }
+
+    //
+    // Add back what the removals clear, but stays in the driver
+    //
+    std::vector<uint64_t> restoredKeys;
+
+    if (!removalsOut.empty()) {
+        std::vector<uint64_t> retainedKeys;
+        retainedKeys.reserve(retained.size());
+
+        for (const IPV4_PREFIX_ENTRY &entry : retained) {
+            retainedKeys.push_back(prefixKey(entry));
+        }
+
+        for (const IPV4_PREFIX_ENTRY &removed : removalsOut) {
+            overlappingKeys(retainedKeys, removed, restoredKeys);
+        }
+
+        std::sort(restoredKeys.begin(), restoredKeys.end());
+        restoredKeys.erase(std::unique(restoredKeys.begin(), restoredKeys.end()), restoredKeys.end());
+    }
+
+    std::vector<uint64_t> additionKeys;
+    additionKeys.reserve(addedKeys.size() + restoredKeys.size());
+
+    std::set_union(
+        addedKeys.begin(), addedKeys.end(),
+        restoredKeys.begin(), restoredKeys.end(),
+        std::back_inserter(additionKeys)
+    );
+
+    additionsOut.reserve(additionKeys.size());
+    for (const uint64_t key : additionKeys) {
+        IPV4_PREFIX_ENTRY entry = { 0 };
+        entry.address.S_un.S_addr = (uint32_t)(key >> 8);
+        entry.prefixLength = (uint8_t)(key & 0xff);
+
+        additionsOut.push_back(entry);
+    }
+
+    LOG_DEBUG("IPv4 blocklist delta: %d removed, %d added, %d restored", 
+        removalsOut.size(), addedKeys.size(), additionKeys.size() - addedKeys.size());
+}
+
+std::vector<std::byte> Ipv4DeltaBuilder::Serialize(
+    const std::vector<IPV4_PREFIX_ENTRY> &removals,
+    const std::vector<IPV4_PREFIX_ENTRY> &additions
+)
+{
+    IPV4_DELTA_HEADER header = { 0 };
+    header.magic = IPV4_DELTA_MAGIC;
+    header.numOfRemovals = (UINT32)removals.size();
+    header.numOfAdditions = (UINT32)additions.size();
+
+    const size_t removalsSize = removals.size() * sizeof(IPV4_PREFIX_ENTRY);
+    const size_t additionsSize = additions.size() * sizeof(IPV4_PREFIX_ENTRY);
+
+    std::vector<std::byte> delta(sizeof(IPV4_DELTA_HEADER) + removalsSize + additionsSize);
+
+    std::memcpy(delta.data(), &header, sizeof(IPV4_DELTA_HEADER));
+    if (removalsSize) {
+        std::memcpy(delta.data() + sizeof(IPV4_DELTA_HEADER), removals.data(), removalsSize);
+    }
+    if (additionsSize) {
+        std::memcpy(delta.data() + sizeof(IPV4_DELTA_HEADER) + removalsSize, additions.data(), additionsSize);
+    }
+
+    return delta;
+}
+
+uint64_t Ipv4DeltaBuilder::prefixKey(const IPV4_PREFIX_ENTRY &entry)
+{
+    return ((uint64_t)entry.address.S_un.S_addr << 8) | entry.prefixLength;
+}
+
+void Ipv4DeltaBuilder::overlappingKeys(
+    const std::vector<uint64_t> &retainedKeys,
+    const IPV4_PREFIX_ENTRY &removed,
+    std::vector<uint64_t> &keysOut
+)
+{
+    const uint32_t prefixLength = removed.prefixLength;
+    const uint64_t start = removed.address.S_un.S_addr;
+    const uint64_t end = start + (1ULL << (IPV4_PREFIX_MAX_LENGTH - prefixLength));
+
+    // Covering prefixes, one candidate per shorter length
+    for (uint32_t length = IPV4_PREFIX_MIN_LENGTH; length < prefixLength; length++) {
+        const uint64_t key = ((uint64_t)(removed.address.S_un.S_addr & IPV4_PREFIX_MASK(length)) << 8) | length;
+
+        if (std::binary_search(retainedKeys.begin(), retainedKeys.end(), key)) {
+            keysOut.push_back(key);
+        }
+    }
+
+    // The prefix itself (i.e. also in the ini blocklist) and the prefixes inside it follow in sort order, up to the
+    //  end of its range
+    for (auto i = std::lower_bound(retainedKeys.begin(), retainedKeys.end(), (start << 8) | prefixLength);
+        i != retainedKeys.end() && (*i >> 8) < end; i++) {
+        keysOut.push_back(*i);
+    }
+}
+
+//EOF
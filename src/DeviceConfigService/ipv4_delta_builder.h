@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <inaddr.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Builds the IPv4 blocklist delta sent on a refresh (IOCTL_ATF_APPLY_IPV4_DELTA, BULK_PAYLOAD_IPV4_DELTA)
+//
+//  The blocklist last sent and the refreshed one are both sorted and without duplicates (see ipv4_bulk_builder.h),
+//   so a single merge pass splits them into the prefixes to remove and the prefixes to add. An hourly refresh of a
+//   large feed usually changes a small fraction of it, and the driver only does work for that fraction.
+//
+//  The driver clears every address of a removed prefix, whatever else covered it. A prefix that stays in the
+//   blocklist and overlaps a removed one (it covers it, or lies inside it) is therefore added back by the same
+//   delta. Aggregated feeds never overlap, so this only happens with ipv4_aggregate_feeds disabled, or against
+//   the ini blocklist.
+//
+class Ipv4DeltaBuilder {
+public:
+    //
+    // Compute the delta from previous to current. retained holds every prefix that stays in the driver (current
+    //  and the ini blocklist), all three sorted and without duplicates. The outputs are sorted the same way
+    //
+    static void Diff(
+        const std::vector<IPV4_PREFIX_ENTRY> &previous,
+        const std::vector<IPV4_PREFIX_ENTRY> &current,
+        const std::vector<IPV4_PREFIX_ENTRY> &retained,
+        std::vector<IPV4_PREFIX_ENTRY> &removalsOut,
+        std::vector<IPV4_PREFIX_ENTRY> &additionsOut
+    );
+
+    //
+    // Serialize a delta: IPV4_DELTA_HEADER, the removals, then the additions
+    //
+    static std::vector<std::byte> Serialize(
+        const std::vector<IPV4_PREFIX_ENTRY> &removals,
+        const std::vector<IPV4_PREFIX_ENTRY> &additions
+    );
+
+private:
+    //
+    // Sort key of a prefix, the same order as Ipv4BulkBuilder::SortUnique
+    //
+    static uint64_t prefixKey(const IPV4_PREFIX_ENTRY &entry);
+
+    //
+    // Append the keys of retainedKeys that cover the removed prefix, are the same prefix, or lie inside it
+    //
+    static void overlappingKeys(
+        const std::vector<uint64_t> &retainedKeys,
+        const IPV4_PREFIX_ENTRY &removed,
+        std::vector<uint64_t> &keysOut
+    );
+};
+
+//EOF
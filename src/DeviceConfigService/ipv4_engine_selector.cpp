@@ -0,0 +1,299 @@
+#include <Windows.h>
+
+#include "ipv4_engine_selector.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/user_logging.h"
+
+#include <intrin.h>
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+//
+// Driver structure sizes (x64) the estimates are based on
+//
+
+// sizeof(IPV4_TRIE_NODE) and sizeof(IPV4_TRIE_LEAF), the root node is part of the context
+#define TRIE_NODE_SIZE                      80
+#define TRIE_LEAF_SIZE                      1
+#define TRIE_STRIDE                         8
+#define TRIE_MAX_DEPTH                      4
+
+// IPV4_DIR24_TBL24_SIZE, IPV4_DIR24_TBL8_BLOCK_SIZE and IPV4_DIR24_TBL8_INITIAL_BLOCKS
+#define DIR24_TBL24_SIZE                    ((1ULL << 24) * sizeof(uint32_t))
+#define DIR24_TBL8_BLOCK_SIZE               256
+#define DIR24_TBL8_INITIAL_BLOCKS           1024
+
+// sizeof(IPV4_CUCKOO_BUCKET), IPV4_CUCKOO_BUCKET_SLOTS, IPV4_CUCKOO_MIN_BUCKETS and IPV4_CUCKOO_LOAD_PERCENT
+#define CUCKOO_BUCKET_SIZE                  32
+#define CUCKOO_BUCKET_SLOTS                 8
+#define CUCKOO_MIN_BUCKETS                  64
+#define CUCKOO_LOAD_PERCENT                 90
+
+// sizeof(IPV4_ROARING_CTX) (mostly the directory), and the container limits of ipv4_roaring.c
+#define ROARING_CTX_SIZE                    (65536 * 8 + 80)
+#define ROARING_CHUNK_BITS                  16
+#define ROARING_NUM_OF_CHUNKS               (1UL << ROARING_CHUNK_BITS)
+#define ROARING_BITMAP_WORDS                4096
+#define ROARING_ARRAY_MAX_CARDINALITY       4096
+#define ROARING_RUN_WORDS                   2
+
+//
+// Engines in order of lookup speed, fastest first
+//
+static const IPV4_LOOKUP_ENGINE engineSpeedOrder[] = {
+    IPV4_ENGINE_DIR24,      // One memory access, two for prefixes longer than /24
+    IPV4_ENGINE_ROARING,    // Directory entry and one container
+    IPV4_ENGINE_CUCKOO,     // Up to two buckets, and the trie for subnets
+    IPV4_ENGINE_TRIE        // Up to four levels
+};
+
+std::vector<IPV4_ENGINE_ESTIMATE> Ipv4EngineSelector::EstimateEngines(const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    std::vector<IPV4_ENGINE_ESTIMATE> estimates;
+
+    for (const IPV4_LOOKUP_ENGINE engine : engineSpeedOrder) {
+        estimates.push_back({ engine, EstimateEngine(engine, prefixes) });
+    }
+
+    return estimates;
+}
+
+uint64_t Ipv4EngineSelector::EstimateEngine(IPV4_LOOKUP_ENGINE engine, const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    switch (engine) {
+    case IPV4_ENGINE_TRIE:
+        return estimateTrie(prefixes);
+    case IPV4_ENGINE_DIR24:
+        return estimateDir24(prefixes);
+    case IPV4_ENGINE_CUCKOO:
+        return estimateCuckoo(prefixes);
+    case IPV4_ENGINE_ROARING:
+        return estimateRoaring(prefixes);
+    default:
+        return 0;
+    }
+}
+
+IPV4_LOOKUP_ENGINE Ipv4EngineSelector::SelectEngine(
+    const std::vector<IPV4_PREFIX_ENTRY> &prefixes,
+    uint64_t memoryBudget,
+    uint64_t &predictedSizeOut
+)
+{
+    const std::vector<IPV4_ENGINE_ESTIMATE> estimates = EstimateEngines(prefixes);
+
+    for (const IPV4_ENGINE_ESTIMATE &estimate : estimates) {
+        LOG_DEBUG("IPv4 engine %s estimated at %llu bytes", GetEngineName(estimate.engine), estimate.size);
+    }
+
+    for (const IPV4_ENGINE_ESTIMATE &estimate : estimates) {
+        if (!memoryBudget || estimate.size <= memoryBudget) {
+            predictedSizeOut = estimate.size;
+            return estimate.engine;
+        }
+    }
+
+    const IPV4_ENGINE_ESTIMATE &smallest = *std::min_element(estimates.begin(), estimates.end(),
+        [](const IPV4_ENGINE_ESTIMATE &a, const IPV4_ENGINE_ESTIMATE &b) { return a.size < b.size; });
+
+    LOG_WARNING("No IPv4 engine fits the memory budget of %llu bytes, using the smallest (%s, %llu bytes)",
+        memoryBudget, GetEngineName(smallest.engine), smallest.size);
+
+    predictedSizeOut = smallest.size;
+    return smallest.engine;
+}
+
+const char *Ipv4EngineSelector::GetEngineName(IPV4_LOOKUP_ENGINE engine)
+{
+    switch (engine) {
+    case IPV4_ENGINE_TRIE:
+        return "TRIE";
+    case IPV4_ENGINE_DIR24:
+        return "DIR24";
+    case IPV4_ENGINE_CUCKOO:
+        return "CUCKOO";
+    case IPV4_ENGINE_ROARING:
+        return "ROARING";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+uint64_t Ipv4EngineSelector::estimateTrie(const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    //
+    // A prefix of length p is stored on level (p - 1) / 8, as the leaves it covers on that level. The nodes are
+    //  the distinct paths above the leaves, keyed by (level, address bits above the level)
+    //
+    std::vector<uint64_t> nodeKeys;
+    std::vector<uint64_t> leafKeys;
+
+    for (const IPV4_PREFIX_ENTRY &entry : prefixes) {
+        const uint32_t address = maskedAddress(entry);
+        const uint32_t leafLevel = (entry.prefixLength - 1) / TRIE_STRIDE;
+
+        for (uint32_t level = 1; level <= leafLevel; level++) {
+            nodeKeys.push_back(((uint64_t)level << 32) | (address >> ((TRIE_MAX_DEPTH - level) * TRIE_STRIDE)));
+        }
+
+        const uint32_t leafShift = (TRIE_MAX_DEPTH - 1 - leafLevel) * TRIE_STRIDE;
+        const uint32_t numOfLeaves = 1UL << ((leafLevel + 1) * TRIE_STRIDE - entry.prefixLength);
+
+        for (uint32_t i = 0; i < numOfLeaves; i++) {
+            leafKeys.push_back(((uint64_t)leafLevel << 32) | ((address >> leafShift) + i));
+        }
+    }
+
+    std::sort(nodeKeys.begin(), nodeKeys.end());
+    std::sort(leafKeys.begin(), leafKeys.end());
+
+    const uint64_t numOfNodes = std::unique(nodeKeys.begin(), nodeKeys.end()) - nodeKeys.begin();
+    const uint64_t numOfLeaves = std::unique(leafKeys.begin(), leafKeys.end()) - leafKeys.begin();
+
+    return (numOfNodes + 1) * TRIE_NODE_SIZE + numOfLeaves * TRIE_LEAF_SIZE;
+}
+
+uint64_t Ipv4EngineSelector::estimateDir24(const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    // Every /24 holding a prefix longer than /24 is extended with a tbl8 block
+    std::vector<uint32_t> extendedBlocks;
+
+    for (const IPV4_PREFIX_ENTRY &entry : prefixes) {
+        if (entry.prefixLength > 24) {
+            extendedBlocks.push_back(maskedAddress(entry) >> 8);
+        }
+    }
+
+    std::sort(extendedBlocks.begin(), extendedBlocks.end());
+    const uint64_t numOfBlocks = std::unique(extendedBlocks.begin(), extendedBlocks.end()) - extendedBlocks.begin();
+
+    uint64_t capacity = 0;
+    if (numOfBlocks) {
+        capacity = DIR24_TBL8_INITIAL_BLOCKS;
+        while (capacity < numOfBlocks) {
+            capacity *= 2;
+        }
+    }
+
+    return DIR24_TBL24_SIZE + capacity * DIR24_TBL8_BLOCK_SIZE;
+}
+
+uint64_t Ipv4EngineSelector::estimateCuckoo(const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    //
+    // The driver sizes the table for every /32 entry of a pool, duplicates included (they are only found once
+    //  inserted), so the entries are counted rather than the distinct addresses
+    //
+    uint64_t numOfAddresses = 0;
+    std::vector<IPV4_PREFIX_ENTRY> subnets;
+
+    for (const IPV4_PREFIX_ENTRY &entry : prefixes) {
+        if (entry.prefixLength == IPV4_PREFIX_MAX_LENGTH) {
+            numOfAddresses++;
+        } else {
+            subnets.push_back(entry);
+        }
+    }
+
+    const uint64_t slotsPerBucket = CUCKOO_BUCKET_SLOTS * CUCKOO_LOAD_PERCENT;
+    const uint64_t numOfBuckets = std::max<uint64_t>(CUCKOO_MIN_BUCKETS,
+        (numOfAddresses * 100 + slotsPerBucket - 1) / slotsPerBucket);
+
+    uint64_t size = numOfBuckets * CUCKOO_BUCKET_SIZE;
+    if (!subnets.empty()) {
+        size += estimateTrie(subnets);
+    }
+
+    return size;
+}
+
+uint64_t Ipv4EngineSelector::estimateRoaring(const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    // A /16 or shorter prefix covers whole chunks, which become a single run each
+    std::vector<bool> coveredChunks(ROARING_NUM_OF_CHUNKS, false);
+    std::vector<IPV4_PREFIX_ENTRY> chunkEntries;
+
+    for (const IPV4_PREFIX_ENTRY &entry : prefixes) {
+        const uint32_t address = maskedAddress(entry);
+
+        if (entry.prefixLength > ROARING_CHUNK_BITS) {
+            chunkEntries.push_back(entry);
+            continue;
+        }
+
+        const uint32_t firstChunk = address >> ROARING_CHUNK_BITS;
+        const uint32_t numOfChunks = 1UL << (ROARING_CHUNK_BITS - entry.prefixLength);
+        std::fill(coveredChunks.begin() + firstChunk, coveredChunks.begin() + firstChunk + numOfChunks, true);
+    }
+
+    uint64_t poolWords = 0;
+    for (uint32_t chunk = 0; chunk < ROARING_NUM_OF_CHUNKS; chunk++) {
+        if (coveredChunks[chunk]) {
+            poolWords += ROARING_RUN_WORDS;
+        }
+    }
+
+    // The other chunks are built the way the driver builds them, from a bitmap of the chunk
+    std::sort(chunkEntries.begin(), chunkEntries.end(),
+        [](const IPV4_PREFIX_ENTRY &a, const IPV4_PREFIX_ENTRY &b) { return a.address.S_un.S_addr < b.address.S_un.S_addr; });
+
+    std::vector<uint64_t> bitmap((1UL << (32 - ROARING_CHUNK_BITS)) / 64);
+
+    for (size_t first = 0; first < chunkEntries.size();) {
+        const uint32_t chunk = chunkEntries[first].address.S_un.S_addr >> ROARING_CHUNK_BITS;
+
+        size_t last = first;
+        while (last < chunkEntries.size() && (chunkEntries[last].address.S_un.S_addr >> ROARING_CHUNK_BITS) == chunk) {
+            last++;
+        }
+
+        if (!coveredChunks[chunk]) {
+            std::fill(bitmap.begin(), bitmap.end(), 0);
+
+            for (size_t i = first; i < last; i++) {
+                const uint32_t low = maskedAddress(chunkEntries[i]) & 0xffff;
+                const uint32_t length = 1UL << (IPV4_PREFIX_MAX_LENGTH - chunkEntries[i].prefixLength);
+
+                for (uint32_t v = low; v < low + length; v++) {
+                    bitmap[v / 64] |= 1ULL << (v % 64);
+                }
+            }
+
+            poolWords += roaringContainerWords(bitmap);
+        }
+
+        first = last;
+    }
+
+    return ROARING_CTX_SIZE + poolWords * sizeof(uint16_t);
+}
+
+uint64_t Ipv4EngineSelector::roaringContainerWords(const std::vector<uint64_t> &bitmap)
+{
+    uint64_t cardinality = 0, numOfRuns = 0, carry = 0;
+
+    for (const uint64_t word : bitmap) {
+        cardinality += __popcnt64(word);
+        numOfRuns += __popcnt64(word & ~((word << 1) | carry));
+        carry = word >> 63;
+    }
+
+    uint64_t numOfWords = ROARING_BITMAP_WORDS;
+    if (cardinality <= ROARING_ARRAY_MAX_CARDINALITY && cardinality < numOfWords) {
+        numOfWords = cardinality;
+    }
+
+    return std::min<uint64_t>(numOfWords, numOfRuns * ROARING_RUN_WORDS);
+}
+
+uint32_t Ipv4EngineSelector::maskedAddress(const IPV4_PREFIX_ENTRY &entry)
+{
+    return entry.address.S_un.S_addr & IPV4_PREFIX_MASK(entry.prefixLength);
+}
+
+//EOF
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <inaddr.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Default memory budget of the IPv4 lookup engine in MB, no limit (see ini, [lookup_engine] ipv4_memory_budget_mb)
+//
+#define IPV4_DEFAULT_MEMORY_BUDGET_MB           0
+
+//
+// Estimated size of an IPv4 lookup engine, in bytes
+//
+typedef struct _ipv4_engine_estimate {
+    IPV4_LOOKUP_ENGINE                          engine;
+    uint64_t                                    size;
+} IPV4_ENGINE_ESTIMATE;
+
+//
+// Picks the IPv4 lookup engine for a blocklist under a non-paged memory budget (ini, ipv4_lookup_engine = AUTO)
+//
+//  The size of every engine is estimated from the actual prefixes, following the layout of the driver structures:
+//   TRIE:    the root, a node for every distinct path above the leaves, and a byte for every distinct leaf
+//   DIR24:   the 64MB tbl24, and a tbl8 block for every /24 holding a longer prefix (the capacity doubles from 1024)
+//   CUCKOO:  buckets for the /32 entries at 90% occupancy, and a trie for the other prefixes
+//   ROARING: the 512KB directory, and the smallest container of every /16 the blocklist touches
+//
+//  The engines are tried fastest first (DIR24, ROARING, CUCKOO, TRIE) and the first one that fits the budget is
+//   selected. If none of them fits, the smallest is selected instead, the driver rejects the blocklist if the
+//   engine still ends up over the budget
+//
+class Ipv4EngineSelector {
+public:
+    //
+    // Estimate the size of every engine for the prefixes, in order of lookup speed (fastest first)
+    //
+    static std::vector<IPV4_ENGINE_ESTIMATE> EstimateEngines(const std::vector<IPV4_PREFIX_ENTRY> &prefixes);
+
+    //
+    // Estimate the size of a single engine
+    //
+    static uint64_t EstimateEngine(IPV4_LOOKUP_ENGINE engine, const std::vector<IPV4_PREFIX_ENTRY> &prefixes);
+
+    //
+    // Select the fastest engine that fits the budget (0 for no limit), or the smallest engine.
+    //  predictedSizeOut receives the estimated size of the selected engine
+    //
+    static IPV4_LOOKUP_ENGINE SelectEngine(
+        const std::vector<IPV4_PREFIX_ENTRY> &prefixes,
+        uint64_t memoryBudget,
+        uint64_t &predictedSizeOut
+    );
+
+    //
+    // Returns the ini name of an engine
+    //
+    static const char *GetEngineName(IPV4_LOOKUP_ENGINE engine);
+
+private:
+    static uint64_t estimateTrie(const std::vector<IPV4_PREFIX_ENTRY> &prefixes);
+    static uint64_t estimateDir24(const std::vector<IPV4_PREFIX_ENTRY> &prefixes);
+    static uint64_t estimateCuckoo(const std::vector<IPV4_PREFIX_ENTRY> &prefixes);
+    static uint64_t estimateRoaring(const std::vector<IPV4_PREFIX_ENTRY> &prefixes);
+
+    //
+    // Number of pool words of the smallest container for a /16 bitmap (same rules as ipv4_roaring.c)
+    //
+    static uint64_t roaringContainerWords(const std::vector<uint64_t> &bitmap);
+
+    //
+    // Address of a prefix with the host bits cleared
+    //
+    static uint32_t maskedAddress(const IPV4_PREFIX_ENTRY &entry);
+};
+
+//EOF
@@ -0,0 +1,510 @@
+#include <Windows.h>
+
+#include "ipv4_image_builder.h"
+#include "ipv4_bulk_builder.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/ipv4_image_format.h"
+#include "../common/user_logging.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#define IPV4_IMAGE_STRIDE                   8
+#define IPV4_IMAGE_MAX_DEPTH                4
+
+// Significant bits of a leaf sort key: level, address and prefix length
+#define IPV4_IMAGE_LEAF_KEY_BITS            (2 + 32 + 8)
+
+// Attempts (seeds) before the prefilter build gives up
+#define IPV4_IMAGE_FILTER_MAX_ATTEMPTS      64
+
+ATF_ERROR Ipv4ImageBuilder::CompileImage(
+    const std::vector<IPV4_PREFIX_ENTRY> &prefixes,
+    IPV4_PREFILTER_MODE prefilterMode,
+    std::vector<std::byte> &imageOut
+)
+{
+    imageOut.clear();
+    numOfPrefixes = 0;
+    lastImageSize = 0;
+
+    if (prefixes.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    //
+    // 1. Expand the prefixes into leaves, the prefix length is packed below the leaf key so that sorting
+    //     puts the longest prefix of a leaf last
+    //
+    std::vector<uint64_t> leafKeys;
+    leafKeys.reserve(prefixes.size());
+
+    for (const IPV4_PREFIX_ENTRY &entry : prefixes) {
+        const uint32_t prefixLength = entry.prefixLength;
+        if (prefixLength < IPV4_PREFIX_MIN_LENGTH || prefixLength > IPV4_PREFIX_MAX_LENGTH) {
+            return ATF_BAD_PARAMETERS;
+        }
+
+        const uint32_t address = entry.address.S_un.S_addr & IPV4_PREFIX_MASK(prefixLength);
+
+        const uint32_t leafLevel = (prefixLength - 1) / IPV4_IMAGE_STRIDE;
+        const uint32_t numOfLeaves = 1UL << (((leafLevel + 1) * IPV4_IMAGE_STRIDE) - prefixLength);
+        const uint32_t octetShift = (IPV4_IMAGE_MAX_DEPTH - 1 - leafLevel) * IPV4_IMAGE_STRIDE;
+
+        for (uint32_t i = 0; i < numOfLeaves; i++) {
+            const uint32_t leafAddress = address + (i << octetShift);
+            leafKeys.push_back((trieKey(leafLevel, leafAddress) << 8) | prefixLength);
+        }
+    }
+
+    Ipv4BulkBuilder::RadixSort(leafKeys, IPV4_IMAGE_LEAF_KEY_BITS);
+
+    //
+    // Keep the last (longest) entry of every leaf. Duplicate prefixes are adjacent, and a prefix is counted on
+    //  its first leaf, the only one of its leaves whose octet is aligned to the number of leaves of the prefix
+    //
+    std::vector<uint64_t> leaves;
+    std::vector<uint8_t> leafValues;
+    leaves.reserve(leafKeys.size());
+    leafValues.reserve(leafKeys.size());
+
+    for (size_t i = 0; i < leafKeys.size(); i++) {
+        if (!i || leafKeys[i] != leafKeys[i - 1]) {
+            const uint32_t prefixLength = (uint32_t)(leafKeys[i] & 0xff);
+            const uint32_t leafLevel = keyLevel(leafKeys[i] >> 8);
+            const uint32_t numOfLeaves = 1UL << (((leafLevel + 1) * IPV4_IMAGE_STRIDE) - prefixLength);
+
+            if (!(levelOctet(keyAddress(leafKeys[i] >> 8), leafLevel) & (numOfLeaves - 1))) {
+                numOfPrefixes++;
+            }
+        }
+
+        if (i + 1 < leafKeys.size() && (leafKeys[i] >> 8) == (leafKeys[i + 1] >> 8)) {
+            continue;
+        }
+
+        leaves.push_back(leafKeys[i] >> 8);
+        leafValues.push_back((uint8_t)(leafKeys[i] & 0xff));
+    }
+
+    leafKeys.clear();
+    leafKeys.shrink_to_fit();
+
+    //
+    // The prefilter keys are the leaves themselves
+    //
+    IPV4_IMAGE_HEADER filterHeader = { 0 };
+    std::vector<IPV4_IMAGE_FINGERPRINT> fingerprints;
+
+    if (prefilterMode != IPV4_PREFILTER_NONE) {
+        ATF_ERROR atfError = buildFilter(leaves, filterHeader, fingerprints);
+        if (atfError) {
+            return atfError;
+        }
+    }
+
+    // A prefilter-only image has no nodes or leaves
+    if (prefilterMode == IPV4_PREFILTER_ONLY) {
+        leaves.clear();
+        leafValues.clear();
+    }
+
+    //
+    // 2. Every leaf needs the nodes on its path, from the root down to its own level. The leaves of each level
+    //     are sorted, so are their paths on any level above: the nodes of a level are the merge of those runs
+    //
+    std::vector<size_t> leafLevelStart;
+    levelBoundaries(leaves, leafLevelStart);
+
+    std::vector<uint64_t> nodes;
+    std::vector<size_t> nodeLevelStart(IPV4_IMAGE_MAX_DEPTH + 1);
+    nodes.reserve(leaves.size() / 2 + 1);
+
+    for (uint32_t level = 0; level < IPV4_IMAGE_MAX_DEPTH; level++) {
+        nodeLevelStart[level] = nodes.size();
+        mergeLevelNodes(leaves, leafLevelStart, level, nodes);
+    }
+    nodeLevelStart[IPV4_IMAGE_MAX_DEPTH] = nodes.size();
+
+    if (nodes.size() > UINT32_MAX || leaves.size() > UINT32_MAX) {
+        return ATF_BULK_PAYLOAD_TOO_LARGE;
+    }
+
+    //
+    // Lay out the image: header, node array, leaf array, prefilter
+    //
+    const size_t nodesOffset = sizeof(IPV4_IMAGE_HEADER);
+    const size_t leavesOffset = nodesOffset + nodes.size() * sizeof(IPV4_IMAGE_NODE);
+    const size_t filterOffset = alignSize(leavesOffset + leaves.size());
+    const size_t imageSize = alignSize(filterOffset + fingerprints.size() * sizeof(IPV4_IMAGE_FINGERPRINT));
+
+    lastImageSize = imageSize;
+    if (imageSize > BULK_UPLOAD_MAX_SIZE) {
+        return ATF_BULK_PAYLOAD_TOO_LARGE;
+    }
+
+    imageOut.resize(imageSize);
+
+    IPV4_IMAGE_HEADER *header = reinterpret_cast<IPV4_IMAGE_HEADER *>(imageOut.data());
+    IPV4_IMAGE_NODE *imageNodes = reinterpret_cast<IPV4_IMAGE_NODE *>(imageOut.data() + nodesOffset);
+    uint8_t *imageLeaves = reinterpret_cast<uint8_t *>(imageOut.data() + leavesOffset);
+
+    //
+    // 3. Link the nodes and leaves to their parents, in one sweep over the parents of each level. Below the root,
+    //     the subtrees of the first octets are disjoint, so they are linked by several workers at once
+    //
+    if (!nodes.empty()) {
+        linkRange(nodes, nodeLevelStart[0], nodes, nodeLevelStart[1], nodeLevelStart[2], false, imageNodes);
+        linkRange(nodes, nodeLevelStart[0], leaves, leafLevelStart[0], leafLevelStart[1], true, imageNodes);
+    }
+
+    std::vector<std::vector<size_t>> nodeOctetStart(IPV4_IMAGE_MAX_DEPTH);
+    std::vector<std::vector<size_t>> leafOctetStart(IPV4_IMAGE_MAX_DEPTH);
+    std::vector<size_t> octetWeights(UINT8_MAX + 1);
+
+    for (uint32_t level = 1; level < IPV4_IMAGE_MAX_DEPTH; level++) {
+        octetBoundaries(nodes, nodeLevelStart[level], nodeLevelStart[level + 1], level, nodeOctetStart[level]);
+        octetBoundaries(leaves, leafLevelStart[level], leafLevelStart[level + 1], level, leafOctetStart[level]);
+
+        for (uint32_t octet = 0; octet <= UINT8_MAX; octet++) {
+            octetWeights[octet] += nodeOctetStart[level][octet + 1] - nodeOctetStart[level][octet];
+            octetWeights[octet] += leafOctetStart[level][octet + 1] - leafOctetStart[level][octet];
+        }
+    }
+
+    const uint32_t numOfWorkers = Ipv4BulkBuilder::GetNumOfThreads(nodes.size() + leaves.size());
+    std::vector<uint32_t> workerOctets;
+    Ipv4BulkBuilder::PartitionByFirstOctet(octetWeights, numOfWorkers, workerOctets);
+
+    Ipv4BulkBuilder::RunWorkers(numOfWorkers, [&](uint32_t worker) {
+        const uint32_t firstOctet = workerOctets[worker];
+        const uint32_t lastOctet = workerOctets[worker + 1];
+
+        for (uint32_t level = 1; level < IPV4_IMAGE_MAX_DEPTH; level++) {
+            if (level + 1 < IPV4_IMAGE_MAX_DEPTH) {
+                linkRange(nodes, nodeOctetStart[level][firstOctet], nodes, nodeOctetStart[level + 1][firstOctet],
+                    nodeOctetStart[level + 1][lastOctet], false, imageNodes);
+            }
+
+            linkRange(nodes, nodeOctetStart[level][firstOctet], leaves, leafOctetStart[level][firstOctet],
+                leafOctetStart[level][lastOctet], true, imageNodes);
+        }
+    });
+
+    if (!leafValues.empty()) {
+        std::memcpy(imageLeaves, leafValues.data(), leafValues.size());
+    }
+
+    if (!fingerprints.empty()) {
+        std::memcpy(imageOut.data() + filterOffset, fingerprints.data(), fingerprints.size() * sizeof(IPV4_IMAGE_FINGERPRINT));
+    }
+
+    header->magic = IPV4_IMAGE_MAGIC;
+    header->version = IPV4_IMAGE_VERSION;
+    header->headerSize = sizeof(IPV4_IMAGE_HEADER);
+    header->flags = 0;
+    header->imageSize = imageSize;
+    header->numOfPrefixes = numOfPrefixes;
+    header->nodesOffset = nodesOffset;
+    header->numOfNodes = nodes.size();
+    header->leavesOffset = leavesOffset;
+    header->numOfLeaves = leaves.size();
+
+    if (prefilterMode != IPV4_PREFILTER_NONE) {
+        header->flags |= IPV4_IMAGE_FLAG_PREFILTER;
+        if (prefilterMode == IPV4_PREFILTER_ONLY) {
+            header->flags |= IPV4_IMAGE_FLAG_PREFILTER_ONLY;
+        }
+
+        header->filterOffset = filterOffset;
+        header->filterSeed = filterHeader.filterSeed;
+        header->filterSegmentLength = filterHeader.filterSegmentLength;
+        header->filterSegmentCountLength = filterHeader.filterSegmentCountLength;
+        header->filterArrayLength = filterHeader.filterArrayLength;
+        header->filterLevelMask = filterHeader.filterLevelMask;
+    }
+
+    header->checksum = AtfIpv4ImageChecksum(imageOut.data() + sizeof(IPV4_IMAGE_HEADER), imageSize - sizeof(IPV4_IMAGE_HEADER));
+
+    LOG_DEBUG("Compiled IPv4 image: %d prefixes, %d nodes, %d leaves, %d prefilter fingerprints, %d bytes",
+        numOfPrefixes, nodes.size(), leaves.size(), fingerprints.size(), imageSize);
+
+    return ATF_ERROR_OK;
+}
+
+size_t Ipv4ImageBuilder::GetNumOfPrefixes(void) const
+{
+    return numOfPrefixes;
+}
+
+size_t Ipv4ImageBuilder::GetImageSize(void) const
+{
+    return lastImageSize;
+}
+
+ATF_ERROR Ipv4ImageBuilder::buildFilter(
+    const std::vector<uint64_t> &keys,
+    IPV4_IMAGE_HEADER &header,
+    std::vector<IPV4_IMAGE_FINGERPRINT> &fingerprintsOut
+)
+{
+    fingerprintsOut.clear();
+
+    const size_t size = keys.size();
+    if (!size || size > UINT32_MAX / 2) {
+        return ATF_BAD_PARAMETERS;
+    }
+
+    //
+    // Segment length and array size of a 3-wise binary fuse filter. Small sets need proportionally more slots
+    //  to peel reliably, from 1.125 slots per key upwards
+    //
+    uint32_t segmentLength = 4;
+    double sizeFactor = 4.0;
+    if (size > 1) {
+        segmentLength = 1UL << (uint32_t)std::floor(std::log((double)size) / std::log(3.33) + 2.25);
+        sizeFactor = std::max(1.125, 0.875 + 0.25 * std::log(1000000.0) / std::log((double)size));
+    }
+    segmentLength = std::clamp<uint32_t>(segmentLength, 4, IPV4_IMAGE_FILTER_MAX_SEGMENT_LENGTH);
+
+    const uint64_t capacity = (uint64_t)std::ceil((double)size * sizeFactor);
+    uint64_t segmentCount = (capacity + segmentLength - 1) / segmentLength;
+    segmentCount = segmentCount <= 2 ? 1 : segmentCount - 2;
+
+    const uint64_t arrayLength = (segmentCount + 2) * segmentLength;
+    if (arrayLength > UINT32_MAX) {
+        return ATF_BULK_PAYLOAD_TOO_LARGE;
+    }
+
+    header.filterSegmentLength = segmentLength;
+    header.filterSegmentCountLength = (uint32_t)(segmentCount * segmentLength);
+    header.filterArrayLength = (uint32_t)arrayLength;
+    header.filterLevelMask = 0;
+    for (const uint64_t key : keys) {
+        header.filterLevelMask |= 1UL << keyLevel(key);
+    }
+
+    std::vector<uint64_t> hashes(size);
+    std::vector<uint32_t> slotCounts(arrayLength);
+    std::vector<uint64_t> slotHashes(arrayLength);
+    std::vector<uint32_t> singleSlots;
+    std::vector<std::pair<uint64_t, uint32_t>> peeled;
+
+    for (uint64_t attempt = 0; attempt < IPV4_IMAGE_FILTER_MAX_ATTEMPTS; attempt++) {
+        header.filterSeed = AtfIpv4ImageFilterHash(attempt, IPV4_IMAGE_CHECKSUM_SEED);
+
+        std::fill(slotCounts.begin(), slotCounts.end(), 0);
+        std::fill(slotHashes.begin(), slotHashes.end(), 0);
+        singleSlots.clear();
+        peeled.clear();
+
+        for (size_t i = 0; i < size; i++) {
+            hashes[i] = AtfIpv4ImageFilterHash(keys[i], header.filterSeed);
+
+            uint32_t slots[3];
+            AtfIpv4ImageFilterSlots(&header, hashes[i], slots);
+            for (const uint32_t slot : slots) {
+                slotCounts[slot]++;
+                slotHashes[slot] ^= hashes[i];
+            }
+        }
+
+        for (uint32_t slot = 0; slot < arrayLength; slot++) {
+            if (slotCounts[slot] == 1) {
+                singleSlots.push_back(slot);
+            }
+        }
+
+        // Peel: a slot used by a single key belongs to that key, removing the key may free up its other slots
+        while (!singleSlots.empty()) {
+            const uint32_t slot = singleSlots.back();
+            singleSlots.pop_back();
+
+            if (slotCounts[slot] != 1) {
+                continue;
+            }
+
+            const uint64_t hash = slotHashes[slot];
+            peeled.emplace_back(hash, slot);
+
+            uint32_t slots[3];
+            AtfIpv4ImageFilterSlots(&header, hash, slots);
+            for (const uint32_t keySlot : slots) {
+                slotCounts[keySlot]--;
+                slotHashes[keySlot] ^= hash;
+                if (slotCounts[keySlot] == 1) {
+                    singleSlots.push_back(keySlot);
+                }
+            }
+        }
+
+        if (peeled.size() != size) {
+            continue;
+        }
+
+        // Assign in reverse, each key's own slot is the only one of its three that is still free
+        fingerprintsOut.assign(arrayLength, 0);
+        for (auto it = peeled.rbegin(); it != peeled.rend(); it++) {
+            uint32_t slots[3];
+            AtfIpv4ImageFilterSlots(&header, it->first, slots);
+
+            fingerprintsOut[it->second] = AtfIpv4ImageFilterFingerprint(it->first) ^
+                fingerprintsOut[slots[0]] ^ fingerprintsOut[slots[1]] ^ fingerprintsOut[slots[2]];
+        }
+
+        return ATF_ERROR_OK;
+    }
+
+    LOG_ERROR("Failed to build the IPv4 prefilter after %d attempts", IPV4_IMAGE_FILTER_MAX_ATTEMPTS);
+
+    return ATF_PREFILTER_BUILD;
+}
+
+void Ipv4ImageBuilder::levelBoundaries(const std::vector<uint64_t> &keys, std::vector<size_t> &levelStartOut)
+{
+    levelStartOut.assign(IPV4_IMAGE_MAX_DEPTH + 1, keys.size());
+
+    for (uint32_t level = 0; level < IPV4_IMAGE_MAX_DEPTH; level++) {
+        levelStartOut[level] = std::lower_bound(keys.begin(), keys.end(), trieKey(level, 0)) - keys.begin();
+    }
+}
+
+void Ipv4ImageBuilder::octetBoundaries(
+    const std::vector<uint64_t> &keys,
+    size_t begin,
+    size_t end,
+    uint32_t level,
+    std::vector<size_t> &octetStartOut
+)
+{
+    octetStartOut.assign(UINT8_MAX + 2, end);
+
+    for (uint32_t octet = 0; octet <= UINT8_MAX; octet++) {
+        octetStartOut[octet] = std::lower_bound(keys.begin() + begin, keys.begin() + end,
+            trieKey(level, octet << ((IPV4_IMAGE_MAX_DEPTH - 1) * IPV4_IMAGE_STRIDE))) - keys.begin();
+    }
+}
+
+void Ipv4ImageBuilder::mergeLevelNodes(
+    const std::vector<uint64_t> &leaves,
+    const std::vector<size_t> &leafLevelStart,
+    uint32_t level,
+    std::vector<uint64_t> &nodesOut
+)
+{
+    const uint32_t pathMask = IPV4_PREFIX_MASK(level * IPV4_IMAGE_STRIDE);
+
+    // One cursor per leaf level at or below this level
+    size_t cursors[IPV4_IMAGE_MAX_DEPTH] = { 0 };
+    for (uint32_t leafLevel = level; leafLevel < IPV4_IMAGE_MAX_DEPTH; leafLevel++) {
+        cursors[leafLevel] = leafLevelStart[leafLevel];
+    }
+
+    for (;;) {
+        bool isFound = false;
+        uint32_t path = 0;
+
+        for (uint32_t leafLevel = level; leafLevel < IPV4_IMAGE_MAX_DEPTH; leafLevel++) {
+            if (cursors[leafLevel] == leafLevelStart[leafLevel + 1]) {
+                continue;
+            }
+
+            const uint32_t leafPath = keyAddress(leaves[cursors[leafLevel]]) & pathMask;
+            if (!isFound || leafPath < path) {
+                path = leafPath;
+                isFound = true;
+            }
+        }
+
+        if (!isFound) {
+            break;
+        }
+
+        nodesOut.push_back(trieKey(level, path));
+
+        // Skip the leaves below this node
+        for (uint32_t leafLevel = level; leafLevel < IPV4_IMAGE_MAX_DEPTH; leafLevel++) {
+            size_t &cursor = cursors[leafLevel];
+            while (cursor < leafLevelStart[leafLevel + 1] && (keyAddress(leaves[cursor]) & pathMask) == path) {
+                cursor++;
+            }
+        }
+    }
+}
+
+void Ipv4ImageBuilder::linkRange(
+    const std::vector<uint64_t> &nodes,
+    size_t parentBegin,
+    const std::vector<uint64_t> &keys,
+    size_t begin,
+    size_t end,
+    bool isLeaf,
+    IPV4_IMAGE_NODE *imageNodes
+)
+{
+    size_t parent = parentBegin;
+    bool isFirstOfParent = true;
+
+    for (size_t i = begin; i < end; i++) {
+        const uint32_t level = keyLevel(keys[i]);
+        const uint32_t address = keyAddress(keys[i]);
+
+        // A leaf hangs off the node on its own level, a node off the one above
+        const uint32_t parentLevel = isLeaf ? level : level - 1;
+        const uint64_t parentKey = trieKey(parentLevel, address & IPV4_PREFIX_MASK(parentLevel * IPV4_IMAGE_STRIDE));
+
+        while (nodes[parent] != parentKey) {
+            parent++;
+            isFirstOfParent = true;
+        }
+
+        const uint8_t octet = levelOctet(address, parentLevel);
+        IPV4_IMAGE_NODE &parentNode = imageNodes[parent];
+
+        if (isLeaf) {
+            if (isFirstOfParent) {
+                parentNode.leavesIndex = (uint32_t)i;
+            }
+            parentNode.leafBitmap[octet >> 6] |= 1ULL << (octet & 63);
+        } else {
+            if (isFirstOfParent) {
+                parentNode.childrenIndex = (uint32_t)i;
+            }
+            parentNode.childBitmap[octet >> 6] |= 1ULL << (octet & 63);
+        }
+
+        isFirstOfParent = false;
+    }
+}
+
+size_t Ipv4ImageBuilder::alignSize(size_t size)
+{
+    return (size + IPV4_IMAGE_ALIGNMENT - 1) & ~((size_t)IPV4_IMAGE_ALIGNMENT - 1);
+}
+
+uint64_t Ipv4ImageBuilder::trieKey(uint32_t level, uint32_t address)
+{
+    return ((uint64_t)level << 32) | address;
+}
+
+uint32_t Ipv4ImageBuilder::keyLevel(uint64_t key)
+{
+    return (uint32_t)(key >> 32);
+}
+
+uint32_t Ipv4ImageBuilder::keyAddress(uint64_t key)
+{
+    return (uint32_t)key;
+}
+
+uint8_t Ipv4ImageBuilder::levelOctet(uint32_t address, uint32_t level)
+{
+    return (uint8_t)(address >> ((IPV4_IMAGE_MAX_DEPTH - 1 - level) * IPV4_IMAGE_STRIDE));
+}
+
+//EOF
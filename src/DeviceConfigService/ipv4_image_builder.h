@@ -0,0 +1,153 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <inaddr.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/ipv4_image_format.h"
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Prefilter built into the image (see ini, [lookup_engine] ipv4_prefilter)
+//
+typedef enum {
+    IPV4_PREFILTER_NONE,        // Trie only. Default value
+    IPV4_PREFILTER_ENABLED,     // Binary fuse filter checked ahead of the trie, misses skip the trie walk
+    IPV4_PREFILTER_ONLY         // Binary fuse filter alone, for very large feeds. Hits are only ever alerted on
+} IPV4_PREFILTER_MODE;
+
+//
+// Compiles an IPv4 blocklist into a relocatable lookup image (see ipv4_image_format.h), which the driver
+//  adopts as is. All of the trie building work is done here, in user mode, rather than in the driver.
+//
+//  The image is built from sorted keys rather than by inserting into a pointer trie:
+//   1. Every prefix is expanded into the leaves it covers on its trie level and the leaves are radix sorted (see
+//      ipv4_bulk_builder.h), duplicate leaves keep the longest prefix length
+//   2. The nodes are the distinct paths above the leaves, merged level by level from the sorted leaves. Sorted by
+//      (level, address) they are already in breadth-first order, and the children (or leaves) of a node are
+//      contiguous and sorted by octet
+//   3. Each node's bitmaps and first child/leaf index are filled in by a sweep over the parents of each level,
+//      the first octets below the root are swept in parallel
+//
+//  The optional prefilter is a binary fuse filter over the leaves (3-wise, 8-bit fingerprints), built by peeling:
+//   every key maps to three slots, a slot used by a single key is assigned to that key and removed, until all
+//   keys are assigned. Fingerprints are then written in the reverse order. If the keys cannot be peeled, the
+//   filter is rebuilt with the next seed
+//
+class Ipv4ImageBuilder {
+private:
+    // Number of distinct prefixes in the last compiled image
+    size_t                                      numOfPrefixes;
+
+    // Size of the last compiled image, also set when it is over BULK_UPLOAD_MAX_SIZE
+    size_t                                      lastImageSize;
+
+public:
+    Ipv4ImageBuilder(void) :
+        numOfPrefixes(0),
+        lastImageSize(0)
+    {
+
+    }
+
+    ~Ipv4ImageBuilder(void)
+    {
+
+    }
+
+    //
+    // Compile the prefixes into an image, imageOut receives the whole image (header included)
+    //
+    ATF_ERROR CompileImage(
+        const std::vector<IPV4_PREFIX_ENTRY> &prefixes,
+        IPV4_PREFILTER_MODE prefilterMode,
+        std::vector<std::byte> &imageOut
+    );
+
+    //
+    // Returns the number of distinct prefixes in the last compiled image
+    //
+    size_t GetNumOfPrefixes(void) const;
+
+    //
+    // Returns the size of the last compiled image. When CompileImage() fails with ATF_BULK_PAYLOAD_TOO_LARGE, the
+    //  size the image would have had
+    //
+    size_t GetImageSize(void) const;
+
+private:
+    //
+    // Build the binary fuse filter over the sorted, distinct leaf keys. The filter parameters are written to
+    //  the header, and the fingerprints to fingerprintsOut
+    //
+    static ATF_ERROR buildFilter(
+        const std::vector<uint64_t> &keys,
+        IPV4_IMAGE_HEADER &header,
+        std::vector<IPV4_IMAGE_FINGERPRINT> &fingerprintsOut
+    );
+
+    //
+    // Sort key of a trie node or leaf: the level in the upper bits, and the address bits of the path below
+    //
+    static uint64_t trieKey(uint32_t level, uint32_t address);
+
+    //
+    // Index of the first key of each level in sorted trie keys, levelStartOut[IPV4_IMAGE_MAX_DEPTH] is the end
+    //
+    static void levelBoundaries(const std::vector<uint64_t> &keys, std::vector<size_t> &levelStartOut);
+
+    //
+    // Index of the first key of each first octet within the sorted keys [begin, end) of a level,
+    //  octetStartOut[256] is the end
+    //
+    static void octetBoundaries(
+        const std::vector<uint64_t> &keys,
+        size_t begin,
+        size_t end,
+        uint32_t level,
+        std::vector<size_t> &octetStartOut
+    );
+
+    //
+    // Append the sorted nodes of a level, the distinct paths of the leaves on that level and below
+    //
+    static void mergeLevelNodes(
+        const std::vector<uint64_t> &leaves,
+        const std::vector<size_t> &leafLevelStart,
+        uint32_t level,
+        std::vector<uint64_t> &nodesOut
+    );
+
+    //
+    // Link the sorted nodes (or leaves) [begin, end) to their parents, which are searched for from parentBegin on
+    //
+    static void linkRange(
+        const std::vector<uint64_t> &nodes,
+        size_t parentBegin,
+        const std::vector<uint64_t> &keys,
+        size_t begin,
+        size_t end,
+        bool isLeaf,
+        IPV4_IMAGE_NODE *imageNodes
+    );
+
+    static uint32_t keyLevel(uint64_t key);
+    static uint32_t keyAddress(uint64_t key);
+
+    //
+    // Round up to IPV4_IMAGE_ALIGNMENT
+    //
+    static size_t alignSize(size_t size);
+
+    //
+    // Octet of an address on a trie level (same as IPV4_TRIE_OCTET in the driver)
+    //
+    static uint8_t levelOctet(uint32_t address, uint32_t level);
+};
+
+//EOF
@@ -0,0 +1,212 @@
+#include <Windows.h>
+
+#include "ipv6_aggregator.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/user_logging.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <tuple>
+#include <cstdint>
+
+void Ipv6Aggregator::AddFeed(const std::string &name, const std::vector<IPV6_PREFIX_ENTRY> &entries)
+{
+    IPV6_AGGREGATE_FEED feed;
+    feed.name = name;
+    feed.numOfEntries = entries.size();
+    feed.numOfSubnets = 0;
+    feed.numOfSites = 0;
+
+    feed.prefixes.reserve(entries.size());
+    for (const IPV6_PREFIX_ENTRY &entry : entries) {
+        IPV6_AGGREGATE_PREFIX prefix;
+        if (fromEntry(entry, prefix)) {
+            feed.prefixes.push_back(prefix);
+        }
+    }
+
+    sortUnique(feed.prefixes);
+
+    // Hosts into their /64 first, so that a /48 counts networks rather than hosts
+    if (threshold) {
+        feed.numOfSubnets = collapse(feed.prefixes, IPV6_AGGREGATE_SUBNET_LENGTH, IPV6_PREFIX_MAX_LENGTH);
+        feed.numOfSites = collapse(feed.prefixes, IPV6_AGGREGATE_SITE_LENGTH, IPV6_AGGREGATE_SUBNET_LENGTH);
+    }
+
+    feeds.push_back(std::move(feed));
+}
+
+std::vector<IPV6_PREFIX_ENTRY> Ipv6Aggregator::Aggregate(void) const
+{
+    std::vector<IPV6_AGGREGATE_PREFIX> merged;
+    size_t totalNumOfEntries = 0;
+
+    for (const IPV6_AGGREGATE_FEED &feed : feeds) {
+        totalNumOfEntries += feed.numOfEntries;
+        merged.insert(merged.end(), feed.prefixes.begin(), feed.prefixes.end());
+
+        LOG_INFO("Aggregated IPv6 feed %s: %d entries -> %d prefixes, %d /64 and %d /48 collapsed (ratio: %.2f)",
+            feed.name.c_str(), feed.numOfEntries, feed.prefixes.size(), feed.numOfSubnets, feed.numOfSites,
+            compressionRatio(feed.numOfEntries, feed.prefixes.size()));
+    }
+
+    // A /48 of one feed may cover the entries of another
+    sortUnique(merged);
+
+    std::vector<IPV6_PREFIX_ENTRY> prefixes;
+    prefixes.reserve(merged.size());
+    for (const IPV6_AGGREGATE_PREFIX &prefix : merged) {
+        prefixes.push_back(toEntry(prefix));
+    }
+
+    LOG_INFO("Aggregated %d IPv6 feeds: %d entries -> %d prefixes (ratio: %.2f)",
+        feeds.size(), totalNumOfEntries, prefixes.size(), compressionRatio(totalNumOfEntries, prefixes.size()));
+
+    return prefixes;
+}
+
+size_t Ipv6Aggregator::collapse(
+    std::vector<IPV6_AGGREGATE_PREFIX> &prefixes,
+    uint8_t collapseLength,
+    uint8_t countLength
+) const
+{
+    std::vector<IPV6_AGGREGATE_PREFIX> out;
+    out.reserve(prefixes.size());
+
+    size_t numOfCollapsed = 0;
+
+    for (size_t first = 0; first < prefixes.size();) {
+        const IPV6_AGGREGATE_PREFIX network = maskPrefix(prefixes[first], collapseLength);
+
+        //
+        // The entries under the same network are adjacent. A prefix of collapseLength or shorter is never grouped,
+        //  since the prefixes are unique it does not cover any of the entries after it
+        //
+        size_t last = first;
+        size_t numOfDistinct = 0;
+        IPV6_AGGREGATE_PREFIX previous = { 0 };
+
+        while (last < prefixes.size() && prefixes[last].prefixLength > collapseLength &&
+            isEqualPrefix(maskPrefix(prefixes[last], collapseLength), network))
+        {
+            const IPV6_AGGREGATE_PREFIX counted = maskPrefix(prefixes[last], countLength);
+            if (!numOfDistinct || !isEqualPrefix(counted, previous)) {
+                numOfDistinct++;
+                previous = counted;
+            }
+
+            last++;
+        }
+
+        // ::/64 holds the IPv4-mapped and other special addresses, which are not subscriber networks
+        if (last > first && numOfDistinct >= threshold && network.high) {
+            out.push_back(network);
+            numOfCollapsed++;
+            first = last;
+            continue;
+        }
+
+        if (last == first) {
+            last++;
+        }
+
+        out.insert(out.end(), prefixes.begin() + first, prefixes.begin() + last);
+        first = last;
+    }
+
+    prefixes.swap(out);
+
+    return numOfCollapsed;
+}
+
+void Ipv6Aggregator::sortUnique(std::vector<IPV6_AGGREGATE_PREFIX> &prefixes)
+{
+    // A prefix sorts right before the prefixes it covers
+    std::sort(prefixes.begin(), prefixes.end(), [](const IPV6_AGGREGATE_PREFIX &a, const IPV6_AGGREGATE_PREFIX &b) {
+        return std::tie(a.high, a.low, a.prefixLength) < std::tie(b.high, b.low, b.prefixLength);
+    });
+
+    //
+    // Prefixes are either nested or disjoint, so a prefix that is not covered by the last one kept is not covered
+    //  by any earlier one either
+    //
+    size_t numOfKept = 0;
+    for (size_t i = 0; i < prefixes.size(); i++) {
+        if (numOfKept) {
+            const IPV6_AGGREGATE_PREFIX &last = prefixes[numOfKept - 1];
+            if (prefixes[i].prefixLength >= last.prefixLength &&
+                isEqualPrefix(maskPrefix(prefixes[i], last.prefixLength), last)) {
+                continue;
+            }
+        }
+
+        prefixes[numOfKept++] = prefixes[i];
+    }
+
+    prefixes.resize(numOfKept);
+}
+
+bool Ipv6Aggregator::fromEntry(const IPV6_PREFIX_ENTRY &entry, IPV6_AGGREGATE_PREFIX &prefixOut)
+{
+    if (entry.prefixLength < IPV6_PREFIX_MIN_LENGTH || entry.prefixLength > IPV6_PREFIX_MAX_LENGTH) {
+        return false;
+    }
+
+    IPV6_AGGREGATE_PREFIX prefix = { 0 };
+    for (size_t i = 0; i < 8; i++) {
+        prefix.high = (prefix.high << 8) | entry.address.a.b.byte[i];
+        prefix.low = (prefix.low << 8) | entry.address.a.b.byte[i + 8];
+    }
+
+    prefixOut = maskPrefix(prefix, entry.prefixLength);
+
+    return true;
+}
+
+IPV6_PREFIX_ENTRY Ipv6Aggregator::toEntry(const IPV6_AGGREGATE_PREFIX &prefix)
+{
+    IPV6_PREFIX_ENTRY entry = { 0 };
+    for (size_t i = 0; i < 8; i++) {
+        entry.address.a.b.byte[i] = (uint8_t)(prefix.high >> (56 - i * 8));
+        entry.address.a.b.byte[i + 8] = (uint8_t)(prefix.low >> (56 - i * 8));
+    }
+
+    entry.prefixLength = prefix.prefixLength;
+
+    return entry;
+}
+
+IPV6_AGGREGATE_PREFIX Ipv6Aggregator::maskPrefix(const IPV6_AGGREGATE_PREFIX &prefix, uint8_t prefixLength)
+{
+    IPV6_AGGREGATE_PREFIX out = { 0 };
+    out.prefixLength = prefixLength;
+
+    if (prefixLength >= 64) {
+        out.high = prefix.high;
+        out.low = (prefixLength == 64) ? 0 : prefix.low & (~0ULL << (IPV6_PREFIX_MAX_LENGTH - prefixLength));
+    } else {
+        out.high = prefixLength ? prefix.high & (~0ULL << (64 - prefixLength)) : 0;
+    }
+
+    return out;
+}
+
+bool Ipv6Aggregator::isEqualPrefix(const IPV6_AGGREGATE_PREFIX &a, const IPV6_AGGREGATE_PREFIX &b)
+{
+    return a.high == b.high && a.low == b.low && a.prefixLength == b.prefixLength;
+}
+
+double Ipv6Aggregator::compressionRatio(size_t numOfEntries, size_t numOfPrefixes)
+{
+    if (!numOfPrefixes) {
+        return 1.0;
+    }
+
+    return (double)numOfEntries / (double)numOfPrefixes;
+}
+
+//EOF
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Default number of entries within a /64 (or of /64 networks within a /48) for them to be collapsed
+//
+#define IPV6_AGGREGATE_DEFAULT_THRESHOLD        4
+
+// Subscriber allocation sizes the entries are collapsed into
+#define IPV6_AGGREGATE_SUBNET_LENGTH            64
+#define IPV6_AGGREGATE_SITE_LENGTH              48
+
+//
+// Prefix in host order, high holds the first 64 bits of the address
+//
+typedef struct _ipv6_aggregate_prefix {
+    uint64_t                                    high;
+    uint64_t                                    low;
+    uint8_t                                     prefixLength;
+} IPV6_AGGREGATE_PREFIX;
+
+//
+// A feed added to the aggregator, as its collapsed prefixes
+//
+typedef struct _ipv6_aggregate_feed {
+    std::string                                 name;
+
+    // Entries as downloaded, and the /64 and /48 prefixes they were collapsed into
+    size_t                                      numOfEntries;
+    size_t                                      numOfSubnets;
+    size_t                                      numOfSites;
+
+    // Sorted by (address, prefix length), no prefix is covered by another
+    std::vector<IPV6_AGGREGATE_PREFIX>          prefixes;
+} IPV6_AGGREGATE_FEED;
+
+//
+// Collapses the online IPv6 blocklists where a feed clusters (see ini, [lookup_engine] ipv6_aggregate_feeds)
+//
+//  An IPv6 host gets a whole /64 (SLAAC and privacy addresses rotate within it), and a site usually a /48, so
+//   feeds of individual addresses list many addresses of the same network. Unlike Ipv4Aggregator, this is not exact:
+//   - Entries within a /64 are replaced by the /64, once at least threshold distinct entries fall in it
+//   - /64 networks with entries within a /48 are replaced by the /48, once at least threshold of them fall in it
+//  Duplicates and prefixes covered by another prefix of any feed are then dropped.
+//
+//  Entries within ::/64 (IPv4-mapped ::ffff:a.b.c.d, loopback) are never collapsed, the driver stores the
+//   IPv4-mapped ones in the IPv4 blocklist.
+//
+class Ipv6Aggregator {
+private:
+    const size_t                                threshold;
+
+    std::vector<IPV6_AGGREGATE_FEED>            feeds;
+
+public:
+    Ipv6Aggregator(size_t threshold) :
+        threshold(threshold)
+    {
+
+    }
+
+    ~Ipv6Aggregator(void)
+    {
+
+    }
+
+    //
+    // Add the entries of a feed, invalid prefix lengths are skipped
+    //
+    void AddFeed(const std::string &name, const std::vector<IPV6_PREFIX_ENTRY> &entries);
+
+    //
+    // Merge every feed added so far, drop the duplicate and covered prefixes, and log the compression ratio of each feed
+    //
+    std::vector<IPV6_PREFIX_ENTRY> Aggregate(void) const;
+
+private:
+    //
+    // Replace the entries (prefixes longer than collapseLength) under a prefix of collapseLength by that prefix, if
+    //  they fall in at least threshold distinct prefixes of countLength. The prefixes must be sorted and unique,
+    //  and stay so. Returns the number of prefixes created
+    //
+    size_t collapse(
+        std::vector<IPV6_AGGREGATE_PREFIX> &prefixes,
+        uint8_t collapseLength,
+        uint8_t countLength
+    ) const;
+
+    //
+    // Sort the prefixes and drop the duplicate and covered ones
+    //
+    static void sortUnique(std::vector<IPV6_AGGREGATE_PREFIX> &prefixes);
+
+    //
+    // Conversion from/to the transport entry (network byte order)
+    //
+    static bool fromEntry(const IPV6_PREFIX_ENTRY &entry, IPV6_AGGREGATE_PREFIX &prefixOut);
+    static IPV6_PREFIX_ENTRY toEntry(const IPV6_AGGREGATE_PREFIX &prefix);
+
+    //
+    // Returns the prefix masked to a shorter prefix length
+    //
+    static IPV6_AGGREGATE_PREFIX maskPrefix(const IPV6_AGGREGATE_PREFIX &prefix, uint8_t prefixLength);
+
+    //
+    // Returns true if both prefixes have the same address and length
+    //
+    static bool isEqualPrefix(const IPV6_AGGREGATE_PREFIX &a, const IPV6_AGGREGATE_PREFIX &b);
+
+    //
+    // Entries per prefix, 1.0 for an empty feed
+    //
+    static double compressionRatio(size_t numOfEntries, size_t numOfPrefixes);
+};
+
+//EOF
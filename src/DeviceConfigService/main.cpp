@@ -87,6 +87,30 @@ int CALLBACK WinMain(
     LOG_DEBUG("Successfully appended %d IPs from online blacklist", filterConfig->GetNumOfIpv4BlacklistIps());
     #endif
 
+    // The IPv6 blocklist is optional, the filter starts with the ini entries alone
+    atfError = driverCommand->CmdAppendIpv6Blacklist();
+    if (atfError && atfError != ATF_NO_DATA_AVAILABLE) {
+        LOG_WARNING("Failed to append ipv6 blacklist (0x%08x)", atfError);
+    }
+
+    // Rules are optional as well, the driver rejects the whole list if a rule does not compile
+    atfError = driverCommand->CmdSendIpv4Rules();
+    if (atfError && atfError != ATF_NO_DATA_AVAILABLE) {
+        LOG_WARNING("Failed to send ipv4 rules (0x%08x)", atfError);
+    }
+
+    // Domain blacklists are optional, the image is rejected as a whole if it fails validation
+    atfError = driverCommand->CmdSendDomainBlacklist();
+    if (atfError && atfError != ATF_NO_DATA_AVAILABLE) {
+        LOG_WARNING("Failed to send domain blacklist (0x%08x)", atfError);
+    }
+
+    // Payload signatures are optional too, they are scanned on the stream layers
+    atfError = driverCommand->CmdSendPayloadSignatures();
+    if (atfError && atfError != ATF_NO_DATA_AVAILABLE) {
+        LOG_WARNING("Failed to send payload signatures (0x%08x)", atfError);
+    }
+
     Sleep(500);
 
     atfError = driverCommand->CmdStartWfp();
@@ -133,6 +157,25 @@ int CALLBACK WinMain(
     }
     #endif
 
+    //
+    // Refresh the online blacklists, the driver only receives what changed since the last refresh
+    //
+    const uint32_t refreshInterval = filterConfig->GetIpv4RefreshInterval();
+    while (refreshInterval) {
+        Sleep(refreshInterval * 60 * 1000);
+
+        atfError = filterConfig->RefreshOnlineIpBlacklists();
+        if (atfError) {
+            LOG_WARNING("Failed to refresh online blacklists, keeping the previous IPs (0x%08x)", atfError);
+            continue;
+        }
+
+        atfError = driverCommand->CmdUpdateIpv4Blacklist();
+        if (atfError) {
+            LOG_ERROR("Failed to update ipv4 blacklist (0x%08x)", atfError);
+        }
+    }
+
     Sleep(INFINITE);
     return 0;
 }
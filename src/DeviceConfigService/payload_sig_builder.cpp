@@ -0,0 +1,443 @@
+#include <Windows.h>
+
+#include "payload_sig_builder.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/payload_sig_format.h"
+#include "../common/shared.h"
+#include "../common/user_logging.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+// States with at least this many goto transitions get a dense row, a sparse state is searched linearly
+#define PAYLOAD_SIG_DENSE_MIN_EDGES         16
+
+// Reach table entries per bigram of the prefixes, until PAYLOAD_SIG_MAX_DOMAIN_BITS. The fewer bigrams share an
+//  entry, the fewer false candidates
+#define PAYLOAD_SIG_REACH_LOAD              4
+
+// Smallest reach table, 8KB
+#define PAYLOAD_SIG_DEFAULT_DOMAIN_BITS     10
+
+// Chars of a signature file line
+#define PAYLOAD_SIG_HEX_DELIMITER           '|'
+
+ATF_ERROR PayloadSigBuilder::ParseSignatureFile(
+    const std::string &filePath,
+    std::vector<PAYLOAD_SIGNATURE> &signaturesOut
+)
+{
+    signaturesOut.clear();
+
+    if (!shared::IsFileExists(filePath)) {
+        return ATF_ERROR_FILE_NOT_FOUND;
+    }
+
+    const std::vector<uint8_t> data = shared::ReadFile(filePath);
+    const std::vector<std::string> lines = shared::SplitStringByLine(std::string(data.begin(), data.end()));
+
+    size_t lineNumber = 0;
+    for (const std::string &line : lines) {
+        lineNumber++;
+
+        const size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#' || line[start] == ';') {
+            continue;
+        }
+
+        PAYLOAD_SIGNATURE signature;
+        if (!ParseSignature(line, signature)) {
+            LOG_WARNING("Skipping invalid payload signature at line %d of %s", lineNumber, filePath.c_str());
+            continue;
+        }
+
+        signaturesOut.push_back(std::move(signature));
+    }
+
+    if (signaturesOut.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    return ATF_ERROR_OK;
+}
+
+bool PayloadSigBuilder::ParseSignature(const std::string &line, PAYLOAD_SIGNATURE &signatureOut)
+{
+    static const char *whitespace = " \t\r\n";
+
+    const size_t nameStart = line.find_first_not_of(whitespace);
+    if (nameStart == std::string::npos) {
+        return false;
+    }
+
+    const size_t nameEnd = line.find_first_of(whitespace, nameStart);
+    if (nameEnd == std::string::npos || nameEnd - nameStart >= PAYLOAD_SIG_NAME_SIZE) {
+        return false;
+    }
+
+    const size_t literalStart = line.find_first_not_of(whitespace, nameEnd);
+    if (literalStart == std::string::npos) {
+        return false;
+    }
+    const size_t literalEnd = line.find_last_not_of(whitespace) + 1;
+
+    std::vector<uint8_t> literal;
+
+    bool isHex = false;
+    int highNibble = -1;
+    for (size_t i = literalStart; i < literalEnd; i++) {
+        const char c = line[i];
+
+        if (c == PAYLOAD_SIG_HEX_DELIMITER) {
+            // A hex block holds whole bytes
+            if (isHex && highNibble >= 0) {
+                return false;
+            }
+
+            isHex = !isHex;
+            continue;
+        }
+
+        if (!isHex) {
+            literal.push_back((uint8_t)c);
+            continue;
+        }
+
+        if (c == ' ' || c == '\t') {
+            if (highNibble >= 0) {
+                return false;
+            }
+
+            continue;
+        }
+
+        int nibble = 0;
+        if (c >= '0' && c <= '9') {
+            nibble = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            nibble = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            nibble = c - 'A' + 10;
+        } else {
+            return false;
+        }
+
+        if (highNibble < 0) {
+            highNibble = nibble;
+        } else {
+            literal.push_back((uint8_t)((highNibble << 4) | nibble));
+            highNibble = -1;
+        }
+    }
+
+    if (isHex || literal.size() < PAYLOAD_SIG_MIN_LITERAL_LENGTH || literal.size() > PAYLOAD_SIG_MAX_LITERAL_LENGTH) {
+        return false;
+    }
+
+    signatureOut.name = line.substr(nameStart, nameEnd - nameStart);
+    signatureOut.literal = std::move(literal);
+
+    return true;
+}
+
+ATF_ERROR PayloadSigBuilder::CompileImage(
+    const std::vector<PAYLOAD_SIGNATURE> &signatures,
+    std::vector<std::byte> &imageOut
+)
+{
+    imageOut.clear();
+    numOfSignatures = 0;
+
+    if (signatures.empty()) {
+        return ATF_NO_DATA_AVAILABLE;
+    }
+
+    if (signatures.size() > PAYLOAD_SIG_MAX_SIGNATURES) {
+        return ATF_BULK_PAYLOAD_TOO_LARGE;
+    }
+
+    size_t minLiteralLength = PAYLOAD_SIG_MAX_LITERAL_LENGTH;
+    for (const PAYLOAD_SIGNATURE &signature : signatures) {
+        if (signature.literal.size() < PAYLOAD_SIG_MIN_LITERAL_LENGTH ||
+            signature.literal.size() > PAYLOAD_SIG_MAX_LITERAL_LENGTH ||
+            signature.name.size() >= PAYLOAD_SIG_NAME_SIZE)
+        {
+            return ATF_BAD_PARAMETERS;
+        }
+
+        minLiteralLength = std::min(minLiteralLength, signature.literal.size());
+    }
+
+    //
+    // 1. Build the automaton
+    //
+    std::vector<TRIE_STATE> states;
+    buildAutomaton(signatures, states);
+
+    if (states.size() > PAYLOAD_SIG_MAX_STATES) {
+        return ATF_BULK_PAYLOAD_TOO_LARGE;
+    }
+
+    //
+    // 2. Dense rows for the root and the states with many transitions, sorted edges for the others
+    //
+    std::vector<PAYLOAD_SIG_STATE> imageStates(states.size());
+    std::vector<uint32_t> edgeTargets;
+    std::vector<uint8_t> edgeChars;
+    std::vector<uint32_t> dense;
+
+    for (uint32_t s = 0; s < states.size(); s++) {
+        const TRIE_STATE &state = states[s];
+        PAYLOAD_SIG_STATE &imageState = imageStates[s];
+
+        imageState.fail = state.fail;
+        imageState.match = state.match;
+        imageState.depth = (uint8_t)state.depth;
+        imageState.numOfEdges = (uint16_t)state.edges.size();
+
+        if (!s || state.edges.size() >= PAYLOAD_SIG_DENSE_MIN_EDGES) {
+            imageState.flags = PAYLOAD_SIG_STATE_DENSE;
+            imageState.edges = (uint32_t)(dense.size() / PAYLOAD_SIG_ALPHABET_SIZE);
+
+            for (uint32_t c = 0; c < PAYLOAD_SIG_ALPHABET_SIZE; c++) {
+                dense.push_back(step(states, s, (uint8_t)c));
+            }
+
+            continue;
+        }
+
+        imageState.flags = 0;
+        imageState.edges = (uint32_t)edgeTargets.size();
+
+        for (const std::pair<uint8_t, uint32_t> &edge : state.edges) {
+            edgeChars.push_back(edge.first);
+            edgeTargets.push_back(edge.second);
+        }
+    }
+
+    const size_t numOfStates = states.size();
+    const size_t numOfDenseStates = dense.size() / PAYLOAD_SIG_ALPHABET_SIZE;
+
+    states.clear();
+    states.shrink_to_fit();
+
+    //
+    // 3. Prefilter, over the prefix all literals have, with a reach table sized for the bigrams of the prefixes
+    //
+    const uint32_t prefilterLength = (uint32_t)std::min(minLiteralLength, (size_t)PAYLOAD_SIG_MAX_PREFILTER_LENGTH);
+
+    uint32_t domainBits = PAYLOAD_SIG_DEFAULT_DOMAIN_BITS;
+    const uint64_t numOfBigrams = (uint64_t)signatures.size() * (prefilterLength - 1);
+    while (domainBits < PAYLOAD_SIG_MAX_DOMAIN_BITS && (1ULL << domainBits) < numOfBigrams * PAYLOAD_SIG_REACH_LOAD) {
+        domainBits++;
+    }
+
+    std::vector<uint64_t> reach;
+    buildPrefilter(signatures, prefilterLength, domainBits, reach);
+
+    //
+    // Lay out the sections
+    //
+    const size_t statesOffset = sizeof(PAYLOAD_SIG_HEADER);
+    const size_t edgeTargetsOffset = alignSize(statesOffset + imageStates.size() * sizeof(PAYLOAD_SIG_STATE));
+    const size_t denseOffset = alignSize(edgeTargetsOffset + edgeTargets.size() * sizeof(uint32_t));
+    const size_t reachOffset = alignSize(denseOffset + dense.size() * sizeof(uint32_t));
+    const size_t edgeCharsOffset = alignSize(reachOffset + reach.size() * sizeof(uint64_t));
+    const size_t namesOffset = alignSize(edgeCharsOffset + edgeChars.size());
+    const size_t imageSize = alignSize(namesOffset + signatures.size() * PAYLOAD_SIG_NAME_SIZE);
+
+    if (imageSize > BULK_UPLOAD_MAX_SIZE) {
+        return ATF_BULK_PAYLOAD_TOO_LARGE;
+    }
+
+    imageOut.resize(imageSize);
+
+    std::memcpy(imageOut.data() + statesOffset, imageStates.data(), imageStates.size() * sizeof(PAYLOAD_SIG_STATE));
+    std::memcpy(imageOut.data() + edgeTargetsOffset, edgeTargets.data(), edgeTargets.size() * sizeof(uint32_t));
+    std::memcpy(imageOut.data() + denseOffset, dense.data(), dense.size() * sizeof(uint32_t));
+    std::memcpy(imageOut.data() + reachOffset, reach.data(), reach.size() * sizeof(uint64_t));
+    std::memcpy(imageOut.data() + edgeCharsOffset, edgeChars.data(), edgeChars.size());
+
+    for (size_t i = 0; i < signatures.size(); i++) {
+        std::memcpy(imageOut.data() + namesOffset + i * PAYLOAD_SIG_NAME_SIZE,
+            signatures[i].name.data(), signatures[i].name.size());
+    }
+
+    PAYLOAD_SIG_HEADER *header = reinterpret_cast<PAYLOAD_SIG_HEADER *>(imageOut.data());
+
+    header->magic = PAYLOAD_SIG_MAGIC;
+    header->version = PAYLOAD_SIG_VERSION;
+    header->headerSize = sizeof(PAYLOAD_SIG_HEADER);
+    header->flags = 0;
+    header->imageSize = imageSize;
+    header->numOfSignatures = (uint32_t)signatures.size();
+    header->numOfStates = (uint32_t)numOfStates;
+    header->numOfEdges = (uint32_t)edgeTargets.size();
+    header->numOfDenseStates = (uint32_t)numOfDenseStates;
+    header->prefilterLength = prefilterLength;
+    header->domainBits = domainBits;
+    header->statesOffset = statesOffset;
+    header->edgeTargetsOffset = edgeTargetsOffset;
+    header->denseOffset = denseOffset;
+    header->reachOffset = reachOffset;
+    header->edgeCharsOffset = edgeCharsOffset;
+    header->namesOffset = namesOffset;
+
+    header->checksum = AtfIpv4ImageChecksum(imageOut.data() + sizeof(PAYLOAD_SIG_HEADER), imageSize - sizeof(PAYLOAD_SIG_HEADER));
+
+    numOfSignatures = signatures.size();
+
+    LOG_DEBUG("Compiled payload signature image: %d signatures, %d states, %d dense states, prefilter %d bytes over %d bits, %d bytes",
+        numOfSignatures, numOfStates, numOfDenseStates, prefilterLength, domainBits, imageSize);
+
+    return ATF_ERROR_OK;
+}
+
+size_t PayloadSigBuilder::GetNumOfSignatures(void) const
+{
+    return numOfSignatures;
+}
+
+void PayloadSigBuilder::buildAutomaton(
+    const std::vector<PAYLOAD_SIGNATURE> &signatures,
+    std::vector<TRIE_STATE> &statesOut
+)
+{
+    //
+    // Trie of the literals, in insertion order
+    //
+    std::vector<TRIE_STATE> trie(1, { {}, 0, PAYLOAD_SIG_NO_MATCH, 0 });
+
+    for (size_t id = 0; id < signatures.size(); id++) {
+        uint32_t state = 0;
+        for (const uint8_t c : signatures[id].literal) {
+            std::vector<std::pair<uint8_t, uint32_t>> &edges = trie[state].edges;
+            std::vector<std::pair<uint8_t, uint32_t>>::iterator edge = std::lower_bound(edges.begin(), edges.end(),
+                std::make_pair(c, (uint32_t)0));
+
+            if (edge != edges.end() && edge->first == c) {
+                state = edge->second;
+                continue;
+            }
+
+            const uint32_t target = (uint32_t)trie.size();
+            const uint32_t depth = trie[state].depth + 1;
+            edges.insert(edge, { c, target });
+
+            trie.push_back({ {}, 0, PAYLOAD_SIG_NO_MATCH, depth });
+            state = target;
+        }
+
+        // Signatures sharing a literal report the first one
+        if (trie[state].match == PAYLOAD_SIG_NO_MATCH) {
+            trie[state].match = (uint32_t)id;
+        }
+    }
+
+    //
+    // Breadth first order, the children of a state in char order
+    //
+    std::vector<uint32_t> order(1, 0);
+    std::vector<uint32_t> newIndex(trie.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        for (const std::pair<uint8_t, uint32_t> &edge : trie[order[i]].edges) {
+            newIndex[edge.second] = (uint32_t)order.size();
+            order.push_back(edge.second);
+        }
+    }
+
+    statesOut.resize(trie.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        TRIE_STATE &state = statesOut[i];
+        state = std::move(trie[order[i]]);
+
+        for (std::pair<uint8_t, uint32_t> &edge : state.edges) {
+            edge.second = newIndex[edge.second];
+        }
+    }
+
+    trie.clear();
+    trie.shrink_to_fit();
+
+    //
+    // Failure states: the state of the longest proper suffix, found from the failure state of the parent. Both are
+    //  shallower than the child, so they are set by the time it is reached
+    //
+    for (uint32_t s = 0; s < statesOut.size(); s++) {
+        for (const std::pair<uint8_t, uint32_t> &edge : statesOut[s].edges) {
+            TRIE_STATE &child = statesOut[edge.second];
+
+            child.fail = s ? step(statesOut, statesOut[s].fail, edge.first) : 0;
+            if (child.match == PAYLOAD_SIG_NO_MATCH) {
+                child.match = statesOut[child.fail].match;
+            }
+        }
+    }
+}
+
+uint32_t PayloadSigBuilder::step(const std::vector<TRIE_STATE> &states, uint32_t state, uint8_t c)
+{
+    for (;;) {
+        const std::vector<std::pair<uint8_t, uint32_t>> &edges = states[state].edges;
+        std::vector<std::pair<uint8_t, uint32_t>>::const_iterator edge = std::lower_bound(edges.begin(), edges.end(),
+            std::make_pair(c, (uint32_t)0));
+
+        if (edge != edges.end() && edge->first == c) {
+            return edge->second;
+        }
+
+        if (!state) {
+            return 0;
+        }
+
+        state = states[state].fail;
+    }
+}
+
+void PayloadSigBuilder::buildPrefilter(
+    const std::vector<PAYLOAD_SIGNATURE> &signatures,
+    uint32_t prefilterLength,
+    uint32_t domainBits,
+    std::vector<uint64_t> &reachOut
+)
+{
+    // The lanes above the last bigram of the prefix are clear, the scanner checks them for the bytes of a stride
+    reachOut.assign((size_t)1 << domainBits, (1ULL << ((prefilterLength - 1) * 8)) - 1);
+
+    //
+    // Literals with a common prefix go to the same bucket, where they clear the same bits
+    //
+    std::vector<uint32_t> sorted(signatures.size());
+    for (uint32_t i = 0; i < sorted.size(); i++) {
+        sorted[i] = i;
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b) {
+        const std::vector<uint8_t> &la = signatures[a].literal;
+        const std::vector<uint8_t> &lb = signatures[b].literal;
+        return std::lexicographical_compare(la.begin(), la.begin() + prefilterLength, lb.begin(), lb.begin() + prefilterLength);
+    });
+
+    for (size_t rank = 0; rank < sorted.size(); rank++) {
+        const uint32_t bucket = (uint32_t)(rank * PAYLOAD_SIG_NUM_OF_BUCKETS / sorted.size());
+        const std::vector<uint8_t> &literal = signatures[sorted[rank]].literal;
+
+        // The bigram ending at byte k + 1 of the prefix is checked in lane k
+        for (uint32_t k = 0; k + 1 < prefilterLength; k++) {
+            const uint32_t hash = AtfPayloadSigBigramHash(literal[k], literal[k + 1], domainBits);
+            reachOut[hash] &= ~(1ULL << (k * 8 + bucket));
+        }
+    }
+}
+
+size_t PayloadSigBuilder::alignSize(size_t size)
+{
+    return (size + PAYLOAD_SIG_ALIGNMENT - 1) & ~((size_t)PAYLOAD_SIG_ALIGNMENT - 1);
+}
+
+//EOF
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/payload_sig_format.h"
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Compiles payload signatures into a prefilter and an Aho-Corasick automaton image (see payload_sig_format.h),
+//  which the driver adopts as is
+//
+//  The signature file holds one signature per line, a name and the literal it matches, separated by whitespace:
+//
+//   eicar-test   X5O!P%@AP[4\PZX54(P^)7CC)7}$EICAR
+//   http-cmd     GET /cmd.exe|3f|
+//
+//  The literal is the rest of the line, with its surrounding whitespace removed. Bytes between two pipes are hex,
+//   pairs of digits optionally separated by spaces (|0d 0a|), and a pipe itself is written |7c|. Lines starting with
+//   # or ; are comments. Literals are matched exactly, they are PAYLOAD_SIG_MIN_LITERAL_LENGTH to
+//   PAYLOAD_SIG_MAX_LITERAL_LENGTH bytes, and names are at most PAYLOAD_SIG_NAME_SIZE - 1 chars.
+//
+//  1. The literals are inserted into a trie, and its states numbered breadth first. Failure states and matches are
+//     then set in that order, as each one only depends on a shallower state
+//  2. The root and the states with at least PAYLOAD_SIG_DENSE_MIN_EDGES transitions get a dense row with the
+//     failure transitions resolved, the others keep their sorted goto transitions
+//  3. The literals are sorted by their prefix and split into PAYLOAD_SIG_NUM_OF_BUCKETS buckets of consecutive
+//     literals, so that the literals of a bucket share most of their bigrams, and the reach table of the prefilter is
+//     filled from the bigrams of each prefix
+//
+class PayloadSigBuilder {
+public:
+    typedef struct _payload_signature {
+        std::string                             name;
+        std::vector<uint8_t>                    literal;
+    } PAYLOAD_SIGNATURE;
+
+private:
+    typedef struct _trie_state {
+        // Goto transitions, sorted by char, with the target state
+        std::vector<std::pair<uint8_t, uint32_t>> edges;
+
+        uint32_t                                fail;
+        uint32_t                                match;
+        uint32_t                                depth;
+    } TRIE_STATE;
+
+    // Number of signatures in the last compiled image
+    size_t                                      numOfSignatures;
+
+public:
+    PayloadSigBuilder(void) :
+        numOfSignatures(0)
+    {
+
+    }
+
+    ~PayloadSigBuilder(void)
+    {
+
+    }
+
+    //
+    // Parse a signature file, the lines that ParseSignature() rejects are skipped with a warning
+    //  Returns ATF_ERROR_FILE_NOT_FOUND if there is no such file, ATF_NO_DATA_AVAILABLE if it holds no signature
+    //
+    static ATF_ERROR ParseSignatureFile(const std::string &filePath, std::vector<PAYLOAD_SIGNATURE> &signaturesOut);
+
+    //
+    // Parse a line of a signature file, returns false if it is not a valid signature
+    //
+    static bool ParseSignature(const std::string &line, PAYLOAD_SIGNATURE &signatureOut);
+
+    //
+    // Compile the signatures into an image, imageOut receives the whole image (header included)
+    //  A signature id is its index in signatures. Returns ATF_NO_DATA_AVAILABLE if there is no signature
+    //
+    ATF_ERROR CompileImage(const std::vector<PAYLOAD_SIGNATURE> &signatures, std::vector<std::byte> &imageOut);
+
+    //
+    // Returns the number of signatures in the last compiled image
+    //
+    size_t GetNumOfSignatures(void) const;
+
+private:
+    //
+    // Build the trie of the literals, with its states in breadth first order, their failure states and matches
+    //
+    static void buildAutomaton(const std::vector<PAYLOAD_SIGNATURE> &signatures, std::vector<TRIE_STATE> &statesOut);
+
+    //
+    // Transition of the automaton from a state, through the failure states
+    //
+    static uint32_t step(const std::vector<TRIE_STATE> &states, uint32_t state, uint8_t c);
+
+    //
+    // Fill the reach table of the prefilter
+    //
+    static void buildPrefilter(
+        const std::vector<PAYLOAD_SIGNATURE> &signatures,
+        uint32_t prefilterLength,
+        uint32_t domainBits,
+        std::vector<uint64_t> &reachOut
+    );
+
+    //
+    // Round up to PAYLOAD_SIG_ALIGNMENT
+    //
+    static size_t alignSize(size_t size);
+};
+
+//EOF
@@ -0,0 +1,187 @@
+#include <Windows.h>
+
+#include "policy_compiler.h"
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/policy_format.h"
+#include "../common/user_logging.h"
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+PolicyCompiler::Label PolicyCompiler::NewLabel(void)
+{
+    labelTargets.push_back(SIZE_MAX);
+    return labelTargets.size() - 1;
+}
+
+void PolicyCompiler::Bind(Label label)
+{
+    labelTargets[label] = insns.size();
+}
+
+void PolicyCompiler::EmitRet(ACTION_OPTS action)
+{
+    emit(POLICY_OP_RET, 0, (UINT32)action);
+}
+
+void PolicyCompiler::EmitRetRule(void)
+{
+    emit(POLICY_OP_RET_RULE, 0, 0);
+}
+
+void PolicyCompiler::EmitJump(Label target)
+{
+    addFixup(true, target);
+    emit(POLICY_OP_JA, 0, 0);
+}
+
+void PolicyCompiler::EmitTest(POLICY_OPCODE opcode, UINT8 arg, UINT32 k, Label onTrue, Label onFalse)
+{
+    addFixup(true, onTrue);
+    addFixup(false, onFalse);
+    emit(opcode, arg, k);
+}
+
+ATF_ERROR PolicyCompiler::Link(std::vector<POLICY_INSN> &programOut) const
+{
+    if (insns.empty() || insns.size() > POLICY_MAX_INSNS) {
+        LOG_ERROR("Policy of %d instructions, the maximum is %d", insns.size(), POLICY_MAX_INSNS);
+        return ATF_BAD_PARAMETERS;
+    }
+
+    programOut = insns;
+
+    for (const POLICY_FIXUP &fixup : fixups) {
+        const size_t target = labelTargets[fixup.label];
+        if (target == SIZE_MAX) {
+            LOG_ERROR("Policy instruction %d jumps to an unbound label", fixup.insnIndex);
+            return ATF_BAD_PARAMETERS;
+        }
+
+        if (target <= fixup.insnIndex || target >= insns.size() || target - fixup.insnIndex - 1 > UINT8_MAX) {
+            LOG_ERROR("Policy instruction %d cannot jump to %d", fixup.insnIndex, target);
+            return ATF_BAD_PARAMETERS;
+        }
+
+        const UINT8 offset = (UINT8)(target - fixup.insnIndex - 1);
+        if (fixup.isTrueBranch) {
+            programOut[fixup.insnIndex].jt = offset;
+        } else {
+            programOut[fixup.insnIndex].jf = offset;
+        }
+    }
+
+    return ATF_ERROR_OK;
+}
+
+ATF_ERROR PolicyCompiler::CompileFilterPolicy(const POLICY_OPTIONS &options, std::vector<POLICY_INSN> &programOut)
+{
+    PolicyCompiler compiler;
+
+    const Label pass = compiler.NewLabel();
+    const Label ruleMatch = compiler.NewLabel();
+    const Label ipv4Match = compiler.NewLabel();
+    const Label ipv6Match = compiler.NewLabel();
+    const Label dnsMatch = compiler.NewLabel();
+    const Label approximateMatch = compiler.NewLabel();
+
+    const bool searchIpv4 = options.ipv4BlocklistAction != ACTION_PASS || options.ipv6BlocklistAction != ACTION_PASS;
+    const bool searchIpv6 = options.ipv6BlocklistAction != ACTION_PASS;
+    const bool searchDns = options.dnsBlocklistAction != ACTION_PASS;
+
+    // The rules carry their own direction and action, and win over the blocklists
+    compiler.EmitTest(POLICY_OP_JRULE, 0, 0, ruleMatch, next);
+
+    if (!options.alertInbound) {
+        compiler.EmitTest(POLICY_OP_JDIRECTION, 0, RULE_DIRECTION_INBOUND, pass, next);
+    }
+
+    if (!options.alertOutbound) {
+        compiler.EmitTest(POLICY_OP_JDIRECTION, 0, RULE_DIRECTION_OUTBOUND, pass, next);
+    }
+
+    // The DNS cache is exact (no prefilter), and only ever holds remote addresses
+    if (searchDns) {
+        compiler.EmitTest(POLICY_OP_JSET, POLICY_SET_DNS_DOMAINS, POLICY_ADDRESS_REMOTE, dnsMatch, next);
+    }
+
+    //
+    // IPv4-mapped addresses of IPv6 flows take the IPv4 action, so the IPv4 blocklist is still searched when only
+    //  the IPv6 action is set, but only for IPv6 flows
+    //
+    if (searchIpv4) {
+        if (options.ipv4BlocklistAction == ACTION_PASS) {
+            compiler.EmitTest(POLICY_OP_JLAYER, 0, POLICY_LAYER_TRANSPORT_V6, next, pass);
+        }
+        compiler.EmitTest(POLICY_OP_JSET, POLICY_SET_IPV4_BLOCKLIST, POLICY_ADDRESS_ANY, ipv4Match, next);
+    }
+
+    if (searchIpv6) {
+        if (options.ipv4BlocklistAction != ACTION_PASS) {
+            compiler.EmitTest(POLICY_OP_JLAYER, 0, POLICY_LAYER_TRANSPORT_V6, next, pass);
+        }
+        compiler.EmitTest(POLICY_OP_JSET, POLICY_SET_IPV6_BLOCKLIST, POLICY_ADDRESS_ANY, ipv6Match, next);
+    }
+
+    compiler.Bind(pass);
+    compiler.EmitRet(ACTION_PASS);
+
+    compiler.Bind(ruleMatch);
+    compiler.EmitRetRule();
+
+    if (searchDns) {
+        compiler.Bind(dnsMatch);
+        compiler.EmitRet(options.dnsBlocklistAction);
+    }
+
+    if (searchIpv4) {
+        compiler.Bind(ipv4Match);
+
+        // A prefilter match may be a false positive, it is alerted on rather than blocked
+        if (options.ipv4BlocklistAction == ACTION_BLOCK) {
+            compiler.EmitTest(POLICY_OP_JAPPROXIMATE, 0, 0, approximateMatch, next);
+        }
+        compiler.EmitRet(options.ipv4BlocklistAction);
+    }
+
+    if (searchIpv6) {
+        compiler.Bind(ipv6Match);
+        compiler.EmitRet(options.ipv6BlocklistAction);
+    }
+
+    if (searchIpv4 && options.ipv4BlocklistAction == ACTION_BLOCK) {
+        compiler.Bind(approximateMatch);
+        compiler.EmitRet(ACTION_ALERT);
+    }
+
+    return compiler.Link(programOut);
+}
+
+void PolicyCompiler::emit(POLICY_OPCODE opcode, UINT8 arg, UINT32 k)
+{
+    POLICY_INSN insn = { 0 };
+    insn.opcode = (UINT8)opcode;
+    insn.arg = arg;
+    insn.k = k;
+
+    insns.push_back(insn);
+}
+
+void PolicyCompiler::addFixup(bool isTrueBranch, Label label)
+{
+    if (label == next) {
+        return;
+    }
+
+    POLICY_FIXUP fixup;
+    fixup.insnIndex = insns.size();
+    fixup.isTrueBranch = isTrueBranch;
+    fixup.label = label;
+
+    fixups.push_back(fixup);
+}
+
+//EOF
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "../common/errors.h"
+#include "../common/user_driver_transport.h"
+#include "../common/policy_format.h"
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//
+// Ini switches the filter policy is compiled from
+//
+typedef struct _policy_options {
+    bool                                        alertInbound;
+    bool                                        alertOutbound;
+    ACTION_OPTS                                 ipv4BlocklistAction;
+    ACTION_OPTS                                 ipv6BlocklistAction;
+    ACTION_OPTS                                 dnsBlocklistAction;
+} POLICY_OPTIONS, *PPOLICY_OPTIONS;
+
+//
+// Assembler for verdict policy programs (see policy_format.h)
+//
+//  Tests branch to labels, which are bound to the next emitted instruction. Link() resolves them into the jt and jf
+//   offsets, and fails if a jump goes backward or further than an offset can encode. The driver verifies the program
+//   again, the compiler only makes sure the service never sends one it would reject.
+//
+class PolicyCompiler {
+public:
+    typedef size_t Label;
+
+    // Branch target of the instruction that follows
+    static constexpr Label next = SIZE_MAX;
+
+private:
+    typedef struct _policy_fixup {
+        size_t                                  insnIndex;
+        bool                                    isTrueBranch;
+        Label                                   label;
+    } POLICY_FIXUP;
+
+    std::vector<POLICY_INSN>                    insns;
+
+    // Instruction index of each label, SIZE_MAX until it is bound
+    std::vector<size_t>                         labelTargets;
+
+    std::vector<POLICY_FIXUP>                   fixups;
+
+public:
+    PolicyCompiler(void)
+    {
+
+    }
+
+    ~PolicyCompiler(void)
+    {
+
+    }
+
+    Label NewLabel(void);
+
+    //
+    // Point a label at the next emitted instruction
+    //
+    void Bind(Label label);
+
+    void EmitRet(ACTION_OPTS action);
+    void EmitRetRule(void);
+    void EmitJump(Label target);
+
+    //
+    // Emit a test instruction (POLICY_OP_J*) branching to onTrue or onFalse
+    //
+    void EmitTest(POLICY_OPCODE opcode, UINT8 arg, UINT32 k, Label onTrue, Label onFalse);
+
+    //
+    // Resolve the labels into the program
+    //  Returns ATF_BAD_PARAMETERS if a label is unbound, a jump cannot be encoded or the program is too long
+    //
+    ATF_ERROR Link(std::vector<POLICY_INSN> &programOut) const;
+
+    //
+    // Compile the filter policy of the ini: 5-tuple rules first, then the directions that are not alerted on are
+    //  passed, then the addresses resolved from the domain blocklist, then the IPv4 and IPv6 blocklists are searched
+    //  with their action
+    //
+    static ATF_ERROR CompileFilterPolicy(const POLICY_OPTIONS &options, std::vector<POLICY_INSN> &programOut);
+
+private:
+    void emit(POLICY_OPCODE opcode, UINT8 arg, UINT32 k);
+    void addFixup(bool isTrueBranch, Label label);
+};
+
+//EOF
@@ -0,0 +1,88 @@
+#if _MSC_VER > 1000
+#pragma once
+#endif //_MSC_VER > 1000
+
+#include "ipv4_image_format.h"
+
+//
+// Relocatable domain blocklist image
+//  Compiled by the service (domain_dafsa_builder.cpp) from the domain blocklists, sent through a bulk upload session
+//  (BULK_PAYLOAD_DOMAIN_IMAGE), and adopted as is by the driver (domain_dafsa.c).
+//
+//  The domains are stored as a minimised DAFSA (deterministic acyclic finite state automaton) over their reversed
+//   labels: www.example.com is the string "com.example.www". Names under the same TLD and domain share a prefix, and
+//   minimisation also merges the states of identical tails (i.e. every name ends in the same final state), so the
+//   automaton is much smaller than a trie of the same names. A name is looked up by walking its labels from the last
+//   one, one transition per byte, and a final state reached at a label boundary is a listed domain covering the name:
+//   example.com also matches a.b.example.com, but not badexample.com.
+//
+//  The states are serialized as a byte stream of nodes, a node is referenced by its offset in the stream:
+//
+//   [DOMAIN_DAFSA_HEADER][nodes][padding]
+//
+//   Branch node:  [flags][numOfEdges][char x numOfEdges][target x numOfEdges]
+//                  flags is DOMAIN_DAFSA_NODE_FINAL or 0, the chars are in ascending order, and a target is the offset
+//                  of the node reached through the char (offsetWidth bytes, little endian)
+//   Chain node:   [DOMAIN_DAFSA_NODE_CHAIN | length][char x length]
+//                  A run of non-final states with a single transition each, collapsed into one node. The node reached
+//                  after the last char is the next one in the stream, or with DOMAIN_DAFSA_NODE_JUMP, the target that
+//                  follows the chars
+//
+//  The root is the node at offset 0. Every edge consumes one byte of the name, so a walk ends after at most
+//   DOMAIN_DAFSA_MAX_NAME_LENGTH steps whatever the image holds. The image size is a multiple of
+//   DOMAIN_DAFSA_ALIGNMENT bytes, and the checksum (AtfIpv4ImageChecksum) covers everything after the header.
+//
+#define DOMAIN_DAFSA_MAGIC                                  0x3af3bbcf
+#define DOMAIN_DAFSA_VERSION                                1
+#define DOMAIN_DAFSA_ALIGNMENT                              IPV4_IMAGE_ALIGNMENT
+
+// Longest name (without the trailing dot) and label, as in DNS
+#define DOMAIN_DAFSA_MAX_NAME_LENGTH                        253
+#define DOMAIN_DAFSA_MAX_LABEL_LENGTH                       63
+
+// Node flags, the first byte of a node
+#define DOMAIN_DAFSA_NODE_FINAL                             0x01
+#define DOMAIN_DAFSA_NODE_JUMP                              0x40
+#define DOMAIN_DAFSA_NODE_CHAIN                             0x80
+#define DOMAIN_DAFSA_CHAIN_LENGTH_MASK                      0x3f
+
+// Bytes of a node offset, 3 for streams up to 16MB
+#define DOMAIN_DAFSA_MIN_OFFSET_WIDTH                       3
+#define DOMAIN_DAFSA_MAX_OFFSET_WIDTH                       4
+
+// Chars of the automaton, printable ASCII. Names are lowercased by the service, and by the driver before a lookup
+#define DOMAIN_DAFSA_MIN_CHAR                               0x21
+#define DOMAIN_DAFSA_MAX_CHAR                               0x7e
+#define DOMAIN_DAFSA_LABEL_SEPARATOR                        '.'
+
+#pragma pack(push, 1)
+typedef struct _domain_dafsa_header {
+    UINT32                                                  magic;
+    UINT32                                                  version;
+
+    // Size of this header, and of the whole image (header included), in bytes
+    UINT32                                                  headerSize;
+    UINT32                                                  flags;
+    UINT64                                                  imageSize;
+
+    // Checksum of the image after the header (AtfIpv4ImageChecksum)
+    UINT64                                                  checksum;
+
+    // Number of distinct domains compiled into the image, after the domains covered by another one are dropped
+    UINT64                                                  numOfDomains;
+
+    // States of the minimised automaton, and the nodes they are serialized into
+    UINT64                                                  numOfStates;
+    UINT64                                                  numOfNodes;
+
+    // Node stream, the offset is from the start of the image
+    UINT64                                                  nodesOffset;
+    UINT64                                                  nodesSize;
+
+    // Bytes of a node offset (DOMAIN_DAFSA_MIN_OFFSET_WIDTH to DOMAIN_DAFSA_MAX_OFFSET_WIDTH)
+    UINT32                                                  offsetWidth;
+    UINT32                                                  reserved;
+} DOMAIN_DAFSA_HEADER, *PDOMAIN_DAFSA_HEADER;
+#pragma pack(pop)
+
+//EOF
@@ -20,6 +20,8 @@ typedef unsigned int ATF_ERROR;
 #define ATF_NO_DATA_AVAILABLE                   0x0000000d
 #define ATF_DEVICE_NOT_CONNECTED                0x0000000e
 #define ATF_BAD_DATA                            0x0000000f
+#define ATF_BULK_PAYLOAD_TOO_LARGE              0x00000010
+#define ATF_PREFILTER_BUILD                     0x00000011
 
 //
 // ATF INI parser errors                        
@@ -38,6 +40,8 @@ typedef unsigned int ATF_ERROR;
 #define ATF_CORRUPT_CONFIG                      0x10000002
 #define ATF_NO_MEMORY_AVAILABLE                 0x10000003
 #define ATF_IOCTL_BUFFER_TOO_LARGE              0x10000004
+#define ATF_CORRUPT_IMAGE                       0x10000005
+#define ATF_MEMORY_BUDGET_EXCEEDED              0x10000006
 
 //
 // WFP signals
@@ -27,7 +27,8 @@
 
 //
 // Flush the WFP configuration
-//  Flushes the config. Note: the WFP service can be running while updating or flushing the config
+//  Flushes the config. Note: the WFP service must be stopped to flush the config, but can be running while 
+//  updating it
 //
 #define IOCTL_ATF_FLUSH_CONFIG \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
@@ -45,7 +46,8 @@
 //  This call will send an array of ipv4 addresses to be blacklisted by the filter. The IPs are supplied
 //  by a blacklist from a DNSBL or IP blocklist, and sent in big-endian format to the filter device.
 // 
-// Note: The WFP service must be stopped (IOCTL_ATF_WFP_SERVICE_STOP) before this call can succeed
+// Note: The WFP service can be running. The driver builds a new config with the IPs appended, and swaps it
+//  in atomically, so every call rebuilds the lookup engine. Large lists should use the bulk upload session
 // 
 // Note: this call can be invoked multiple times, if the blacklist is too large, each subsequent call will
 //  append IPs into the driver's memory until complete. From there, to start the engine, call on
@@ -54,11 +56,59 @@
 // Note: Before this call can succeed, a default config must be set, so IOCTL_ATF_SEND_WFP_CONFIG
 //  needs to be called.
 // 
-// If there exists a running filter.c version, then the service must be stopped, config must be flushed,
-//  (IOCTL_ATF_FLUSH_CONFIG), new config added, new blacklist IPs added, and service must be started
-//  (IOCTL_ATF_WFP_SERVICE_START)
+// To replace the blacklist entirely, send a new config (IOCTL_ATF_SEND_WFP_CONFIG) and then the new blacklist IPs
 //
 #define IOCTL_ATF_APPEND_IPV4_BLACKLIST \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
 
+//
+// Bulk upload session
+//  Large payloads (i.e. an online blocklist with millions of entries) are sent in a single session, rather than
+//  in BLACKLIST_IPV4_MAX_SIZE chunks:
+// 
+//   1. IOCTL_ATF_BULK_UPLOAD_BEGIN with a BULK_UPLOAD_BEGIN buffer. The driver allocates a staging buffer
+//       for the whole payload. A session that is already open is discarded
+//   2. IOCTL_ATF_BULK_UPLOAD_DATA with a BULK_UPLOAD_DATA input buffer, and the payload as the output buffer
+//       (METHOD_IN_DIRECT, so the payload is not copied by the I/O manager). Up to BULK_UPLOAD_MAX_TRANSFER_SIZE
+//       bytes per call, in order, until the whole payload is sent
+//   3. IOCTL_ATF_BULK_UPLOAD_COMMIT without a buffer. The driver verifies that the whole payload was received,
+//       and applies it to the config in one pass. A BULK_PAYLOAD_IPV4_IMAGE payload (ipv4_image_format.h) replaces
+//       the previous image, and is rejected with STATUS_BAD_DATA if it fails validation. A BULK_PAYLOAD_IPV4_DELTA
+//       payload is applied like IOCTL_ATF_APPLY_IPV4_DELTA.
+//       A BULK_PAYLOAD_IPV6_BLOCKLIST payload is appended to the IPv6 blocklist, which is otherwise limited to the
+//       MAX_IPV6_ADDRESSES_BLACKLIST entries of the default config. A BULK_PAYLOAD_IPV4_RULES payload replaces the
+//       5-tuple rules, and is rejected with STATUS_BAD_DATA if a rule is invalid or the rules do not compile.
+//       A BULK_PAYLOAD_DOMAIN_IMAGE payload (domain_dafsa_format.h) replaces the domain blocklist, and is rejected
+//       with STATUS_BAD_DATA if it fails validation. A BULK_PAYLOAD_SIGNATURE_IMAGE payload (payload_sig_format.h)
+//       replaces the payload signatures, and is rejected with STATUS_BAD_DATA if it fails validation
+// 
+// The same rules as IOCTL_ATF_APPEND_IPV4_BLACKLIST apply: a default config must exist, WFP may be running.
+//  IOCTL_ATF_FLUSH_CONFIG and IOCTL_ATF_SEND_WFP_CONFIG discard any open session
+//
+#define IOCTL_ATF_BULK_UPLOAD_BEGIN \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+#define IOCTL_ATF_BULK_UPLOAD_DATA \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+
+#define IOCTL_ATF_BULK_UPLOAD_COMMIT \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+//
+// Apply an IPv4 blocklist delta
+//  Sends the changes between the blocklist last sent and a refreshed one, as an IPV4_DELTA_HEADER followed by the
+//  prefixes to remove and the prefixes to add (see user_driver_transport.h). The driver removes the prefixes from
+//  the lookup engine, reclaiming the memory they used, then inserts the additions. The work done is proportional
+//  to the size of the delta rather than the size of the blocklist.
+// 
+// Note: up to IPV4_DELTA_MAX_SIZE bytes per call, larger deltas are sent through a bulk upload session
+//  (BULK_PAYLOAD_IPV4_DELTA). A delta that fails validation is rejected with STATUS_BAD_DATA, and the config
+//  is left unchanged
+// 
+// Note: the same rules as IOCTL_ATF_APPEND_IPV4_BLACKLIST apply: a default config must exist, WFP may be running.
+//  The lookup image (IPV4_ENGINE_TRIE) is not affected, the service sends a new image instead
+//
+#define IOCTL_ATF_APPLY_IPV4_DELTA \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
 //EOF
\ No newline at end of file
@@ -0,0 +1,151 @@
+#if _MSC_VER > 1000
+#pragma once
+#endif //_MSC_VER > 1000
+
+//
+// Relocatable IPv4 lookup image
+//  Compiled by the service (ipv4_image_builder.cpp) from the complete IPv4 blocklist, sent through a bulk upload
+//  session (BULK_PAYLOAD_IPV4_IMAGE), and adopted as is by the driver (ipv4_image.c).
+//
+//  The image is the same bitmap-compressed trie as ipv4_trie.h, but links are indexes rather than pointers, so
+//   the image is valid at any address and the driver does no per-node work besides validation:
+//
+//   [IPV4_IMAGE_HEADER][IPV4_IMAGE_NODE x numOfNodes][IPV4_TRIE_LEAF (UINT8) x numOfLeaves][padding]
+//   [IPV4_IMAGE_FINGERPRINT x filterArrayLength][padding] (optional)
+//
+//  Nodes are stored breadth-first and the root is node 0. The children of a node are contiguous, starting at
+//   childrenIndex, and its leaves are contiguous in the leaf array, starting at leavesIndex. As in ipv4_trie.h,
+//   the rank of an octet in the bitmap is its index among the children (or leaves), and a leaf holds the longest
+//   prefix length covering it.
+//
+//  The image size is a multiple of 8 bytes, and the checksum covers everything after the header.
+//
+//  Optionally (IPV4_IMAGE_FLAG_PREFILTER), the image also holds a binary fuse filter over its leaves, after the
+//   leaf array. The filter answers "definitely not in the blocklist" for most addresses with three independent
+//   byte loads per trie level in use, so a miss does not walk the nodes at all. A filter key is a leaf: its level,
+//   and the address bits down to that level (i.e. a /20 prefix is the 16 level 2 keys it expands to).
+//   8-bit fingerprints give about 9 bits per key and a false positive rate of about 1/256 per probed level.
+//
+//  An image built with IPV4_IMAGE_FLAG_PREFILTER_ONLY has no nodes or leaves, only the filter. It is meant for
+//   feeds too large to hold as a trie, and since a filter hit may be a false positive, the driver only ever
+//   alerts on it, regardless of the configured action.
+//
+#define IPV4_IMAGE_MAGIC                                    0x3af3bbce
+#define IPV4_IMAGE_VERSION                                  2
+
+// Header flags
+#define IPV4_IMAGE_FLAG_PREFILTER                           0x00000001
+#define IPV4_IMAGE_FLAG_PREFILTER_ONLY                      0x00000002
+
+// Fingerprint type of the prefilter, and the largest segment of the filter
+typedef UINT8                                               IPV4_IMAGE_FINGERPRINT;
+#define IPV4_IMAGE_FILTER_MAX_SEGMENT_LENGTH                (1UL << 18)
+#define IPV4_IMAGE_ALIGNMENT                                8
+
+// Bitmap words per node, must match IPV4_TRIE_BITMAP_WORDS
+#define IPV4_IMAGE_BITMAP_WORDS                             4
+
+// Checksum seed and multiplier (FNV-1a, applied to 64-bit words)
+#define IPV4_IMAGE_CHECKSUM_SEED                            0xcbf29ce484222325ULL
+#define IPV4_IMAGE_CHECKSUM_PRIME                           0x00000100000001b3ULL
+
+#pragma pack(push, 1)
+typedef struct _ipv4_image_header {
+    UINT32                                                  magic;
+    UINT32                                                  version;
+
+    // Size of this header, and of the whole image (header included), in bytes
+    UINT32                                                  headerSize;
+    UINT32                                                  flags;
+    UINT64                                                  imageSize;
+
+    // Checksum of the image after the header (AtfIpv4ImageChecksum)
+    UINT64                                                  checksum;
+
+    // Number of distinct prefixes compiled into the image
+    UINT64                                                  numOfPrefixes;
+
+    // Node array and leaf array, offsets are from the start of the image
+    UINT64                                                  nodesOffset;
+    UINT64                                                  numOfNodes;
+    UINT64                                                  leavesOffset;
+    UINT64                                                  numOfLeaves;
+
+    // Prefilter (only with IPV4_IMAGE_FLAG_PREFILTER), filterArrayLength fingerprints starting at filterOffset
+    UINT64                                                  filterOffset;
+    UINT64                                                  filterSeed;
+    UINT32                                                  filterSegmentLength;
+    UINT32                                                  filterSegmentCountLength;
+    UINT32                                                  filterArrayLength;
+
+    // Bit n is set if level n holds any leaf, only those levels are probed
+    UINT32                                                  filterLevelMask;
+} IPV4_IMAGE_HEADER, *PIPV4_IMAGE_HEADER;
+
+typedef struct _ipv4_image_node {
+    UINT64                                                  childBitmap[IPV4_IMAGE_BITMAP_WORDS];
+    UINT64                                                  leafBitmap[IPV4_IMAGE_BITMAP_WORDS];
+
+    // Index of the first child in the node array, and of the first leaf in the leaf array
+    UINT32                                                  childrenIndex;
+    UINT32                                                  leavesIndex;
+} IPV4_IMAGE_NODE, *PIPV4_IMAGE_NODE;
+#pragma pack(pop)
+
+//
+// Checksum of an IPV4_IMAGE_ALIGNMENT aligned buffer, size must be a multiple of IPV4_IMAGE_ALIGNMENT
+//
+static __inline UINT64 AtfIpv4ImageChecksum(const VOID *data, UINT64 size)
+{
+    const UINT64 *words = (const UINT64 *)data;
+    UINT64 checksum = IPV4_IMAGE_CHECKSUM_SEED;
+
+    for (UINT64 i = 0; i < size / sizeof(UINT64); i++) {
+        checksum ^= words[i];
+        checksum *= IPV4_IMAGE_CHECKSUM_PRIME;
+    }
+
+    return checksum;
+}
+
+//
+// Prefilter key of an address on a trie level (8 bits per level, the first octet is level 0)
+//
+static __inline UINT64 AtfIpv4ImageFilterKey(UINT32 address, UINT32 level)
+{
+    const UINT32 levelMask = 0xffffffffUL << ((3 - level) * 8);
+    return ((UINT64)level << 32) | (address & levelMask);
+}
+
+//
+// 64-bit mix of a prefilter key (murmur3 finalizer)
+//
+static __inline UINT64 AtfIpv4ImageFilterHash(UINT64 key, UINT64 seed)
+{
+    UINT64 h = key + seed;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static __inline IPV4_IMAGE_FINGERPRINT AtfIpv4ImageFilterFingerprint(UINT64 hash)
+{
+    return (IPV4_IMAGE_FINGERPRINT)(hash ^ (hash >> 32));
+}
+
+//
+// The three fingerprint slots of a hash, one in each of three consecutive segments
+//
+static __inline VOID AtfIpv4ImageFilterSlots(const IPV4_IMAGE_HEADER *header, UINT64 hash, UINT32 slots[3])
+{
+    const UINT32 segmentMask = header->filterSegmentLength - 1;
+
+    slots[0] = (UINT32)(((hash >> 32) * header->filterSegmentCountLength) >> 32);
+    slots[1] = (slots[0] + header->filterSegmentLength) ^ (UINT32)((hash >> 18) & segmentMask);
+    slots[2] = (slots[0] + 2 * header->filterSegmentLength) ^ (UINT32)(hash & segmentMask);
+}
+
+//EOF
@@ -0,0 +1,130 @@
+#if _MSC_VER > 1000
+#pragma once
+#endif //_MSC_VER > 1000
+
+#include "ipv4_image_format.h"
+
+//
+// Relocatable payload signature image
+//  Compiled by the service (payload_sig_builder.cpp) from the signature file, sent through a bulk upload session
+//  (BULK_PAYLOAD_SIGNATURE_IMAGE), and adopted as is by the driver (payload_sig.c).
+//
+//  A signature is a literal byte string, matched exactly (case-sensitive) anywhere in the payload of a stream. The
+//   image holds two structures built over the same literals:
+//
+//   - A prefilter: a bucketed shift-or over hashed bigrams. Every literal is put into one of 8 buckets, and only
+//     its first prefilterLength bytes are considered. For each of the prefilterLength - 1 bigrams of that prefix,
+//     at position k, the bit of its bucket is cleared in byte k (the lane) of the reach entry of its hash. The
+//     scanner keeps a 64 bit state shifted by one lane per byte and or-ed with the reach entry of the last bigram:
+//     a clear bit in lane prefilterLength - 2 means that every bigram of the prefix of a literal of that bucket was
+//     seen in order, the literal may start prefilterLength - 1 bytes back. The lanes above prefilterLength - 2 of
+//     a reach entry are clear, so that the scanner checks several bytes with one shift and one compare.
+//
+//   - An Aho-Corasick automaton, which confirms the candidates of the prefilter. The states are in breadth first
+//     order, so the root is state 0, a state is deeper than its failure state, and the failure state has a lower
+//     index. The root and the states with many transitions are dense: a row of PAYLOAD_SIG_ALPHABET_SIZE targets
+//     with the failure transitions resolved. Other states are sparse: their goto transitions, sorted by char, and a
+//     failure state to fall back to when the char has none.
+//
+//  The layout is:
+//
+//   [PAYLOAD_SIG_HEADER][states][edge targets][dense rows][reach][edge chars][names][padding]
+//
+//  Every section starts on a PAYLOAD_SIG_ALIGNMENT boundary. The image size is a multiple of PAYLOAD_SIG_ALIGNMENT
+//   bytes, and the checksum (AtfIpv4ImageChecksum) covers everything after the header.
+//
+#define PAYLOAD_SIG_MAGIC                                   0x3af3bbd0
+#define PAYLOAD_SIG_VERSION                                 1
+#define PAYLOAD_SIG_ALIGNMENT                               IPV4_IMAGE_ALIGNMENT
+
+// Literal lengths, the depth of a state is stored in a byte
+#define PAYLOAD_SIG_MIN_LITERAL_LENGTH                      4
+#define PAYLOAD_SIG_MAX_LITERAL_LENGTH                      255
+
+// Prefix of the literals seen by the prefilter, the scanner keeps the last PAYLOAD_SIG_MAX_PREFILTER_LENGTH - 1
+//  bytes of a stream to confirm a candidate that started in an earlier segment
+#define PAYLOAD_SIG_MIN_PREFILTER_LENGTH                    PAYLOAD_SIG_MIN_LITERAL_LENGTH
+#define PAYLOAD_SIG_MAX_PREFILTER_LENGTH                    6
+
+// Buckets of the prefilter, one bit of each lane
+#define PAYLOAD_SIG_NUM_OF_BUCKETS                          8
+
+// Bits of the bigram hash, the reach table has 1 << domainBits entries
+#define PAYLOAD_SIG_MIN_DOMAIN_BITS                         8
+#define PAYLOAD_SIG_MAX_DOMAIN_BITS                         16
+
+#define PAYLOAD_SIG_ALPHABET_SIZE                           256
+
+// Signature names, NULL terminated in a fixed size slot
+#define PAYLOAD_SIG_NAME_SIZE                               64
+
+#define PAYLOAD_SIG_MAX_SIGNATURES                          (1024 * 1024)
+#define PAYLOAD_SIG_MAX_STATES                              (64 * 1024 * 1024)
+
+// Signature id of a state that ends no literal, and result of a scan that found none
+#define PAYLOAD_SIG_NO_MATCH                                0xffffffff
+
+// State flags
+#define PAYLOAD_SIG_STATE_DENSE                             0x01
+
+#pragma pack(push, 1)
+typedef struct _payload_sig_header {
+    UINT32                                                  magic;
+    UINT32                                                  version;
+
+    // Size of this header, and of the whole image (header included), in bytes
+    UINT32                                                  headerSize;
+    UINT32                                                  flags;
+    UINT64                                                  imageSize;
+
+    // Checksum of the image after the header (AtfIpv4ImageChecksum)
+    UINT64                                                  checksum;
+
+    UINT32                                                  numOfSignatures;
+    UINT32                                                  numOfStates;
+    UINT32                                                  numOfEdges;
+    UINT32                                                  numOfDenseStates;
+
+    // Prefilter parameters (PAYLOAD_SIG_MIN_PREFILTER_LENGTH to PAYLOAD_SIG_MAX_PREFILTER_LENGTH, no longer than
+    //  the shortest literal, and PAYLOAD_SIG_MIN_DOMAIN_BITS to PAYLOAD_SIG_MAX_DOMAIN_BITS)
+    UINT32                                                  prefilterLength;
+    UINT32                                                  domainBits;
+
+    // Sections, the offsets are from the start of the image
+    UINT64                                                  statesOffset;           // PAYLOAD_SIG_STATE x numOfStates
+    UINT64                                                  edgeTargetsOffset;      // UINT32 x numOfEdges
+    UINT64                                                  denseOffset;            // UINT32 x PAYLOAD_SIG_ALPHABET_SIZE x numOfDenseStates
+    UINT64                                                  reachOffset;            // UINT64 x (1 << domainBits)
+    UINT64                                                  edgeCharsOffset;        // UINT8 x numOfEdges
+    UINT64                                                  namesOffset;            // CHAR x PAYLOAD_SIG_NAME_SIZE x numOfSignatures
+} PAYLOAD_SIG_HEADER, *PPAYLOAD_SIG_HEADER;
+
+typedef struct _payload_sig_state {
+    // Failure state, lower than the state itself (the root fails to itself)
+    UINT32                                                  fail;
+
+    // Signature whose literal ends at the state (the lowest id if several share the literal), or else the match of
+    //  the failure state: a literal that is a suffix of the string of the state. PAYLOAD_SIG_NO_MATCH if none
+    UINT32                                                  match;
+
+    // Dense state: index of its row. Sparse state: index of its first edge, in both edge sections
+    UINT32                                                  edges;
+
+    UINT16                                                  numOfEdges;
+
+    // Length of the string the state stands for
+    UINT8                                                   depth;
+    UINT8                                                   flags;
+} PAYLOAD_SIG_STATE, *PPAYLOAD_SIG_STATE;
+#pragma pack(pop)
+
+//
+// Hash of the bigram of two consecutive bytes, shared by the builder and the scanner. With
+//  PAYLOAD_SIG_MAX_DOMAIN_BITS it is the bigram itself, with fewer bits the high bits of the second byte are dropped
+//
+static __inline UINT32 AtfPayloadSigBigramHash(UINT8 first, UINT8 second, UINT32 domainBits)
+{
+    return ((UINT32)first | ((UINT32)second << 8)) & ((1UL << domainBits) - 1);
+}
+
+//EOF
@@ -0,0 +1,82 @@
+#if _MSC_VER > 1000
+#pragma once
+#endif //_MSC_VER > 1000
+
+//
+// Verdict policy bytecode
+//  Compiled by the service (policy_compiler.cpp) from the ini, sent with the default config
+//  (USER_DRIVER_FILTER_TRANSPORT_DATA), verified when the config is created and run by the driver (policy.c) on
+//  every flow of the IPv4 and IPv6 transport layers.
+//
+//  A program is an array of fixed-size instructions, in the style of classic BPF. Test instructions branch on a
+//   property of the flow, jt and jf are the number of instructions skipped when the test is true or false (0 is the
+//   next instruction). A return instruction ends the program with a verdict (ACTION_OPTS).
+//
+//  Jumps only go forward, so every program terminates in at most numOfInsns steps. The driver rejects a program
+//   with an unknown opcode, an operand out of range, or a path that runs past the last instruction without a
+//   return. POLICY_OP_RET_RULE and POLICY_OP_JAPPROXIMATE read the result of an earlier test, and must only be
+//   reachable through the true branch of a POLICY_OP_JRULE or POLICY_OP_JSET respectively.
+//
+//  Lookups (POLICY_OP_JSET, POLICY_OP_JRULE) are only done when they are reached, so a program that returns early
+//   (i.e. on a direction that is not filtered) does not search the blocklists.
+//
+#define POLICY_MAX_INSNS                                    256
+
+//
+// Opcodes
+//
+typedef enum {
+    POLICY_OP_RET,          // Return k (ACTION_OPTS)
+    POLICY_OP_RET_RULE,     // Return the action of the rule matched by POLICY_OP_JRULE
+    POLICY_OP_JA,           // Skip jt instructions
+    POLICY_OP_JLAYER,       // Flow layer == k (POLICY_LAYER_*)
+    POLICY_OP_JDIRECTION,   // Flow direction == k (RULE_DIRECTION_INBOUND or RULE_DIRECTION_OUTBOUND)
+    POLICY_OP_JPROTOCOL,    // Flow IP protocol == k
+    POLICY_OP_JLOCAL_PORT,  // Local port within [k & 0xffff, k >> 16]
+    POLICY_OP_JREMOTE_PORT, // Remote port within [k & 0xffff, k >> 16]
+    POLICY_OP_JSET,         // One of the addresses selected by k (POLICY_ADDRESS_*) is in set arg (POLICY_SET_*)
+    POLICY_OP_JAPPROXIMATE, // The last POLICY_OP_JSET match came from a prefilter only, and may be a false positive
+    POLICY_OP_JRULE,        // A 5-tuple rule (IPV4_RULE_ENTRY) matches the flow
+    POLICY_OP_MAX
+} POLICY_OPCODE;
+
+//
+// Layers of a flow (POLICY_OP_JLAYER)
+//
+#define POLICY_LAYER_TRANSPORT_V4                           0
+#define POLICY_LAYER_TRANSPORT_V6                           1
+#define POLICY_NUM_OF_LAYERS                                2
+
+//
+// Address sets (POLICY_OP_JSET)
+//  IPv4-mapped addresses of IPv6 flows are searched in the IPv4 blocklist, other IPv6 addresses never match it.
+//  IPv4 flows never match the IPv6 blocklist
+//  POLICY_SET_DNS_DOMAINS holds the addresses that the DNS responses resolved a blocklisted domain to (dns_cache.h),
+//  of both families. A match is reported as a /32 (IPv4 flows) or /128 (IPv6 flows)
+//
+#define POLICY_SET_IPV4_BLOCKLIST                           0
+#define POLICY_SET_IPV6_BLOCKLIST                           1
+#define POLICY_SET_DNS_DOMAINS                              2
+#define POLICY_NUM_OF_SETS                                  3
+
+//
+// Addresses tested by POLICY_OP_JSET (bitmask). If both match, the remote address is reported
+//
+#define POLICY_ADDRESS_LOCAL                                0x1
+#define POLICY_ADDRESS_REMOTE                               0x2
+#define POLICY_ADDRESS_ANY                                  (POLICY_ADDRESS_LOCAL | POLICY_ADDRESS_REMOTE)
+
+// Port range operand of POLICY_OP_JLOCAL_PORT and POLICY_OP_JREMOTE_PORT
+#define POLICY_PORT_RANGE(low, high)                        ((UINT32)(low) | ((UINT32)(high) << 16))
+
+#pragma pack(push, 1)
+typedef struct _policy_insn {
+    UINT8                                                   opcode;
+    UINT8                                                   arg;
+    UINT8                                                   jt;
+    UINT8                                                   jf;
+    UINT32                                                  k;
+} POLICY_INSN, *PPOLICY_INSN;
+#pragma pack(pop)
+
+//EOF
@@ -201,6 +201,239 @@ inline bool ParseStringToIpv4(const std::string &ip, uint32_t &ipOut)
     return true;
 }
 
+//
+// Convert a string in CIDR notation (a.b.c.d/nn) to an IPv4 network address and prefix length
+//  A plain address (a.b.c.d) is returned as a /32. Host bits beyond the prefix length are cleared,
+//  and the address has the same byte order as ParseStringToIpv4
+//
+//  If it's not a valid address or prefix length (1-32), return false
+//
+inline bool ParseStringToIpv4Prefix(const std::string &cidr, uint32_t &ipOut, uint8_t &prefixLengthOut)
+{
+    static const uint32_t maxPrefixLength = 32;
+
+    ipOut = 0;
+    prefixLengthOut = 0;
+
+    const size_t slashOffset = cidr.find('/');
+
+    if (!ParseStringToIpv4(cidr.substr(0, slashOffset), ipOut)) {
+        return false;
+    }
+
+    uint32_t prefixLength = maxPrefixLength;
+    if (slashOffset != std::string::npos) {
+        const std::string prefixStr = cidr.substr(slashOffset + 1);
+
+        // The prefix length must be 1-2 digits, and within 1-32
+        if (prefixStr.size() == 0 || prefixStr.size() > 2 || !ConvertStringToInt(prefixStr, prefixLength)) {
+            return false;
+        }
+
+        if (prefixLength == 0 || prefixLength > maxPrefixLength) {
+            return false;
+        }
+    }
+
+    ipOut &= (uint32_t)(0xffffffffULL << (maxPrefixLength - prefixLength));
+    prefixLengthOut = (uint8_t)prefixLength;
+
+    return true;
+}
+
+//
+// Convert a string to an IPv6 address, in network byte order (as WFP supplies it)
+//  Accepts the compressed form (a single "::"), and an IPv4 dotted tail (i.e. ::ffff:10.0.0.1).
+//  Zone indexes (fe80::1%eth0) are not addresses and are rejected
+//
+//  The string is scanned once, without any allocation, since feeds are hundreds of thousands of lines
+//
+//  If it's not a valid address, return false
+//
+inline bool ParseStringToIpv6(const std::string &ip, std::array<uint8_t, 16> &ipOut)
+{
+    static const size_t maxIpv6StrLength = 45; // ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255
+    static const size_t maxGroups = 8;
+
+    ipOut.fill(0);
+
+    const size_t length = ip.size();
+    if (length < 2 || length > maxIpv6StrLength) {
+        return false;
+    }
+
+    uint16_t groups[maxGroups] = { 0 };
+    size_t numOfGroups = 0;
+    size_t compressOffset = maxGroups + 1;
+    size_t pos = 0;
+
+    if (ip[0] == ':') {
+        if (ip[1] != ':') {
+            return false;
+        }
+
+        compressOffset = 0;
+        pos = 2;
+    }
+
+    while (pos < length) {
+        if (numOfGroups == maxGroups) {
+            return false;
+        }
+
+        // Up to 4 hex digits per group
+        const size_t groupStart = pos;
+        uint32_t group = 0;
+        while (pos < length && pos - groupStart < 5) {
+            const char c = ip[pos];
+
+            uint32_t digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                digit = c - 'A' + 10;
+            } else {
+                break;
+            }
+
+            group = (group << 4) | digit;
+            pos++;
+        }
+
+        // The last 32 bits may be written as an IPv4 address
+        if (pos < length && ip[pos] == '.') {
+            if (numOfGroups > maxGroups - 2) {
+                return false;
+            }
+
+            uint32_t ipv4 = 0;
+            if (!ParseStringToIpv4(ip.substr(groupStart), ipv4)) {
+                return false;
+            }
+
+            groups[numOfGroups++] = (uint16_t)(ipv4 >> 16);
+            groups[numOfGroups++] = (uint16_t)ipv4;
+            pos = length;
+            break;
+        }
+
+        if (pos == groupStart || pos - groupStart > 4) {
+            return false;
+        }
+
+        groups[numOfGroups++] = (uint16_t)group;
+
+        if (pos == length) {
+            break;
+        }
+
+        if (ip[pos] != ':') {
+            return false;
+        }
+
+        pos++;
+
+        if (pos < length && ip[pos] == ':') {
+            if (compressOffset <= maxGroups) {
+                return false;
+            }
+
+            compressOffset = numOfGroups;
+            pos++;
+        } else if (pos == length) {
+            // Trailing single ':'
+            return false;
+        }
+    }
+
+    // Without "::" all 8 groups must be present, with it at least one group is zero
+    if (compressOffset > maxGroups) {
+        if (numOfGroups != maxGroups) {
+            return false;
+        }
+    } else if (numOfGroups == maxGroups) {
+        return false;
+    }
+
+    // Groups after the "::" are moved to the end, the gap is left zero
+    const size_t numOfTailGroups = compressOffset > maxGroups ? 0 : numOfGroups - compressOffset;
+    for (size_t i = 0; i < numOfGroups; i++) {
+        const size_t target = (i < numOfGroups - numOfTailGroups) ? i : maxGroups - (numOfGroups - i);
+
+        ipOut[target * 2] = (uint8_t)(groups[i] >> 8);
+        ipOut[target * 2 + 1] = (uint8_t)groups[i];
+    }
+
+    return true;
+}
+
+//
+// Convert a string in CIDR notation (a::b/nn) to an IPv6 network address and prefix length
+//  A plain address is returned as a /128. Host bits beyond the prefix length are cleared
+//
+//  If it's not a valid address or prefix length (1-128), return false
+//
+inline bool ParseStringToIpv6Prefix(const std::string &cidr, std::array<uint8_t, 16> &ipOut, uint8_t &prefixLengthOut)
+{
+    static const uint32_t maxPrefixLength = 128;
+
+    prefixLengthOut = 0;
+
+    const size_t slashOffset = cidr.find('/');
+
+    if (!ParseStringToIpv6(cidr.substr(0, slashOffset), ipOut)) {
+        return false;
+    }
+
+    uint32_t prefixLength = maxPrefixLength;
+    if (slashOffset != std::string::npos) {
+        const std::string prefixStr = cidr.substr(slashOffset + 1);
+
+        // The prefix length must be 1-3 digits, and within 1-128
+        if (prefixStr.size() == 0 || prefixStr.size() > 3 ||
+            prefixStr.find_first_not_of("0123456789") != std::string::npos || !ConvertStringToInt(prefixStr, prefixLength)) {
+            return false;
+        }
+
+        if (prefixLength == 0 || prefixLength > maxPrefixLength) {
+            return false;
+        }
+    }
+
+    for (uint32_t bit = prefixLength; bit < maxPrefixLength; bit++) {
+        ipOut[bit / 8] &= (uint8_t)~(0x80 >> (bit % 8));
+    }
+
+    prefixLengthOut = (uint8_t)prefixLength;
+
+    return true;
+}
+
+//
+// Returns the first token of a blocklist feed line, i.e. the address or subnet
+//  Leading whitespace is skipped, and the token ends at whitespace (including the \r of CRLF feeds)
+//  or at a ';' or '#' comment. Returns an empty string for blank and comment-only lines
+//
+inline std::string IsolateFirstToken(const std::string &line)
+{
+    static const char *whitespace = " \t\r\n";
+    static const char *terminators = " \t\r\n;#";
+
+    const size_t offset = line.find_first_not_of(whitespace);
+    if (offset == std::string::npos || line[offset] == ';' || line[offset] == '#') {
+        return "";
+    }
+
+    const size_t offsetEnd = line.find_first_of(terminators, offset);
+    if (offsetEnd == std::string::npos) {
+        return line.substr(offset);
+    }
+
+    return line.substr(offset, offsetEnd - offset);
+}
+
 //
 // Read a file into memory
 //  Return a 0 size vector if failed
@@ -4,6 +4,8 @@
 
 #include <inaddr.h>
 
+#include "policy_format.h"
+
 //
 // This header contains the transport configuration between usermode and kernelmode
 //  Includes structures, constants, and objects, that can be safely transported to the ATF driver
@@ -11,7 +13,9 @@
 
 //
 // When appending ipv4 blacklists, this will be the maximum size of the packet
-//  The addresses may be appended in subsequent calls
+//  The packet is an array of IPV4_PREFIX_ENTRY, which may be appended in subsequent calls
+//  Note: every call publishes a new config, and its first change to the lookup engine copies the engine as a whole
+//   (64MB or more for DIR-24-8). Large blocklists are sent through a bulk upload session, which publishes them once
 //
 #define BLACKLIST_IPV4_MAX_SIZE                             512
 
@@ -45,6 +49,51 @@ typedef _servicePort                                        SERVICE_PORT;
 #define MAX_IPV4_ADDRESSES_BLACKLIST                        512
 #define MAX_IPV6_ADDRESSES_BLACKLIST                        512
 
+//
+// IPv4 blocklist entry, a network address and its prefix length (CIDR notation)
+//  A single address is stored as a /32. Host bits beyond the prefix length are ignored by the driver
+//
+#define IPV4_PREFIX_MIN_LENGTH                              1
+#define IPV4_PREFIX_MAX_LENGTH                              32
+
+// Network mask for a prefix length, in the same byte order as the stored address
+#define IPV4_PREFIX_MASK(prefixLength) \
+    ((prefixLength) ? (UINT32)(0xffffffffUL << (IPV4_PREFIX_MAX_LENGTH - (prefixLength))) : 0)
+
+typedef struct _ipv4_prefix_entry {
+    struct in_addr                                          address;
+    UINT8                                                   prefixLength;
+    UINT8                                                   reserved[3];
+} IPV4_PREFIX_ENTRY, *PIPV4_PREFIX_ENTRY;
+
+//
+// IPv6 blocklist entry, a network address and its prefix length (CIDR notation)
+//  The address is in network byte order, as WFP supplies it. A single address is stored as a /128
+//
+#define IPV6_PREFIX_MIN_LENGTH                              1
+#define IPV6_PREFIX_MAX_LENGTH                              128
+
+typedef struct _ipv6_prefix_entry {
+    IPV6_RAW_ADDRESS                                        address;
+    UINT8                                                   prefixLength;
+    UINT8                                                   reserved[3];
+} IPV6_PREFIX_ENTRY, *PIPV6_PREFIX_ENTRY;
+
+//
+// IPv4-mapped IPv6 addresses (::ffff:a.b.c.d). These are IPv4 peers, so they are searched in the IPv4 blocklist, and
+//  mapped blocklist prefixes longer than IPV6_IPV4_MAPPED_PREFIX_LENGTH are stored there as well
+//
+#define IPV6_IPV4_MAPPED_PREFIX_LENGTH                      96
+
+#define IPV6_IS_IPV4_MAPPED(addr) \
+    (!(addr)->a.q.qword[0] && !(addr)->a.b.byte[8] && !(addr)->a.b.byte[9] && \
+     (addr)->a.b.byte[10] == 0xff && (addr)->a.b.byte[11] == 0xff)
+
+// IPv4 address of a mapped address, in the byte order of IPV4_PREFIX_ENTRY
+#define IPV6_GET_MAPPED_IPV4(addr) \
+    (((UINT32)(addr)->a.b.byte[12] << 24) | ((UINT32)(addr)->a.b.byte[13] << 16) | \
+     ((UINT32)(addr)->a.b.byte[14] << 8) | (UINT32)(addr)->a.b.byte[15])
+
 //
 // Structure to represent the transport buffer which configures ATF.
 //  Configured by the usermode service, through ini, and transported to the ATF driver which will then configure WFP
@@ -60,6 +109,24 @@ typedef enum {
     ACTION_ALERT        // Alert on blocklist
 } ACTION_OPTS;
 
+//
+// Lookup engine used for the IPv4 blocklist (see ini)
+//
+typedef enum {
+    IPV4_ENGINE_TRIE,   // Bitmap-compressed trie (ipv4_trie.c). Default value
+    IPV4_ENGINE_DIR24,  // DIR-24-8 flat table (ipv4_dir24.c), fastest but requires 64MB of non-paged memory
+    IPV4_ENGINE_CUCKOO, // Cuckoo hash set (ipv4_cuckoo.c), for blocklists of mostly individual (/32) addresses
+    IPV4_ENGINE_ROARING // Roaring-style container set (ipv4_roaring.c), for large or clustered blocklists
+} IPV4_LOOKUP_ENGINE;
+
+//
+// Answer given to a DNS query for a blocklisted domain, when dnsBlocklistAction is ACTION_BLOCK (see ini)
+//
+typedef enum {
+    DNS_BLOCK_NXDOMAIN,     // The name does not exist (NXDOMAIN). Default value
+    DNS_BLOCK_NULL_ADDRESS  // A queries are answered with 0.0.0.0 and AAAA queries with ::, others with no answer
+} DNS_BLOCK_RESPONSE;
+
 //
 // Primary struct sent via IOCTL to configure filter.c
 //
@@ -76,6 +143,17 @@ typedef struct _user_driver_filter_transport_data {
     BOOLEAN                                                 enableLayerIpv6TcpOutbound;
     BOOLEAN                                                 enableLayerIcmpv4;
 
+    // Inbound DNS responses (UDP/53) are snooped on the datagram layers, to block the connects to the addresses of
+    //  blocklisted domains (dnsBlocklistAction). The outbound queries for blocklisted domains are blocked there too
+    BOOLEAN                                                 enableLayerIpv4Dns;
+    BOOLEAN                                                 enableLayerIpv6Dns;
+
+    // The server name of the TLS ClientHello sent first on each outbound TCP flow is read on the stream layers, and
+    //  matched against the domain blocklist (dnsBlocklistAction). The payload of the TCP flows is scanned for the
+    //  payload signatures there too (payloadSignatureAction)
+    BOOLEAN                                                 enableLayerIpv4Tls;
+    BOOLEAN                                                 enableLayerIpv6Tls;
+
     //
     // Alert on direction
     //
@@ -89,15 +167,146 @@ typedef struct _user_driver_filter_transport_data {
     ACTION_OPTS                                             ipv6BlocklistAction;
     ACTION_OPTS                                             dnsBlocklistAction;
 
-    // Blacklist for all IPv6 addresses
+    // The DNS queries for blocklisted domains are dropped on the DNS layers, and answered with this response
+    DNS_BLOCK_RESPONSE                                      dnsBlockResponse;
+
+    // Action on a TCP flow whose payload matches a signature (BULK_PAYLOAD_SIGNATURE_IMAGE), on the stream layers
+    ACTION_OPTS                                             payloadSignatureAction;
+
+    //
+    // Lookup engine config
+    //
+    IPV4_LOOKUP_ENGINE                                      ipv4LookupEngine;
+
+    // Non-paged memory budget of the IPv4 engine and image, in bytes (0 for no limit). A blocklist that would
+    //  take the config over the budget is rejected
+    UINT64                                                  ipv4MemoryBudget;
+
+    // Size of the engine predicted by the service from the blocklists (0 if unknown), for the driver stats
+    UINT64                                                  ipv4PredictedSize;
+
+    // Verdict policy (policy_format.h) compiled from the actions and direction switches above, and the rules.
+    //  The driver decides every flow with it, the switches themselves are not used by the driver. The DNS queries
+    //  are not flows, they are decided by dnsBlocklistAction alone
+    UINT16                                                  numOfPolicyInsns;
+    POLICY_INSN                                             policy[POLICY_MAX_INSNS];
+
+    // Blacklist for all IPv6 addresses and subnets
     //  Note: the default config (ini) will only contain the manually entered addresses, so it will
-    //  never exceeed MAX_IPV4_ADDRESSES_BLACKLIST
-    // Additional blacklist addresses can be appeneded with a separate command
+    //  never exceeed MAX_IPV6_ADDRESSES_BLACKLIST
+    // Additional blacklist addresses can be appeneded with a bulk upload session (BULK_PAYLOAD_IPV6_BLOCKLIST)
     UINT16                                                  numOfIpv6Addresses;
-    IPV6_RAW_ADDRESS                                        ipv6Blacklist[MAX_IPV4_ADDRESSES_BLACKLIST];
+    IPV6_PREFIX_ENTRY                                       ipv6Blacklist[MAX_IPV6_ADDRESSES_BLACKLIST];
 
-    // Blacklist for all IPv4 addresses
+    // Blacklist for all IPv4 addresses and subnets
     UINT16                                                  numOfIpv4Addresses;
-    struct in_addr                                          ipv4BlackList[MAX_IPV6_ADDRESSES_BLACKLIST];
+    IPV4_PREFIX_ENTRY                                       ipv4BlackList[MAX_IPV4_ADDRESSES_BLACKLIST];
 } USER_DRIVER_FILTER_TRANSPORT_DATA, *PUSER_DRIVER_FILTER_TRANSPORT_DATA;
-#pragma pack(pop)
\ No newline at end of file
+#pragma pack(pop)
+
+//
+// Bulk upload session (IOCTL_ATF_BULK_UPLOAD_BEGIN/DATA/COMMIT, see ioctl_codes.h)
+//  Moves a large payload, such as a full online blocklist, to the driver in as few transfers as possible.
+//  The payload is staged by the driver and only applied to the config on commit
+//
+#define BULK_UPLOAD_MAGIC                                   0x3af3bbcd
+
+// Maximum size of a whole payload, and of a single IOCTL_ATF_BULK_UPLOAD_DATA transfer
+#define BULK_UPLOAD_MAX_SIZE                                (256 * 1024 * 1024)
+#define BULK_UPLOAD_MAX_TRANSFER_SIZE                       (16 * 1024 * 1024)
+
+//
+// Payload types that can be sent through a bulk upload session
+//
+typedef enum {
+    BULK_PAYLOAD_NONE,
+    BULK_PAYLOAD_IPV4_BLOCKLIST,    // Array of IPV4_PREFIX_ENTRY, appended to the current config
+    BULK_PAYLOAD_IPV4_IMAGE,        // Compiled lookup image (ipv4_image_format.h), replaces the image of the current config
+    BULK_PAYLOAD_IPV4_DELTA,        // IPV4_DELTA_HEADER and its entries, applied to the lookup engine of the current config
+    BULK_PAYLOAD_IPV6_BLOCKLIST,    // Array of IPV6_PREFIX_ENTRY, appended to the current config
+    BULK_PAYLOAD_IPV4_RULES,        // Array of IPV4_RULE_ENTRY in priority order, replaces the rules of the current config
+    BULK_PAYLOAD_DOMAIN_IMAGE,      // Compiled domain blocklist (domain_dafsa_format.h), replaces the domain blocklist of the current config
+    BULK_PAYLOAD_SIGNATURE_IMAGE    // Compiled payload signatures (payload_sig_format.h), replaces the signatures of the current config
+} BULK_PAYLOAD_TYPE;
+
+//
+// IPv4 blocklist delta (BULK_PAYLOAD_IPV4_DELTA), the difference between the blocklist last sent and the new one
+//  The header is followed by numOfRemovals, then numOfAdditions IPV4_PREFIX_ENTRY. The removals are applied first:
+//  a removal clears every address of the prefix, so the additions must also carry the prefixes that stay in the
+//  blocklist and overlap a removed one
+//
+#define IPV4_DELTA_MAGIC                                    0x3af3bbce
+
+// Maximum size of a delta sent with IOCTL_ATF_APPLY_IPV4_DELTA, rather than a bulk upload session. Each delta copies
+//  the lookup engine once (see BLACKLIST_IPV4_MAX_SIZE), so a feed update is sent as a single delta
+#define IPV4_DELTA_MAX_SIZE                                 (64 * 1024)
+
+#pragma pack(push, 1)
+//
+// Input buffer of IOCTL_ATF_BULK_UPLOAD_BEGIN
+//
+typedef struct _bulk_upload_begin {
+    UINT32                                                  magic;
+    BULK_PAYLOAD_TYPE                                       payloadType;
+
+    // Size of the whole payload, in bytes
+    UINT64                                                  totalSize;
+} BULK_UPLOAD_BEGIN, *PBULK_UPLOAD_BEGIN;
+
+//
+// Input buffer of IOCTL_ATF_BULK_UPLOAD_DATA, the payload data itself is the direct I/O buffer
+//
+typedef struct _bulk_upload_data {
+    // Offset of this transfer within the payload, transfers must be sequential
+    UINT64                                                  offset;
+} BULK_UPLOAD_DATA, *PBULK_UPLOAD_DATA;
+
+typedef struct _ipv4_delta_header {
+    UINT32                                                  magic;
+    UINT32                                                  numOfRemovals;
+    UINT32                                                  numOfAdditions;
+    UINT32                                                  reserved;
+} IPV4_DELTA_HEADER, *PIPV4_DELTA_HEADER;
+#pragma pack(pop)
+
+//
+// IPv4 5-tuple rules (BULK_PAYLOAD_IPV4_RULES), from the [rule.*] sections of the ini
+//  Rules are sent in priority order and the first rule matching a flow decides its action, before the blocklist is
+//  searched. Addresses and ports are in host byte order. A prefix length of 0 matches any address, the port range
+//  0-65535 any port
+//
+#define IPV4_RULES_MAX_ENTRIES                              65536
+
+typedef enum {
+    RULE_DIRECTION_ANY,
+    RULE_DIRECTION_INBOUND,
+    RULE_DIRECTION_OUTBOUND
+} RULE_DIRECTION;
+
+// IP protocol numbers, only TCP and UDP flows are classified
+#define RULE_PROTOCOL_ANY                                   0
+#define RULE_PROTOCOL_TCP                                   6
+#define RULE_PROTOCOL_UDP                                   17
+
+#pragma pack(push, 1)
+typedef struct _ipv4_rule_entry {
+    struct in_addr                                          localAddress;
+    struct in_addr                                          remoteAddress;
+    UINT8                                                   localPrefixLength;
+    UINT8                                                   remotePrefixLength;
+
+    // Inclusive port ranges
+    SERVICE_PORT                                            localPortLow;
+    SERVICE_PORT                                            localPortHigh;
+    SERVICE_PORT                                            remotePortLow;
+    SERVICE_PORT                                            remotePortHigh;
+
+    UINT8                                                   protocol;
+    UINT8                                                   direction;
+    UINT8                                                   action;
+    UINT8                                                   reserved;
+
+    // Logged by the driver when the rule matches, the service logs the ids of the ini rules
+    UINT32                                                  ruleId;
+} IPV4_RULE_ENTRY, *PIPV4_RULE_ENTRY;
+#pragma pack(pop)
@@ -0,0 +1,155 @@
+#include "harness.h"
+
+#include <cstring>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_trie.h"
+}
+
+//
+// Arena allocator (mem.c), and the trie built on it (ipv4_trie.c)
+//
+
+extern "C" uint64_t gStubPoolAllocations;
+
+static bool HarnessIsZero(const VOID *p, size_t size)
+{
+    const UINT8 *bytes = (const UINT8 *)p;
+    for (size_t i = 0; i < size; i++) {
+        if (bytes[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+HARNESS_TEST(arena_alloc_free_and_release)
+{
+    ATF_ARENA arena;
+    AtfArenaInit(&arena);
+
+    HARNESS_CHECK(!AtfArenaAlloc(&arena, 0));
+    HARNESS_CHECK(arena.numOfChunks == 0);
+
+    // Size classes are powers of two, from ATF_ARENA_MIN_BLOCK_SIZE
+    HARNESS_CHECK(AtfArenaBlockSize(1) == ATF_ARENA_MIN_BLOCK_SIZE);
+    HARNESS_CHECK(AtfArenaBlockSize(17) == 32);
+    HARNESS_CHECK(AtfArenaBlockSize(ATF_ARENA_MAX_BLOCK_SIZE) == ATF_ARENA_MAX_BLOCK_SIZE);
+    HARNESS_CHECK(AtfArenaBlockSize(ATF_ARENA_MAX_BLOCK_SIZE + 1) == ATF_ARENA_MAX_BLOCK_SIZE + 16);
+
+    // Blocks are zeroed, aligned and carved from a single chunk
+    std::vector<UINT8 *> blocks;
+    for (size_t size = 1; size <= 4096; size *= 3) {
+        UINT8 *block = (UINT8 *)AtfArenaAlloc(&arena, size);
+        HARNESS_CHECK(block != NULL);
+        HARNESS_CHECK(!((uintptr_t)block % ATF_ARENA_MIN_BLOCK_SIZE));
+        HARNESS_CHECK(HarnessIsZero(block, AtfArenaBlockSize(size)));
+
+        std::memset(block, 0xa5, AtfArenaBlockSize(size));
+        blocks.push_back(block);
+    }
+    HARNESS_CHECK(arena.numOfChunks == 1);
+
+    // A freed block is reused by the next allocation of its size class, zeroed again
+    const size_t allocatedSize = arena.allocatedSize;
+    AtfArenaFree(&arena, blocks[3], 27);
+    HARNESS_CHECK(arena.allocatedSize == allocatedSize - 32);
+
+    UINT8 *reused = (UINT8 *)AtfArenaAlloc(&arena, 20);
+    HARNESS_CHECK(reused == blocks[3]);
+    HARNESS_CHECK(HarnessIsZero(reused, 32));
+    HARNESS_CHECK(arena.allocatedSize == allocatedSize);
+
+    // Blocks over ATF_ARENA_MAX_BLOCK_SIZE get a dedicated chunk, and the current chunk stays in use
+    UINT8 *large = (UINT8 *)AtfArenaAlloc(&arena, ATF_ARENA_MAX_BLOCK_SIZE * 4);
+    HARNESS_CHECK(large != NULL);
+    HARNESS_CHECK(arena.numOfChunks == 2);
+
+    UINT8 *small = (UINT8 *)AtfArenaAlloc(&arena, 16);
+    HARNESS_CHECK(small == blocks.back() + AtfArenaBlockSize(2187));
+    HARNESS_CHECK(arena.numOfChunks == 2);
+
+    AtfArenaRelease(&arena);
+    HARNESS_CHECK(!arena.chunks);
+    HARNESS_CHECK(arena.numOfChunks == 0);
+    HARNESS_CHECK(arena.reservedSize == 0);
+    HARNESS_CHECK(arena.allocatedSize == 0);
+}
+
+//
+// A trie takes a few chunks from the pool rather than one allocation per node, and hands them all back on free
+//
+HARNESS_TEST(ipv4_trie_allocates_from_arena)
+{
+    std::mt19937_64 rng(60);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 20000, 10, 12);
+
+    const uint64_t poolAllocations = gStubPoolAllocations;
+
+    IPV4_TRIE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    const uint64_t numOfAllocations = gStubPoolAllocations - poolAllocations;
+
+    HARNESS_CHECK(ctx->arena.numOfChunks > 0);
+    HARNESS_CHECK(numOfAllocations <= ctx->arena.numOfChunks + 4);
+    HARNESS_CHECK(numOfAllocations * 100 < ctx->totalNumOfNodes);
+    HARNESS_CHECK(ctx->arena.allocatedSize <= ctx->arena.reservedSize);
+
+    AtfIpv4TrieFree(&ctx);
+    HARNESS_CHECK(!ctx);
+}
+
+//
+// Pool allocations and teardown time of a trie, against allocating and freeing the same blocks one by one
+//
+HARNESS_BENCH(arena_trie_build_and_teardown)
+{
+    std::mt19937_64 rng(61);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, HarnessScale(100000), 5, 16);
+
+    const uint64_t poolAllocations = gStubPoolAllocations;
+
+    IPV4_TRIE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&ctx) == ATF_ERROR_OK);
+
+    double start = HarnessNowNs();
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+    const double buildNs = HarnessNowNs() - start;
+
+    const size_t numOfNodes = ctx->totalNumOfNodes;
+    const size_t averageBlockSize = ctx->arena.allocatedSize / numOfNodes;
+
+    HarnessReport("prefixes", (double)prefixes.size(), "");
+    HarnessReport("nodes", (double)numOfNodes, "");
+    HarnessReport("arena pool allocations", (double)(gStubPoolAllocations - poolAllocations), "");
+    HarnessReport("arena reserved", (double)ctx->arena.reservedSize / (1024 * 1024), "MB");
+    HarnessReport("arena allocated", (double)ctx->arena.allocatedSize / (1024 * 1024), "MB");
+    HarnessReport("arena build (ms)", buildNs / 1e6, "ms");
+
+    start = HarnessNowNs();
+    AtfIpv4TrieFree(&ctx);
+    HarnessReport("arena teardown (ms)", (HarnessNowNs() - start) / 1e6, "ms");
+
+    //
+    // One zeroed pool allocation per node, freed one by one
+    //
+    std::vector<VOID *> blocks(numOfNodes);
+
+    start = HarnessNowNs();
+    for (size_t i = 0; i < numOfNodes; i++) {
+        blocks[i] = ATF_MALLOC(averageBlockSize);
+    }
+    HarnessReport("per-node pool allocations", (double)numOfNodes, "");
+    HarnessReport("per-node alloc (ms)", (HarnessNowNs() - start) / 1e6, "ms");
+
+    start = HarnessNowNs();
+    for (size_t i = 0; i < numOfNodes; i++) {
+        ATF_FREE(blocks[i]);
+    }
+    HarnessReport("per-node teardown (ms)", (HarnessNowNs() - start) / 1e6, "ms");
+}
+
+//EOF
@@ -0,0 +1,179 @@
+#include "harness.h"
+
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/config.h"
+}
+
+//
+// Bulk upload session (IOCTL_ATF_BULK_UPLOAD_*) against the BLACKLIST_IPV4_MAX_SIZE append IOCTLs it replaced
+//
+//  The IOCTL transport is stood in for by HARNESS_BULK_SESSION: the transfers are copied into the staging buffer at
+//   their offset, as AtfHandleBulkUploadData() does from the locked output buffer, and both protocols publish the
+//   way ioctl.c does, by building a copy of the current config (AtfPublishIpv4Blacklist)
+//
+
+typedef struct _harness_bulk_session {
+    std::vector<UINT8>              buffer;
+    size_t                          receivedSize;
+} HARNESS_BULK_SESSION;
+
+static CONFIG_CTX *HarnessAllocConfig(void)
+{
+    static USER_DRIVER_FILTER_TRANSPORT_DATA data;
+    std::memset(&data, 0, sizeof(data));
+
+    data.magic = FILTER_TRANSPORT_MAGIC;
+    data.size = sizeof(USER_DRIVER_FILTER_TRANSPORT_DATA);
+    data.enableLayerIpv4TcpOutbound = TRUE;
+    data.dnsBlockResponse = DNS_BLOCK_NXDOMAIN;
+    data.ipv4LookupEngine = IPV4_ENGINE_TRIE;
+    data.numOfPolicyInsns = 1;
+    data.policy[0].opcode = POLICY_OP_RET;
+    data.policy[0].k = ACTION_BLOCK;
+
+    CONFIG_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfAllocDefaultConfig(&data, &ctx) == ATF_ERROR_OK);
+
+    return ctx;
+}
+
+//
+// AtfPublishIpv4Blacklist() without the store, the old config is freed once the new one is built
+//
+static bool HarnessPublishIpv4Blacklist(CONFIG_CTX **current, const VOID *blacklist, size_t bufLen)
+{
+    CONFIG_CTX *newConfigCtx = NULL;
+    if (AtfConfigClone(*current, &newConfigCtx)) {
+        return false;
+    }
+
+    if (AtfConfigAddIpv4Blacklist(newConfigCtx, blacklist, bufLen)) {
+        AtfFreeConfig(newConfigCtx);
+        return false;
+    }
+
+    AtfFreeConfig(*current);
+    *current = newConfigCtx;
+
+    return true;
+}
+
+//
+// One IOCTL_ATF_APPEND_IPV4_BLACKLIST per BLACKLIST_IPV4_MAX_SIZE bytes, each publishing a config
+//
+static bool HarnessUploadByAppend(CONFIG_CTX **current, const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    const size_t entriesPerCall = BLACKLIST_IPV4_MAX_SIZE / sizeof(IPV4_PREFIX_ENTRY);
+
+    for (size_t i = 0; i < prefixes.size(); i += entriesPerCall) {
+        const size_t numOfEntries = std::min(entriesPerCall, prefixes.size() - i);
+        if (!HarnessPublishIpv4Blacklist(current, &prefixes[i], numOfEntries * sizeof(IPV4_PREFIX_ENTRY))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//
+// BEGIN, DATA transfers of up to BULK_UPLOAD_MAX_TRANSFER_SIZE, then COMMIT, which publishes a single config
+//
+static bool HarnessUploadBySession(CONFIG_CTX **current, const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    const UINT8 *payload = (const UINT8 *)prefixes.data();
+    const size_t totalSize = prefixes.size() * sizeof(IPV4_PREFIX_ENTRY);
+
+    if (!totalSize || totalSize > BULK_UPLOAD_MAX_SIZE) {
+        return false;
+    }
+
+    HARNESS_BULK_SESSION session;
+    session.buffer.resize(totalSize);
+    session.receivedSize = 0;
+
+    while (session.receivedSize < totalSize) {
+        const size_t dataLen = std::min((size_t)BULK_UPLOAD_MAX_TRANSFER_SIZE, totalSize - session.receivedSize);
+
+        std::memcpy(&session.buffer[session.receivedSize], &payload[session.receivedSize], dataLen);
+        session.receivedSize += dataLen;
+    }
+
+    return HarnessPublishIpv4Blacklist(current, session.buffer.data(), session.buffer.size());
+}
+
+HARNESS_TEST(bulk_upload_matches_appends)
+{
+    std::mt19937_64 rng(40);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 3000, 20, 8);
+
+    CONFIG_CTX *appended = HarnessAllocConfig();
+    CONFIG_CTX *uploaded = HarnessAllocConfig();
+    if (!appended || !uploaded) {
+        return;
+    }
+
+    HARNESS_CHECK(HarnessUploadByAppend(&appended, prefixes));
+    HARNESS_CHECK(HarnessUploadBySession(&uploaded, prefixes));
+
+    HARNESS_CHECK(appended->numOfIpv4Addresses == prefixes.size());
+    HARNESS_CHECK(uploaded->numOfIpv4Addresses == prefixes.size());
+
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 20000);
+    std::vector<UINT8> appendedResults(probes.size());
+    std::vector<UINT8> uploadedResults(probes.size());
+
+    appended->ipv4Engine->SearchBatch(appended->ipv4EngineCtx, probes.data(), appendedResults.data(), probes.size());
+    uploaded->ipv4Engine->SearchBatch(uploaded->ipv4EngineCtx, probes.data(), uploadedResults.data(), probes.size());
+
+    for (size_t i = 0; i < probes.size(); i++) {
+        const UINT8 expected = HarnessIpv4Reference(prefixes, probes[i].S_un.S_addr);
+        HARNESS_CHECK(appendedResults[i] == expected);
+        HARNESS_CHECK(uploadedResults[i] == expected);
+    }
+
+    AtfFreeConfig(uploaded);
+    AtfFreeConfig(appended);
+}
+
+//
+// Time to load a host feed into the trie engine with each protocol, including the config copies
+//
+HARNESS_BENCH(bulk_upload_throughput)
+{
+    std::mt19937_64 rng(41);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, HarnessScale(20000), 0, 32);
+
+    CONFIG_CTX *appended = HarnessAllocConfig();
+    CONFIG_CTX *uploaded = HarnessAllocConfig();
+    if (!appended || !uploaded) {
+        return;
+    }
+
+    double start = HarnessNowNs();
+    HARNESS_CHECK(HarnessUploadByAppend(&appended, prefixes));
+    const double appendNs = HarnessNowNs() - start;
+
+    start = HarnessNowNs();
+    HARNESS_CHECK(HarnessUploadBySession(&uploaded, prefixes));
+    const double sessionNs = HarnessNowNs() - start;
+
+    const size_t entriesPerCall = BLACKLIST_IPV4_MAX_SIZE / sizeof(IPV4_PREFIX_ENTRY);
+    const size_t payloadSize = prefixes.size() * sizeof(IPV4_PREFIX_ENTRY);
+
+    HarnessReport("prefixes", (double)prefixes.size(), "");
+    HarnessReport("append IOCTLs", (double)((prefixes.size() + entriesPerCall - 1) / entriesPerCall), "");
+    HarnessReport("append load (ms)", appendNs / 1e6, "ms");
+    HarnessReport("append throughput", prefixes.size() / (appendNs / 1e9), "prefixes/s");
+    HarnessReport("session IOCTLs", (double)(2 + (payloadSize + BULK_UPLOAD_MAX_TRANSFER_SIZE - 1) /
+        BULK_UPLOAD_MAX_TRANSFER_SIZE), "");
+    HarnessReport("session load (ms)", sessionNs / 1e6, "ms");
+    HarnessReport("session throughput", prefixes.size() / (sessionNs / 1e9), "prefixes/s");
+
+    AtfFreeConfig(uploaded);
+    AtfFreeConfig(appended);
+}
+
+//EOF
@@ -0,0 +1,345 @@
+#include "harness.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/epoch.h"
+#include "../src/ActiveTransportFilter/config.h"
+}
+
+//
+// Epoch-based reclamation (epoch.c) and the config swap built on it (AtfFilterStoreDefaultConfig)
+//
+
+#define HARNESS_EPOCH_MAGIC             0x45504f43
+#define HARNESS_EPOCH_POISON            0xdd
+
+//
+// Published object: a reader that sees it poisoned, or its magic change while it is pinned, read freed memory
+//
+typedef struct _harness_epoch_object {
+    volatile UINT32                 magic;
+    UINT64                          generation;
+    UINT64                          payload[14];
+} HARNESS_EPOCH_OBJECT;
+
+static HARNESS_EPOCH_OBJECT *HarnessEpochAllocObject(UINT64 generation)
+{
+    HARNESS_EPOCH_OBJECT *object = new HARNESS_EPOCH_OBJECT;
+    object->magic = HARNESS_EPOCH_MAGIC;
+    object->generation = generation;
+    for (size_t i = 0; i < ARRAYSIZE(object->payload); i++) {
+        object->payload[i] = generation + i;
+    }
+
+    return object;
+}
+
+//
+// Poisoned before it is freed, so a late reader fails even if the allocator does not reuse the memory yet
+//
+static void HarnessEpochFreeObject(HARNESS_EPOCH_OBJECT *object)
+{
+    std::memset((void *)object, HARNESS_EPOCH_POISON, sizeof(HARNESS_EPOCH_OBJECT));
+    delete object;
+}
+
+typedef struct _harness_epoch_state {
+    ATF_EPOCH                       epoch;
+    HARNESS_EPOCH_OBJECT *volatile  published;
+    std::atomic<bool>               isStopped;
+    bool                            isYielding;
+    std::atomic<size_t>             numOfStarted;
+    std::atomic<size_t>             numOfReads;
+    std::atomic<size_t>             numOfBadReads;
+} HARNESS_EPOCH_STATE;
+
+//
+// The callout side: enter, load the published pointer, read it twice, exit
+//
+static void HarnessEpochReader(HARNESS_EPOCH_STATE *state)
+{
+    size_t numOfReads = 0;
+    size_t numOfBadReads = 0;
+    UINT64 lastGeneration = 0;
+
+    while (!state->isStopped.load(std::memory_order_relaxed)) {
+        ATF_EPOCH_GUARD epochGuard;
+        AtfEpochEnter(&state->epoch, &epochGuard);
+
+        const HARNESS_EPOCH_OBJECT *object = __atomic_load_n(&state->published, __ATOMIC_ACQUIRE);
+
+        const UINT64 generation = object->generation;
+
+        bool isValid = object->magic == HARNESS_EPOCH_MAGIC && generation >= lastGeneration;
+        for (size_t i = 0; isValid && i < ARRAYSIZE(object->payload); i++) {
+            isValid = object->payload[i] == generation + i;
+        }
+        lastGeneration = generation;
+
+        // Give up the processor now and then while pinned, so the writer also runs inside read sections
+        if (state->isYielding && !(numOfReads & 63)) {
+            std::this_thread::yield();
+        }
+
+        // Still pinned, the writer cannot have poisoned it or reused its memory in between
+        isValid = isValid && object->magic == HARNESS_EPOCH_MAGIC && object->generation == generation;
+
+        AtfEpochExit(&state->epoch, &epochGuard);
+
+        if (!numOfReads++) {
+            state->numOfStarted++;
+        }
+        numOfBadReads += !isValid;
+    }
+
+    state->numOfReads += numOfReads;
+    state->numOfBadReads += numOfBadReads;
+}
+
+//
+// Readers on every processor against a writer that swaps and frees as fast as AtfEpochSynchronize() returns
+//
+HARNESS_TEST(epoch_swap_and_reclaim_stress)
+{
+    HARNESS_EPOCH_STATE *state = new HARNESS_EPOCH_STATE;
+    AtfEpochInit(&state->epoch);
+    state->published = HarnessEpochAllocObject(0);
+    state->isStopped = false;
+    state->isYielding = true;
+    state->numOfStarted = 0;
+    state->numOfReads = 0;
+    state->numOfBadReads = 0;
+
+    const size_t numOfReaders = std::max(2U, std::thread::hardware_concurrency());
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < numOfReaders; i++) {
+        readers.emplace_back(HarnessEpochReader, state);
+    }
+
+    // The swaps only start once every reader is in its loop, even on a single processor
+    while (state->numOfStarted < numOfReaders) {
+        std::this_thread::yield();
+    }
+
+    const size_t numOfSwaps = 1000;
+    for (UINT64 generation = 1; generation <= numOfSwaps; generation++) {
+        HARNESS_EPOCH_OBJECT *old = (HARNESS_EPOCH_OBJECT *)InterlockedExchangePointer(&state->published,
+            HarnessEpochAllocObject(generation));
+
+        AtfEpochSynchronize(&state->epoch);
+
+        HarnessEpochFreeObject(old);
+    }
+
+    state->isStopped = true;
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+
+    HARNESS_CHECK(state->numOfBadReads == 0);
+
+    // Every reader has exited both epochs
+    for (ULONG i = 0; i < ATF_EPOCH_MAX_SLOTS; i++) {
+        HARNESS_CHECK(state->epoch.slots[i].readers[0] == 0);
+        HARNESS_CHECK(state->epoch.slots[i].readers[1] == 0);
+    }
+
+    HarnessEpochFreeObject(state->published);
+    delete state;
+}
+
+static CONFIG_CTX *HarnessEpochAllocConfig(IPV4_LOOKUP_ENGINE engine, const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    static USER_DRIVER_FILTER_TRANSPORT_DATA data;
+    std::memset(&data, 0, sizeof(data));
+
+    data.magic = FILTER_TRANSPORT_MAGIC;
+    data.size = sizeof(USER_DRIVER_FILTER_TRANSPORT_DATA);
+    data.enableLayerIpv4TcpOutbound = TRUE;
+    data.dnsBlockResponse = DNS_BLOCK_NXDOMAIN;
+    data.ipv4LookupEngine = engine;
+    data.numOfPolicyInsns = 1;
+    data.policy[0].opcode = POLICY_OP_RET;
+    data.policy[0].k = ACTION_BLOCK;
+
+    CONFIG_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfAllocDefaultConfig(&data, &ctx) == ATF_ERROR_OK);
+
+    if (ctx && !prefixes.empty()) {
+        HARNESS_CHECK(AtfConfigAddIpv4Blacklist(ctx, prefixes.data(), prefixes.size() * sizeof(IPV4_PREFIX_ENTRY)) ==
+            ATF_ERROR_OK);
+    }
+
+    return ctx;
+}
+
+static std::vector<UINT8> HarnessEpochSearch(const CONFIG_CTX *ctx, const std::vector<struct in_addr> &probes)
+{
+    std::vector<UINT8> results(probes.size());
+    ctx->ipv4Engine->SearchBatch(ctx->ipv4EngineCtx, probes.data(), results.data(), probes.size());
+
+    return results;
+}
+
+//
+// A clone shares the lookup engines, and the first change to an engine copies it for the clone only
+//
+HARNESS_TEST(config_clone_shares_engines)
+{
+    std::mt19937_64 rng(50);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 2000, 20, 8);
+    const std::vector<IPV4_PREFIX_ENTRY> added = HarnessIpv4RandomPrefixes(rng, 500, 0, 32);
+
+    CONFIG_CTX *ctx = HarnessEpochAllocConfig(IPV4_ENGINE_TRIE, prefixes);
+    if (!ctx) {
+        return;
+    }
+
+    CONFIG_CTX *clone = NULL;
+    HARNESS_CHECK(AtfConfigClone(ctx, &clone) == ATF_ERROR_OK);
+    if (!clone) {
+        AtfFreeConfig(ctx);
+        return;
+    }
+
+    HARNESS_CHECK(clone->ipv4EngineCtx == ctx->ipv4EngineCtx);
+    HARNESS_CHECK(clone->ipv6EngineCtx == ctx->ipv6EngineCtx);
+    HARNESS_CHECK(*ctx->ipv4EngineRefCount == 2);
+    HARNESS_CHECK(*ctx->ipv6EngineRefCount == 2);
+
+    HARNESS_CHECK(AtfConfigAddIpv4Blacklist(clone, added.data(), added.size() * sizeof(IPV4_PREFIX_ENTRY)) ==
+        ATF_ERROR_OK);
+
+    HARNESS_CHECK(clone->ipv4EngineCtx != ctx->ipv4EngineCtx);
+    HARNESS_CHECK(*ctx->ipv4EngineRefCount == 1);
+    HARNESS_CHECK(*clone->ipv4EngineRefCount == 1);
+
+    // The IPv6 engine was not modified, so it is still shared
+    HARNESS_CHECK(clone->ipv6EngineCtx == ctx->ipv6EngineCtx);
+    HARNESS_CHECK(*ctx->ipv6EngineRefCount == 2);
+
+    std::vector<IPV4_PREFIX_ENTRY> all = prefixes;
+    all.insert(all.end(), added.begin(), added.end());
+
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, all, 10000);
+    const std::vector<UINT8> ctxResults = HarnessEpochSearch(ctx, probes);
+    const std::vector<UINT8> cloneResults = HarnessEpochSearch(clone, probes);
+
+    for (size_t i = 0; i < probes.size(); i++) {
+        HARNESS_CHECK(ctxResults[i] == HarnessIpv4Reference(prefixes, probes[i].S_un.S_addr));
+        HARNESS_CHECK(cloneResults[i] == HarnessIpv4Reference(all, probes[i].S_un.S_addr));
+    }
+
+    // Freed in publish order, the old config first
+    AtfFreeConfig(ctx);
+    HARNESS_CHECK(*clone->ipv6EngineRefCount == 1);
+    AtfFreeConfig(clone);
+}
+
+//
+// Read-side cost of the epoch with every processor reading, and the writer's wait for the readers to drain
+//
+HARNESS_BENCH(epoch_read_and_synchronize)
+{
+    HARNESS_EPOCH_STATE *state = new HARNESS_EPOCH_STATE;
+    AtfEpochInit(&state->epoch);
+    state->published = HarnessEpochAllocObject(0);
+    state->isStopped = false;
+    state->isYielding = false;
+    state->numOfStarted = 0;
+    state->numOfReads = 0;
+    state->numOfBadReads = 0;
+
+    const size_t numOfReaders = std::max(2U, std::thread::hardware_concurrency());
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < numOfReaders; i++) {
+        readers.emplace_back(HarnessEpochReader, state);
+    }
+
+    // The swaps only start once every reader is in its loop, even on a single processor
+    while (state->numOfStarted < numOfReaders) {
+        std::this_thread::yield();
+    }
+
+    const size_t numOfSwaps = HarnessScale(200);
+    double synchronizeNs = 0;
+    double maxSynchronizeNs = 0;
+
+    const double start = HarnessNowNs();
+    for (UINT64 generation = 1; generation <= numOfSwaps; generation++) {
+        HARNESS_EPOCH_OBJECT *old = (HARNESS_EPOCH_OBJECT *)InterlockedExchangePointer(&state->published,
+            HarnessEpochAllocObject(generation));
+
+        const double synchronizeStart = HarnessNowNs();
+        AtfEpochSynchronize(&state->epoch);
+        const double elapsed = HarnessNowNs() - synchronizeStart;
+
+        synchronizeNs += elapsed;
+        maxSynchronizeNs = std::max(maxSynchronizeNs, elapsed);
+
+        HarnessEpochFreeObject(old);
+    }
+    const double totalNs = HarnessNowNs() - start;
+
+    state->isStopped = true;
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+
+    HARNESS_CHECK(state->numOfBadReads == 0);
+
+    HarnessReport("readers", (double)numOfReaders, "");
+    HarnessReport("read sections (ns/read, per reader)", totalNs * numOfReaders / state->numOfReads, "ns");
+    HarnessReport("synchronize (us, mean)", synchronizeNs / numOfSwaps / 1e3, "us");
+    HarnessReport("synchronize (us, max)", maxSynchronizeNs / 1e3, "us");
+
+    HarnessEpochFreeObject(state->published);
+    delete state;
+}
+
+//
+// Cost of a publish: a clone that shares the engine, and one that changes it (the whole engine is copied)
+//
+HARNESS_BENCH(config_clone_cost)
+{
+    std::mt19937_64 rng(51);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, HarnessScale(100000), 5, 16);
+    const IPV4_PREFIX_ENTRY added = HarnessIpv4Prefix((uint32_t)rng(), 32);
+
+    const IPV4_LOOKUP_ENGINE engines[] = { IPV4_ENGINE_TRIE, IPV4_ENGINE_DIR24 };
+    const char *names[] = { "trie", "dir24" };
+
+    for (size_t e = 0; e < ARRAYSIZE(engines); e++) {
+        CONFIG_CTX *ctx = HarnessEpochAllocConfig(engines[e], prefixes);
+        if (!ctx) {
+            return;
+        }
+
+        CONFIG_CTX *clone = NULL;
+
+        double start = HarnessNowNs();
+        HARNESS_CHECK(AtfConfigClone(ctx, &clone) == ATF_ERROR_OK);
+        const double cloneNs = HarnessNowNs() - start;
+
+        start = HarnessNowNs();
+        HARNESS_CHECK(AtfConfigAddIpv4Blacklist(clone, &added, sizeof(added)) == ATF_ERROR_OK);
+        const double changeNs = HarnessNowNs() - start;
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "%s engine size", names[e]);
+        HarnessReport(name, (double)AtfConfigGetIpv4Size(ctx) / (1024 * 1024), "MB");
+        std::snprintf(name, sizeof(name), "%s clone, shared engine (us)", names[e]);
+        HarnessReport(name, cloneNs / 1e3, "us");
+        std::snprintf(name, sizeof(name), "%s first change, engine copy (ms)", names[e]);
+        HarnessReport(name, changeNs / 1e6, "ms");
+
+        AtfFreeConfig(ctx);
+        AtfFreeConfig(clone);
+    }
+}
+
+//EOF
@@ -0,0 +1,101 @@
+#include "harness.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+//
+// Usage:
+//  atf_harness                     list the cases
+//  atf_harness <case> [--scale N]  run a case, benchmarks with their default size multiplied by N
+//  atf_harness --all [--scale N]   run every case
+//
+
+typedef struct _harness_case {
+    const char                      *name;
+    HARNESS_CASE_FN                 fn;
+    bool                            isBenchmark;
+} HARNESS_CASE;
+
+static std::vector<HARNESS_CASE> &HarnessCases(void)
+{
+    static std::vector<HARNESS_CASE> cases;
+    return cases;
+}
+
+static size_t gScale = 1;
+static size_t gNumOfFailures = 0;
+
+int HarnessRegister(const char *name, HARNESS_CASE_FN fn, bool isBenchmark)
+{
+    HarnessCases().push_back({ name, fn, isBenchmark });
+    return (int)HarnessCases().size() - 1;
+}
+
+void HarnessFail(const char *file, int line, const char *expr)
+{
+    // Only the first failures are printed, a broken engine fails the same check for every probe
+    if (gNumOfFailures++ < 10) {
+        std::printf("  FAILED %s:%d: %s\n", file, line, expr);
+    }
+}
+
+size_t HarnessScale(size_t size)
+{
+    return size * gScale;
+}
+
+void HarnessReport(const char *name, double value, const char *unit)
+{
+    std::printf("  %-48s %12.2f %s\n", name, value, unit);
+}
+
+static bool HarnessRun(const HARNESS_CASE &c)
+{
+    std::printf("[%s] %s\n", c.isBenchmark ? "bench" : "test", c.name);
+
+    gNumOfFailures = 0;
+    c.fn();
+
+    std::printf("[%s] %s\n", gNumOfFailures ? "FAIL" : "ok", c.name);
+    return !gNumOfFailures;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "--scale") && i + 1 < argc) {
+            gScale = std::strtoull(argv[++i], NULL, 10);
+        } else {
+            name = argv[i];
+        }
+    }
+
+    if (!name) {
+        for (const HARNESS_CASE &c : HarnessCases()) {
+            std::printf("%s%s\n", c.name, c.isBenchmark ? " (bench)" : "");
+        }
+        return 0;
+    }
+
+    bool isFound = false;
+    bool isPassed = true;
+    for (const HARNESS_CASE &c : HarnessCases()) {
+        if (std::strcmp(name, "--all") && std::strcmp(name, c.name)) {
+            continue;
+        }
+
+        isFound = true;
+        isPassed &= HarnessRun(c);
+    }
+
+    if (!isFound) {
+        std::printf("Unknown case: %s\n", name);
+        return 2;
+    }
+
+    return isPassed ? 0 : 1;
+}
+
+//EOF
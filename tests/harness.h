@@ -0,0 +1,151 @@
+#pragma once
+
+//
+// User-mode test and benchmark harness
+//
+//  The driver modules that do not talk to WFP (lookup engines, images, parsers, epoch, policy) are built against
+//   the kernel stand-ins in stub/, and the service builders as they are. Each case is registered with HARNESS_TEST
+//   or HARNESS_BENCH and runs as its own ctest test. Benchmarks run at a small scale under ctest, the sizes quoted
+//   in the commit messages are reproduced with --scale (see harness.cpp)
+//
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/mem.h"
+}
+
+#include "../src/common/user_driver_transport.h"
+
+typedef void (*HARNESS_CASE_FN)(void);
+
+//
+// Register a case, returns its index. Called by the HARNESS_TEST and HARNESS_BENCH macros at static initialization
+//
+int HarnessRegister(const char *name, HARNESS_CASE_FN fn, bool isBenchmark);
+
+//
+// Record a failed check, the case keeps running and fails once it returns
+//
+void HarnessFail(const char *file, int line, const char *expr);
+
+//
+// Benchmark size: the default size multiplied by the --scale argument (1 under ctest)
+//
+size_t HarnessScale(size_t size);
+
+//
+// Print a benchmark result line
+//
+void HarnessReport(const char *name, double value, const char *unit);
+
+#define HARNESS_TEST(name) \
+    static void name(void); \
+    static const int name##Index = HarnessRegister(#name, name, false); \
+    static void name(void)
+
+#define HARNESS_BENCH(name) \
+    static void name(void); \
+    static const int name##Index = HarnessRegister(#name, name, true); \
+    static void name(void)
+
+#define HARNESS_CHECK(expr) \
+    do { if (!(expr)) { HarnessFail(__FILE__, __LINE__, #expr); } } while (0)
+
+//
+// Wall clock time in nanoseconds
+//
+static inline double HarnessNowNs(void)
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//
+// Keep the compiler from dropping a benchmarked result
+//
+static inline void HarnessKeep(uint64_t value)
+{
+    static volatile uint64_t sink;
+    sink = sink + value;
+}
+
+//
+// IPv4 prefixes and reference lookups, shared by the lookup engine cases
+//  Addresses are in the byte order of IPV4_PREFIX_ENTRY: the first octet is the most significant byte of S_addr
+//
+
+static inline IPV4_PREFIX_ENTRY HarnessIpv4Prefix(uint32_t address, uint8_t prefixLength)
+{
+    IPV4_PREFIX_ENTRY entry = {};
+    entry.address.S_un.S_addr = prefixLength ? address & (0xffffffffU << (32 - prefixLength)) : 0;
+    entry.prefixLength = prefixLength;
+
+    return entry;
+}
+
+//
+// Random prefixes: /32 hosts, and subnetPercent percent of subnets from /shortestPrefix to /31
+//
+static inline std::vector<IPV4_PREFIX_ENTRY> HarnessIpv4RandomPrefixes(std::mt19937_64 &rng, size_t numOfEntries,
+    unsigned subnetPercent, uint8_t shortestPrefix)
+{
+    std::vector<IPV4_PREFIX_ENTRY> prefixes;
+    prefixes.reserve(numOfEntries);
+
+    for (size_t i = 0; i < numOfEntries; i++) {
+        uint8_t prefixLength = 32;
+        if (rng() % 100 < subnetPercent) {
+            prefixLength = (uint8_t)(shortestPrefix + rng() % (32 - shortestPrefix));
+        }
+
+        prefixes.push_back(HarnessIpv4Prefix((uint32_t)rng(), prefixLength));
+    }
+
+    return prefixes;
+}
+
+//
+// Longest prefix length covering the address, 0 if none. Linear scan, for the correctness cases
+//
+static inline uint8_t HarnessIpv4Reference(const std::vector<IPV4_PREFIX_ENTRY> &prefixes, uint32_t address)
+{
+    uint8_t longest = 0;
+    for (const IPV4_PREFIX_ENTRY &entry : prefixes) {
+        const uint32_t mask = entry.prefixLength ? 0xffffffffU << (32 - entry.prefixLength) : 0;
+        if ((address & mask) == entry.address.S_un.S_addr && entry.prefixLength > longest) {
+            longest = entry.prefixLength;
+        }
+    }
+
+    return longest;
+}
+
+//
+// Probe addresses: half are taken from the prefixes (hits), half are random (almost all misses)
+//
+static inline std::vector<struct in_addr> HarnessIpv4Probes(std::mt19937_64 &rng,
+    const std::vector<IPV4_PREFIX_ENTRY> &prefixes, size_t numOfProbes)
+{
+    std::vector<struct in_addr> probes(numOfProbes);
+
+    for (size_t i = 0; i < numOfProbes; i++) {
+        uint32_t address = (uint32_t)rng();
+        if (!prefixes.empty() && (i & 1)) {
+            const IPV4_PREFIX_ENTRY &entry = prefixes[rng() % prefixes.size()];
+            const uint32_t hostMask = entry.prefixLength ? ~(0xffffffffU << (32 - entry.prefixLength)) : 0xffffffffU;
+            address = entry.address.S_un.S_addr | (address & hostMask);
+        }
+
+        probes[i].S_un.S_addr = address;
+    }
+
+    return probes;
+}
+
+//EOF
@@ -0,0 +1,183 @@
+#include "harness.h"
+
+#include <algorithm>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_trie.h"
+#include "../src/ActiveTransportFilter/ipv4_image.h"
+}
+
+#include "../src/DeviceConfigService/ipv4_image_builder.h"
+
+//
+// Batched lookups (AtfIpv4TrieSearchBatch, AtfIpv4ImageSearchBatch) against the single-key searches
+//
+
+static IPV4_IMAGE_CTX *HarnessAdoptImage(const std::vector<IPV4_PREFIX_ENTRY> &prefixes, IPV4_PREFILTER_MODE mode)
+{
+    Ipv4ImageBuilder builder;
+    std::vector<std::byte> image;
+    HARNESS_CHECK(builder.CompileImage(prefixes, mode, image) == ATF_ERROR_OK);
+
+    IPV4_IMAGE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4ImageAdopt(image.data(), image.size(), &ctx) == ATF_ERROR_OK);
+
+    return ctx;
+}
+
+// Batch sizes around the lockstep window, and a tail shorter than it
+static const size_t gBatchSizes[] = { 1, 2, 3, 8, IPV4_TRIE_BATCH_WINDOW, IPV4_TRIE_BATCH_WINDOW + 1, 32, 100 };
+
+HARNESS_TEST(ipv4_trie_batch_matches_single)
+{
+    std::mt19937_64 rng(80);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 4000, 20, 8);
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 10000);
+
+    IPV4_TRIE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    for (size_t batchSize : gBatchSizes) {
+        std::vector<UINT8> results(probes.size());
+        for (size_t i = 0; i < probes.size(); i += batchSize) {
+            AtfIpv4TrieSearchBatch(ctx, &probes[i], &results[i], std::min(batchSize, probes.size() - i));
+        }
+
+        for (size_t i = 0; i < probes.size(); i++) {
+            HARNESS_CHECK(results[i] == AtfIpv4TrieSearch(ctx, probes[i]));
+        }
+    }
+
+    AtfIpv4TrieFree(&ctx);
+}
+
+HARNESS_TEST(ipv4_image_batch_matches_single)
+{
+    std::mt19937_64 rng(81);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 4000, 20, 8);
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 10000);
+
+    // The prefilter has no false negatives, so both images are exact
+    const IPV4_PREFILTER_MODE modes[] = { IPV4_PREFILTER_NONE, IPV4_PREFILTER_ENABLED };
+
+    for (IPV4_PREFILTER_MODE mode : modes) {
+        IPV4_IMAGE_CTX *ctx = HarnessAdoptImage(prefixes, mode);
+        if (!ctx) {
+            continue;
+        }
+
+        for (size_t batchSize : gBatchSizes) {
+            std::vector<UINT8> results(probes.size());
+            for (size_t i = 0; i < probes.size(); i += batchSize) {
+                AtfIpv4ImageSearchBatch(ctx, &probes[i], &results[i], std::min(batchSize, probes.size() - i));
+            }
+
+            for (size_t i = 0; i < probes.size(); i++) {
+                HARNESS_CHECK(results[i] == AtfIpv4ImageSearch(ctx, probes[i]));
+                HARNESS_CHECK(results[i] == HarnessIpv4Reference(prefixes, probes[i].S_un.S_addr));
+            }
+        }
+
+        AtfIpv4ImageFree(&ctx);
+    }
+}
+
+//
+// Evict the caches between the cold runs, by writing a buffer larger than the last level cache
+//
+static void HarnessEvictCaches(void)
+{
+    static std::vector<UINT8> buffer(64 * 1024 * 1024);
+    for (size_t i = 0; i < buffer.size(); i += 64) {
+        buffer[i]++;
+    }
+}
+
+typedef VOID HARNESS_SEARCH_BATCH(const VOID *ctx, const struct in_addr *ips, UINT8 *resultsOut, size_t numOfIps);
+
+static VOID HarnessTrieSearchBatch(const VOID *ctx, const struct in_addr *ips, UINT8 *resultsOut, size_t numOfIps)
+{
+    AtfIpv4TrieSearchBatch((const IPV4_TRIE_CTX *)ctx, ips, resultsOut, numOfIps);
+}
+
+static VOID HarnessImageSearchBatch(const VOID *ctx, const struct in_addr *ips, UINT8 *resultsOut, size_t numOfIps)
+{
+    AtfIpv4ImageSearchBatch((const IPV4_IMAGE_CTX *)ctx, ips, resultsOut, numOfIps);
+}
+
+//
+// ns/lookup of probes searched batchSize at a time, over numOfRounds passes
+//
+static double HarnessTimeBatches(HARNESS_SEARCH_BATCH *searchBatch, const VOID *ctx,
+    const std::vector<struct in_addr> &probes, size_t batchSize, size_t numOfRounds)
+{
+    std::vector<UINT8> results(probes.size());
+
+    const double start = HarnessNowNs();
+    for (size_t round = 0; round < numOfRounds; round++) {
+        for (size_t i = 0; i < probes.size(); i += batchSize) {
+            searchBatch(ctx, &probes[i], &results[i], std::min(batchSize, probes.size() - i));
+        }
+    }
+    const double elapsed = HarnessNowNs() - start;
+
+    uint64_t hits = 0;
+    for (UINT8 result : results) {
+        hits += result != 0;
+    }
+    HarnessKeep(hits);
+
+    return elapsed / (probes.size() * numOfRounds);
+}
+
+//
+// Cold: a pass over random probes right after the caches are evicted. Warm: a small probe set searched repeatedly
+//
+HARNESS_BENCH(ipv4_batch_lookup)
+{
+    std::mt19937_64 rng(82);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, HarnessScale(100000), 5, 16);
+    const std::vector<struct in_addr> coldProbes = HarnessIpv4Probes(rng, prefixes, 1 << 16);
+    const std::vector<struct in_addr> warmProbes = HarnessIpv4Probes(rng, prefixes, 1 << 10);
+
+    IPV4_TRIE_CTX *trieCtx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&trieCtx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(trieCtx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    IPV4_IMAGE_CTX *imageCtx = HarnessAdoptImage(prefixes, IPV4_PREFILTER_NONE);
+    if (!imageCtx) {
+        AtfIpv4TrieFree(&trieCtx);
+        return;
+    }
+
+    const struct {
+        const char                  *name;
+        HARNESS_SEARCH_BATCH        *searchBatch;
+        const VOID                  *ctx;
+    } engines[] = {
+        { "trie", HarnessTrieSearchBatch, trieCtx },
+        { "image", HarnessImageSearchBatch, imageCtx }
+    };
+
+    const size_t benchSizes[] = { 1, 2, 8, 32 };
+
+    for (const auto &engine : engines) {
+        for (size_t batchSize : benchSizes) {
+            char name[64];
+
+            HarnessEvictCaches();
+            std::snprintf(name, sizeof(name), "%s cold, batch %zu (ns/lookup)", engine.name, batchSize);
+            HarnessReport(name, HarnessTimeBatches(engine.searchBatch, engine.ctx, coldProbes, batchSize, 1), "ns");
+
+            HarnessTimeBatches(engine.searchBatch, engine.ctx, warmProbes, batchSize, 1);
+            std::snprintf(name, sizeof(name), "%s warm, batch %zu (ns/lookup)", engine.name, batchSize);
+            HarnessReport(name, HarnessTimeBatches(engine.searchBatch, engine.ctx, warmProbes, batchSize, 256), "ns");
+        }
+    }
+
+    AtfIpv4ImageFree(&imageCtx);
+    AtfIpv4TrieFree(&trieCtx);
+}
+
+//EOF
@@ -0,0 +1,135 @@
+#include "harness.h"
+
+#include <algorithm>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_trie.h"
+#include "../src/ActiveTransportFilter/ipv4_cuckoo.h"
+}
+
+//
+// Bucketized cuckoo hash set (ipv4_cuckoo.c)
+//
+
+HARNESS_TEST(ipv4_cuckoo_matches_reference)
+{
+    std::mt19937_64 rng(100);
+
+    // Mostly hosts, and a few subnets for the companion trie
+    std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 20000, 2, 8);
+    prefixes.push_back(HarnessIpv4Prefix(0, 32));
+
+    IPV4_CUCKOO_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4CuckooAllocCtx(&ctx) == ATF_ERROR_OK);
+
+    // Inserted in small pools, so the table is rebuilt larger several times
+    for (size_t i = 0; i < prefixes.size(); i += 1000) {
+        const size_t numOfEntries = std::min((size_t)1000, prefixes.size() - i);
+        HARNESS_CHECK(AtfIpv4CuckooInsertPool(ctx, &prefixes[i], numOfEntries) == ATF_ERROR_OK);
+    }
+
+    HARNESS_CHECK(ctx->hasZeroAddress);
+    HARNESS_CHECK(ctx->trieCtx != NULL);
+
+    std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 40000);
+    probes[0].S_un.S_addr = 0;
+
+    std::vector<UINT8> results(probes.size());
+    AtfIpv4CuckooSearchBatch(ctx, probes.data(), results.data(), probes.size());
+
+    for (size_t i = 0; i < probes.size(); i++) {
+        const UINT8 expected = HarnessIpv4Reference(prefixes, probes[i].S_un.S_addr);
+        HARNESS_CHECK(AtfIpv4CuckooSearch(ctx, probes[i]) == expected);
+        HARNESS_CHECK(results[i] == expected);
+    }
+
+    AtfIpv4CuckooFree(&ctx);
+    HARNESS_CHECK(!ctx);
+}
+
+HARNESS_TEST(ipv4_cuckoo_remove_and_clone)
+{
+    std::mt19937_64 rng(101);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 20000, 0, 32);
+
+    IPV4_CUCKOO_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4CuckooAllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4CuckooInsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    IPV4_CUCKOO_CTX *clone = NULL;
+    HARNESS_CHECK(AtfIpv4CuckooClone(ctx, &clone) == ATF_ERROR_OK);
+
+    const std::vector<IPV4_PREFIX_ENTRY> removed(prefixes.begin(), prefixes.begin() + prefixes.size() / 2);
+    const std::vector<IPV4_PREFIX_ENTRY> kept(prefixes.begin() + prefixes.size() / 2, prefixes.end());
+    HARNESS_CHECK(AtfIpv4CuckooRemovePool(ctx, removed.data(), removed.size()) == ATF_ERROR_OK);
+
+    // Freed slots are reused, the removed addresses go back in without growing the table
+    const size_t numOfBuckets = ctx->numOfBuckets;
+    HARNESS_CHECK(AtfIpv4CuckooInsertPool(clone, removed.data(), removed.size()) == ATF_ERROR_OK);
+
+    for (const IPV4_PREFIX_ENTRY &entry : removed) {
+        HARNESS_CHECK(AtfIpv4CuckooSearch(ctx, entry.address) == 0);
+        HARNESS_CHECK(AtfIpv4CuckooSearch(clone, entry.address) == 32);
+    }
+    for (const IPV4_PREFIX_ENTRY &entry : kept) {
+        HARNESS_CHECK(AtfIpv4CuckooSearch(ctx, entry.address) == 32);
+    }
+
+    HARNESS_CHECK(AtfIpv4CuckooInsertPool(ctx, removed.data(), removed.size()) == ATF_ERROR_OK);
+    HARNESS_CHECK(ctx->numOfBuckets == numOfBuckets);
+    HARNESS_CHECK(ctx->numOfAddresses == prefixes.size());
+
+    AtfIpv4CuckooFree(&clone);
+    AtfIpv4CuckooFree(&ctx);
+}
+
+//
+// Bytes per address and lookups of a /32 feed, against the trie
+//
+HARNESS_BENCH(ipv4_cuckoo_lookup)
+{
+    std::mt19937_64 rng(102);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, HarnessScale(200000), 0, 32);
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 1 << 20);
+    std::vector<UINT8> results(probes.size());
+
+    IPV4_TRIE_CTX *trieCtx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&trieCtx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(trieCtx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    IPV4_CUCKOO_CTX *cuckooCtx = NULL;
+    HARNESS_CHECK(AtfIpv4CuckooAllocCtx(&cuckooCtx) == ATF_ERROR_OK);
+
+    double start = HarnessNowNs();
+    HARNESS_CHECK(AtfIpv4CuckooInsertPool(cuckooCtx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+    HarnessReport("cuckoo insert (ns/address)", (HarnessNowNs() - start) / prefixes.size(), "ns");
+
+    HarnessReport("addresses", (double)prefixes.size(), "");
+    HarnessReport("trie (bytes/address)", (double)trieCtx->totalTrieSize / prefixes.size(), "B");
+    HarnessReport("cuckoo (bytes/address)", (double)cuckooCtx->totalTableSize / prefixes.size(), "B");
+    HarnessReport("cuckoo rebuilds", (double)cuckooCtx->numOfRebuilds, "");
+
+    uint64_t hits = 0;
+    start = HarnessNowNs();
+    for (const struct in_addr &probe : probes) {
+        hits += AtfIpv4TrieSearch(trieCtx, probe) != 0;
+    }
+    HarnessReport("trie search (ns/lookup)", (HarnessNowNs() - start) / probes.size(), "ns");
+
+    start = HarnessNowNs();
+    for (const struct in_addr &probe : probes) {
+        hits += AtfIpv4CuckooSearch(cuckooCtx, probe) != 0;
+    }
+    HarnessReport("cuckoo search (ns/lookup)", (HarnessNowNs() - start) / probes.size(), "ns");
+
+    start = HarnessNowNs();
+    AtfIpv4CuckooSearchBatch(cuckooCtx, probes.data(), results.data(), probes.size());
+    HarnessReport("cuckoo batch search (ns/lookup)", (HarnessNowNs() - start) / probes.size(), "ns");
+
+    HarnessKeep(hits + results[0]);
+
+    AtfIpv4CuckooFree(&cuckooCtx);
+    AtfIpv4TrieFree(&trieCtx);
+}
+
+//EOF
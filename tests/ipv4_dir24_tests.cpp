@@ -0,0 +1,105 @@
+#include "harness.h"
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_dir24.h"
+#include "../src/ActiveTransportFilter/ipv4_trie.h"
+}
+
+//
+// DIR-24-8 flat table (ipv4_dir24.c)
+//
+
+HARNESS_TEST(ipv4_dir24_matches_reference)
+{
+    std::mt19937_64 rng(20);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 4000, 30, 8);
+
+    IPV4_DIR24_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4Dir24AllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4Dir24InsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 20000);
+    std::vector<UINT8> results(probes.size());
+    AtfIpv4Dir24SearchBatch(ctx, probes.data(), results.data(), probes.size());
+
+    for (size_t i = 0; i < probes.size(); i++) {
+        const UINT8 expected = HarnessIpv4Reference(prefixes, probes[i].S_un.S_addr);
+        HARNESS_CHECK(AtfIpv4Dir24Search(ctx, probes[i]) == expected);
+        HARNESS_CHECK(results[i] == expected);
+    }
+
+    AtfIpv4Dir24Free(&ctx);
+    HARNESS_CHECK(!ctx);
+}
+
+HARNESS_TEST(ipv4_dir24_matches_trie)
+{
+    std::mt19937_64 rng(21);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 100000, 10, 12);
+
+    IPV4_DIR24_CTX *dir24 = NULL;
+    IPV4_TRIE_CTX *trie = NULL;
+    HARNESS_CHECK(AtfIpv4Dir24AllocCtx(&dir24) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&trie) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4Dir24InsertPool(dir24, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(trie, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 200000);
+    for (const struct in_addr &probe : probes) {
+        HARNESS_CHECK(AtfIpv4Dir24Search(dir24, probe) == AtfIpv4TrieSearch(trie, probe));
+    }
+
+    AtfIpv4TrieFree(&trie);
+    AtfIpv4Dir24Free(&dir24);
+}
+
+//
+// Single and batched lookups against the trie, on the same feed and probes
+//
+HARNESS_BENCH(ipv4_dir24_lookup)
+{
+    std::mt19937_64 rng(22);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, HarnessScale(100000), 5, 16);
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 1 << 20);
+
+    IPV4_DIR24_CTX *dir24 = NULL;
+    IPV4_TRIE_CTX *trie = NULL;
+    HARNESS_CHECK(AtfIpv4Dir24AllocCtx(&dir24) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&trie) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4Dir24InsertPool(dir24, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(trie, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    HarnessReport("table size", (double)dir24->totalTableSize / (1024 * 1024), "MB");
+
+    uint64_t hits = 0;
+    double start = HarnessNowNs();
+    for (const struct in_addr &probe : probes) {
+        hits += AtfIpv4TrieSearch(trie, probe) != 0;
+    }
+    HarnessReport("trie search (ns/lookup)", (HarnessNowNs() - start) / probes.size(), "ns");
+
+    start = HarnessNowNs();
+    for (const struct in_addr &probe : probes) {
+        hits += AtfIpv4Dir24Search(dir24, probe) != 0;
+    }
+    HarnessReport("dir24 search (ns/lookup)", (HarnessNowNs() - start) / probes.size(), "ns");
+
+    std::vector<UINT8> results(probes.size());
+    start = HarnessNowNs();
+    AtfIpv4Dir24SearchBatch(dir24, probes.data(), results.data(), probes.size());
+    HarnessReport("dir24 batch search (ns/lookup)", (HarnessNowNs() - start) / probes.size(), "ns");
+
+    // The callout looks up the local/remote pair
+    start = HarnessNowNs();
+    for (size_t i = 0; i + 1 < probes.size(); i += 2) {
+        AtfIpv4Dir24SearchBatch(dir24, &probes[i], &results[i], 2);
+    }
+    HarnessReport("dir24 pair batch (ns/lookup)", (HarnessNowNs() - start) / probes.size(), "ns");
+
+    HarnessKeep(hits + results[0]);
+
+    AtfIpv4TrieFree(&trie);
+    AtfIpv4Dir24Free(&dir24);
+}
+
+//EOF
@@ -0,0 +1,145 @@
+#include "harness.h"
+
+#include <cmath>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_engine.h"
+}
+
+#include "../src/DeviceConfigService/ipv4_engine_selector.h"
+
+//
+// Engine size estimates of the service (ipv4_engine_selector.cpp) against the engines built by the driver
+//
+
+static const IPV4_LOOKUP_ENGINE gEngines[] = {
+    IPV4_ENGINE_TRIE,
+    IPV4_ENGINE_DIR24,
+    IPV4_ENGINE_CUCKOO,
+    IPV4_ENGINE_ROARING
+};
+
+//
+// Physical size of an engine built from the prefixes, as counted against the memory budget
+//
+static size_t HarnessIpv4EngineSize(IPV4_LOOKUP_ENGINE engine, const std::vector<IPV4_PREFIX_ENTRY> &prefixes)
+{
+    const IPV4_ENGINE_OPS *ops = AtfIpv4EngineGetOps(engine);
+    HARNESS_CHECK(ops != NULL);
+    if (!ops) {
+        return 0;
+    }
+
+    VOID *ctx = NULL;
+    HARNESS_CHECK(ops->AllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(ops->InsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    const size_t size = ops->GetSize(ctx);
+    ops->Free(&ctx);
+
+    return size;
+}
+
+//
+// Feeds of different shapes: hosts only, hosts with subnets, and hosts clustered in a few /16s
+//
+static std::vector<IPV4_PREFIX_ENTRY> HarnessIpv4Feed(std::mt19937_64 &rng, size_t shape, size_t numOfEntries)
+{
+    switch (shape)
+    {
+    case 0:
+        return HarnessIpv4RandomPrefixes(rng, numOfEntries, 0, 32);
+    case 1:
+        return HarnessIpv4RandomPrefixes(rng, numOfEntries, 20, 12);
+    default:
+        {
+            std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, numOfEntries, 0, 32);
+            for (IPV4_PREFIX_ENTRY &entry : prefixes) {
+                entry.address.S_un.S_addr = 0x0a000000 | (entry.address.S_un.S_addr & 0x0007ffff);
+            }
+            return prefixes;
+        }
+    }
+}
+
+static const char *gFeedNames[] = { "hosts", "subnets", "clustered" };
+
+HARNESS_TEST(ipv4_engine_estimates_match_sizes)
+{
+    std::mt19937_64 rng(120);
+
+    for (size_t shape = 0; shape < ARRAYSIZE(gFeedNames); shape++) {
+        const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4Feed(rng, shape, 20000);
+
+        for (IPV4_LOOKUP_ENGINE engine : gEngines) {
+            const double estimate = (double)Ipv4EngineSelector::EstimateEngine(engine, prefixes);
+            const double actual = (double)HarnessIpv4EngineSize(engine, prefixes);
+
+            // Within a quarter of the actual size, the budget check of the driver uses the actual size
+            const bool isClose = std::fabs(estimate - actual) <= actual / 4;
+            HARNESS_CHECK(isClose);
+            if (!isClose) {
+                std::printf("  %s, %s: estimated %.0f, actual %.0f\n", gFeedNames[shape],
+                    Ipv4EngineSelector::GetEngineName(engine), estimate, actual);
+            }
+        }
+    }
+}
+
+HARNESS_TEST(ipv4_engine_selection_fits_budget)
+{
+    std::mt19937_64 rng(121);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4Feed(rng, 0, 20000);
+
+    // No limit: the fastest engine
+    uint64_t predictedSize = 0;
+    HARNESS_CHECK(Ipv4EngineSelector::SelectEngine(prefixes, 0, predictedSize) == IPV4_ENGINE_DIR24);
+
+    // Under the DIR-24-8 table, a smaller engine that still fits once built
+    const uint64_t memoryBudget = 16 * 1024 * 1024;
+    const IPV4_LOOKUP_ENGINE engine = Ipv4EngineSelector::SelectEngine(prefixes, memoryBudget, predictedSize);
+    HARNESS_CHECK(engine != IPV4_ENGINE_DIR24);
+    HARNESS_CHECK(predictedSize <= memoryBudget);
+    HARNESS_CHECK(HarnessIpv4EngineSize(engine, prefixes) <= memoryBudget);
+
+    // Nothing fits: the smallest engine
+    const std::vector<IPV4_ENGINE_ESTIMATE> estimates = Ipv4EngineSelector::EstimateEngines(prefixes);
+    IPV4_ENGINE_ESTIMATE smallest = estimates[0];
+    for (const IPV4_ENGINE_ESTIMATE &estimate : estimates) {
+        if (estimate.size < smallest.size) {
+            smallest = estimate;
+        }
+    }
+    HARNESS_CHECK(Ipv4EngineSelector::SelectEngine(prefixes, 1, predictedSize) == smallest.engine);
+    HARNESS_CHECK(predictedSize == smallest.size);
+}
+
+//
+// Estimated against actual size of every engine, and the time taken by the estimate
+//
+HARNESS_BENCH(ipv4_engine_estimates)
+{
+    std::mt19937_64 rng(122);
+
+    for (size_t shape = 0; shape < ARRAYSIZE(gFeedNames); shape++) {
+        const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4Feed(rng, shape, HarnessScale(100000));
+        char name[96];
+
+        const double start = HarnessNowNs();
+        const std::vector<IPV4_ENGINE_ESTIMATE> estimates = Ipv4EngineSelector::EstimateEngines(prefixes);
+        std::snprintf(name, sizeof(name), "%s estimate (ms)", gFeedNames[shape]);
+        HarnessReport(name, (HarnessNowNs() - start) / 1e6, "ms");
+
+        for (const IPV4_ENGINE_ESTIMATE &estimate : estimates) {
+            const size_t actual = HarnessIpv4EngineSize(estimate.engine, prefixes);
+            const char *engineName = Ipv4EngineSelector::GetEngineName(estimate.engine);
+
+            std::snprintf(name, sizeof(name), "%s %s estimated", gFeedNames[shape], engineName);
+            HarnessReport(name, (double)estimate.size / (1024 * 1024), "MB");
+            std::snprintf(name, sizeof(name), "%s %s actual", gFeedNames[shape], engineName);
+            HarnessReport(name, (double)actual / (1024 * 1024), "MB");
+        }
+    }
+}
+
+//EOF
@@ -0,0 +1,151 @@
+#include "harness.h"
+
+#include <algorithm>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_trie.h"
+#include "../src/ActiveTransportFilter/ipv4_image.h"
+}
+
+#include "../src/DeviceConfigService/ipv4_bulk_builder.h"
+#include "../src/DeviceConfigService/ipv4_image_builder.h"
+
+//
+// User mode image build (ipv4_bulk_builder.cpp, ipv4_image_builder.cpp) against the insertion into the driver trie
+//
+
+//
+// The feeds overlap: a share of the entries is repeated, and everything is shuffled
+//
+static std::vector<IPV4_PREFIX_ENTRY> HarnessIpv4OverlappingFeed(std::mt19937_64 &rng, size_t numOfEntries,
+    uint32_t subnetPercent, uint8_t shortestPrefix)
+{
+    std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, numOfEntries, subnetPercent,
+        shortestPrefix);
+
+    const size_t numOfRepeats = numOfEntries / 10;
+    for (size_t i = 0; i < numOfRepeats; i++) {
+        prefixes.push_back(prefixes[rng() % numOfEntries]);
+    }
+
+    std::shuffle(prefixes.begin(), prefixes.end(), rng);
+
+    return prefixes;
+}
+
+HARNESS_TEST(ipv4_bulk_radix_sort_matches_sort)
+{
+    std::mt19937_64 rng(130);
+
+    // Enough keys for several workers, and key widths that skip some of the passes
+    const uint32_t keyWidths[] = { 8, 32, 40, 64 };
+
+    for (uint32_t keyBits : keyWidths) {
+        const uint64_t mask = keyBits == 64 ? ~0ULL : (1ULL << keyBits) - 1;
+
+        std::vector<uint64_t> keys(IPV4_BULK_MIN_KEYS_PER_THREAD * 4 + 7);
+        for (uint64_t &key : keys) {
+            key = rng() & mask;
+        }
+
+        std::vector<uint64_t> expected = keys;
+        std::sort(expected.begin(), expected.end());
+
+        Ipv4BulkBuilder::RadixSort(keys, keyBits);
+        HARNESS_CHECK(keys == expected);
+    }
+}
+
+HARNESS_TEST(ipv4_image_build_drops_duplicates)
+{
+    std::mt19937_64 rng(131);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4OverlappingFeed(rng, 300000, 10, 8);
+
+    size_t numOfDuplicates = 0;
+    const std::vector<IPV4_PREFIX_ENTRY> distinct = Ipv4BulkBuilder::SortUnique(prefixes, numOfDuplicates);
+    HARNESS_CHECK(distinct.size() + numOfDuplicates == prefixes.size());
+    HARNESS_CHECK(numOfDuplicates >= prefixes.size() / 11);
+
+    Ipv4ImageBuilder builder;
+    std::vector<std::byte> image;
+    HARNESS_CHECK(builder.CompileImage(prefixes, IPV4_PREFILTER_NONE, image) == ATF_ERROR_OK);
+    HARNESS_CHECK(builder.GetNumOfPrefixes() == distinct.size());
+    HARNESS_CHECK(builder.GetImageSize() == image.size());
+
+    IPV4_IMAGE_CTX *imageCtx = NULL;
+    HARNESS_CHECK(AtfIpv4ImageAdopt(image.data(), image.size(), &imageCtx) == ATF_ERROR_OK);
+    if (!imageCtx) {
+        return;
+    }
+
+    IPV4_TRIE_CTX *trieCtx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&trieCtx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(trieCtx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 100000);
+    for (const struct in_addr &probe : probes) {
+        HARNESS_CHECK(AtfIpv4ImageSearch(imageCtx, probe) == AtfIpv4TrieSearch(trieCtx, probe));
+    }
+
+    AtfIpv4TrieFree(&trieCtx);
+    AtfIpv4ImageFree(&imageCtx);
+}
+
+//
+// Time to turn an overlapping feed into a lookup structure: compiled into an image in user mode and adopted by the
+//  driver, against inserted into the driver trie one prefix at a time. The trie is capped at a million prefixes,
+//  its cost per prefix does not drop with size
+//
+HARNESS_BENCH(ipv4_image_build)
+{
+    std::mt19937_64 rng(132);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4OverlappingFeed(rng, HarnessScale(1000000), 5, 16);
+
+    HarnessReport("prefixes", (double)prefixes.size(), "");
+    HarnessReport("worker threads", (double)Ipv4BulkBuilder::GetNumOfThreads(prefixes.size()), "");
+
+    double start = HarnessNowNs();
+    size_t numOfDuplicates = 0;
+    const std::vector<IPV4_PREFIX_ENTRY> distinct = Ipv4BulkBuilder::SortUnique(prefixes, numOfDuplicates);
+    HarnessReport("sort and dedupe (ms)", (HarnessNowNs() - start) / 1e6, "ms");
+    HarnessReport("duplicates", (double)numOfDuplicates, "");
+
+    Ipv4ImageBuilder builder;
+    std::vector<std::byte> image;
+
+    start = HarnessNowNs();
+    const ATF_ERROR compileError = builder.CompileImage(prefixes, IPV4_PREFILTER_NONE, image);
+    const double compileNs = HarnessNowNs() - start;
+
+    // At large scales the image can be over BULK_UPLOAD_MAX_SIZE, it is still built and measured but not adopted
+    HARNESS_CHECK(compileError == ATF_ERROR_OK || compileError == ATF_BULK_PAYLOAD_TOO_LARGE);
+
+    HarnessReport("image compile (ms)", compileNs / 1e6, "ms");
+    HarnessReport("image compile (ns/prefix)", compileNs / prefixes.size(), "ns");
+    HarnessReport("image size", (double)builder.GetImageSize() / (1024 * 1024), "MB");
+
+    IPV4_IMAGE_CTX *imageCtx = NULL;
+    if (compileError == ATF_ERROR_OK) {
+        start = HarnessNowNs();
+        HARNESS_CHECK(AtfIpv4ImageAdopt(image.data(), image.size(), &imageCtx) == ATF_ERROR_OK);
+        HarnessReport("image adopt (ms)", (HarnessNowNs() - start) / 1e6, "ms");
+    }
+
+    const size_t numOfTrieEntries = std::min(prefixes.size(), (size_t)1000000);
+
+    IPV4_TRIE_CTX *trieCtx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&trieCtx) == ATF_ERROR_OK);
+
+    start = HarnessNowNs();
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(trieCtx, prefixes.data(), numOfTrieEntries) == ATF_ERROR_OK);
+    const double insertNs = HarnessNowNs() - start;
+
+    HarnessReport("trie insert (ms)", insertNs / 1e6, "ms");
+    HarnessReport("trie insert (ns/prefix)", insertNs / numOfTrieEntries, "ns");
+    HarnessReport("trie size", (double)trieCtx->totalTrieSize / (1024 * 1024), "MB");
+
+    AtfIpv4TrieFree(&trieCtx);
+    AtfIpv4ImageFree(&imageCtx);
+}
+
+//EOF
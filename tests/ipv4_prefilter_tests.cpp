@@ -0,0 +1,139 @@
+#include "harness.h"
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_trie.h"
+#include "../src/ActiveTransportFilter/ipv4_image.h"
+}
+
+#include "../src/DeviceConfigService/ipv4_image_builder.h"
+
+//
+// Binary fuse prefilter of the IPv4 image (IPV4_IMAGE_FLAG_PREFILTER, IPV4_IMAGE_FLAG_PREFILTER_ONLY)
+//
+
+static IPV4_IMAGE_CTX *HarnessAdoptPrefilterImage(const std::vector<IPV4_PREFIX_ENTRY> &prefixes,
+    IPV4_PREFILTER_MODE mode)
+{
+    Ipv4ImageBuilder builder;
+    std::vector<std::byte> image;
+    HARNESS_CHECK(builder.CompileImage(prefixes, mode, image) == ATF_ERROR_OK);
+
+    IPV4_IMAGE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4ImageAdopt(image.data(), image.size(), &ctx) == ATF_ERROR_OK);
+
+    return ctx;
+}
+
+//
+// Random addresses not covered by the blocklist, the trie is the reference
+//
+static std::vector<struct in_addr> HarnessIpv4Misses(std::mt19937_64 &rng, const IPV4_TRIE_CTX *trieCtx,
+    size_t numOfMisses)
+{
+    std::vector<struct in_addr> misses;
+    misses.reserve(numOfMisses);
+
+    while (misses.size() < numOfMisses) {
+        struct in_addr ip;
+        ip.S_un.S_addr = (uint32_t)rng();
+        if (!AtfIpv4TrieSearch(trieCtx, ip)) {
+            misses.push_back(ip);
+        }
+    }
+
+    return misses;
+}
+
+HARNESS_TEST(ipv4_prefilter_only_has_no_false_negatives)
+{
+    std::mt19937_64 rng(90);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 5000, 0, 32);
+
+    IPV4_IMAGE_CTX *ctx = HarnessAdoptPrefilterImage(prefixes, IPV4_PREFILTER_ONLY);
+    if (!ctx) {
+        return;
+    }
+
+    HARNESS_CHECK(AtfIpv4ImageIsApproximate(ctx));
+
+    // Every blocklisted address hits the filter
+    for (const IPV4_PREFIX_ENTRY &entry : prefixes) {
+        HARNESS_CHECK(AtfIpv4ImageSearch(ctx, entry.address) != 0);
+    }
+
+    // Hosts only, so one level is probed and the false positive rate is about 1/256
+    size_t numOfFalsePositives = 0;
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, {}, 100000);
+    for (const struct in_addr &probe : probes) {
+        if (!HarnessIpv4Reference(prefixes, probe.S_un.S_addr)) {
+            numOfFalsePositives += AtfIpv4ImageSearch(ctx, probe) != 0;
+        }
+    }
+    HARNESS_CHECK(numOfFalsePositives < probes.size() / 100);
+
+    AtfIpv4ImageFree(&ctx);
+}
+
+//
+// Size of the filter, the cost of a miss with and without it, and the misses reported as hits (false positives of
+//  the prefilter only image, the other images are exact)
+//
+HARNESS_BENCH(ipv4_prefilter_miss_path)
+{
+    std::mt19937_64 rng(91);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, HarnessScale(100000), 5, 16);
+
+    IPV4_TRIE_CTX *trieCtx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&trieCtx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(trieCtx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    const std::vector<struct in_addr> misses = HarnessIpv4Misses(rng, trieCtx, 1 << 20);
+
+    const struct {
+        const char                  *name;
+        IPV4_PREFILTER_MODE         mode;
+    } modes[] = {
+        { "trie image", IPV4_PREFILTER_NONE },
+        { "prefilter and trie image", IPV4_PREFILTER_ENABLED },
+        { "prefilter only image", IPV4_PREFILTER_ONLY }
+    };
+
+    for (const auto &mode : modes) {
+        IPV4_IMAGE_CTX *ctx = HarnessAdoptPrefilterImage(prefixes, mode.mode);
+        if (!ctx) {
+            continue;
+        }
+
+        char name[96];
+
+        if (mode.mode != IPV4_PREFILTER_NONE) {
+            const IPV4_IMAGE_HEADER *header = ctx->header;
+
+            // The keys are the leaves of the trie image, which the prefilter only image does not keep
+            std::snprintf(name, sizeof(name), "%s filter size", mode.name);
+            HarnessReport(name, (double)header->filterArrayLength / (1024 * 1024), "MB");
+            if (header->numOfLeaves) {
+                std::snprintf(name, sizeof(name), "%s bits per key", mode.name);
+                HarnessReport(name, (double)header->filterArrayLength * 8 / header->numOfLeaves, "bits");
+            }
+        }
+
+        uint64_t numOfHits = 0;
+        const double start = HarnessNowNs();
+        for (const struct in_addr &miss : misses) {
+            numOfHits += AtfIpv4ImageSearch(ctx, miss) != 0;
+        }
+        const double elapsed = HarnessNowNs() - start;
+
+        std::snprintf(name, sizeof(name), "%s miss (ns/lookup)", mode.name);
+        HarnessReport(name, elapsed / misses.size(), "ns");
+        std::snprintf(name, sizeof(name), "%s hits on misses", mode.name);
+        HarnessReport(name, 100.0 * numOfHits / misses.size(), "%");
+
+        AtfIpv4ImageFree(&ctx);
+    }
+
+    AtfIpv4TrieFree(&trieCtx);
+}
+
+//EOF
@@ -0,0 +1,177 @@
+#include "harness.h"
+
+#include <algorithm>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_trie.h"
+#include "../src/ActiveTransportFilter/ipv4_roaring.h"
+}
+
+//
+// Roaring-style container set (ipv4_roaring.c)
+//  The set does not keep prefix lengths, a hit is reported as a /32 match
+//
+
+static UINT8 HarnessIpv4SetReference(const std::vector<IPV4_PREFIX_ENTRY> &prefixes, uint32_t address)
+{
+    return HarnessIpv4Reference(prefixes, address) ? IPV4_PREFIX_MAX_LENGTH : 0;
+}
+
+//
+// Prefixes clustered in a few /16s (dense enough for bitmaps and runs), and scattered hosts elsewhere
+//
+static std::vector<IPV4_PREFIX_ENTRY> HarnessIpv4ClusteredPrefixes(std::mt19937_64 &rng, size_t numOfEntries,
+    size_t numOfClusters)
+{
+    std::vector<uint32_t> clusters(numOfClusters);
+    for (uint32_t &cluster : clusters) {
+        cluster = (uint32_t)rng() & 0xffff0000U;
+    }
+
+    std::vector<IPV4_PREFIX_ENTRY> prefixes;
+    prefixes.reserve(numOfEntries);
+
+    for (size_t i = 0; i < numOfEntries; i++) {
+        if (rng() % 10 < 8) {
+            const uint32_t cluster = clusters[rng() % clusters.size()];
+            const uint8_t prefixLength = rng() % 8 ? 32 : (uint8_t)(20 + rng() % 12);
+            prefixes.push_back(HarnessIpv4Prefix(cluster | ((uint32_t)rng() & 0xffff), prefixLength));
+        } else {
+            prefixes.push_back(HarnessIpv4Prefix((uint32_t)rng(), 32));
+        }
+    }
+
+    return prefixes;
+}
+
+HARNESS_TEST(ipv4_roaring_matches_reference)
+{
+    std::mt19937_64 rng(110);
+    std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4ClusteredPrefixes(rng, 20000, 4);
+
+    // A /16 and a /12, which are stored as runs
+    prefixes.push_back(HarnessIpv4Prefix(0x0a0a0000, 16));
+    prefixes.push_back(HarnessIpv4Prefix(0xac100000, 12));
+
+    IPV4_ROARING_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4RoaringAllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4RoaringInsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    HARNESS_CHECK(ctx->numOfContainers[IPV4_ROARING_ARRAY] > 0);
+    HARNESS_CHECK(ctx->numOfContainers[IPV4_ROARING_BITMAP] + ctx->numOfContainers[IPV4_ROARING_RUN] > 0);
+
+    std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 40000);
+    std::vector<UINT8> results(probes.size());
+    AtfIpv4RoaringSearchBatch(ctx, probes.data(), results.data(), probes.size());
+
+    for (size_t i = 0; i < probes.size(); i++) {
+        const UINT8 expected = HarnessIpv4SetReference(prefixes, probes[i].S_un.S_addr);
+        HARNESS_CHECK(AtfIpv4RoaringSearch(ctx, probes[i]) == expected);
+        HARNESS_CHECK(results[i] == expected);
+    }
+
+    AtfIpv4RoaringFree(&ctx);
+    HARNESS_CHECK(!ctx);
+}
+
+//
+// Union and difference of feeds, a clone keeps the set it was taken from
+//
+HARNESS_TEST(ipv4_roaring_union_and_difference)
+{
+    std::mt19937_64 rng(111);
+    const std::vector<IPV4_PREFIX_ENTRY> first = HarnessIpv4ClusteredPrefixes(rng, 10000, 4);
+    const std::vector<IPV4_PREFIX_ENTRY> second = HarnessIpv4ClusteredPrefixes(rng, 10000, 4);
+
+    std::vector<IPV4_PREFIX_ENTRY> both = first;
+    both.insert(both.end(), second.begin(), second.end());
+
+    IPV4_ROARING_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4RoaringAllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4RoaringInsertPool(ctx, first.data(), first.size()) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4RoaringInsertPool(ctx, second.data(), second.size()) == ATF_ERROR_OK);
+
+    IPV4_ROARING_CTX *clone = NULL;
+    HARNESS_CHECK(AtfIpv4RoaringClone(ctx, &clone) == ATF_ERROR_OK);
+
+    HARNESS_CHECK(AtfIpv4RoaringRemovePool(ctx, second.data(), second.size()) == ATF_ERROR_OK);
+
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, both, 20000);
+    for (const struct in_addr &probe : probes) {
+        const bool isInFirst = HarnessIpv4Reference(first, probe.S_un.S_addr) != 0;
+        const bool isInSecond = HarnessIpv4Reference(second, probe.S_un.S_addr) != 0;
+
+        HARNESS_CHECK((AtfIpv4RoaringSearch(ctx, probe) != 0) == (isInFirst && !isInSecond));
+        HARNESS_CHECK((AtfIpv4RoaringSearch(clone, probe) != 0) == (isInFirst || isInSecond));
+    }
+
+    AtfIpv4RoaringFree(&clone);
+    AtfIpv4RoaringFree(&ctx);
+}
+
+//
+// Memory and lookups on clustered and uniform feeds, against the trie
+//
+HARNESS_BENCH(ipv4_roaring_lookup)
+{
+    std::mt19937_64 rng(112);
+
+    const struct {
+        const char                  *name;
+        std::vector<IPV4_PREFIX_ENTRY> prefixes;
+    } feeds[] = {
+        { "clustered", HarnessIpv4ClusteredPrefixes(rng, HarnessScale(200000), 64) },
+        { "uniform", HarnessIpv4RandomPrefixes(rng, HarnessScale(200000), 0, 32) }
+    };
+
+    for (const auto &feed : feeds) {
+        const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, feed.prefixes, 1 << 20);
+        char name[96];
+
+        IPV4_TRIE_CTX *trieCtx = NULL;
+        HARNESS_CHECK(AtfIpv4TrieAllocCtx(&trieCtx) == ATF_ERROR_OK);
+        HARNESS_CHECK(AtfIpv4TrieInsertPool(trieCtx, feed.prefixes.data(), feed.prefixes.size()) == ATF_ERROR_OK);
+
+        IPV4_ROARING_CTX *roaringCtx = NULL;
+        HARNESS_CHECK(AtfIpv4RoaringAllocCtx(&roaringCtx) == ATF_ERROR_OK);
+
+        double start = HarnessNowNs();
+        HARNESS_CHECK(AtfIpv4RoaringInsertPool(roaringCtx, feed.prefixes.data(), feed.prefixes.size()) ==
+            ATF_ERROR_OK);
+        std::snprintf(name, sizeof(name), "%s roaring insert (ms)", feed.name);
+        HarnessReport(name, (HarnessNowNs() - start) / 1e6, "ms");
+
+        std::snprintf(name, sizeof(name), "%s trie size", feed.name);
+        HarnessReport(name, (double)trieCtx->totalTrieSize / (1024 * 1024), "MB");
+        std::snprintf(name, sizeof(name), "%s roaring size", feed.name);
+        HarnessReport(name, (double)roaringCtx->totalSetSize / (1024 * 1024), "MB");
+        std::snprintf(name, sizeof(name), "%s array containers", feed.name);
+        HarnessReport(name, (double)roaringCtx->numOfContainers[IPV4_ROARING_ARRAY], "");
+        std::snprintf(name, sizeof(name), "%s bitmap containers", feed.name);
+        HarnessReport(name, (double)roaringCtx->numOfContainers[IPV4_ROARING_BITMAP], "");
+        std::snprintf(name, sizeof(name), "%s run containers", feed.name);
+        HarnessReport(name, (double)roaringCtx->numOfContainers[IPV4_ROARING_RUN], "");
+
+        uint64_t hits = 0;
+        start = HarnessNowNs();
+        for (const struct in_addr &probe : probes) {
+            hits += AtfIpv4TrieSearch(trieCtx, probe) != 0;
+        }
+        std::snprintf(name, sizeof(name), "%s trie search (ns/lookup)", feed.name);
+        HarnessReport(name, (HarnessNowNs() - start) / probes.size(), "ns");
+
+        start = HarnessNowNs();
+        for (const struct in_addr &probe : probes) {
+            hits += AtfIpv4RoaringSearch(roaringCtx, probe) != 0;
+        }
+        std::snprintf(name, sizeof(name), "%s roaring search (ns/lookup)", feed.name);
+        HarnessReport(name, (HarnessNowNs() - start) / probes.size(), "ns");
+
+        HarnessKeep(hits);
+
+        AtfIpv4RoaringFree(&roaringCtx);
+        AtfIpv4TrieFree(&trieCtx);
+    }
+}
+
+//EOF
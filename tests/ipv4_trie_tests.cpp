@@ -0,0 +1,117 @@
+#include "harness.h"
+
+extern "C" {
+#include "../src/ActiveTransportFilter/ipv4_trie.h"
+}
+
+//
+// Bitmap-compressed trie (ipv4_trie.c)
+//
+
+HARNESS_TEST(ipv4_trie_matches_reference)
+{
+    std::mt19937_64 rng(1);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 4000, 20, 8);
+
+    IPV4_TRIE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 20000);
+    for (const struct in_addr &probe : probes) {
+        HARNESS_CHECK(AtfIpv4TrieSearch(ctx, probe) == HarnessIpv4Reference(prefixes, probe.S_un.S_addr));
+    }
+
+    AtfIpv4TrieFree(&ctx);
+    HARNESS_CHECK(!ctx);
+}
+
+HARNESS_TEST(ipv4_trie_counts_duplicates_once)
+{
+    const IPV4_PREFIX_ENTRY prefixes[] = {
+        HarnessIpv4Prefix(0x0a000001, 32),
+        HarnessIpv4Prefix(0x0a000001, 32),
+        HarnessIpv4Prefix(0x0a000000, 24),
+        HarnessIpv4Prefix(0x0a000000, 24)
+    };
+
+    IPV4_TRIE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(ctx, prefixes, ARRAYSIZE(prefixes)) == ATF_ERROR_OK);
+
+    HARNESS_CHECK(ctx->totalNumOfPrefixes == 2);
+
+    struct in_addr ip;
+    ip.S_un.S_addr = 0x0a000001;
+    HARNESS_CHECK(AtfIpv4TrieSearch(ctx, ip) == 32);
+    ip.S_un.S_addr = 0x0a0000fe;
+    HARNESS_CHECK(AtfIpv4TrieSearch(ctx, ip) == 24);
+    ip.S_un.S_addr = 0x0a000100;
+    HARNESS_CHECK(AtfIpv4TrieSearch(ctx, ip) == 0);
+
+    AtfIpv4TrieFree(&ctx);
+}
+
+HARNESS_TEST(ipv4_trie_remove_and_clone)
+{
+    std::mt19937_64 rng(2);
+    std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, 4000, 0, 32);
+
+    IPV4_TRIE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&ctx) == ATF_ERROR_OK);
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+
+    IPV4_TRIE_CTX *clone = NULL;
+    HARNESS_CHECK(AtfIpv4TrieClone(ctx, &clone) == ATF_ERROR_OK);
+
+    // Hosts only, so no remaining prefix overlaps a removed one
+    const std::vector<IPV4_PREFIX_ENTRY> removed(prefixes.begin(), prefixes.begin() + prefixes.size() / 2);
+    const std::vector<IPV4_PREFIX_ENTRY> kept(prefixes.begin() + prefixes.size() / 2, prefixes.end());
+    HARNESS_CHECK(AtfIpv4TrieRemovePool(ctx, removed.data(), removed.size()) == ATF_ERROR_OK);
+
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 10000);
+    for (const struct in_addr &probe : probes) {
+        HARNESS_CHECK(AtfIpv4TrieSearch(ctx, probe) == HarnessIpv4Reference(kept, probe.S_un.S_addr));
+        HARNESS_CHECK(AtfIpv4TrieSearch(clone, probe) == HarnessIpv4Reference(prefixes, probe.S_un.S_addr));
+    }
+
+    AtfIpv4TrieFree(&clone);
+    AtfIpv4TrieFree(&ctx);
+}
+
+//
+// Lookups over a mixed feed, and the size of the trie against the 2048-byte nodes it replaced
+//
+HARNESS_BENCH(ipv4_trie_lookup)
+{
+    std::mt19937_64 rng(3);
+    const std::vector<IPV4_PREFIX_ENTRY> prefixes = HarnessIpv4RandomPrefixes(rng, HarnessScale(100000), 5, 16);
+    const std::vector<struct in_addr> probes = HarnessIpv4Probes(rng, prefixes, 1 << 20);
+
+    IPV4_TRIE_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfIpv4TrieAllocCtx(&ctx) == ATF_ERROR_OK);
+
+    double start = HarnessNowNs();
+    HARNESS_CHECK(AtfIpv4TrieInsertPool(ctx, prefixes.data(), prefixes.size()) == ATF_ERROR_OK);
+    HarnessReport("insert (ns/prefix)", (HarnessNowNs() - start) / prefixes.size(), "ns");
+
+    HarnessReport("prefixes", (double)ctx->totalNumOfPrefixes, "");
+    HarnessReport("nodes", (double)ctx->totalNumOfNodes, "");
+    HarnessReport("trie size", (double)ctx->totalTrieSize / (1024 * 1024), "MB");
+    HarnessReport("size with 256-pointer nodes", (double)ctx->totalNumOfNodes * 256 * sizeof(VOID *) / (1024 * 1024), "MB");
+
+    uint64_t hits = 0;
+    start = HarnessNowNs();
+    for (const struct in_addr &probe : probes) {
+        hits += AtfIpv4TrieSearch(ctx, probe) != 0;
+    }
+    HarnessReport("search (ns/lookup)", (HarnessNowNs() - start) / probes.size(), "ns");
+
+    HarnessKeep(hits);
+
+    start = HarnessNowNs();
+    AtfIpv4TrieFree(&ctx);
+    HarnessReport("free (ms)", (HarnessNowNs() - start) / 1e6, "ms");
+}
+
+//EOF
@@ -0,0 +1,391 @@
+#include "harness.h"
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+extern "C" {
+#include "../src/ActiveTransportFilter/payload_sig.h"
+}
+
+#include "../src/DeviceConfigService/payload_sig_builder.h"
+
+//
+// Payload signature image (payload_sig_builder.cpp) and the stream scan of the driver (payload_sig.c)
+//
+
+typedef PayloadSigBuilder::PAYLOAD_SIGNATURE HARNESS_SIGNATURE;
+
+// Tokens of HTTP requests and shell commands, the text payloads and the text signatures are made of
+static const char *gSigWords[] = {
+    "GET", "POST", "HTTP/1.1", "Host:", "User-Agent:", "Mozilla/5.0", "admin", "login", "php", "cmd", "exec",
+    "select", "union", "from", "where", "password", "token", "session", "cookie", "Accept:", "text/html",
+    "application/json", "Content-Length:", "index", "upload", "shell", "eval", "base64", "decode", "script",
+    "alert", "document", "window", "location", "the", "and", "for", "with", "this", "that", "http://", "https://",
+    "www.", "example", ".com", ".net", "/api/v1/", "?id=", "&user=", "=", "\r\n", " ", "/", "%20", "..", "../",
+    "etc/passwd", "system32", "powershell", "-enc", "wget", "curl", "chmod", "+x", "/tmp/", "bin/sh"
+};
+
+static std::vector<uint8_t> HarnessSigRandomBytes(std::mt19937_64 &rng, size_t size)
+{
+    std::vector<uint8_t> bytes(size);
+    for (uint8_t &byte : bytes) {
+        byte = (uint8_t)rng();
+    }
+
+    return bytes;
+}
+
+//
+// Text of the signature vocabulary, with numbers in between
+//
+static std::vector<uint8_t> HarnessSigVocabularyText(std::mt19937_64 &rng, size_t size)
+{
+    std::string text;
+    while (text.size() < size) {
+        text += gSigWords[rng() % ARRAYSIZE(gSigWords)];
+        if (rng() % 3 == 0) {
+            text += ' ';
+        }
+        if (rng() % 11 == 0) {
+            text += std::to_string(rng() % 100000);
+        }
+    }
+    text.resize(size);
+
+    return std::vector<uint8_t>(text.begin(), text.end());
+}
+
+//
+// HTTP and HTML text that does not share the vocabulary of the text signatures
+//
+static std::vector<uint8_t> HarnessSigWebText(std::mt19937_64 &rng, size_t size)
+{
+    static const char *markup[] = { "GET /", " HTTP/1.1\r\nHost: ", "\r\nAccept: text/html\r\n", "<div class=\"", "\">" };
+    static const char *syllables[] = {
+        "ka", "lo", "mi", "tra", "ck", "ad", "serv", "net", "pix", "el", "on", "ar", "go", "zo", "ex", "ample", "re",
+        "qu", "ing", "tion", "ment", "st", "th", "er", "ou", "an", "in", "es"
+    };
+
+    std::string text;
+    while (text.size() < size) {
+        const size_t kind = rng() % 20;
+        if (kind < ARRAYSIZE(markup)) {
+            text += markup[kind];
+        }
+
+        const size_t numOfSyllables = 1 + rng() % 3;
+        for (size_t i = 0; i < numOfSyllables; i++) {
+            text += syllables[rng() % ARRAYSIZE(syllables)];
+        }
+        text += rng() % 6 == 0 ? ". " : " ";
+    }
+    text.resize(size);
+
+    return std::vector<uint8_t>(text.begin(), text.end());
+}
+
+//
+// Text and binary literals, and literals sharing a prefix with, a suffix of or equal to an earlier one
+//
+static std::vector<HARNESS_SIGNATURE> HarnessSigSignatures(std::mt19937_64 &rng, size_t numOfSignatures,
+    size_t minLength)
+{
+    std::vector<HARNESS_SIGNATURE> signatures;
+
+    for (size_t i = 0; i < numOfSignatures; i++) {
+        HARNESS_SIGNATURE signature;
+        signature.name = "sig-" + std::to_string(i);
+
+        const size_t kind = signatures.empty() ? 0 : rng() % 10;
+        if (kind < 4) {
+            std::string text;
+            const size_t numOfWords = 1 + rng() % 3;
+            for (size_t k = 0; k < numOfWords; k++) {
+                text += gSigWords[rng() % ARRAYSIZE(gSigWords)];
+            }
+            text += std::to_string(rng() % 1000000);
+            signature.literal.assign(text.begin(), text.end());
+        } else if (kind < 8) {
+            signature.literal = HarnessSigRandomBytes(rng, minLength + rng() % 28);
+        } else if (kind < 9) {
+            signature.literal = signatures[rng() % signatures.size()].literal;
+            signature.literal.resize(std::max(minLength, signature.literal.size() / 2 + 1));
+
+            const std::vector<uint8_t> extra = HarnessSigRandomBytes(rng, 1 + rng() % 6);
+            signature.literal.insert(signature.literal.end(), extra.begin(), extra.end());
+        } else {
+            signature.literal = signatures[rng() % signatures.size()].literal;
+            if (rng() % 2 && signature.literal.size() > minLength) {
+                const size_t numOfDropped = rng() % (signature.literal.size() - minLength + 1);
+                signature.literal.erase(signature.literal.begin(), signature.literal.begin() + numOfDropped);
+            }
+        }
+
+        if (signature.literal.size() < minLength) {
+            const std::vector<uint8_t> extra = HarnessSigRandomBytes(rng, minLength - signature.literal.size());
+            signature.literal.insert(signature.literal.end(), extra.begin(), extra.end());
+        }
+        if (signature.literal.size() > PAYLOAD_SIG_MAX_LITERAL_LENGTH) {
+            signature.literal.resize(PAYLOAD_SIG_MAX_LITERAL_LENGTH);
+        }
+
+        signatures.push_back(signature);
+    }
+
+    return signatures;
+}
+
+//
+// Naive scan: the first end position a literal ends at, the longest literal ending there, and the lowest id of
+//  equal literals
+//
+class HarnessSigReference {
+private:
+    std::unordered_map<std::string, uint32_t>   idByLiteral;
+    std::set<size_t>                            lengths;
+
+public:
+    HarnessSigReference(const std::vector<HARNESS_SIGNATURE> &signatures)
+    {
+        for (uint32_t id = 0; id < signatures.size(); id++) {
+            const std::string literal(signatures[id].literal.begin(), signatures[id].literal.end());
+            idByLiteral.emplace(literal, id);
+            lengths.insert(literal.size());
+        }
+    }
+
+    uint32_t Scan(const uint8_t *data, size_t dataLength) const
+    {
+        for (size_t end = 1; end <= dataLength; end++) {
+            for (auto length = lengths.rbegin(); length != lengths.rend(); ++length) {
+                if (*length > end) {
+                    continue;
+                }
+
+                const auto match = idByLiteral.find(std::string((const char *)data + end - *length, *length));
+                if (match != idByLiteral.end()) {
+                    return match->second;
+                }
+            }
+        }
+
+        return PAYLOAD_SIG_NO_MATCH;
+    }
+};
+
+static PAYLOAD_SIG_CTX *HarnessAdoptSigImage(const std::vector<HARNESS_SIGNATURE> &signatures,
+    std::vector<std::byte> &imageOut)
+{
+    PayloadSigBuilder builder;
+    HARNESS_CHECK(builder.CompileImage(signatures, imageOut) == ATF_ERROR_OK);
+    HARNESS_CHECK(builder.GetNumOfSignatures() == signatures.size());
+
+    PAYLOAD_SIG_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfPayloadSigAdopt(imageOut.data(), imageOut.size(), &ctx) == ATF_ERROR_OK);
+
+    return ctx;
+}
+
+//
+// Scan a payload as a stream of segments of at most maxSegmentLength bytes (random lengths), up to the first match
+//
+static uint32_t HarnessSigScanSegments(std::mt19937_64 &rng, const PAYLOAD_SIG_CTX *ctx,
+    const std::vector<uint8_t> &payload, size_t maxSegmentLength)
+{
+    PAYLOAD_SIG_STREAM stream;
+    AtfPayloadSigResetStream(&stream);
+
+    for (size_t offset = 0; offset < payload.size();) {
+        const size_t segmentLength = std::min(1 + rng() % maxSegmentLength, payload.size() - offset);
+
+        const uint32_t signatureId = AtfPayloadSigScan(ctx, &stream, &payload[offset], segmentLength);
+        if (signatureId != PAYLOAD_SIG_NO_MATCH) {
+            return signatureId;
+        }
+
+        offset += segmentLength;
+    }
+
+    return PAYLOAD_SIG_NO_MATCH;
+}
+
+HARNESS_TEST(payload_sig_matches_reference)
+{
+    std::mt19937_64 rng(250);
+
+    const struct {
+        size_t                      numOfSignatures;
+        size_t                      minLength;
+        size_t                      numOfPayloads;
+    } sets[] = {
+        { 1, 4, 200 },
+        { 5, 4, 200 },
+        { 50, 5, 200 },
+        { 300, 9, 200 },
+        { 2000, 4, 200 },
+        { 10000, 6, 60 },
+        { 10000, 9, 60 }
+    };
+
+    // Whole payloads, segments split inside the prefilter window, and segments of up to an MTU
+    const size_t maxSegmentLengths[] = { SIZE_MAX, 3, 1500 };
+
+    for (const auto &set : sets) {
+        const std::vector<HARNESS_SIGNATURE> signatures = HarnessSigSignatures(rng, set.numOfSignatures, set.minLength);
+        const HarnessSigReference reference(signatures);
+
+        std::vector<std::byte> image;
+        PAYLOAD_SIG_CTX *ctx = HarnessAdoptSigImage(signatures, image);
+        if (!ctx) {
+            continue;
+        }
+
+        size_t numOfMatches = 0;
+
+        for (size_t i = 0; i < set.numOfPayloads; i++) {
+            const size_t size = 1 + rng() % 4000;
+            std::vector<uint8_t> payload = rng() % 2 ? HarnessSigVocabularyText(rng, size) :
+                HarnessSigRandomBytes(rng, size);
+
+            // Up to two literals planted at random offsets
+            const size_t numOfPlanted = rng() % 3;
+            for (size_t k = 0; k < numOfPlanted; k++) {
+                const std::vector<uint8_t> &literal = signatures[rng() % signatures.size()].literal;
+                if (literal.size() <= payload.size()) {
+                    const size_t offset = rng() % (payload.size() - literal.size() + 1);
+                    std::copy(literal.begin(), literal.end(), payload.begin() + offset);
+                }
+            }
+
+            const uint32_t expected = reference.Scan(payload.data(), payload.size());
+            numOfMatches += expected != PAYLOAD_SIG_NO_MATCH;
+
+            for (size_t maxSegmentLength : maxSegmentLengths) {
+                HARNESS_CHECK(HarnessSigScanSegments(rng, ctx, payload, maxSegmentLength) == expected);
+            }
+        }
+
+        HARNESS_CHECK(numOfMatches > 0);
+
+        AtfPayloadSigFree(&ctx);
+        HARNESS_CHECK(!ctx);
+    }
+}
+
+HARNESS_TEST(payload_sig_rejects_corrupt_images)
+{
+    std::mt19937_64 rng(251);
+    const std::vector<HARNESS_SIGNATURE> signatures = HarnessSigSignatures(rng, 300, 4);
+
+    std::vector<std::byte> image;
+    PAYLOAD_SIG_CTX *ctx = HarnessAdoptSigImage(signatures, image);
+    AtfPayloadSigFree(&ctx);
+
+    // Any flipped byte is caught, by the checksum if by nothing else
+    for (size_t i = 0; i < 200; i++) {
+        std::vector<std::byte> corrupt = image;
+        corrupt[rng() % corrupt.size()] ^= (std::byte)(1 + rng() % 255);
+
+        PAYLOAD_SIG_CTX *corruptCtx = NULL;
+        HARNESS_CHECK(AtfPayloadSigAdopt(corrupt.data(), corrupt.size(), &corruptCtx) == ATF_CORRUPT_IMAGE);
+        HARNESS_CHECK(!corruptCtx);
+    }
+
+    PAYLOAD_SIG_CTX *truncatedCtx = NULL;
+    HARNESS_CHECK(AtfPayloadSigAdopt(image.data(), image.size() - 1, &truncatedCtx) == ATF_CORRUPT_IMAGE);
+}
+
+HARNESS_TEST(payload_sig_parses_signature_lines)
+{
+    HARNESS_SIGNATURE signature;
+
+    HARNESS_CHECK(PayloadSigBuilder::ParseSignature("http-cmd   GET /cmd.exe|3f 7c|x  \r", signature));
+    HARNESS_CHECK(signature.name == "http-cmd");
+    HARNESS_CHECK(std::string(signature.literal.begin(), signature.literal.end()) == "GET /cmd.exe?|x");
+
+    HARNESS_CHECK(PayloadSigBuilder::ParseSignature("\tbin |00 01 02 03|", signature));
+    HARNESS_CHECK(signature.literal.size() == 4 && signature.literal[3] == 3);
+
+    // Too short, odd hex digits, unterminated hex, no literal
+    HARNESS_CHECK(!PayloadSigBuilder::ParseSignature("short abc", signature));
+    HARNESS_CHECK(!PayloadSigBuilder::ParseSignature("odd ab|3|cd", signature));
+    HARNESS_CHECK(!PayloadSigBuilder::ParseSignature("open abcd|41", signature));
+    HARNESS_CHECK(!PayloadSigBuilder::ParseSignature("nameonly", signature));
+}
+
+//
+// Scan throughput of 10K signatures, over large and MTU sized segments of a stream. The stream is reset after a
+//  match, as the stream layer does with a new flow. A scan stops at its match, so only the bytes of the segments
+//  scanned to their end are counted (the time of every segment is)
+//
+HARNESS_BENCH(payload_sig_scan)
+{
+    std::mt19937_64 rng(252);
+    const std::vector<HARNESS_SIGNATURE> signatures = HarnessSigSignatures(rng, 10000, 8);
+
+    PayloadSigBuilder builder;
+    std::vector<std::byte> image;
+
+    double start = HarnessNowNs();
+    HARNESS_CHECK(builder.CompileImage(signatures, image) == ATF_ERROR_OK);
+    HarnessReport("compile (ms)", (HarnessNowNs() - start) / 1e6, "ms");
+
+    PAYLOAD_SIG_CTX *ctx = NULL;
+    HARNESS_CHECK(AtfPayloadSigAdopt(image.data(), image.size(), &ctx) == ATF_ERROR_OK);
+    if (!ctx) {
+        return;
+    }
+
+    HarnessReport("signatures", (double)signatures.size(), "");
+    HarnessReport("image size", (double)image.size() / 1024, "KB");
+    HarnessReport("states", (double)ctx->header->numOfStates, "");
+    HarnessReport("prefilter length", (double)ctx->prefilterLength, "B");
+
+    const size_t size = HarnessScale(16 * 1024 * 1024);
+
+    const struct {
+        const char                  *name;
+        std::vector<uint8_t>        payload;
+    } corpora[] = {
+        { "random", HarnessSigRandomBytes(rng, size) },
+        { "vocabulary text", HarnessSigVocabularyText(rng, size) },
+        { "web text", HarnessSigWebText(rng, size) },
+        { "zeros", std::vector<uint8_t>(size, 0) }
+    };
+
+    const size_t segmentLengths[] = { 64 * 1024, 1460 };
+
+    for (const auto &corpus : corpora) {
+        for (size_t segmentLength : segmentLengths) {
+            PAYLOAD_SIG_STREAM stream;
+            AtfPayloadSigResetStream(&stream);
+
+            uint64_t numOfMatches = 0;
+            uint64_t numOfScannedBytes = 0;
+
+            start = HarnessNowNs();
+            for (size_t offset = 0; offset < corpus.payload.size(); offset += segmentLength) {
+                const size_t length = std::min(segmentLength, corpus.payload.size() - offset);
+                if (AtfPayloadSigScan(ctx, &stream, &corpus.payload[offset], length) != PAYLOAD_SIG_NO_MATCH) {
+                    numOfMatches++;
+                    AtfPayloadSigResetStream(&stream);
+                } else {
+                    numOfScannedBytes += length;
+                }
+            }
+            const double elapsed = HarnessNowNs() - start;
+
+            char name[96];
+            std::snprintf(name, sizeof(name), "%s, %zu B segments (Gbit/s)", corpus.name, segmentLength);
+            HarnessReport(name, numOfScannedBytes * 8 / elapsed, "Gbit/s");
+            std::snprintf(name, sizeof(name), "%s, %zu B segments matches", corpus.name, segmentLength);
+            HarnessReport(name, (double)numOfMatches, "");
+        }
+    }
+
+    AtfPayloadSigFree(&ctx);
+}
+
+//EOF
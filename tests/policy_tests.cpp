@@ -0,0 +1,332 @@
+#include "harness.h"
+
+extern "C" {
+#include "../src/ActiveTransportFilter/policy.h"
+}
+
+#include "../src/DeviceConfigService/policy_compiler.h"
+
+//
+// Verdict policy bytecode (policy.c, policy_compiler.cpp) against the hard-coded verdicts of AtfFilterProcessIpv4 and
+//  AtfFilterProcessIpv6 it replaced
+//
+//  The lookups are stubbed: each flow carries the results its blocklist searches and rule classification would
+//   return, so only the verdict logic is compared and timed. Like the engine searches of the driver, the stubs are
+//   not inlined into either verdict. The domain set is not compiled in (dnsBlocklistAction
+//   is PASS), the hard-coded verdicts predate it
+//
+
+typedef struct _harness_policy_flow {
+    UINT8                           layer;
+    UINT8                           direction;
+
+    // Prefix lengths of the local and remote address in the IPv4 and IPv6 blocklists. On the IPv6 layer, only
+    //  the IPv4-mapped addresses have an IPv4 result
+    UINT8                           ipv4PrefixLengths[2];
+    UINT8                           ipv6PrefixLengths[2];
+    BOOLEAN                         isApproximate;
+
+    // IPv4 layer only
+    BOOLEAN                         hasRule;
+    IPV4_TSS_RULE                   rule;
+} HARNESS_POLICY_FLOW;
+
+static DECLSPEC_NOINLINE VOID HarnessPolicySearchSet(const VOID *lookupCtx, UINT32 set, UINT8 prefixLengths[2],
+    BOOLEAN *isApproximate)
+{
+    const HARNESS_POLICY_FLOW *flow = (const HARNESS_POLICY_FLOW *)lookupCtx;
+
+    const UINT8 *results = set == POLICY_SET_IPV4_BLOCKLIST ? flow->ipv4PrefixLengths :
+        set == POLICY_SET_IPV6_BLOCKLIST ? flow->ipv6PrefixLengths : NULL;
+
+    prefixLengths[0] = results ? results[0] : 0;
+    prefixLengths[1] = results ? results[1] : 0;
+    *isApproximate = set == POLICY_SET_IPV4_BLOCKLIST && flow->isApproximate;
+}
+
+static DECLSPEC_NOINLINE BOOLEAN HarnessPolicyClassify(const VOID *lookupCtx, IPV4_TSS_RULE *ruleOut)
+{
+    const HARNESS_POLICY_FLOW *flow = (const HARNESS_POLICY_FLOW *)lookupCtx;
+
+    if (flow->hasRule) {
+        *ruleOut = flow->rule;
+    }
+
+    return flow->hasRule;
+}
+
+//
+// The if-chain of AtfFilterProcessIpv4, before the policy bytecode
+//
+static ACTION_OPTS HarnessLegacyVerdictIpv4(const POLICY_OPTIONS &options, const HARNESS_POLICY_FLOW *flow)
+{
+    IPV4_TSS_RULE rule;
+    if (HarnessPolicyClassify(flow, &rule)) {
+        return (ACTION_OPTS)rule.action;
+    }
+
+    if (flow->direction == RULE_DIRECTION_INBOUND && !options.alertInbound) {
+        return ACTION_PASS;
+    }
+
+    if (flow->direction == RULE_DIRECTION_OUTBOUND && !options.alertOutbound) {
+        return ACTION_PASS;
+    }
+
+    UINT8 prefixLengths[2];
+    BOOLEAN isApproximate = FALSE;
+    HarnessPolicySearchSet(flow, POLICY_SET_IPV4_BLOCKLIST, prefixLengths, &isApproximate);
+
+    const UINT8 badPrefixLength = prefixLengths[1] ? prefixLengths[1] : prefixLengths[0];
+
+    if (options.ipv4BlocklistAction == ACTION_BLOCK && badPrefixLength && !isApproximate) {
+        return ACTION_BLOCK;
+    } else if (options.ipv4BlocklistAction != ACTION_PASS && badPrefixLength) {
+        return ACTION_ALERT;
+    }
+
+    return ACTION_PASS;
+}
+
+//
+// The if-chain of AtfFilterProcessIpv6, before the policy bytecode
+//
+static ACTION_OPTS HarnessLegacyVerdictIpv6(const POLICY_OPTIONS &options, const HARNESS_POLICY_FLOW *flow)
+{
+    if (flow->direction == RULE_DIRECTION_INBOUND && !options.alertInbound) {
+        return ACTION_PASS;
+    }
+
+    if (flow->direction == RULE_DIRECTION_OUTBOUND && !options.alertOutbound) {
+        return ACTION_PASS;
+    }
+
+    UINT8 srcPrefixLength = 0;
+    UINT8 destPrefixLength = 0;
+    BOOLEAN isApproximate = FALSE;
+
+    UINT8 prefixLengths[2];
+    HarnessPolicySearchSet(flow, POLICY_SET_IPV4_BLOCKLIST, prefixLengths, &isApproximate);
+    srcPrefixLength = prefixLengths[0];
+    destPrefixLength = prefixLengths[1];
+
+    const BOOLEAN isSrcIpv4Match = srcPrefixLength != 0;
+    const BOOLEAN isDestIpv4Match = destPrefixLength != 0;
+
+    if (!isSrcIpv4Match || !isDestIpv4Match) {
+        BOOLEAN isIpv6Approximate = FALSE;
+        HarnessPolicySearchSet(flow, POLICY_SET_IPV6_BLOCKLIST, prefixLengths, &isIpv6Approximate);
+
+        if (!isSrcIpv4Match) {
+            srcPrefixLength = prefixLengths[0];
+        }
+        if (!isDestIpv4Match) {
+            destPrefixLength = prefixLengths[1];
+        }
+    }
+
+    UINT8 badPrefixLength = 0;
+    ACTION_OPTS action = ACTION_PASS;
+    if (srcPrefixLength) {
+        badPrefixLength = srcPrefixLength;
+        action = isSrcIpv4Match ? options.ipv4BlocklistAction : options.ipv6BlocklistAction;
+    }
+    if (destPrefixLength) {
+        badPrefixLength = destPrefixLength;
+        action = isDestIpv4Match ? options.ipv4BlocklistAction : options.ipv6BlocklistAction;
+    }
+
+    if (!(destPrefixLength ? isDestIpv4Match : isSrcIpv4Match)) {
+        isApproximate = FALSE;
+    }
+
+    if (action == ACTION_BLOCK && badPrefixLength && !isApproximate) {
+        return ACTION_BLOCK;
+    } else if (action != ACTION_PASS && badPrefixLength) {
+        return ACTION_ALERT;
+    }
+
+    return ACTION_PASS;
+}
+
+//
+// Where the verdicts differ by design: on an IPv6 flow whose addresses match different blocklists, the program
+//  takes the IPv4 blocklist (tested first) and the if-chain took the one of the remote address
+//
+static bool HarnessIsMixedIpv6Match(const HARNESS_POLICY_FLOW *flow)
+{
+    if (flow->layer != POLICY_LAYER_TRANSPORT_V6) {
+        return false;
+    }
+
+    const bool isIpv4Match = flow->ipv4PrefixLengths[0] || flow->ipv4PrefixLengths[1];
+    const bool isIpv6Match = (!flow->ipv4PrefixLengths[0] && flow->ipv6PrefixLengths[0]) ||
+        (!flow->ipv4PrefixLengths[1] && flow->ipv6PrefixLengths[1]);
+
+    return isIpv4Match && isIpv6Match;
+}
+
+static std::vector<HARNESS_POLICY_FLOW> HarnessPolicyFlows(std::mt19937_64 &rng, size_t numOfFlows)
+{
+    std::vector<HARNESS_POLICY_FLOW> flows(numOfFlows);
+
+    for (HARNESS_POLICY_FLOW &flow : flows) {
+        flow.layer = rng() % 2 ? POLICY_LAYER_TRANSPORT_V6 : POLICY_LAYER_TRANSPORT_V4;
+        flow.direction = rng() % 2 ? RULE_DIRECTION_INBOUND : RULE_DIRECTION_OUTBOUND;
+
+        for (size_t i = 0; i < 2; i++) {
+            const bool isIpv4 = flow.layer == POLICY_LAYER_TRANSPORT_V4 || rng() % 2;
+
+            flow.ipv4PrefixLengths[i] = isIpv4 && rng() % 4 == 0 ? (UINT8)(8 + rng() % 25) : 0;
+            flow.ipv6PrefixLengths[i] = flow.layer == POLICY_LAYER_TRANSPORT_V6 && rng() % 4 == 0 ?
+                (UINT8)(16 + rng() % 113) : 0;
+        }
+
+        flow.isApproximate = rng() % 4 == 0;
+
+        flow.hasRule = flow.layer == POLICY_LAYER_TRANSPORT_V4 && rng() % 8 == 0;
+        flow.rule.ruleId = (UINT32)(rng() % 100);
+        flow.rule.action = (UINT8)(rng() % 3);
+    }
+
+    return flows;
+}
+
+//
+// Verified and specialized program of each layer, as AtfConfigDefaultInit() builds them
+//
+typedef struct _harness_policy_program {
+    POLICY_INSN                     insns[POLICY_NUM_OF_LAYERS][POLICY_MAX_INSNS];
+    size_t                          entry[POLICY_NUM_OF_LAYERS];
+} HARNESS_POLICY_PROGRAM;
+
+static bool HarnessCompilePolicy(const POLICY_OPTIONS &options, HARNESS_POLICY_PROGRAM &programOut)
+{
+    std::vector<POLICY_INSN> program;
+    if (PolicyCompiler::CompileFilterPolicy(options, program) || AtfPolicyVerify(program.data(), program.size())) {
+        return false;
+    }
+
+    for (UINT32 layer = 0; layer < POLICY_NUM_OF_LAYERS; layer++) {
+        programOut.entry[layer] = AtfPolicySpecialize(program.data(), program.size(), layer, programOut.insns[layer]);
+    }
+
+    return true;
+}
+
+static ACTION_OPTS HarnessRunPolicy(const HARNESS_POLICY_PROGRAM &program, const HARNESS_POLICY_FLOW *flow)
+{
+    const POLICY_ENV env = {
+        flow->layer,
+        flow->direction,
+        6,      // TCP, the compiled program does not test the protocol or ports
+        443,
+        50000,
+        HarnessPolicySearchSet,
+        flow->layer == POLICY_LAYER_TRANSPORT_V4 ? HarnessPolicyClassify : NULL,
+        flow
+    };
+
+    POLICY_VERDICT verdict;
+    AtfPolicyRun(&program.insns[flow->layer][program.entry[flow->layer]], &env, &verdict);
+
+    return verdict.action;
+}
+
+static ACTION_OPTS HarnessRunLegacy(const POLICY_OPTIONS &options, const HARNESS_POLICY_FLOW *flow)
+{
+    return flow->layer == POLICY_LAYER_TRANSPORT_V4 ? HarnessLegacyVerdictIpv4(options, flow) :
+        HarnessLegacyVerdictIpv6(options, flow);
+}
+
+//
+// Every combination of the direction switches and the IPv4 and IPv6 blocklist actions
+//
+HARNESS_TEST(policy_matches_hard_coded_verdicts)
+{
+    std::mt19937_64 rng(190);
+    const std::vector<HARNESS_POLICY_FLOW> flows = HarnessPolicyFlows(rng, 20000);
+
+    const ACTION_OPTS actions[] = { ACTION_PASS, ACTION_BLOCK, ACTION_ALERT };
+    size_t numOfPrograms = 0;
+
+    for (uint32_t combination = 0; combination < 4 * 3 * 3; combination++) {
+        POLICY_OPTIONS options;
+        options.alertInbound = (combination & 1) != 0;
+        options.alertOutbound = (combination & 2) != 0;
+        options.ipv4BlocklistAction = actions[(combination / 4) % 3];
+        options.ipv6BlocklistAction = actions[combination / 12];
+        options.dnsBlocklistAction = ACTION_PASS;
+
+        HARNESS_POLICY_PROGRAM program;
+        HARNESS_CHECK(HarnessCompilePolicy(options, program));
+
+        for (const HARNESS_POLICY_FLOW &flow : flows) {
+            if (!HarnessIsMixedIpv6Match(&flow)) {
+                HARNESS_CHECK(HarnessRunPolicy(program, &flow) == HarnessRunLegacy(options, &flow));
+            }
+        }
+
+        numOfPrograms++;
+    }
+
+    HARNESS_CHECK(numOfPrograms == 36);
+}
+
+//
+// Cost of a verdict on each layer, for the default ini switches and with every switch on
+//
+HARNESS_BENCH(policy_verdict)
+{
+    std::mt19937_64 rng(191);
+    const std::vector<HARNESS_POLICY_FLOW> flows = HarnessPolicyFlows(rng, 4096);
+    const size_t numOfRounds = HarnessScale(1000);
+
+    const struct {
+        const char                  *name;
+        POLICY_OPTIONS              options;
+    } configs[] = {
+        { "default", { true, true, ACTION_ALERT, ACTION_PASS, ACTION_PASS } },
+        { "block all", { true, true, ACTION_BLOCK, ACTION_BLOCK, ACTION_PASS } }
+    };
+
+    for (const auto &config : configs) {
+        HARNESS_POLICY_PROGRAM program;
+        HARNESS_CHECK(HarnessCompilePolicy(config.options, program));
+
+        for (UINT8 layer = 0; layer < POLICY_NUM_OF_LAYERS; layer++) {
+            std::vector<const HARNESS_POLICY_FLOW *> layerFlows;
+            for (const HARNESS_POLICY_FLOW &flow : flows) {
+                if (flow.layer == layer) {
+                    layerFlows.push_back(&flow);
+                }
+            }
+
+            const char *layerName = layer == POLICY_LAYER_TRANSPORT_V4 ? "IPv4" : "IPv6";
+            char name[96];
+            uint64_t numOfBlocked = 0;
+
+            double start = HarnessNowNs();
+            for (size_t round = 0; round < numOfRounds; round++) {
+                for (const HARNESS_POLICY_FLOW *flow : layerFlows) {
+                    numOfBlocked += HarnessRunLegacy(config.options, flow) == ACTION_BLOCK;
+                }
+            }
+            std::snprintf(name, sizeof(name), "%s %s hard-coded (ns/flow)", config.name, layerName);
+            HarnessReport(name, (HarnessNowNs() - start) / (layerFlows.size() * numOfRounds), "ns");
+
+            start = HarnessNowNs();
+            for (size_t round = 0; round < numOfRounds; round++) {
+                for (const HARNESS_POLICY_FLOW *flow : layerFlows) {
+                    numOfBlocked += HarnessRunPolicy(program, flow) == ACTION_BLOCK;
+                }
+            }
+            std::snprintf(name, sizeof(name), "%s %s policy (ns/flow)", config.name, layerName);
+            HarnessReport(name, (HarnessNowNs() - start) / (layerFlows.size() * numOfRounds), "ns");
+
+            HarnessKeep(numOfBlocked);
+        }
+    }
+}
+
+//EOF
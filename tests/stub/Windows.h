@@ -0,0 +1,25 @@
+#pragma once
+
+//
+// User-mode stand-in for the parts of Windows.h used by the service builders: the base types come from the kernel
+//  stand-ins (see ntddk.h)
+//
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+#include "ntddk.h"
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#include <time.h>
+
+static inline int localtime_s(struct tm *result, const time_t *timer)
+{
+    return localtime_r(timer, result) ? 0 : 1;
+}
+
+//EOF
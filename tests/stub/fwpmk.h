@@ -0,0 +1,24 @@
+#pragma once
+
+#include <ntddk.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Layer GUIDs referenced by the config, defined in kernel_stub.c
+//
+extern const GUID FWPM_LAYER_INBOUND_TRANSPORT_V4;
+extern const GUID FWPM_LAYER_OUTBOUND_TRANSPORT_V4;
+extern const GUID FWPM_LAYER_INBOUND_TRANSPORT_V6;
+extern const GUID FWPM_LAYER_OUTBOUND_TRANSPORT_V6;
+extern const GUID FWPM_LAYER_DATAGRAM_DATA_V4;
+extern const GUID FWPM_LAYER_DATAGRAM_DATA_V6;
+extern const GUID FWPM_LAYER_STREAM_V4;
+extern const GUID FWPM_LAYER_STREAM_V6;
+extern const GUID FWPM_CONDITION_ORIGINAL_ICMP_TYPE;
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,5 @@
+#pragma once
+
+#include <ntddk.h>
+
+#define IsEqualGUID(a, b)                   (!memcmp((a), (b), sizeof(GUID)))
@@ -0,0 +1,8 @@
+#pragma once
+
+struct in6_addr {
+    union {
+        unsigned char Byte[16];
+        unsigned short Word[8];
+    } u;
+};
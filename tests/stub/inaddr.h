@@ -0,0 +1,10 @@
+#pragma once
+
+struct in_addr {
+    union {
+        struct {
+            unsigned char s_b1, s_b2, s_b3, s_b4;
+        } S_un_b;
+        unsigned int S_addr;
+    } S_un;
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+//
+// User-mode stand-in for the MSVC intrinsics used by the service
+//
+
+#include <stdint.h>
+
+static inline uint64_t __popcnt64(uint64_t value)
+{
+    return (uint64_t)__builtin_popcountll(value);
+}
+
+//EOF
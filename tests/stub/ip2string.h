@@ -0,0 +1,5 @@
+#pragma once
+
+#include <ntddk.h>
+#include <inaddr.h>
+#include <in6addr.h>
@@ -0,0 +1,54 @@
+#include <ntddk.h>
+#include <fwpmk.h>
+
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t gStubInterruptTime = 0;
+uint64_t gStubPoolAllocations = 0;
+
+const GUID FWPM_LAYER_INBOUND_TRANSPORT_V4      = { 0x5926dfc8, 0xe3cf, 0x4426, { 0xa2, 0x83, 0xdc, 0x39, 0x3f, 0x5d, 0x0f, 0x9d } };
+const GUID FWPM_LAYER_OUTBOUND_TRANSPORT_V4     = { 0x09e61aea, 0xd214, 0x46e2, { 0x9b, 0x21, 0xb2, 0x6b, 0x0b, 0x2f, 0x28, 0xc8 } };
+const GUID FWPM_LAYER_INBOUND_TRANSPORT_V6      = { 0x634a869f, 0xfc23, 0x4b90, { 0xb0, 0xc1, 0xbf, 0x62, 0x0a, 0x36, 0xae, 0x6f } };
+const GUID FWPM_LAYER_OUTBOUND_TRANSPORT_V6     = { 0xe1735bde, 0x013f, 0x4655, { 0xb3, 0x51, 0xa4, 0x9e, 0x15, 0x76, 0x2d, 0xf0 } };
+const GUID FWPM_LAYER_DATAGRAM_DATA_V4          = { 0x3d08bf4e, 0x45f6, 0x4930, { 0xa9, 0x22, 0x41, 0x70, 0x98, 0xe2, 0x00, 0x27 } };
+const GUID FWPM_LAYER_DATAGRAM_DATA_V6          = { 0xfa45fe2f, 0x3cba, 0x4427, { 0x87, 0xfc, 0x57, 0xb9, 0xa4, 0xb1, 0x0d, 0x00 } };
+const GUID FWPM_LAYER_STREAM_V4                 = { 0x3b89653c, 0xc170, 0x49e4, { 0xb1, 0xcd, 0xe0, 0xee, 0xee, 0xe1, 0x9a, 0x3e } };
+const GUID FWPM_LAYER_STREAM_V6                 = { 0x47c9137a, 0x7ec4, 0x46b3, { 0xb6, 0xe4, 0x48, 0xe9, 0x26, 0xb1, 0xed, 0xa4 } };
+const GUID FWPM_CONDITION_ORIGINAL_ICMP_TYPE    = { 0x076dfdbe, 0xc56c, 0x4f72, { 0xae, 0x8a, 0x2c, 0xfe, 0x7e, 0x5c, 0x82, 0x86 } };
+
+LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *frequency)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    if (frequency) {
+        frequency->QuadPart = 1000000000LL;
+    }
+
+    LARGE_INTEGER counter;
+    counter.QuadPart = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    return counter;
+}
+
+ULONG KeGetCurrentProcessorIndex(void)
+{
+    const int cpu = sched_getcpu();
+
+    return cpu < 0 ? 0 : (ULONG)cpu;
+}
+
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE mode, BOOLEAN alertable, LARGE_INTEGER *interval)
+{
+    (void)mode;
+    (void)alertable;
+
+    // Relative intervals are negative, in 100ns units
+    const int64_t ns = (interval->QuadPart < 0 ? -interval->QuadPart : interval->QuadPart) * 100;
+    const struct timespec ts = { (time_t)(ns / 1000000000LL), (long)(ns % 1000000000LL) };
+    nanosleep(&ts, NULL);
+
+    return STATUS_SUCCESS;
+}
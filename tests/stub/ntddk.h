@@ -0,0 +1,186 @@
+#pragma once
+
+//
+// User-mode stand-ins for the kernel primitives used by the driver modules under test
+//  Pool allocations map to calloc/free, interlocked operations to the GCC atomics and waits to short sleeps, so the
+//  lookup engines, images, parsers and the epoch can be built and run as ordinary user-mode code
+//
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t UINT8, BYTE, UCHAR, BOOLEAN, *PUCHAR;
+typedef uint16_t UINT16, USHORT, WORD;
+typedef uint32_t UINT32, ULONG, DWORD, UINT;
+typedef int32_t INT32, LONG, NTSTATUS;
+typedef int16_t INT16, SHORT;
+typedef int8_t INT8;
+typedef uint64_t UINT64, ULONG64, ULONGLONG;
+typedef int64_t INT64, LONGLONG;
+typedef char CHAR, *PCHAR;
+typedef wchar_t WCHAR;
+typedef void VOID, *PVOID, *HANDLE;
+typedef int BOOL;
+typedef size_t SIZE_T, ULONG_PTR;
+
+#define TRUE                                1
+#define FALSE                               0
+
+#define NTAPI
+#define __forceinline                       inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x)                   __attribute__((aligned(x)))
+#define DECLSPEC_NOINLINE                   __attribute__((noinline))
+
+#ifdef __cplusplus
+#define C_ASSERT(e)                         static_assert(e, #e)
+#else
+#define C_ASSERT(e)                         _Static_assert(e, #e)
+#endif
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(x)
+#define _In_reads_bytes_(x)
+#define _Out_writes_(x)
+#define _Out_writes_bytes_(x)
+#define UNREFERENCED_PARAMETER(x)           ((void)(x))
+
+#define _UI8_MAX                            0xffU
+#define _UI16_MAX                           0xffffU
+#define _UI32_MAX                           0xffffffffU
+#define _UI64_MAX                           0xffffffffffffffffULL
+#define MAXUINT16                           0xffff
+#define MAXUINT32                           0xffffffffU
+#define MAXSIZE_T                           ((size_t)~(size_t)0)
+#define ARRAYSIZE(a)                        (sizeof(a) / sizeof((a)[0]))
+
+#ifndef __cplusplus
+#define min(a, b)                           ((a) < (b) ? (a) : (b))
+#define max(a, b)                           ((a) > (b) ? (a) : (b))
+#endif
+
+#define NT_SUCCESS(s)                       (((NTSTATUS)(s)) >= 0)
+#define STATUS_SUCCESS                      ((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL                 ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER            ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES       ((NTSTATUS)0xC000009AL)
+
+#define RtlCopyMemory                       memcpy
+#define RtlMoveMemory                       memmove
+#define RtlZeroMemory(p, n)                 memset((p), 0, (n))
+#define RtlFillMemory(p, n, c)              memset((p), (c), (n))
+#define RtlUlonglongByteSwap(x)             __builtin_bswap64(x)
+
+typedef union _LARGE_INTEGER {
+    struct {
+        uint32_t LowPart;
+        int32_t HighPart;
+    };
+    int64_t QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _GUID {
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+} GUID;
+
+//
+// Tracing, the arguments are never evaluated
+//
+#define KdPrint(x)
+#define DbgPrintEx(...)
+#define DbgBreakPoint()
+
+//
+// Intrinsics
+//
+#define PF_TEMPORAL_LEVEL_1                 3
+#define PreFetchCacheLine(level, p)         __builtin_prefetch((p), 0, (level))
+
+static inline unsigned char _BitScanForward(unsigned long *index, unsigned long mask)
+{
+    if (!mask) {
+        return 0;
+    }
+
+    *index = (unsigned long)__builtin_ctzl(mask);
+    return 1;
+}
+
+static inline unsigned char _BitScanForward64(unsigned long *index, unsigned long long mask)
+{
+    if (!mask) {
+        return 0;
+    }
+
+    *index = (unsigned long)__builtin_ctzll(mask);
+    return 1;
+}
+
+//
+// Pool
+//
+typedef enum { NonPagedPool, PagedPool } POOL_TYPE;
+
+// Number of pool allocations made so far, read by the tests (see kernel_stub.c)
+extern uint64_t gStubPoolAllocations;
+
+static inline void *ExAllocatePoolWithTag(POOL_TYPE type, size_t size, ULONG tag)
+{
+    (void)type;
+    (void)tag;
+    __atomic_add_fetch(&gStubPoolAllocations, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static inline void ExFreePoolWithTag(void *p, ULONG tag)
+{
+    (void)tag;
+    free(p);
+}
+
+//
+// Interlocked operations and barriers
+//
+#define InterlockedIncrement(p)             __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)             __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, x)           __atomic_exchange_n((p), (x), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#define InterlockedExchangePointer(p, x)    __atomic_exchange_n((p), (x), __ATOMIC_SEQ_CST)
+#define KeMemoryBarrier()                   __sync_synchronize()
+
+//
+// Time and processors. The interrupt time is set by the tests (see kernel_stub.c)
+//
+extern uint64_t gStubInterruptTime;
+
+static inline uint64_t KeQueryInterruptTime(void)
+{
+    return gStubInterruptTime;
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *frequency);
+
+ULONG KeGetCurrentProcessorIndex(void);
+
+typedef enum { KernelMode, UserMode } KPROCESSOR_MODE;
+
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE mode, BOOLEAN alertable, LARGE_INTEGER *interval);
+
+#ifdef __cplusplus
+}
+#endif